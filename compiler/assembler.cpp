@@ -28,6 +28,8 @@
 #include <stdlib.h> /* for macro max() */
 #include <string.h>
 #include <algorithm>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include "amxdbg.h"
 #include "errors.h"
@@ -47,8 +49,13 @@
 #include "memfile.h"
 #include "sctracker.h"
 #include "shared/byte-buffer.h"
+#include "shared/lz4-block.h"
+#include "shared/zlib-chunks.h"
+#include "smx-file-writer.h"
 #include "sp_symhash.h"
+#include "stack-usage.h"
 #include "types.h"
+#include "vm/md5/md5.h"
 
 using namespace sp;
 using namespace ke;
@@ -72,6 +79,16 @@ struct BackpatchEntry {
 
 static std::vector<cell> sLabelTable;
 static std::vector<BackpatchEntry> sBackpatchList;
+static uint32_t sCodeFeatures; /* SmxConsts::kCodeFeature* bits the code uses */
+static size_t sTypeDataEncoded;
+static size_t sTypeDataStored;
+
+void
+type_data_stats(size_t* encoded, size_t* stored)
+{
+    *encoded = sTypeDataEncoded;
+    *stored = sTypeDataStored;
+}
 
 class CellWriter
 {
@@ -373,6 +390,13 @@ parm5(CellWriter* writer, AsmReader* reader, cell opcode)
     writer->push_back(p5);
 }
 
+static void
+do_fused_index(CellWriter* writer, AsmReader* reader, cell opcode)
+{
+    sCodeFeatures |= SmxConsts::kCodeFeatureFusedIndex;
+    parm3(writer, reader, opcode);
+}
+
 static void
 do_dump(CellWriter* writer, AsmReader* reader, cell opcode)
 {
@@ -507,6 +531,7 @@ static OPCODEC opcodelist[] = {
   { 45, "heap",       sIN_CSEG, parm1 },
   { 27, "idxaddr",    sIN_CSEG, parm0 },
   { 28, "idxaddr.b",  sIN_CSEG, parm1 },
+  {170, "idxaddr.s.bounds", sIN_CSEG, do_fused_index },
   {109, "inc",        sIN_CSEG, parm1 },
   {108, "inc.alt",    sIN_CSEG, parm0 },
   {111, "inc.i",      sIN_CSEG, parm0 },
@@ -525,6 +550,7 @@ static OPCODEC opcodelist[] = {
   {167, "ldgfn.pri",  sIN_CSEG, do_ldgfen },
   { 25, "lidx",       sIN_CSEG, parm0 },
   { 26, "lidx.b",     sIN_CSEG, parm1 },
+  {169, "lidx.s.bounds", sIN_CSEG, do_fused_index },
   {  2, "load.alt",   sIN_CSEG, parm1 },
   {154, "load.both",  sIN_CSEG, parm2 },  /* version 9 */
   {  9, "load.i",     sIN_CSEG, parm0 },
@@ -780,14 +806,19 @@ struct variable_type_t {
     const int* dims;
     int dimcount;
     bool is_const;
+    bool is_flat;
 };
 
 class RttiBuilder
 {
   public:
-    explicit RttiBuilder(SmxNameTable* names);
+    // Debug variable and file names go in |debug_names|, which is |names|
+    // unless the debug sections are split out.
+    RttiBuilder(SmxNameTable* names, SmxNameTable* debug_names);
 
-    void finish(SmxBuilder& builder);
+    // With a |debug_builder|, the debug sections and their names are added
+    // to it instead of |builder|.
+    void finish(SmxBuilder& builder, SmxBuilder* debug_builder);
     void add_method(symbol* sym);
     void add_native(symbol* sym);
 
@@ -807,14 +838,24 @@ class RttiBuilder
     void encode_struct_into(std::vector<uint8_t>& bytes, Type* type);
     void encode_enumstruct_into(std::vector<uint8_t>& bytes, Type* type);
 
-    uint32_t to_typeid(const std::vector<uint8_t>& bytes);
+    // Both take the encoding from |start| to the end of encoding_, and drop
+    // it from the buffer.
+    uint32_t to_typeid(size_t start);
+    uint32_t add_encoding(size_t start);
 
     void add_debug_var(SmxRttiTable<smx_rtti_debug_var>* table, DebugString& str);
     void build_debuginfo();
 
   private:
     RefPtr<SmxNameTable> names_;
+    RefPtr<SmxNameTable> debug_names_;
     DataPool type_pool_;
+
+    // Encodings are built at the end of this one buffer. Encoding a type can
+    // add the types it refers to (struct fields, say), which are encoded
+    // after it and truncated away before it continues, so nothing is
+    // allocated per symbol once the buffer has grown.
+    std::vector<uint8_t> encoding_;
     RefPtr<SmxBlobSection<void>> data_;
     RefPtr<SmxRttiTable<smx_rtti_method>> methods_;
     RefPtr<SmxRttiTable<smx_rtti_native>> natives_;
@@ -827,6 +868,7 @@ class RttiBuilder
     RefPtr<SmxRttiTable<smx_rtti_es_field>> es_fields_;
     RefPtr<SmxDebugInfoSection> dbg_info_;
     RefPtr<SmxDebugLineSection> dbg_lines_;
+    RefPtr<SmxLineTableSection> dbg_linetable_;
     RefPtr<SmxDebugFileSection> dbg_files_;
     RefPtr<SmxRttiTable<smx_rtti_debug_method>> dbg_methods_;
     RefPtr<SmxRttiTable<smx_rtti_debug_var>> dbg_globals_;
@@ -836,8 +878,9 @@ class RttiBuilder
     TypeIdCache typeid_cache_;
 };
 
-RttiBuilder::RttiBuilder(SmxNameTable* names)
- : names_(names)
+RttiBuilder::RttiBuilder(SmxNameTable* names, SmxNameTable* debug_names)
+ : names_(names),
+   debug_names_(debug_names)
 {
     typeid_cache_.init(128);
     data_ = new SmxBlobSection<void>("rtti.data");
@@ -852,6 +895,7 @@ RttiBuilder::RttiBuilder(SmxNameTable* names)
     es_fields_ = new SmxRttiTable<smx_rtti_es_field>("rtti.enumstruct_fields");
     dbg_info_ = new SmxDebugInfoSection(".dbg.info");
     dbg_lines_ = new SmxDebugLineSection(".dbg.lines");
+    dbg_linetable_ = new SmxLineTableSection(".dbg.linetable");
     dbg_files_ = new SmxDebugFileSection(".dbg.files");
     dbg_methods_ = new SmxRttiTable<smx_rtti_debug_method>(".dbg.methods");
     dbg_globals_ = new SmxRttiTable<smx_rtti_debug_var>(".dbg.globals");
@@ -859,12 +903,14 @@ RttiBuilder::RttiBuilder(SmxNameTable* names)
 }
 
 void
-RttiBuilder::finish(SmxBuilder& builder)
+RttiBuilder::finish(SmxBuilder& builder, SmxBuilder* debug_builder)
 {
     build_debuginfo();
 
     const ByteBuffer& buffer = type_pool_.buffer();
     data_->add(buffer.bytes(), buffer.size());
+    sTypeDataEncoded = type_pool_.bytes_added();
+    sTypeDataStored = type_pool_.bytes_stored();
 
     builder.add(data_);
     builder.add(methods_);
@@ -876,12 +922,17 @@ RttiBuilder::finish(SmxBuilder& builder)
     builder.addIfNotEmpty(fields_);
     builder.addIfNotEmpty(enumstructs_);
     builder.addIfNotEmpty(es_fields_);
-    builder.add(dbg_files_);
-    builder.add(dbg_lines_);
-    builder.add(dbg_info_);
-    builder.add(dbg_methods_);
-    builder.add(dbg_globals_);
-    builder.add(dbg_locals_);
+
+    SmxBuilder& debug = debug_builder ? *debug_builder : builder;
+    if (debug_builder)
+        debug.add(debug_names_);
+    debug.add(dbg_files_);
+    debug.add(dbg_lines_);
+    debug.addIfNotEmpty(dbg_linetable_);
+    debug.add(dbg_info_);
+    debug.add(dbg_methods_);
+    debug.add(dbg_globals_);
+    debug.add(dbg_locals_);
 }
 
 void
@@ -907,7 +958,7 @@ RttiBuilder::build_debuginfo()
                     if (prev_file_name) {
                         sp_fdbg_file_t& entry = dbg_files_->add();
                         entry.addr = prev_file_addr;
-                        entry.name = names_->add(gAtoms, prev_file_name);
+                        entry.name = debug_names_->add(gAtoms, prev_file_name);
                     }
                     prev_file_addr = codeidx;
                 }
@@ -916,9 +967,18 @@ RttiBuilder::build_debuginfo()
             }
 
             case 'L': {
-                sp_fdbg_line_t& entry = dbg_lines_->add();
-                entry.addr = str.parse();
-                entry.line = str.parse();
+                ucell addr = str.parse();
+                ucell line = str.parse();
+
+                // Compact lines leave .dbg.lines empty, so older VMs still
+                // load the plugin, just without line numbers.
+                if (sc_compact_lines) {
+                    dbg_linetable_->add(addr, line);
+                } else {
+                    sp_fdbg_line_t& entry = dbg_lines_->add();
+                    entry.addr = addr;
+                    entry.line = line;
+                }
                 break;
             }
 
@@ -932,7 +992,7 @@ RttiBuilder::build_debuginfo()
     if (prev_file_name) {
         sp_fdbg_file_t& entry = dbg_files_->add();
         entry.addr = prev_file_addr;
-        entry.name = names_->add(gAtoms, prev_file_name);
+        entry.name = debug_names_->add(gAtoms, prev_file_name);
     }
 
     // Finish up debug header statistics.
@@ -955,7 +1015,9 @@ RttiBuilder::add_debug_var(SmxRttiTable<smx_rtti_debug_var>* table, DebugString&
     uint32_t code_end = str.parse();
     int ident = str.parse();
     int vclass = str.parse();
-    bool is_const = !!str.parse();
+    int flags = str.parse();
+    bool is_const = !!(flags & 1);
+    bool is_flat = !!(flags & 2);
 
     // We don't care about the ident type, we derive it from the tag.
     (void)ident;
@@ -984,11 +1046,11 @@ RttiBuilder::add_debug_var(SmxRttiTable<smx_rtti_debug_var>* table, DebugString&
     // Encode the type.
     uint32_t type_id;
     {
-        variable_type_t type = {tag, dims, dimcount, is_const};
-        std::vector<uint8_t> encoding;
-        encode_var_type(encoding, type);
+        variable_type_t type = {tag, dims, dimcount, is_const, is_flat};
+        size_t start = encoding_.size();
+        encode_var_type(encoding_, type);
 
-        type_id = to_typeid(encoding);
+        type_id = to_typeid(start);
     }
 
     smx_rtti_debug_var& var = table->add();
@@ -1007,7 +1069,7 @@ RttiBuilder::add_debug_var(SmxRttiTable<smx_rtti_debug_var>* table, DebugString&
             var.vclass = 0;
             assert(false);
     }
-    var.name = names_->add(gAtoms.add(name_start, name_end - name_start));
+    var.name = debug_names_->add(gAtoms.add(name_start, name_end - name_start));
     var.code_start = code_start;
     var.code_end = code_end;
     var.type_id = type_id;
@@ -1089,13 +1151,13 @@ RttiBuilder::add_enumstruct(Type* type)
         if (field->dim.array.length)
             dims[dimcount++] = field->dim.array.length;
 
-        variable_type_t type = {field->x.tags.index, dims, dimcount, false};
-        std::vector<uint8_t> encoding;
-        encode_var_type(encoding, type);
+        variable_type_t type = {field->x.tags.index, dims, dimcount, false, false};
+        size_t start = encoding_.size();
+        encode_var_type(encoding_, type);
 
         smx_rtti_es_field info;
         info.name = names_->add(gAtoms, iter->name);
-        info.type_id = to_typeid(encoding);
+        info.type_id = to_typeid(start);
         info.offset = field->addr();
         es_fields_->at(es.first_field + index) = info;
     }
@@ -1132,38 +1194,49 @@ RttiBuilder::add_struct(Type* type)
         int dims[1] = {0};
         int dimcount = arg->ident == iREFARRAY ? 1 : 0;
 
-        variable_type_t type = {arg->tag, dims, dimcount, !!arg->fconst};
-        std::vector<uint8_t> encoding;
-        encode_var_type(encoding, type);
+        variable_type_t type = {arg->tag, dims, dimcount, !!arg->fconst, false};
+        size_t start = encoding_.size();
+        encode_var_type(encoding_, type);
 
         smx_rtti_field field;
         field.flags = 0;
         field.name = names_->add(arg->name);
-        field.type_id = to_typeid(encoding);
+        field.type_id = to_typeid(start);
         fields_->at(classdef.first_field + i) = field;
     }
     return struct_index;
 }
 
 uint32_t
-RttiBuilder::to_typeid(const std::vector<uint8_t>& bytes)
+RttiBuilder::to_typeid(size_t start)
 {
-    if (bytes.size() <= 4) {
+    size_t length = encoding_.size() - start;
+    if (length <= 4) {
         uint32_t payload = 0;
-        for (size_t i = 0; i < bytes.size(); i++)
-            payload |= bytes[i] << (i * 8);
-        if (payload <= kMaxTypeIdPayload)
+        for (size_t i = 0; i < length; i++)
+            payload |= encoding_[start + i] << (i * 8);
+        if (payload <= kMaxTypeIdPayload) {
+            encoding_.resize(start);
             return MakeTypeId(payload, kTypeId_Inline);
+        }
     }
 
-    uint32_t offset = type_pool_.add(bytes);
-    return MakeTypeId(offset, kTypeId_Complex);
+    return MakeTypeId(add_encoding(start), kTypeId_Complex);
+}
+
+uint32_t
+RttiBuilder::add_encoding(size_t start)
+{
+    uint32_t offset = type_pool_.add(encoding_.data() + start, encoding_.size() - start);
+    encoding_.resize(start);
+    return offset;
 }
 
 uint32_t
 RttiBuilder::encode_signature(symbol* sym)
 {
-    std::vector<uint8_t> bytes;
+    size_t start = encoding_.size();
+    std::vector<uint8_t>& bytes = encoding_;
 
     uint32_t argc = 0;
     bool is_variadic = false;
@@ -1202,11 +1275,11 @@ RttiBuilder::encode_signature(symbol* sym)
 
         if (arg->ident == iREFERENCE)
             bytes.push_back(cb::kByRef);
-        variable_type_t info = {tag, arg->dim, numdim, arg->is_const};
+        variable_type_t info = {tag, arg->dim, numdim, arg->is_const, false};
         encode_var_type(bytes, info);
     }
 
-    return type_pool_.add(bytes);
+    return add_encoding(start);
 }
 
 uint32_t
@@ -1238,9 +1311,9 @@ RttiBuilder::add_funcenum(Type* type, funcenum_t* fe)
     typeid_cache_.add(p, type, index);
     typedefs_->add();
 
-    std::vector<uint8_t> bytes;
-    encode_signature_into(bytes, fe->entries.back());
-    uint32_t signature = type_pool_.add(bytes);
+    size_t start = encoding_.size();
+    encode_signature_into(encoding_, fe->entries.back());
+    uint32_t signature = add_encoding(start);
 
     smx_rtti_typedef& def = typedefs_->at(index);
     def.name = names_->add(gAtoms, type->name());
@@ -1262,14 +1335,15 @@ RttiBuilder::add_typeset(Type* type, funcenum_t* fe)
 
     uint32_t typecount = (uint32_t)fe->entries.size();
 
-    std::vector<uint8_t> bytes;
-    CompactEncodeUint32(bytes, typecount);
+    size_t start = encoding_.size();
+    CompactEncodeUint32(encoding_, typecount);
     for (const auto& iter : fe->entries)
-        encode_signature_into(bytes, iter);
+        encode_signature_into(encoding_, iter);
+    uint32_t signature = add_encoding(start);
 
     smx_rtti_typeset& entry = typesets_->at(index);
     entry.name = names_->add(gAtoms, type->name());
-    entry.signature = type_pool_.add(bytes);
+    entry.signature = signature;
     return index;
 }
 
@@ -1383,7 +1457,7 @@ RttiBuilder::encode_signature_into(std::vector<uint8_t>& bytes, functag_t* ft)
         if (arg.ident == iREFERENCE)
             bytes.push_back(cb::kByRef);
 
-        variable_type_t info = {arg.tag, arg.dims, arg.dimcount, !!arg.fconst};
+        variable_type_t info = {arg.tag, arg.dims, arg.dimcount, !!arg.fconst, false};
         encode_var_type(bytes, info);
     }
 }
@@ -1391,6 +1465,8 @@ RttiBuilder::encode_signature_into(std::vector<uint8_t>& bytes, functag_t* ft)
 void
 RttiBuilder::encode_var_type(std::vector<uint8_t>& bytes, const variable_type_t& info)
 {
+    if (info.is_flat && info.dimcount > 1)
+        bytes.push_back(cb::kFlatArray);
     for (int i = 0; i < info.dimcount; i++) {
         if (info.dims[i] == 0) {
             bytes.push_back(cb::kArray);
@@ -1416,18 +1492,147 @@ typedef SmxListSection<sp_file_pubvars_t> SmxPubvarSection;
 typedef SmxBlobSection<sp_file_data_t> SmxDataSection;
 typedef SmxBlobSection<sp_file_code_t> SmxCodeSection;
 
+// Both files of a --split-debug build get a .dbg.link with this id, so the
+// VM can tell a debug file was written along with the binary. Lines can
+// move without the code changing, so the debug sections are hashed too.
 static void
-assemble_to_buffer(SmxByteBuffer* buffer, memfile_t* fin)
+add_debug_links(SmxBuilder& builder, SmxBuilder& debug_builder, const std::vector<cell>& code)
 {
-    SmxBuilder builder;
+    MD5 md5;
+    md5.update((const unsigned char*)code.data(), (unsigned int)(code.size() * sizeof(cell)));
+    for (const auto& section : debug_builder.sections()) {
+        SmxByteBuffer bytes;
+        section->write(&bytes);
+        md5.update(bytes.bytes(), (unsigned int)bytes.size());
+    }
+    md5.finalize();
+
+    sp_fdbg_link_t link;
+    md5.raw_digest(link.build_id);
+
+    std::string debug_name = sc_split_debug;
+    size_t sep = debug_name.find_last_of("/\\");
+    if (sep != std::string::npos)
+        debug_name = debug_name.substr(sep + 1);
+
+    RefPtr<SmxBlobSection<void>> main_link = new SmxBlobSection<void>(".dbg.link");
+    main_link->add(&link, sizeof(link));
+    main_link->add(debug_name.c_str(), debug_name.size() + 1);
+    builder.add(main_link);
+
+    RefPtr<SmxBlobSection<void>> debug_link = new SmxBlobSection<void>(".dbg.link");
+    debug_link->add(&link, sizeof(link));
+    debug_link->add("", 1);
+    debug_builder.add(debug_link);
+}
+
+// A native manifest is a text file. The first line that isn't blank or a
+// "#" comment is "natives <id>", and each one after it names a native; a
+// native's ordinal is the line it is on, counting from zero.
+static bool
+read_native_manifest(const char* path, uint32_t* id,
+                     std::unordered_map<std::string, uint32_t>* ordinals)
+{
+    FILE* fp = fopen(path, "rt");
+    if (!fp)
+        return false;
+
+    bool have_id = false;
+    uint32_t next = 0;
+    char line[sNAMEMAX + 64];
+    while (fgets(line, sizeof(line), fp)) {
+        char* start = line;
+        while (isspace((unsigned char)*start))
+            start++;
+        char* end = start + strlen(start);
+        while (end > start && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (!have_id) {
+            char* rest;
+            if (strncmp(start, "natives ", 8) != 0)
+                break;
+            *id = (uint32_t)strtoul(start + 8, &rest, 0);
+            if (*rest != '\0')
+                break;
+            have_id = true;
+            continue;
+        }
+        ordinals->emplace(start, next++);
+    }
+    fclose(fp);
+    return have_id;
+}
+
+static void
+add_native_ordinals(SmxBuilder& builder, const std::vector<symbol*>& natives)
+{
+    uint32_t id = 0;
+    std::unordered_map<std::string, uint32_t> ordinals;
+    if (!read_native_manifest(sc_native_manifest.c_str(), &id, &ordinals))
+        error(FATAL_ERROR_READ, sc_native_manifest.c_str());
+
+    sp_file_native_ordinals_t header;
+    header.manifest = id;
+
+    RefPtr<SmxBlobSection<void>> section = new SmxBlobSection<void>(".natives.ordinals");
+    section->add(&header, sizeof(header));
+    for (symbol* sym : natives) {
+        // Aliased natives are bound by their alias, which the manifest can't
+        // know about.
+        char alias[sNAMEMAX + 1];
+        uint32_t ordinal = NATIVE_NO_ORDINAL;
+        if (!lookup_alias(alias, sym->name())) {
+            auto iter = ordinals.find(sym->name());
+            if (iter != ordinals.end())
+                ordinal = iter->second;
+        }
+        section->add(&ordinal, sizeof(ordinal));
+    }
+    builder.add(section);
+}
+
+// For --auto-stack, replaces the #pragma dynamic size with what the code can
+// actually use. The slack covers the VM's own margin between the heap and the
+// stack, and scratch space natives take from the heap.
+static void
+size_stack(const std::vector<cell>& code, const std::vector<function_entry>& functions)
+{
+    static const cell kSlackCells = 128;
+
+    std::vector<symbol*> syms;
+    for (const auto& entry : functions)
+        syms.push_back(entry.sym);
+
+    StackUsage usage = EstimateStackUsage(code, syms);
+    if (!usage.known) {
+        pc_printf("Stack/heap usage:  unknown (%s), keeping %ld bytes\n", usage.reason.c_str(),
+                  (long)pc_stksize * sizeof(cell));
+        return;
+    }
+
+    pc_stksize = std::max(usage.cells + kSlackCells, cell(sDEF_AMXSTACK));
+    pc_printf("Stack/heap usage:  %8ld bytes (estimated), reserving %ld bytes\n",
+              (long)usage.cells * sizeof(cell), (long)pc_stksize * sizeof(cell));
+}
+
+static void
+build_smx(SmxBuilder& builder, SmxBuilder* debug_builder, memfile_t* fin)
+{
+    builder.setPageAligned(sc_page_aligned);
     RefPtr<SmxNativeSection> natives = new SmxNativeSection(".natives");
     RefPtr<SmxPublicSection> publics = new SmxPublicSection(".publics");
     RefPtr<SmxPubvarSection> pubvars = new SmxPubvarSection(".pubvars");
     RefPtr<SmxDataSection> data = new SmxDataSection(".data");
     RefPtr<SmxCodeSection> code = new SmxCodeSection(".code");
     RefPtr<SmxNameTable> names = new SmxNameTable(".names");
+    RefPtr<SmxNameTable> debug_names = names;
+    if (debug_builder)
+        debug_names = new SmxNameTable(".dbg.strings");
 
-    RttiBuilder rtti(names);
+    RttiBuilder rtti(names, debug_names);
 
     std::vector<function_entry> functions;
 
@@ -1509,8 +1714,12 @@ assemble_to_buffer(SmxByteBuffer* buffer, memfile_t* fin)
     // Generate buffers.
     AsmReader reader(fin);
     std::vector<cell> code_buffer, data_buffer;
+    sCodeFeatures = 0;
     generate_segment(reader, &code_buffer, &data_buffer);
 
+    if (sc_auto_stack)
+        size_stack(code_buffer, functions);
+
     // Populate the native table.
     for (size_t i = 0; i < reader.native_list().size(); i++) {
         symbol* sym = reader.native_list()[i];
@@ -1535,7 +1744,8 @@ assemble_to_buffer(SmxByteBuffer* buffer, memfile_t* fin)
     code->header().flags = CODEFLAG_DEBUG;
     code->header().main = 0;
     code->header().code = sizeof(sp_file_code_t);
-    code->header().features = 0;
+    assert(!sCodeFeatures || code->header().codeversion >= SmxConsts::CODE_VERSION_FEATURE_MASK);
+    code->header().features = sCodeFeatures;
     code->setBlob((uint8_t*)code_buffer.data(), code_buffer.size() * sizeof(cell));
 
     // Set up the data section. Note pre-SourceMod 1.7, the |memsize| was
@@ -1555,9 +1765,23 @@ assemble_to_buffer(SmxByteBuffer* buffer, memfile_t* fin)
     builder.add(pubvars);
     builder.add(natives);
     builder.add(names);
-    rtti.finish(builder);
-
-    builder.write(buffer);
+    rtti.finish(builder, debug_builder);
+
+    // Index the tables by name. Older loaders ignore this section.
+    RefPtr<SmxNameHashSection> name_hash = new SmxNameHashSection(".names.hash", names);
+    for (size_t i = 0; i < natives->count(); i++)
+        name_hash->add(SmxNameHashSection::Natives, natives->at(i).name);
+    for (size_t i = 0; i < publics->count(); i++)
+        name_hash->add(SmxNameHashSection::Publics, publics->at(i).name);
+    for (size_t i = 0; i < pubvars->count(); i++)
+        name_hash->add(SmxNameHashSection::Pubvars, pubvars->at(i).name);
+    builder.addIfNotEmpty(name_hash);
+
+    if (!sc_native_manifest.empty())
+        add_native_ordinals(builder, reader.native_list());
+
+    if (debug_builder)
+        add_debug_links(builder, *debug_builder, code_buffer);
 }
 
 static void
@@ -1577,41 +1801,101 @@ splat_to_binary(const char* binfname, const void* bytes, size_t size)
     fclose(fp);
 }
 
+// Streams the image to |binfname|, deflating it on the way if
+// |compression_level| is set. The builder has every section's size by now,
+// so nothing is held in memory but the sections themselves.
+static bool
+stream_to_binary(const char* binfname, SmxBuilder& builder, int compression_level)
+{
+    FILE* fp = fopen(binfname, "wb");
+    if (!fp)
+        return false;
+
+    bool ok;
+    {
+        SmxFileWriter writer(fp, compression_level);
+        if (writer.zlib_error() != Z_OK) {
+            pc_printf("Unable to compress, error %d\n", writer.zlib_error());
+            pc_printf("Falling back to no compression.\n");
+        }
+        ok = builder.write(&writer) && writer.finish();
+    }
+    if (fclose(fp) != 0)
+        ok = false;
+    return ok;
+}
+
 void
 assemble(const char* binfname, memfile_t* fin)
 {
+    sp::AutoPhase phase(gPhaseTimer, kPhaseAssemble);
+
     init_opcode_lookup();
 
-    SmxByteBuffer buffer;
-    assemble_to_buffer(&buffer, fin);
+    SmxBuilder builder;
+    SmxBuilder debug_builder;
+    bool split_debug = !sc_split_debug.empty();
+    build_smx(builder, split_debug ? &debug_builder : nullptr, fin);
 
-    // Buffer compression logic.
-    sp_file_hdr_t* header = (sp_file_hdr_t*)buffer.bytes();
+    // A page-aligned file is left uncompressed so the VM can map it.
+    int compression_level = sc_page_aligned ? 0 : sc_compression_level;
 
-    if (sc_compression_level) {
-        size_t region_size = header->imagesize - header->dataoffs;
-        size_t zbuf_max = compressBound(region_size);
-        std::unique_ptr<Bytef[]> zbuf = std::make_unique<Bytef[]>(zbuf_max);
+    // The debug file is only read when something needs it, so it is simply
+    // deflated.
+    if (split_debug && !stream_to_binary(sc_split_debug.c_str(), debug_builder,
+                                         sc_compression_level))
+    {
+        error(FATAL_ERROR_WRITE, sc_split_debug.c_str());
+        return;
+    }
 
-        uLong new_disksize = zbuf_max;
-        int err = compress2(zbuf.get(), &new_disksize, (Bytef*)(buffer.bytes() + header->dataoffs),
-                            region_size, sc_compression_level);
-        if (err == Z_OK) {
-            header->disksize = new_disksize + header->dataoffs;
-            header->compression = SmxConsts::FILE_COMPRESSION_GZ;
+    if (!compression_level || sc_compression_codec == SmxConsts::FILE_COMPRESSION_GZ) {
+        // Note: error 161 will setjmp(), which skips destructors, so the
+        // writer must be gone by now.
+        if (!stream_to_binary(binfname, builder, compression_level))
+            error(FATAL_ERROR_WRITE, binfname);
+        return;
+    }
 
-            ByteBuffer new_buffer;
-            new_buffer.writeBytes(buffer.bytes(), header->dataoffs);
-            new_buffer.writeBytes(zbuf.get(), new_disksize);
+    // LZ4 compresses the whole region in one block, and zlib-chunks hands
+    // chunks of it to threads, so both need the image in memory.
+    SmxByteBuffer buffer;
+    builder.write(&buffer);
 
-            splat_to_binary(binfname, new_buffer.bytes(), new_buffer.size());
-            return;
+    sp_file_hdr_t* header = (sp_file_hdr_t*)buffer.bytes();
+    const uint8_t* region = buffer.bytes() + header->dataoffs;
+    size_t region_size = header->imagesize - header->dataoffs;
+
+    std::vector<uint8_t> packed;
+    const char* codec_name;
+    if (sc_compression_codec == SmxConsts::FILE_COMPRESSION_LZ4) {
+        codec_name = "lz4";
+        packed.resize(Lz4CompressBound(region_size));
+        packed.resize(Lz4Compress(region, region_size, packed.data(), packed.size()));
+    } else {
+        codec_name = "zlib-chunks";
+        if (!ZlibChunksCompress(region, region_size, compression_level, sc_compression_threads,
+                                &packed))
+        {
+            packed.clear();
         }
+    }
+
+    if (!packed.empty()) {
+        header->disksize = packed.size() + header->dataoffs;
+        header->compression = sc_compression_codec;
+
+        ByteBuffer new_buffer;
+        new_buffer.writeBytes(buffer.bytes(), header->dataoffs);
+        new_buffer.writeBytes(packed.data(), packed.size());
 
-        pc_printf("Unable to compress, error %d\n", err);
-        pc_printf("Falling back to no compression.\n");
+        splat_to_binary(binfname, new_buffer.bytes(), new_buffer.size());
+        return;
     }
 
+    pc_printf("Unable to compress with %s\n", codec_name);
+    pc_printf("Falling back to no compression.\n");
+
     header->disksize = 0;
     header->compression = SmxConsts::FILE_COMPRESSION_NONE;
 
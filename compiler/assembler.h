@@ -19,6 +19,12 @@
 //  3.  This notice may not be removed or altered from any source distribution.
 #pragma once
 
+#include <stddef.h>
+
 struct memfile_t;
 
 void assemble(const char* outname, memfile_t* fin);
+
+// Bytes of RTTI type data the last assemble() encoded, and how many were
+// left once identical and overlapping encodings were shared.
+void type_data_stats(size_t* encoded, size_t* stored);
@@ -259,6 +259,15 @@ BinaryExpr::DoEmit()
             assert(!oper_);
             assert(!assignop_.sym);
 
+            // The callee can write its result right into the destination,
+            // which saves a heap temporary and a copy out of it.
+            CallExpr* call = right_->AsCallExpr();
+            if (call && call->CanReturnInto(array_copy_length_)) {
+                call->set_return_into_pri();
+                right_->Emit();
+                return;
+            }
+
             pushreg(sPRI);
             right_->Emit();
             popreg(sALT);
@@ -558,7 +567,14 @@ TaggedValueExpr::DoEmit()
 void
 StringExpr::DoEmit()
 {
+    if (shared_) {
+        int index = litadd_shared(text_->chars(), text_->length());
+        ldconst((index + glb_declared) * sizeof(cell), sPRI);
+        return;
+    }
+
     auto addr = (litidx + glb_declared) * sizeof(cell);
+    litunshare(text_->chars(), text_->length());
     litadd(text_->chars(), text_->length());
     ldconst(addr, sPRI);
 }
@@ -573,9 +589,19 @@ IndexExpr::DoEmit()
 
     bool magic_string = (sym->tag == pc_tag_string && sym->dim.array.level == 0);
 
+    // Rows of a flat array follow each other, so there is no vector to load.
+    cell flat_stride = 0;
+    if (sym->flat && sym->dim.array.level > 0)
+        flat_stride = flat_array_cells(sym->array_child()) * sizeof(cell);
+
     const auto& idxval = expr_->val();
     if (idxval.ident == iCONSTEXPR) {
-        if (!(sym->tag == pc_tag_string && sym->dim.array.level == 0)) {
+        if (flat_stride) {
+            if (idxval.constval != 0) {
+                ldconst(idxval.constval * flat_stride, sALT);
+                ob_add();
+            }
+        } else if (!(sym->tag == pc_tag_string && sym->dim.array.level == 0)) {
             /* normal array index */
             if (idxval.constval != 0) {
                 /* don't add offsets for zero subscripts */
@@ -595,7 +621,11 @@ IndexExpr::DoEmit()
         expr_->Emit();
 
         /* array index is not constant */
-        if (!magic_string) {
+        if (flat_stride) {
+            ffbounds(sym->dim.array.length - 1);
+            ldconst(flat_stride, sALT);
+            os_mult();
+        } else if (!magic_string) {
             if (sym->dim.array.length != 0)
                 ffbounds(sym->dim.array.length - 1); /* run time check for array bounds */
             else
@@ -613,7 +643,7 @@ IndexExpr::DoEmit()
     }
 
     /* the indexed item may be another array (multi-dimensional arrays) */
-    if (sym->dim.array.level > 0) {
+    if (sym->dim.array.level > 0 && !flat_stride) {
         /* read the offset to the subarray and add it to the current address */
         value val = base_->val();
         val.ident = iARRAYCELL;
@@ -647,11 +677,44 @@ SizeofExpr::DoEmit()
     assert(false);
 }
 
+bool
+CallExpr::CanReturnInto(cell cells) const
+{
+    // The callee only writes to the buffer when it returns, so it cannot
+    // observe the destination being overwritten, even through an argument
+    // that refers to it.
+    return val_.sym && val_.sym->dim.array.level == 0 && array_totalsize(val_.sym) == cells;
+}
+
+bool
+CallExpr::IsSelfTailCall() const
+{
+    if (!tail_return_ || sym_ != curfunc || val_.sym)
+        return false;
+
+    // Only values are passed, so nothing refers into the frame that the
+    // arguments overwrite.
+    for (const auto& arg : argv_) {
+        if (arg.arg->ident != iVARIABLE)
+            return false;
+    }
+    return true;
+}
+
 void
 CallExpr::DoEmit()
 {
+    // Calls to an argumentless function that only returns a constant are
+    // replaced by the constant.
+    if (sym_->function()->returns_constant && argv_.empty() && !val_.sym) {
+        ldconst(sym_->function()->constant_value, sPRI);
+        return;
+    }
+
     // If returning an array, push a hidden parameter.
-    if (val_.sym) {
+    if (val_.sym && return_into_pri_) {
+        pushreg(sPRI);
+    } else if (val_.sym) {
         int retsize = array_totalsize(val_.sym);
         assert(retsize > 0  || !cc_ok());
 
@@ -720,6 +783,25 @@ CallExpr::DoEmit()
         markexpr(sPARM, NULL, 0); // mark the end of a sub-expression
     }
 
+    if (IsSelfTailCall()) {
+        FunctionData* data = sym_->function();
+        if (data->tail_label >= 0) {
+            // Rather than stacking another frame, store the arguments over
+            // the parameters and run the body again. Argument 0 was pushed
+            // last.
+            for (size_t i = 0; i < argv_.size(); i++) {
+                popreg(sPRI);
+                storeframe((i + 3) * sizeof(cell));
+            }
+            genheapfree(-1);
+            genstackfree(-1);
+            jumplabel(data->tail_label);
+            popheaplist(false);
+            return;
+        }
+        data->tail_calls = true;
+    }
+
     ffcall(sym_, argv_.size());
 
     if (val_.sym)
@@ -744,7 +826,15 @@ DefaultArgExpr::DoEmit()
             break;
         }
         case iREFERENCE:
-            setheap(arg_->defvalue.val);
+            if (arg_->is_const) {
+                // Nothing can write through a const reference, so the value
+                // can be passed from the data section instead of the heap.
+                cell addr = (litidx + glb_declared) * sizeof(cell);
+                litadd(arg_->defvalue.val);
+                ldconst(addr, sPRI);
+            } else {
+                setheap(arg_->defvalue.val);
+            }
             break;
         case iVARIABLE:
             ldconst(arg_->defvalue.val, sPRI);
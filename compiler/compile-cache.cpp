@@ -0,0 +1,277 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include "compile-cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined _WIN32
+#    include <direct.h>
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
+
+#include "libpawnc.h"
+#include "osdefs.h"
+#include "sclist.h"
+#include "vm/md5/md5.h"
+
+#if defined(SOURCEMOD_BUILD)
+#    include <sourcemod_version.h>
+#    define SOURCEPAWN_VERSION SOURCEMOD_VERSION
+#endif
+
+CompileCache gCompileCache;
+
+// Bump this when the entry layout changes.
+static const char kEntryHeader[] = "spcomp-cache 1";
+
+static std::string
+Digest(const void* data, size_t length)
+{
+    MD5 md5;
+    md5.update(reinterpret_cast<const unsigned char*>(data), (unsigned int)length);
+    md5.finalize();
+
+    char hex[33];
+    return md5.hex_digest(hex);
+}
+
+static void
+AddKeyPart(std::string* key, const std::string& part)
+{
+    *key += part;
+    key->push_back('\0');
+}
+
+static bool
+ReadFile(const char* path, std::string* contents)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    bool ok = false;
+    long length;
+    if (fseek(fp, 0, SEEK_END) != -1 && (length = ftell(fp)) != -1 &&
+        fseek(fp, 0, SEEK_SET) != -1)
+    {
+        contents->resize(length);
+        ok = length == 0 || fread(&(*contents)[0], length, 1, fp) == 1;
+    }
+    fclose(fp);
+    return ok;
+}
+
+static bool
+WriteFile(const char* path, const char* data, size_t length)
+{
+    FILE* fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    bool ok = length == 0 || fwrite(data, length, 1, fp) == 1;
+    if (fclose(fp) != 0)
+        ok = false;
+    return ok;
+}
+
+static bool
+ReadLine(const std::string& entry, size_t* pos, std::string* line)
+{
+    size_t newline = entry.find('\n', *pos);
+    if (newline == std::string::npos)
+        return false;
+    line->assign(entry, *pos, newline - *pos);
+    *pos = newline + 1;
+    return true;
+}
+
+CompileCache::CompileCache()
+  : active_(false),
+    cacheable_(false)
+{
+}
+
+bool
+CompileCache::lookup(const char* dir, int argc, char** argv, const char* binfname, int* retcode)
+{
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return false;
+
+    std::string key;
+    AddKeyPart(&key, kEntryHeader);
+    AddKeyPart(&key, SOURCEPAWN_VERSION " " __DATE__ " " __TIME__);
+    AddKeyPart(&key, cwd);
+    AddKeyPart(&key, std::to_string(argc));
+    for (int i = 1; i < argc; i++)
+        AddKeyPart(&key, argv[i]);
+    for (int i = 0; char* path = get_path(i); i++)
+        AddKeyPart(&key, path);
+
+    dir_ = dir;
+    path_ = dir_;
+    if (!path_.empty() && path_.back() != '/' && path_.back() != DIRSEP_CHAR)
+        path_.push_back(DIRSEP_CHAR);
+    path_ += Digest(key.data(), key.size()) + ".cache";
+
+    std::string entry;
+    if (ReadFile(path_.c_str(), &entry) && replay(entry, binfname)) {
+        *retcode = 0;
+        return true;
+    }
+
+    active_ = true;
+    cacheable_ = true;
+    sources_.clear();
+    output_.clear();
+    return false;
+}
+
+bool
+CompileCache::replay(const std::string& entry, const char* binfname)
+{
+    size_t pos = 0;
+    std::string line;
+    if (!ReadLine(entry, &pos, &line) || line != kEntryHeader)
+        return false;
+    if (!ReadLine(entry, &pos, &line))
+        return false;
+
+    unsigned long count = strtoul(line.c_str(), nullptr, 10);
+    for (unsigned long i = 0; i < count; i++) {
+        if (!ReadLine(entry, &pos, &line))
+            return false;
+        size_t space = line.find(' ');
+        if (space == std::string::npos)
+            return false;
+
+        std::string digest = line.substr(0, space);
+        std::string filename = line.substr(space + 1);
+        const std::string* text = pc_srctext(filename.c_str());
+        if (digest == "-") {
+            if (text)
+                return false;
+        } else if (!text || Digest(text->data(), text->size()) != digest) {
+            return false;
+        }
+    }
+
+    unsigned long output_length, smx_length;
+    if (!ReadLine(entry, &pos, &line) ||
+        sscanf(line.c_str(), "%lu %lu", &output_length, &smx_length) != 2 ||
+        entry.size() - pos != output_length + smx_length)
+    {
+        return false;
+    }
+
+    if (!WriteFile(binfname, entry.data() + pos + output_length, smx_length))
+        return false;
+    fwrite(entry.data() + pos, 1, output_length, stdout);
+    return true;
+}
+
+void
+CompileCache::finish(const char* binfname, int retcode)
+{
+    if (!active_)
+        return;
+    active_ = false;
+
+    std::string smx;
+    if (retcode != 0 || !cacheable_ || !ReadFile(binfname, &smx))
+        return;
+
+    std::string entry = kEntryHeader;
+    entry += "\n" + std::to_string(sources_.size()) + "\n";
+    for (const auto& source : sources_) {
+        entry += source.second.empty() ? "-" : source.second;
+        entry += " " + source.first + "\n";
+    }
+    entry += std::to_string(output_.size()) + " " + std::to_string(smx.size()) + "\n";
+    entry += output_;
+    entry += smx;
+
+    // Entries are written whole and then renamed into place, so compiles
+    // running at the same time never see part of one.
+#if defined _WIN32
+    _mkdir(dir_.c_str());
+    std::string temp = path_ + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    mkdir(dir_.c_str(), 0777);
+    std::string temp = path_ + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    if (!WriteFile(temp.c_str(), entry.data(), entry.size())) {
+        remove(temp.c_str());
+        return;
+    }
+#if defined _WIN32
+    remove(path_.c_str());
+#endif
+    if (rename(temp.c_str(), path_.c_str()) != 0)
+        remove(temp.c_str());
+}
+
+void
+CompileCache::noteSource(const char* filename, const std::string* text)
+{
+    if (!active_ || sources_.count(filename))
+        return;
+
+    if (strchr(filename, '\n'))
+        cacheable_ = false;
+
+    // These expand to when the compile ran, so the result can't be reused.
+    if (text && (text->find("__DATE__") != std::string::npos ||
+                 text->find("__TIME__") != std::string::npos))
+    {
+        cacheable_ = false;
+    }
+
+    sources_.emplace(filename, text ? Digest(text->data(), text->size()) : std::string());
+}
+
+void
+CompileCache::noteOutput(const char* text)
+{
+    if (active_)
+        output_ += text;
+}
+
+void
+CompileCache::noteOutputVA(const char* format, va_list ap)
+{
+    if (!active_)
+        return;
+
+    va_list copy;
+    va_copy(copy, ap);
+    int length = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    if (length <= 0)
+        return;
+
+    size_t start = output_.size();
+    output_.resize(start + length + 1);
+    vsnprintf(&output_[start], length + 1, format, ap);
+    output_.resize(start + length);
+}
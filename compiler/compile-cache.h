@@ -0,0 +1,79 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#ifndef _include_spcomp_compile_cache_h_
+#define _include_spcomp_compile_cache_h_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <string>
+#include <unordered_map>
+
+// The cache behind --cache-dir. Each entry holds the .smx and console output
+// of one successful compile, and is keyed by everything that can change the
+// result without being a source file: the compiler build, the working
+// directory, the arguments (and with them the command-line #defines), and
+// the include paths.
+//
+// The sources are checked, not hashed into the key, since which files a
+// compile reads is only known once it has run. Every path the compiler tried
+// to open is recorded with a digest of its contents, or as missing; an entry
+// is only used if each of those paths still looks the same, so an include
+// that now resolves somewhere else (or to a file that didn't exist before)
+// is a miss.
+class CompileCache
+{
+  public:
+    CompileCache();
+
+    // Looks for an entry for this compile in |dir|. On a hit, the binary is
+    // written to |binfname|, the output is printed, and true is returned.
+    // Otherwise, the compile's sources and output are recorded from here on,
+    // and finish() stores them.
+    bool lookup(const char* dir, int argc, char** argv, const char* binfname, int* retcode);
+
+    // Stores the entry if the compile succeeded and could be cached.
+    void finish(const char* binfname, int retcode);
+
+    bool active() const {
+        return active_;
+    }
+
+    // |text| is null if |filename| could not be opened.
+    void noteSource(const char* filename, const std::string* text);
+    void noteOutput(const char* text);
+    void noteOutputVA(const char* format, va_list ap);
+
+  private:
+    bool replay(const std::string& entry, const char* binfname);
+
+  private:
+    bool active_;
+    bool cacheable_;
+    std::string dir_;
+    std::string path_;
+
+    // Digests of the contents of every source opened, or empty if it was
+    // missing.
+    std::unordered_map<std::string, std::string> sources_;
+    std::string output_;
+};
+
+extern CompileCache gCompileCache;
+
+#endif // _include_spcomp_compile_cache_h_
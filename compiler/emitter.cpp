@@ -27,6 +27,9 @@
 #include <stdlib.h> /* for _MAX_PATH */
 #include <string.h>
 
+#include <string>
+#include <unordered_map>
+
 #include <amtl/am-raii.h>
 
 #include "emitter.h"
@@ -235,6 +238,7 @@ markexpr(optmark type, const char* name, cell offset)
 void
 startfunc(const char* fname)
 {
+    stgfunction(TRUE);
     stgwrite("\tproc");
     if (sc_asmfile) {
         char symname[2 * sNAMEMAX + 16];
@@ -254,6 +258,7 @@ void
 endfunc(void)
 {
     stgwrite("\n"); /* skip a line */
+    stgfunction(FALSE);
 }
 
 /*  rvalue
@@ -492,6 +497,15 @@ storereg(cell address, regid reg)
     code_idx += opcodes(1) + opargs(1);
 }
 
+/* Store PRI into a cell of the current stack frame */
+void
+storeframe(cell offset)
+{
+    stgwrite("\tstor.s.pri ");
+    outval(offset, TRUE);
+    code_idx += opcodes(1) + opargs(1);
+}
+
 /* source must in PRI, destination address in ALT. The "size"
  * parameter is in bytes, not cells.
  */
@@ -1464,6 +1478,11 @@ chk_grow_litq(void)
     }
 }
 
+/* read-only string literals in the literal queue, by contents; emptied
+ * whenever the queue starts over
+ */
+static std::unordered_map<std::string, int> sSharedLiterals;
+
 /*  litadd
  *
  *  Adds a value at the end of the literal queue. The literal queue is used
@@ -1475,11 +1494,56 @@ chk_grow_litq(void)
 void
 litadd(cell value)
 {
+    if (litidx == 0 && !sSharedLiterals.empty())
+        sSharedLiterals.clear();
     chk_grow_litq();
     assert(litidx < litmax);
     litq[litidx++] = value;
 }
 
+/*  litadd_shared
+ *
+ *  Adds a string literal that is never written to, reusing the storage of an
+ *  identical read-only literal already in the queue. Returns the index of its
+ *  first cell.
+ */
+int
+litadd_shared(const char* str, size_t len)
+{
+    int start = litidx;
+    litadd(str, len);
+
+    std::string key(str, len);
+    auto iter = sSharedLiterals.find(key);
+    if (iter != sSharedLiterals.end()) {
+        /* the queue can be rewound or shifted while declaring arrays, so check
+         * that the earlier copy is still there
+         */
+        int prev = iter->second;
+        int cells = litidx - start;
+        if (prev + cells <= start &&
+            memcmp(litq + prev, litq + start, cells * sizeof(cell)) == 0)
+        {
+            litidx = start;
+            return prev;
+        }
+    }
+    sSharedLiterals[key] = start;
+    return start;
+}
+
+/*  litunshare
+ *
+ *  Forgets a read-only literal with these contents, before adding a literal
+ *  that may be written to (and could otherwise land at the same index).
+ */
+void
+litunshare(const char* str, size_t len)
+{
+    if (!sSharedLiterals.empty())
+        sSharedLiterals.erase(std::string(str, len));
+}
+
 /*  litinsert
  *
  *  Inserts a value into the literal queue. This is sometimes necessary for
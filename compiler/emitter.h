@@ -58,6 +58,7 @@ void address(symbol* ptr, regid reg);
 void store(const value* lval);
 void loadreg(cell address, regid reg);
 void storereg(cell address, regid reg);
+void storeframe(cell offset);
 void memcopy(cell size);
 void copyarray(symbol* sym, cell size);
 void fillarray(symbol* sym, cell size, cell value);
@@ -134,6 +135,8 @@ void jmp_ne0(int number);
 void jmp_eq0(int number);
 void outval(cell val, int newline);
 void litadd(cell value);
+int litadd_shared(const char* str, size_t len);
+void litunshare(const char* str, size_t len);
 void litinsert(cell value, int pos);
 cell dumplits();
 void dumpzero(int count);
@@ -33,6 +33,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <unordered_set>
+#include "compile-cache.h"
 #include "errors.h"
 #include "lexer.h"
 #include "libpawnc.h"
@@ -57,6 +60,10 @@ static unsigned char warndisable[(NUM_WARNINGS + 7) / 8]; /* 8 flags in a char *
 static int errflag;
 static AutoErrorPos* sPosOverride = nullptr;
 
+// Every warning printed so far. A warning raised again at the same place, with
+// the same text, is not printed twice.
+static std::unordered_set<std::string> sReportedWarnings;
+
 AutoErrorPos::AutoErrorPos(const token_pos_t& pos)
   : pos_(pos),
     prev_(sPosOverride)
@@ -82,6 +89,30 @@ AutoErrorPos::~AutoErrorPos()
  *                     fcurrent   (reffered to only)
  *                     errflag    (altered)
  */
+/* Whether report_error() would print this report. errflag is reset on each
+ * semicolon. In a two-pass compiler, an error should not be reported twice.
+ * Therefore the error reporting is enabled only in the second pass (and only
+ * when actually producing output). Fatal errors may never be ignored.
+ */
+static bool
+is_reportable(const ErrorReport& report)
+{
+    if (report.type == ErrorType::Fatal)
+        return true;
+    if (report.type == ErrorType::Suppressed || errflag)
+        return false;
+    return sc_status == statWRITE || sc_err_status;
+}
+
+static void
+report_error_va(ErrorReport* report, va_list ap)
+{
+    if (!is_reportable(*report))
+        return;
+    report->format_va(ap);
+    report_error(report);
+}
+
 int
 error(int number, ...)
 {
@@ -93,47 +124,44 @@ error(int number, ...)
         return 0;
     }
 
+    ErrorReport report = ErrorReport::infer(number);
+
     va_list ap;
     va_start(ap, number);
-    ErrorReport report = ErrorReport::infer_va(number, ap);
+    report_error_va(&report, ap);
     va_end(ap);
-
-    report_error(&report);
     return 0;
 }
 
 int
 error(const token_pos_t& where, int number, ...)
 {
+    ErrorReport report = ErrorReport::create(number, where.file, where.line);
+
     va_list ap;
     va_start(ap, number);
-    ErrorReport report = ErrorReport::create_va(number, where.file, where.line, ap);
+    report_error_va(&report, ap);
     va_end(ap);
-
-    report.lineno = where.line;
-    report_error(&report);
     return 0;
 }
 
 int
 error_va(const token_pos_t& where, int number, va_list ap)
 {
-    ErrorReport report = ErrorReport::create_va(number, where.file, where.line, ap);
-
-    report.lineno = where.line;
-    report_error(&report);
+    ErrorReport report = ErrorReport::create(number, where.file, where.line);
+    report_error_va(&report, ap);
     return 0;
 }
 
 int
 error(symbol* sym, int number, ...)
 {
+    ErrorReport report = ErrorReport::create(number, sym->fnumber, sym->lnumber);
+
     va_list ap;
     va_start(ap, number);
-    ErrorReport report = ErrorReport::create_va(number, sym->fnumber, sym->lnumber, ap);
+    report_error_va(&report, ap);
     va_end(ap);
-
-    report_error(&report);
     return 0;
 }
 
@@ -151,7 +179,7 @@ abort_compiler()
 }
 
 ErrorReport
-ErrorReport::create_va(int number, int fileno, int lineno, va_list ap)
+ErrorReport::create(int number, int fileno, int lineno)
 {
     ErrorReport report;
     report.number = number;
@@ -176,9 +204,14 @@ ErrorReport::create_va(int number, int fileno, int lineno, va_list ap)
         if ((warndisable[index] & mask) != 0)
             report.type = ErrorType::Suppressed;
     }
+    return report;
+}
 
+void
+ErrorReport::format_va(va_list ap)
+{
     const char* prefix = "";
-    switch (report.type) {
+    switch (type) {
         case ErrorType::Error:
             prefix = "error";
             break;
@@ -192,31 +225,28 @@ ErrorReport::create_va(int number, int fileno, int lineno, va_list ap)
     }
 
     const char* format = nullptr;
-    if (report.number < FIRST_FATAL_ERROR)
-        format = errmsg[report.number - 1];
-    else if (report.number < 200)
-        format = fatalmsg[report.number - FIRST_FATAL_ERROR];
+    if (number < FIRST_FATAL_ERROR)
+        format = errmsg[number - 1];
+    else if (number < 200)
+        format = fatalmsg[number - FIRST_FATAL_ERROR];
     else
-        format = warnmsg[report.number - 200];
+        format = warnmsg[number - 200];
 
     char msg[1024];
     ke::SafeVsprintf(msg, sizeof(msg), format, ap);
 
     char base[1024];
-    ke::SafeSprintf(base, sizeof(base), "%s(%d) : %s %03d: ", report.filename, report.lineno,
-                    prefix, report.number);
+    ke::SafeSprintf(base, sizeof(base), "%s(%d) : %s %03d: ", filename, lineno, prefix, number);
 
     char full[2048];
     ke::SafeSprintf(full, sizeof(full), "%s%s", base, msg);
-    report.message = full;
-
-    return report;
+    message = full;
 }
 
 ErrorReport
-ErrorReport::infer_va(int number, va_list ap)
+ErrorReport::infer(int number)
 {
-    return create_va(number, -1, fline, ap);
+    return create(number, -1, fline);
 }
 
 void
@@ -225,17 +255,10 @@ report_error(ErrorReport* report)
     static int lastline, errorcount;
     static short lastfile;
 
-    /* errflag is reset on each semicolon.
-     * In a two-pass compiler, an error should not be reported twice. Therefore
-     * the error reporting is enabled only in the second pass (and only when
-     * actually producing output). Fatal errors may never be ignored.
-     */
-    if (report->type != ErrorType::Fatal) {
-        if (errflag)
-            return;
-        if (sc_status != statWRITE && !sc_err_status)
-            return;
-    }
+    if (!is_reportable(*report))
+        return;
+    if (report->type == ErrorType::Warning && !sReportedWarnings.insert(report->message).second)
+        return;
 
     switch (report->type) {
         case ErrorType::Suppressed:
@@ -259,6 +282,8 @@ report_error(ErrorReport* report)
 
     fprintf(fp, "%s", report->message.c_str());
     fflush(fp);
+    if (fp == stdout)
+        gCompileCache.noteOutput(report->message.c_str());
 
     if (fp != stdout)
         fclose(fp);
@@ -281,6 +306,12 @@ report_error(ErrorReport* report)
         error(FATAL_ERROR_OVERWHELMED_BY_BAD);
 }
 
+void
+clear_reported_warnings()
+{
+    sReportedWarnings.clear();
+}
+
 void
 errorset(int code, int line)
 {
@@ -34,8 +34,12 @@
 enum class ErrorType { Suppressed, Warning, Error, Fatal };
 
 struct ErrorReport {
-    static ErrorReport infer_va(int number, va_list ap);
-    static ErrorReport create_va(int number, int fileno, int lineno, va_list ap);
+    // These leave |message| empty; most reports are raised in passes that
+    // don't print them, so it is only formatted for ones that will be.
+    static ErrorReport infer(int number);
+    static ErrorReport create(int number, int fileno, int lineno);
+
+    void format_va(va_list ap);
 
     int number;
     int fileno;
@@ -87,6 +91,7 @@ int error(const token_pos_t& where, int number, ...);
 int error_va(const token_pos_t& where, int number, va_list ap);
 void errorset(int code, int line);
 void report_error(ErrorReport* report);
+void clear_reported_warnings();
 
 int pc_enablewarning(int number, int enable);
 
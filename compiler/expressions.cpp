@@ -607,6 +607,8 @@ array_totalsize(symbol* sym)
 
     assert(sym != NULL);
     assert(sym->ident == iARRAY || sym->ident == iREFARRAY);
+    if (sym->flat)
+        return flat_array_cells(sym);
     length = sym->dim.array.length;
     if (sym->dim.array.level > 0) {
         cell sublength = array_totalsize(sym->array_child());
@@ -618,6 +620,20 @@ array_totalsize(symbol* sym)
     return length;
 }
 
+/* Returns the number of cells taken by a (sub-)array laid out flat, which
+ * has no indirection vectors.
+ */
+cell
+flat_array_cells(symbol* sym)
+{
+    assert(sym->flat);
+    if (sym->dim.array.level > 0)
+        return sym->dim.array.length * flat_array_cells(sym->array_child());
+    if (sym->tag == pc_tag_string && !sym->dim.array.slength)
+        return char_array_cells(sym->dim.array.length);
+    return sym->dim.array.length;
+}
+
 cell
 array_levelsize(symbol* sym, int level)
 {
@@ -59,6 +59,7 @@ void emit_userop(const UserOperation& user_op, value* lval);
 
 int findnamedarg(arginfo* arg, const char* name);
 cell array_totalsize(symbol* sym);
+cell flat_array_cells(symbol* sym);
 cell array_levelsize(symbol* sym, int level);
 int commutative(void (*oper)());
 cell calc(cell left, void (*oper)(), cell right, char* boolresult);
@@ -28,7 +28,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "lexer.h"
 #include <amtl/am-hashmap.h>
@@ -70,7 +73,22 @@ static short skiplevel; /* level at which we started skipping (including nested
 static unsigned char term_expr[] = "";
 static int listline = -1; /* "current line" for the list file */
 
-ke::HashMap<CharsAndLength, int, KeywordTablePolicy> sKeywords;
+// Keywords are found with a perfect hash of their length and first, second
+// and last characters, so ruling one out costs at most a single compare. The
+// multipliers were picked so that no two keywords share a slot; lexinit()
+// checks that this still holds, in every build, since a keyword added later
+// would otherwise silently displace another.
+static const size_t kKeywordSlots = 512;
+static short sKeywordSlots[kKeywordSlots];
+static size_t sMaxKeywordLength;
+
+static constexpr size_t
+KeywordHash(const char* str, size_t length)
+{
+    return (length * 28 + (unsigned char)str[0] * 41 + (unsigned char)str[1] * 16 +
+            (unsigned char)str[length - 1]) &
+           (kKeywordSlots - 1);
+}
 
 int
 plungequalifiedfile(char* name)
@@ -99,7 +117,7 @@ plungequalifiedfile(char* name)
         return FALSE;
     }
     if (sc_showincludes && sc_status == statFIRST) {
-        fprintf(stdout, "Note: including file: %s\n", name);
+        pc_printf("Note: including file: %s\n", name);
     }
     gInputFileStack.push_back(inpf);
     gInputFilenameStack.push_back(inpfname);
@@ -237,7 +255,6 @@ readline(unsigned char* line)
 {
     int num, cont;
     unsigned char* ptr;
-    symbol* sym;
 
     if (lptr == term_expr)
         return;
@@ -281,23 +298,30 @@ readline(unsigned char* line)
             *line = '\0'; /* delete line */
             cont = FALSE;
         } else {
+            /* the line is measured once; the checks below only look at its end */
+            size_t len = strlen((char*)line);
             /* check whether to erase leading spaces */
             if (cont) {
                 unsigned char* ptr = line;
                 while (*ptr <= ' ' && *ptr != '\0')
                     ptr++;
-                if (ptr != line)
-                    memmove(line, ptr, strlen((char*)ptr) + 1);
+                if (ptr != line) {
+                    len -= ptr - line;
+                    memmove(line, ptr, len + 1);
+                }
             }
             cont = FALSE;
+            /* pc_readsrc() stops at the end of a line, so a '\n' or '\r' can only
+             * be the last character
+             */
+            ptr = NULL;
+            if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                ptr = line + len - 1;
             /* check whether a full line was read */
-            if (strchr((char*)line, '\n') == NULL && !pc_eofsrc(inpf))
+            if ((ptr == NULL || *ptr != '\n') && !pc_eofsrc(inpf))
                 error(75); /* line too long */
             /* check if the next line must be concatenated to this line */
-            if ((ptr = (unsigned char*)strchr((char*)line, '\n')) == NULL)
-                ptr = (unsigned char*)strchr((char*)line, '\r');
             if (ptr != NULL && ptr > line) {
-                assert(*(ptr + 1) == '\0'); /* '\n' or '\r' should be last in the string */
                 while (ptr > line && *ptr <= ' ')
                     ptr--; /* skip trailing whitespace */
                 if (*ptr == '\\') {
@@ -307,15 +331,15 @@ readline(unsigned char* line)
                      */
                     *ptr++ = '\a';
                     *ptr = '\0'; /* erase '\n' (and any trailing whitespace) */
+                    len = ptr - line;
                 }
             }
-            num -= strlen((char*)line);
-            line += strlen((char*)line);
+            num -= (int)len;
+            line += len;
         }
         fline += 1;
-        sym = findconst("__LINE__");
-        assert(sym != NULL);
-        sym->setAddr(fline);
+        assert(sc_linesym != NULL);
+        sc_linesym->setAddr(fline);
     } while (num >= 0 && cont);
 }
 
@@ -940,6 +964,10 @@ command(void)
                         cell val;
                         preproc_expr(&val, NULL);
                         sc_needsemicolon = (int)val;
+                    } else if (strcmp(str, "flatarrays") == 0) {
+                        cell val;
+                        preproc_expr(&val, NULL);
+                        sc_flat_arrays = (int)val;
                     } else if (strcmp(str, "newdecls") == 0) {
                         while (*lptr <= ' ' && *lptr != '\0')
                             lptr++;
@@ -1189,34 +1217,18 @@ skippgroup(const unsigned char* string)
     return string;
 }
 
-static char*
-strdel(char* str, size_t len)
-{
-    size_t length = strlen(str);
-    if (len > length)
-        len = length;
-    memmove(str, str + len, length - len + 1); /* include EOS byte */
-    return str;
-}
-
-static char*
-strins(char* dest, const char* src, size_t srclen)
-{
-    size_t destlen = strlen(dest);
-    assert(srclen <= strlen(src));
-    memmove(dest + srclen, dest, destlen + 1); /* include EOS byte */
-    memcpy(dest, src, srclen);
-    return dest;
-}
-
 static int
 substpattern(unsigned char* line, size_t buffersize, const char* pattern,
              const char* substitution)
 {
     int prefixlen;
     const unsigned char *p, *s, *e;
-    unsigned char* args[10];
-    int match, arg, len, argsnum = 0;
+    /* arguments point into the line, which is left alone until the whole
+     * expansion has been built
+     */
+    const unsigned char* args[10];
+    int arglens[10];
+    int match, arg;
     int stringize;
 
     memset(args, 0, sizeof args);
@@ -1255,15 +1267,8 @@ substpattern(unsigned char* line, size_t buffersize, const char* pattern,
                               * a string, or the closing paranthese of a group) */
                 }
                 /* store the parameter (overrule any earlier) */
-                if (args[arg] != NULL)
-                    free(args[arg]);
-                else
-                    argsnum++;
-                len = (int)(e - s);
-                args[arg] = (unsigned char*)malloc(len + 1);
-                if (args[arg] == NULL)
-                    error(FATAL_ERROR_OOM);
-                SafeStrcpy((char*)args[arg], len + 1, (char*)s);
+                args[arg] = s;
+                arglens[arg] = (int)(e - s);
                 /* character behind the pattern was matched too */
                 if (*e == *p) {
                     s = e + 1;
@@ -1312,79 +1317,56 @@ substpattern(unsigned char* line, size_t buffersize, const char* pattern,
     }
 
     if (match) {
-        /* calculate the length of the substituted string */
-        for (e = (unsigned char*)substitution, len = 0; *e != '\0'; e++) {
-            if (*e == '#' && *(e + 1) == '%' && isdigit(*(e + 2)) && argsnum) {
+        /* build the expansion in one buffer, then splice it into the line
+         * with a single move
+         */
+        std::string expansion;
+        int missing = 0;
+        for (e = (unsigned char*)substitution; *e != '\0'; e++) {
+            if (*e == '#' && *(e + 1) == '%' && isdigit(*(e + 2))) {
                 stringize = 1;
                 e++; /* skip '#' */
             } else {
                 stringize = 0;
             }
-            if (*e == '%' && isdigit(*(e + 1)) && argsnum) {
+            if (*e == '%' && isdigit(*(e + 1))) {
                 arg = *(e + 1) - '0';
                 assert(arg >= 0 && arg <= 9);
-                assert(stringize == 0 || stringize == 1);
                 if (args[arg] != NULL) {
-                    len += strlen((char*)args[arg]) + 2 * stringize;
-                    e++;
+                    if (stringize)
+                        expansion += '"';
+                    expansion.append((const char*)args[arg], arglens[arg]);
+                    if (stringize)
+                        expansion += '"';
                 } else {
-                    len++;
+                    missing++;
+                    expansion.append((const char*)e, 2);
                 }
+                e++; /* skip %, digit is skipped later */
+            } else if (*e == '"' && is_startstring(e)) {
+                p = e;
+                e = skipstring(e);
+                if (*e == '\0') {
+                    expansion.append((const char*)p, e - p); /* unterminated */
+                    break;
+                }
+                expansion.append((const char*)p, e - p + 1);
             } else {
-                len++;
+                expansion += (char)*e;
             }
         }
         /* check length of the string after substitution */
-        if (strlen((char*)line) + len - (int)(s - line) > buffersize) {
+        size_t rest = strlen((const char*)s);
+        if (expansion.size() + rest > buffersize) {
             error(75); /* line too long */
         } else {
-            /* substitute pattern */
-            strdel((char*)line, (int)(s - line));
-            for (e = (unsigned char*)substitution, s = line; *e != '\0'; e++) {
-                if (*e == '#' && *(e + 1) == '%' && isdigit(*(e + 2))) {
-                    stringize = 1;
-                    e++; /* skip '#' */
-                } else {
-                    stringize = 0;
-                }
-                if (*e == '%' && isdigit(*(e + 1))) {
-                    arg = *(e + 1) - '0';
-                    assert(arg >= 0 && arg <= 9);
-                    if (args[arg] != NULL) {
-                        if (stringize)
-                            strins((char*)s++, "\"", 1);
-                        strins((char*)s, (char*)args[arg], strlen((char*)args[arg]));
-                        s += strlen((char*)args[arg]);
-                        if (stringize)
-                            strins((char*)s++, "\"", 1);
-                    } else {
-                        error(236); /* parameter does not exist, incorrect #define pattern */
-                        strins((char*)s, (char*)e, 2);
-                        s += 2;
-                    }
-                    e++; /* skip %, digit is skipped later */
-                } else if (*e == '"') {
-                    p = e;
-                    if (is_startstring(e)) {
-                        e = skipstring(e);
-                        strins((char*)s, (char*)p, (e - p + 1));
-                        s += (e - p + 1);
-                    } else {
-                        strins((char*)s, (char*)e, 1);
-                        s++;
-                    }
-                } else {
-                    strins((char*)s, (char*)e, 1);
-                    s++;
-                }
-            }
+            while (missing-- > 0)
+                error(236); /* parameter does not exist, incorrect #define pattern */
+            memmove(line + expansion.size(), s, rest + 1); /* include EOS byte */
+            memcpy(line, expansion.data(), expansion.size());
         }
     }
 
-    for (arg = 0; arg < 10; arg++)
-        if (args[arg] != NULL)
-            free(args[arg]);
-
     return match;
 }
 
@@ -1520,6 +1502,8 @@ preprocess(void)
 
     if (!freading)
         return;
+
+    sp::AutoPhase phase(gPhaseTimer, kPhasePreprocess);
     do {
         readline(pline);
         stripcom(
@@ -1557,6 +1541,24 @@ packedstring(const unsigned char* lptr, int flags, full_token_t* tok)
             lptr++;
             continue;
         }
+
+        // Only escapes need decoding, so copy everything up to the next one
+        // in one go.
+        size_t run = 0;
+        while (lptr[run] != '\0' && lptr[run] != '\a' && lptr[run] != sc_ctrlchar)
+            run++;
+        if (run > 0) {
+            size_t room = sizeof(tok->str) - 1 - tok->len;
+            size_t copied = std::min(run, room);
+            if (copied < run)
+                error(75); // line too long
+            memcpy(tok->str + tok->len, lptr, copied);
+            tok->len += copied;
+            glbstringread += (int)run;
+            lptr += run;
+            continue;
+        }
+
         ucell c = litchar(&lptr, flags); // litchar() alters "lptr"
         if (c >= (ucell)(1 << sCHARBITS))
             error(43); // character constant exceeds range
@@ -1772,16 +1774,20 @@ lexinit()
     memset(&sPreprocessBuffer, 0, sizeof(sPreprocessBuffer));
     sTokenBuffer = &sNormalBuffer;
 
-    if (!sKeywords.elements()) {
-        sKeywords.init(128);
-
+    if (!sMaxKeywordLength) {
         const int kStart = tMIDDLE + 1;
         const char** tokptr = &sc_tokens[kStart - tFIRST];
         for (int i = kStart; i <= tLAST; i++, tokptr++) {
-            CharsAndLength key(*tokptr, strlen(*tokptr));
-            auto p = sKeywords.findForAdd(key);
-            assert(!p.found());
-            sKeywords.add(p, key, i);
+            size_t length = strlen(*tokptr);
+            assert(length >= 2);
+            size_t slot = KeywordHash(*tokptr, length);
+            if (sKeywordSlots[slot]) {
+                fprintf(stderr, "keyword hash collision: \"%s\" and \"%s\"\n",
+                        sc_tokens[sKeywordSlots[slot] - tFIRST], *tokptr);
+                abort();
+            }
+            sKeywordSlots[slot] = (short)i;
+            sMaxKeywordLength = std::max(sMaxKeywordLength, length);
         }
     }
 }
@@ -1801,11 +1807,15 @@ get_token_string(int tok_id)
 static int
 lex_keyword_impl(const char* match, size_t length)
 {
-    CharsAndLength key(match, length);
-    auto p = sKeywords.find(key);
-    if (!p.found())
+    if (length < 2 || length > sMaxKeywordLength)
+        return 0;
+    int tok_id = sKeywordSlots[KeywordHash(match, length)];
+    if (!tok_id)
+        return 0;
+    const char* keyword = sc_tokens[tok_id - tFIRST];
+    if (strncmp(keyword, match, length) != 0 || keyword[length] != '\0')
         return 0;
-    return p->value;
+    return tok_id;
 }
 
 static inline bool
@@ -1908,6 +1918,8 @@ lex(cell* lexvalue, char** lexsym)
         return current_token()->id;
     }
 
+    sp::AutoPhase phase(gPhaseTimer, kPhaseLex);
+
     full_token_t* tok = advance_token_ptr();
     tok->id = 0;
     tok->value = 0;
@@ -2367,7 +2379,7 @@ lex_symbol(full_token_t* tok, const char* token_start)
  *  Pushes a token back, so the next call to lex() will return the token
  *  last examined, instead of a new token.
  *
- *  Only one token can be pushed back.
+ *  Up to MAX_TOKEN_DEPTH - 1 tokens can be pushed back.
  *
  *  In fact, lex() already stores the information it finds into global
  *  variables, so all that is to be done is set a flag that informs lex()
@@ -2386,6 +2398,21 @@ lexpush(void)
     assert(sTokenBuffer->depth <= sTokenBuffer->num_tokens);
 }
 
+int
+lexmark()
+{
+    return sTokenBuffer->num_tokens - sTokenBuffer->depth;
+}
+
+void
+lexrewind(int mark)
+{
+    int count = lexmark() - mark;
+    assert(count >= 0);
+    while (count--)
+        lexpush();
+}
+
 /*  lexclr
  *
  *  Sets the variable "_pushed" to 0 to make sure lex() will read in a new
@@ -2418,6 +2445,34 @@ const token_pos_t& current_pos()
     return current_token()->start;
 }
 
+static std::vector<token_pos_t> sSourceLocs;
+
+SourceLoc::SourceLoc(const token_pos_t& pos)
+{
+    if (!sSourceLocs.empty()) {
+        const token_pos_t& last = sSourceLocs.back();
+        if (last.file == pos.file && last.line == pos.line && last.col == pos.col) {
+            index_ = uint32_t(sSourceLocs.size() - 1);
+            return;
+        }
+    }
+    index_ = uint32_t(sSourceLocs.size());
+    sSourceLocs.push_back(pos);
+}
+
+SourceLoc::operator token_pos_t() const
+{
+    assert(index_ < sSourceLocs.size());
+    return sSourceLocs[index_];
+}
+
+void
+clear_source_locs()
+{
+    sSourceLocs.clear();
+    sSourceLocs.shrink_to_fit();
+}
+
 /*  matchtoken
  *
  *  This routine is useful if only a simple check is needed. If the token
@@ -2900,6 +2955,12 @@ markusage(symbol* sym, int usage)
  */
 symbol*
 findglb(const char* name)
+{
+    return findglb(gAtoms.add(name));
+}
+
+symbol*
+findglb(sp::Atom* name)
 {
     return FindInHashTable(sp_Globals, name, fcurrent);
 }
@@ -2911,9 +2972,14 @@ findglb(const char* name)
  */
 symbol*
 findloc(const char* name)
+{
+    return findloc(gAtoms.add(name));
+}
+
+symbol*
+findloc(sp::Atom* atom)
 {
     symbol* sym = loctab.next;
-    sp::Atom* atom = gAtoms.add(name);
     while (sym != NULL) {
         if (atom == sym->nameAtom() &&
             (sym->parent() == NULL ||
@@ -2929,12 +2995,18 @@ findloc(const char* name)
 
 symbol*
 findconst(const char* name)
+{
+    return findconst(gAtoms.add(name));
+}
+
+symbol*
+findconst(sp::Atom* name)
 {
     symbol* sym;
 
     sym = findloc(name);          /* try local symbols first */
     if (sym == NULL || sym->ident != iCONSTEXPR) { /* not found, or not a constant */
-        sym = FindInHashTable(sp_Globals, name, fcurrent);
+        sym = findglb(name);
     }
     if (sym == NULL || sym->ident != iCONSTEXPR)
         return NULL;
@@ -2946,6 +3018,10 @@ findconst(const char* name)
 FunctionData::FunctionData()
  : funcid(0)
  , dbgstrs(nullptr)
+ , returns_constant(false)
+ , constant_value(0)
+ , tail_calls(false)
+ , tail_label(-1)
 {
     resizeArgs(0);
 }
@@ -2997,6 +3073,7 @@ symbol::symbol(const char* symname, cell symaddr, int symident, int symvclass, i
    predefined(false),
    deprecated(false),
    queued(false),
+   flat(false),
    x({}),
    fnumber(fcurrent),
    /* assume global visibility (ignored for local symbols) */
@@ -3038,6 +3115,7 @@ symbol::symbol(const symbol& other)
     is_const = other.is_const;
     deprecated = other.deprecated;
     // Note: explicitly don't add queued.
+    flat = other.flat;
 
     x = other.x;
 }
@@ -3116,8 +3194,18 @@ symbol*
 addvariable3(declinfo_t* decl, cell addr, int vclass, int slength)
 {
     typeinfo_t* type = &decl->type;
-    return addvariable2(decl->name, addr, type->ident, vclass, type->tag, type->dim, type->numdim,
-                        type->idxtag, slength);
+    symbol* sym = addvariable2(decl->name, addr, type->ident, vclass, type->tag, type->dim,
+                               type->numdim, type->idxtag, slength);
+    if (type->is_flat)
+        mark_flat_array(sym);
+    return sym;
+}
+
+void
+mark_flat_array(symbol* sym)
+{
+    for (symbol* sub = sym; sub; sub = sub->dim.array.level ? sub->array_child() : nullptr)
+        sub->flat = true;
 }
 
 symbol*
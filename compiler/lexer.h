@@ -36,6 +36,23 @@ struct token_pos_t {
     int col;
 };
 
+// A position as kept in the parse tree: an index into a table shared by the
+// whole compile, a third the size of a token_pos_t. Nodes are made in source
+// order, so a position that repeats the last one reuses its entry.
+class SourceLoc final
+{
+  public:
+    SourceLoc(const token_pos_t& pos);
+
+    operator token_pos_t() const;
+
+  private:
+    uint32_t index_;
+};
+
+// Drops every SourceLoc; the parse tree must be gone.
+void clear_source_locs();
+
 // Helper for token info.
 struct token_t {
     int id;
@@ -57,7 +74,7 @@ struct full_token_t {
     token_pos_t end;
 };
 
-#define MAX_TOKEN_DEPTH 4
+#define MAX_TOKEN_DEPTH 32
 
 struct token_buffer_t {
     // Total number of tokens parsed.
@@ -271,6 +288,13 @@ int lextok(token_t* tok);
 int lexpeek(int id);
 void lexpush(void);
 void lexclr(int clreol);
+
+// A point in the token stream the parser can come back to, to look further
+// ahead than lexpeek() allows. Tokens read past the mark stay buffered, so
+// lexrewind() hands them out again without lexing them twice. At most
+// MAX_TOKEN_DEPTH - 1 tokens may be read past a mark before rewinding.
+int lexmark();
+void lexrewind(int mark);
 const token_pos_t& current_pos();
 int matchtoken(int token);
 int tokeninfo(cell* val, char** str);
@@ -291,6 +315,9 @@ void markusage(symbol* sym, int usage);
 symbol* findglb(const char* name);
 symbol* findloc(const char* name);
 symbol* findconst(const char* name);
+symbol* findglb(sp::Atom* name);
+symbol* findloc(sp::Atom* name);
+symbol* findconst(sp::Atom* name);
 symbol* find_enumstruct_field(Type* type, const char* name);
 symbol* addsym(const char* name, cell addr, int ident, int vclass, int tag);
 symbol* addvariable(const char* name, cell addr, int ident, int vclass, int tag, int dim[],
@@ -298,6 +325,7 @@ symbol* addvariable(const char* name, cell addr, int ident, int vclass, int tag,
 symbol* addvariable2(const char* name, cell addr, int ident, int vclass, int tag, int dim[],
                      int numdim, int idxtag[], int slength);
 symbol* addvariable3(declinfo_t* decl, cell addr, int vclass, int slength);
+void mark_flat_array(symbol* sym);
 void declare_methodmap_symbol(methodmap_t* map, bool can_redef);
 void declare_handle_intrinsics();
 int getlabel(void);
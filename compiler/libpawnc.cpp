@@ -29,6 +29,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "compile-cache.h"
 #include "memfile.h"
 #include "sc.h"
 
@@ -52,6 +56,12 @@ pc_printf(const char* message, ...)
     ret = vprintf(message, argptr);
     va_end(argptr);
 
+    if (gCompileCache.active()) {
+        va_start(argptr, message);
+        gCompileCache.noteOutputVA(message, argptr);
+        va_end(argptr);
+    }
+
     return ret;
 }
 
@@ -63,8 +73,104 @@ typedef struct src_file_s {
     char* pos;        // IO position.
     char* end;        // End of buffer.
     size_t maxlength; // Maximum length of the writable buffer.
+    bool cached;      // Buffer is owned by sSourceCache.
 } src_file_t;
 
+// Every pass re-reads the main file and all of its includes, probing each
+// include path and extension along the way, so source files are only read
+// from disk the first time a compile opens them. Entries outlive the compile
+// (so a process running several compiles parses shared includes, like
+// sourcemod.inc, from memory), but each later compile first checks that the
+// file has not changed since it was read.
+struct CachedSource {
+    bool exists;
+    std::string text;
+#if defined __linux__ || defined __FreeBSD__ || defined __OpenBSD__ || defined DARWIN
+    time_t mtime;
+    off_t size;
+#endif
+    unsigned generation; // The compile that last validated this entry.
+};
+static std::unordered_map<std::string, std::unique_ptr<CachedSource>> sSourceCache;
+static unsigned sSourceGeneration = 0;
+
+static bool
+ReadSourceFile(const char* filename, CachedSource* source)
+{
+#if defined __linux__ || defined __FreeBSD__ || defined __OpenBSD__ || defined DARWIN
+    struct stat fileInfo;
+    if (stat(filename, &fileInfo) != 0) {
+        return false;
+    }
+
+    if (S_ISDIR(fileInfo.st_mode)) {
+        return false;
+    }
+    source->mtime = fileInfo.st_mtime;
+    source->size = fileInfo.st_size;
+#endif
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    bool ok = false;
+    long length;
+    if (fseek(fp, 0, SEEK_END) != -1 && (length = ftell(fp)) != -1 &&
+        fseek(fp, 0, SEEK_SET) != -1)
+    {
+        source->text.resize(length);
+        ok = length == 0 || fread(&source->text[0], length, 1, fp) == 1;
+    }
+    fclose(fp);
+    return ok;
+}
+
+// Returns whether a source read by an earlier compile is still current.
+static bool
+IsSourceCurrent(const char* filename, const CachedSource* source)
+{
+#if defined __linux__ || defined __FreeBSD__ || defined __OpenBSD__ || defined DARWIN
+    struct stat fileInfo;
+    if (stat(filename, &fileInfo) != 0 || S_ISDIR(fileInfo.st_mode))
+        return !source->exists;
+    return source->exists && fileInfo.st_mtime == source->mtime &&
+           fileInfo.st_size == source->size;
+#else
+    return false;
+#endif
+}
+
+static CachedSource*
+FindSource(const char* filename)
+{
+    std::unique_ptr<CachedSource>& source = sSourceCache[filename];
+    if (!source || (source->generation != sSourceGeneration &&
+                    !IsSourceCurrent(filename, source.get())))
+    {
+        source.reset(new CachedSource);
+        source->exists = ReadSourceFile(filename, source.get());
+        if (!source->exists)
+            source->text.clear();
+    }
+    source->generation = sSourceGeneration;
+    return source.get();
+}
+
+/* pc_srctext()
+ * Returns the contents of a source file, as pc_opensrc() would read it, or
+ * NULL if it can't be read. The text stays valid until the file is read
+ * again.
+ */
+const std::string*
+pc_srctext(const char* filename)
+{
+    CachedSource* source = FindSource(filename);
+    if (!source->exists)
+        return NULL;
+    return &source->text;
+}
+
 /* pc_opensrc()
  * Opens a source file (or include file) for reading. The "file" does not have
  * to be a physical file, one might compile from memory.
@@ -80,46 +186,30 @@ typedef struct src_file_s {
 void*
 pc_opensrc(char* filename)
 {
-    FILE* fp = NULL;
-    long length;
-    src_file_t* src = NULL;
-
-#if defined __linux__ || defined __FreeBSD__ || defined __OpenBSD__ || defined DARWIN
-    struct stat fileInfo;
-    if (stat(filename, &fileInfo) != 0) {
-        return NULL;
-    }
-
-    if (S_ISDIR(fileInfo.st_mode)) {
+    CachedSource* source = FindSource(filename);
+    gCompileCache.noteSource(filename, source->exists ? &source->text : nullptr);
+    if (!source->exists)
         return NULL;
-    }
-#endif
 
-    if ((fp = fopen(filename, "rb")) == NULL)
+    src_file_t* src = (src_file_t*)calloc(1, sizeof(src_file_t));
+    if (!src)
         return NULL;
-    if (fseek(fp, 0, SEEK_END) == -1)
-        goto err;
-    if ((length = ftell(fp)) == -1)
-        goto err;
-    if (fseek(fp, 0, SEEK_SET) == -1)
-        goto err;
-
-    if ((src = (src_file_t*)calloc(1, sizeof(src_file_t))) == NULL)
-        goto err;
-    if ((src->buffer = (char*)calloc(length, sizeof(char))) == NULL)
-        goto err;
-    if (fread(src->buffer, length, 1, fp) != 1)
-        goto err;
-
+    src->buffer = &source->text[0];
     src->pos = src->buffer;
-    src->end = src->buffer + length;
-    fclose(fp);
+    src->end = src->buffer + source->text.size();
+    src->cached = true;
     return src;
+}
 
-err:
-    pc_closesrc(src);
-    fclose(fp);
-    return NULL;
+/* pc_agesrccache()
+ * Called at the end of a compile. Source files that were read stay cached,
+ * but must be checked for changes before the next compile uses them. Files
+ * opened with pc_opensrc() must all be closed first.
+ */
+void
+pc_agesrccache()
+{
+    sSourceGeneration++;
 }
 
 /* pc_createsrc()
@@ -137,6 +227,9 @@ err:
 void*
 pc_createsrc(char* filename)
 {
+    // The file is about to change, so it must be read again.
+    sSourceCache.erase(filename);
+
     src_file_t* src = (src_file_t*)calloc(1, sizeof(src_file_t));
     if (!src)
         return NULL;
@@ -170,7 +263,8 @@ pc_closesrc(void* handle)
         fwrite(src->buffer, src->pos - src->buffer, 1, src->fp);
         fclose(src->fp);
     }
-    free(src->buffer);
+    if (!src->cached)
+        free(src->buffer);
     free(src);
 }
 
@@ -19,11 +19,15 @@
 //  3.  This notice may not be removed or altered from any source distribution.
 #pragma once
 
+#include <string>
+
 struct memfile_t;
 
 void* pc_opensrc(char* filename); /* reading only */
+const std::string* pc_srctext(const char* filename);
 void* pc_createsrc(char* filename);
 void pc_closesrc(void* handle); /* never delete */
+void pc_agesrccache();
 char* pc_readsrc(void* handle, unsigned char* target, int maxchars);
 int pc_writesrc(void* handle, unsigned char* source);
 void* pc_getpossrc(void* handle);
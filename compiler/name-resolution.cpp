@@ -70,7 +70,7 @@ EnumDecl::Bind()
     constvalue* enumroot = nullptr;
     if (name_) {
         if (vclass_ == sGLOBAL) {
-            if ((enumsym = findglb(name_->chars())) != NULL) {
+            if ((enumsym = findglb(name_)) != NULL) {
                 // If we were previously defined as a methodmap, don't overwrite the
                 // symbol. Otherwise, flow into add_constant where we will error.
                 if (enumsym->ident != iMETHODMAP)
@@ -95,7 +95,7 @@ EnumDecl::Bind()
         enumsym = NULL;
 
     for (const auto& field : fields_ ) {
-        if (findconst(field.name->chars()))
+        if (findconst(field.name))
             error(field.pos, 50, field.name->chars());
 
         symbol* sym = add_constant(field.name->chars(), field.value, vclass_, tag);
@@ -209,10 +209,9 @@ ConstDecl::Bind()
 bool
 VarDecl::Bind()
 {
-    // :TODO: introduce find-by-atom to improve compiler speed
-    sym_ = findconst(name_->chars());
+    sym_ = findconst(name_);
     if (!sym_)
-        sym_ = findglb(name_->chars());
+        sym_ = findglb(name_);
 
     bool should_define = !!sym_;
 
@@ -244,11 +243,11 @@ SymbolExpr::Bind()
 {
     AutoErrorPos aep(pos_);
 
-    sym_ = findconst(name_->chars());
+    sym_ = findconst(name_);
     if (!sym_)
-        sym_ = findloc(name_->chars());
+        sym_ = findloc(name_);
     if (!sym_)
-        sym_ = findglb(name_->chars());
+        sym_ = findglb(name_);
 
     if (!sym_) {
         // We assume this is a function that hasn't been seen yet. We should
@@ -345,9 +344,9 @@ IsDefinedExpr::Bind()
 {
     AutoErrorPos aep(pos_);
 
-    symbol* sym = findloc(name_->chars());
+    symbol* sym = findloc(name_);
     if (!sym)
-        sym = findglb(name_->chars());
+        sym = findglb(name_);
     if (sym && sym->ident == iFUNCTN && !sym->defined)
         sym = nullptr;
     value_ = sym ? 1 : 0;
@@ -361,9 +360,9 @@ SizeofExpr::Bind()
 {
     AutoErrorPos aep(pos_);
 
-    sym_ = findloc(ident_->chars());
+    sym_ = findloc(ident_);
     if (!sym_)
-        sym_ = findglb(ident_->chars());
+        sym_ = findglb(ident_);
     if (!sym_) {
         error(pos_, 17, ident_->chars());
         return false;
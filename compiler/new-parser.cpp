@@ -465,8 +465,14 @@ Parser::expression(value* lval)
     expr->ProcessUses();
 
     *lval = expr->val();
-    if (cc_ok())
+    if (cc_ok()) {
+        // A call that is all of a returned expression may become a jump.
+        if (pc_tail_return && !lexpeek(',')) {
+            if (CallExpr* call = expr->AsCallExpr())
+                call->set_tail_return();
+        }
         expr->Emit();
+    }
 
     sideeffect = expr->HasSideEffects();
     return expr->lvalue();
@@ -49,9 +49,17 @@
  */
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h> /* for atoi() */
 #include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <smx/smx-headers.h>
 #include "emitter.h"
 #include "errors.h"
 #include "lexer.h"
@@ -83,6 +91,14 @@ static char* stgpipe = NULL;
 static int pipemax = 0; /* current size of the stage pipe, a second staging buffer */
 static int pipeidx = 0;
 
+/* While a function is generated, its finished code collects here, and is
+ * written to the file when the function ends. The buffer is kept from one
+ * function to the next, unless a function was unusually large.
+ */
+static std::string sFunctionCode;
+static bool sInFunction = false;
+static const size_t kFunctionCodeKeep = 1024 * 1024;
+
 #define CHECK_STGBUFFER(index)  \
     if ((int)(index) >= stgmax) \
     grow_stgbuffer(&stgbuf, &stgmax, (index) + 1)
@@ -128,6 +144,8 @@ stgbuffer_cleanup(void)
         pipemax = 0;
         pipeidx = 0;
     }
+    std::string().swap(sFunctionCode);
+    sInFunction = false;
 }
 
 /* the variables "stgidx" and "staging" are declared in "scvars.c" */
@@ -176,9 +194,36 @@ rebuffer(char* str)
 static int
 filewrite(char* str)
 {
-    if (sc_status == statWRITE)
-        return pc_writeasm(outf, str);
-    return TRUE;
+    if (sc_status != statWRITE)
+        return TRUE;
+    if (sInFunction) {
+        sFunctionCode += str;
+        return TRUE;
+    }
+    return pc_writeasm(outf, str);
+}
+
+/*  stgfunction
+ *
+ *  Starts or stops collecting the code of one function. On stopping, the
+ *  function is written to the output file as a whole, and the buffer is
+ *  emptied for the next one.
+ *
+ *  Global references: sFunctionCode (altered)
+ */
+void
+stgfunction(int onoff)
+{
+    assert(!onoff != !sInFunction);
+    sInFunction = !!onoff;
+    if (onoff)
+        return;
+
+    if (!sFunctionCode.empty())
+        pc_writeasm(outf, sFunctionCode.c_str());
+    sFunctionCode.clear();
+    if (sFunctionCode.capacity() > kFunctionCodeKeep)
+        std::string().swap(sFunctionCode);
 }
 
 /*  stgwrite
@@ -416,12 +461,96 @@ stgset(int onoff)
  */
 static SEQUENCE* sequences = sequences_cmp;
 
+static bool
+istokenend(char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '!';
+}
+
+/* The sequences are indexed by the mnemonic they start with, so that for
+ * each line stgopt() only tries the sequences that can possibly match it.
+ * Each list keeps the table's order (longest sequences first), and also
+ * holds the sequences that start with a pattern rather than a mnemonic.
+ */
+static std::unordered_map<std::string, std::vector<int>> seqindex;
+static std::vector<int> seqgeneric; /* for lines whose mnemonic starts no sequence */
+static int seqmacros = 0;           /* index of the separator before the macro sequences */
+static int seqmaxlines = 0;         /* the most lines any sequence matches */
+
 int
 phopt_init(void)
 {
+    seqindex.clear();
+    seqgeneric.clear();
+    seqmacros = INT_MAX;
+    seqmaxlines = 0;
+
+    std::vector<std::string> tokens;
+    for (int seq = 0; sequences[seq].find != NULL; seq++) {
+        const char* find = sequences[seq].find;
+        if (*find == '\0') {
+            if (seqmacros == INT_MAX)
+                seqmacros = seq;
+            tokens.push_back(std::string());
+            continue;
+        }
+
+        int lines = 0;
+        for (const char* ptr = find; *ptr; ptr++) {
+            if (*ptr == '!')
+                lines++;
+        }
+        seqmaxlines = std::max(seqmaxlines, lines);
+
+        size_t length = 0;
+        while (!istokenend(find[length]))
+            length++;
+        if (strcspn(find, "%-") < length) {
+            tokens.push_back(std::string());
+            seqgeneric.push_back(seq);
+        } else {
+            std::string token(find, length);
+            for (char& c : token)
+                c = (char)tolower(c);
+            tokens.push_back(token);
+            seqindex[tokens.back()];
+        }
+    }
+
+    /* Build each list in table order. */
+    for (int seq = 0; seq < (int)tokens.size(); seq++) {
+        if (tokens[seq].empty()) {
+            if (*sequences[seq].find == '\0')
+                continue;
+            for (auto& entry : seqindex)
+                entry.second.push_back(seq);
+        } else {
+            seqindex[tokens[seq]].push_back(seq);
+        }
+    }
     return TRUE;
 }
 
+/* Returns the sequences that may match the line at "start". */
+static const std::vector<int>&
+seqcandidates(const char* start)
+{
+    while (*start == '\t' || *start == ' ')
+        start++;
+
+    size_t length = 0;
+    char token[sNAMEMAX + 1];
+    while (!istokenend(start[length]) && length < sNAMEMAX) {
+        token[length] = (char)tolower(start[length]);
+        length++;
+    }
+
+    auto iter = seqindex.find(std::string(token, length));
+    if (iter == seqindex.end())
+        return seqgeneric;
+    return iter->second;
+}
+
 int
 phopt_cleanup(void)
 {
@@ -618,62 +747,63 @@ static void
 stgopt(char* start, char* end, int (*outputfunc)(char* str))
 {
     char symbols[MAX_OPT_VARS][MAX_ALIAS + 1];
-    int seq, match_length, repl_length;
-    int matches;
+    int match_length, repl_length;
     char* debut = start; /* save original start of the buffer */
+    sp::AutoPhase phase(gPhaseTimer, kPhasePeephole);
 
     assert(sequences != NULL);
     /* do not match anything if debug-level is maximum */
     if (pc_optimize > sOPTIMIZE_NONE && sc_status == statWRITE) {
-        do {
-            matches = 0;
-            start = debut;
-            while (start < end) {
-                seq = 0;
-                while (sequences[seq].find != NULL) {
-                    assert(seq >= 0);
-                    if (*sequences[seq].find == '\0') {
-                        if (pc_optimize == sOPTIMIZE_NOMACRO) {
-                            break; /* don't look further */
-                        } else {
-                            seq++; /* continue with next string */
-                            continue;
-                        }
-                    }
-                    if (matchsequence(start, end, sequences[seq].find, symbols, &match_length)) {
-                        char* replace =
-                            replacesequence(sequences[seq].replace, symbols, &repl_length);
-                        /* If the replacement is bigger than the original section, we may need
-                         * to "grow" the staging buffer. This is quite complex, due to the
-                         * re-ordering of expressions that can also happen in the staging
-                         * buffer. In addition, it should not happen: the peephole optimizer
-                         * must replace sequences with *shorter* sequences, not longer ones.
-                         * So, I simply forbid sequences that are longer than the ones they
-                         * are meant to replace.
-                         */
-                        assert(match_length >= repl_length);
-                        if (match_length >= repl_length) {
-                            strreplace(start, replace, match_length, repl_length,
-                                       (int)(end - start));
-                            end -= match_length - repl_length;
-                            free(replace);
-                            code_idx -= sequences[seq].savesize;
-                            seq = 0; /* restart search for matches */
-                            matches++;
-                        } else {
-                            /* actually, we should never get here (match_length<repl_length) */
-                            assert(0);
-                            seq++;
-                        }
-                    } else {
-                        seq++;
-                    }
+        int limit = (pc_optimize == sOPTIMIZE_NOMACRO) ? seqmacros : INT_MAX;
+        uint32_t features = 0;
+        if (pc_code_version >= sp::SmxConsts::CODE_VERSION_FEATURE_MASK)
+            features = sp::SmxConsts::kCodeFeatureFusedIndex;
+        while (start < end) {
+            bool replaced = false;
+            for (int seq : seqcandidates(start)) {
+                if (seq >= limit)
+                    break; /* don't look further */
+                if (sequences[seq].features & ~features)
+                    continue;
+                if (!matchsequence(start, end, sequences[seq].find, symbols, &match_length))
+                    continue;
+
+                char* replace = replacesequence(sequences[seq].replace, symbols, &repl_length);
+                /* If the replacement is bigger than the original section, we may need
+                 * to "grow" the staging buffer. This is quite complex, due to the
+                 * re-ordering of expressions that can also happen in the staging
+                 * buffer. In addition, it should not happen: the peephole optimizer
+                 * must replace sequences with *shorter* sequences, not longer ones.
+                 * So, I simply forbid sequences that are longer than the ones they
+                 * are meant to replace.
+                 */
+                assert(match_length >= repl_length);
+                if (match_length >= repl_length) {
+                    strreplace(start, replace, match_length, repl_length, (int)(end - start));
+                    end -= match_length - repl_length;
+                    code_idx -= sequences[seq].savesize;
+                    replaced = true;
                 }
-                assert(sequences[seq].find == NULL ||
-                       (*sequences[seq].find == '\0' && pc_optimize == sOPTIMIZE_NOMACRO));
+                free(replace);
+                if (replaced)
+                    break;
+            }
+
+            if (!replaced) {
                 start += strlen(start) + 1; /* to next string */
-            }                               /* while (start<end) */
-        } while (matches > 0);
+                continue;
+            }
+
+            /* The replacement may complete a sequence that starts on one of the
+             * preceding lines, so back up as far as the longest sequence reaches,
+             * instead of scanning the whole buffer again.
+             */
+            for (int lines = 1; lines < seqmaxlines && start > debut; lines++) {
+                start--; /* onto the '\0' ending the previous line */
+                while (start > debut && *(start - 1) != '\0')
+                    start--;
+            }
+        }
     } /* if (pc_optimize>sOPTIMIZE_NONE && sc_status==statWRITE) */
 
     for (start = debut; start < end; start += strlen(start) + 1)
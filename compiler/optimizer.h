@@ -28,5 +28,6 @@ void stgout(int index);
 void stgdel(int index, cell code_index);
 int stgget(int* index, cell* code_index);
 void stgset(int onoff);
+void stgfunction(int onoff);
 int phopt_init(void);
 int phopt_cleanup(void);
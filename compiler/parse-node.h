@@ -52,6 +52,7 @@ typedef void (*OpFunc)();
 
 class Expr;
 class BinaryExpr;
+class CallExpr;
 class DefaultArgExpr;
 class StringExpr;
 class StructExpr;
@@ -75,7 +76,7 @@ class ParseNode : public PoolObject
         return false;
     }
 
-    const token_pos_t& pos() const {
+    token_pos_t pos() const {
         return pos_;
     }
 
@@ -88,7 +89,7 @@ class ParseNode : public PoolObject
     void error(int number, ...) = delete;
 
   protected:
-    token_pos_t pos_;
+    SourceLoc pos_;
 };
 
 class Stmt : public ParseNode
@@ -209,7 +210,7 @@ struct EnumField {
     EnumField(const token_pos_t& pos, sp::Atom* name, cell value)
       : pos(pos), name(name), value(value)
     {}
-    token_pos_t pos;
+    SourceLoc pos;
     sp::Atom* name;
     cell value;
 };
@@ -239,7 +240,7 @@ struct StructField {
       : pos(pos), name(name), type(typeinfo)
     {}
 
-    token_pos_t pos;
+    SourceLoc pos;
     sp::Atom* name;
     typeinfo_t type;
 };
@@ -316,9 +317,24 @@ class UsingDecl : public Decl
 
 class Expr : public ParseNode
 {
+  protected:
+    // Classes with a cast below set their kind, so the casts are a compare
+    // instead of a virtual call.
+    enum class Kind : uint8_t {
+        Other,
+        Binary,
+        DefaultArg,
+        Symbol,
+        Struct,
+        String,
+        TaggedValue,
+        Call
+    };
+
   public:
-    explicit Expr(const token_pos_t& pos)
-      : ParseNode(pos)
+    explicit Expr(const token_pos_t& pos, Kind kind = Kind::Other)
+      : ParseNode(pos),
+        kind_(kind)
     {}
 
     // Flatten a series of binary expressions into a single list.
@@ -353,18 +369,20 @@ class Expr : public ParseNode
     }
 
     // Casts.
-    virtual BinaryExpr* AsBinaryExpr() { return nullptr; }
-    virtual DefaultArgExpr* AsDefaultArgExpr() {  return nullptr; }
-    virtual SymbolExpr* AsSymbolExpr() { return nullptr; }
-    virtual StructExpr* AsStructExpr() { return nullptr; }
-    virtual StringExpr* AsStringExpr() { return nullptr; }
-    virtual TaggedValueExpr* AsTaggedValueExpr() { return nullptr; }
+    inline BinaryExpr* AsBinaryExpr();
+    inline CallExpr* AsCallExpr();
+    inline DefaultArgExpr* AsDefaultArgExpr();
+    inline SymbolExpr* AsSymbolExpr();
+    inline StructExpr* AsStructExpr();
+    inline StringExpr* AsStringExpr();
+    inline TaggedValueExpr* AsTaggedValueExpr();
 
   protected:
     virtual void DoEmit() = 0;
 
   protected:
     value val_ = {};
+    Kind kind_;
     bool lvalue_ = 0;
 };
 
@@ -464,9 +482,6 @@ class BinaryExpr final : public BinaryExprBase
     bool Analyze() override;
     void DoEmit() override;
 
-    BinaryExpr* AsBinaryExpr() override {
-        return this;
-    }
     OpFunc oper() const {
         return oper_;
     }
@@ -504,7 +519,7 @@ struct CompareOp
 {
     CompareOp(const token_pos_t& pos, int token, Expr* expr);
 
-    token_pos_t pos;
+    SourceLoc pos;
     int token;
     Expr* expr;
     OpFunc oper;
@@ -662,7 +677,7 @@ class SymbolExpr final : public Expr
 {
   public:
     SymbolExpr(const token_pos_t& pos, sp::Atom* name)
-      : Expr(pos),
+      : Expr(pos, Kind::Symbol),
         name_(name),
         sym_(nullptr)
     {
@@ -674,9 +689,6 @@ class SymbolExpr final : public Expr
     void ProcessUses() override {}
     symbol* BindCallTarget(int token, Expr** implicit_this) override;
     symbol* BindNewTarget() override;
-    SymbolExpr* AsSymbolExpr() override {
-        return this;
-    }
 
     bool AnalyzeWithOptions(bool allow_types);
 
@@ -708,7 +720,7 @@ class CallExpr final : public Expr
 {
   public:
     CallExpr(const token_pos_t& pos, int token, Expr* target)
-      : Expr(pos),
+      : Expr(pos, Kind::Call),
         token_(token),
         target_(target)
     {}
@@ -726,8 +738,24 @@ class CallExpr final : public Expr
         return args_;
     }
 
+    // Whether the returned array can be written straight into a destination
+    // of |cells| cells.
+    bool CanReturnInto(cell cells) const;
+
+    // The address in PRI becomes the hidden return buffer, instead of a heap
+    // temporary the caller would copy out of.
+    void set_return_into_pri() {
+        return_into_pri_ = true;
+    }
+
+    // The call is all of a returned expression.
+    void set_tail_return() {
+        tail_return_ = true;
+    }
+
   private:
     bool ProcessArg(arginfo* arg, Expr* param, unsigned int pos);
+    bool IsSelfTailCall() const;
 
     int token_;
     Expr* target_;
@@ -735,6 +763,8 @@ class CallExpr final : public Expr
     symbol* sym_ = nullptr;
     Expr* implicit_this_ = nullptr;
     PoolList<ComputedArg> argv_;
+    bool return_into_pri_ = false;
+    bool tail_return_ = false;
 };
 
 class EmitOnlyExpr : public Expr
@@ -775,9 +805,6 @@ class DefaultArgExpr final : public EmitOnlyExpr
   public:
     DefaultArgExpr(const token_pos_t& pos, arginfo* arg);
 
-    DefaultArgExpr* AsDefaultArgExpr() override {
-        return this;
-    }
     void DoEmit() override;
     void ProcessUses() override {}
 
@@ -915,7 +942,7 @@ class TaggedValueExpr : public Expr
 {
   public:
     TaggedValueExpr(const token_pos_t& pos, int tag, cell value)
-      : Expr(pos),
+      : Expr(pos, Kind::TaggedValue),
         tag_(tag),
         value_(value)
     {}
@@ -923,9 +950,6 @@ class TaggedValueExpr : public Expr
     bool Analyze() override;
     void DoEmit() override;
     void ProcessUses() override {}
-    TaggedValueExpr* AsTaggedValueExpr() override {
-        return this;
-    }
 
     int tag() const {
         return tag_;
@@ -959,23 +983,28 @@ class StringExpr final : public Expr
 {
   public:
     StringExpr(const token_pos_t& pos, const char* str, size_t len)
-      : Expr(pos),
-        text_(new PoolString(str, len))
+      : Expr(pos, Kind::String),
+        text_(new PoolString(str, len)),
+        shared_(false)
     {}
 
     bool Analyze() override;
     void DoEmit() override;
     void ProcessUses() override {}
-    StringExpr* AsStringExpr() override {
-        return this;
-    }
 
     PoolString* text() const {
         return text_;
     }
 
+    // Set when nothing can write to the literal, so it may share storage
+    // with an identical one.
+    void set_shared() {
+        shared_ = true;
+    }
+
   private:
     PoolString* text_;
+    bool shared_;
 };
 
 class ArrayExpr final : public Expr
@@ -1010,7 +1039,7 @@ class StructExpr final : public Expr
 {
   public:
     explicit StructExpr(const token_pos_t& pos)
-        : Expr(pos)
+        : Expr(pos, Kind::Struct)
     {}
 
     bool Analyze() override {
@@ -1022,9 +1051,6 @@ class StructExpr final : public Expr
     void DoEmit() override {
         assert(false);
     }
-    StructExpr* AsStructExpr() override {
-        return this;
-    }
 
     PoolList<StructInitField>& fields() {
         return fields_;
@@ -1033,3 +1059,45 @@ class StructExpr final : public Expr
   private:
     PoolList<StructInitField> fields_;
 };
+
+inline BinaryExpr*
+Expr::AsBinaryExpr()
+{
+    return kind_ == Kind::Binary ? static_cast<BinaryExpr*>(this) : nullptr;
+}
+
+inline CallExpr*
+Expr::AsCallExpr()
+{
+    return kind_ == Kind::Call ? static_cast<CallExpr*>(this) : nullptr;
+}
+
+inline DefaultArgExpr*
+Expr::AsDefaultArgExpr()
+{
+    return kind_ == Kind::DefaultArg ? static_cast<DefaultArgExpr*>(this) : nullptr;
+}
+
+inline SymbolExpr*
+Expr::AsSymbolExpr()
+{
+    return kind_ == Kind::Symbol ? static_cast<SymbolExpr*>(this) : nullptr;
+}
+
+inline StructExpr*
+Expr::AsStructExpr()
+{
+    return kind_ == Kind::Struct ? static_cast<StructExpr*>(this) : nullptr;
+}
+
+inline StringExpr*
+Expr::AsStringExpr()
+{
+    return kind_ == Kind::String ? static_cast<StringExpr*>(this) : nullptr;
+}
+
+inline TaggedValueExpr*
+Expr::AsTaggedValueExpr()
+{
+    return kind_ == Kind::TaggedValue ? static_cast<TaggedValueExpr*>(this) : nullptr;
+}
@@ -32,6 +32,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <string>
+#include <unordered_set>
 #include <utility>
 
 #include <amtl/am-platform.h>
@@ -39,7 +41,9 @@
 #include <amtl/am-string.h>
 #include <amtl/am-unused.h>
 #include <amtl/experimental/am-argparser.h>
+#include <smx/smx-headers.h>
 
+#include "compile-cache.h"
 #include "new-parser.h"
 #include "types.h"
 
@@ -109,6 +113,7 @@ static char* get_extension(char* filename);
 static void setopt(int argc, char** argv, char* oname, char* ename, char* pname);
 static void setconfig(char* root);
 static void setcaption(void);
+static bool write_depfile(const char* depfname, const char* target);
 static void setconstants(void);
 static void declloc(int tokid);
 static void dodelete();
@@ -119,9 +124,11 @@ static cell initarray(int ident, int tag, int dim[], int numdim, int cur, int st
 static cell initvector(int ident, int tag, cell size, int fillzero, constvalue* enumroot,
                        int* errorfound);
 static void initials3(declinfo_t* decl);
+static void flatten_array(typeinfo_t* type, int curlit);
 static cell fix_char_size(declinfo_t* decl);
 static cell init(int ident, int* tag, int* errorfound);
 static int declargs(symbol* sym, int chkshadow, const int* thistag);
+static void skip_function_body();
 static void doarg(symbol* sym, declinfo_t* decl, int offset, int chkshadow, arginfo* arg);
 static void reduce_referrers(symbol* root);
 static void deduce_liveness(symbol* root);
@@ -178,6 +185,14 @@ static int wq[wqTABSZ];               /* "while queue", internal stack for neste
 static int* wqptr;                    /* pointer to next entry */
 static char* sc_documentation = NULL; /* main documentation */
 static int sReturnType = RETURN_NONE;
+
+/* statements parsed so far in the current function body, and the statement
+ * count at a "return <constant>;" (0 if there was none), used to spot
+ * functions that only return a constant
+ */
+static int sFuncStatements = 0;
+static int sConstReturnAt = 0;
+static cell sConstReturnValue = 0;
 #if defined __WIN32__ || defined _WIN32 || defined _Windows
 static HWND hwndFinish = 0;
 #endif
@@ -187,6 +202,12 @@ char g_tmpfile[_MAX_PATH] = {0};
 
 args::ToggleOption opt_show_stats(nullptr, "--show-stats", Some(false),
                                   "Show compiler statistics on exit.");
+args::ToggleOption opt_time_phases(nullptr, "--time-phases", Some(false),
+                                   "Show the time and memory spent in each compiler phase.");
+args::StringOption opt_dep_file(nullptr, "--dep-file", {},
+                                "Write a Makefile dependency file listing the files read.");
+args::StringOption opt_cache_dir(nullptr, "--cache-dir", {},
+                                 "Reuse unchanged compiles' output, cached in this directory.");
 
 #ifdef __EMSCRIPTEN__
 EM_JS(void, setup_emscripten_fs, (), {
@@ -206,13 +227,19 @@ pc_compile(int argc, char* argv[]) {
     int retcode;
     char incfname[_MAX_PATH];
     void* inpfmark;
-    int lcl_needsemicolon, lcl_tabsize, lcl_require_newdecls;
+    int lcl_needsemicolon, lcl_tabsize, lcl_require_newdecls, lcl_flat_arrays;
     char* ptr;
+    bool cache_hit = false;
 
 #ifdef __EMSCRIPTEN__
     setup_emscripten_fs();
 #endif
 
+    /* everything pool-allocated during the compile is released in one go at
+     * the end, so repeated compiles in --server mode don't accumulate it
+     */
+    char* pool_mark = gPoolAllocator.enter();
+
     /* set global variables to their initial value */
     initglobals();
     errorset(sRESET, 0);
@@ -239,6 +266,8 @@ pc_compile(int argc, char* argv[]) {
         error(FATAL_ERROR_OOM); /* insufficient memory */
 
     setopt(argc, argv, outfname, errfname, incfname);
+    if (opt_time_phases.value())
+        gPhaseTimer.start();
     strcpy(binfname, outfname);
     ptr = get_extension(binfname);
     if (ptr != NULL && stricmp(ptr, ".asm") == 0)
@@ -258,12 +287,29 @@ pc_compile(int argc, char* argv[]) {
     sc_ctrlchar_org = sc_ctrlchar;
     lcl_needsemicolon = sc_needsemicolon;
     lcl_require_newdecls = sc_require_newdecls;
+    lcl_flat_arrays = sc_flat_arrays;
     lcl_tabsize = sc_tabsize;
 
     /* optionally create a temporary input file that is a collection of all
      * input files
      */
     assert(get_sourcefile(0) != NULL); /* there must be at least one source file */
+
+    /* a compile whose inputs are unchanged since it was cached is replayed
+     * instead; this is only done for a single source file compiled to a lone .smx,
+     * with messages on the console and no output that measures the compile
+     */
+    if (opt_cache_dir.hasValue() && get_sourcefile(1) == NULL && !(sc_asmfile || sc_listing) &&
+        strlen(errfname) == 0 && !opt_time_phases.value() && !opt_show_stats.value() &&
+        !opt_dep_file.hasValue() && sc_split_debug.empty() && sc_native_manifest.empty())
+    {
+        if (gCompileCache.lookup(opt_cache_dir.value().c_str(), argc, argv, binfname, &retcode))
+        {
+            cache_hit = true;
+            goto cleanup;
+        }
+    }
+
     if (get_sourcefile(1) != NULL) {
         /* there are at least two or more source files */
         char *tname, *sname;
@@ -349,6 +395,7 @@ pc_compile(int argc, char* argv[]) {
         sc_ctrlchar = sc_ctrlchar_org;
         sc_needsemicolon = lcl_needsemicolon;
         sc_require_newdecls = lcl_require_newdecls;
+        sc_flat_arrays = lcl_flat_arrays;
         sc_tabsize = lcl_tabsize;
         errorset(sRESET, 0);
         /* reset the source file */
@@ -367,10 +414,12 @@ pc_compile(int argc, char* argv[]) {
                 error(FATAL_ERROR_READ, incfname);
             }
         }
+        gPhaseTimer.enter(kPhaseParse);
         preprocess(); /* fetch first line */
 
         Parser parser;
         parser.parse();      /* process all input */
+        gPhaseTimer.leave();
 
         sc_parsenum++;
     } while (sc_reparse);
@@ -403,6 +452,7 @@ pc_compile(int argc, char* argv[]) {
     sc_ctrlchar = sc_ctrlchar_org;
     sc_needsemicolon = lcl_needsemicolon;
     sc_require_newdecls = lcl_require_newdecls;
+    sc_flat_arrays = lcl_flat_arrays;
     sc_tabsize = lcl_tabsize;
     errorset(sRESET, 0);
     /* reset the source file */
@@ -411,6 +461,7 @@ pc_compile(int argc, char* argv[]) {
     pc_resetsrc(inpf, inpfmark); /* reset file position */
     lexinit();                   /* clear internal flags of lex() */
     sc_status = statWRITE;       /* allow to write --this variable was reset by resetglobals() */
+    gPhaseTimer.enter(kPhaseCodegen);
     writeleader(&glbtab);
     insert_dbgfile(inpfname);   /* attach to debug information */
     insert_inputfile(inpfname); /* save for the error system */
@@ -424,6 +475,7 @@ pc_compile(int argc, char* argv[]) {
 
     /* inpf is already closed when readline() attempts to pop of a file */
     writetrailer(); /* write remaining stuff */
+    gPhaseTimer.leave();
 
     entry = testsymbols(&glbtab, 0, TRUE, FALSE); /* test for unused or undefined
                                                    * functions and variables */
@@ -438,9 +490,14 @@ cleanup:
     }
 
     // Write the binary file.
-    if (!(sc_asmfile || sc_listing) && errnum == 0 && jmpcode == 0) {
+    if (!(sc_asmfile || sc_listing) && errnum == 0 && jmpcode == 0 && !cache_hit) {
         pc_resetasm(outf);
         assemble(binfname, outf);
+
+        if (opt_dep_file.hasValue() && !write_depfile(opt_dep_file.value().c_str(), binfname)) {
+            pc_printf("error: could not write %s\n", opt_dep_file.value().c_str());
+            errnum++;
+        }
     }
 
     if (outf != NULL) {
@@ -448,7 +505,13 @@ cleanup:
         outf = NULL;
     }
 
-    if (errnum == 0 && strlen(errfname) == 0) {
+    // A fatal error may have left phases open; stop() closes them.
+    if (gPhaseTimer.enabled()) {
+        gPhaseTimer.stop();
+        gPhaseTimer.report(stdout);
+    }
+
+    if (errnum == 0 && strlen(errfname) == 0 && !cache_hit) {
         if ((!norun && (sc_debug & sSYMBOLIC) != 0) || verbosity >= 2) {
             pc_printf("Code size:         %8ld bytes\n", (long)code_idx);
             pc_printf("Data size:         %8ld bytes\n", (long)glb_declared * sizeof(cell));
@@ -464,6 +527,12 @@ cleanup:
             pc_printf("Pool allocation:   %8" KE_FMT_SIZET " bytes\n", allocated);
             pc_printf("Pool unused:       %8" KE_FMT_SIZET " bytes\n", reserved - allocated);
             pc_printf("Pool bookkeeping:  %8" KE_FMT_SIZET " bytes\n", bookkeeping);
+
+            size_t encoded, stored;
+            type_data_stats(&encoded, &stored);
+            pc_printf("Type data:         %8" KE_FMT_SIZET " bytes (%" KE_FMT_SIZET
+                      " encoded, %.1f%% shared)\n",
+                      stored, encoded, encoded ? 100.0 * (encoded - stored) / encoded : 0.0);
         }
     }
 
@@ -477,6 +546,7 @@ cleanup:
         free(litq);
     phopt_cleanup();
     stgbuffer_cleanup();
+    pc_agesrccache();
 
     gCurrentFileStack.clear();
     gCurrentLineStack.clear();
@@ -503,7 +573,11 @@ cleanup:
     if (sc_documentation != NULL)
         free(sc_documentation);
     delete_autolisttable();
-    if (errnum != 0) {
+    gPoolAllocator.leave(pool_mark);
+    clear_source_locs();
+    if (cache_hit) {
+        /* the replayed output already ended with the summary */
+    } else if (errnum != 0) {
         if (strlen(errfname) == 0)
             pc_printf("\n%d Error%s.\n", errnum, (errnum > 1) ? "s" : "");
         retcode = 1;
@@ -516,6 +590,7 @@ cleanup:
         if (retcode == 0 && verbosity >= 2)
             pc_printf("\nDone.\n");
     }
+    gCompileCache.finish(binfname, retcode);
 #if defined __WIN32__ || defined _WIN32 || defined _Windows
     if (IsWindow(hwndFinish))
         PostMessageA(hwndFinish, RegisterWindowMessageA("PawnNotify"), retcode, 0L);
@@ -531,6 +606,54 @@ pc_addconstant(const char* name, cell value, int tag) {
     return 1;
 }
 
+/* Make needs spaces, '#' and '$' escaped; Ninja reads depfiles the same way. */
+static std::string
+escape_dependency(const char* path) {
+    std::string escaped;
+    for (const char* iter = path; *iter; iter++) {
+        if (*iter == ' ' || *iter == '#')
+            escaped.push_back('\\');
+        else if (*iter == '$')
+            escaped.push_back('$');
+        escaped.push_back(*iter);
+    }
+    return escaped;
+}
+
+/* write_depfile
+ *
+ * Writes "target: files" for every file the last pass read (the files named
+ * on the command line, rather than the temporary file that joins them), and
+ * an empty rule for each file so the build doesn't fail when an include is
+ * deleted.
+ */
+static bool
+write_depfile(const char* depfname, const char* target) {
+    std::vector<std::string> files;
+    std::unordered_set<std::string> seen;
+    for (int i = 0; char* name = get_inputfile(i); i++) {
+        if (g_tmpfile[0] != '\0' && strcmp(name, g_tmpfile) == 0) {
+            for (int j = 0; char* source = get_sourcefile(j); j++) {
+                if (seen.insert(source).second)
+                    files.push_back(source);
+            }
+        } else if (seen.insert(name).second) {
+            files.push_back(name);
+        }
+    }
+
+    FILE* fp = fopen(depfname, "wt");
+    if (!fp)
+        return false;
+    fprintf(fp, "%s:", escape_dependency(target).c_str());
+    for (const auto& file : files)
+        fprintf(fp, " \\\n  %s", escape_dependency(file.c_str()).c_str());
+    fprintf(fp, "\n");
+    for (const auto& file : files)
+        fprintf(fp, "\n%s:\n", escape_dependency(file.c_str()).c_str());
+    return fclose(fp) == 0;
+}
+
 static void
 inst_binary_name(char* binfname) {
     size_t i, len;
@@ -658,6 +781,7 @@ initglobals(void) {
     litmax = sDEF_LITMAX;              /* current size of the literal table */
     errnum = 0;                        /* number of errors */
     warnnum = 0;                       /* number of warnings */
+    clear_reported_warnings();
     verbosity = 1;                     /* verbosity level, no copyright banner */
     sc_debug = sCHKBOUNDS | sSYMBOLIC; /* sourcemod: full debug stuff */
     pc_optimize = sOPTIMIZE_DEFAULT;   /* sourcemod: full optimization */
@@ -732,6 +856,21 @@ args::ToggleOption opt_listing("-l", "--listing", Some(false),
                                "Create list file (preprocess only)");
 args::IntOption opt_compression("-z", "--compress-level", Some(9),
                                 "Compression level, default 9 (0=none, 1=worst, 9=best)");
+args::StringOption opt_compression_codec("-Z", "--compress-codec", {},
+                                         "Compression codec, default zlib "
+                                         "(zlib, zlib-chunks, lz4)");
+args::IntOption opt_compression_threads(nullptr, "--compress-threads", Some(0),
+                                        "Threads for zlib-chunks, default 0 (one per core)");
+args::ToggleOption opt_page_aligned(nullptr, "--page-aligned", Some(false),
+                                    "Page-align sections, uncompressed, so the VM can map them");
+args::ToggleOption opt_compact_lines(nullptr, "--compact-lines", Some(false),
+                                     "Write debug line info compactly (needs a newer VM)");
+args::StringOption opt_split_debug(nullptr, "--split-debug", {},
+                                   "Write debug info to this file instead (needs a newer VM)");
+args::StringOption opt_native_manifest(nullptr, "--native-manifest", {},
+                                       "Record natives' places in this host manifest");
+args::ToggleOption opt_auto_stack(nullptr, "--auto-stack", Some(false),
+                                  "Size the stack/heap from the code, not #pragma dynamic");
 args::IntOption opt_tabsize("-t", "--tabsize", Some(8),
                             "TAB indent size (in character positions, default=8)");
 args::StringOption opt_verbosity("-v", "--verbose", {},
@@ -771,6 +910,8 @@ parseoptions(int argc, char** argv, char* oname, char* ename, char* pname)
 
     parser.add_usage_line("sym=val", "Define constant \"sym\" with value \"val\".");
     parser.add_usage_line("sym=", "Define constant \"sym\" with value 0.");
+    parser.add_usage_line("--server", "Compile one set of arguments per line of stdin.");
+    parser.add_usage_line("--server --jobs=N", "Same, running up to N compiles at once.");
 
     auto usage = "[options] <filename> [filename...]";
     parser.set_usage_line(usage);
@@ -783,6 +924,27 @@ parseoptions(int argc, char** argv, char* oname, char* ename, char* pname)
     sc_showincludes = opt_showincludes.value();
     sc_listing = opt_listing.value();
     sc_compression_level = opt_compression.value();
+    if (opt_compression_codec.hasValue()) {
+        const std::string& codec = opt_compression_codec.value();
+        if (codec == "zlib") {
+            sc_compression_codec = sp::SmxConsts::FILE_COMPRESSION_GZ;
+        } else if (codec == "zlib-chunks") {
+            sc_compression_codec = sp::SmxConsts::FILE_COMPRESSION_GZ_CHUNKS;
+        } else if (codec == "lz4") {
+            sc_compression_codec = sp::SmxConsts::FILE_COMPRESSION_LZ4;
+        } else {
+            fprintf(stderr, "unknown compression codec: %s\n", codec.c_str());
+            exit(1);
+        }
+    }
+    sc_compression_threads = opt_compression_threads.value();
+    if (sc_compression_threads < 0)
+        sc_compression_threads = 0;
+    sc_page_aligned = opt_page_aligned.value();
+    sc_compact_lines = opt_compact_lines.value();
+    sc_split_debug = opt_split_debug.hasValue() ? opt_split_debug.value() : "";
+    sc_auto_stack = opt_auto_stack.value();
+    sc_native_manifest = opt_native_manifest.hasValue() ? opt_native_manifest.value() : "";
     sc_tabsize = opt_tabsize.value();
     sc_needsemicolon = opt_semicolons.value();
 
@@ -1021,7 +1183,7 @@ setconstants(void) {
     add_constant("cellmin", INT_MIN, sGLOBAL, 0);
 
     add_constant("__Pawn", VERSION_INT, sGLOBAL, 0);
-    add_constant("__LINE__", 0, sGLOBAL, 0);
+    sc_linesym = add_constant("__LINE__", 0, sGLOBAL, 0);
 
     debug = 0;
     if ((sc_debug & (sCHKBOUNDS | sSYMBOLIC)) == (sCHKBOUNDS | sSYMBOLIC))
@@ -1168,6 +1330,7 @@ parse_local_array_initializer(typeinfo_t* type, int* curlit, int* slength) {
     if (type->numdim && !type->dim[type->numdim - 1])
         type->size = 0;
     initials(type->ident, type->tag, &type->size, type->dim, type->numdim, type->enumroot);
+    flatten_array(type, *curlit);
     if (type->tag == pc_tag_string && type->numdim == 1 && !type->dim[type->numdim - 1])
         *slength = glbstringread;
     if (type->size == 0)
@@ -1259,10 +1422,14 @@ declloc(int tokid) {
             sym = addvariable2(decl.name, (cur_lit + glb_declared) * sizeof(cell), type->ident,
                                sSTATIC, type->tag, type->dim, type->numdim, type->idxtag, slength);
             sym->is_static = true;
+            if (type->is_flat)
+                mark_flat_array(sym);
         } else if (type->ident != iREFARRAY) {
             declared += type->size; /* variables are put on stack, adjust "declared" */
             sym = addvariable2(decl.name, -declared * sizeof(cell), type->ident, sLOCAL, type->tag,
                                type->dim, type->numdim, type->idxtag, slength);
+            if (type->is_flat)
+                mark_flat_array(sym);
             if (type->ident == iVARIABLE) {
                 assert(!staging);
                 stgset(TRUE); /* start stage-buffering */
@@ -1794,7 +1961,37 @@ initials(int ident, int tag, cell* size, int dim[], int numdim, constvalue* enum
 static void
 initials3(declinfo_t* decl) {
     typeinfo_t* type = &decl->type;
+    int curlit = litidx;
     initials(type->ident, type->tag, &type->size, type->dim, type->numdim, type->enumroot);
+    flatten_array(type, curlit);
+}
+
+/* flatten_array
+ *
+ * Under "#pragma flatarrays", drops the indirection vectors that initials()
+ * put in front of a fixed-size multi-dimensional array, so that its rows are
+ * addressed as i*stride+j instead of through a vector each.
+ */
+static void
+flatten_array(typeinfo_t* type, int curlit) {
+    if (!sc_flat_arrays || type->ident != iARRAY || type->numdim < 2 || type->size == CELL_MAX)
+        return;
+    for (int i = 0; i < type->numdim; i++) {
+        if (type->dim[i] <= 0 || gTypes.find(type->idxtag[i])->isEnumStruct())
+            return;
+    }
+
+    cell vectors = calc_arraysize(type->dim, type->numdim - 1, 0);
+    assert(type->size > vectors);
+    if (litidx - curlit > vectors) {
+        memmove(&litq[curlit], &litq[curlit + vectors],
+                (litidx - curlit - vectors) * sizeof(cell));
+        litidx -= vectors;
+    } else {
+        litidx = curlit;
+    }
+    type->size -= vectors;
+    type->is_flat = true;
 }
 
 static cell
@@ -2508,6 +2705,8 @@ reparse_new_decl(declinfo_t* decl, int flags) {
     if (expecttoken(tSYMBOL, &tok))
         strcpy(decl->name, tok.str);
 
+    decl->type.is_flat = false;
+
     if (decl->type.declared_tag && !decl->type.tag) {
         assert(decl->type.numdim > 0);
         assert(decl->type.enumroot);
@@ -3818,12 +4017,25 @@ newfunc(declinfo_t* decl, const int* thistag, int fpublic, int fstatic, int stoc
         const char* ptr = sym->documentation.c_str();
         error(234, decl->name, ptr); /* deprecated (probably a public function) */
     }
-    begcseg();
     sym->defined = true;
     if (stock)
         sym->stock = true;
     if (decl->opertok != 0 && opererror)
         sym->defined = false;
+
+    // Nothing in a skipped body reaches the output, and what it refers to was
+    // already found in the first pass, so unless its errors are wanted it is
+    // only lexed past.
+    if (sc_status == statSKIP && !sc_err_status && matchtoken('{')) {
+        skip_function_body();
+        delete_symbols(&loctab, 0, TRUE);
+        sc_status = statWRITE;
+        if (symp)
+            *symp = sym;
+        return TRUE;
+    }
+
+    begcseg();
     startfunc(sym->name()); /* creates stack frame */
     insert_dbgline(fileline);
     setline(FALSE);
@@ -3836,15 +4048,31 @@ newfunc(declinfo_t* decl, const int* thistag, int fpublic, int fstatic, int stoc
         sReturnType = RETURN_NONE;
     curfunc = sym;
     define_args(); /* add the symbolic info for the function arguments */
-    if (matchtoken('{')) {
+    /* self tail calls found in an earlier pass jump back to here */
+    sym->function()->tail_label = -1;
+    if (sym->function()->tail_calls) {
+        sym->function()->tail_label = getlabel();
+        setlabel(sym->function()->tail_label);
+    }
+    int braced = matchtoken('{');
+    if (braced) {
         lexpush();
     } else {
         // We require '{' for new methods.
         if (decl->type.is_new)
             needtoken('{');
     }
+    sFuncStatements = 0;
+    sConstReturnAt = 0;
     statement(NULL, FALSE);
 
+    /* a body of just "return <constant>;" (the block counts as a statement) */
+    int expected = braced ? 2 : 1;
+    FunctionData* data = sym->function();
+    data->returns_constant = argcnt == 0 && !sym->is_public && sConstReturnAt == expected &&
+                             sFuncStatements == expected;
+    data->constant_value = sConstReturnValue;
+
     if (sReturnType & RETURN_VALUE) {
         sym->retvalue = true;
     } else {
@@ -3907,6 +4135,33 @@ newfunc(declinfo_t* decl, const int* thistag, int fpublic, int fstatic, int stoc
     return TRUE;
 }
 
+/*  skip_function_body
+ *
+ *  Reads up to and including the "}" that closes a function body whose "{"
+ *  was just read. Lines still go through the preprocessor, so directives in
+ *  the body take effect as they would when parsing it.
+ */
+static void
+skip_function_body()
+{
+    int opening_line = fline;
+    int depth = 1;
+    while (depth > 0) {
+        if (!freading) {
+            error(30, opening_line); /* compound block not closed at end of file */
+            return;
+        }
+
+        cell val;
+        char* str;
+        int tok = lex(&val, &str);
+        if (tok == '{')
+            depth++;
+        else if (tok == '}')
+            depth--;
+    }
+}
+
 static int
 argcompare(arginfo* a1, arginfo* a2) {
     int result, level;
@@ -4238,14 +4493,23 @@ reduce_referrers(symbol* root) {
     }
 }
 
-// Determine the set of live functions. Note that this must run before delete_symbols,
-// since that resets referrer lists.
+static inline bool
+is_global_storage(symbol* sym) {
+    return (sym->ident == iVARIABLE || sym->ident == iARRAY) && !sym->parent();
+}
+
+// Determine the set of live functions, and the global variables they use. Note
+// that this must run before delete_symbols, since that resets referrer lists.
 static void
 deduce_liveness(symbol* root) {
     std::vector<symbol*> work;
 
-    // The root set is all public functions.
+    // The root set is all public functions. Public variables are always live.
     for (symbol* sym = root->next; sym; sym = sym->next) {
+        if (is_global_storage(sym)) {
+            sym->queued = sym->is_public;
+            continue;
+        }
         if (sym->ident != iFUNCTN)
             continue;
         if (sym->native)
@@ -4264,6 +4528,10 @@ deduce_liveness(symbol* root) {
         symbol* live = ke::PopBack(&work);
 
         for (const auto& other : live->refers_to()) {
+            if (is_global_storage(other)) {
+                other->queued = true;
+                continue;
+            }
             if (other->ident != iFUNCTN || other->queued)
                 continue;
             other->queued = true;
@@ -4273,6 +4541,17 @@ deduce_liveness(symbol* root) {
 
     // Remove the liveness flags for anything we did not visit.
     for (symbol* sym = root->next; sym; sym = sym->next) {
+        if (is_global_storage(sym)) {
+            // Only code reads or writes a global at run time, so a variable that
+            // no live function refers to gets no storage. It is marked stock, like
+            // reduce_referrers() does, since the dead code using it has already
+            // been reported.
+            if (!sym->queued && (sym->usage & (uREAD | uWRITTEN))) {
+                sym->usage &= ~(uWRITTEN | uREAD);
+                sym->stock = true;
+            }
+            continue;
+        }
         if (sym->ident != iFUNCTN || sym->queued)
             continue;
         if (sym->native)
@@ -4365,6 +4644,12 @@ calc_array_datasize(symbol* sym, cell* offset) {
 
     assert(sym != NULL);
     assert(sym->ident == iARRAY || sym->ident == iREFARRAY);
+    if (sym->flat) {
+        /* the data starts right away, there are no indirection vectors to skip */
+        if (offset != NULL)
+            *offset = 0;
+        return flat_array_cells(sym);
+    }
     length = sym->dim.array.length;
     if (sym->dim.array.level > 0) {
         cell sublength = calc_array_datasize(sym->array_child(), offset);
@@ -4431,6 +4716,22 @@ destructsymbols(symbol* root, int level) {
         popreg(sPRI);
 }
 
+/* Whether any local in scope has a '~' operator, which destructsymbols()
+ * would call.
+ */
+static bool
+has_destructors(symbol* root) {
+    for (symbol* sym = root->next; sym != NULL; sym = sym->next) {
+        if (sym->ident != iVARIABLE && sym->ident != iARRAY)
+            continue;
+        char symbolname[16];
+        operator_symname(symbolname, "~", sym->tag, 0, 1, 0);
+        if (findglb(symbolname) != NULL)
+            return true;
+    }
+    return false;
+}
+
 static constvalue*
 insert_constval(constvalue* prev, constvalue* next, const char* name, cell val, int index) {
     constvalue* cur;
@@ -4543,6 +4844,20 @@ redef_enumfield:
     return sym;
 }
 
+// Whether the symbol just read looks like the type of a new-style local
+// declaration, "Foo x" or "Foo[] x". Nothing past the symbol is consumed.
+static bool
+symbol_starts_decl() {
+    int mark = lexmark();
+    bool is_decl;
+    if (matchtoken('['))
+        is_decl = !!matchtoken(']');
+    else
+        is_decl = !!matchtoken(tSYMBOL);
+    lexrewind(mark);
+    return is_decl;
+}
+
 /*  statement           - The Statement Parser
  *
  *  This routine is called whenever the parser needs to know what statement
@@ -4559,6 +4874,7 @@ statement(int* lastindent, int allow_decl) {
         return;
     }
     errorset(sRESET, 0);
+    sFuncStatements++;
 
     tok = lex(&val, &st);
     if (tok != '{') {
@@ -4574,18 +4890,7 @@ statement(int* lastindent, int allow_decl) {
     }
 
     if (tok == tSYMBOL) {
-        // We reaaaally don't have enough lookahead for this, so we cheat and try
-        // to determine whether this is probably a declaration.
-        int is_decl = FALSE;
-        if (matchtoken('[')) {
-            if (lexpeek(']'))
-                is_decl = TRUE;
-            lexpush();
-        } else if (lexpeek(tSYMBOL)) {
-            is_decl = TRUE;
-        }
-
-        if (is_decl) {
+        if (symbol_starts_decl()) {
             if (!allow_decl) {
                 error(3);
                 return;
@@ -5007,6 +5312,171 @@ dodo(void) {
     return retcode;
 }
 
+static bool
+match_name(const std::string& name) {
+    token_t tok;
+    return lextok(&tok) == tSYMBOL && name == tok.str;
+}
+
+/* A number, a named constant, or the size of a cell array. */
+static bool
+match_idiom_constant(cell* val) {
+    token_t tok;
+    switch (lextok(&tok)) {
+        case tNUMBER:
+            *val = tok.val;
+            return true;
+        case tSYMBOL: {
+            symbol* sym = findconst(tok.str);
+            if (!sym || sym->tag != 0)
+                return false;
+            *val = sym->addr();
+            return true;
+        }
+        case tSIZEOF: {
+            bool paren = !!matchtoken('(');
+            if (lextok(&tok) != tSYMBOL)
+                return false;
+            symbol* sym = findloc(tok.str);
+            if (!sym)
+                sym = findglb(tok.str);
+            if (!sym || (sym->ident != iARRAY && sym->ident != iREFARRAY) ||
+                sym->dim.array.level != 0 || sym->tag == pc_tag_string)
+            {
+                return false;
+            }
+            if (paren && !matchtoken(')'))
+                return false;
+            *val = sym->dim.array.length;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A one-dimensional, untagged cell array with at least |cells| cells. */
+static symbol*
+find_idiom_array(const std::string& name, cell cells) {
+    symbol* sym = findloc(name.c_str());
+    if (!sym)
+        sym = findglb(name.c_str());
+    if (!sym || (sym->ident != iARRAY && sym->ident != iREFARRAY))
+        return nullptr;
+    if (sym->dim.array.level != 0 || sym->dim.array.length < cells || sym->tag != 0 ||
+        sym->x.tags.index != 0)
+    {
+        return nullptr;
+    }
+    return sym;
+}
+
+/*  dofor_idiom
+ *
+ *  Recognizes loops that only fill or copy the start of an array,
+ *
+ *     for (int i = 0; i < N; i++) dst[i] = value;
+ *     for (int i = 0; i < N; i++) dst[i] = src[i];
+ *
+ *  where N and the value are constants, and the arrays are known to be long
+ *  enough, so no index can be out of bounds. These become a single FILL or
+ *  MOVS. Anything else is left to dofor(), with its tokens put back.
+ */
+static bool
+dofor_idiom(void) {
+    int mark = lexmark();
+    token_t tok;
+    cell start, bound, fill = 0;
+
+    bool ok = false;
+    std::string iv, dst_name, src_name;
+    bool declares = false, braced = false;
+    do {
+        if (!matchtoken('('))
+            break;
+        declares = matchtoken(tINT) || matchtoken(tNEW);
+        if (lextok(&tok) != tSYMBOL)
+            break;
+        iv = tok.str;
+        if (!matchtoken('=') || !match_idiom_constant(&start) || start != 0 || !matchtoken(';'))
+            break;
+        if (!match_name(iv) || !matchtoken('<') || !match_idiom_constant(&bound) ||
+            !matchtoken(';'))
+        {
+            break;
+        }
+        if (matchtoken(tINC)) {
+            if (!match_name(iv))
+                break;
+        } else if (!match_name(iv) || !matchtoken(tINC)) {
+            break;
+        }
+        if (!matchtoken(')'))
+            break;
+        braced = !!matchtoken('{');
+        if (lextok(&tok) != tSYMBOL)
+            break;
+        dst_name = tok.str;
+        if (!matchtoken('[') || !match_name(iv) || !matchtoken(']') || !matchtoken('='))
+            break;
+
+        int value_mark = lexmark();
+        if (lextok(&tok) == tSYMBOL && matchtoken('[')) {
+            src_name = tok.str;
+            if (!match_name(iv) || !matchtoken(']'))
+                break;
+        } else {
+            lexrewind(value_mark);
+            bool negate = !!matchtoken('-');
+            if (!match_idiom_constant(&fill))
+                break;
+            if (negate)
+                fill = -fill;
+        }
+        if (!matchtoken(';') || (braced && !matchtoken('}')))
+            break;
+        ok = true;
+    } while (false);
+
+    symbol* dst = nullptr;
+    symbol* src = nullptr;
+    symbol* ivsym = nullptr;
+    if (ok && bound > 0) {
+        dst = find_idiom_array(dst_name, bound);
+        if (!src_name.empty())
+            src = find_idiom_array(src_name, bound);
+        if (!declares) {
+            /* the loop leaves an existing counter at the bound */
+            ivsym = findloc(iv.c_str());
+            if (!ivsym)
+                ivsym = findglb(iv.c_str());
+            if (ivsym && (ivsym->ident != iVARIABLE || ivsym->tag != 0 || ivsym->is_const))
+                ivsym = nullptr;
+        }
+    }
+    if (!dst || dst->is_const || (!src_name.empty() && !src) || (!declares && !ivsym)) {
+        lexrewind(mark);
+        return false;
+    }
+
+    if (src) {
+        address(src, sPRI);
+        copyarray(dst, bound * sizeof(cell));
+        markusage(src, uREAD);
+    } else {
+        fillarray(dst, bound * sizeof(cell), fill);
+    }
+    if (ivsym) {
+        value lval = {0};
+        lval.sym = ivsym;
+        lval.ident = iVARIABLE;
+        lval.tag = ivsym->tag;
+        ldconst(bound, sPRI);
+        store(&lval);
+        markusage(ivsym, uREAD);
+    }
+    return true;
+}
+
 static int
 dofor(void) {
     int wq[wqSIZE], skiplab;
@@ -5015,6 +5485,9 @@ dofor(void) {
     int index, endtok;
     int* ptr;
 
+    if (dofor_idiom())
+        return tFOR;
+
     save_decl = declared;
     save_nestlevel = nestlevel;
     save_endlessloop = endlessloop;
@@ -5044,17 +5517,7 @@ dofor(void) {
                 declloc(tok.id); /* declare local variable */
                 break;
             case tSYMBOL: {
-                // See comment in statement() near tSYMBOL.
-                int is_decl = FALSE;
-                if (matchtoken('[')) {
-                    if (lexpeek(']'))
-                        is_decl = TRUE;
-                    lexpush();
-                } else if (lexpeek(tSYMBOL)) {
-                    is_decl = TRUE;
-                }
-
-                if (is_decl) {
+                if (symbol_starts_decl()) {
                     lexpush();
                     nestlevel++;
                     autozero = 1;
@@ -5342,8 +5805,23 @@ doreturn(void)
         /* "return <value>" */
         if (sReturnType & RETURN_NONE)
             error(78); /* mix "return;" and "return value;" */
-        ident = doexpr(TRUE, FALSE, TRUE, FALSE, &tag, &sym, TRUE);
+        value lval = {0};
+        cell expr_start = code_idx;
+        /* a call can only turn into a jump when nothing is left to do on the
+         * way out but to free the stack and the heap
+         */
+        pc_tail_return = pc_must_drop_stack && !has_destructors(&loctab) &&
+                         pc_optimize > sOPTIMIZE_NOMACRO;
+        ident = doexpr2(TRUE, FALSE, TRUE, FALSE, &tag, &sym, TRUE, &lval);
+        pc_tail_return = FALSE;
         needtoken(tTERM);
+        /* a comma expression can end in a constant, but then more than the
+         * constant itself was generated
+         */
+        if (ident == iCONSTEXPR && code_idx - expr_start <= (cell)(opcodes(1) + opargs(1))) {
+            sConstReturnAt = sFuncStatements;
+            sConstReturnValue = lval.constval;
+        }
         if (ident == iARRAY && sym == NULL) {
             /* returning a literal string is not supported (it must be a variable) */
             error(39);
@@ -5369,6 +5847,8 @@ doreturn(void)
             int dim[sDIMEN_MAX], numdim = 0;
             cell arraysize;
             assert(sym != NULL);
+            if (sym->flat && sym->dim.array.level > 0)
+                error(48); /* a flat array cannot be returned as a multi-dimensional one */
             if (sub != NULL) {
                 assert(sub->ident == iREFARRAY);
                 /* this function has an array attached already; check that the current
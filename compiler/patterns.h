@@ -31,6 +31,7 @@ typedef struct {
     const char* find;
     const char* replace;
     int savesize; /* number of bytes saved (in bytecode) */
+    uint32_t features; /* SMX code features the replacement needs, if any */
 } SEQUENCE;
 static SEQUENCE sequences_cmp[] = {
     /* A very common sequence in four varieties
@@ -271,6 +272,22 @@ static SEQUENCE sequences_cmp[] = {
     /* the shorter array indexing sequences, see above for comments */
     {"shl.c.pri 2!pop.alt!add!loadi!", "pop.alt!lidx!", seqsize(4, 1) - seqsize(2, 0)},
     {"shl.c.pri 2!pop.alt!add!", "pop.alt!idxaddr!", seqsize(3, 1) - seqsize(2, 0)},
+    /* Indexing a local array by a local variable fits in one instruction
+     * when the VM supports it (code version 13 and up).
+     *    addr.alt n1             lidx.s.bounds n1 n2 n3
+     *    load.s.pri n2           -
+     *    bounds n3               -
+     *    lidx                    -
+     *    --------------------------------------
+     *    addr.alt n1             idxaddr.s.bounds n1 n2 n3
+     *    load.s.pri n2           -
+     *    bounds n3               -
+     *    idxaddr                 -
+     */
+    {"addr.alt %1!load.s.pri %2!bounds %3!lidx!", "lidx.s.bounds %1 %2 %3!",
+     seqsize(4, 3) - seqsize(1, 3), sp::SmxConsts::kCodeFeatureFusedIndex},
+    {"addr.alt %1!load.s.pri %2!bounds %3!idxaddr!", "idxaddr.s.bounds %1 %2 %3!",
+     seqsize(4, 3) - seqsize(1, 3), sp::SmxConsts::kCodeFeatureFusedIndex},
 #endif
     /* For packed arrays, there is another case (packed arrays
      * do not take advantage of the LIDX or IDXADDR instructions).
@@ -324,6 +341,21 @@ static SEQUENCE sequences_cmp[] = {
      *    pop.alt                 -
      */
     {"push.pri!pop.alt!", "move.alt!", seqsize(2, 0) - seqsize(1, 0)},
+    /* Reading a variable straight after storing PRI into it (as in "x = y;"
+     * followed by a test or an expression on "x") reloads a value that is
+     * still in PRI:
+     *    stor.s.pri n1           stor.s.pri n1
+     *    load.s.pri n1           -
+     * Loading it into ALT instead becomes a register move. Both also occur
+     * with a statement boundary in between, and for global variables.
+     */
+    {"stor.s.pri %1!load.s.pri %1!", "stor.s.pri %1!", seqsize(2, 2) - seqsize(1, 1)},
+    {"stor.pri %1!load.pri %1!", "stor.pri %1!", seqsize(2, 2) - seqsize(1, 1)},
+    {"stor.s.pri %1!;$exp!load.s.pri %1!", "stor.s.pri %1!;$exp!",
+     seqsize(2, 2) - seqsize(1, 1)},
+    {"stor.pri %1!;$exp!load.pri %1!", "stor.pri %1!;$exp!", seqsize(2, 2) - seqsize(1, 1)},
+    {"stor.s.pri %1!load.s.alt %1!", "stor.s.pri %1!move.alt!", seqsize(2, 2) - seqsize(2, 1)},
+    {"stor.pri %1!load.alt %1!", "stor.pri %1!move.alt!", seqsize(2, 2) - seqsize(2, 1)},
     /* Some simple arithmetic sequences
      */
     {"move.alt!load.s.pri %1!add!", "load.s.alt %1!add!", seqsize(3, 1) - seqsize(2, 1)},
@@ -1,18 +1,243 @@
 #include <assert.h>
 #include <setjmp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
 #include "memfile.h"
 #include "osdefs.h"
 #if defined __linux__ || defined DARWIN
+#    include <poll.h>
+#    include <sys/wait.h>
 #    include <unistd.h>
 #elif defined WIN32
 #    include <io.h>
 #endif
 #include "sc.h"
 
+// Splits a job line into arguments, honoring double quotes.
+static std::vector<std::string>
+SplitJob(const std::string& line)
+{
+    std::vector<std::string> args;
+    std::string arg;
+    bool in_arg = false, quoted = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            in_arg = true;
+        } else if (!quoted && (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+            if (in_arg)
+                args.push_back(arg);
+            arg.clear();
+            in_arg = false;
+        } else {
+            arg.push_back(c);
+            in_arg = true;
+        }
+    }
+    if (in_arg)
+        args.push_back(arg);
+    return args;
+}
+
+static bool
+ReadJob(std::string* line)
+{
+    line->clear();
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), stdin)) {
+        *line += buffer;
+        if (!line->empty() && line->back() == '\n')
+            return true;
+    }
+    return !line->empty();
+}
+
+static int
+RunJob(char* program, std::vector<std::string>& args)
+{
+    std::vector<char*> argv;
+    argv.push_back(program);
+    for (std::string& arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    return pc_compile((int)argv.size() - 1, argv.data());
+}
+
+#if defined __linux__ || defined DARWIN
+struct ParallelJob {
+    pid_t pid;
+    int fd;
+    std::string output;
+    int retcode;
+};
+
+// Compiles a job in a child process, with its output going to a pipe.
+static bool
+StartJob(char* program, std::vector<std::string>& args, ParallelJob* job)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        int retcode = RunJob(program, args);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(retcode);
+    }
+
+    close(fds[1]);
+    job->pid = pid;
+    job->fd = fds[0];
+    job->retcode = -1;
+    return true;
+}
+
+// Like RunServer, but compiles up to |max_jobs| jobs at once, each in its own
+// process (the compiler's state is global, so it cannot use threads). Results
+// are still reported in the order the jobs were given.
+static int
+RunParallelServer(char* program, int max_jobs)
+{
+    std::deque<std::vector<std::string>> queued;
+    std::deque<ParallelJob> jobs;
+    std::string input;
+    bool input_open = true;
+    int running = 0;
+
+    while (input_open || !queued.empty() || !jobs.empty()) {
+        while (!queued.empty() && running < max_jobs) {
+            ParallelJob job;
+            if (!StartJob(program, queued.front(), &job)) {
+                job.fd = -1;
+                job.retcode = 1;
+                job.output = "error: could not start a compile\n";
+            } else {
+                running++;
+            }
+            jobs.push_back(job);
+            queued.pop_front();
+        }
+
+        std::vector<pollfd> fds;
+        if (input_open)
+            fds.push_back(pollfd{STDIN_FILENO, POLLIN, 0});
+        for (const ParallelJob& job : jobs) {
+            if (job.fd >= 0)
+                fds.push_back(pollfd{job.fd, POLLIN, 0});
+        }
+        if (!fds.empty() && poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+
+        char buffer[4096];
+        size_t poll_index = 0;
+        if (input_open) {
+            if (fds[poll_index++].revents) {
+                ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+                if (n > 0) {
+                    input.append(buffer, n);
+                } else {
+                    input_open = false;
+                    input.push_back('\n');
+                }
+
+                size_t newline;
+                while ((newline = input.find('\n')) != std::string::npos) {
+                    std::vector<std::string> args = SplitJob(input.substr(0, newline));
+                    input.erase(0, newline + 1);
+                    if (!args.empty())
+                        queued.push_back(std::move(args));
+                }
+            }
+        }
+
+        for (ParallelJob& job : jobs) {
+            if (job.fd < 0)
+                continue;
+            if (!fds[poll_index++].revents)
+                continue;
+
+            ssize_t n = read(job.fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                job.output.append(buffer, n);
+                continue;
+            }
+
+            int status;
+            close(job.fd);
+            job.fd = -1;
+            waitpid(job.pid, &status, 0);
+            job.retcode = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            running--;
+        }
+
+        while (!jobs.empty() && jobs.front().fd < 0) {
+            const ParallelJob& job = jobs.front();
+            fwrite(job.output.data(), 1, job.output.size(), stdout);
+            fprintf(stdout, "@done %d\n", job.retcode);
+            fflush(stdout);
+            jobs.pop_front();
+        }
+    }
+    return 0;
+}
+#endif
+
+// In server mode, each line on stdin holds the arguments of one compile, as
+// they would be given on the command line. The compiler's output is written
+// as usual, followed by a "@done <exit code>" line. The process stays up
+// between jobs, so shared includes are read from disk only once (and only
+// again when they change); it exits at the end of its input.
+static int
+RunServer(char* program)
+{
+    std::string line;
+    while (ReadJob(&line)) {
+        std::vector<std::string> args = SplitJob(line);
+        if (args.empty())
+            continue;
+
+        int retcode = RunJob(program, args);
+        fflush(stderr);
+        fprintf(stdout, "@done %d\n", retcode);
+        fflush(stdout);
+    }
+    return 0;
+}
+
 int
 main(int argc, char* argv[])
 {
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        int max_jobs = 1;
+        if (argc == 3 && strncmp(argv[2], "--jobs=", 7) == 0)
+            max_jobs = atoi(argv[2] + 7);
+        else if (argc != 2)
+            return pc_compile(argc, argv);
+#if defined __linux__ || defined DARWIN
+        if (max_jobs > 1)
+            return RunParallelServer(argv[0], max_jobs);
+#endif
+        return RunServer(argv[0]);
+    }
     return pc_compile(argc, argv);
 }
@@ -34,7 +34,7 @@ PoolAllocator::PoolAllocator()
 
 PoolAllocator::~PoolAllocator()
 {
-    unwind(nullptr);
+    pools_.clear();
 }
 
 char*
@@ -60,6 +60,11 @@ PoolAllocator::unwind(char* pos)
             last->ptr = pos;
             return;
         }
+        if (reserved_bytes_ + last->size() <= kMaxReserveSize) {
+            reserved_bytes_ += last->size();
+            last->ptr = last->base.get();
+            reserve_.push_back(std::move(pools_.back()));
+        }
         pools_.pop_back();
     }
 }
@@ -67,6 +72,15 @@ PoolAllocator::unwind(char* pos)
 PoolAllocator::Pool*
 PoolAllocator::ensurePool(size_t actualBytes)
 {
+    for (size_t i = 0; i < reserve_.size(); i++) {
+        if (reserve_[i]->size() < actualBytes)
+            continue;
+        reserved_bytes_ -= reserve_[i]->size();
+        pools_.push_back(std::move(reserve_[i]));
+        reserve_.erase(reserve_.begin() + i);
+        return pools_.back().get();
+    }
+
     size_t bytesNeeded = actualBytes;
     if (bytesNeeded < kDefaultPoolSize)
         bytesNeeded = kDefaultPoolSize;
@@ -52,6 +52,11 @@ class PoolAllocator final
   private:
     std::vector<std::unique_ptr<Pool>> pools_;
 
+    // Pools released by leave(), kept for reuse up to kMaxReserveSize bytes,
+    // so repeated compiles in one process don't go back to malloc.
+    std::vector<std::unique_ptr<Pool>> reserve_;
+    size_t reserved_bytes_ = 0;
+
   private:
     void unwind(char* pos);
     Pool* ensurePool(size_t actualBytes);
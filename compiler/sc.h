@@ -141,6 +141,17 @@ class FunctionData final : public SymbolData
     int funcid;          /* set for functions during codegen */
     stringlist* dbgstrs; /* debug strings - functions only */
     std::vector<arginfo> args;
+
+    // Set when the body is a single "return <constant>;" and the function
+    // takes no arguments, so calls can be folded to the constant.
+    bool returns_constant;
+    cell constant_value;
+
+    // Set when a return calls the function itself in a way that can jump
+    // back to the start of the body instead. The next pass then puts
+    // |tail_label| there.
+    bool tail_calls;
+    int tail_label;
 };
 
 class EnumStructVarData final : public SymbolData
@@ -213,6 +224,9 @@ struct symbol {
     bool deprecated : 1;    // symbol is deprecated (avoid use)
     bool queued : 1;        // symbol is queued for a local work algorithm
 
+    // Arrays only.
+    bool flat : 1;          // sub-arrays are stored back to back, without indirection vectors
+
     union {
         struct {
             int index; /* array & enum: tag of array indices or the enum item */
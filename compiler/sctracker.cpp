@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <string>
+#include <unordered_map>
 #include <utility>
 
 #include <amtl/am-raii.h>
@@ -49,6 +51,7 @@ std::vector<MemoryScope> sStackScopes;
 std::vector<MemoryScope> sHeapScopes;
 std::vector<std::unique_ptr<funcenum_t>> sFuncEnums;
 std::vector<std::unique_ptr<pstruct_t>> sStructs;
+std::unordered_map<std::string, pstruct_t*> sStructsByName;
 std::vector<std::unique_ptr<methodmap_t>> sMethodmaps;
 
 pstruct_t::pstruct_t(const char* name)
@@ -70,6 +73,7 @@ pstruct_t*
 pstructs_add(const char* name)
 {
     auto p = std::make_unique<pstruct_t>(name);
+    sStructsByName.emplace(p->name, p.get());
     sStructs.push_back(std::move(p));
     return sStructs.back().get();
 }
@@ -78,16 +82,16 @@ void
 pstructs_free()
 {
     sStructs.clear();
+    sStructsByName.clear();
 }
 
 pstruct_t*
 pstructs_find(const char* name)
 {
-    for (const auto& p : sStructs) {
-        if (strcmp(p->name, name) == 0)
-            return p.get();
-    }
-    return nullptr;
+    auto iter = sStructsByName.find(name);
+    if (iter == sStructsByName.end())
+        return nullptr;
+    return iter->second;
 }
 
 structarg_t*
@@ -25,7 +25,9 @@
 #include "scvars.h"
 #include <stdio.h>
 #include <stdlib.h> /* for _MAX_PATH */
+#include <smx/smx-headers.h>
 #include "emitter.h"
+#include "pool-allocator.h"
 #include "sc.h"
 #include "sp_symhash.h"
 
@@ -44,6 +46,7 @@ constvalue libname_tab = {NULL, "", 0, 0}; /* library table (#pragma library "..
 constvalue* curlibrary = NULL;             /* current library */
 int pc_addlibtable = TRUE;                 /* is the library table added to the AMX file? */
 symbol* curfunc;                           /* pointer to current function */
+symbol* sc_linesym;                        /* the __LINE__ constant, updated per line */
 char* inpfname;                            /* pointer to name of the file currently read from */
 char outfname[_MAX_PATH];                  /* intermediate (assembler) file name */
 char binfname[_MAX_PATH];                  /* binary file name */
@@ -71,6 +74,7 @@ int freading = FALSE;                      /* Is there an input file ready for r
 int fline = 0;                             /* the line number in the current file */
 short fnumber = 0;                         /* the file number in the file table (debugging) */
 int sideeffect = 0;                        /* true if an expression causes a side-effect */
+int pc_tail_return = FALSE;                /* the expression being parsed is returned */
 int stmtindent = 0;                        /* current indent of the statement */
 int indent_nowarn = FALSE;                 /* skip warning "217 loose indentation" */
 int sc_tabsize = 8;                        /* number of spaces that a TAB represents */
@@ -84,8 +88,16 @@ int pc_optimize = sOPTIMIZE_NOMACRO; /* (peephole) optimization level */
 int pc_memflags = 0;                 /* special flags for the stack/heap usage */
 int sc_showincludes = 0;             /* show include files */
 int sc_require_newdecls = 0;         /* Require new-style declarations */
+int sc_flat_arrays = 0;              /* Flat fixed-size multi-dimensional arrays */
 bool sc_warnings_are_errors = false;
 int sc_compression_level = 9;
+int sc_compression_codec = sp::SmxConsts::FILE_COMPRESSION_GZ;
+int sc_compression_threads = 0;
+bool sc_page_aligned = false;
+bool sc_compact_lines = false;
+std::string sc_split_debug;
+bool sc_auto_stack = false;
+std::string sc_native_manifest;
 bool sc_use_new_parser = false;
 
 void* inpf = NULL;      /* file read from (source or include) */
@@ -101,6 +113,25 @@ std::vector<int> gCurrentLineStack;
 std::vector<void*> gInputFileStack;
 std::vector<char*> gInputFilenameStack;
 
+static const char* const sPhaseNames[kNumCompilePhases] = {
+    "preprocess",
+    "lex",
+    "parse (first pass)",
+    "codegen (second pass)",
+    "peephole",
+    "assemble",
+};
+
+static size_t
+PoolBytesAllocated()
+{
+    size_t allocated, reserved, bookkeeping;
+    gPoolAllocator.memoryUsage(&allocated, &reserved, &bookkeeping);
+    return allocated;
+}
+
+sp::PhaseTimer gPhaseTimer(sPhaseNames, kNumCompilePhases, PoolBytesAllocated);
+
 jmp_buf errbuf;
 
 HashTable* sp_Globals = NULL;
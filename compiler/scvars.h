@@ -23,6 +23,7 @@
 #include <amtl/am-vector.h>
 #include <setjmp.h>
 #include "sc.h"
+#include "shared/phase-timer.h"
 
 struct memfile_t;
 
@@ -36,6 +37,7 @@ extern const unsigned char* lptr; /* points to the current position in "pline" *
 extern constvalue libname_tab;    /* library table (#pragma library "..." syntax) */
 extern int pc_addlibtable;        /* is the library table added to the AMX file? */
 extern symbol* curfunc;           /* pointer to current function */
+extern symbol* sc_linesym;        /* the __LINE__ constant, updated per line */
 extern char* inpfname;            /* name of the file currently read from */
 extern char outfname[];           /* intermediate (assembler) file name */
 extern char binfname[];           /* binary file name */
@@ -64,6 +66,7 @@ extern int freading;              /* is there an input file ready for reading? *
 extern int fline;                 /* the line number in the current file */
 extern short fnumber;             /* number of files in the input file table */
 extern int sideeffect;            /* true if an expression causes a side-effect */
+extern int pc_tail_return;        /* the expression being parsed is returned */
 extern int stmtindent;            /* current indent of the statement */
 extern int indent_nowarn;         /* skip warning "217 loose indentation" */
 extern int sc_tabsize;            /* number of spaces that a TAB represents */
@@ -82,10 +85,18 @@ extern int pc_tag_nullfunc_t;     /* the null function type */
 extern int pc_anytag;             /* global any tag */
 extern int glbstringread;         /* last global string read */
 extern int sc_require_newdecls;   /* only newdecls are allowed */
+extern int sc_flat_arrays;        /* lay out fixed-size arrays without indirection vectors */
 extern bool sc_warnings_are_errors;
 extern unsigned sc_total_errors;
 extern int pc_code_version; /* override the code version */
 extern int sc_compression_level;
+extern int sc_compression_codec; /* SmxConsts::FILE_COMPRESSION_* */
+extern int sc_compression_threads; /* for zlib-chunks; 0 = one per core */
+extern bool sc_page_aligned;     /* page-align sections, leave uncompressed */
+extern bool sc_compact_lines;    /* write .dbg.linetable instead of .dbg.lines */
+extern std::string sc_split_debug; /* file to write debug sections to, if any */
+extern bool sc_auto_stack;       /* size the stack/heap from the generated code */
+extern std::string sc_native_manifest; /* host's list of natives, to record ordinals from */
 
 extern void* inpf;      /* file read from (source or include) */
 extern void* inpf_org;  /* main source file */
@@ -104,6 +115,19 @@ extern std::vector<int> gCurrentLineStack;
 extern std::vector<void*> gInputFileStack;
 extern std::vector<char*> gInputFilenameStack;
 
+// The phases --time-phases reports on. Preprocessing and lexing happen on
+// demand while parsing, so their time is not counted as parsing.
+enum CompilePhase {
+    kPhasePreprocess,
+    kPhaseLex,
+    kPhaseParse,
+    kPhaseCodegen,
+    kPhasePeephole,
+    kPhaseAssemble,
+    kNumCompilePhases
+};
+extern sp::PhaseTimer gPhaseTimer;
+
 // Returns true if compilation is in its second phase (writing phase) and has
 // so far proceeded without error.
 static inline bool
@@ -411,6 +411,7 @@ BinaryExprBase::ProcessUses()
 BinaryExpr::BinaryExpr(const token_pos_t& pos, int token, Expr* left, Expr* right)
   : BinaryExprBase(pos, token, left, right)
 {
+    kind_ = Kind::Binary;
     oper_ = TokenToOpFunc(token_);
 }
 
@@ -918,9 +919,8 @@ SymbolExpr::AnalyzeWithOptions(bool allow_types)
     if (sym_->ident == iCONSTEXPR) {
         // Hack: __LINE__ is updated by the lexer, so we have to special case
         // it here.
-        static symbol* sLineConst = findconst("__LINE__");
-        if (sym_ == sLineConst)
-            val_.constval = pos_.line;
+        if (sym_ == sc_linesym)
+            val_.constval = pos().line;
         else
             val_.constval = sym_->addr();
     }
@@ -1550,6 +1550,7 @@ DefaultArgExpr::DefaultArgExpr(const token_pos_t& pos, arginfo* arg)
   : EmitOnlyExpr(pos),
     arg_(arg)
 {
+    kind_ = Kind::DefaultArg;
     // Leave val bogus, it doesn't participate in anything, and we can't
     // accurately construct it.
 }
@@ -1813,6 +1814,17 @@ CallExpr::ProcessArg(arginfo* arg, Expr* param, unsigned int pos)
                         }
                     }
                 }
+            } else if (val->sym->flat && val->sym->dim.array.level > 0) {
+                // A flat array has no indirection vectors, so it can only be
+                // seen as one block of cells.
+                if (arg->numdim != 1) {
+                    error(pos_, 48); // array dimensions must match
+                    return false;
+                }
+                if (arg->dim[0] != 0 && arg->dim[0] != flat_array_cells(val->sym)) {
+                    error(pos_, 47); // array sizes must match
+                    return false;
+                }
             } else {
                 symbol* sym = val->sym;
                 if (sym->dim.array.level + 1 != arg->numdim) {
@@ -1853,6 +1865,10 @@ CallExpr::ProcessArg(arginfo* arg, Expr* param, unsigned int pos)
                 error(pos_, 178, type_to_name(val->tag), type_to_name(arg->tag));
                 return false;
             }
+            if (arg->is_const) {
+                if (StringExpr* str = param->AsStringExpr())
+                    str->set_shared();
+            }
             break;
         default:
             assert(false);
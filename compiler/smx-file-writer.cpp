@@ -0,0 +1,131 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2012-2014 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "smx-file-writer.h"
+
+using namespace sp;
+
+SmxFileWriter::SmxFileWriter(FILE* fp, int compression_level)
+  : fp_(fp),
+    deflating_(false),
+    zerr_(Z_OK),
+    pos_(0)
+{
+    memset(&header_, 0, sizeof(header_));
+    memset(&stream_, 0, sizeof(stream_));
+    if (!compression_level)
+        return;
+
+    zerr_ = deflateInit(&stream_, compression_level);
+    if (zerr_ != Z_OK)
+        return;
+    deflating_ = true;
+    out_ = std::make_unique<uint8_t[]>(kChunkSize);
+}
+
+SmxFileWriter::~SmxFileWriter()
+{
+    if (deflating_)
+        deflateEnd(&stream_);
+}
+
+bool
+SmxFileWriter::write(const void* bytes, size_t len)
+{
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(bytes);
+
+    // Hold on to the header, since finish() has to rewrite it.
+    if (pos_ < sizeof(header_)) {
+        size_t n = std::min(len, sizeof(header_) - pos_);
+        memcpy(reinterpret_cast<uint8_t*>(&header_) + pos_, ptr, n);
+        pos_ += n;
+        ptr += n;
+        len -= n;
+        if (pos_ == sizeof(header_) && !writeHeader())
+            return false;
+    }
+
+    // Everything before |dataoffs| is stored as-is.
+    size_t raw = len;
+    if (deflating_)
+        raw = (pos_ < header_.dataoffs) ? std::min(len, size_t(header_.dataoffs - pos_)) : 0;
+    if (raw && fwrite(ptr, 1, raw, fp_) != raw)
+        return false;
+    pos_ += raw;
+    ptr += raw;
+    len -= raw;
+
+    if (!len)
+        return true;
+    pos_ += len;
+    return deflateSome(ptr, len, Z_NO_FLUSH);
+}
+
+bool
+SmxFileWriter::finish()
+{
+    if (pos_ < sizeof(header_))
+        return false;
+
+    if (deflating_) {
+        if (!deflateSome(nullptr, 0, Z_FINISH))
+            return false;
+        header_.compression = SmxConsts::FILE_COMPRESSION_GZ;
+        header_.disksize = header_.dataoffs + stream_.total_out;
+    } else {
+        header_.compression = SmxConsts::FILE_COMPRESSION_NONE;
+        header_.disksize = 0;
+    }
+
+    if (fseek(fp_, 0, SEEK_SET) != 0)
+        return false;
+    return writeHeader();
+}
+
+bool
+SmxFileWriter::writeHeader()
+{
+    return fwrite(&header_, 1, sizeof(header_), fp_) == sizeof(header_);
+}
+
+bool
+SmxFileWriter::deflateSome(const uint8_t* bytes, size_t len, int flush)
+{
+    assert(len <= UINT_MAX);
+    stream_.next_in = const_cast<Bytef*>(bytes);
+    stream_.avail_in = uInt(len);
+    do {
+        stream_.next_out = out_.get();
+        stream_.avail_out = uInt(kChunkSize);
+        int err = deflate(&stream_, flush);
+        if (err == Z_STREAM_ERROR) {
+            zerr_ = err;
+            return false;
+        }
+        size_t have = kChunkSize - stream_.avail_out;
+        if (have && fwrite(out_.get(), 1, have, fp_) != have)
+            return false;
+    } while (stream_.avail_out == 0);
+    assert(!stream_.avail_in);
+    return true;
+}
@@ -0,0 +1,79 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2012-2014 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#ifndef _include_spcomp_smx_file_writer_h_
+#define _include_spcomp_smx_file_writer_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+
+#include <smx/smx-v1.h>
+#include <zlib/zlib.h>
+#include "libsmx/smx-buffer.h"
+
+namespace sp {
+
+// Writes an SMX image straight to a file as SmxBuilder produces it, instead
+// of collecting it in memory first. If |compression_level| is non-zero, the
+// region after the header's |dataoffs| is deflated as it streams through,
+// which gives the same zlib stream compress2() would.
+//
+// pos() is the position in the uncompressed image. The header is written
+// first as a placeholder and patched by finish(), so |fp| must be seekable.
+class SmxFileWriter : public ISmxBuffer
+{
+  public:
+    SmxFileWriter(FILE* fp, int compression_level);
+    ~SmxFileWriter();
+
+    bool write(const void* bytes, size_t len) override;
+    size_t pos() const override {
+        return pos_;
+    }
+
+    // Flushes the compressor and rewrites the header with the final
+    // compression type and disk size.
+    bool finish();
+
+    // The zlib error that turned compression off or failed the write, or
+    // Z_OK.
+    int zlib_error() const {
+        return zerr_;
+    }
+
+  private:
+    static const size_t kChunkSize = 64 * 1024;
+
+    bool writeHeader();
+    bool deflateSome(const uint8_t* bytes, size_t len, int flush);
+
+  private:
+    FILE* fp_;
+    bool deflating_;
+    int zerr_;
+    size_t pos_;
+    sp_file_hdr_t header_;
+    z_stream stream_;
+    std::unique_ptr<uint8_t[]> out_;
+};
+
+} // namespace sp
+
+#endif // _include_spcomp_smx_file_writer_h_
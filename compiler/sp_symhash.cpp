@@ -10,8 +10,8 @@ struct NameAndScope {
     sp::Atom* name;
     int fnumber;
 
-    NameAndScope(const char* name, int fnumber)
-     : name(gAtoms.add(name)),
+    NameAndScope(sp::Atom* name, int fnumber)
+     : name(name),
        fnumber(fnumber)
     {}
 };
@@ -71,6 +71,12 @@ DestroyHashTable(HashTable* ht)
 
 symbol*
 FindInHashTable(HashTable* ht, const char* name, int fnumber)
+{
+    return FindInHashTable(ht, gAtoms.add(name), fnumber);
+}
+
+symbol*
+FindInHashTable(HashTable* ht, sp::Atom* name, int fnumber)
 {
     NameAndScope nas(name, fnumber);
     HashTable::Result r = ht->find(nas);
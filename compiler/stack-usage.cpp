@@ -0,0 +1,463 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include "stack-usage.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include <smx/smx-v1-opcodes.h>
+
+
+// The compiler's own opcode enum (amx.h) clashes with these, hence sp::.
+//
+// Cells taken by each instruction, opcode included. Case tables vary in
+// length, and are never walked into.
+static const int kOpcodeCells[] = {
+#define _G(op, text, cells) cells,
+#define _U(op, text) 0,
+    OPCODE_LIST(_G, _U)
+#undef _G
+#undef _U
+};
+
+// Anything deeper than this is taken to be code that never balances.
+static const int64_t kMaxCells = 1 << 24;
+
+namespace {
+
+struct CallSite {
+    size_t callee;
+    int64_t stack;
+    int64_t heap;
+};
+
+struct FunctionUsage {
+    int64_t stack = 0;
+    int64_t heap = 0;
+    std::vector<CallSite> calls;
+
+    // Set if the function's own usage can't be bounded.
+    const char* problem = nullptr;
+};
+
+struct WalkState {
+    size_t pc;
+    size_t prev;
+    int64_t stack;
+    int64_t heap;
+
+    // The amounts pushed by trk.push.c, which trk.pop frees again.
+    std::vector<int64_t> trackers;
+};
+
+class UsageWalker
+{
+  public:
+    UsageWalker(const std::vector<cell>& code, size_t start, size_t end,
+                const std::unordered_map<cell, size_t>& functions, FunctionUsage* usage)
+      : code_(code),
+        start_(start),
+        end_(end),
+        functions_(functions),
+        usage_(usage)
+    {}
+
+    void walk();
+
+  private:
+    bool step(WalkState& state, bool* falls_through);
+    bool branch(const WalkState& from, cell target);
+    bool fail(const char* problem) {
+        usage_->problem = problem;
+        return false;
+    }
+
+  private:
+    const std::vector<cell>& code_;
+    size_t start_;
+    size_t end_;
+    const std::unordered_map<cell, size_t>& functions_;
+    FunctionUsage* usage_;
+
+    // The deepest stack and heap each instruction has been reached with.
+    std::unordered_map<size_t, std::pair<int64_t, int64_t>> seen_;
+    std::vector<WalkState> work_;
+};
+
+} // anonymous namespace
+
+// The stack and heap don't depend on how a join was reached in compiled
+// code, so every instruction is normally walked once. If a path does reach
+// one deeper than before, it is walked again from there.
+void
+UsageWalker::walk()
+{
+    work_.push_back(WalkState{start_, SIZE_MAX, 0, 0, {}});
+    while (!work_.empty()) {
+        WalkState state = std::move(work_.back());
+        work_.pop_back();
+
+        for (;;) {
+            if (state.pc >= end_) {
+                fail("code that runs off its end");
+                return;
+            }
+
+            auto iter = seen_.find(state.pc);
+            if (iter != seen_.end()) {
+                if (state.stack <= iter->second.first && state.heap <= iter->second.second)
+                    break;
+                iter->second.first = std::max(iter->second.first, state.stack);
+                iter->second.second = std::max(iter->second.second, state.heap);
+            } else {
+                seen_.emplace(state.pc, std::make_pair(state.stack, state.heap));
+            }
+
+            bool falls_through = true;
+            if (!step(state, &falls_through))
+                return;
+            if (state.stack < 0 || state.heap < 0) {
+                fail("unbalanced code");
+                return;
+            }
+            if (state.stack > kMaxCells || state.heap > kMaxCells) {
+                fail("unbounded stack use");
+                return;
+            }
+            usage_->stack = std::max(usage_->stack, state.stack);
+            usage_->heap = std::max(usage_->heap, state.heap);
+            if (!falls_through)
+                break;
+        }
+    }
+}
+
+bool
+UsageWalker::branch(const WalkState& from, cell target)
+{
+    if (target < 0 || target % sizeof(cell) != 0)
+        return fail("a bad jump");
+    size_t pc = size_t(target) / sizeof(cell);
+    if (pc < start_ || pc >= end_)
+        return fail("a jump out of the function");
+
+    WalkState next = from;
+    next.pc = pc;
+    next.prev = SIZE_MAX;
+    work_.push_back(std::move(next));
+    return true;
+}
+
+bool
+UsageWalker::step(WalkState& state, bool* falls_through)
+{
+    cell op = code_[state.pc];
+    if (op <= 0 || op >= sp::OP_UNGEN_FIRST_FAKE || kOpcodeCells[op] <= 0)
+        return fail("an unknown instruction");
+
+    size_t length = kOpcodeCells[op];
+    if (state.pc + length > end_)
+        return fail("code that runs off its end");
+    const cell* args = &code_[state.pc + 1];
+
+    switch (op) {
+        case sp::OP_PROC: // saves the frame pointer
+        case sp::OP_PUSH_PRI:
+        case sp::OP_PUSH_ALT:
+            state.stack++;
+            break;
+
+        case sp::OP_PUSH_C:
+        case sp::OP_PUSH:
+        case sp::OP_PUSH_S:
+        case sp::OP_PUSH_ADR:
+        case sp::OP_PUSH2_C:
+        case sp::OP_PUSH2:
+        case sp::OP_PUSH2_S:
+        case sp::OP_PUSH2_ADR:
+        case sp::OP_PUSH3_C:
+        case sp::OP_PUSH3:
+        case sp::OP_PUSH3_S:
+        case sp::OP_PUSH3_ADR:
+        case sp::OP_PUSH4_C:
+        case sp::OP_PUSH4:
+        case sp::OP_PUSH4_S:
+        case sp::OP_PUSH4_ADR:
+        case sp::OP_PUSH5_C:
+        case sp::OP_PUSH5:
+        case sp::OP_PUSH5_S:
+        case sp::OP_PUSH5_ADR:
+            state.stack += length - 1;
+            break;
+
+        case sp::OP_POP_PRI:
+        case sp::OP_POP_ALT:
+            state.stack--;
+            break;
+
+        case sp::OP_STACK:
+            state.stack -= args[0] / cell(sizeof(cell));
+            break;
+
+        case sp::OP_HEAP:
+            state.heap += args[0] / cell(sizeof(cell));
+            break;
+
+        case sp::OP_TRACKER_PUSH_C:
+            state.trackers.push_back(args[0] / cell(sizeof(cell)));
+            break;
+
+        case sp::OP_TRACKER_POP_SETHEAP:
+            if (state.trackers.empty())
+                return fail("unbalanced code");
+            state.heap -= state.trackers.back();
+            state.trackers.pop_back();
+            break;
+
+        case sp::OP_GENARRAY:
+        case sp::OP_GENARRAY_Z:
+            return fail("an array sized at runtime");
+
+        case sp::OP_CALL:
+        {
+            // The argument count is always pushed right before the call, and
+            // the callee pops it along with the arguments.
+            if (state.prev == SIZE_MAX)
+                return fail("a call without an argument count");
+            cell prev_op = code_[state.prev];
+            size_t prev_length = kOpcodeCells[prev_op];
+            if (prev_op != sp::OP_PUSH_C && prev_op != sp::OP_PUSH2_C &&
+                prev_op != sp::OP_PUSH3_C && prev_op != sp::OP_PUSH4_C &&
+                prev_op != sp::OP_PUSH5_C)
+            {
+                return fail("a call without an argument count");
+            }
+            cell nargs = code_[state.prev + prev_length - 1];
+
+            auto iter = functions_.find(args[0]);
+            if (iter == functions_.end())
+                return fail("a call to an unknown function");
+            usage_->calls.push_back(CallSite{iter->second, state.stack, state.heap});
+            state.stack -= nargs + 1;
+            break;
+        }
+
+        case sp::OP_SYSREQ_N:
+            // The argument count is pushed for the native, and popped along
+            // with the arguments.
+            usage_->stack = std::max(usage_->stack, state.stack + 1);
+            state.stack -= args[1];
+            break;
+
+        case sp::OP_JUMP:
+            *falls_through = false;
+            return branch(state, args[0]);
+
+        case sp::OP_JZER:
+        case sp::OP_JNZ:
+        case sp::OP_JEQ:
+        case sp::OP_JNEQ:
+        case sp::OP_JSLESS:
+        case sp::OP_JSLEQ:
+        case sp::OP_JSGRTR:
+        case sp::OP_JSGEQ:
+            if (!branch(state, args[0]))
+                return false;
+            break;
+
+        case sp::OP_SWITCH:
+        {
+            *falls_through = false;
+            if (args[0] < 0 || args[0] % sizeof(cell) != 0)
+                return fail("a bad jump");
+            size_t table = size_t(args[0]) / sizeof(cell);
+            if (table + 3 > end_ || code_[table] != sp::OP_CASETBL || code_[table + 1] < 0 ||
+                table + 3 + size_t(code_[table + 1]) * 2 > end_)
+            {
+                return fail("a bad case table");
+            }
+            if (!branch(state, code_[table + 2]))
+                return false;
+            for (cell i = 0; i < code_[table + 1]; i++) {
+                if (!branch(state, code_[table + 4 + i * 2]))
+                    return false;
+            }
+            return true;
+        }
+
+        case sp::OP_RETN:
+        case sp::OP_HALT:
+        case sp::OP_ENDPROC:
+            *falls_through = false;
+            return true;
+
+        case sp::OP_CASETBL:
+            return fail("an unknown instruction");
+
+        default:
+            break;
+    }
+
+    state.prev = state.pc;
+    state.pc += length;
+    return true;
+}
+
+namespace {
+
+// Finds the worst case through each function's calls, depth first.
+class CallGraphWalker
+{
+  public:
+    CallGraphWalker(const std::vector<symbol*>& functions, const std::vector<FunctionUsage>& usage)
+      : functions_(functions),
+        usage_(usage),
+        state_(functions.size(), Unvisited),
+        worst_(functions.size())
+    {}
+
+    bool visit(size_t index);
+
+    const FunctionUsage& worst(size_t index) const {
+        return worst_[index];
+    }
+    const std::string& reason() const {
+        return reason_;
+    }
+
+  private:
+    bool fail(const std::string& reason) {
+        if (reason_.empty())
+            reason_ = reason;
+        return false;
+    }
+
+  private:
+    enum State { Unvisited, Visiting, Done, Failed };
+
+    const std::vector<symbol*>& functions_;
+    const std::vector<FunctionUsage>& usage_;
+    std::vector<State> state_;
+    std::vector<FunctionUsage> worst_;
+    std::string reason_;
+};
+
+} // anonymous namespace
+
+bool
+CallGraphWalker::visit(size_t index)
+{
+    switch (state_[index]) {
+        case Visiting:
+            return fail(std::string("recursion through ") + functions_[index]->name());
+        case Done:
+            return true;
+        case Failed:
+            return false;
+        default:
+            break;
+    }
+
+    const FunctionUsage& usage = usage_[index];
+    if (usage.problem) {
+        state_[index] = Failed;
+        return fail(std::string(usage.problem) + " in " + functions_[index]->name());
+    }
+
+    state_[index] = Visiting;
+
+    FunctionUsage& worst = worst_[index];
+    worst.stack = usage.stack;
+    worst.heap = usage.heap;
+    for (const auto& call : usage.calls) {
+        if (!visit(call.callee)) {
+            state_[index] = Failed;
+            return false;
+        }
+
+        // The call saves the return address.
+        const FunctionUsage& callee = worst_[call.callee];
+        worst.stack = std::max(worst.stack, call.stack + 1 + callee.stack);
+        worst.heap = std::max(worst.heap, call.heap + callee.heap);
+        if (worst.stack > kMaxCells || worst.heap > kMaxCells) {
+            state_[index] = Failed;
+            return fail(std::string("calls too deep through ") + functions_[index]->name());
+        }
+    }
+
+    state_[index] = Done;
+    return true;
+}
+
+StackUsage
+EstimateStackUsage(const std::vector<cell>& code, const std::vector<symbol*>& functions)
+{
+    std::unordered_map<cell, size_t> by_address;
+    std::vector<size_t> starts;
+    for (size_t i = 0; i < functions.size(); i++) {
+        by_address.emplace(functions[i]->addr(), i);
+        starts.push_back(functions[i]->addr() / sizeof(cell));
+    }
+    std::sort(starts.begin(), starts.end());
+
+    // Each function runs up to the next one.
+    std::vector<FunctionUsage> usage(functions.size());
+    for (size_t i = 0; i < functions.size(); i++) {
+        size_t start = functions[i]->addr() / sizeof(cell);
+        auto next = std::upper_bound(starts.begin(), starts.end(), start);
+        size_t end = next != starts.end() ? *next : code.size();
+
+        UsageWalker walker(code, start, end, by_address, &usage[i]);
+        walker.walk();
+    }
+
+    StackUsage result;
+    CallGraphWalker graph(functions, usage);
+    int64_t most = 0;
+    for (size_t i = 0; i < functions.size(); i++) {
+        symbol* sym = functions[i];
+        if (!sym->is_public)
+            continue;
+
+        // The VM pushes the arguments, their count, and a return address.
+        int64_t entry = 2;
+        for (const arginfo& arg : sym->function()->args) {
+            if (!arg.ident)
+                break;
+            if (arg.ident == iVARARGS) {
+                result.reason = std::string("variable arguments to ") + sym->name();
+                return result;
+            }
+            entry++;
+        }
+
+        if (!graph.visit(i)) {
+            result.reason = graph.reason();
+            return result;
+        }
+        const FunctionUsage& worst = graph.worst(i);
+        most = std::max(most, entry + worst.stack + worst.heap);
+    }
+
+    result.known = true;
+    result.cells = cell(most);
+    return result;
+}
@@ -0,0 +1,44 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#ifndef _include_spcomp_stack_usage_h_
+#define _include_spcomp_stack_usage_h_
+
+#include <string>
+#include <vector>
+
+#include "sc.h"
+
+// The most stack and heap, in cells, that a call into any public function can
+// use at once, found by walking the generated code of every function and
+// then the call graph.
+//
+// This can't be known for code that recurses, or that makes arrays whose
+// size is only known at runtime; |known| is then false and |reason| says
+// where. Natives that call back into the plugin (sorting with a callback,
+// say) nest one public inside another, which is not accounted for here.
+struct StackUsage {
+    bool known = false;
+    cell cells = 0;
+    std::string reason;
+};
+
+// |functions| holds every function in |code|.
+StackUsage EstimateStackUsage(const std::vector<cell>& code,
+                              const std::vector<symbol*>& functions);
+
+#endif // _include_spcomp_stack_usage_h_
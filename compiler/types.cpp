@@ -115,11 +115,10 @@ TypeDictionary::TypeDictionary() {}
 Type*
 TypeDictionary::find(const char* name)
 {
-    for (const auto& type : types_) {
-        if (strcmp(type->name(), name) == 0)
-            return type.get();
-    }
-    return nullptr;
+    auto iter = by_name_.find(name);
+    if (iter == by_name_.end())
+        return nullptr;
+    return iter->second;
 }
 
 Type*
@@ -133,13 +132,12 @@ TypeDictionary::find(int tag)
 Type*
 TypeDictionary::findOrAdd(const char* name)
 {
-    for (const auto& type : types_) {
-        if (strcmp(type->name(), name) == 0)
-            return type.get();
-    }
+    if (Type* type = find(name))
+        return type;
 
     int tag = int(types_.size());
     std::unique_ptr<Type> type = std::make_unique<Type>(name, tag);
+    by_name_.emplace(type->name(), type.get());
     types_.push_back(std::move(type));
     return types_.back().get();
 }
@@ -148,6 +146,7 @@ void
 TypeDictionary::clear()
 {
     types_.clear();
+    by_name_.clear();
 }
 
 void
@@ -27,6 +27,8 @@
 #define _INCLUDE_SOURCEPAWN_COMPILER_TYPES_H_
 
 #include <memory>
+#include <string>
+#include <unordered_map>
 
 #include <amtl/am-enum.h>
 #include <amtl/am-string.h>
@@ -69,6 +71,7 @@ struct typeinfo_t {
     bool is_const : 1;
     bool is_new : 1;        // New-style declaration.
     bool has_postdims : 1;  // Dimensions, if present, were in postfix position.
+    bool is_flat : 1;       // Array laid out without indirection vectors.
 
     // If non-zero, this type was originally declared with this type, but was
     // rewritten for desugaring.
@@ -273,6 +276,9 @@ class TypeDictionary
 
   private:
     std::vector<std::unique_ptr<Type>> types_;
+
+    // Types by name; a type's name never changes after it is added.
+    std::unordered_map<std::string, Type*> by_name_;
 };
 
 extern TypeDictionary gTypes;
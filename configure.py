@@ -42,7 +42,7 @@ parser.options.add_argument('--enable-optimize', action='store_const', const='1'
                             help='Enable optimization')
 parser.options.add_argument('--amtl', type=str, dest='amtl', default=None, help='Custom AMTL path')
 parser.options.add_argument('--build', type=str, dest='build', default='all', 
-                            help='Build which components (all, spcomp, vm, exp, test, core)')
+                            help='Build which components (all, spcomp, vm, exp, test, core, bench)')
 parser.options.add_argument('--enable-spew', action='store_true', default=False, dest='enable_spew',
                             help='Enable debug spew')
 parser.options.add_argument("--enable-coverage", action='store_true', default=False,
@@ -0,0 +1,156 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2012-2014 David Anderson
+// 
+// This file is part of SourcePawn.
+// 
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+
+#include "build-stamp.h"
+#include "source-manager.h"
+
+using namespace ke;
+using namespace sp;
+
+static const char kStampHeader[] = "spcomp2-deps 1";
+
+BuildStamp::BuildStamp(const std::string& output)
+ : output_(output),
+   path_(output + ".deps")
+{
+}
+
+uint64_t
+BuildStamp::Hash(const char* bytes, size_t length)
+{
+  // 64-bit FNV-1a.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= uint8_t(bytes[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Returns the contents hash of the file at |path|, or false if it can't be
+// read.
+static bool
+HashFile(const char* path, uint64_t* hash)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    return false;
+
+  std::string contents;
+  char buffer[16 * 1024];
+  size_t nread;
+  while ((nread = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    contents.append(buffer, nread);
+  bool ok = !ferror(fp);
+  fclose(fp);
+
+  if (!ok)
+    return false;
+  *hash = BuildStamp::Hash(contents.c_str(), contents.size());
+  return true;
+}
+
+// Reads one line without its newline. Returns false at the end of the file.
+static bool
+ReadLine(FILE* fp, std::string* line)
+{
+  line->clear();
+  int c;
+  while ((c = fgetc(fp)) != EOF) {
+    if (c == '\n')
+      return true;
+    line->push_back(char(c));
+  }
+  return !line->empty();
+}
+
+bool
+BuildStamp::isUpToDate(const std::string& options) const
+{
+  if (FILE* out = fopen(output_.c_str(), "rb"))
+    fclose(out);
+  else
+    return false;
+
+  FILE* fp = fopen(path_.c_str(), "rb");
+  if (!fp)
+    return false;
+  std::unique_ptr<FILE, int(*)(FILE*)> closer(fp, fclose);
+
+  std::string line;
+  if (!ReadLine(fp, &line) || line != kStampHeader)
+    return false;
+
+  uint64_t recorded;
+  if (!ReadLine(fp, &line) || sscanf(line.c_str(), "options %" SCNx64, &recorded) != 1)
+    return false;
+  if (recorded != Hash(options.c_str(), options.size()))
+    return false;
+
+  // Each remaining line is "<hash> <path>".
+  size_t nfiles = 0;
+  while (ReadLine(fp, &line)) {
+    size_t space = line.find(' ');
+    if (space == std::string::npos)
+      return false;
+    if (sscanf(line.c_str(), "%" SCNx64, &recorded) != 1)
+      return false;
+
+    uint64_t current;
+    if (!HashFile(line.c_str() + space + 1, &current) || current != recorded)
+      return false;
+    nfiles++;
+  }
+  return nfiles > 0;
+}
+
+bool
+BuildStamp::write(const std::string& options,
+                  const std::vector<RefPtr<SourceFile>>& files) const
+{
+  FILE* fp = fopen(path_.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  fprintf(fp, "%s\n", kStampHeader);
+  fprintf(fp, "options %016" PRIx64 "\n", Hash(options.c_str(), options.size()));
+  for (const RefPtr<SourceFile>& file : files) {
+    // Files are hashed as they were compiled, rather than re-read, so an
+    // edit made during the compile makes the next one rebuild.
+    uint64_t hash = Hash(file->chars(), file->length());
+    fprintf(fp, "%016" PRIx64 " %s\n", hash, file->path());
+  }
+
+  bool ok = !ferror(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok)
+    remove();
+  return ok;
+}
+
+void
+BuildStamp::remove() const
+{
+  ::remove(path_.c_str());
+}
@@ -0,0 +1,66 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2012-2014 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#ifndef _include_spcomp_build_stamp_h_
+#define _include_spcomp_build_stamp_h_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <amtl/am-refcounting.h>
+
+namespace sp {
+
+class SourceFile;
+
+// Records what a compile read, so that a later compile run with
+// --incremental can tell it would write the same output and skip the work.
+// The stamp for an output file is kept beside it, with ".deps" appended.
+//
+// Each source file is recorded with a hash of its contents, and the
+// compile with a hash of the options that change what it produces. Files
+// that were searched for but not found aren't recorded, so adding a file
+// that an include would now find first isn't noticed, and neither is a
+// change to the compiler itself.
+class BuildStamp
+{
+ public:
+  explicit BuildStamp(const std::string& output);
+
+  // Returns whether the output exists and was built with the same options
+  // from files whose contents have not changed since.
+  bool isUpToDate(const std::string& options) const;
+
+  // Records the inputs of a compile that wrote the output. Returns false
+  // if the stamp could not be written.
+  bool write(const std::string& options, const std::vector<ke::RefPtr<SourceFile>>& files) const;
+
+  // Removes the stamp, so that the output is never considered up to date.
+  void remove() const;
+
+  static uint64_t Hash(const char* bytes, size_t length);
+
+ private:
+  std::string output_;
+  std::string path_;
+};
+
+} // namespace sp
+
+#endif // _include_spcomp_build_stamp_h_
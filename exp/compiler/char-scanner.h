@@ -0,0 +1,226 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2012-2014 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+#ifndef _include_spcomp_char_scanner_h_
+#define _include_spcomp_char_scanner_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define SP_SCAN_SSE2
+# include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+# define SP_SCAN_NEON
+# include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(SP_SCAN_SSE2) || defined(SP_SCAN_NEON))
+# include <intrin.h>
+#endif
+
+namespace sp {
+
+// Scanners for the runs of characters the lexer and line cache skip over.
+// Each takes [p, end) and returns the first character that stops the run,
+// or |end|. With SSE2 or NEON, sixteen characters are tested at a time;
+// loads never go past |end|, so the rest is tested one at a time.
+namespace scan {
+
+#if defined(SP_SCAN_SSE2) || defined(SP_SCAN_NEON)
+static const ptrdiff_t kBlockSize = 16;
+
+#if defined(SP_SCAN_SSE2)
+typedef __m128i Block;
+
+static inline Block Load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+static inline Block Splat(char c) {
+  return _mm_set1_epi8(c);
+}
+static inline Block Equal(Block a, char c) {
+  return _mm_cmpeq_epi8(a, Splat(c));
+}
+static inline Block Or(Block a, Block b) {
+  return _mm_or_si128(a, b);
+}
+static inline Block Not(Block a) {
+  return _mm_xor_si128(a, _mm_set1_epi8(-1));
+}
+// Matches bytes from |lo| to |hi|, compared as unsigned.
+static inline Block InRange(Block a, char lo, char hi) {
+  Block offset = _mm_sub_epi8(a, Splat(lo));
+  return _mm_cmpeq_epi8(_mm_subs_epu8(offset, Splat(char(hi - lo))), _mm_setzero_si128());
+}
+static inline Block Lower(Block a) {
+  return _mm_or_si128(a, Splat(0x20));
+}
+
+// Returns the index of the first matching byte, or kBlockSize.
+static inline ptrdiff_t FirstMatch(Block matches) {
+  uint32_t mask = uint32_t(_mm_movemask_epi8(matches));
+  if (!mask)
+    return kBlockSize;
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return ptrdiff_t(index);
+#else
+  return ptrdiff_t(__builtin_ctz(mask));
+#endif
+}
+#else
+typedef uint8x16_t Block;
+
+static inline Block Load(const char* p) {
+  return vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+}
+static inline Block Splat(char c) {
+  return vdupq_n_u8(uint8_t(c));
+}
+static inline Block Equal(Block a, char c) {
+  return vceqq_u8(a, Splat(c));
+}
+static inline Block Or(Block a, Block b) {
+  return vorrq_u8(a, b);
+}
+static inline Block Not(Block a) {
+  return vmvnq_u8(a);
+}
+static inline Block InRange(Block a, char lo, char hi) {
+  return vcleq_u8(vsubq_u8(a, Splat(lo)), Splat(char(hi - lo)));
+}
+static inline Block Lower(Block a) {
+  return vorrq_u8(a, Splat(0x20));
+}
+
+// NEON has no movemask; narrowing each byte to four bits gives a 64-bit
+// mask with the same order.
+static inline ptrdiff_t FirstMatch(Block matches) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+  uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+  if (!mask)
+    return kBlockSize;
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, mask);
+  return ptrdiff_t(index) / 4;
+#else
+  return ptrdiff_t(__builtin_ctzll(mask)) / 4;
+#endif
+}
+#endif
+
+# define SP_SCAN_BLOCKS(p, end, stops)                  \
+  for (; (end) - (p) >= kBlockSize; (p) += kBlockSize) { \
+    Block block = Load(p);                              \
+    ptrdiff_t index = FirstMatch(stops);                \
+    if (index < kBlockSize)                             \
+      return (p) + index;                               \
+  }
+#else
+# define SP_SCAN_BLOCKS(p, end, stops)
+#endif
+
+static inline bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\f';
+}
+static inline bool IsIdentChar(char c) {
+  return (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') ||
+          c == '_';
+}
+
+} // namespace scan
+
+// Finds the next '\r' or '\n'.
+static inline const char*
+ScanToNewline(const char* p, const char* end)
+{
+  using namespace scan;
+  SP_SCAN_BLOCKS(p, end, Or(Equal(block, '\n'), Equal(block, '\r')));
+  for (; p < end; p++) {
+    if (*p == '\n' || *p == '\r')
+      return p;
+  }
+  return end;
+}
+
+// Finds the next '\r', '\n' or '\0', which end a line to the lexer.
+static inline const char*
+ScanToLineEnd(const char* p, const char* end)
+{
+  using namespace scan;
+  SP_SCAN_BLOCKS(p, end, Or(Or(Equal(block, '\n'), Equal(block, '\r')), Equal(block, '\0')));
+  for (; p < end; p++) {
+    if (*p == '\n' || *p == '\r' || *p == '\0')
+      return p;
+  }
+  return end;
+}
+
+// Finds the next character a block comment has to look at: a '*' that may
+// end it, or a line end.
+static inline const char*
+ScanToCommentEnd(const char* p, const char* end)
+{
+  using namespace scan;
+  SP_SCAN_BLOCKS(p, end, Or(Or(Equal(block, '*'), Equal(block, '\0')),
+                            Or(Equal(block, '\n'), Equal(block, '\r'))));
+  for (; p < end; p++) {
+    if (*p == '*' || *p == '\n' || *p == '\r' || *p == '\0')
+      return p;
+  }
+  return end;
+}
+
+// Skips spaces, tabs and form feeds.
+static inline const char*
+SkipSpaces(const char* p, const char* end)
+{
+  using namespace scan;
+  SP_SCAN_BLOCKS(p, end, Not(Or(Or(Equal(block, ' '), Equal(block, '\t')),
+                                Equal(block, '\f'))));
+  for (; p < end; p++) {
+    if (!IsSpace(*p))
+      return p;
+  }
+  return end;
+}
+
+// Skips letters, digits and underscores. Only 'A'-'Z' land in 'a'-'z' when
+// 0x20 is or'd in, so letters take one range test.
+static inline const char*
+SkipIdentChars(const char* p, const char* end)
+{
+  using namespace scan;
+  SP_SCAN_BLOCKS(p, end, Not(Or(Or(InRange(Lower(block), 'a', 'z'), InRange(block, '0', '9')),
+                                Equal(block, '_'))));
+  for (; p < end; p++) {
+    if (!IsIdentChar(*p))
+      return p;
+  }
+  return end;
+}
+
+#undef SP_SCAN_BLOCKS
+
+} // namespace sp
+
+#endif // _include_spcomp_char_scanner_h_
@@ -15,6 +15,7 @@
 //
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include "build-stamp.h"
 #include "compile-context.h"
 #include "compile-phases.h"
 #include "source-manager.h"
@@ -33,6 +34,23 @@ using namespace ke;
 using namespace sp;
 
 ThreadLocal<CompileContext*> sp::CurrentCompileContext;
+ThreadLocal<PoolAllocator*> sp::CurrentThreadPool;
+ThreadLocal<ReportManager*> sp::CurrentThreadReports;
+
+static const char* const sPhaseNames[kNumCompilePhases] = {
+  "parse",
+  "semantic analysis",
+  "codegen",
+  "emit",
+};
+
+static size_t
+PoolBytesAllocated()
+{
+  size_t allocated, reserved, bookkeeping;
+  POOL().memoryUsage(&allocated, &reserved, &bookkeeping);
+  return allocated;
+}
 
 CompileContext::CompileContext(PoolAllocator& pool,
                                StringPool& strings,
@@ -42,7 +60,8 @@ CompileContext::CompileContext(PoolAllocator& pool,
    strings_(strings),
    reports_(reports),
    source_(source),
-   types_(strings)
+   types_(strings),
+   phases_(sPhaseNames, kNumCompilePhases, PoolBytesAllocated)
 {
   assert(!CurrentCompileContext);
 
@@ -59,6 +78,13 @@ CompileContext::~CompileContext()
   CurrentCompileContext = NULL;
 }
 
+PoolAllocator&
+CompileContext::addThreadPool()
+{
+  thread_pools_.push_back(std::make_unique<PoolAllocator>());
+  return *thread_pools_.back();
+}
+
 bool
 CompileContext::ChangePragmaDynamic(ReportingContext& rc, int64_t value)
 {
@@ -75,6 +101,15 @@ CompileContext::ChangePragmaDynamic(ReportingContext& rc, int64_t value)
   return true;
 }
 
+static void
+ReportPoolStats(FILE* fp)
+{
+  const PoolAllocator::Stats& stats = POOL().stats();
+  fprintf(fp, " -- %llu pool chunks allocated, %llu reused, %" KE_FMT_SIZET " KB peak\n",
+          (unsigned long long)stats.chunks_allocated, (unsigned long long)stats.chunks_reused,
+          stats.peak_reserved / 1024);
+}
+
 static void
 ReportMemory(FILE* fp)
 {
@@ -84,6 +119,7 @@ ReportMemory(FILE* fp)
   fprintf(fp, " -- %" KE_FMT_SIZET " bytes allocated in pool\n", allocated);
   fprintf(fp, " -- %" KE_FMT_SIZET " bytes reserved in pool\n", reserved);
   fprintf(fp, " -- %" KE_FMT_SIZET " bytes used for bookkeeping\n", bookkeeping);
+  ReportPoolStats(fp);
 }
 
 class FpBuffer : public ISmxBuffer
@@ -163,15 +199,92 @@ GetOutputFilename(const char* output_file, const char* input_file)
   return StringPrintf("%s.smx", output_file);
 }
 
+// Describes the options that change the output, for build stamps.
+static std::string
+StampedOptions(const CompileOptions& options)
+{
+  std::string text = StringPrintf("newdecls=%d semicolons=%d",
+                                  options.RequireNewdecls ? 1 : 0,
+                                  options.RequireSemicolons ? 1 : 0);
+  for (const std::string& path : options.SearchPaths)
+    text += " -i " + path;
+  return text;
+}
+
+// Make needs spaces, '#' and '$' escaped; Ninja reads depfiles the same way.
+static std::string
+EscapeDependency(const char* path)
+{
+  std::string escaped;
+  for (const char* iter = path; *iter; iter++) {
+    if (*iter == ' ' || *iter == '#')
+      escaped.push_back('\\');
+    else if (*iter == '$')
+      escaped.push_back('$');
+    escaped.push_back(*iter);
+  }
+  return escaped;
+}
+
+// Writes "target: sources", plus an empty rule for each source so a build
+// doesn't fail when an include is deleted.
+static bool
+WriteDependencyFile(const std::string& path, const std::string& target,
+                    const std::vector<RefPtr<SourceFile>>& files)
+{
+  FILE* fp = fopen(path.c_str(), "wt");
+  if (!fp)
+    return false;
+
+  fprintf(fp, "%s:", EscapeDependency(target.c_str()).c_str());
+  for (const auto& file : files)
+    fprintf(fp, " \\\n  %s", EscapeDependency(file->path()).c_str());
+  fprintf(fp, "\n");
+  for (const auto& file : files)
+    fprintf(fp, "\n%s:\n", EscapeDependency(file->path()).c_str());
+  return fclose(fp) == 0;
+}
+
 bool
 CompileContext::compile(RefPtr<SourceFile> file)
 {
+  if (options_.TimePhases)
+    phases_.start();
+
+  bool ok = compilePhases(file);
+
+  if (phases_.enabled()) {
+    phases_.stop();
+    fprintf(stderr, "\n");
+    phases_.report(stderr);
+    ReportPoolStats(stderr);
+  }
+  return ok;
+}
+
+bool
+CompileContext::compilePhases(RefPtr<SourceFile> file)
+{
+  std::string output_path = GetOutputFilename(
+    options_.OutputFile ? (*options_.OutputFile).c_str() : nullptr,
+    file->path());
+
+  BuildStamp stamp(output_path);
+  std::string stamped_options = StampedOptions(options_);
+  if (options_.Incremental && !options_.SkipSemanticAnalysis &&
+      stamp.isUpToDate(stamped_options))
+  {
+    fprintf(stderr, "-- Up to date: %s --\n", output_path.c_str());
+    return true;
+  }
+
   Preprocessor pp(*this);
 
   fprintf(stderr, "-- Parsing --\n");
 
   TranslationUnit* unit = new (pool()) TranslationUnit();
   {
+    AutoPhase phase(phases_, kPhaseParse);
     if (!pp.enter(file))
       return false;
 
@@ -197,8 +310,12 @@ CompileContext::compile(RefPtr<SourceFile> file)
 
   fprintf(stderr, "\n-- Semantic Analysis --\n");
 
-  SemanticAnalysis sema(*this, unit);
-  sema::Program* program = sema.analyze();
+  sema::Program* program;
+  {
+    AutoPhase phase(phases_, kPhaseSemanticAnalysis);
+    SemanticAnalysis sema(*this, unit);
+    program = sema.analyze();
+  }
   if (!program)
     return false;
 
@@ -210,16 +327,19 @@ CompileContext::compile(RefPtr<SourceFile> file)
   if (options_.ShowSema)
     program->dump(stderr);
 
-  std::string output_path = GetOutputFilename(
-    options_.OutputFile ? (*options_.OutputFile).c_str() : nullptr,
-    file->path());
-
   // Code generation.
   {
     SmxCompiler compiler(*this, program);
-    if (!compiler.compile())
-      return false;
     {
+      AutoPhase phase(phases_, kPhaseCodegen);
+      if (!compiler.compile())
+        return false;
+    }
+    {
+      AutoPhase phase(phases_, kPhaseEmit);
+
+      // The old stamp no longer describes the output once it is rewritten.
+      stamp.remove();
       FILE* fp = fopen(output_path.c_str(), "wt");
       FpBuffer buf(fp);
       if (!compiler.emit(&buf))
@@ -231,6 +351,16 @@ CompileContext::compile(RefPtr<SourceFile> file)
   if (reports_.HasErrors())
     return false;
 
+  if (options_.Incremental && !stamp.write(stamped_options, source_.openedFiles()))
+    fprintf(stderr, "warning: could not write %s.deps\n", output_path.c_str());
+
+  if (options_.DependencyFile &&
+      !WriteDependencyFile(*options_.DependencyFile, output_path, source_.openedFiles()))
+  {
+    fprintf(stderr, "error: could not write %s\n", (*options_.DependencyFile).c_str());
+    return false;
+  }
+
   fprintf(stderr, "\n-- Ok! %s --\n", output_path.c_str());
   return true;
 }
@@ -22,10 +22,13 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include <memory>
+
 #include <amtl/am-hashtable.h>
 #include <amtl/am-threadlocal.h>
 #include <amtl/am-vector.h>
 
+#include "shared/phase-timer.h"
 #include "shared/string-pool.h"
 #include "pool-allocator.h"
 #include "auto-string.h"
@@ -75,6 +78,12 @@ class TranslationUnit : public PoolObject
   GlobalScope* globalScope_;
 };
 
+// Threads analysing function bodies in parallel allocate from a pool of
+// their own, and collect diagnostics into their own report manager until
+// they are merged back in order. Both are null everywhere else.
+extern ke::ThreadLocal<PoolAllocator*> CurrentThreadPool;
+extern ke::ThreadLocal<ReportManager*> CurrentThreadReports;
+
 class CompileContext
 {
  public:
@@ -85,16 +94,20 @@ class CompileContext
 
   bool compile(RefPtr<SourceFile> file);
 
-  bool phasePassed() const {
-    return !reports_.HasErrors();
+  bool phasePassed() {
+    return !reporting().HasErrors();
   }
-  bool canContinueProcessing() const {
-    return !reports_.HasFatalError();
+  bool canContinueProcessing() {
+    return !reporting().HasFatalError();
   }
 
   PoolAllocator& pool() {
     return pool_;
   }
+
+  // Returns a pool for a thread that allocates in parallel with this one.
+  // It lives as long as the context.
+  PoolAllocator& addThreadPool();
   TypeManager* types() {
     return &types_;
   }
@@ -104,6 +117,9 @@ class CompileContext
   CompileOptions& options() {
     return options_;
   }
+  PhaseTimer& phases() {
+    return phases_;
+  }
 
   // String interning.
   Atom* add(const char* str) {
@@ -121,23 +137,28 @@ class CompileContext
 
   // Error reporting.
   ReportManager& reporting() {
+    if (ReportManager* reports = CurrentThreadReports.get())
+      return *reports;
     return reports_;
   }
   void reportFatal(rmsg::Id msg) {
-    reports_.reportFatal(msg);
+    reporting().reportFatal(msg);
   }
   void reportFatal(const SourceLocation& loc, rmsg::Id msg) {
-    reports_.reportFatal(loc, msg);
+    reporting().reportFatal(loc, msg);
   }
   MessageBuilder report(const SourceLocation& loc, rmsg::Id msg_id) {
-    return reports_.report(loc, msg_id);
+    return reporting().report(loc, msg_id);
   }
   MessageBuilder note(const SourceLocation& loc, rmsg::Id msg_id) {
-    return reports_.note(loc, msg_id);
+    return reporting().note(loc, msg_id);
   }
 
   Atom* createAnonymousName(const SourceLocation& loc);
 
+ private:
+  bool compilePhases(RefPtr<SourceFile> file);
+
  private:
   PoolAllocator& pool_;
   StringPool& strings_;
@@ -145,12 +166,16 @@ class CompileContext
   SourceManager& source_;
   TypeManager types_;
   CompileOptions options_;
+  PhaseTimer phases_;
+  std::vector<std::unique_ptr<PoolAllocator>> thread_pools_;
 };
 
 extern ke::ThreadLocal<CompileContext*> CurrentCompileContext;
 
 static inline PoolAllocator& POOL()
 {
+  if (PoolAllocator* pool = CurrentThreadPool.get())
+    return *pool;
   return CurrentCompileContext->pool();
 }
 
@@ -22,6 +22,16 @@
 
 namespace sp {
 
+// The phases timed by --time-phases. Preprocessing happens on demand while
+// parsing, so it is counted as part of parsing.
+enum CompilePhase {
+  kPhaseParse,
+  kPhaseSemanticAnalysis,
+  kPhaseCodegen,
+  kPhaseEmit,
+  kNumCompilePhases
+};
+
 }
 
 #endif // _include_spcomp2_compile_phases_
@@ -132,11 +132,10 @@ CoerceForBinaryFloat(BoxedValue& left, BoxedValue& right)
     return TypeError;
 
 ConstantEvaluator::Result
-ConstantEvaluator::binary(BinaryExpression* expr, BoxedValue& left, BoxedValue& right, BoxedValue* out)
+ConstantEvaluator::EvaluateBinary(ReportingContext& cc, TokenKind tok, BoxedValue& left,
+                                  BoxedValue& right, BoxedValue* out)
 {
-  ReportingContext cc(cc_, expr->loc(), mode_ == Required);
-
-  switch (expr->token()) {
+  switch (tok) {
     EVAL_ALU_OP(TOK_PLUS, Add);
     EVAL_ALU_OP(TOK_MINUS, Sub);
     EVAL_ALU_OP(TOK_STAR, Mul);
@@ -163,10 +162,10 @@ ConstantEvaluator::binary(BinaryExpression* expr, BoxedValue& left, BoxedValue&
 }
 
 ConstantEvaluator::Result
-ConstantEvaluator::unary(UnaryExpression* expr, BoxedValue& inner, BoxedValue* out)
+ConstantEvaluator::EvaluateUnary(ReportingContext& cc, TokenKind tok, BoxedValue& inner,
+                                 BoxedValue* out)
 {
-  ReportingContext cc(cc_, expr->loc(), mode_ == Required);
-  switch (expr->token()) {
+  switch (tok) {
     case TOK_NEGATE:
       if (inner.isInteger()) {
         IntValue tmp;
@@ -216,14 +215,18 @@ ConstantEvaluator::Evaluate(Expression* expr, BoxedValue* out)
       return rv;
     if ((rv = Evaluate(b->right(), &right)) != Ok)
       return rv;
-    return binary(b, left, right, out);
+
+    ReportingContext cc(cc_, b->loc(), mode_ == Required);
+    return EvaluateBinary(cc, b->token(), left, right, out);
   }
 
   if (UnaryExpression* u = expr->asUnaryExpression()) {
     BoxedValue inner;
     if ((rv = Evaluate(u->expression(), &inner)) != Ok)
       return rv;
-    return unary(u, inner, out);
+
+    ReportingContext cc(cc_, u->loc(), mode_ == Required);
+    return EvaluateUnary(cc, u->token(), inner, out);
   }
 
   if (TernaryExpression* t = expr->asTernaryExpression()) {
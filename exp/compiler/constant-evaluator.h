@@ -21,11 +21,13 @@
 
 #include "types.h"
 #include "symbols.h"
+#include "token-kind.h"
 
 namespace sp {
 
 class Scope;
 class CompileContext;
+struct ReportingContext;
 
 namespace ast {
 class Expression;
@@ -89,9 +91,11 @@ class ConstantEvaluator
 
   Result Evaluate(ast::Expression* expr, BoxedValue* out);
 
- private:
-  Result unary(ast::UnaryExpression* expr, BoxedValue& inner, BoxedValue* out);
-  Result binary(ast::BinaryExpression* expr, BoxedValue& left, BoxedValue& right, BoxedValue* out);
+  // Apply an operator to values that are already known. Errors go to |cc|.
+  static Result EvaluateUnary(ReportingContext& cc, TokenKind tok, BoxedValue& inner,
+                              BoxedValue* out);
+  static Result EvaluateBinary(ReportingContext& cc, TokenKind tok, BoxedValue& left,
+                               BoxedValue& right, BoxedValue* out);
 
  private:
   CompileContext& cc_;
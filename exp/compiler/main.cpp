@@ -17,9 +17,12 @@
  * SourcePawn. If not, see http://www.gnu.org/licenses/.
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <amtl/experimental/am-argparser.h>
 #include "compile-context.h"
@@ -30,6 +33,52 @@ using namespace ke;
 using namespace ke::args;
 using namespace sp;
 
+static int
+CompileFile(PoolAllocator& pool, StringPool& strings, const CompileOptions& options,
+            const char* filename)
+{
+  ReportManager reports;
+  SourceManager source(strings, reports);
+
+  PoolScope scope(pool);
+  CompileContext cc(pool, strings, reports, source);
+  cc.options() = options;
+
+  ReportingContext rc(cc, SourceLocation(), false);
+
+  RefPtr<SourceFile> file = source.open(rc, filename);
+  if (!file) {
+    fprintf(stderr, "cannot open file '%s'\n", filename);
+    return 1;
+  }
+
+  if (!cc.compile(file) || reports.HasMessages()) {
+    reports.PrintMessages();
+    return 1;
+  }
+  return 0;
+}
+
+// Reads the files named in |list|, one per line.
+static bool
+ReadFileList(const char* list, std::vector<std::string>* files)
+{
+  FILE* fp = fopen(list, "rt");
+  if (!fp)
+    return false;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), fp)) {
+    size_t length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      length--;
+    if (length)
+      files->emplace_back(line, length);
+  }
+  fclose(fp);
+  return true;
+}
+
 int main(int argc, char** argv)
 {
   Parser parser("SourcePawn compiler.");
@@ -37,6 +86,8 @@ int main(int argc, char** argv)
   StringOption input_file(parser, "file", "Input file.");
   StringOption output_file(parser, "o", "output", Nothing(),
     "SMX output file.");
+  StringOption dep_file(parser, nullptr, "dep-file", Nothing(),
+    "Write a Makefile dependency file listing the sources the output was built from.");
   RepeatOption<std::string> includes(parser, "-i", nullptr,
     "Add a folder to the include path.");
 
@@ -47,47 +98,68 @@ int main(int argc, char** argv)
     "Print the semantic analysis tree to stderr.");
   EnableOption pool_stats(parser, nullptr, "pool-stats", true,
     "Show pool memory usage after each phase.");
+  ToggleOption time_phases(parser, nullptr, "time-phases", Some(false),
+    "Show the time and memory spent in each compiler phase.");
   ToggleOption parse_only(parser, nullptr, "parse-only", Some(false),
     "Skip name binding and type resolution.");
   ToggleOption bind_only(parser, nullptr, "bind-only", Some(false),
     "Skip type-checking and code generation.");
+  IntOption jobs(parser, "j", "jobs", Some(1),
+    "Analyse function bodies on this many threads (0 for one per core).");
+  ToggleOption incremental(parser, nullptr, "incremental", Some(false),
+    "Skip compiling if the output was built from the same sources and options.");
+  ToggleOption batch(parser, nullptr, "batch", Some(false),
+    "Treat the input file as a list of files to compile, one per line. Memory is reused "
+    "between files, and -o is ignored.");
+  ToggleOption huge_pages(parser, nullptr, "huge-pages", Some(false),
+    "Allocate compiler memory in huge pages where the system allows it.");
 
   if (!parser.parse(argc, argv)) {
     parser.usage(stderr, argc, argv);
     return 1;
   }
 
-  StringPool strings;
-  ReportManager reports;
-  SourceManager source(strings, reports);
+  CompileOptions options;
+  options.SkipResolution = parse_only.value();
+  options.SkipSemanticAnalysis = bind_only.value();
+  options.ShowSema = show_sema.value();
+  options.ShowPoolStats = pool_stats.value();
+  options.TimePhases = time_phases.value();
+  options.Jobs = jobs.value() > 0 ? uint32_t(jobs.value()) : 0;
+  options.Incremental = incremental.value();
+  options.SearchPaths = std::move(includes.values());
 
+  StringPool strings;
   PoolAllocator pool;
-  {
-    PoolScope scope(pool);
-    CompileContext cc(pool, strings, reports, source);
-
-    cc.options().SkipResolution = parse_only.value();
-    cc.options().SkipSemanticAnalysis = bind_only.value();
-    cc.options().ShowSema = show_sema.value();
-    cc.options().ShowPoolStats = pool_stats.value();
-    cc.options().OutputFile = output_file.maybeValue();
-    cc.options().SearchPaths = std::move(includes.values());
-    
-    ReportingContext rc(cc, SourceLocation(), false);
-
-    const char* filename = input_file.value().c_str();
-    RefPtr<SourceFile> file = source.open(rc, filename);
-    if (!file) {
-      fprintf(stderr, "cannot open file '%s'\n", filename);
-      return 1;
-    }
-
-    if (!cc.compile(file) || reports.HasMessages()) {
-      reports.PrintMessages();
-      return 1;
-    }
+  if (huge_pages.value())
+    pool.setChunkSize(PoolAllocator::kHugePageSize, true);
+
+  if (!batch.value()) {
+    options.OutputFile = output_file.maybeValue();
+    options.DependencyFile = dep_file.maybeValue();
+    return CompileFile(pool, strings, options, input_file.value().c_str());
   }
 
-  return 0;
+  std::vector<std::string> files;
+  if (!ReadFileList(input_file.value().c_str(), &files)) {
+    fprintf(stderr, "cannot open file '%s'\n", input_file.value().c_str());
+    return 1;
+  }
+
+  // Keep every chunk between compiles, so after the largest file nothing
+  // more has to be allocated. Each result follows the file's own output so
+  // a harness can split the output per file.
+  pool.setRetainLimit(SIZE_MAX);
+
+  int status = 0;
+  for (const std::string& file : files) {
+    int rv = CompileFile(pool, strings, options, file.c_str());
+    fflush(stdout);
+    fprintf(stderr, "\n-- batch: %d %s --\n", rv, file.c_str());
+    fflush(stderr);
+    if (rv)
+      status = 1;
+  }
+  return status;
 }
 
@@ -17,6 +17,9 @@
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 #include "json-tools.h"
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
 
 using namespace ke;
 using namespace sp;
@@ -138,3 +141,202 @@ void JsonRenderer::RenderObject(JsonObject* val)
   prefix();
   out_ << "}";
 }
+
+JsonWriter::JsonWriter(FILE* fp)
+ : fp_(fp),
+   buffer_(new char[kBufferSize]),
+   used_(0),
+   failed_(false),
+   after_key_(false)
+{
+}
+
+JsonWriter::~JsonWriter()
+{
+  flush();
+}
+
+void
+JsonWriter::drain()
+{
+  if (used_ && fwrite(buffer_.get(), 1, used_, fp_) != used_)
+    failed_ = true;
+  used_ = 0;
+}
+
+bool
+JsonWriter::flush()
+{
+  drain();
+  if (fflush(fp_) != 0)
+    failed_ = true;
+  return !failed_;
+}
+
+void
+JsonWriter::write(const char* bytes, size_t length)
+{
+  while (length) {
+    if (used_ == kBufferSize)
+      drain();
+    size_t n = std::min(length, kBufferSize - used_);
+    memcpy(buffer_.get() + used_, bytes, n);
+    used_ += n;
+    bytes += n;
+    length -= n;
+  }
+}
+
+void
+JsonWriter::prefix()
+{
+  for (size_t i = 0; i < levels_.size() * 2; i++)
+    write(' ');
+}
+
+// Every value but the outermost starts a new line, after a comma if its
+// container already has entries. Values in objects were started by key().
+void
+JsonWriter::beforeValue()
+{
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (levels_.empty())
+    return;
+
+  Level& level = levels_.back();
+  assert(!level.object);
+  write(level.empty ? "\n" : ",\n");
+  level.empty = false;
+  prefix();
+}
+
+void
+JsonWriter::key(const char* name)
+{
+  assert(!levels_.empty() && levels_.back().object && !after_key_);
+
+  Level& level = levels_.back();
+  write(level.empty ? "\n" : ",\n");
+  level.empty = false;
+  prefix();
+
+  write('"');
+  write(name);
+  write("\": ");
+  after_key_ = true;
+}
+
+void
+JsonWriter::beginContainer(char open, bool object)
+{
+  beforeValue();
+  write(open);
+  levels_.push_back(Level{object, true});
+}
+
+void
+JsonWriter::endContainer(char close)
+{
+  assert(!levels_.empty() && !after_key_);
+  bool empty = levels_.back().empty;
+  levels_.pop_back();
+  if (!empty) {
+    write('\n');
+    prefix();
+  }
+  write(close);
+}
+
+void
+JsonWriter::beginObject()
+{
+  beginContainer('{', true);
+}
+
+void
+JsonWriter::endObject()
+{
+  assert(levels_.back().object);
+  endContainer('}');
+}
+
+void
+JsonWriter::beginList()
+{
+  beginContainer('[', false);
+}
+
+void
+JsonWriter::endList()
+{
+  assert(!levels_.back().object);
+  endContainer(']');
+}
+
+void
+JsonWriter::writeNull()
+{
+  beforeValue();
+  write("null");
+}
+
+void
+JsonWriter::writeRaw(const char* json, size_t length)
+{
+  beforeValue();
+  write(json, length);
+}
+
+void
+JsonWriter::writeBool(bool value)
+{
+  beforeValue();
+  write(value ? "true" : "false");
+}
+
+void
+JsonWriter::writeInt(int value)
+{
+  beforeValue();
+  char buffer[16];
+  int length = snprintf(buffer, sizeof(buffer), "%d", value);
+  write(buffer, size_t(length));
+}
+
+void
+JsonWriter::writeString(const char* str, size_t length)
+{
+  beforeValue();
+  write('"');
+  for (size_t i = 0; i < length; i++) {
+    char c = str[i];
+    switch (c) {
+      case '"':
+        write("\\\"");
+        continue;
+      case '\\':
+        write("\\\\");
+        continue;
+      case '\n':
+        write("\\n");
+        continue;
+      case '\r':
+        write("\\r");
+        continue;
+      case '\t':
+        write("\\t");
+        continue;
+    }
+    if (uint8_t(c) < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", unsigned(uint8_t(c)));
+      write(escape);
+      continue;
+    }
+    write(c);
+  }
+  write('"');
+}
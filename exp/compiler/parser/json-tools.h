@@ -24,6 +24,10 @@
 #include "pool-allocator.h"
 #include "boxed-value.h"
 #include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace sp {
 
@@ -183,6 +187,82 @@ class JsonList : public JsonValue
   PoolList<JsonValue*> items_;
 };
 
+// Writes JSON as it is produced, rather than building a tree of JsonValues
+// to render afterward, so memory use does not grow with the output. The
+// layout matches JsonRenderer's. Output is buffered and written to |fp| as
+// the buffer fills, and when the writer is flushed or destroyed.
+//
+// Values are written in order: inside an object, each value must follow a
+// key(); inside a list, values follow each other.
+class JsonWriter
+{
+ public:
+  explicit JsonWriter(FILE* fp);
+  ~JsonWriter();
+
+  void beginObject();
+  void endObject();
+  void beginList();
+  void endList();
+
+  void key(const char* name);
+  void key(Atom* name) {
+    key(name->chars());
+  }
+
+  void writeNull();
+  void writeBool(bool value);
+  void writeInt(int value);
+  void writeString(const char* str, size_t length);
+  void writeString(const char* str) {
+    writeString(str, strlen(str));
+  }
+  void writeString(const std::string& str) {
+    writeString(str.c_str(), str.size());
+  }
+  void writeString(Atom* atom) {
+    writeString(atom->chars(), atom->length());
+  }
+
+  // Writes a value that is already JSON, such as another writer's output.
+  void writeRaw(const char* json, size_t length);
+
+  // Writes out anything buffered. Returns false if any write has failed.
+  bool flush();
+
+ private:
+  void beforeValue();
+  void beginContainer(char open, bool object);
+  void endContainer(char close);
+  void prefix();
+
+  void write(const char* bytes, size_t length);
+  void write(char c) {
+    if (used_ == kBufferSize)
+      drain();
+    buffer_[used_++] = c;
+  }
+  void write(const char* str) {
+    write(str, strlen(str));
+  }
+  void drain();
+
+ private:
+  static const size_t kBufferSize = 64 * 1024;
+
+  struct Level {
+    bool object;
+    bool empty;
+  };
+
+  FILE* fp_;
+  std::unique_ptr<char[]> buffer_;
+  size_t used_;
+  bool failed_;
+  std::vector<Level> levels_;
+  bool after_key_;
+};
+
 } // namespace ke
 
 #endif // _include_spcomp_json_tools_h_
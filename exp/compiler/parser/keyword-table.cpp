@@ -16,7 +16,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 #include "keyword-table.h"
-#include "compile-context.h"
+#include <string.h>
 
 using namespace ke;
 using namespace sp;
@@ -29,24 +29,82 @@ const char* sp::TokenNames[] =
   nullptr
 };
 
-KeywordTable::KeywordTable(CompileContext& cc)
+namespace {
+
+constexpr const char* kKeywordNames[] =
 {
-  impl_.init(128);
+#define _(name, str) str,
+  TOKENMAP(_)
+#undef _
+  nullptr
+};
 
-#define _(name)                                   \
-  do {                                            \
-    Atom* atom = cc.add(TokenNames[TOK_##name]);  \
-    defineKeyword(atom, TOK_##name);              \
-  } while (0);
+constexpr TokenKind kKeywords[] =
+{
+#define _(name) TOK_##name,
   KEYWORDMAP(_)
 #undef _
+};
+
+constexpr size_t
+Length(const char* str)
+{
+  size_t length = 0;
+  while (str[length])
+    length++;
+  return length;
 }
 
-void
-KeywordTable::defineKeyword(Atom* atom, TokenKind kind)
+struct KeywordSlots
 {
-  Impl::Insert p = impl_.findForAdd(atom);
-  assert(!p.found());
+  TokenKind kinds[KeywordTable::kSlots];
+  size_t max_length;
+  bool perfect;
+};
+
+constexpr KeywordSlots
+BuildKeywordSlots()
+{
+  KeywordSlots slots = {};
+  slots.perfect = true;
+  for (TokenKind kind : kKeywords) {
+    const char* name = kKeywordNames[kind];
+    size_t length = Length(name);
+    if (length < 2) {
+      slots.perfect = false;
+      continue;
+    }
+
+    size_t slot = KeywordTable::Hash(name, length);
+    if (slots.kinds[slot] != TOK_NONE)
+      slots.perfect = false;
+    slots.kinds[slot] = kind;
+    if (length > slots.max_length)
+      slots.max_length = length;
+  }
+  return slots;
+}
+
+constexpr KeywordSlots kKeywordSlots = BuildKeywordSlots();
+
+} // anonymous namespace
+
+// If this fires, a new keyword collides with an old one; pick new multipliers
+// in KeywordTable::Hash.
+static_assert(kKeywordSlots.perfect, "keyword hash must not have collisions");
+
+TokenKind
+KeywordTable::findKeyword(const char* str, size_t length) const
+{
+  if (length < 2 || length > kKeywordSlots.max_length)
+    return TOK_NONE;
+
+  TokenKind kind = kKeywordSlots.kinds[Hash(str, length)];
+  if (kind == TOK_NONE)
+    return TOK_NONE;
 
-  impl_.add(p, atom, kind);
+  const char* name = kKeywordNames[kind];
+  if (strncmp(name, str, length) != 0 || name[length] != '\0')
+    return TOK_NONE;
+  return kind;
 }
@@ -23,28 +23,23 @@
 
 namespace sp {
 
-class CompileContext;
-
+// Keywords are found with a perfect hash of their length and first, second
+// and last characters, built at compile time, so ruling one out costs at most
+// a single compare. Names don't need to be interned first.
 class KeywordTable
 {
  public:
-  KeywordTable(CompileContext& cc);
+  static const size_t kSlots = 256;
 
-  TokenKind findKeyword(Atom* id) {
-    Impl::Result r = impl_.find(id);
-    if (!r.found())
-      return TOK_NONE;
-    return r->value;
+  static constexpr size_t Hash(const char* str, size_t length) {
+    return (length * 2 + (unsigned char)str[0] * 8 + (unsigned char)str[1] * 42 +
+            (unsigned char)str[length - 1]) & (kSlots - 1);
   }
 
- private:
-  void defineKeyword(Atom* atom, TokenKind tok);
-
- private:
-  typedef AtomMap<TokenKind> Impl;
-
- private:
-  Impl impl_;
+  TokenKind findKeyword(const char* str, size_t length) const;
+  TokenKind findKeyword(Atom* id) const {
+    return findKeyword(id->chars(), id->length());
+  }
 };
 
 }
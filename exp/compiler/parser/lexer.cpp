@@ -16,6 +16,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 #include "lexer.h"
+#include "char-scanner.h"
 #include "compile-context.h"
 #include "preprocessor.h"
 #include <ctype.h>
@@ -82,11 +83,6 @@ static inline bool IsIdentStart(char c)
           c == '_';
 }
 
-static inline bool IsIdentChar(char c)
-{
-  return IsIdentStart(c) || (c >= '0' && c <= '9');
-}
-
 int
 sp::StringToInt32(const char* ptr)
 {
@@ -103,18 +99,15 @@ sp::StringToInt32(const char* ptr)
 const char*
 Lexer::skipSpaces()
 {
-  while (IsSkipSpace(peekChar()))
-    skipChar();
+  pos_ = SkipSpaces(pos_, end_);
   return ptr();
 }
 
 char
 Lexer::firstNonSpaceChar()
 {
-  char c = readChar();
-  while (IsSkipSpace(c))
-    c = readChar();
-  return c;
+  pos_ = SkipSpaces(pos_, end_);
+  return readChar();
 }
 
 void
@@ -122,8 +115,7 @@ Lexer::readUntilEnd(const char** beginp, const char** endp)
 {
   const char* begin = skipSpaces();
 
-  while (!IsLineTerminator(peekChar()))
-    skipChar();
+  pos_ = ScanToLineEnd(pos_, end_);
 
   const char* end = ptr();
   while (end > begin) {
@@ -345,17 +337,12 @@ Lexer::handleNumber(Token* tok, char first)
 TokenKind
 Lexer::name(char first)
 {
+  const char* start = pos_;
+  pos_ = SkipIdentChars(pos_, end_);
+
   literal_.clear();
   literal_.push_back(first);
-  char c;
-  for (;;) {
-    c = readChar();
-    if (!IsIdentChar(c)) {
-      putBack(c);
-      break;
-    }
-    literal_.push_back(c);
-  }
+  literal_.insert(literal_.end(), start, pos_);
   literal_.push_back('\0');
   return TOK_NAME;
 }
@@ -364,9 +351,7 @@ TokenKind
 Lexer::maybeKeyword(char first)
 {
   name(first);
-
-  Atom* atom = cc_.add(literal(), literal_length());
-  return pp_.findKeyword(atom);
+  return pp_.findKeyword(literal(), literal_length());
 }
 
 // Based on the logic for litchar() in sc2.c.
@@ -550,8 +535,7 @@ Lexer::handleIdentifier(Token* tok, char first)
 TokenKind
 Lexer::singleLineComment()
 {
-  while (!IsLineTerminator(peekChar()))
-    skipChar();
+  pos_ = ScanToLineEnd(pos_, end_);
   return TOK_COMMENT;
 }
 
@@ -559,6 +543,7 @@ TokenKind
 Lexer::multiLineComment(const SourceLocation& begin)
 {
   while (true) {
+    pos_ = ScanToCommentEnd(pos_, end_);
     char c = readChar();
     if (c == '\r' || c == '\n') {
       advanceLine(c);
@@ -611,6 +596,7 @@ Lexer::consumeWhitespace()
       case ' ':
       case '\t':
       case '\f':
+        pos_ = SkipSpaces(pos_, end_);
         break;
 
       default:
@@ -945,6 +931,10 @@ Lexer::handlePreprocessorDirective()
         cc_.report(tok.start.loc, rmsg::bad_pragma_newdecls);
         return false;
       }
+      if (strcmp(tok.atom()->chars(), "once") == 0) {
+        pp_.markIncludedOnce(buffer_);
+        return true;
+      }
       if (strcmp(tok.atom()->chars(), "semicolon") == 0) {
         // We ignore #pragma semicolon entirely now. There's a separate
         // top-level mode for users that wish to enforce it on their code.
@@ -17,6 +17,7 @@
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 #include "preprocessor.h"
 #include "auto-string.h"
+#include "char-scanner.h"
 #include <time.h>
 #ifdef WIN32
 # include <windows.h>
@@ -36,7 +37,6 @@ static const size_t kMaxIncludeDepth = 50;
 Preprocessor::Preprocessor(CompileContext& cc)
  : cc_(cc),
    options_(cc_.options()),
-   keywords_(cc),
    tokens_(&normal_tokens_),
    allow_macro_expansion_(true),
    disable_includes_(false),
@@ -318,6 +318,101 @@ Preprocessor::searchPaths(const char* file, const char* where)
   return AutoString();
 }
 
+// Skips spaces, newlines and comments.
+static const char*
+SkipBlankText(const char* p, const char* end)
+{
+  for (;;) {
+    p = SkipSpaces(p, end);
+    if (p == end)
+      return end;
+    if (*p == '\r' || *p == '\n') {
+      p++;
+      continue;
+    }
+    if (end - p < 2 || p[0] != '/' || (p[1] != '/' && p[1] != '*'))
+      return p;
+
+    if (p[1] == '/') {
+      p = ScanToLineEnd(p + 2, end);
+      continue;
+    }
+    for (p += 2;; p++) {
+      p = ScanToCommentEnd(p, end);
+      if (p == end || *p == '\0')
+        return end;
+      if (*p == '*' && p + 1 < end && p[1] == '/')
+        break;
+    }
+    p += 2;
+  }
+}
+
+// Matches |word| at |*p|, if it isn't followed by more of an identifier.
+static bool
+MatchWord(const char** p, const char* end, const char* word)
+{
+  size_t length = strlen(word);
+  if (size_t(end - *p) < length || strncmp(*p, word, length) != 0)
+    return false;
+  const char* after = *p + length;
+  if (SkipIdentChars(after, end) != after)
+    return false;
+  *p = after;
+  return true;
+}
+
+// If |file| starts with "#if defined <name>" on a line of its own followed
+// by "#endinput", returns the name. Anything fancier isn't recognized.
+static Atom*
+FindIncludeGuard(CompileContext& cc, SourceFile* file)
+{
+  const char* end = file->chars() + file->length();
+  const char* p = SkipBlankText(file->chars(), end);
+  if (p == end || *p++ != '#' || !MatchWord(&p, end, "if"))
+    return nullptr;
+  p = SkipSpaces(p, end);
+  if (!MatchWord(&p, end, "defined"))
+    return nullptr;
+
+  const char* name = SkipSpaces(p, end);
+  p = SkipIdentChars(name, end);
+  if (p == name || (*name >= '0' && *name <= '9'))
+    return nullptr;
+  size_t name_length = p - name;
+
+  p = SkipSpaces(p, end);
+  if (p != end && *p != '\r' && *p != '\n')
+    return nullptr;
+  p = SkipBlankText(p, end);
+  if (p == end || *p++ != '#' || !MatchWord(&p, end, "endinput"))
+    return nullptr;
+  return cc.add(name, name_length);
+}
+
+bool
+Preprocessor::canSkipInclude(const IncludedFile& file)
+{
+  if (file.once)
+    return true;
+
+  // Comments before the guard would still reach the comment handler.
+  if (!file.guard || traceComments())
+    return false;
+  return macros_.find(file.guard).found();
+}
+
+void
+Preprocessor::markIncludedOnce(SourceFile* file)
+{
+  Atom* path = cc_.add(file->path());
+  AtomMap<IncludedFile>::Insert p = included_files_.findForAdd(path);
+  if (p.found())
+    p->value.once = true;
+  else
+    included_files_.add(p, path, IncludedFile(nullptr, true));
+}
+
 bool
 Preprocessor::enterFile(TokenKind directive,
                         const SourceLocation& from,
@@ -346,11 +441,19 @@ Preprocessor::enterFile(TokenKind directive,
     return false;
   }
 
+  Atom* path_atom = cc_.add(path.ptr());
+  AtomMap<IncludedFile>::Insert included = included_files_.findForAdd(path_atom);
+  if (included.found() && canSkipInclude(included->value))
+    return true;
+
   ReportingContext rc(cc_, from);
   RefPtr<SourceFile> new_file = cc_.source().open(rc, path.ptr());
   if (!new_file)
     return false;
 
+  if (!included.found())
+    included_files_.add(included, path_atom, IncludedFile(FindIncludeGuard(cc_, new_file), false));
+
   LREntry tl = cc_.source().trackFile(from, new_file);
   if (!tl.valid()) {
     // Error was already reported.
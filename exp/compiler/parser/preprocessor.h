@@ -154,6 +154,9 @@ class Preprocessor
   // Returns false if an error was reported.
   bool removeMacro(const SourceLocation& loc, Atom* name);
 
+  // #pragma once support: later #includes of this file are ignored.
+  void markIncludedOnce(SourceFile* file);
+
   // Leaves a lexer. If this returns true, the lexer is finished, and it should
   // return TOK_NONE instead of TOK_EOF.
   bool handleEndOfFile();
@@ -182,6 +185,9 @@ class Preprocessor
   TokenKind findKeyword(Atom* name) {
     return keywords_.findKeyword(name);
   }
+  TokenKind findKeyword(const char* name, size_t length) {
+    return keywords_.findKeyword(name, length);
+  }
 
   bool& macro_expansion() {
     return allow_macro_expansion_;
@@ -191,7 +197,31 @@ class Preprocessor
   // Internal functions.
   AutoString searchPaths(const char* file, const char* where);
 
+  struct IncludedFile;
+  bool canSkipInclude(const IncludedFile& file);
+
  private:
+  // What is known about each file #included so far, by path. Including a
+  // file again is skipped if it used #pragma once, or if it starts with the
+  // usual guard:
+  //    #if defined _file_included
+  //     #endinput
+  //    #endif
+  // while that macro is defined, since it would produce nothing.
+  struct IncludedFile {
+    Atom* guard;
+    bool once;
+
+    IncludedFile()
+     : guard(nullptr),
+       once(false)
+    {}
+    IncludedFile(Atom* guard, bool once)
+     : guard(guard),
+       once(once)
+    {}
+  };
+
   struct SavedLexer {
     RefPtr<Lexer> lexer;
     RefPtr<MacroLexer> macro_lexer;
@@ -211,6 +241,7 @@ class Preprocessor
   KeywordTable keywords_;
 
   AtomMap<Macro*> macros_;
+  AtomMap<IncludedFile> included_files_;
 
   std::vector<RefPtr<MacroLexer>> recycled_macro_lexers_;
   std::vector<SavedLexer> lexer_stack_;
@@ -18,7 +18,13 @@
  */
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <new>
+#if defined(_WIN32)
+# include <Windows.h>
+#else
+# include <sys/mman.h>
+#endif
 #include "pool-allocator.h"
 #include "compile-context.h"
 
@@ -26,16 +32,51 @@ using namespace ke;
 using namespace sp;
 
 PoolAllocator::PoolAllocator()
-  : reserved_(NULL),
-  last_(NULL)
+  : free_(NULL),
+  free_bytes_(0),
+  last_(NULL),
+  chunk_size_(kDefaultPoolSize),
+  retain_limit_(kMaxReserveSize),
+  huge_pages_(false),
+  reserved_bytes_(0)
 {
+  memset(&stats_, 0, sizeof(stats_));
 }
 
 PoolAllocator::~PoolAllocator()
 {
   unwind(NULL);
-  if (reserved_)
-    free(reserved_);
+  trim();
+}
+
+void
+PoolAllocator::setChunkSize(size_t bytes, bool huge_pages)
+{
+  chunk_size_ = bytes > kDefaultPoolSize ? bytes : kDefaultPoolSize;
+  huge_pages_ = huge_pages;
+}
+
+void
+PoolAllocator::setRetainLimit(size_t bytes)
+{
+  retain_limit_ = bytes;
+  while (free_ && free_bytes_ > retain_limit_) {
+    Pool* pool = free_;
+    free_ = pool->prev;
+    free_bytes_ -= pool->size();
+    freeChunk(pool);
+  }
+}
+
+void
+PoolAllocator::trim()
+{
+  while (free_) {
+    Pool* pool = free_;
+    free_ = pool->prev;
+    freeChunk(pool);
+  }
+  free_bytes_ = 0;
 }
 
 char*
@@ -59,17 +100,7 @@ PoolAllocator::unwind(char* pos)
     if (pos && pos >= last_->base && pos < last_->end)
       break;
     Pool* prev = last_->prev;
-    {
-      if (last_->size() <= kMaxReserveSize &&
-        (!reserved_ || reserved_->size() < last_->size()))
-      {
-        if (reserved_)
-          free(reserved_);
-        reserved_ = last_;
-      } else {
-        free(last_);
-      }
-    }
+    releaseChunk(last_);
     last_ = prev;
   }
 
@@ -85,22 +116,27 @@ void*
 PoolAllocator::slowAllocate(size_t actualBytes)
 {
   size_t bytesNeeded = actualBytes + sizeof(Pool);
-  if (bytesNeeded < kDefaultPoolSize)
-    bytesNeeded = kDefaultPoolSize;
-
-  Pool* pool;
-  if (reserved_ && reserved_->size() >= bytesNeeded) {
-    pool = reserved_;
-    reserved_ = NULL;
-  } else {
-    pool = (Pool*)malloc(bytesNeeded);
+  if (bytesNeeded < chunk_size_)
+    bytesNeeded = chunk_size_;
+
+  // Take the first free chunk that is large enough.
+  Pool* pool = nullptr;
+  for (Pool** link = &free_; *link; link = &(*link)->prev) {
+    if ((*link)->size() + sizeof(Pool) >= bytesNeeded) {
+      pool = *link;
+      *link = pool->prev;
+      free_bytes_ -= pool->size();
+      stats_.chunks_reused++;
+      break;
+    }
+  }
+  if (!pool) {
+    pool = newChunk(bytesNeeded);
     if (!pool) {
       fprintf(stderr, "OUT OF POOL MEMORY\n");
       abort();
       return NULL;
     }
-    pool->base = (char*)(pool + 1);
-    pool->end = (char*)pool + bytesNeeded;
   }
   pool->ptr = pool->base + actualBytes;
   pool->prev = last_;
@@ -108,6 +144,83 @@ PoolAllocator::slowAllocate(size_t actualBytes)
   return pool->base;
 }
 
+PoolAllocator::Pool*
+PoolAllocator::newChunk(size_t bytes)
+{
+  void* memory = nullptr;
+  bool mapped = false;
+  if (huge_pages_ && bytes == chunk_size_ && IsAligned(bytes, kHugePageSize)) {
+#if defined(_WIN32)
+    // Large pages need SeLockMemoryPrivilege, which most hosts don't have.
+    size_t large = GetLargePageMinimum();
+    if (large && IsAligned(bytes, large))
+      memory = VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE);
+#else
+# if defined(MAP_HUGETLB)
+    memory = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+    if (memory == MAP_FAILED)
+      memory = nullptr;
+# endif
+# if defined(MADV_HUGEPAGE)
+    // Otherwise, ask for transparent huge pages. The mapping is only
+    // backed by them where it covers whole aligned huge pages.
+    if (!memory) {
+      memory = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+      if (memory == MAP_FAILED)
+        memory = nullptr;
+      else
+        madvise(memory, bytes, MADV_HUGEPAGE);
+    }
+# endif
+#endif
+    mapped = !!memory;
+  }
+  if (!memory)
+    memory = malloc(bytes);
+  if (!memory)
+    return nullptr;
+
+  Pool* pool = (Pool*)memory;
+  pool->base = (char*)(pool + 1);
+  pool->end = (char*)pool + bytes;
+  pool->mapped = mapped;
+
+  stats_.chunks_allocated++;
+  reserved_bytes_ += bytes;
+  if (reserved_bytes_ > stats_.peak_reserved)
+    stats_.peak_reserved = reserved_bytes_;
+  return pool;
+}
+
+// Keeps |pool| for reuse if that stays under the retention limit.
+void
+PoolAllocator::releaseChunk(Pool* pool)
+{
+  if (free_bytes_ + pool->size() <= retain_limit_) {
+    pool->prev = free_;
+    free_ = pool;
+    free_bytes_ += pool->size();
+    return;
+  }
+  freeChunk(pool);
+}
+
+void
+PoolAllocator::freeChunk(Pool* pool)
+{
+  size_t bytes = pool->size() + sizeof(Pool);
+  reserved_bytes_ -= bytes;
+  if (!pool->mapped) {
+    free(pool);
+    return;
+  }
+#if defined(_WIN32)
+  VirtualFree(pool, 0, MEM_RELEASE);
+#else
+  munmap(pool, bytes);
+#endif
+}
+
 void
 PoolAllocationPolicy::reportOutOfMemory()
 {
@@ -125,7 +238,7 @@ PoolAllocationPolicy::reportAllocationOverflow()
 void*
 PoolAllocationPolicy::Malloc(size_t bytes)
 {
-  void* p = CurrentCompileContext->pool().rawAllocate(bytes);
+  void* p = POOL().rawAllocate(bytes);
   if (!p) {
     fprintf(stderr, "OUT OF POOL MEMORY\n");
     abort();
@@ -20,6 +20,7 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <new>
@@ -34,6 +35,11 @@ using namespace ke;
 
 // Allocates memory in chunks that are not freed until the entire allocator
 // is freed. This is intended for use with large, temporary data structures.
+//
+// Chunks given back by leave() are kept for later allocations, up to the
+// retention limit, instead of being freed. A process that compiles many
+// files with one allocator can lift the limit so each compile reuses the
+// chunks the largest compile so far needed.
 class PoolAllocator
 {
   friend class PoolAllocationScope;
@@ -43,6 +49,8 @@ class PoolAllocator
     char* ptr;
     char* end;
     Pool* prev;
+    // Set if the chunk was mapped from the system rather than malloc'd.
+    bool mapped;
 
     size_t size() const {
       return size_t(end - base);
@@ -52,18 +60,55 @@ class PoolAllocator
   static const size_t kDefaultPoolSize = 8 * 1024;
   static const size_t kMaxReserveSize = 64 * 1024;
 
+ public:
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  struct Stats {
+    // Chunks taken from the system, and chunks reused from the free list.
+    uint64_t chunks_allocated;
+    uint64_t chunks_reused;
+    // The most bytes held in chunks at once, whether in use or free.
+    size_t peak_reserved;
+  };
+
  private:
-  Pool* reserved_;
+  // Chunks kept for reuse, most recently freed first.
+  Pool* free_;
+  size_t free_bytes_;
   Pool* last_;
+  size_t chunk_size_;
+  size_t retain_limit_;
+  bool huge_pages_;
+  size_t reserved_bytes_;
+  Stats stats_;
 
  private:
   void unwind(char* pos);
   void* slowAllocate(size_t actualBytes);
+  Pool* newChunk(size_t bytes);
+  void releaseChunk(Pool* pool);
+  void freeChunk(Pool* pool);
 
  public:
   PoolAllocator();
   ~PoolAllocator();
 
+  // Sets the size of new chunks. With |huge_pages|, chunks whose size is a
+  // multiple of kHugePageSize are mapped with huge pages if the system has
+  // them, which saves TLB misses when walking large trees.
+  void setChunkSize(size_t bytes, bool huge_pages);
+
+  // Sets how many bytes of chunks are kept once unwound. SIZE_MAX keeps all
+  // of them until the allocator is destroyed.
+  void setRetainLimit(size_t bytes);
+
+  // Frees the chunks kept for reuse.
+  void trim();
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
   void memoryUsage(size_t* allocated, size_t* reserved, size_t* bookkeeping) const {
     *allocated = 0;
     *reserved = 0;
@@ -73,8 +118,8 @@ class PoolAllocator
       *reserved += size_t(cursor->end - cursor->base);
       *bookkeeping += sizeof(Pool);
     }
-    if (reserved_) {
-      *reserved += size_t(reserved_->end - reserved_->base);
+    for (Pool* cursor = free_; cursor; cursor = cursor->prev) {
+      *reserved += size_t(cursor->end - cursor->base);
       *bookkeeping += sizeof(Pool);
     }
   }
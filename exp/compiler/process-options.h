@@ -56,6 +56,15 @@ struct CompileOptions
   // Show memory stats.
   bool ShowPoolStats;
 
+  // Show the time and memory spent in each phase.
+  bool TimePhases;
+
+  // Number of threads that analyse function bodies. 0 means one per core.
+  uint32_t Jobs;
+
+  // Skip compiling if the output's build stamp shows nothing has changed.
+  bool Incremental;
+
   // Memory size for v1 pcode.
   uint32_t PragmaDynamic;
 
@@ -65,6 +74,10 @@ struct CompileOptions
   // Override output file.
   Maybe<std::string> OutputFile;
 
+  // Where to write a Makefile-style list of the sources the output was built
+  // from, if anywhere.
+  Maybe<std::string> DependencyFile;
+
   CompileOptions()
    : RequireNewdecls(false),
      RequireSemicolons(false),
@@ -73,6 +86,9 @@ struct CompileOptions
      ShowAST(false),
      ShowSema(false),
      ShowPoolStats(false),
+     TimePhases(false),
+     Jobs(1),
+     Incremental(false),
      PragmaDynamic(0)
   {
   }
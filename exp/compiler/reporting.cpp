@@ -131,6 +131,15 @@ ReportManager::report(const RefPtr<TMessage>& msg)
   messages_.push_back(msg);
 }
 
+void
+ReportManager::absorb(const ReportManager& other)
+{
+  for (const RefPtr<TMessage>& msg : other.messages_)
+    report(msg);
+  if (other.fatal_error_ != rmsg::none)
+    reportFatal(other.fatal_loc_, other.fatal_error_);
+}
+
 MessageBuilder
 ReportManager::build(const SourceLocation& loc, rmsg::Id msg_id)
 {
@@ -230,6 +230,9 @@ class ReportManager
   MessageBuilder build(const SourceLocation& loc, rmsg::Id msg_id);
   void report(const RefPtr<TMessage>& msg);
 
+  // Reports everything |other| collected, as if it had been reported here.
+  void absorb(const ReportManager& other);
+
  private:
   void printMessage(RefPtr<TMessage> message);
   void printSourceLine(const FullSourceRef& ref);
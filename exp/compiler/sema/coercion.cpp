@@ -105,10 +105,64 @@ SemanticAnalysis::coerce_array(EvalContext& ec)
   if (ec.ck == CoercionKind::Assignment || ec.ck == CoercionKind::Return)
     assert(to_array->nlevels() == 1);
 
-  // Check that each level contains a matching size and const-qualifier.
+  switch (checkArrayCoercion(from, to_array, ec.ck)) {
+    case ArrayCoercion::Ok:
+      break;
+    case ArrayCoercion::IllegalAssignment:
+      cc_.report(ec.from_src->loc(), rmsg::coercion_allows_illegal_assn) <<
+        ec.from->type() << ec.to;
+      ec.result = nullptr;
+      return false;
+    default:
+      return no_conversion(ec);
+  }
+
+  // Phew... everything is equal. If the destination type is fixed-length,
+  // there is nothing more to do.
+  if (to_array->hasFixedLength()) {
+    assert(!index_expr);
+    assert(from->toArray()->hasFixedLength());
+    return true;
+  }
+
+  // Create a slice if needed.
+  if (index_expr) {
+    sema::Expr* base = index_expr->base();
+    if (sema::LValueExpr* lval = base->asLValueExpr())
+      base = new (pool_) sema::LoadExpr(base->src(), base->type(), lval);
+    ec.result = new (pool_) sema::SliceExpr(base->src(), from, base, index_expr->index());
+    return true;
+  }
+
+  if (sema::LValueExpr* lval = ec.result->asLValueExpr())
+    ec.result = lvalue_to_rvalue(lval);
+  return true;
+}
+
+SemanticAnalysis::ArrayCoercion
+SemanticAnalysis::checkArrayCoercion(Type* from, ArrayType* to, CoercionKind ck)
+{
+  // The answer only depends on the types, which are interned, so it is the
+  // same for every expression coerced from |from| to |to|.
+  ArrayCoercionKey key = { from, to, ck };
+  ArrayCoercionCache::Insert p = array_coercions_.findForAdd(key);
+  if (p.found())
+    return p->value;
+
+  ArrayCoercion result = computeArrayCoercion(from, to, ck);
+  array_coercions_.add(p, key, result);
+  return result;
+}
+
+SemanticAnalysis::ArrayCoercion
+SemanticAnalysis::computeArrayCoercion(Type* from, ArrayType* to_array, CoercionKind ck)
+{
+  // Check that each level contains a matching size and const-qualifier. Array
+  // and qualified types are interned, so once both sides reach the same type
+  // the remaining levels are known to match.
   Type* from_iter = from;
   Type* to_iter = to_array;
-  while (from_iter->isArray() && to_iter->isArray()) {
+  while (from_iter != to_iter && from_iter->isArray() && to_iter->isArray()) {
     ArrayType* from_iter_array = from_iter->toArray();
     ArrayType* to_iter_array = to_iter->toArray();
 
@@ -117,16 +171,16 @@ SemanticAnalysis::coerce_array(EvalContext& ec)
     // if the destination has a fixed size, it must always match.
     if (to_iter_array->hasFixedLength()) {
       if (!from_iter_array->hasFixedLength())
-        return no_conversion(ec);
+        return ArrayCoercion::None;
 
-      if (ec.ck == CoercionKind::Assignment) {
+      if (ck == CoercionKind::Assignment) {
         // As a special exception, we allow converting from char[N] to char[M]
         // if N<=M, since strings are null-terminated.
         if (from_iter_array->fixedLength() > to_iter_array->fixedLength())
-          return no_conversion(ec);
+          return ArrayCoercion::None;
       } else {
         if (from_iter_array->fixedLength() != to_iter_array->fixedLength())
-          return no_conversion(ec);
+          return ArrayCoercion::None;
       }
     }
 
@@ -158,18 +212,15 @@ SemanticAnalysis::coerce_array(EvalContext& ec)
         !to_iter->toArray()->hasFixedLength() &&
         !to_iter->isConst())
     {
-      cc_.report(ec.from_src->loc(), rmsg::coercion_allows_illegal_assn) <<
-        ec.from->type() << ec.to;
-      ec.result = nullptr;
-      return false;
+      return ArrayCoercion::IllegalAssignment;
     }
 
-    if (ec.ck == CoercionKind::Arg) {
+    if (ck == CoercionKind::Arg) {
       // If the source contents at this level are const, but the target wants
       // something mutable, then no conversion is available.
       if (from_iter->isConst() && !to_iter->isConst())
-        return no_conversion(ec);
-    } else if (ec.ck == CoercionKind::Assignment) {
+        return ArrayCoercion::None;
+    } else if (ck == CoercionKind::Assignment) {
       // const int p[10] is not assignable. :TODO: handle this in assignment
       // const int p[] has no semantics at all. :TODO: block this in assignment
       assert(to_iter_array->hasFixedLength());
@@ -181,28 +232,8 @@ SemanticAnalysis::coerce_array(EvalContext& ec)
   from_iter = from_iter->unqualified();
   to_iter = to_iter->unqualified();
   if (!CompareNonArrayTypesExactly(from_iter, to_iter))
-    return no_conversion(ec);
-
-  // Phew... everything is equal. If the destination type is fixed-length,
-  // there is nothing more to do.
-  if (to_array->hasFixedLength()) {
-    assert(!index_expr);
-    assert(from->toArray()->hasFixedLength());
-    return true;
-  }
-
-  // Create a slice if needed.
-  if (index_expr) {
-    sema::Expr* base = index_expr->base();
-    if (sema::LValueExpr* lval = base->asLValueExpr())
-      base = new (pool_) sema::LoadExpr(base->src(), base->type(), lval);
-    ec.result = new (pool_) sema::SliceExpr(base->src(), from, base, index_expr->index());
-    return true;
-  }
-
-  if (sema::LValueExpr* lval = ec.result->asLValueExpr())
-    ec.result = lvalue_to_rvalue(lval);
-  return true;
+    return ArrayCoercion::None;
+  return ArrayCoercion::Ok;
 }
 
 Type*
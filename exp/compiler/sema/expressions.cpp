@@ -19,6 +19,7 @@
 
 #include "coercion.h"
 #include "compile-context.h"
+#include "constant-evaluator.h"
 #include "parser/ast.h"
 #include "scopes.h"
 #include "semantic-analysis.h"
@@ -164,7 +165,7 @@ SemanticAnalysis::visitNameProxy(ast::NameProxy* node)
   return new (pool_) sema::VarExpr(node, sym->type(), sym);
 }
 
-sema::BinaryExpr*
+sema::Expr*
 SemanticAnalysis::visitBinaryExpression(BinaryExpression* node)
 {
   sema::Expr* left = visitExpression(node->left());
@@ -224,6 +225,9 @@ SemanticAnalysis::visitBinaryExpression(BinaryExpression* node)
       return nullptr;
   }
 
+  if (sema::Expr* folded = fold_binary(node, type, left, right))
+    return folded;
+
   return new (pool_) sema::BinaryExpr(node, type, node->token(), left, right);
 }
 
@@ -241,9 +245,88 @@ SemanticAnalysis::visitUnaryExpression(ast::UnaryExpression* node)
   if (!coerce(ec))
     return nullptr;
 
+  if (sema::Expr* folded = fold_unary(node, ec.to, ec.result))
+    return folded;
+
   return new (pool_) sema::UnaryExpr(node, ec.to, node->token(), ec.result);
 }
 
+// Folding is only an optimization, so anything the evaluator would complain
+// about - overflow, division by zero - is quietly left for the runtime, which
+// is what spcomp does. Errors go to a scratch report manager and are dropped.
+static bool
+IsFoldableValue(const BoxedValue& value)
+{
+  if (value.isBool())
+    return true;
+  return value.isInteger() && value.toInteger().valueFitsInInt32();
+}
+
+sema::Expr*
+SemanticAnalysis::fold_binary(BinaryExpression* node, Type* type, sema::Expr* left,
+                              sema::Expr* right)
+{
+  BoxedValue lval, rval;
+  if (!left->getBoxedValue(&lval) || !right->getBoxedValue(&rval))
+    return nullptr;
+
+  // The evaluator shifts 64-bit values, so only fold shifts whose result
+  // doesn't depend on the width.
+  switch (node->token()) {
+    case TOK_SHL:
+    case TOK_SHR:
+    case TOK_USHR:
+    {
+      int32_t count, value;
+      if (!left->getConstantInt32(&value) || !right->getConstantInt32(&count))
+        return nullptr;
+      if (count < 0 || count > 31)
+        return nullptr;
+      if (node->token() != TOK_SHR && value < 0)
+        return nullptr;
+      break;
+    }
+    default:
+      break;
+  }
+
+  ReportManager scratch;
+  ReportingContext rc(scratch, node->loc(), false);
+
+  BoxedValue result;
+  if (ConstantEvaluator::EvaluateBinary(rc, node->token(), lval, rval, &result) !=
+      ConstantEvaluator::Ok)
+  {
+    return nullptr;
+  }
+  if (!IsFoldableValue(result))
+    return nullptr;
+
+  return new (pool_) sema::ConstValueExpr(node, type, result);
+}
+
+sema::Expr*
+SemanticAnalysis::fold_unary(ast::UnaryExpression* node, Type* type, sema::Expr* expr)
+{
+  BoxedValue value;
+  if (!expr->getBoxedValue(&value))
+    return nullptr;
+
+  ReportManager scratch;
+  ReportingContext rc(scratch, node->loc(), false);
+
+  BoxedValue result;
+  if (ConstantEvaluator::EvaluateUnary(rc, node->token(), value, &result) !=
+      ConstantEvaluator::Ok)
+  {
+    return nullptr;
+  }
+  if (!IsFoldableValue(result))
+    return nullptr;
+
+  return new (pool_) sema::ConstValueExpr(node, type, result);
+}
+
 sema::Expr*
 SemanticAnalysis::visitIndex(ast::IndexExpression* node)
 {
@@ -730,6 +813,11 @@ SemanticAnalysis::visitTernary(ast::TernaryExpression* node)
   if (!coerce_ternary(tc))
     return nullptr;
 
+  // Both arms have been checked, so a constant condition can pick one now.
+  BoxedValue cond;
+  if (test_ec.result->getBoxedValue(&cond) && cond.isBool())
+    return cond.toBool() ? tc.left : tc.right;
+
   return new (pool_) sema::TernaryExpr(
     node,
     tc.type,
@@ -705,6 +705,10 @@ class TernaryExpr final : public Expr
   Expr* right() const {
     return right_;
   }
+  bool hasSideEffects() const override {
+    return choose_->hasSideEffects() || left_->hasSideEffects() ||
+           right_->hasSideEffects();
+  }
 
  private:
   Expr* choose_;
@@ -96,12 +96,13 @@ NameResolver::declareSystemType(Scope* scope, const char* name, Type* type)
 
   TypeSymbol* sym = new (pool_) TypeSymbol(nullptr, scope, tag, type);
   scope->addSymbol(sym);
+  bind(sym);
 }
 
 void
 NameResolver::OnEnterScope(Scope::Kind kind)
 {
-  env_.push_back(SymbolEnv(kind));
+  env_.push_back(SymbolEnv(kind, shadowed_.size()));
 }
 
 Scope*
@@ -125,6 +126,7 @@ NameResolver::OnLeaveScope()
     // we must have a parent, since we stop at the global scope.
     ke::MoveExtend(&prev->children(), &env.children());
   }
+  unbindTo(env.shadow_mark());
   env_.pop_back();
   return scope;
 }
@@ -133,6 +135,7 @@ void
 NameResolver::OnLeaveOrphanScope()
 {
   // Don't connect the current up to anything.
+  unbindTo(env_.back().shadow_mark());
   env_.pop_back();
 }
 
@@ -160,14 +163,44 @@ NameResolver::getOrCreateScope()
 Symbol*
 NameResolver::lookup(Atom* name)
 {
-  for (size_t i = env_.size(); i > 0; i--) {
-    SymbolEnv& env = env_[i - 1];
-    if (!env.scope())
-      continue;
-    if (Symbol* sym = env.scope()->localLookup(name))
-      return sym;
+  AtomMap<Symbol*>::Result r = bindings_.find(name);
+  if (!r.found())
+    return nullptr;
+  return r->value;
+}
+
+void
+NameResolver::bind(Symbol* sym)
+{
+  // Globals are never unbound, and nothing is bound beneath them, so they
+  // don't need to be logged.
+  bool logged = env_.size() > 1;
+
+  AtomMap<Symbol*>::Insert p = bindings_.findForAdd(sym->name());
+  if (p.found()) {
+    if (logged)
+      shadowed_.push_back(Shadowed{sym->name(), p->value});
+    p->value = sym;
+    return;
+  }
+  if (logged)
+    shadowed_.push_back(Shadowed{sym->name(), nullptr});
+  bindings_.add(p, sym->name(), sym);
+}
+
+void
+NameResolver::unbindTo(size_t mark)
+{
+  while (shadowed_.size() > mark) {
+    const Shadowed& entry = shadowed_.back();
+    AtomMap<Symbol*>::Result r = bindings_.find(entry.name);
+    assert(r.found());
+    if (entry.prev)
+      r->value = entry.prev;
+    else
+      bindings_.remove(r);
+    shadowed_.pop_back();
   }
-  return nullptr;
 }
 
 void
@@ -188,13 +221,16 @@ NameResolver::registerSymbol(Symbol* sym)
 {
   Scope* scope = getOrCreateScope();
 
-  if (Symbol* other = scope->localLookup(sym->name())) {
+  // The innermost binding is the only one that can be in this scope.
+  Symbol* other = lookup(sym->name());
+  if (other && other->scope() == scope) {
     // Report, but allow errors to continue.
     reportRedeclaration(sym, other);
     return true;
   }
 
   scope->addSymbol(sym);
+  bind(sym);
   return true;
 }
 
@@ -203,13 +239,14 @@ NameResolver::resolveUnknownTags()
 {
   for (AtomMap<NameProxy*>::iterator iter = user_tags_.iter(); !iter.empty(); iter.next()) {
     Atom* atom = iter->key;
-    if (globals_->lookup(atom))
+    if (lookup(atom))
       continue;
 
     NameProxy* origin = iter->value;
     EnumType* type = cc_.types()->newEnum(atom);
     Symbol* sym = new (pool_) TypeSymbol(origin, globals_, atom, type);
     globals_->addSymbol(sym);
+    bind(sym);
   }
 }
 
@@ -220,7 +257,7 @@ NameResolver::resolveUnboundNames()
   AtomSet seen;
   for (size_t i = 0; i < unresolved_names_.size(); i++) {
     NameProxy* proxy = unresolved_names_[i];
-    Symbol* sym = globals_->lookup(proxy->name());
+    Symbol* sym = lookup(proxy->name());
     if (!sym) {
       AtomSet::Insert p = seen.findForAdd(proxy->name());
       if (p.found())
@@ -408,7 +445,7 @@ NameResolver::canDefineMethodmap(MethodmapDecl* methodmap)
   // not accept typedefs.
   assert(getOrCreateScope() == globals_);
 
-  Symbol* prev = globals_->lookup(methodmap->name());
+  Symbol* prev = lookup(methodmap->name());
   if (!prev)
     return true;
 
@@ -689,9 +726,10 @@ NameResolver::registerFunction(FunctionSymbol* sym)
   Scope* scope = sym->scope();
   assert(scope == globals_);
 
-  Symbol* other = scope->localLookup(sym->name());
+  Symbol* other = lookup(sym->name());
   if (!other) {
     scope->addSymbol(sym);
+    bind(sym);
     return;
   }
 
@@ -108,6 +108,8 @@ class NameResolver
   void declareSystemType(Scope* scope, const char* name, Type* type);
   Scope* getOrCreateScope();
   Symbol* lookup(Atom* name);
+  void bind(Symbol* sym);
+  void unbindTo(size_t mark);
   bool registerSymbol(Symbol* sym);
   void registerFunction(FunctionSymbol* sym);
   void reportRedeclaration(Symbol* sym, Symbol* other);
@@ -133,17 +135,15 @@ class NameResolver
    public:
     SymbolEnv()
     {}
-    SymbolEnv(Scope* scope)
-     : scope_(scope),
-       kind_(scope->kind())
-    {}
-    SymbolEnv(Scope::Kind kind)
+    SymbolEnv(Scope::Kind kind, size_t shadow_mark)
      : scope_(nullptr),
-       kind_(kind)
+       kind_(kind),
+       shadow_mark_(shadow_mark)
     {}
     SymbolEnv(SymbolEnv&& other)
      : scope_(other.scope_),
        kind_(other.kind_),
+       shadow_mark_(other.shadow_mark_),
        children_(std::move(other.children_))
     {
     }
@@ -158,6 +158,11 @@ class NameResolver
       return children_;
     }
 
+    // Length of the shadow log when this environment was entered.
+    size_t shadow_mark() const {
+      return shadow_mark_;
+    }
+
     void setScope(Scope* scope) {
       assert(!scope_);
       assert(scope->kind() == kind_);
@@ -177,6 +182,7 @@ class NameResolver
     SymbolEnv& operator =(SymbolEnv&& other) {
       scope_ = other.scope_;
       kind_ = other.kind_;
+      shadow_mark_ = other.shadow_mark_;
       children_ = std::move(other.children_);
       return *this;
     }
@@ -188,15 +194,28 @@ class NameResolver
    private:
     Scope* scope_;
     Scope::Kind kind_;
+    size_t shadow_mark_;
     std::vector<Scope*> children_;
   };
 
+  // Scopes keep their symbols for later phases, but names are looked up in
+  // one table holding the innermost binding of every visible name, so a
+  // lookup is one probe however deeply blocks nest. Binding a name pushes
+  // the binding it shadows (or null) onto the shadow log, and leaving an
+  // environment pops its entries to restore them.
+  struct Shadowed {
+    Atom* name;
+    Symbol* prev;
+  };
+
  private:
   CompileContext& cc_;
   PoolAllocator& pool_;
   TypeResolver tr_;
   GlobalScope* globals_;
   std::vector<SymbolEnv> env_;
+  AtomMap<Symbol*> bindings_;
+  std::vector<Shadowed> shadowed_;
 
   LayoutScope* layout_scope_;
   std::vector<LayoutScope*> saved_layout_scopes_;
@@ -15,8 +15,13 @@
 // 
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <utility>
 
+#include <amtl/am-thread.h>
+
 #include "compile-context.h"
 #include "semantic-analysis.h"
 #include "scopes.h"
@@ -30,13 +35,19 @@ using namespace ast;
 // :TODO: constant folding
 
 SemanticAnalysis::SemanticAnalysis(CompileContext& cc, TranslationUnit* tu)
+ : SemanticAnalysis(cc, tu, cc.pool())
+{
+}
+
+SemanticAnalysis::SemanticAnalysis(CompileContext& cc, TranslationUnit* tu, PoolAllocator& pool)
  : cc_(cc),
-   pool_(cc.pool()),
+   pool_(pool),
    types_(cc.types()),
    tu_(tu),
    fs_(nullptr),
    loop_depth_(0)
 {
+  array_coercions_.init(16);
 }
 
 sema::Program*
@@ -56,13 +67,25 @@ SemanticAnalysis::walkAST()
 {
   ParseTree* tree = tu_->tree();
   StatementList* statements = tree->statements();
+
+  // Bodies analysed ahead of time have their messages reported here, so the
+  // output is the same as analysing everything in order.
+  std::vector<std::unique_ptr<ReportManager>> body_reports;
+  bool analyzed_bodies = analyzeBodiesInParallel(statements, &body_reports);
+
   for (size_t i = 0; i < statements->size(); i++) {
     Statement* stmt = statements->at(i);
     switch (stmt->kind()) {
       case AstKind::kFunctionStatement:
       {
         FunctionStatement* fun = stmt->toFunctionStatement();
-        visitFunctionStatement(fun);
+        if (analyzed_bodies) {
+          cc_.reporting().absorb(*body_reports[i]);
+          if (fun->body())
+            global_functions_.push_back(fun);
+        } else {
+          visitFunctionStatement(fun);
+        }
         break;
       }
       case AstKind::kVarDecl:
@@ -87,4 +110,67 @@ SemanticAnalysis::walkAST()
   return cc_.phasePassed();
 }
 
+bool
+SemanticAnalysis::analyzeBodiesInParallel(StatementList* statements,
+                                          std::vector<std::unique_ptr<ReportManager>>* reports)
+{
+  size_t jobs = cc_.options().Jobs;
+  if (!jobs)
+    jobs = std::max(std::thread::hardware_concurrency(), 1u);
+
+  std::vector<size_t> functions;
+  for (size_t i = 0; i < statements->size(); i++) {
+    if (statements->at(i)->kind() == AstKind::kFunctionStatement)
+      functions.push_back(i);
+  }
+  jobs = std::min(jobs, functions.size());
+  if (jobs <= 1)
+    return false;
+
+  reports->resize(statements->size());
+  for (size_t index : functions)
+    (*reports)[index] = std::make_unique<ReportManager>();
+
+  // Nothing may be written to a shared type once threads are reading them.
+  types_->normalizeWrappedTypes();
+
+  // Everything the analysis allocates outlives this phase, so each thread
+  // gets a pool that lives as long as the compile context.
+  std::atomic<size_t> next(0);
+  auto work = [&, this](PoolAllocator* pool) -> void {
+    CurrentCompileContext = &cc_;
+    CurrentThreadPool = pool;
+
+    SemanticAnalysis analysis(cc_, tu_, *pool);
+    for (size_t i = next++; i < functions.size(); i = next++) {
+      size_t index = functions[i];
+      CurrentThreadReports = (*reports)[index].get();
+      analysis.visitFunctionStatement(statements->at(index)->toFunctionStatement());
+    }
+
+    CurrentThreadReports = nullptr;
+    CurrentThreadPool = nullptr;
+  };
+
+  std::vector<std::unique_ptr<std::thread>> threads;
+  for (size_t i = 0; i < jobs; i++) {
+    PoolAllocator* pool = &cc_.addThreadPool();
+    std::unique_ptr<std::thread> thread =
+      ke::NewThread("spcomp2 semantic analysis", [&work, pool]() -> void {
+        work(pool);
+      });
+    if (!thread)
+      break;
+    threads.push_back(std::move(thread));
+  }
+
+  // If no thread could be started, the work still has to be done.
+  if (threads.empty())
+    work(&cc_.addThreadPool());
+
+  for (const auto& thread : threads)
+    thread->join();
+  return true;
+}
+
 } // namespace sp
@@ -18,7 +18,12 @@
 #ifndef _include_semantic_analysis_h_
 #define _include_semantic_analysis_h_
 
+#include <memory>
+#include <vector>
+
+#include <amtl/am-hashmap.h>
 #include "parser/ast.h"
+#include "sema/coercion.h"
 #include "sema/expressions.h"
 #include "sema/program.h"
 
@@ -26,10 +31,9 @@ namespace sp {
 
 class CompileContext;
 class PoolAllocator;
+class ReportManager;
 class TranslationUnit;
 class TypeManager;
-struct EvalContext;
-struct TernaryContext;
 
 using namespace ast;
 
@@ -41,8 +45,17 @@ class SemanticAnalysis
   sema::Program* analyze();
 
  private:
+  SemanticAnalysis(CompileContext& cc, TranslationUnit* unit, PoolAllocator& pool);
+
   bool walkAST();
 
+  // With more than one job, analyses every function body on worker threads,
+  // filling |reports| (indexed like |statements|) with each one's messages.
+  // Returns false, having done nothing, if the bodies should be analysed in
+  // order instead.
+  bool analyzeBodiesInParallel(StatementList* statements,
+                               std::vector<std::unique_ptr<ReportManager>>* reports);
+
   void visitFunctionStatement(FunctionStatement* node);
   void visitBlockStatement(BlockStatement* node);
   void visitStatement(Statement* node);
@@ -59,7 +72,7 @@ class SemanticAnalysis
   // Expression handling.
   sema::Expr* visitExpression(Expression* node);
   sema::ConstValueExpr* visitIntegerLiteral(IntegerLiteral* node);
-  sema::BinaryExpr* visitBinaryExpression(BinaryExpression* node);
+  sema::Expr* visitBinaryExpression(BinaryExpression* node);
   sema::CallExpr* visitCallExpression(ast::CallExpression* node);
   sema::Expr* visitNameProxy(ast::NameProxy* node);
   sema::Expr* visitUnaryExpression(ast::UnaryExpression* node);
@@ -98,9 +111,23 @@ class SemanticAnalysis
   bool coerce_primitive(EvalContext& ec);
   bool coerce_to_char(EvalContext& ec);
   bool no_conversion(EvalContext& ec);
+
+  enum class ArrayCoercion : uint8_t {
+    Ok,
+    None,
+    IllegalAssignment
+  };
+  ArrayCoercion checkArrayCoercion(Type* from, ArrayType* to, CoercionKind ck);
+  ArrayCoercion computeArrayCoercion(Type* from, ArrayType* to, CoercionKind ck);
   Type* arrayOrSliceType(EvalContext& ec, sema::IndexExpr** out);
   sema::Expr* lvalue_to_rvalue(sema::LValueExpr* expr);
 
+  // Replace operators on constants with their value. These return null if
+  // the operation can't be done at compile time.
+  sema::Expr* fold_binary(BinaryExpression* node, Type* type, sema::Expr* left,
+                          sema::Expr* right);
+  sema::Expr* fold_unary(ast::UnaryExpression* node, Type* type, sema::Expr* expr);
+
   sema::Expr* initializer(ast::Expression* expr, Type* type);
   sema::Expr* struct_initializer(ast::StructInitializer* expr, Type* type);
   sema::Expr* array_initializer(ast::ArrayLiteral* expr, Type* type);
@@ -144,6 +171,26 @@ class SemanticAnalysis
   std::vector<ast::VarDecl*> global_vars_;
 
   size_t loop_depth_;
+
+  // Whether one array type coerces to another, by coercion kind. Each
+  // analysis has its own, so threads analysing bodies don't share it.
+  struct ArrayCoercionKey {
+    Type* from;
+    ArrayType* to;
+    CoercionKind ck;
+  };
+  struct ArrayCoercionKeyPolicy {
+    static uint32_t hash(const ArrayCoercionKey& key) {
+      return (ke::HashPointer(key.from) * 31 + ke::HashPointer(key.to)) * 31 +
+             uint32_t(key.ck);
+    }
+    static bool matches(const ArrayCoercionKey& key, const ArrayCoercionKey& other) {
+      return key.from == other.from && key.to == other.to && key.ck == other.ck;
+    }
+  };
+  typedef ke::HashMap<ArrayCoercionKey, ArrayCoercion, ArrayCoercionKeyPolicy>
+    ArrayCoercionCache;
+  ArrayCoercionCache array_coercions_;
 };
 
 } // namespace sp
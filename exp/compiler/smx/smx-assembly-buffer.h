@@ -37,6 +37,16 @@ class SmxAssemblyBuffer : public AssemblyBuffer
     write<cell_t>(static_cast<cell_t>(op));
     write<cell_t>(param);
   }
+  void opcode(OPCODE op, cell_t param1, cell_t param2) {
+    write<cell_t>(static_cast<cell_t>(op));
+    write<cell_t>(param1);
+    write<cell_t>(param2);
+  }
+  void opcode(OPCODE op, const cell_t* params, size_t nparams) {
+    write<cell_t>(static_cast<cell_t>(op));
+    for (size_t i = 0; i < nparams; i++)
+      write<cell_t>(params[i]);
+  }
   void opcode(OPCODE op, cell_t param1, cell_t param2, cell_t param3) {
     write<cell_t>(static_cast<cell_t>(op));
     write<cell_t>(param1);
@@ -57,6 +57,7 @@ SmxCompiler::SmxCompiler(CompileContext& cc, sema::Program* program)
    last_stmt_pc_(0)
 {
   names_ = new SmxNameTable(".names");
+  name_hash_ = new SmxNameHashSection(".names.hash", names_);
   builder_.add(names_);
 }
 
@@ -93,6 +94,7 @@ SmxCompiler::compile()
   add_natives();
   add_publics();
   add_pubvars();
+  builder_.addIfNotEmpty(name_hash_);
 
   return cc_.phasePassed();
 }
@@ -142,6 +144,7 @@ SmxCompiler::add_natives()
 
     sp_file_natives_t& nf = natives->add();
     nf.name = names_->add(entry.name);
+    name_hash_->add(SmxNameHashSection::Natives, nf.name);
 
     __ bind_to(entry.fun->address(), (uint32_t)i);
   }
@@ -162,6 +165,7 @@ SmxCompiler::add_publics()
     sp_file_publics_t& pf = publics->add();
     pf.address = entry.fun->address()->offset();
     pf.name = names_->add(entry.name);
+    name_hash_->add(SmxNameHashSection::Publics, pf.name);
   }
   builder_.add(publics);
 }
@@ -187,6 +191,7 @@ SmxCompiler::add_pubvars()
     sp_file_pubvars_t& pv = pubvars->add();
     pv.address = decl->sym()->address();
     pv.name = names_->add(decl->name());
+    name_hash_->add(SmxNameHashSection::Pubvars, pv.name);
   }
   if (!pubvars->length())
     return;
@@ -324,11 +329,8 @@ SmxCompiler::generateStatement(ast::Statement* stmt)
       "operand stack is not empty at end of statement";
   }
 
-  if (heap_usage_) {
-    __ opcode(OP_HEAP, -heap_usage_);
-    max_heap_usage_ = std::max(heap_usage_, max_heap_usage_);
-    heap_usage_ = 0;
-  }
+  // Calls free their own temporaries.
+  assert(heap_usage_ == 0);
 }
 
 void
@@ -415,6 +417,8 @@ SmxCompiler::generateVarDecl(ast::VarDecl* stmt)
     init = nullptr;
 
   if (init) {
+    if (emit_const_store(sym, init))
+      return;
     if (!emit_into(init, ValueDest::Pri))
       return;
 
@@ -439,6 +443,16 @@ void
 SmxCompiler::generateExprStatement(ast::ExpressionStatement* stmt)
 {
   sema::Expr* expr = stmt->sema_expr();
+
+  // The value of an assignment statement is unused, so constants can be
+  // stored without a register.
+  if (sema::StoreExpr* store = expr->asStoreExpr()) {
+    if (sema::VarExpr* var = store->left()->asVarExpr()) {
+      if (emit_const_store(var->sym(), store->right()))
+        return;
+    }
+  }
+
   emit_into(expr, ValueDest::Pri);
 }
 
@@ -706,6 +720,9 @@ SmxCompiler::emitConstValue(sema::ConstValueExpr* expr, ValueDest dest)
       value = (int32_t)iv.asSigned();
       break;
     }
+    case BoxedValue::Kind::Bool:
+      value = box.toBool() ? 1 : 0;
+      break;
     default:
       assert(false);
   }
@@ -808,6 +825,69 @@ MaybeConstInt32(sema::Expr* expr)
   return Some((int32_t)iv.asSigned());
 }
 
+// If |expr| is a plain read of a local, argument, or global cell, returns the
+// variable. These can be loaded into either register without touching the
+// other one.
+static VariableSymbol*
+GetLeafVar(sema::Expr* expr)
+{
+  sema::LoadExpr* load = expr->asLoadExpr();
+  if (!load)
+    return nullptr;
+  sema::VarExpr* var = load->lvalue()->asVarExpr();
+  if (!var)
+    return nullptr;
+
+  VariableSymbol* sym = var->sym();
+  switch (sym->storage()) {
+    case StorageClass::Argument:
+    case StorageClass::Local:
+      return sym;
+    case StorageClass::Global:
+      return sym->type()->isReference() ? nullptr : sym;
+    default:
+      return nullptr;
+  }
+}
+
+// Sethi-Ullman numbering: how many registers an expression needs to be
+// computed without spilling. Anything we can't see through is assumed to need
+// both registers and then some.
+static unsigned
+RegisterNeed(sema::Expr* expr)
+{
+  if (MaybeConstInt32(expr) || GetLeafVar(expr))
+    return 1;
+  if (sema::BinaryExpr* bin = expr->asBinaryExpr()) {
+    unsigned left = RegisterNeed(bin->left());
+    unsigned right = RegisterNeed(bin->right());
+    return (left == right) ? left + 1 : std::max(left, right);
+  }
+  if (sema::UnaryExpr* unary = expr->asUnaryExpr())
+    return RegisterNeed(unary->expr());
+  if (sema::ImplicitCastExpr* cast = expr->asImplicitCastExpr())
+    return RegisterNeed(cast->expr());
+  return 3;
+}
+
+// If |expr| can be pushed with one of the PUSH/PUSH.S/PUSH.C opcodes, returns
+// the index of that family in the PUSHn opcode groups, and sets |*param|.
+static int
+GetPushKind(sema::Expr* expr, cell_t* param)
+{
+  if (Maybe<int32_t> value = MaybeConstInt32(expr)) {
+    *param = *value;
+    return 0;
+  }
+
+  VariableSymbol* sym = GetLeafVar(expr);
+  if (!sym || sym->type()->isReference())
+    return -1;
+
+  *param = sym->address();
+  return (sym->storage() == StorageClass::Global) ? 1 : 2;
+}
+
 ValueDest
 SmxCompiler::emitBinary(sema::BinaryExpr* expr, ValueDest dest)
 {
@@ -848,11 +928,11 @@ SmxCompiler::emitBinary(sema::BinaryExpr* expr, ValueDest dest)
         std::swap(left_i32, right_i32);
       }
 
-      if (!emit_into(left, ValueDest::Pri))
-        return ValueDest::Error;
-
       // Use .C variants.
       if (right_i32) {
+        if (!emit_into(left, ValueDest::Pri))
+          return ValueDest::Error;
+
         if (expr->token() == TOK_PLUS)
           __ opcode(OP_ADD_C, *right_i32);
         else if (expr->token() == TOK_STAR)
@@ -862,10 +942,8 @@ SmxCompiler::emitBinary(sema::BinaryExpr* expr, ValueDest dest)
         return ValueDest::Pri;
       }
 
-      uint64_t saved_pri = preserve(ValueDest::Pri);
-      if (!emit_into(right, ValueDest::Alt))
+      if (!load_both(left, right))
         return ValueDest::Error;
-      restore(saved_pri);
 
       if (expr->token() == TOK_PLUS)
         __ opcode(OP_ADD);
@@ -1123,9 +1201,34 @@ SmxCompiler::emitCall(sema::CallExpr* expr, ValueDest dest)
   if (args->size() > kMaxArgs)
     cc_.report(expr->src()->loc(), rmsg::too_many_arguments);
 
+  // Bytes of heap used to pass by-value arguments to variadic parameters.
+  // If an argument fails to compile, no code frees them, but they are still
+  // taken off heap_usage_ so the next statement starts balanced.
+  int32_t call_heap = 0;
+
   for (size_t i = args->size() - 1; i < args->size(); i--) {
     sema::Expr* expr = args->at(i);
 
+    // Runs of constants, or of plain locals or globals, can be pushed with
+    // one of the PUSH2-PUSH5 opcodes.
+    cell_t params[5];
+    int kind = (i < formal_argc) ? GetPushKind(expr, &params[0]) : -1;
+    if (kind >= 0) {
+      size_t count = 1;
+      while (count < 5 && i >= count && i - count < formal_argc) {
+        if (GetPushKind(args->at(i - count), &params[count]) != kind)
+          break;
+        count++;
+      }
+      if (count >= 2) {
+        // Groups are laid out as PUSHn.C, PUSHn, PUSHn.S, PUSHn.ADR.
+        OPCODE op = OPCODE(OP_PUSH2_C + (count - 2) * 4 + kind);
+        __ opcode(op, params, count);
+        i -= count - 1;
+        continue;
+      }
+    }
+
     size_t opstack_size = operand_stack_.size();
 
     if (i >= formal_argc &&
@@ -1134,16 +1237,21 @@ SmxCompiler::emitCall(sema::CallExpr* expr, ValueDest dest)
     {
       // :TODO: write peephole optimization for f(n++) to not lose the lvalue.
       assert(HasSimpleCellStorage(expr->type()));
-      if (!emit_into(expr, ValueDest::Pri))
+      if (!emit_into(expr, ValueDest::Pri)) {
+        heap_usage_ -= call_heap;
         return ValueDest::Error;
+      }
 
       __ opcode(OP_HEAP, sizeof(cell_t));
       __ opcode(OP_STOR_I);
       __ opcode(OP_PUSH_ALT);
       heap_usage_ += sizeof(cell_t);
+      call_heap += sizeof(cell_t);
     } else {
-      if (!emit_into(expr, ValueDest::Stack))
+      if (!emit_into(expr, ValueDest::Stack)) {
+        heap_usage_ -= call_heap;
         return ValueDest::Error;
+      }
     }
 
     // Make sure emit_into does not cause any spills (or, if it did, that the
@@ -1167,6 +1275,16 @@ SmxCompiler::emitCall(sema::CallExpr* expr, ValueDest dest)
     __ opcode(OP_CALL, fun->impl()->address());
   }
 
+  // The temporaries are dead once the call returns, so free them here rather
+  // than at the end of the statement. Otherwise a call in a loop condition
+  // would grow the heap on every iteration, and a call skipped by || or &&
+  // would have its heap freed anyway. HEAP only clobbers ALT.
+  if (call_heap) {
+    max_heap_usage_ = std::max(heap_usage_, max_heap_usage_);
+    __ opcode(OP_HEAP, -call_heap);
+    heap_usage_ -= call_heap;
+  }
+
   return ValueDest::Pri;
 }
 
@@ -1216,6 +1334,8 @@ SmxCompiler::generateData(ast::VarDecl* decl)
       const BoxedValue& value = expr->value();
       if (value.isInteger()) {
         *reinterpret_cast<int32_t*>(bytes) = (int32_t)value.toInteger().asSigned();
+      } else if (value.isBool()) {
+        *reinterpret_cast<int32_t*>(bytes) = value.toBool() ? 1 : 0;
       } else {
         cc_.report(decl->loc(), rmsg::unimpl_kind) <<
           "smx-gen-data" << "value type";
@@ -1882,6 +2002,16 @@ SmxCompiler::test(sema::Expr* expr, bool jumpOnTrue, Label* taken, Label* fallth
     }
   }
 
+  // Sema folds constant conditions, so the branch is either always or never
+  // taken.
+  if (sema::ConstValueExpr* cv = expr->asConstValueExpr()) {
+    const BoxedValue& box = cv->value();
+    bool truthy = box.isBool() ? box.toBool() : !box.toInteger().isZero();
+    if (truthy == jumpOnTrue)
+      __ opcode(OP_JUMP, taken);
+    return;
+  }
+
   // If we get here, there were no obvious shortcuts to take, so we will
   // simply emit the expression and test if it's zero.
   if (!emit_into(expr, ValueDest::Pri))
@@ -1984,6 +2114,43 @@ SmxCompiler::flatten(sema::BinaryExpr* expr)
 bool
 SmxCompiler::load_both(sema::Expr* left, sema::Expr* right)
 {
+  // Two plain locals or two globals have a fused load.
+  VariableSymbol* left_var = GetLeafVar(left);
+  VariableSymbol* right_var = GetLeafVar(right);
+  if (left_var && right_var &&
+      !left_var->type()->isReference() &&
+      !right_var->type()->isReference())
+  {
+    bool left_global = (left_var->storage() == StorageClass::Global);
+    bool right_global = (right_var->storage() == StorageClass::Global);
+    if (left_global == right_global) {
+      will_kill(ValueDest::Pri);
+      will_kill(ValueDest::Alt);
+      __ opcode(left_global ? OP_LOAD_BOTH : OP_LOAD_S_BOTH,
+                left_var->address(),
+                right_var->address());
+      return true;
+    }
+  }
+
+  // Compute the operand with the larger register need first, so the other
+  // one fits in the remaining register without a spill. This changes the
+  // order of evaluation, so it's only done when the two sides can't observe
+  // each other.
+  if (RegisterNeed(right) > RegisterNeed(left) &&
+      (MaybeConstInt32(left) || (!left->hasSideEffects() && !right->hasSideEffects())))
+  {
+    if (!emit_into(right, ValueDest::Alt))
+      return false;
+
+    uint64_t saved_alt = preserve(ValueDest::Alt);
+    if (!emit_into(left, ValueDest::Pri))
+      return false;
+
+    restore(saved_alt);
+    return true;
+  }
+
   if (!emit_into(left, ValueDest::Pri))
     return false;
 
@@ -2015,6 +2182,26 @@ SmxCompiler::emit_const(ValueDest dest, cell_t value)
   }
 }
 
+bool
+SmxCompiler::emit_const_store(VariableSymbol* sym, sema::Expr* value)
+{
+  Maybe<int32_t> constant = MaybeConstInt32(value);
+  if (!constant || sym->type()->isReference())
+    return false;
+
+  switch (sym->storage()) {
+    case StorageClass::Argument:
+    case StorageClass::Local:
+      __ opcode(OP_CONST_S, sym->address(), *constant);
+      return true;
+    case StorageClass::Global:
+      __ opcode(OP_CONST, sym->address(), *constant);
+      return true;
+    default:
+      return false;
+  }
+}
+
 void
 SmxCompiler::will_kill(ValueDest dest)
 {
@@ -103,6 +103,10 @@ private:
   // Store a constant value. Calls will_kill().
   void emit_const(ValueDest dest, cell_t value);
 
+  // Store a constant directly into a variable, without going through a
+  // register. Returns false if there is no opcode for it.
+  bool emit_const_store(VariableSymbol* sym, sema::Expr* value);
+
   // Helpers for l-values.
   ValueDest emit_var_load(sema::VarExpr* var, ValueDest dest);
   void emit_var_store(VariableSymbol* sym, ValueDest src);
@@ -174,6 +178,7 @@ private:
 
   SmxBuilder builder_;
   RefPtr<SmxNameTable> names_;
+  RefPtr<SmxNameHashSection> name_hash_;
 
   struct FunctionEntry {
     Atom* name;
@@ -200,7 +205,7 @@ private:
   int32_t cur_var_stk_;
   DataLabel entry_stack_op_;
 
-  // Heap usage is reset each statement. We track the max used.
+  // Heap used by call temporaries that are still live. We track the max used.
   int32_t heap_usage_;
   int32_t max_heap_usage_;
 
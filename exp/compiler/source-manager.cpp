@@ -15,88 +15,274 @@
 // 
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include <amtl/am-platform.h>
+#if defined(KE_WINDOWS)
+# include <windows.h>
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <unordered_map>
+
 #include "source-manager.h"
+#include "char-scanner.h"
 #include "compile-context.h"
 #include <stdio.h>
 #include <amtl/am-arithmetic.h>
+#include <amtl/am-mutex.h>
 
 using namespace ke;
 using namespace sp;
 
-class FileReader
+// Identifies one version of a file on disk.
+struct FileStamp
+{
+  uint64_t size;
+  int64_t mtime_ns;
+
+  bool operator ==(const FileStamp& other) const {
+    return size == other.size && mtime_ns == other.mtime_ns;
+  }
+};
+
+// Loads a source file, mapping it if it can. The lexer relies on a NUL just
+// past the last character, which a mapping only has if the file doesn't end
+// on a page boundary, so those files (and any that fail to map) are read.
+class sp::FileLoader
 {
  public:
-  FileReader(ReportingContext& cc, const char* path)
+  FileLoader(ReportingContext& cc, const char* path)
    : cc_(cc),
-     path_(path),
-     fp_(nullptr)
+     path_(path)
   {
-    if ((fp_ = fopen(path, "rb")) == nullptr)
+#if defined(KE_WINDOWS)
+    file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      cc.report(rmsg::file_read_error) << path;
+#else
+    if ((fd_ = ::open(path, O_RDONLY)) == -1)
       cc.report(rmsg::file_read_error) << path;
+#endif
   }
-  ~FileReader() {
-    if (fp_)
-      fclose(fp_);
+  ~FileLoader() {
+#if defined(KE_WINDOWS)
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+#else
+    if (fd_ != -1)
+      close(fd_);
+#endif
   }
 
   bool isValid() const {
-    return !!fp_;
+#if defined(KE_WINDOWS)
+    return file_ != INVALID_HANDLE_VALUE;
+#else
+    return fd_ != -1;
+#endif
   }
 
-  bool read(char** ptr, uint32_t* lengthp) {
-    if (fseek(fp_, 0, SEEK_END) == -1) {
+  bool stamp(FileStamp* out) {
+#if defined(KE_WINDOWS)
+    LARGE_INTEGER size;
+    FILETIME mtime;
+    if (!GetFileSizeEx(file_, &size) || !GetFileTime(file_, nullptr, nullptr, &mtime)) {
       cc_.report(rmsg::file_read_error) << path_;
       return false;
     }
-
-    long size = ftell(fp_);
-    if (size == -1 || fseek(fp_, 0, SEEK_SET) == -1) {
+    out->size = uint64_t(size.QuadPart);
+    out->mtime_ns =
+      int64_t((uint64_t(mtime.dwHighDateTime) << 32) | mtime.dwLowDateTime) * 100;
+#else
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
       cc_.report(rmsg::file_read_error) << path_;
       return false;
     }
+    out->size = uint64_t(st.st_size);
+# if defined(__APPLE__)
+    out->mtime_ns = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+# else
+    out->mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+# endif
+#endif
+    return true;
+  }
 
-    if (size_t(size) > kMaxTotalSourceFileLength) {
+  RefPtr<SourceFile> load(const FileStamp& stamp) {
+    if (stamp.size > kMaxTotalSourceFileLength) {
       cc_.report(rmsg::file_too_large) << path_;
-      return false;
+      return nullptr;
     }
+    uint32_t length = uint32_t(stamp.size);
 
-    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(size + 1);
+    if (length && length % PageSize() != 0) {
+      if (const char* chars = map(length))
+        return new SourceFile(chars, length, length, path_);
+    }
+
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(length + 1);
     if (!buffer) {
       cc_.reportFatal(rmsg::outofmemory);
-      return false;
+      return nullptr;
     }
-
-    if (fread(buffer.get(), 1, size, fp_) != size_t(size)) {
+    if (!read(buffer.get(), length)) {
       cc_.report(rmsg::file_read_error) << path_;
-      return false;
+      return nullptr;
     }
+    return new SourceFile(buffer.release(), length, path_);
+  }
 
-    *ptr = buffer.release();
-    *lengthp = uint32_t(size);
+ private:
+  static size_t PageSize() {
+#if defined(KE_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return size_t(sysconf(_SC_PAGESIZE));
+#endif
+  }
+
+  const char* map(size_t length) {
+#if defined(KE_WINDOWS)
+    HANDLE mapping = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+      return nullptr;
+    // The view keeps the mapping alive.
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, length);
+    CloseHandle(mapping);
+    return reinterpret_cast<const char*>(view);
+#else
+    void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (view == MAP_FAILED)
+      return nullptr;
+    return reinterpret_cast<const char*>(view);
+#endif
+  }
+
+  bool read(char* buffer, uint32_t length) {
+    uint32_t done = 0;
+    while (done < length) {
+#if defined(KE_WINDOWS)
+      DWORD got;
+      if (!ReadFile(file_, buffer + done, length - done, &got, nullptr) || !got)
+        return false;
+#else
+      ssize_t got = ::read(fd_, buffer + done, length - done);
+      if (got == -1 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return false;
+#endif
+      done += uint32_t(got);
+    }
     return true;
   }
 
  private:
   ReportingContext& cc_;
   const char* path_;
-  FILE* fp_;
+#if defined(KE_WINDOWS)
+  HANDLE file_;
+#else
+  int fd_;
+#endif
+};
+
+// Every file read from disk by any SourceManager in this process, by path.
+// An entry is reused only while the file has the size and modification
+// time it had when it was loaded.
+class SharedSourceFiles
+{
+ public:
+  static SharedSourceFiles* Get() {
+    static SharedSourceFiles files;
+    return &files;
+  }
+
+  RefPtr<SourceFile> find(const std::string& path, const FileStamp& stamp) {
+    std::lock_guard<ke::Mutex> lock(mutex_);
+    auto iter = files_.find(path);
+    if (iter == files_.end() || !(iter->second.stamp == stamp))
+      return nullptr;
+    return iter->second.file;
+  }
+
+  // Returns the file already added for this path and stamp, if another
+  // thread got there first.
+  RefPtr<SourceFile> add(const std::string& path, const FileStamp& stamp,
+                         const RefPtr<SourceFile>& file)
+  {
+    std::lock_guard<ke::Mutex> lock(mutex_);
+    Entry& entry = files_[path];
+    if (entry.file && entry.stamp == stamp)
+      return entry.file;
+    entry.stamp = stamp;
+    entry.file = file;
+    return file;
+  }
+
+ private:
+  struct Entry {
+    FileStamp stamp;
+    RefPtr<SourceFile> file;
+  };
+
+  ke::Mutex mutex_;
+  std::unordered_map<std::string, Entry> files_;
 };
 
+SourceFile::SourceFile(char* chars, uint32_t length, const char* path)
+ : chars_(chars),
+   owned_chars_(chars),
+   mapped_length_(0),
+   length_(length),
+   path_(path)
+{
+}
+
+SourceFile::SourceFile(const char* chars, uint32_t length, size_t mapped_length,
+                       const char* path)
+ : chars_(chars),
+   mapped_length_(mapped_length),
+   length_(length),
+   path_(path)
+{
+}
+
+SourceFile::~SourceFile()
+{
+  if (!mapped_length_)
+    return;
+#if defined(KE_WINDOWS)
+  UnmapViewOfFile(chars_);
+#else
+  munmap(const_cast<char*>(chars_), mapped_length_);
+#endif
+}
+
 void
 SourceFile::computeLineCache()
 {
   std::vector<uint32_t> lines;
 
+  const char* begin = chars_;
+  const char* end = begin + length_;
+
   lines.push_back(0);
-  for (uint32_t i = 0; i < length_; i++) {
-    if (chars_[i] == '\r' || chars_[i] == '\n') {
-      if (chars_[i] == '\r') {
-        // Detect \r\n.
-        if (i + 1 < length_ && chars_[i + 1] == '\n')
-          i++;
-      }
-      lines.push_back(i + 1);
-    }
+  for (const char* p = ScanToNewline(begin, end); p < end; p = ScanToNewline(p, end)) {
+    // Detect \r\n.
+    if (*p == '\r' && p + 1 < end && p[1] == '\n')
+      p++;
+    p++;
+    lines.push_back(uint32_t(p - begin));
   }
 
   line_cache_ = std::make_unique<LineExtents>(lines.size());
@@ -112,7 +298,9 @@ SourceManager::SourceManager(StringPool& strings, ReportManager& reports)
  : strings_(strings),
    rr_(reports),
    next_source_id_(1),
-   last_lookup_(0)
+   last_lookup_(0),
+   last_line_file_(nullptr),
+   last_line_(0)
 {
   reports.setSourceManager(this);
 }
@@ -125,21 +313,21 @@ SourceManager::open(ReportingContext& cc, const char* path)
   if (p.found())
     return p->value;
 
-  FileReader reader(cc, path);
-  if (!reader.isValid())
+  FileLoader loader(cc, path);
+  FileStamp stamp;
+  if (!loader.isValid() || !loader.stamp(&stamp))
     return nullptr;
 
-  uint32_t length;
-  std::unique_ptr<char[]> chars;
-  {
-    char* ptr;
-    if (!reader.read(&ptr, &length))
+  SharedSourceFiles* shared = SharedSourceFiles::Get();
+  RefPtr<SourceFile> file = shared->find(path, stamp);
+  if (!file) {
+    if ((file = loader.load(stamp)) == nullptr)
       return nullptr;
-    chars.reset(ptr);
+    file = shared->add(path, stamp, file);
   }
 
-  RefPtr<SourceFile> file = new SourceFile(chars.release(), length, path);
   file_cache_.add(p, atom, file);
+  opened_files_.push_back(file);
   return file;
 }
 
@@ -177,6 +365,7 @@ SourceManager::trackExtents(uint32_t length, size_t* index)
   LREntry tracker;
   tracker.id = next_source_id_;
   locations_.push_back(tracker);
+  range_ids_.push_back(tracker.id);
 
   next_source_id_ = next_source_id;
   return true;
@@ -214,40 +403,33 @@ SourceManager::findLocation(const SourceLocation& loc, size_t* aIndex)
   if (!loc.isSet())
     return false;
 
-  if (last_lookup_ < locations_.size() && locations_[last_lookup_].owns(loc)) {
+  uint32_t offset = loc.offset();
+  if (last_lookup_ < range_ids_.size() &&
+      offset >= range_ids_[last_lookup_] &&
+      (last_lookup_ + 1 == range_ids_.size() || offset < range_ids_[last_lookup_ + 1]))
+  {
     *aIndex = last_lookup_;
     return true;
   }
 
   // We should not allocate ids >= the next id.
-  assert(loc.offset() < next_source_id_);
+  assert(offset < next_source_id_);
 
-  // Binary search.
-  size_t lower = 0;
-  size_t upper = locations_.size();
-  while (lower < upper) {
-    size_t index = (lower + upper) / 2;
+  auto iter = std::upper_bound(range_ids_.begin(), range_ids_.end(), offset);
+  if (iter == range_ids_.begin()) {
+    // What happened?
+    assert(false);
+    return false;
+  }
 
-    LREntry& range = locations_[index];
-    if (loc.offset() < range.id) {
-      upper = index;
-    } else if (loc.offset() > range.id + range.length() + 1) {
-      // Note +1 for the terminal offset.
-      lower = index + 1;
-    } else {
-      assert(range.owns(loc));
+  size_t index = (iter - range_ids_.begin()) - 1;
+  assert(locations_[index].owns(loc));
 
-      // Update cache.
-      last_lookup_ = index;
+  // Update cache.
+  last_lookup_ = uint32_t(index);
 
-      *aIndex = index;
-      return true;
-    }
-  }
-
-  // What happened?
-  assert(false);
-  return false;
+  *aIndex = index;
+  return true;
 }
 
 SourceLocation
@@ -292,18 +474,28 @@ SourceManager::getLine(const LREntry& range, const SourceLocation& loc)
 {
   SourceFile* file = range.getFile();
 
-  // Note: we don't OOM check this, since we don't oom check anything.
-  if (!file->lineCache())
-    file->computeLineCache();
-
   uint32_t pos = loc.offset() - range.id;
   assert(pos <= file->length());
 
   // If the position is at end-of-file, return the last line number.
+  // Note: we don't OOM check this, since we don't oom check anything.
   LineExtents* lines = file->lineCache();
   if (pos == file->length())
     return lines->length();
 
+  // The range of each line should be [start, end).
+  auto end_of_line = [&](uint32_t index) -> uint32_t {
+    return index < lines->length() - 1 ? lines->at(index + 1) : file->length();
+  };
+  if (file == last_line_file_ && last_line_ < lines->length() &&
+      pos >= lines->at(last_line_))
+  {
+    if (pos < end_of_line(last_line_))
+      return last_line_ + 1;
+    if (last_line_ + 1 < lines->length() && pos < end_of_line(last_line_ + 1))
+      return ++last_line_ + 1;
+  }
+
   uint32_t lower = 0;
   uint32_t upper = lines->length();
   while (lower < upper) {
@@ -315,10 +507,7 @@ SourceManager::getLine(const LREntry& range, const SourceLocation& loc)
       continue;
     }
 
-    // The range should be (start, end].
-    uint32_t line_end = (index < lines->length() - 1)
-                        ? lines->at(index + 1)
-                        : file->length();
+    uint32_t line_end = end_of_line(index);
     if (pos >= line_end) {
       lower = index + 1;
       continue;
@@ -327,6 +516,8 @@ SourceManager::getLine(const LREntry& range, const SourceLocation& loc)
     // Either the id is the first character of a line, or before the first
     // character of the next line, or it should be the terminal offset.
     assert(pos >= line_start && pos < line_end);
+    last_line_file_ = file;
+    last_line_ = index;
     return index + 1;
   }
 
@@ -19,6 +19,7 @@
 #define _include_spcomp_source_cache_h_
 
 #include <memory>
+#include <mutex>
 
 #include <amtl/am-string.h>
 #include <amtl/am-refcounting.h>
@@ -32,6 +33,7 @@ namespace sp {
 using namespace ke;
 
 struct ReportingContext;
+class FileLoader;
 class ReportManager;
 class SourceFile;
 
@@ -43,19 +45,27 @@ static const size_t kMaxTotalSourceFileLength = (INT_MAX / 4) - 1;
 
 typedef FixedArray<uint32_t> LineExtents;
 
-class SourceFile : public Refcounted<SourceFile>
+// The contents of a source file. Files read from disk are shared by every
+// SourceManager in the process (see SourceManager::open), so a SourceFile
+// must not change once created, except for its line cache.
+class SourceFile : public RefcountedThreadsafe<SourceFile>
 {
   friend class SourceManager;
+  friend class FileLoader;
 
-  SourceFile(char* chars, uint32_t length, const char* path)
-   : chars_(chars),
-     length_(length),
-     path_(path)
-  {}
+  // Takes ownership of |chars|, which must have room for a NUL after the
+  // last character.
+  SourceFile(char* chars, uint32_t length, const char* path);
+
+  // |chars| is a read-only mapping of |mapped_length| bytes, with at least
+  // one zeroed byte after the last character.
+  SourceFile(const char* chars, uint32_t length, size_t mapped_length, const char* path);
 
  public:
+  ~SourceFile();
+
   const char* chars() const {
-    return chars_.get();
+    return chars_;
   }
   uint32_t length() const {
     return length_;
@@ -64,14 +74,24 @@ class SourceFile : public Refcounted<SourceFile>
     return path_.c_str();
   }
 
+  // The offset of each line, computed on first use; null if that ran out
+  // of memory. Safe to call from any thread.
   LineExtents* lineCache() {
+    std::call_once(line_cache_once_, [this]() -> void {
+      computeLineCache();
+    });
     return line_cache_.get();
   }
+
+ private:
   void computeLineCache();
 
  protected:
-  std::unique_ptr<char[]> chars_;
+  const char* chars_;
+  std::unique_ptr<char[]> owned_chars_;
+  size_t mapped_length_;
   uint32_t length_;
+  std::once_flag line_cache_once_;
   std::unique_ptr<LineExtents> line_cache_;
   std::string path_;
 };
@@ -212,10 +232,18 @@ class SourceManager
  public:
   SourceManager(StringPool& strings, ReportManager& reports);
 
+  // Files are mapped into memory when possible, and are shared with every
+  // other SourceManager in the process for as long as their size and
+  // modification time don't change.
   RefPtr<SourceFile> open(ReportingContext& cc, const char* path);
 
   RefPtr<SourceFile> createFromBuffer(std::unique_ptr<char[]>&& buffer, uint32_t length, const char* path);
 
+  // Every file read from disk by open(), in the order first opened.
+  const std::vector<RefPtr<SourceFile>>& openedFiles() const {
+    return opened_files_;
+  }
+
   // Returns whether two source locations ultimately originate from the same
   // file (i.e., ignoring macros).
   bool sameFiles(const SourceLocation& a, const SourceLocation& b);
@@ -275,15 +303,26 @@ class SourceManager
   StringPool& strings_;
   ReportManager& rr_;
   AtomMap<RefPtr<SourceFile>> file_cache_;
+  std::vector<RefPtr<SourceFile>> opened_files_;
   std::vector<LREntry> locations_;
 
+  // The id of each entry in locations_. Ranges are allocated back to back,
+  // so a location belongs to the last range starting at or before it, and
+  // lookups can bisect this dense array without touching the entries.
+  std::vector<uint32_t> range_ids_;
+
   // Source ids start from 1. The source file id is 1 + len(source) + 1. This
   // lets us store source locations as a single integer, as we can always
   // bisect to a particular file, and from there, to a line number and column.
   uint32_t next_source_id_;
 
-  // One-entry caches. This one is for getSource().
+  // One-entry caches. This one is for findLocation().
   uint32_t last_lookup_;
+
+  // And this one is for getLine(), since diagnostics and token histories
+  // tend to ask about the same or the next line again.
+  SourceFile* last_line_file_;
+  uint32_t last_line_;
 };
 
 }
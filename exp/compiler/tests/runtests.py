@@ -1,7 +1,8 @@
 # vim: set ts=4 sw=4 tw=99 et:
-import os, sys
+import os, re, sys
 import argparse
 import subprocess
+import tempfile
 
 def get_tests(tests, relroot, absroot):
     for filename in os.listdir(absroot):
@@ -14,6 +15,34 @@ def get_tests(tests, relroot, absroot):
             if ext == '.sp':
                 tests += [base]
 
+def run_one(args, path):
+    argv = [os.path.abspath(args.spcomp), path]
+    p = subprocess.Popen(argv, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    stdout, stderr = p.communicate()
+    return p.returncode, stdout.decode('utf-8'), stderr.decode('utf-8')
+
+# Compiles every test in one spcomp2 process. Output of both streams is
+# merged, and split per file on the result line printed after each one.
+def run_batch(args, paths):
+    fd, list_path = tempfile.mkstemp(suffix='.txt')
+    try:
+        with os.fdopen(fd, 'w') as fp:
+            for path in paths:
+                fp.write(path + '\n')
+        argv = [os.path.abspath(args.spcomp), '--batch', list_path]
+        p = subprocess.Popen(argv, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        output, _ = p.communicate()
+    finally:
+        os.unlink(list_path)
+
+    results = {}
+    start = 0
+    for match in re.finditer(r'^-- batch: (-?\d+) (.*) --$', output.decode('utf-8'), re.M):
+        text = match.string[start:match.start()]
+        results[match.group(2)] = (int(match.group(1)), '', text)
+        start = match.end()
+    return results
+
 def run_tests(args):
     testdir = os.path.dirname(os.path.abspath(__file__))
     tests = []
@@ -21,6 +50,9 @@ def run_tests(args):
 
     failed = False
 
+    if args.batch:
+        batch = run_batch(args, [os.path.join(testdir, test + '.sp') for test in tests])
+
     for test in tests:
         test_type = os.path.split(os.path.dirname(test))[-1]
         test_name = os.path.basename(test)
@@ -32,11 +64,11 @@ def run_tests(args):
             kind = 'pass'
 
         try:
-            argv = [os.path.abspath(args.spcomp), os.path.join(testdir, test + '.sp')]
-            p = subprocess.Popen(argv, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
-            stdout, stderr = p.communicate()
-            stdout = stdout.decode('utf-8')
-            stderr = stderr.decode('utf-8')
+            path = os.path.join(testdir, test + '.sp')
+            if args.batch:
+                returncode, stdout, stderr = batch.get(path, (-1, '', 'no result\n'))
+            else:
+                returncode, stdout, stderr = run_one(args, path)
 
             if test_type == 'runtime':
                 smx_path = test + '.smx'
@@ -44,7 +76,7 @@ def run_tests(args):
                 if compiled:
                     os.unlink(smx_path)
             else:
-                compiled = p.returncode == 0
+                compiled = returncode == 0
 
             status = 'ok'
             if compiled and kind == 'fail':
@@ -67,7 +99,7 @@ def run_tests(args):
                         break
             
             if status == 'fail' or len(fails):
-                print('Test {0} ... FAIL, exit code {1}'.format(test, p.returncode))
+                print('Test {0} ... FAIL, exit code {1}'.format(test, returncode))
                 failed = True
                 sys.stderr.write('FAILED! Dumping stdout/stderr:\n')
                 sys.stderr.write(stdout)
@@ -88,6 +120,8 @@ def run_tests(args):
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument('spcomp', type=str, help='Path to spcomp')
+    parser.add_argument('--batch', action='store_true', default=False,
+                        help='Compile every test in one spcomp2 process.')
     args = parser.parse_args()
     run_tests(args)
 
@@ -74,43 +74,51 @@ TypeManager::initialize()
   primitiveTypes_[size_t(PrimitiveType::Char)] = Type::NewPrimitive(PrimitiveType::Char);
   primitiveTypes_[size_t(PrimitiveType::Bool)] = Type::NewPrimitive(PrimitiveType::Bool);
 
+  if (!reftype_cache_.init(16))
+    return false;
+  if (!array_cache_.init(64))
+    return false;
+  if (!qualified_cache_.init(16))
+    return false;
+
   // We special case the following types, because they are extremely common:
   //   char[]
   //   const char[]
   //   float[3]
   //   const float[3]
+  //
+  // They are interned like any other array, but const-qualifying the plain
+  // forms must find the const-element forms below.
   char_type_ = getPrimitive(PrimitiveType::Char);
-  char_array_ = ArrayType::New(char_type_, ArrayType::kUnsized);
+  char_array_ = newArray(char_type_, ArrayType::kUnsized);
   const_char_array_ =
-    ArrayType::New(Type::NewQualified(char_type_, Qualifiers::Const),
-                   ArrayType::kUnsized);
+    newArray(newQualified(char_type_, Qualifiers::Const), ArrayType::kUnsized);
 
   float_type_ = getPrimitive(PrimitiveType::Float);
-  float3_array_ = ArrayType::New(float_type_, 3);
+  float3_array_ = newArray(float_type_, 3);
   const_float3_array_ =
-    ArrayType::New(Type::NewQualified(float_type_, Qualifiers::Const),
-                   3);
+    newArray(newQualified(float_type_, Qualifiers::Const), 3);
+  if (!char_array_ || !const_char_array_ || !float3_array_ || !const_float3_array_)
+    return false;
 
   variadic_any_ = VariadicType::New(uncheckedType_);
 
-  if (!reftype_cache_.init(16))
-    return false;
-
   return true;
 }
 
 ArrayType*
 TypeManager::newArray(Type* contained, int elements)
 {
-  if (contained == char_type_) {
-    if (elements == ArrayType::kUnsized)
-      return char_array_;
-  } else if (contained == float_type_) {
-    if (elements == 3)
-      return float3_array_;
-  }
+  std::lock_guard<ke::Mutex> lock(cache_lock_);
+  ArrayKey key = {contained, elements};
+  ArrayTypeCache::Insert p = array_cache_.findForAdd(key);
+  if (p.found())
+    return p->value;
 
-  return ArrayType::New(contained, elements);
+  ArrayType* array = ArrayType::New(contained, elements);
+  if (!array_cache_.add(p, key, array))
+    return nullptr;
+  return array;
 }
 
 EnumType*
@@ -137,7 +145,16 @@ TypeManager::newQualified(Type* type, Qualifiers qualifiers)
     type = type->unqualified();
   }
 
-  return Type::NewQualified(type, qualifiers);
+  std::lock_guard<ke::Mutex> lock(cache_lock_);
+  QualifiedKey key = {type, qualifiers};
+  QualifiedTypeCache::Insert p = qualified_cache_.findForAdd(key);
+  if (p.found())
+    return p->value;
+
+  Type* qual = Type::NewQualified(type, qualifiers);
+  if (!qualified_cache_.add(p, key, qual))
+    return nullptr;
+  return qual;
 }
 
 TypesetType*
@@ -155,18 +172,21 @@ TypeManager::newStruct(ast::RecordDecl* decl)
 TypedefType*
 TypeManager::newTypedef(Atom* name)
 {
-  return TypedefType::New(name);
+  TypedefType* tdef = TypedefType::New(name);
+  typedefs_.push_back(tdef);
+  return tdef;
 }
 
 ReferenceType*
 TypeManager::newReference(Type* type)
 {
+  std::lock_guard<ke::Mutex> lock(cache_lock_);
   RefTypeCache::Insert p = reftype_cache_.findForAdd(type);
   if (p.found())
     return p->value;
 
   ReferenceType* ref = ReferenceType::New(type);
-  if (!reftype_cache_.add(p, ref))
+  if (!reftype_cache_.add(p, type, ref))
     return nullptr;
   return ref;
 }
@@ -185,6 +205,15 @@ TypeManager::newVariadic(Type* inner)
   return VariadicType::New(inner);
 }
 
+void
+TypeManager::normalizeWrappedTypes()
+{
+  for (TypedefType* tdef : typedefs_)
+    tdef->canonical();
+  for (QualifiedTypeCache::iterator iter = qualified_cache_.iter(); !iter.empty(); iter.next())
+    iter->value->canonical();
+}
+
 Type*
 TypeManager::typeForLabelAtom(Atom* atom)
 {
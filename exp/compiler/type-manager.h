@@ -19,9 +19,13 @@
 #ifndef _include_jitcraft_type_manager_h_
 #define _include_jitcraft_type_manager_h_
 
+#include <mutex>
+#include <vector>
+
 #include "shared/string-pool.h"
 #include "types.h"
 #include <amtl/am-hashmap.h>
+#include <amtl/am-mutex.h>
 
 namespace sp {
 
@@ -75,6 +79,11 @@ class TypeManager
 
   Type* typeForLabelAtom(Atom* atom);
 
+  // Typedefs and qualifiers collapse their chains the first time they are
+  // looked through, which writes to the type. This does that for every such
+  // type up front, so that threads can then share them read-only.
+  void normalizeWrappedTypes();
+
   Type* getImplicitInt() {
     return primitiveTypes_[int(PrimitiveType::ImplicitIntDoNotUseDirectly)];
   }
@@ -109,6 +118,44 @@ class TypeManager
                       ReferenceType*,
                       ke::PointerPolicy<Type>> RefTypeCache;
   RefTypeCache reftype_cache_;
+
+  // Array and qualified types are interned by their parts, so that two
+  // spellings of the same type are one object and compare by pointer.
+  struct ArrayKey {
+    Type* contained;
+    int elements;
+  };
+  struct ArrayKeyPolicy {
+    static uint32_t hash(const ArrayKey& key) {
+      return ke::HashPointer(key.contained) * 31 + ke::HashInt32(key.elements);
+    }
+    static bool matches(const ArrayKey& key, const ArrayKey& other) {
+      return key.contained == other.contained && key.elements == other.elements;
+    }
+  };
+  typedef ke::HashMap<ArrayKey, ArrayType*, ArrayKeyPolicy> ArrayTypeCache;
+  ArrayTypeCache array_cache_;
+
+  struct QualifiedKey {
+    Type* type;
+    Qualifiers qualifiers;
+  };
+  struct QualifiedKeyPolicy {
+    static uint32_t hash(const QualifiedKey& key) {
+      return ke::HashPointer(key.type) * 31 + uint32_t(key.qualifiers);
+    }
+    static bool matches(const QualifiedKey& key, const QualifiedKey& other) {
+      return key.type == other.type && key.qualifiers == other.qualifiers;
+    }
+  };
+  typedef ke::HashMap<QualifiedKey, Type*, QualifiedKeyPolicy> QualifiedTypeCache;
+  QualifiedTypeCache qualified_cache_;
+
+  std::vector<TypedefType*> typedefs_;
+
+  // Function bodies may be analysed on several threads, all of which can
+  // create types through the caches above.
+  ke::Mutex cache_lock_;
 };
 
 }
@@ -622,6 +622,13 @@ sp::AreTypesEquivalent(Type* a, Type* b, Qualifiers context)
         Qualifiers qb = (innerB->qualifiers() | context);
         if (qa != qb)
           return false;
+
+        // Array types are interned, so the same inner type is equivalent
+        // however deeply it nests.
+        aa = innerA->toArray();
+        ba = innerB->toArray();
+        if (aa == ba)
+          break;
       }
       return true;
     }
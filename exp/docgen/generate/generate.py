@@ -5,6 +5,7 @@ import yaml
 import locale
 import pymysql
 import argparse
+import tempfile
 import subprocess
 import json as JSON
 
@@ -181,19 +182,32 @@ class DocGen(object):
     self.current_class = None
 
   def generate(self):
-    for include in os.listdir(self.config['includes']):
+    includes = []
+    for include in sorted(os.listdir(self.config['includes'])):
       if not include.endswith('.inc'):
         continue
-      include = include[:len(include) - 4]
+      includes.append(include[:len(include) - 4])
 
-      self.parse_include(include)
+    # Every include is documented by one docparse run, in parallel.
+    paths = [os.path.join(self.config['includes'], include + '.inc') for include in includes]
+    with tempfile.NamedTemporaryFile('w', suffix = '.txt', delete = False) as fp:
+      fp.write('\n'.join(paths) + '\n')
+      listfile = fp.name
+    try:
+      docs = self.run_parser(listfile)
+    finally:
+      os.unlink(listfile)
+
+    for include, entry in zip(includes, docs):
+      self.parse_include(include, entry['file'], entry['doc'])
 
     self.db.commit()
 
-  def parse_include(self, include):
+  def run_parser(self, listfile):
     argv = [
       self.config['parser'],
-      os.path.join(self.config['includes'], include + '.inc'),
+      '--batch',
+      listfile,
     ]
     p = subprocess.Popen(
       args = argv,
@@ -203,18 +217,19 @@ class DocGen(object):
     stdout = DecodeConsoleText(sys.stdout, stdoutData).strip()
     stderr = DecodeConsoleText(sys.stderr, stderrData).strip()
     if p.returncode != 0:
-      print('Failed to process {0}:'.format(argv[1]))
+      print('Failed to process includes:')
       print(stderr)
       raise Exception('failed to parse file')
 
     if len(stderr) > 0:
-      print('Notes for {0}:'.format(argv[1]))
+      print('Notes:')
       print(stderr)
 
-    with open(argv[1], 'rb') as fp:
-      self.current_file = fp.read()
+    return JSON.loads(stdout)
 
-    json = JSON.loads(stdout)
+  def parse_include(self, include, path, json):
+    with open(path, 'rb') as fp:
+      self.current_file = fp.read()
 
     query = """
       insert into spdoc_include
@@ -24,6 +24,18 @@
 #include "compiler/parser/json-tools.h"
 #include "compiler/sema/name-resolver.h"
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <amtl/am-thread.h>
 #include <amtl/experimental/am-argparser.h>
 
 using namespace ke;
@@ -139,206 +151,279 @@ class Comments : public CommentDelegate
 
 class Analyzer : public PartialAstVisitor
 {
+  // Declarations are grouped by kind, so the tree is walked once for each
+  // group and only that group's declarations are written.
+  enum class Section {
+    Functions,
+    Methodmaps,
+    Enums,
+    Constants,
+    Typesets,
+    Typedefs
+  };
+  enum class Member {
+    Methods,
+    Properties
+  };
+
  public:
-  Analyzer(CompileContext &cc, Comments &comments)
+  Analyzer(CompileContext &cc, Comments &comments, JsonWriter &out)
    : cc_(cc),
-     pool_(cc.pool()),
-     comments_(comments)
+     comments_(comments),
+     out_(out),
+     section_(Section::Functions),
+     member_(Member::Methods)
   {
-    atom_name_ = cc_.add("name");
-    atom_kind_ = cc_.add("kind");
-    atom_returnType_ = cc_.add("returnType");
-    atom_type_ = cc_.add("type");
-    atom_parameters_ = cc_.add("arguments");
-    atom_doc_start_ = cc_.add("docStart");
-    atom_doc_end_ = cc_.add("docEnd");
-    atom_properties_ = cc_.add("properties");
-    atom_methods_ = cc_.add("methods");
-    atom_getter_ = cc_.add("getter");
-    atom_setter_ = cc_.add("setter");
-    atom_entries_ = cc_.add("entries");
-    atom_constants_ = cc_.add("constants");
-    atom_decl_ = cc_.add("decl");
-    atom_parent_ = cc_.add("parent");
-  }
-
-  JsonObject *analyze(ParseTree *tree) {
-    functions_ = new (pool_) JsonList();
-    methodmaps_ = new (pool_) JsonList();
-    enums_ = new (pool_) JsonList();
-    constants_ = new (pool_) JsonList();
-    typesets_ = new (pool_) JsonList();
-    typedefs_ = new (pool_) JsonList();
-
-    for (size_t i = 0; i < tree->statements()->size(); i++) {
-      Statement *stmt = tree->statements()->at(i);
-      stmt->accept(this);
-    }
+  }
 
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(cc_.add("functions"), functions_);
-    obj->add(cc_.add("methodmaps"), methodmaps_);
-    obj->add(cc_.add("enums"), enums_);
-    obj->add(cc_.add("constants"), constants_);
-    obj->add(cc_.add("typesets"), typesets_);
-    obj->add(cc_.add("typedefs"), typedefs_);
-    return obj;
+  void analyze(ParseTree *tree) {
+    static const struct {
+      Section section;
+      const char *name;
+    } kSections[] = {
+      { Section::Functions, "functions" },
+      { Section::Methodmaps, "methodmaps" },
+      { Section::Enums, "enums" },
+      { Section::Constants, "constants" },
+      { Section::Typesets, "typesets" },
+      { Section::Typedefs, "typedefs" },
+    };
+
+    out_.beginObject();
+    for (const auto &entry : kSections) {
+      section_ = entry.section;
+      out_.key(entry.name);
+      out_.beginList();
+      for (size_t i = 0; i < tree->statements()->size(); i++) {
+        Statement *stmt = tree->statements()->at(i);
+        stmt->accept(this);
+      }
+      out_.endList();
+    }
+    out_.endObject();
   }
 
   void visitMethodmapDecl(MethodmapDecl *node) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(node->name()));
-    startDoc(obj, "class", node->name(), node->loc());
+    if (section_ != Section::Methodmaps)
+      return;
 
-    if (node->parent())
-      obj->add(atom_parent_, new (pool_) JsonString(node->parent()->name()));
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(node->name());
+    startDoc("class", node->name(), node->loc());
 
-    SaveAndSet<JsonList *> new_props(&props_, new (pool_) JsonList());
-    SaveAndSet<JsonList *> new_methods(&methods_, new (pool_) JsonList());
-    for (size_t i = 0; i < node->body()->size(); i++)
-      node->body()->at(i)->accept(this);
-
-    obj->add(atom_methods_, methods_);
-    obj->add(atom_properties_, props_);
+    if (node->parent()) {
+      out_.key("parent");
+      out_.writeString(node->parent()->name());
+    }
 
-    methodmaps_->add(obj);
+    out_.key("methods");
+    writeMembers(node, Member::Methods);
+    out_.key("properties");
+    writeMembers(node, Member::Properties);
+    out_.endObject();
   }
 
   void visitMethodDecl(MethodDecl *node) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(node->name()));
-    startDoc(obj, "method", node->name(), node->loc());
+    if (member_ != Member::Methods)
+      return;
+
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(node->name());
+    startDoc("method", node->name(), node->loc());
 
     FunctionNode *fun = node->method();
-    if (fun->signature()->native())
-        obj->add(atom_kind_, toJson("native"));
-    else
-        obj->add(atom_kind_, toJson("stock"));
-    obj->add(atom_returnType_, toJson(fun->signature()->returnType()));
-    obj->add(atom_parameters_, toJson(fun->signature()->parameters()));
-    methods_->add(obj);
+    out_.key("kind");
+    out_.writeString(fun->signature()->native() ? "native" : "stock");
+    out_.key("returnType");
+    out_.writeString(typeName(fun->signature()->returnType()));
+    out_.key("arguments");
+    writeParameters(fun->signature()->parameters());
+    out_.endObject();
   }
   void visitPropertyDecl(PropertyDecl *node) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(node->name()));
-    startDoc(obj, "property", node->name(), node->loc());
+    if (member_ != Member::Properties)
+      return;
 
-    obj->add(atom_type_, toJson(node->te()));
-    obj->add(atom_getter_, new (pool_) JsonBool(!!node->getter()));
-    obj->add(atom_setter_, new (pool_) JsonBool(!!node->setter()));
-    props_->add(obj);
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(node->name());
+    startDoc("property", node->name(), node->loc());
+
+    out_.key("type");
+    out_.writeString(typeName(node->te()));
+    out_.key("getter");
+    out_.writeBool(!!node->getter());
+    out_.key("setter");
+    out_.writeBool(!!node->setter());
+    out_.endObject();
   }
 
   void visitTypesetDecl(TypesetDecl *decl) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(decl->name()));
-    startDoc(obj, "typeset", decl->name(), decl->loc());
+    if (section_ != Section::Typesets)
+      return;
 
-    JsonList *list = new (pool_) JsonList();
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(decl->name());
+    startDoc("typeset", decl->name(), decl->loc());
+
+    out_.key("types");
+    out_.beginList();
     for (size_t i = 0; i < decl->types()->size(); i++) {
       const TypesetDecl::Entry &entry = decl->types()->at(i);
-      JsonObject *te = new (pool_) JsonObject();
-      te->add(atom_type_, toJson(entry.te));
+      out_.beginObject();
+      out_.key("type");
+      out_.writeString(typeName(entry.te));
       unsigned start, end;
-      if (comments_.findCommentFor(entry.loc, &start, &end)) {
-        te->add(atom_doc_start_, new (pool_) JsonInt(start));
-        te->add(atom_doc_end_, new (pool_) JsonInt(end));
-      }
-      list->add(te);
+      if (comments_.findCommentFor(entry.loc, &start, &end))
+        writeDocRange(start, end);
+      out_.endObject();
     }
-    obj->add(cc_.add("types"), list);
-
-    typesets_->add(obj);
+    out_.endList();
+    out_.endObject();
   }
 
   void visitTypedefDecl(TypedefDecl *decl) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(decl->name()));
-    startDoc(obj, "typedef", decl->name(), decl->loc());
+    if (section_ != Section::Typedefs)
+      return;
 
-    obj->add(atom_type_, toJson(decl->te()));
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(decl->name());
+    startDoc("typedef", decl->name(), decl->loc());
 
-    typedefs_->add(obj);
+    out_.key("type");
+    out_.writeString(typeName(decl->te()));
+    out_.endObject();
   }
 
   void visitEnumStatement(EnumStatement *node) override {
+    // Anonymous enums only define constants.
     if (!node->name()) {
-      for (size_t i = 0; i < node->entries()->size(); i++) {
-        EnumConstant *cs = node->entries()->at(i);
-
-        JsonObject *val = new (pool_) JsonObject();
-        val->add(atom_name_, toJson(cs->name()));
-        startDoc(val, "enum value", cs->name(), cs->loc());
-
-        constants_->add(val);
-      }
+      if (section_ == Section::Constants)
+        writeEnumValues(node);
       return;
     }
+    if (section_ != Section::Enums)
+      return;
 
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(node->name()));
-    startDoc(obj, "enum", node->name(), node->loc());
-
-    JsonList *list = new (pool_) JsonList();
-    for (size_t i = 0; i < node->entries()->size(); i++) {
-      EnumConstant *cs = node->entries()->at(i);
-
-      JsonObject *val = new (pool_) JsonObject();
-      val->add(atom_name_, toJson(cs->name()));
-      startDoc(val, "enum value", cs->name(), cs->loc());
-
-      list->add(val);
-    }
-    obj->add(atom_entries_, list);
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(node->name());
+    startDoc("enum", node->name(), node->loc());
 
-    enums_->add(obj);
+    out_.key("entries");
+    out_.beginList();
+    writeEnumValues(node);
+    out_.endList();
+    out_.endObject();
   }
 
   void visitFunctionStatement(FunctionStatement *node) override {
-    JsonObject *obj = new (pool_) JsonObject();
-    obj->add(atom_name_, toJson(node->name()));
-    startDoc(obj, "function", node->name(), node->loc());
+    if (section_ != Section::Functions)
+      return;
+
+    out_.beginObject();
+    out_.key("name");
+    out_.writeString(node->name());
+    startDoc("function", node->name(), node->loc());
 
+    out_.key("kind");
     if (node->token() == TOK_FORWARD)
-      obj->add(atom_kind_, toJson("forward"));
+      out_.writeString("forward");
     else if (node->token() == TOK_NATIVE)
-      obj->add(atom_kind_, toJson("native"));
+      out_.writeString("native");
     else
-      obj->add(atom_kind_, toJson("stock"));
+      out_.writeString("stock");
 
-    obj->add(atom_returnType_, toJson(node->signature()->returnType()));
-    obj->add(atom_parameters_, toJson(node->signature()->parameters()));
-
-    functions_->add(obj);
+    out_.key("returnType");
+    out_.writeString(typeName(node->signature()->returnType()));
+    out_.key("arguments");
+    writeParameters(node->signature()->parameters());
+    out_.endObject();
   }
 
  private:
-  void startDoc(JsonObject *obj, const char *type, Atom *name, const SourceLocation &loc) {
+  void startDoc(const char *type, Atom *name, const SourceLocation &loc) {
     unsigned start, end;
     if (!comments_.findCommentFor(loc, &start, &end)) {
       cc_.report(loc, rmsg::missing_comment)
         << type << name;
       return;
     }
+    writeDocRange(start, end);
+  }
 
+  void writeDocRange(unsigned start, unsigned end) {
     assert(start < INT_MAX);
     assert(end < INT_MAX);
 
-    obj->add(atom_doc_start_, new (pool_) JsonInt(start));
-    obj->add(atom_doc_end_, new (pool_) JsonInt(end));
+    out_.key("docStart");
+    out_.writeInt(start);
+    out_.key("docEnd");
+    out_.writeInt(end);
   }
 
-  JsonString *toJson(const TypeSpecifier *spec, Atom *name = nullptr) {
-    return toJson(BuildTypeName(spec, name, TypeDiagFlags::Names).c_str());
+  void writeMembers(MethodmapDecl *node, Member member) {
+    SaveAndSet<Member> set_member(&member_, member);
+    out_.beginList();
+    for (size_t i = 0; i < node->body()->size(); i++)
+      node->body()->at(i)->accept(this);
+    out_.endList();
   }
-  JsonString *toJson(Type *type, Atom *name = nullptr) {
-    return toJson(BuildTypeName(type, name, TypeDiagFlags::Names).c_str());
+
+  void writeEnumValues(EnumStatement *node) {
+    for (size_t i = 0; i < node->entries()->size(); i++) {
+      EnumConstant *cs = node->entries()->at(i);
+
+      out_.beginObject();
+      out_.key("name");
+      out_.writeString(cs->name());
+      startDoc("enum value", cs->name(), cs->loc());
+      out_.endObject();
+    }
   }
 
-  JsonString *toJson(const TypeExpr &te, Atom *name = nullptr) {
+  void writeParameters(const ParameterList *params) {
+    out_.beginList();
+    for (size_t i = 0; i < params->size(); i++) {
+      VarDecl *decl = params->at(i);
+      out_.beginObject();
+
+      out_.key("type");
+      out_.writeString(typeName(decl, false));
+
+      if (decl->name()) {
+        out_.key("name");
+        out_.writeString(decl->name());
+        out_.key("decl");
+        out_.writeString(typeName(decl, true));
+      } else {
+        out_.key("name");
+        out_.writeString("...");
+
+        std::string decl_text = BuildTypeName(decl->te(), nullptr, TypeDiagFlags::Names);
+        decl_text += " ...";
+        out_.key("decl");
+        out_.writeString(decl_text);
+      }
+      out_.endObject();
+    }
+    out_.endList();
+  }
+
+  std::string typeName(const TypeSpecifier *spec, Atom *name = nullptr) {
+    return BuildTypeName(spec, name, TypeDiagFlags::Names);
+  }
+  std::string typeName(Type *type, Atom *name = nullptr) {
+    return BuildTypeName(type, name, TypeDiagFlags::Names);
+  }
+  std::string typeName(const TypeExpr &te, Atom *name = nullptr) {
     if (te.spec())
-      return toJson(te.spec(), name);
-    return toJson(te.resolved(), name);
+      return typeName(te.spec(), name);
+    return typeName(te.resolved(), name);
   }
 
   static inline bool isByRef(const TypeExpr& te) {
@@ -352,110 +437,202 @@ class Analyzer : public PartialAstVisitor
            : te.spec()->isConst();
   }
 
-  JsonString *toJson(VarDecl *decl, bool named) {
+  std::string typeName(VarDecl *decl, bool named) {
     // :TODO: add a BuildTypeName(VarDecl) helper.
     TypeDiagFlags flags = TypeDiagFlags::Names;
     if (isByRef(decl->te()))
       flags |= TypeDiagFlags::IsByRef;
     if (isConst(decl->te()))
       flags |= TypeDiagFlags::IsConst;
-    return toJson(BuildTypeName(
+    return BuildTypeName(
       decl->te(),
       named ? decl->name() : nullptr,
-      flags).c_str());
+      flags);
   }
 
-  JsonList *toJson(const ParameterList *params) {
-    JsonList *list = new (pool_) JsonList();
-    for (size_t i = 0; i < params->size(); i++) {
-      VarDecl *decl = params->at(i);
-      JsonObject *obj = new (pool_) JsonObject();
+ private:
+  CompileContext &cc_;
+  Comments &comments_;
+  JsonWriter &out_;
+  Section section_;
+  Member member_;
+};
 
-      obj->add(atom_type_, toJson(decl, false));
+static ParseTree *
+Parse(CompileContext &cc, Comments &comments, const char *path)
+{
+  Preprocessor pp(cc);
 
-      if (decl->name()) {
-        obj->add(atom_name_, toJson(decl->name()));
-        obj->add(atom_decl_, toJson(decl, true));
-      } else {
-        obj->add(atom_name_, toJson("..."));
+  pp.disableIncludes();
+  pp.setCommentDelegate(&comments);
 
-        AutoString builder = BuildTypeName(decl->te(), nullptr, TypeDiagFlags::Names);
-        builder = builder + " ...";
-        obj->add(atom_decl_, toJson(builder.ptr()));
-      }
-      list->add(obj);
-    }
-    return list;
-  }
-
-  JsonString *toJson(Atom *name) {
-    return new (pool_) JsonString(name);
-  }
-  JsonString *toJson(const char *str) {
-    return new (pool_) JsonString(cc_.add(str));
+  {
+    ReportingContext rc(cc, SourceLocation());
+    RefPtr<SourceFile> file = cc.source().open(rc, path);
+    if (!file)
+      return nullptr;
+    if (!pp.enter(file))
+      return nullptr;
   }
 
- private:
-  CompileContext &cc_;
-  PoolAllocator &pool_;
-  Comments &comments_;
+  NameResolver nr(cc);
+  Parser parser(cc, pp, nr);
 
-  Atom *atom_name_;
-  Atom *atom_kind_;
-  Atom *atom_returnType_;
-  Atom *atom_type_;
-  Atom *atom_parameters_;
-  Atom *atom_doc_start_;
-  Atom *atom_doc_end_;
-  Atom *atom_properties_;
-  Atom *atom_methods_;
-  Atom *atom_getter_;
-  Atom *atom_setter_;
-  Atom *atom_entries_;
-  Atom *atom_constants_;
-  Atom *atom_decl_;
-  Atom *atom_parent_;
-  JsonList *functions_;
-  JsonList *methodmaps_;
-  JsonList *enums_;
-  JsonList *constants_;
-  JsonList *typesets_;
-  JsonList *typedefs_;
-
-  JsonList *props_;
-  JsonList *methods_;
-};
+  ParseTree *tree = parser.parse();
+  if (!tree || !cc.phasePassed())
+    return nullptr;
+  return tree;
+}
 
-static JsonObject *
-Run(CompileContext &cc, const char *path)
+// Everything a file is parsed with is its own, so files can be documented on
+// several threads at once. Only the contents of files read from disk are
+// shared, by the source managers.
+static bool
+Document(const char *path, FILE *fp)
 {
-  Comments comments(cc);
-  ParseTree *tree = nullptr;
+  static std::mutex sMessageLock;
+
+  StringPool strings;
+  ReportManager reports;
+  SourceManager source(strings, reports);
+
+  bool ok = false;
+  PoolAllocator pool;
   {
-    Preprocessor pp(cc);
+    PoolScope scope(pool);
 
-    pp.disableIncludes();
-    pp.setCommentDelegate(&comments);
+    CompileContext cc(pool, strings, reports, source);
 
-    {
-      ReportingContext rc(cc, SourceLocation());
-      RefPtr<SourceFile> file = cc.source().open(rc, path);
-      if (!file)
-        return nullptr;
-      if (!pp.enter(file))
-        return nullptr;
+    cc.SkipResolution();
+
+    Comments comments(cc);
+    if (ParseTree *tree = Parse(cc, comments, path)) {
+      // Declarations are written out as they are found, so nothing but the
+      // parse tree has to be held in memory.
+      JsonWriter out(fp);
+      Analyzer analyzer(cc, comments, out);
+      analyzer.analyze(tree);
+      ok = out.flush();
+      if (!ok)
+        fprintf(stderr, "could not write output\n");
     }
 
-    NameResolver nr(cc);
-    Parser parser(cc, pp, nr);
+    if (reports.HasMessages()) {
+      std::lock_guard<std::mutex> lock(sMessageLock);
+      reports.PrintMessages();
+    }
+  }
+  return ok;
+}
 
-    tree = parser.parse();
-    if (!tree || !cc.phasePassed())
-      return nullptr;
+static bool
+ReadFileList(const char *list, std::vector<std::string> *files)
+{
+  FILE *fp = fopen(list, "rt");
+  if (!fp)
+    return false;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), fp)) {
+    size_t length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      length--;
+    if (length)
+      files->emplace_back(line, length);
   }
+  fclose(fp);
+  return true;
+}
 
-  Analyzer analyzer(cc, comments);
-  return analyzer.analyze(tree);
+static bool
+ReadAll(FILE *fp, std::string *text)
+{
+  if (fseek(fp, 0, SEEK_END) != 0)
+    return false;
+  long size = ftell(fp);
+  if (size < 0 || fseek(fp, 0, SEEK_SET) != 0)
+    return false;
+  text->resize(size_t(size));
+  return fread(&(*text)[0], 1, text->size(), fp) == text->size();
+}
+
+// Documents every file in the list on |jobs| threads, and writes a list of
+// {file, doc} objects in the order of the list. Each file's documentation is
+// written out as soon as it and every file before it are done.
+static int
+DocumentBatch(const std::vector<std::string> &files, size_t jobs)
+{
+  struct Result {
+    FILE *fp = nullptr;
+    bool ok = false;
+    bool done = false;
+  };
+  std::vector<Result> results(files.size());
+  std::mutex lock;
+  std::condition_variable finished;
+
+  std::atomic<size_t> next(0);
+  auto work = [&]() -> void {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      FILE *fp = tmpfile();
+      bool ok = fp && Document(files[i].c_str(), fp);
+
+      std::lock_guard<std::mutex> guard(lock);
+      results[i].fp = fp;
+      results[i].ok = ok;
+      results[i].done = true;
+      finished.notify_all();
+    }
+  };
+
+  std::vector<std::unique_ptr<std::thread>> threads;
+  for (size_t i = 0; i < jobs; i++) {
+    std::unique_ptr<std::thread> thread = ke::NewThread("docparse", work);
+    if (!thread)
+      break;
+    threads.push_back(std::move(thread));
+  }
+  if (threads.empty())
+    work();
+
+  int status = 0;
+  JsonWriter out(stdout);
+  out.beginList();
+  for (size_t i = 0; i < files.size(); i++) {
+    Result result;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      finished.wait(guard, [&]() -> bool { return results[i].done; });
+      result = results[i];
+    }
+
+    out.beginObject();
+    out.key("file");
+    out.writeString(files[i]);
+    out.key("doc");
+
+    std::string text;
+    if (result.ok && ReadAll(result.fp, &text)) {
+      out.writeRaw(text.c_str(), text.size());
+    } else {
+      fprintf(stderr, "could not document '%s'\n", files[i].c_str());
+      out.writeNull();
+      status = 1;
+    }
+    out.endObject();
+    if (result.fp)
+      fclose(result.fp);
+  }
+  out.endList();
+
+  for (const auto &thread : threads)
+    thread->join();
+
+  if (!out.flush()) {
+    fprintf(stderr, "could not write output\n");
+    return 1;
+  }
+  return status;
 }
 
 int main(int argc, char **argv)
@@ -465,37 +642,28 @@ int main(int argc, char **argv)
   args::StringOption filename(parser,
     "filename",
     "SourcePawn file to scan for documentation.");
-
-  StringPool strings;
-  ReportManager reports;
-  SourceManager source(strings, reports);
+  args::ToggleOption batch(parser, nullptr, "batch", Some(false),
+    "Treat the file as a list of files to document, one per line, and write a list "
+    "of {file, doc} objects.");
+  args::IntOption jobs(parser, "j", "jobs", Some(0),
+    "With --batch, document files on this many threads (0 for one per core).");
 
   if (!parser.parse(argc, argv)) {
     parser.usage(stderr, argc, argv);
     return 1;
   }
 
-  PoolAllocator pool;
-  {
-    PoolScope scope(pool);
-
-    CompileContext cc(pool, strings, reports, source);
-
-    cc.SkipResolution();
-
-    const char* file = filename.value().c_str();
-    JsonObject *obj = Run(cc, file);
-    if (!obj) {
-      reports.PrintMessages();
-      return 1;
-    }
-
-    JsonRenderer renderer(std::cout);
-    renderer.Render(obj);
+  if (!batch.value())
+    return Document(filename.value().c_str(), stdout) ? 0 : 1;
 
-    if (reports.HasMessages())
-      reports.PrintMessages();
+  std::vector<std::string> files;
+  if (!ReadFileList(filename.value().c_str(), &files)) {
+    fprintf(stderr, "cannot open file '%s'\n", filename.value().c_str());
+    return 1;
   }
 
-  return 0;
+  size_t threads = jobs.value() > 0 ? size_t(jobs.value()) : 0;
+  if (!threads)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  return DocumentBatch(files, std::min(threads, files.size()));
 }
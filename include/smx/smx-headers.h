@@ -58,6 +58,16 @@ struct SmxConsts {
     // Compression types.
     static const uint8_t FILE_COMPRESSION_NONE = 0;
     static const uint8_t FILE_COMPRESSION_GZ = 1;
+    // LZ4 block format (no frame header); see shared/lz4-block.h.
+    static const uint8_t FILE_COMPRESSION_LZ4 = 2;
+    // zlib streams over fixed-size chunks, which can be (de)compressed in
+    // parallel; see shared/zlib-chunks.h.
+    static const uint8_t FILE_COMPRESSION_GZ_CHUNKS = 3;
+
+    // In a page-aligned file, the contents of each section (after its header,
+    // for .code and .data) start on this boundary. Such files are stored
+    // uncompressed, so a loader can map them and use .code in place.
+    static const uint32_t FILE_PAGE_ALIGNMENT = 4096;
 
     // Version 9: Initial version.
     // Version 10: DEBUG code flag removed; no bytecode changes.
@@ -73,6 +83,10 @@ struct SmxConsts {
     // This feature adds the REBASE opcode, and requires that multi-dimensional
     // arrays use direct internal addressing.
     static const uint32_t kCodeFeatureDirectArrays = (1 << 0);
+
+    // This feature adds the LIDX.S.BOUNDS and IDXADDR.S.BOUNDS opcodes, which
+    // index a local array by a local variable in one instruction.
+    static const uint32_t kCodeFeatureFusedIndex = (1 << 1);
 };
 
 // These structures are byte-packed.
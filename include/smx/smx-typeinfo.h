@@ -240,6 +240,10 @@ static const uint8_t kArray = 0x31;
 // smx_rtti_method::signature.
 static const uint8_t kFunction = 0x32;
 
+// kFlatArray precedes the kFixedArray chain of an array whose rows are
+// stored one after another, without indirection vectors.
+static const uint8_t kFlatArray = 0x33;
+
 // Each of these is followed by an index into an appropriate table.
 static const uint8_t kEnum = 0x42;       // rtti.enums
 static const uint8_t kTypedef = 0x43;    // rtti.typedefs
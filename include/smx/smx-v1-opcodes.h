@@ -238,6 +238,8 @@ namespace sp {
     _G(ENDPROC, "endproc", 1)                                               \
     _U(LDGFN_PRI, "ldgfn.pri")                                              \
     _G(REBASE, "rebase", 4)                                                 \
+    _G(LIDX_S_BOUNDS, "lidx.s.bounds", 4)                                   \
+    _G(IDXADDR_S_BOUNDS, "idxaddr.s.bounds", 4)                             \
     /* Opcodes below this are pseudo-opcodes and are not part of the ABI */ \
     _U(FIRST_FAKE, "firstfake")                                             \
     _G(FABS, "fabs", 1)                                                     \
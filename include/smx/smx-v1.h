@@ -69,6 +69,37 @@ typedef struct sp_file_pubvars_s {
     uint32_t name;    /**< Index into nametable */
 } sp_file_pubvars_t;
 
+// The optional ".names.hash" section indexes natives, publics and pubvars by
+// name. This header is followed by the native table, then the public table,
+// then the pubvar table, each an array of sp_file_name_hash_entry_t. A table
+// has zero slots or a power of two, with at least one slot empty. A name is
+// looked up by starting at slot (SmxNameHash(name) & (slots - 1)) and moving
+// to the following slot, wrapping around, until an empty slot is reached.
+// Rows are entered in order, so the lowest row with a name is found first.
+typedef struct sp_file_name_hash_s {
+    uint32_t natives_slots;
+    uint32_t publics_slots;
+    uint32_t pubvars_slots;
+} sp_file_name_hash_t;
+
+static const uint32_t NAME_HASH_EMPTY = 0xffffffff;
+
+// The optional ".natives.ordinals" section places each native in a native
+// manifest: a list of names a host publishes under an id, so that a plugin
+// compiled against it can be bound without looking up names. This header is
+// followed by one uint32_t per row of .natives, the index of the native in
+// the manifest, or NATIVE_NO_ORDINAL.
+typedef struct sp_file_native_ordinals_s {
+    uint32_t manifest; /**< Id of the manifest */
+} sp_file_native_ordinals_t;
+
+static const uint32_t NATIVE_NO_ORDINAL = 0xffffffff;
+
+typedef struct sp_file_name_hash_entry_s {
+    uint32_t hash; /**< SmxNameHash() of the name */
+    uint32_t row;  /**< Row in .natives, .publics or .pubvars, or NAME_HASH_EMPTY */
+} sp_file_name_hash_entry_t;
+
 // The ".tags" section.
 typedef struct sp_file_tag_s {
     uint32_t tag_id; /**< Tag ID from compiler */
@@ -96,6 +127,36 @@ typedef struct sp_fdbg_line_s {
     uint32_t line; /**< Line number */
 } sp_fdbg_line_t;
 
+// The optional ".dbg.linetable" section holds the same entries as .dbg.lines,
+// in address order, in far less space. The header is followed by one
+// sp_fdbg_lineblock_t for each |block_size| entries, then a byte stream. A
+// block's first entry is stored in the block itself. Each later entry of the
+// block is two varints in the stream (7 bits per byte, low bits first, high
+// bit set on all but the last byte): the address minus the previous entry's
+// address, then the line minus the previous line, zigzag-encoded. When this
+// section is present, .dbg.lines may be empty.
+typedef struct sp_fdbg_linetable_s {
+    uint32_t num_lines;  /**< number of entries */
+    uint32_t block_size; /**< entries per block */
+    uint32_t num_blocks; /**< ceil(num_lines / block_size) */
+} sp_fdbg_linetable_t;
+
+typedef struct sp_fdbg_lineblock_s {
+    uint32_t addr;   /**< Address of the block's first entry */
+    uint32_t line;   /**< Line of the block's first entry */
+    uint32_t offset; /**< Offset of the block's deltas in the stream */
+} sp_fdbg_lineblock_t;
+
+// The ".dbg.link" section, in a binary compiled with --split-debug. Its debug
+// sections (.dbg.*, with their names in .dbg.strings) are in a separate SMX
+// file, which has a .dbg.link of its own with the same |build_id| and an
+// empty name. The VM only reads that file once something needs debug info.
+typedef struct sp_fdbg_link_s {
+    uint8_t build_id[16]; /**< MD5 of the code and the split-out debug sections */
+    // Followed by the debug file's name, null-terminated, relative to the
+    // binary's directory.
+} sp_fdbg_link_t;
+
 // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
 // DO NOT DEFINE NEW STRUCTURES BELOW.
 // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
@@ -106,6 +167,18 @@ typedef struct sp_fdbg_line_s {
 #    pragma pack(pop) /* reset previous packing */
 #endif
 
+// The hash used by .names.hash: 32-bit FNV-1a over the name's bytes.
+static inline uint32_t
+SmxNameHash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* iter = name; *iter; iter++) {
+        hash ^= uint8_t(*iter);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 } // namespace sp
 
 #endif //_INCLUDE_SPFILE_HEADERS_v1_H
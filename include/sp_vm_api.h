@@ -23,8 +23,8 @@
 #include "sp_vm_types.h"
 
 /** SourcePawn Engine API Versions */
-#define SOURCEPAWN_ENGINE2_API_VERSION 0xD
-#define SOURCEPAWN_API_VERSION 0x020F
+#define SOURCEPAWN_ENGINE2_API_VERSION 0x1A
+#define SOURCEPAWN_API_VERSION 0x021A
 
 namespace SourceMod {
 struct IdentityToken_t;
@@ -39,12 +39,20 @@ typedef struct sp_context_s sp_context_t;
 namespace SourcePawn {
 class IVirtualMachine;
 class IPluginRuntime;
+class ISuspendedInvocation;
 class ISourcePawnEngine2;
 class ISourcePawnEnvironment;
 
 /* Parameter flags */
 #define SM_PARAM_COPYBACK (1 << 0) /**< Copy an array/reference back after call */
 
+/* Plugin load flags */
+#define SP_LOADFLAG_PRECOMPILE (1 << 0) /**< Compile reachable methods in the background */
+#define SP_LOADFLAG_MAP_FILE   (1 << 1) /**< Map the file instead of reading it */
+#define SP_LOADFLAG_LAZY_DEBUG_INFO (1 << 2) /**< Validate debug info and RTTI on first use */
+#define SP_LOADFLAG_MD5_HASHES (1 << 3) /**< Use MD5 for GetCodeHash and GetDataHash */
+#define SP_LOADFLAG_VERIFY_ALL (1 << 4) /**< Verify every reachable method at load */
+
 /* String parameter flags (separate from parameter flags) */
 #define SM_PARAM_STRING_UTF8 (1 << 0)   /**< String should be UTF-8 handled */
 #define SM_PARAM_STRING_COPY (1 << 1)   /**< String should be copied into the plugin */
@@ -287,6 +295,149 @@ class IPluginFunction : public ICallable
      * @return       String name.
      */
     virtual const char* DebugName() = 0;
+
+    /**
+     * @brief Same as Invoke(), except that the invocation runs on its own
+     * native stack, so a native it calls can suspend it with
+     * IPluginContext::SuspendInvocation. If that happens, this returns true
+     * and sets |suspended|; the invocation finishes later, through
+     * ISuspendedInvocation::Resume, and copybacks happen then.
+     *
+     * The invocation can only be suspended if nothing else is running in
+     * the VM when this is called. Otherwise, or where the platform has no
+     * way to switch stacks, this behaves like Invoke().
+     *
+     * @param result    Pointer to store return value in, if it finishes.
+     * @param suspended Set to the suspended invocation, or NULL if it
+     *                  finished.
+     * @return          True on success, false on error.
+     */
+    virtual bool InvokeSuspendable(cell_t* result, ISuspendedInvocation** suspended) = 0;
+};
+
+/**
+ * @brief A plugin invocation that a native has suspended, through
+ * IPluginContext::SuspendInvocation.
+ *
+ * While it is suspended, the part of its plugin's stack and heap it was
+ * using is set aside, so other functions of the same plugin can run, and
+ * be suspended, in the meantime. It can only be resumed when nothing else
+ * is running in the VM, and it must be resumed or aborted before its
+ * plugin is unloaded.
+ */
+class ISuspendedInvocation
+{
+  public:
+    /**
+     * @brief Resumes the invocation. The native that suspended it returns
+     * |value| to the plugin, and the invocation runs until it finishes or is
+     * suspended again.
+     *
+     * @param value     Value the suspending native returns.
+     * @param result    Pointer to store the function's return value in, if
+     *                  it finishes.
+     * @param suspended Set to this object if the invocation was suspended
+     *                  again, or could not be resumed yet; otherwise, to
+     *                  NULL, and this object is destroyed.
+     * @return          True on success, false on error, as with
+     *                  IPluginFunction::Invoke().
+     */
+    virtual bool Resume(cell_t value, cell_t* result, ISuspendedInvocation** suspended) = 0;
+
+    /**
+     * @brief Resumes the invocation with SP_ERROR_ABORTED pending, so it
+     * unwinds without running any more plugin code, and destroys this
+     * object. The error is not left pending for the caller.
+     *
+     * @return          False if the invocation could not be resumed yet, in
+     *                  which case this object is still valid.
+     */
+    virtual bool Abort() = 0;
+};
+
+/**
+ * @brief Called by IPluginContext::SuspendInvocation once the invocation
+ * has been suspended, before control returns to the host. The invocation
+ * must not be resumed from inside this callback.
+ */
+typedef void (*SPVM_SUSPEND_FUNC)(ISuspendedInvocation* invocation, void* data);
+
+/**
+   * @brief A reusable argument list. Arguments are pushed once with the
+   * ICallable methods, then the call can be made any number of times, on any
+   * function, without pushing them again.
+   *
+   * Arrays and strings are laid out the first time the call is made, and
+   * copied into the plugin heap as a single block on every call after that.
+   * Input-only arrays and strings are therefore read once; use Set* or
+   * Refresh() if their contents change. Arguments with copy-back are re-read
+   * on every call, so each callee sees what the previous one wrote.
+   *
+   * Cancel() clears the argument list. A prepared call is freed with delete.
+   */
+class IPreparedCall : public ICallable
+{
+  public:
+    virtual ~IPreparedCall() {}
+
+    /**
+     * @brief Returns the number of arguments pushed.
+     */
+    virtual unsigned int GetArgCount() = 0;
+
+    /**
+     * @brief Replaces a cell argument.
+     *
+     * @param index     Argument index.
+     * @param cell      Cell value.
+     * @return          Error code, if any. The argument must have been pushed
+     *                  by value.
+     */
+    virtual int SetCell(unsigned int index, cell_t cell) = 0;
+
+    /**
+     * @brief Replaces a float argument.
+     *
+     * @param index     Argument index.
+     * @param number    Floating point value.
+     * @return          Error code, if any.
+     */
+    virtual int SetFloat(unsigned int index, float number) = 0;
+
+    /**
+     * @brief Replaces an array or reference argument. The size and flags given
+     * when the argument was pushed are kept.
+     *
+     * @param index     Argument index.
+     * @param inarray   Array to copy, or NULL.
+     * @return          Error code, if any.
+     */
+    virtual int SetArray(unsigned int index, cell_t* inarray) = 0;
+
+    /**
+     * @brief Replaces a string argument. The buffer size and flags given when
+     * the argument was pushed are kept.
+     *
+     * @param index     Argument index.
+     * @param string    String to copy, or NULL.
+     * @return          Error code, if any.
+     */
+    virtual int SetString(unsigned int index, const char* string) = 0;
+
+    /**
+     * @brief Re-reads every input-only array and string on the next call.
+     */
+    virtual void Refresh() = 0;
+
+    /**
+     * @brief Calls a function with the prepared arguments, and performs any
+     * copybacks. Errors are reported the same way as IPluginFunction::Invoke.
+     *
+     * @param function  Function to call.
+     * @param result    Pointer to store return value in.
+     * @return          True on success, false on error.
+     */
+    virtual bool Invoke(IPluginFunction* function, cell_t* result = nullptr) = 0;
 };
 
 /**
@@ -355,6 +506,37 @@ class IPluginDebugInfo
 
 class ICompilation;
 
+/**
+ * @brief A copy of a plugin's global data, heap and native bindings, from
+ * which new runtimes of the same plugin can be started without loading or
+ * initializing it again. The snapshot is independent of the runtime it was
+ * taken from, and can be used after that runtime is gone.
+ */
+class IPluginSnapshot
+{
+  public:
+    virtual ~IPluginSnapshot() {}
+
+    /**
+     * @brief Creates a new runtime whose memory starts out as the snapshot,
+     * mapped copy-on-write where the platform allows, and whose natives are
+     * bound as they were when the snapshot was taken. Pages the new runtime
+     * never writes are shared with the snapshot.
+     *
+     * @param error         Buffer to store an error message.
+     * @param maxlength     Maximum length of the error buffer.
+     * @return              New runtime, or NULL on failure.
+     */
+    virtual IPluginRuntime* Instantiate(char* error, size_t maxlength) = 0;
+};
+
+/**
+ * @brief Called with the IDs of the watched ranges of global data that
+ * changed, once the plugin's outermost invocation returns.
+ */
+typedef void (*SPVM_DATAWATCH_FUNC)(IPluginRuntime* runtime, const uint32_t* ids, size_t count,
+                                    void* data);
+
 /**
    * @brief Interface to managing a runtime plugin.
    */
@@ -461,7 +643,10 @@ class IPluginRuntime
     virtual IPluginFunction* GetFunctionByName(const char* public_name) = 0;
 
     /**
-     * @brief Returns a function by its id.
+     * @brief Returns a function by its id. Odd IDs refer to publics; even
+     * IDs are the code offset of any function, public or not, such as one
+     * found with LookupFunctionAddress(). Either way, the same object is
+     * returned for the same ID.
      *
      * @param func_id      Function ID.
      * @return          A new IPluginFunction pointer, NULL if not found.
@@ -512,16 +697,21 @@ class IPluginRuntime
     virtual size_t GetMemUsage() = 0;
 
     /**
-     * @brief Returns the MD5 hash of the plugin's P-Code.
+     * @brief Returns a hash of the plugin's P-Code.
      *
-     * @return        16-byte buffer with MD5 hash of the plugin's P-Code.
+     * By default this is a fast 128-bit non-cryptographic digest, computed
+     * once when the plugin is loaded. Plugins loaded with
+     * SP_LOADFLAG_MD5_HASHES return an MD5 hash instead.
+     *
+     * @return        16-byte buffer with the hash of the plugin's P-Code.
      */
     virtual unsigned char* GetCodeHash() = 0;
 
     /**
-     * @brief Returns the MD5 hash of the plugin's Data.
+     * @brief Returns a hash of the plugin's Data, of the same kind as
+     * GetCodeHash().
      *
-     * @return        16-byte buffer with MD5 hash of the plugin's Data.
+     * @return        16-byte buffer with the hash of the plugin's Data.
      */
     virtual unsigned char* GetDataHash() = 0;
 
@@ -560,6 +750,88 @@ class IPluginRuntime
      */
     virtual int UpdateNativeBindingObject(uint32_t index, INativeCallback* native, uint32_t flags,
                                           void* data) = 0;
+
+    /**
+     * @brief Update the native binding at the given index to a typed
+     * native, which is called with its arguments unpacked. The descriptor
+     * is copied.
+     *
+     * @param info      Typed native, or NULL to unbind.
+     * @param flags     Native flags.
+     * @param user      User data pointer.
+     * @return          SP_ERROR_PARAM if the signature is invalid, differs
+     *                  from the one the plugin declared for the native in
+     *                  its RTTI, or the native can no longer be rebound.
+     */
+    virtual int UpdateTypedNativeBinding(uint32_t index, const sp_typed_nativeinfo_t* info,
+                                         uint32_t flags, void* data) = 0;
+
+    /**
+     * @brief Sets or clears a breakpoint on a BREAK instruction, such as the
+     * address LookupLineAddress() gives for a line. Unless single-stepping,
+     * only BREAKs with a breakpoint call the debug break handler, and the
+     * rest cost next to nothing.
+     *
+     * @param addr      Code address of the BREAK.
+     * @param enabled   True to set the breakpoint, false to clear it.
+     * @return          SP_ERROR_NOTDEBUGGING if debug breaks are not
+     *                  enabled, or SP_ERROR_INVALID_ADDRESS if there is no
+     *                  BREAK at |addr|.
+     */
+    virtual int SetBreakpoint(ucell_t addr, bool enabled) = 0;
+
+    /**
+     * @brief Sets whether every BREAK calls the debug break handler, as if
+     * each one had a breakpoint. This is the default, so that handlers that
+     * check for breakpoints themselves keep working.
+     *
+     * @param enabled   True to stop at every BREAK.
+     */
+    virtual void SetSingleStep(bool enabled) = 0;
+
+    /**
+     * @brief Sets the function called when watched global data changes, or
+     * NULL for none. Changes made while there is no callback are reported
+     * once there is one.
+     *
+     * @param callback  Function to call.
+     * @param data      Passed to the callback.
+     */
+    virtual void SetDataWatchCallback(SPVM_DATAWATCH_FUNC callback, void* data) = 0;
+
+    /**
+     * @brief Watches a range of the plugin's global data, such as a pubvar
+     * from GetPubvarAddrs(). Whenever the plugin's outermost invocation
+     * returns, every watched range whose contents differ from the last
+     * time is reported, in one call to the data watch callback. Changes
+     * the host makes are reported the same way.
+     *
+     * @param local_addr    Local address of the range.
+     * @param bytes         Size of the range, in bytes.
+     * @param id            Set to an ID for the watch.
+     * @return              SP_ERROR_INVALID_ADDRESS if the range is not
+     *                      entirely in global data.
+     */
+    virtual int WatchData(cell_t local_addr, uint32_t bytes, uint32_t* id) = 0;
+
+    /**
+     * @brief Removes a watch added with WatchData().
+     *
+     * @param id            ID of the watch.
+     * @return              SP_ERROR_NOT_FOUND if there is no such watch.
+     */
+    virtual int UnwatchData(uint32_t id) = 0;
+
+    /**
+     * @brief Takes a snapshot of the plugin's global data, heap and native
+     * bindings, for example once its start-up code has built its tables.
+     * This can only be done while the plugin is not running, and only for
+     * plugins loaded from a binary.
+     *
+     * @return              New snapshot, which must be freed with delete, or
+     *                      NULL if one could not be taken.
+     */
+    virtual IPluginSnapshot* CreateSnapshot() = 0;
 };
 
 /**
@@ -943,7 +1215,10 @@ class IPluginContext
     virtual IPluginFunction* GetFunctionByName(const char* public_name) = 0;
 
     /**
-     * @brief Returns a function by its id.
+     * @brief Returns a function by its id. Odd IDs refer to publics; even
+     * IDs are the code offset of any function, public or not, such as one
+     * found with LookupFunctionAddress(). Either way, the same object is
+     * returned for the same ID.
      *
      * @param func_id      Function ID.
      * @return          A new IPluginFunction pointer, NULL if not found.
@@ -1128,6 +1403,146 @@ class IPluginContext
      * @brief Frees an IFrameIterator object. Paired with CreateFrameIterator() 
      */
     virtual void DestroyFrameIterator(IFrameIterator* it) = 0;
+
+    /**
+     * @brief Copies a UTF-8 string of known length to a local address. This
+     * is the same as StringToLocalUTF8, except that the source is not scanned
+     * for its length, and need not be null-terminated. If the destination is
+     * too small, the string is cut at a character boundary. The destination is
+     * also never allowed to run past the end of the plugin's memory.
+     *
+     * @param local_addr    Local address in plugin.
+     * @param maxbytes      Number of bytes to write, including NULL terminator.
+     * @param source        Source string to copy.
+     * @param length        Length of the source string, in bytes.
+     * @param wrtnbytes     Optionally set to the number of bytes written, not
+     *                      including the NULL terminator.
+     * @return              Error code: SP_ERROR_NONE on success.
+     */
+    virtual int StringToLocalN(cell_t local_addr, size_t maxbytes, const char* source,
+                               size_t length, size_t* wrtnbytes) = 0;
+
+    /**
+     * @brief Converts a local address to a physical string and its length.
+     * Unlike LocalToString, the string is checked to be terminated within
+     * the plugin's memory, so the result can be used without further
+     * validation.
+     *
+     * @param local_addr    Local address in plugin.
+     * @param addr          Destination output pointer.
+     * @param length        Set to the length of the string, in bytes.
+     * @return              Error code: SP_ERROR_NONE on success, or
+     *                      SP_ERROR_INVALID_ADDRESS if the address is invalid
+     *                      or the string is not terminated.
+     */
+    virtual int LocalToStringView(cell_t local_addr, const char** addr, size_t* length) = 0;
+
+    /**
+     * @brief From a native, suspends the invocation that called it and
+     * returns control to the host that started it with
+     * IPluginFunction::InvokeSuspendable. This returns once the invocation
+     * is resumed.
+     *
+     * Only an invocation started that way can be suspended, and only while
+     * it has not called into another plugin.
+     *
+     * @param callback      Optional function to call with the suspended
+     *                      invocation, to resume it later.
+     * @param data          Passed to the callback.
+     * @param value         Set to the value the invocation was resumed
+     *                      with, which the native should return.
+     * @return              False if the invocation could not be suspended,
+     *                      or was aborted; an error is pending, and the
+     *                      native should return immediately.
+     */
+    virtual bool SuspendInvocation(SPVM_SUSPEND_FUNC callback, void* data, cell_t* value) = 0;
+
+    /**
+     * @brief Formats a string from a native's arguments, the way a Format
+     * native does. Each argument is passed by reference, as variadic
+     * arguments are. The format supports %d, %i, %u, %x, %X, %b, %f, %s,
+     * %c and %%, with the '-' and '0' flags, a width, and a precision for
+     * %f and %s. Formats in the plugin's global data are parsed once and
+     * cached.
+     *
+     * If the output does not fit, it is cut at a character boundary.
+     *
+     * @param buffer        Destination buffer.
+     * @param maxbytes      Size of the buffer, including NULL terminator.
+     * @param fmt_addr      Local address of the format string.
+     * @param params        The native's parameters, with the count first.
+     * @param arg           Index in params of the first argument to format.
+     * @param wrtnbytes     Optionally set to the number of bytes written, not
+     *                      including the NULL terminator.
+     * @return              Error code: SP_ERROR_NONE on success,
+     *                      SP_ERROR_PARAM if the format is malformed or
+     *                      there are too few arguments, or
+     *                      SP_ERROR_INVALID_ADDRESS if an address is invalid.
+     */
+    virtual int FormatToBuffer(char* buffer, size_t maxbytes, cell_t fmt_addr,
+                               const cell_t* params, unsigned int arg, size_t* wrtnbytes) = 0;
+
+    /**
+     * @brief Same as FormatToBuffer, except that the output is copied to a
+     * local address. The destination may also be one of the arguments.
+     *
+     * @param local_addr    Local address in plugin.
+     * @param maxbytes      Number of bytes to write, including NULL terminator.
+     * @param fmt_addr      Local address of the format string.
+     * @param params        The native's parameters, with the count first.
+     * @param arg           Index in params of the first argument to format.
+     * @param wrtnbytes     Optionally set to the number of bytes written, not
+     *                      including the NULL terminator.
+     * @return              Error code: SP_ERROR_NONE on success.
+     */
+    virtual int FormatToLocal(cell_t local_addr, size_t maxbytes, cell_t fmt_addr,
+                              const cell_t* params, unsigned int arg, size_t* wrtnbytes) = 0;
+
+    /**
+     * @brief Converts a local address to a physical string buffer that a
+     * native can write its result into directly, instead of building it
+     * elsewhere and copying it with StringToLocal. The buffer is checked to
+     * lie within the plugin's memory.
+     *
+     * The caller must write no more than |bytes| bytes, and must terminate
+     * what it writes. If the buffer is not large enough, it is up to the
+     * caller to cut the string at a character boundary.
+     *
+     * @param local_addr    Local address in plugin.
+     * @param maxbytes      Size of the buffer the plugin passed, including
+     *                      NULL terminator.
+     * @param addr          Destination output pointer.
+     * @param bytes         Set to the number of bytes that may be written,
+     *                      which is |maxbytes| unless the plugin's memory
+     *                      ends first. It may be 0.
+     * @return              Error code: SP_ERROR_NONE on success.
+     */
+    virtual int LocalToStringBuffer(cell_t local_addr, size_t maxbytes, char** addr,
+                                    size_t* bytes) = 0;
+
+    /**
+     * @brief Allocates temporary host memory for a native. Unlike HeapAlloc,
+     * the memory is not in the plugin's address space and is not tracked, so
+     * it is much cheaper; it is for natives that need a work buffer they
+     * won't pass to the plugin.
+     *
+     * Allocations are freed in stack order with ScratchRelease. Anything
+     * still allocated when the host's invocation of the plugin returns is
+     * freed then.
+     *
+     * @param cells         Number of cells to allocate.
+     * @param mark          Set to a value to pass to ScratchRelease.
+     * @return              The memory, or NULL if out of memory.
+     */
+    virtual cell_t* ScratchAlloc(size_t cells, size_t* mark) = 0;
+
+    /**
+     * @brief Frees the ScratchAlloc allocation that returned |mark|, and any
+     * made after it.
+     *
+     * @param mark          Mark returned by ScratchAlloc.
+     */
+    virtual void ScratchRelease(size_t mark) = 0;
 };
 
 /**
@@ -1419,6 +1834,76 @@ class ISourcePawnEngine
 
 class ExceptionHandler;
 
+/**
+   * @brief Counters the VM keeps for each public function. Time and natives
+   * called while a public is running another public, in any plugin, are
+   * charged to the public that was called.
+   */
+struct PublicStats
+{
+    uint64_t calls;            /**< Number of invocations */
+    uint64_t total_ns;         /**< Wall time, including nested invocations */
+    uint64_t self_ns;          /**< Wall time, excluding nested invocations */
+    uint64_t max_ns;           /**< Longest single invocation */
+    uint64_t native_calls;     /**< Natives called, excluding nested invocations */
+    uint32_t heap_high_water;  /**< Most heap used by one invocation, in bytes */
+};
+
+/**
+   * @brief Memory a plugin context has used since it was created, or since
+   * its stats were last reset. These are meant for sizing #pragma dynamic:
+   * the heap and stack share memory_size bytes, so a plugin needs about
+   * heap_high_water + stack_high_water of it.
+   */
+struct MemoryStats
+{
+    uint32_t memory_size;         /**< Bytes shared by the heap and stack */
+    uint32_t heap_high_water;     /**< Most heap in use at once, in bytes */
+    uint32_t stack_high_water;    /**< Most stack in use at once, in bytes. This is
+                                       an upper bound, from the most stack each
+                                       method entered may use. */
+    uint32_t tracker_high_water;  /**< Most heap trackers live at once */
+    uint64_t heap_allocs;         /**< Calls to IPluginContext::HeapAlloc */
+    uint64_t array_allocs;        /**< Dynamic arrays generated */
+};
+
+/**
+   * @brief What the JIT has spent on a plugin, summed over every method that
+   * has compiled code. Methods loaded from the code cache are only counted
+   * in methods, cached_methods and code_bytes.
+   */
+struct JitStats
+{
+    uint32_t methods;         /**< Methods with compiled code */
+    uint32_t cached_methods;  /**< Of those, methods loaded from the code cache */
+    uint64_t pcode_bytes;     /**< P-code compiled, in bytes */
+    uint64_t code_bytes;      /**< Machine code, in bytes */
+    uint64_t compile_ns;      /**< Time spent compiling */
+    uint32_t ool_paths;       /**< Out-of-line paths emitted */
+    uint32_t thunks;          /**< Timeout thunks emitted for backward jumps */
+};
+
+/**
+   * @brief The outcome of loading one file with
+   * ISourcePawnEngine2::LoadBinariesFromFiles.
+   */
+struct LoadResult
+{
+    IPluginRuntime* runtime;   /**< New runtime, or NULL on failure */
+    char error[256];           /**< Error message if runtime is NULL */
+};
+
+/**
+   * @brief One entry of a batch passed to ISourcePawnEngine2::InvokeBatch.
+   */
+struct BatchCall
+{
+    IPluginFunction* function;  /**< Function to call */
+    IPreparedCall* args;        /**< Arguments, or NULL for none */
+    cell_t result;              /**< Set to the return value */
+    int error;                  /**< Set to the error code, or SP_ERROR_NONE */
+};
+
 /** 
    * @brief Outlines the interface a Virtual Machine (JIT) must expose
    */
@@ -1583,8 +2068,284 @@ class ISourcePawnEngine2
      * @brief Returns the environment.
      */
     virtual ISourcePawnEnvironment* Environment() = 0;
+
+    /**
+     * @brief Loads a plugin from disk, with SP_LOADFLAG_* options.
+     *
+     * With SP_LOADFLAG_PRECOMPILE, every function reachable from a public
+     * is compiled on a background thread. The compiled code is installed all
+     * at once, the first time the plugin is invoked after the thread has
+     * finished. Natives bound after loading are always called through the
+     * generic path from precompiled code.
+     *
+     * With SP_LOADFLAG_MAP_FILE, an uncompressed plugin is mapped read-only
+     * and its sections are used in place, rather than read into memory. The
+     * file must not be rewritten in place while the plugin is loaded; replace
+     * it with a rename instead. Compressed plugins are unaffected. Plugins
+     * compiled with spcomp --page-aligned are always mapped this way.
+     *
+     * With SP_LOADFLAG_LAZY_DEBUG_INFO, the debug info, RTTI and tag sections
+     * are validated the first time they are used rather than at load. A
+     * plugin whose debug info turns out to be malformed still loads, but
+     * reports no file, function or line information.
+     *
+     * With SP_LOADFLAG_MD5_HASHES, GetCodeHash() and GetDataHash() return
+     * MD5 hashes, computed on first use, instead of the default fast digest.
+     *
+     * With SP_LOADFLAG_VERIFY_ALL, every method reachable from a public is
+     * verified while loading instead of on first call. The results are
+     * shared by later loads of the same image and, if a code cache directory
+     * is set, saved with the cache so that other processes skip verifying.
+     *
+     * Validated images are cached by content, so loading a file identical to
+     * one loaded recently (such as reloading an unchanged plugin) skips
+     * validation and method verification. Mapped files are not cached.
+     *
+     * @param file      Path to the file to load.
+     * @param flags     SP_LOADFLAG_* flags.
+     * @param error     Buffer to store an error message (optional).
+     * @param maxlength Maximum length of the error buffer.
+     * @return          New runtime pointer, or NULL on failure.
+     */
+    virtual IPluginRuntime* LoadBinaryFromFileEx(const char* file, uint32_t flags, char* error,
+                                                 size_t maxlength) = 0;
+
+    /**
+     * @brief Starts the built-in sampling profiler, which records the script
+     * call stack roughly every interval_ms milliseconds while plugin code is
+     * running. Requires the watchdog timer to be installed.
+     *
+     * Code compiled while sampling is enabled calls natives through a slower
+     * path, so this is best enabled before plugins are loaded.
+     *
+     * @param interval_ms   Milliseconds between samples.
+     * @return              True on success, false otherwise.
+     */
+    virtual bool StartSampling(size_t interval_ms) = 0;
+
+    /**
+     * @brief Stops the sampling profiler. Samples taken so far are kept.
+     */
+    virtual void StopSampling() = 0;
+
+    /**
+     * @brief Writes and then discards the samples taken so far, as one
+     * "frame;frame;frame count" line per distinct call stack, outermost
+     * frame first. This is the folded format read by flamegraph tools.
+     *
+     * @param path      File to write.
+     * @return          True on success, false otherwise.
+     */
+    virtual bool WriteSampleProfile(const char* path) = 0;
+
+    /**
+     * @brief Reads the counters kept for a public function.
+     *
+     * @param runtime   Plugin runtime.
+     * @param index     Public function index.
+     * @param stats     Filled with the counters on success.
+     * @return          False if the index is out of range.
+     */
+    virtual bool GetPublicStats(IPluginRuntime* runtime, uint32_t index, PublicStats* stats) = 0;
+
+    /**
+     * @brief Zeroes the counters for every public function in a runtime.
+     *
+     * @param runtime   Plugin runtime.
+     */
+    virtual void ResetPublicStats(IPluginRuntime* runtime) = 0;
+
+    /**
+     * @brief Creates an empty, reusable argument list.
+     *
+     * @return          New prepared call, which must be freed with delete.
+     */
+    virtual IPreparedCall* CreatePreparedCall() = 0;
+
+    /**
+     * @brief Calls a list of functions, usually the same public in many
+     * plugins, under a single exception handling scope. An error in one call
+     * is recorded in its entry and reported as usual, and does not stop the
+     * remaining calls.
+     *
+     * @param calls     Calls to make, in order.
+     * @param count     Number of entries in calls.
+     * @return          Number of calls that succeeded.
+     */
+    virtual size_t InvokeBatch(BatchCall* calls, size_t count) = 0;
+
+    /**
+     * @brief Loads several plugins at once. Files are read, decompressed and
+     * validated on a pool of worker threads; the runtimes are then created on
+     * the calling thread, in order. Each result is the same as calling
+     * LoadBinaryFromFileEx on that file.
+     *
+     * @param files     Paths to the files to load.
+     * @param count     Number of files.
+     * @param flags     SP_LOADFLAG_* flags, applied to every file.
+     * @param results   Array of count entries, filled in for each file.
+     */
+    virtual void LoadBinariesFromFiles(const char* const* files, size_t count, uint32_t flags,
+                                       LoadResult* results) = 0;
+
+    /**
+     * @brief Adds natives to the engine-wide registry, for binding with
+     * BindRegisteredNatives. Registering a name again replaces the earlier
+     * function. Names are copied, so the table need not outlive the call.
+     *
+     * @param natives   Array of natives, terminated by an entry with a NULL
+     *                  name.
+     * @return          False if out of memory.
+     */
+    virtual bool RegisterNatives(const sp_nativeinfo_t* natives) = 0;
+
+    /**
+     * @brief Adds typed natives to the engine-wide registry, the same way
+     * as RegisterNatives. A name registered both ways keeps whichever was
+     * registered last.
+     *
+     * @param natives   Array of typed natives, terminated by an entry with
+     *                  a NULL name.
+     * @return          False if out of memory or a signature is invalid.
+     */
+    virtual bool RegisterTypedNatives(const sp_typed_nativeinfo_t* natives) = 0;
+
+    /**
+     * @brief Binds every native of a plugin that is in the registry and not
+     * already bound, in one pass. Plugins that import the same list of
+     * natives reuse a cached resolution.
+     *
+     * @param runtime   Plugin runtime.
+     * @return          Number of natives bound.
+     */
+    virtual size_t BindRegisteredNatives(IPluginRuntime* runtime) = 0;
+
+    /**
+     * @brief Writes a profile of how often each method of a plugin has run,
+     * keyed by code offset and the code hash. Counts are only kept while a
+     * method is interpreted, so this is most useful with tiered compilation.
+     *
+     * @param runtime   Plugin runtime.
+     * @param path      File to write.
+     * @return          True on success, false otherwise.
+     */
+    virtual bool WriteMethodProfile(IPluginRuntime* runtime, const char* path) = 0;
+
+    /**
+     * @brief Reads a profile written by WriteMethodProfile for the same
+     * code. The profiled methods are treated as already hot, and compiled
+     * right away, hottest first, so that they start out compiled and are
+     * laid out next to each other.
+     *
+     * @param runtime   Plugin runtime.
+     * @param path      File to read.
+     * @return          False if the file could not be read, or was written
+     *                  for different code.
+     */
+    virtual bool ApplyMethodProfile(IPluginRuntime* runtime, const char* path) = 0;
+
+    /**
+     * @brief Reads how much heap and stack a plugin has used.
+     *
+     * @param runtime   Plugin runtime.
+     * @param stats     Filled with the counters.
+     */
+    virtual void GetMemoryStats(IPluginRuntime* runtime, MemoryStats* stats) = 0;
+
+    /**
+     * @brief Restarts the memory counters of a plugin from its current usage.
+     *
+     * @param runtime   Plugin runtime.
+     */
+    virtual void ResetMemoryStats(IPluginRuntime* runtime) = 0;
+
+    /**
+     * @brief Sums up what the JIT has spent compiling a plugin so far.
+     *
+     * @param runtime   Plugin runtime.
+     * @param stats     Filled with the totals.
+     */
+    virtual void GetJitStats(IPluginRuntime* runtime, JitStats* stats) = 0;
+
+    /**
+     * @brief Writes one line per compiled method of a plugin, with its p-code
+     * and machine code size, compile time, and out-of-line paths and thunks,
+     * most expensive first, followed by the totals.
+     *
+     * @param runtime   Plugin runtime.
+     * @param path      File to write.
+     * @return          True on success, false otherwise.
+     */
+    virtual bool WriteJitReport(IPluginRuntime* runtime, const char* path) = 0;
+
+    /**
+     * @brief Starts recording the invocations made into a plugin: their
+     * arguments, the return value of each native they call, and how long
+     * they take. The recording can be replayed against the same plugin with
+     * spshell --replay, to benchmark with a real workload. Natives' writes
+     * through references are not recorded. While any plugin is recorded,
+     * every native call is a little slower.
+     *
+     * @param runtime   Plugin runtime.
+     * @param path      File to write; replaces any recording in progress.
+     * @return          False if the file could not be created.
+     */
+    virtual bool StartRecording(IPluginRuntime* runtime, const char* path) = 0;
+
+    /**
+     * @brief Stops recording a plugin, and closes the file.
+     *
+     * @param runtime   Plugin runtime.
+     * @return          False if the recording could not be written.
+     */
+    virtual bool StopRecording(IPluginRuntime* runtime) = 0;
+
+    /**
+     * @brief Publishes the host's native manifest, a list of native names
+     * under an id. Plugins compiled with spcomp --native-manifest against a
+     * file with the same id and names bind in BindRegisteredNatives by
+     * index, rather than by name. The file has a line "natives <id>", then
+     * one line per name, in this order. Names are copied.
+     *
+     * @param id        Manifest id; change it whenever names are removed or
+     *                  reordered.
+     * @param names     Native names.
+     * @param count     Number of names.
+     * @return          False if out of memory.
+     */
+    virtual bool SetNativeManifest(uint32_t id, const char* const* names, size_t count) = 0;
+
+    /**
+     * @brief Replaces the code of a loaded plugin with a newer build of it,
+     * without reloading it. The plugin's memory, native bindings and
+     * function pointers are kept: globals keep their values, except those
+     * whose initial value changed in the new build, which take the new one.
+     *
+     * The new build must import the same natives and export the same
+     * publics and pubvars, in the same order, and its .data must be laid
+     * out the same way; if both builds have debug info, every global must
+     * be at the same address. Methods whose code didn't change keep their
+     * compiled code. This must not be called while the plugin is running.
+     *
+     * @param runtime   Plugin runtime.
+     * @param file      Path to the new build.
+     * @param error     Buffer to store an error message (optional).
+     * @param maxlength Maximum length of the error buffer.
+     * @return          False if the file could not be loaded or is not
+     *                  compatible, in which case the plugin is unchanged.
+     */
+    virtual bool ReplaceCode(IPluginRuntime* runtime, const char* file, char* error,
+                             size_t maxlength) = 0;
 };
 
+/**
+ * @brief Called by ISourcePawnEnvironment::RunQueuedCallbacks after a
+ * queued callback has run. |ok| is false if the callback threw an error or
+ * its plugin was paused, in which case |result| is 0.
+ */
+typedef void (*SPVM_QUEUED_CALLBACK_FUNC)(IPluginFunction* function, bool ok, cell_t result,
+                                          void* data);
+
 // @brief This class is the v3 API for SourcePawn. It provides access to
 // the original v1 and v2 APIs as well.
 class ISourcePawnEnvironment
@@ -1628,6 +2389,40 @@ class ISourcePawnEnvironment
     // @brief Enables the line debugger callbacks. This must be called
     // before any plugins are loaded.
     virtual bool EnableDebugBreak() = 0;
+
+    // @brief Enables invocation budgets. Each function call and loop test
+    // in a plugin then spends one unit of budget, which is refilled each
+    // time the host enters the VM, and the invocation fails with
+    // SP_ERROR_BUDGET if it runs out. Unlike the watchdog timer, this
+    // measures the same cost every time a plugin runs. This must be called
+    // before any plugins are loaded.
+    virtual bool EnableInvocationBudgets() = 0;
+
+    // @brief Sets how many units of budget each invocation from the host
+    // has. 0, the default, means the largest budget there is (INT32_MAX).
+    virtual void SetInvocationBudget(uint32_t units) = 0;
+
+    // @brief Returns how many units of budget the last invocation from the
+    // host spent.
+    virtual uint32_t GetInvocationBudgetSpent() = 0;
+
+    // @brief Queues a call to |function| with |num_params| cells, copied
+    // now, to run on the next call to RunQueuedCallbacks. Arguments are
+    // passed by value, so anything by reference must live in the plugin.
+    // Callbacks with a higher priority run first; then those with the
+    // earlier deadline, with 0 meaning none; then in the order they were
+    // queued. |done|, which may be null, is given the result. Callbacks
+    // for a plugin are dropped when it is unloaded. Returns false if there
+    // are too many parameters.
+    virtual bool QueueCallback(IPluginFunction* function, const cell_t* params,
+                               unsigned int num_params, int priority, uint64_t deadline,
+                               SPVM_QUEUED_CALLBACK_FUNC done, void* data) = 0;
+
+    // @brief Runs the callbacks that were queued before this call, until
+    // there are none left or |max_us| microseconds (0 for no limit) have
+    // passed, and returns how many ran. Anything left over, or queued by
+    // the callbacks themselves, waits for the next call.
+    virtual size_t RunQueuedCallbacks(uint32_t max_us) = 0;
 };
 
 // @brief This class is the entry-point to using SourcePawn from a DLL.
@@ -1638,7 +2433,8 @@ class ISourcePawnFactory
     virtual int ApiVersion() = 0;
 
     // @brief Initializes a new environment on the current thread.
-    // Currently, at most one environment may be created in a process.
+    // At most one environment may exist per thread; environments on
+    // different threads are independent and may run concurrently.
     virtual ISourcePawnEnvironment* NewEnvironment() = 0;
 
     // @brief Returns the environment for the calling thread.
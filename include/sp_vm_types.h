@@ -94,7 +94,8 @@ typedef uint32_t funcid_t; /**< Function index code */
 #define SP_ERROR_TIMEOUT 30             /**< Timeout */
 #define SP_ERROR_USER 31                /**< Custom message */
 #define SP_ERROR_FATAL 32               /**< Custom fatal message */
-#define SP_MAX_ERROR_CODES 33
+#define SP_ERROR_BUDGET 33              /**< Invocation ran out of budget */
+#define SP_MAX_ERROR_CODES 34
 //Hey you! Update the string table if you add to the end of me! */
 
 // Maximum number of dimensions.
@@ -157,6 +158,15 @@ typedef struct sp_pubvar_s {
 
 #define SP_NTVFLAG_OPTIONAL (1 << 0)  /**< Native is optional */
 #define SP_NTVFLAG_EPHEMERAL (1 << 1) /**< Native can be unbound */
+#define SP_NTVFLAG_NOREENTRY (1 << 2) /**< Native never calls back into plugins */
+
+/**
+ * @brief Native's result depends only on its arguments, which are all cells
+ * passed by value, until the plugin calls a native without this flag or
+ * returns to the host. It must never call back into plugins. Compiled code
+ * may reuse an earlier result instead of calling it again.
+ */
+#define SP_NTVFLAG_PURE (1 << 3)
 
 /** 
  * @brief Information about a native entry in a plugin.
@@ -194,6 +204,45 @@ typedef struct sp_nativeinfo_s {
     SPVM_NATIVE_FUNC func; /**< Address of native implementation */
 } sp_nativeinfo_t;
 
+/**
+ * @brief How a typed native receives one argument.
+ */
+#define SP_NATIVEARG_CELL (0)   /**< cell_t, by value */
+#define SP_NATIVEARG_FLOAT (1)  /**< cell_t holding float bits (see sp_ctof) */
+#define SP_NATIVEARG_REF (2)    /**< cell_t* into plugin memory */
+#define SP_NATIVEARG_STRING (3) /**< char* into plugin memory */
+
+/**
+ * @brief Most arguments a typed native can take. Along with the context,
+ * they all fit in argument registers on every supported ABI.
+ */
+#define SP_TYPED_NATIVE_MAX_ARGS (3)
+
+/**
+ * @brief Typed native callback prototype. The real function takes the
+ * context followed by exactly the arguments its signature describes, and
+ * is cast to this type when registered:
+ *
+ *   cell_t IsValidClient(IPluginContext* cx, cell_t client);
+ *   cell_t GetName(IPluginContext* cx, cell_t client, char* buffer);
+ */
+typedef cell_t (*SPVM_TYPED_NATIVE_FUNC)();
+
+/**
+ * @brief Used for setting typed natives from modules/host apps.
+ *
+ * A typed native is called with its arguments already unpacked, rather
+ * than with a params array. The VM checks the argument count and that
+ * references and strings point into plugin memory before the call, so the
+ * native does neither.
+ */
+typedef struct sp_typed_nativeinfo_s {
+    const char* name;            /**< Name of the native */
+    SPVM_TYPED_NATIVE_FUNC func; /**< Address of native implementation */
+    uint32_t nargs;              /**< Number of arguments, up to SP_TYPED_NATIVE_MAX_ARGS */
+    uint8_t args[SP_TYPED_NATIVE_MAX_ARGS]; /**< SP_NATIVEARG_* for each argument */
+} sp_typed_nativeinfo_t;
+
 /** 
  * @brief Run-time debug file table
  */
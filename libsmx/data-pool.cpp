@@ -18,35 +18,105 @@
 
 #include "data-pool.h"
 
+#include <algorithm>
 #include <utility>
 
 namespace sp { 
 
 DataPool::DataPool()
+ : bytes_added_(0)
 {
   pool_map_.init(64);
+  windows_.init(64);
   buffer_.write<uint8_t>(0);
 }
 
+static inline uint32_t
+ReadWindow(const uint8_t* bytes)
+{
+  uint32_t window;
+  memcpy(&window, bytes, sizeof(window));
+  return window;
+}
+
+// Returns the offset of a copy of |bytes| already in the pool, or 0.
+uint32_t
+DataPool::findInPool(const uint8_t* bytes, size_t length) const
+{
+  if (length < kWindow)
+    return 0;
+
+  WindowMap::Result r = windows_.find(ReadWindow(bytes));
+  if (!r.found())
+    return 0;
+
+  const uint8_t* pool = buffer_.bytes();
+  for (uint32_t offset : r->value) {
+    if (offset + length <= buffer_.size() && memcmp(pool + offset, bytes, length) == 0)
+      return offset;
+  }
+  return 0;
+}
+
+// Returns the length of the longest proper prefix of |bytes| that the pool
+// ends with. The leading zero byte is never part of it, since offset 0 means
+// failure.
+size_t
+DataPool::tailOverlap(const uint8_t* bytes, size_t length) const
+{
+  const uint8_t* end = buffer_.bytes() + buffer_.size();
+  for (size_t n = std::min(length - 1, bytes_stored()); n > 0; n--) {
+    if (memcmp(end - n, bytes, n) == 0)
+      return n;
+  }
+  return 0;
+}
+
+// Indexes every window starting at or after |from| that now fits.
+void
+DataPool::indexWindows(size_t from)
+{
+  const uint8_t* pool = buffer_.bytes();
+  for (size_t offset = std::max<size_t>(from, 1); offset + kWindow <= buffer_.size(); offset++) {
+    uint32_t window = ReadWindow(pool + offset);
+    WindowMap::Insert p = windows_.findForAdd(window);
+    if (!p.found() && !windows_.add(p, window, std::vector<uint32_t>()))
+      return;
+    p->value.push_back(uint32_t(offset));
+  }
+}
+
 uint32_t
-DataPool::add(const std::vector<uint8_t>& run)
+DataPool::add(const uint8_t* bytes, size_t length)
 {
   BytesAndLength tmp_key;
-  tmp_key.bytes = run.data();
-  tmp_key.length = run.size();
+  tmp_key.bytes = bytes;
+  tmp_key.length = length;
+
+  bytes_added_ += length;
 
   DataPoolMap::Insert p = pool_map_.findForAdd(tmp_key);
   if (p.found())
     return p->value;
 
-  uint32_t index = buffer_.position();
-  if (!buffer_.writeBytes(run.data(), run.size()))
-    return 0;
+  uint32_t index = findInPool(bytes, length);
+  if (!index && length) {
+    size_t old_size = buffer_.size();
+    size_t overlap = tailOverlap(bytes, length);
+    index = uint32_t(old_size - overlap);
+    if (!buffer_.writeBytes(bytes + overlap, length - overlap))
+      return 0;
+
+    // Windows that straddle the old end are new too.
+    indexWindows(old_size >= kWindow ? old_size - kWindow + 1 : 0);
+  } else if (!index) {
+    index = buffer_.position();
+  }
 
   ByteRun key;
-  key.bytes = std::make_unique<uint8_t[]>(run.size());
-  key.length = run.size();
-  memcpy(key.bytes.get(), run.data(), key.length);
+  key.bytes = std::make_unique<uint8_t[]>(length);
+  key.length = length;
+  memcpy(key.bytes.get(), bytes, length);
   pool_map_.add(p, std::move(key), index);
   return index;
 }
@@ -24,6 +24,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <amtl/am-hashmap.h>
 #include <amtl/am-vector.h>
@@ -33,17 +34,44 @@ namespace sp {
 
 using namespace ke;
 
+// Stores byte runs end to end and returns the offset of each one. Runs are
+// read back from their offset alone, so every run must be self-delimiting,
+// like the RTTI type encodings are. That lets a run be shared with any copy
+// of the same bytes already in the pool: an identical run, one that occurs
+// inside a longer run, or, by appending only the rest, one that starts
+// with the bytes at the end of the pool.
 class DataPool
 {
  public:
   DataPool();
 
-  uint32_t add(const std::vector<uint8_t>& run);
+  uint32_t add(const uint8_t* bytes, size_t length);
+  uint32_t add(const std::vector<uint8_t>& run) {
+    return add(run.data(), run.size());
+  }
 
   const ByteBuffer& buffer() const {
     return buffer_;
   }
 
+  // The total length of every run added, and how much of the pool they
+  // take up. The pool's leading zero byte isn't counted.
+  size_t bytes_added() const {
+    return bytes_added_;
+  }
+  size_t bytes_stored() const {
+    return buffer_.size() - 1;
+  }
+
+ private:
+  // Runs at least this long are found inside earlier runs, through an index
+  // of the first kWindow bytes at every position in the pool.
+  static const size_t kWindow = 4;
+
+  uint32_t findInPool(const uint8_t* bytes, size_t length) const;
+  size_t tailOverlap(const uint8_t* bytes, size_t length) const;
+  void indexWindows(size_t from);
+
  private:
   struct ByteRun {
     ByteRun()
@@ -76,6 +104,19 @@ class DataPool
 
   typedef HashMap<ByteRun, uint32_t, ByteRunPolicy> DataPoolMap;
   DataPoolMap pool_map_;
+
+  struct WindowPolicy {
+    static uint32_t hash(uint32_t key) {
+      return HashInteger<4>(key);
+    }
+    static bool matches(uint32_t key, uint32_t other) {
+      return key == other;
+    }
+  };
+  typedef HashMap<uint32_t, std::vector<uint32_t>, WindowPolicy> WindowMap;
+  WindowMap windows_;
+
+  size_t bytes_added_;
 };
 
 } // namespace sp
@@ -15,6 +15,8 @@
 //
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
+#include <algorithm>
+
 #include "smx-builder.h"
 #include "shared/string-pool.h"
 
@@ -23,7 +25,31 @@ namespace sp {
 using namespace ke;
 
 SmxBuilder::SmxBuilder()
+ : page_aligned_(false)
+{
+}
+
+// Returns where |section| starts if the previous section ended at |offset|.
+size_t
+SmxBuilder::placeSection(size_t offset, const SmxSection* section) const
 {
+  if (!page_aligned_)
+    return offset;
+  size_t payload = section->payloadOffset();
+  return Align(offset + payload, SmxConsts::FILE_PAGE_ALIGNMENT) - payload;
+}
+
+static bool
+WritePadding(ISmxBuffer* buf, size_t bytes)
+{
+  static const uint8_t kZeroes[256] = {};
+  while (bytes) {
+    size_t chunk = bytes < sizeof(kZeroes) ? bytes : sizeof(kZeroes);
+    if (!buf->write(kZeroes, chunk))
+      return false;
+    bytes -= chunk;
+  }
+  return true;
 }
 
 bool
@@ -44,14 +70,18 @@ SmxBuilder::write(ISmxBuffer* buf)
   header.dataoffs = header.disksize;
 
   size_t current_string_offset = 0;
-  for (size_t i = 0; i < sections_.size(); i++) {
-    RefPtr<SmxSection> section = sections_[i];
-    header.disksize += section->length();
-    current_string_offset += section->name().size() + 1;
-  }
+  for (size_t i = 0; i < sections_.size(); i++)
+    current_string_offset += sections_[i]->name().size() + 1;
   header.disksize += current_string_offset;
   header.dataoffs += current_string_offset;
 
+  // Sections follow the names, padded if the layout is page-aligned.
+  std::vector<size_t> offsets;
+  for (size_t i = 0; i < sections_.size(); i++) {
+    offsets.push_back(placeSection(header.disksize, sections_[i].get()));
+    header.disksize = offsets.back() + sections_[i]->length();
+  }
+
   header.imagesize = header.disksize;
   header.sections = sections_.size();
 
@@ -62,18 +92,16 @@ SmxBuilder::write(ISmxBuffer* buf)
     return false;
 
   size_t current_offset = sizeof(header);
-  size_t current_data_offset = header.stringtab + current_string_offset;
   current_string_offset = 0;
   for (size_t i = 0; i < sections_.size(); i++) {
     sp_file_section_t s;
     s.nameoffs = current_string_offset;
-    s.dataoffs = current_data_offset;
+    s.dataoffs = offsets[i];
     s.size = sections_[i]->length();
     if (!buf->write(&s, sizeof(s)))
       return false;
 
     current_offset += sizeof(s);
-    current_data_offset += s.size;
     current_string_offset += sections_[i]->name().size() + 1;
   }
   assert(buf->pos() == current_offset);
@@ -89,6 +117,10 @@ SmxBuilder::write(ISmxBuffer* buf)
   assert(buf->pos() == current_offset);
 
   for (size_t i = 0; i < sections_.size(); i++) {
+    if (!WritePadding(buf, offsets[i] - current_offset))
+      return false;
+    current_offset = offsets[i];
+
     if (!sections_[i]->write(buf))
       return false;
     current_offset += sections_[i]->length();
@@ -106,6 +138,14 @@ SmxNameTable::add(StringPool& pool, const char* str)
   return add(pool.add(str));
 }
 
+Atom*
+SmxNameTable::nameAt(uint32_t offset) const
+{
+  auto iter = std::lower_bound(offsets_.begin(), offsets_.end(), offset);
+  assert(iter != offsets_.end() && *iter == offset);
+  return names_[iter - offsets_.begin()];
+}
+
 bool
 SmxNameTable::write(ISmxBuffer* buf)
 {
@@ -117,4 +157,105 @@ SmxNameTable::write(ISmxBuffer* buf)
   return true;
 }
 
+void
+SmxLineTableSection::add(uint32_t addr, uint32_t line)
+{
+  if (count_ % kBlockSize == 0) {
+    sp_fdbg_lineblock_t block;
+    block.addr = addr;
+    block.line = line;
+    block.offset = uint32_t(stream_.size());
+    blocks_.push_back(block);
+  } else {
+    assert(addr >= last_addr_);
+    int32_t delta = int32_t(line - last_line_);
+    writeVarint(addr - last_addr_);
+    writeVarint((uint32_t(delta) << 1) ^ uint32_t(delta >> 31));
+  }
+  last_addr_ = addr;
+  last_line_ = line;
+  count_++;
+}
+
+void
+SmxLineTableSection::writeVarint(uint32_t value)
+{
+  while (value >= 0x80) {
+    stream_.push_back(uint8_t(value | 0x80));
+    value >>= 7;
+  }
+  stream_.push_back(uint8_t(value));
+}
+
+bool
+SmxLineTableSection::write(ISmxBuffer* buf)
+{
+  sp_fdbg_linetable_t header;
+  header.num_lines = count_;
+  header.block_size = kBlockSize;
+  header.num_blocks = uint32_t(blocks_.size());
+  if (!buf->write(&header, sizeof(header)))
+    return false;
+  if (!blocks_.empty() && !buf->write(blocks_.data(), blocks_.size() * sizeof(blocks_[0])))
+    return false;
+  if (!stream_.empty() && !buf->write(stream_.data(), stream_.size()))
+    return false;
+  return true;
+}
+
+// Keeps tables at most half full, so probes stay short.
+uint32_t
+SmxNameHashSection::SlotsFor(size_t rows)
+{
+  if (!rows)
+    return 0;
+  uint32_t slots = 2;
+  while (slots < rows * 2)
+    slots *= 2;
+  return slots;
+}
+
+size_t
+SmxNameHashSection::length() const
+{
+  size_t slots = 0;
+  for (size_t i = 0; i < kNumTables; i++)
+    slots += SlotsFor(rows_[i].size());
+  return sizeof(sp_file_name_hash_t) + slots * sizeof(sp_file_name_hash_entry_t);
+}
+
+bool
+SmxNameHashSection::write(ISmxBuffer* buf)
+{
+  sp_file_name_hash_t header;
+  header.natives_slots = SlotsFor(rows_[Natives].size());
+  header.publics_slots = SlotsFor(rows_[Publics].size());
+  header.pubvars_slots = SlotsFor(rows_[Pubvars].size());
+  if (!buf->write(&header, sizeof(header)))
+    return false;
+
+  for (size_t i = 0; i < kNumTables; i++) {
+    const std::vector<uint32_t>& rows = rows_[i];
+
+    sp_file_name_hash_entry_t empty;
+    empty.hash = 0;
+    empty.row = NAME_HASH_EMPTY;
+    std::vector<sp_file_name_hash_entry_t> slots(SlotsFor(rows.size()), empty);
+
+    uint32_t mask = uint32_t(slots.size()) - 1;
+    for (size_t row = 0; row < rows.size(); row++) {
+      uint32_t hash = SmxNameHash(names_->nameAt(rows[row])->chars());
+      uint32_t slot = hash & mask;
+      while (slots[slot].row != NAME_HASH_EMPTY)
+        slot = (slot + 1) & mask;
+      slots[slot].hash = hash;
+      slots[slot].row = uint32_t(row);
+    }
+
+    if (!slots.empty() && !buf->write(slots.data(), slots.size() * sizeof(slots[0])))
+      return false;
+  }
+  return true;
+}
+
 } // namespace sp
@@ -24,6 +24,7 @@
 #include <amtl/am-refcounting.h>
 #include <smx/smx-headers.h>
 #include <smx/smx-typeinfo.h>
+#include <smx/smx-v1.h>
 #include <stdlib.h>
 #include "shared/string-atom.h"
 #include "smx-buffer.h"
@@ -49,6 +50,11 @@ class SmxSection : public ke::Refcounted<SmxSection>
     return false;
   }
 
+  // Offset of the bytes that a page-aligned layout puts on a page boundary.
+  virtual size_t payloadOffset() const {
+    return 0;
+  }
+
   const std::string& name() const {
     return name_;
   }
@@ -89,6 +95,9 @@ class SmxBlobSection : public SmxSection
   size_t length() const override {
     return sizeof(t_) + extra_len_;
   }
+  size_t payloadOffset() const override {
+    return sizeof(t_);
+  }
 
  private:
   T t_;
@@ -216,10 +225,14 @@ class SmxNameTable : public SmxSection
     uint32_t index = buffer_size_;
     name_table_.add(i, str, index);
     names_.push_back(str);
+    offsets_.push_back(index);
     buffer_size_ += str->length() + 1;
     return index;
   }
 
+  // Returns the name at |offset|, which add() must have returned.
+  Atom* nameAt(uint32_t offset) const;
+
   bool write(ISmxBuffer* buf) override;
   size_t length() const override {
     return buffer_size_;
@@ -238,9 +251,84 @@ class SmxNameTable : public SmxSection
 
   NameTable name_table_;
   std::vector<Atom*> names_;
+  std::vector<uint32_t> offsets_;
   uint32_t buffer_size_;
 };
 
+// The .dbg.linetable section (see smx-v1.h). Entries must be added in address
+// order; each is encoded as it is added.
+class SmxLineTableSection : public SmxSection
+{
+ public:
+  static const uint32_t kBlockSize = 32;
+
+  SmxLineTableSection(const char* name)
+   : SmxSection(name),
+     count_(0),
+     last_addr_(0),
+     last_line_(0)
+  {
+  }
+
+  void add(uint32_t addr, uint32_t line);
+
+  bool write(ISmxBuffer* buf) override;
+  size_t length() const override {
+    return sizeof(sp_fdbg_linetable_t) + blocks_.size() * sizeof(sp_fdbg_lineblock_t) +
+           stream_.size();
+  }
+  bool empty() const override {
+    return !count_;
+  }
+
+ private:
+  void writeVarint(uint32_t value);
+
+ private:
+  uint32_t count_;
+  uint32_t last_addr_;
+  uint32_t last_line_;
+  std::vector<sp_fdbg_lineblock_t> blocks_;
+  std::vector<uint8_t> stream_;
+};
+
+// The .names.hash section: natives, publics and pubvars indexed by name, so
+// a loader can find them without hashing every name (see smx-v1.h). Rows are
+// added in the order of their sections, by their offsets into |names|.
+class SmxNameHashSection : public SmxSection
+{
+ public:
+  enum Table {
+    Natives,
+    Publics,
+    Pubvars,
+    kNumTables
+  };
+
+  SmxNameHashSection(const char* name, const ke::RefPtr<SmxNameTable>& names)
+   : SmxSection(name),
+     names_(names)
+  {
+  }
+
+  void add(Table table, uint32_t name_offset) {
+    rows_[table].push_back(name_offset);
+  }
+
+  bool write(ISmxBuffer* buf) override;
+  size_t length() const override;
+  bool empty() const override {
+    return rows_[Natives].empty() && rows_[Publics].empty() && rows_[Pubvars].empty();
+  }
+
+ private:
+  static uint32_t SlotsFor(size_t rows);
+
+ private:
+  ke::RefPtr<SmxNameTable> names_;
+  std::vector<uint32_t> rows_[kNumTables];
+};
+
 class SmxBuilder
 {
  public:
@@ -248,6 +336,12 @@ class SmxBuilder
 
   bool write(ISmxBuffer* buf);
 
+  // Pads the file so every section's payload starts on a page boundary
+  // (SmxConsts::FILE_PAGE_ALIGNMENT). The file must then not be compressed.
+  void setPageAligned(bool page_aligned) {
+    page_aligned_ = page_aligned;
+  }
+
   void add(const ke::RefPtr<SmxSection>& section) {
     sections_.push_back(section);
   }
@@ -256,8 +350,16 @@ class SmxBuilder
       sections_.push_back(section);
   }
 
+  const std::vector<ke::RefPtr<SmxSection>>& sections() const {
+    return sections_;
+  }
+
+ private:
+  size_t placeSection(size_t offset, const SmxSection* section) const;
+
  private:
   std::vector<ke::RefPtr<SmxSection>> sections_;
+  bool page_aligned_;
 };
 
 } // namespace sp
@@ -0,0 +1,239 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2012-2018 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+
+#ifndef _include_sourcepawn_shared_lz4_block_h
+#define _include_sourcepawn_shared_lz4_block_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace sp {
+
+// A minimal, self-contained codec for the LZ4 block format. Output of
+// Lz4Compress can be decoded by any conforming LZ4 block decoder, and
+// Lz4Decompress accepts any conforming block. The compressor is a simple
+// greedy single-probe matcher: it trades some ratio for speed and for not
+// needing any state beyond a small hash table. Decompression is the part
+// that matters for plugin loading, and it is bounds-checked against both
+// the input and output buffers.
+static const size_t kLz4MinMatch = 4;
+static const size_t kLz4HashLog = 12;
+static const size_t kLz4MaxOffset = 65535;
+
+// Neither a match nor its extension may reach into the last few bytes of a
+// block; these are always encoded as literals.
+static const size_t kLz4LastLiterals = 5;
+static const size_t kLz4MatchStartLimit = 12;
+
+static inline size_t
+Lz4CompressBound(size_t length)
+{
+  return length + (length / 255) + 16;
+}
+
+namespace detail {
+
+static inline uint32_t
+Lz4Read32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t
+Lz4Hash(uint32_t seq)
+{
+  return (seq * 2654435761u) >> (32 - kLz4HashLog);
+}
+
+static inline bool
+Lz4WriteLength(uint8_t*& op, uint8_t* oend, size_t length)
+{
+  // The first 15 units are stored in the token.
+  length -= 15;
+  while (length >= 255) {
+    if (op >= oend)
+      return false;
+    *op++ = 255;
+    length -= 255;
+  }
+  if (op >= oend)
+    return false;
+  *op++ = uint8_t(length);
+  return true;
+}
+
+static inline bool
+Lz4EmitSequence(uint8_t*& op, uint8_t* oend, const uint8_t* literals, size_t nliterals,
+                size_t offset, size_t match_length)
+{
+  if (op >= oend)
+    return false;
+
+  uint8_t* token = op++;
+  *token = uint8_t((nliterals >= 15 ? 15 : nliterals) << 4);
+  if (nliterals >= 15 && !Lz4WriteLength(op, oend, nliterals))
+    return false;
+  if (nliterals > size_t(oend - op))
+    return false;
+  memcpy(op, literals, nliterals);
+  op += nliterals;
+
+  // The final sequence of a block has no match part.
+  if (!match_length)
+    return true;
+
+  if (size_t(oend - op) < 2)
+    return false;
+  *op++ = uint8_t(offset & 0xff);
+  *op++ = uint8_t(offset >> 8);
+
+  size_t ml = match_length - kLz4MinMatch;
+  *token |= uint8_t(ml >= 15 ? 15 : ml);
+  if (ml >= 15 && !Lz4WriteLength(op, oend, ml))
+    return false;
+  return true;
+}
+
+} // namespace detail
+
+// Compress |length| bytes into |dest|. Returns the number of bytes written,
+// or 0 if |dest| is too small. A buffer of Lz4CompressBound(length) bytes is
+// always large enough.
+static inline size_t
+Lz4Compress(const uint8_t* src, size_t length, uint8_t* dest, size_t capacity)
+{
+  uint8_t* op = dest;
+  uint8_t* oend = dest + capacity;
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + length;
+
+  if (length > kLz4MatchStartLimit) {
+    const uint8_t* mflimit = end - kLz4MatchStartLimit;
+    const uint8_t* matchlimit = end - kLz4LastLiterals;
+
+    // Positions are stored biased by one so that zero means "empty".
+    uint32_t table[1 << kLz4HashLog];
+    memset(table, 0, sizeof(table));
+
+    while (ip < mflimit) {
+      uint32_t seq = detail::Lz4Read32(ip);
+      uint32_t h = detail::Lz4Hash(seq);
+      uint32_t candidate = table[h];
+      table[h] = uint32_t(ip - src) + 1;
+
+      if (!candidate) {
+        ip++;
+        continue;
+      }
+
+      const uint8_t* match = src + candidate - 1;
+      if (size_t(ip - match) > kLz4MaxOffset || detail::Lz4Read32(match) != seq) {
+        ip++;
+        continue;
+      }
+
+      const uint8_t* mp = ip + kLz4MinMatch;
+      const uint8_t* mm = match + kLz4MinMatch;
+      while (mp < matchlimit && *mp == *mm) {
+        mp++;
+        mm++;
+      }
+
+      if (!detail::Lz4EmitSequence(op, oend, anchor, ip - anchor, ip - match, mp - ip))
+        return 0;
+      ip = mp;
+      anchor = ip;
+    }
+  }
+
+  if (!detail::Lz4EmitSequence(op, oend, anchor, end - anchor, 0, 0))
+    return 0;
+  return op - dest;
+}
+
+// Decompress |length| bytes from |src| into exactly |expected| bytes at
+// |dest|. Returns false if the input is malformed, or if it does not decode
+// to exactly |expected| bytes.
+static inline bool
+Lz4Decompress(const uint8_t* src, size_t length, uint8_t* dest, size_t expected)
+{
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + length;
+  uint8_t* op = dest;
+  uint8_t* oend = dest + expected;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    size_t nliterals = token >> 4;
+    if (nliterals == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend)
+          return false;
+        b = *ip++;
+        nliterals += b;
+      } while (b == 255);
+    }
+    if (nliterals > size_t(iend - ip) || nliterals > size_t(oend - op))
+      return false;
+    memcpy(op, ip, nliterals);
+    op += nliterals;
+    ip += nliterals;
+
+    // The last sequence ends after its literals.
+    if (ip == iend)
+      break;
+
+    if (size_t(iend - ip) < 2)
+      return false;
+    size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+    ip += 2;
+    if (!offset || offset > size_t(op - dest))
+      return false;
+
+    size_t match_length = token & 15;
+    if (match_length == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend)
+          return false;
+        b = *ip++;
+        match_length += b;
+      } while (b == 255);
+    }
+    match_length += kLz4MinMatch;
+    if (match_length > size_t(oend - op))
+      return false;
+
+    // Matches may overlap the bytes being written, so copy forward.
+    const uint8_t* match = op - offset;
+    for (size_t i = 0; i < match_length; i++)
+      op[i] = match[i];
+    op += match_length;
+  }
+  return op == oend;
+}
+
+} // namespace sp
+
+#endif // _include_sourcepawn_shared_lz4_block_h
@@ -0,0 +1,229 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2012-2018 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+
+#ifndef _include_sourcepawn_shared_phase_timer_h
+#define _include_sourcepawn_shared_phase_timer_h
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#if defined(_WIN32)
+# include <windows.h>
+# include <psapi.h>
+#else
+# include <sys/resource.h>
+#endif
+
+namespace sp {
+
+// Returns the most memory this process has had resident so far, in bytes,
+// or 0 if the platform can't tell.
+static inline size_t
+PeakResidentBytes()
+{
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+# if defined(__APPLE__)
+  return size_t(usage.ru_maxrss);
+# else
+  return size_t(usage.ru_maxrss) * 1024;
+# endif
+#endif
+}
+
+// Attributes the wall time of a compile to its phases. Phases nest: entering
+// one pauses the phase that was running until it is left again, so each
+// moment is counted once and the phase times add up to the total. Memory is
+// sampled only when an outermost phase starts and ends, since nested phases
+// like lexing switch far too often to ask the system each time: the growth
+// reported by the usage function (if any) and the peak resident size are
+// attributed to the outermost phase. Nothing is measured until start().
+class PhaseTimer
+{
+ public:
+  typedef size_t (*UsageFn)();
+
+  PhaseTimer(const char* const* names, size_t nphases, UsageFn usage = nullptr)
+   : names_(names),
+     nphases_(nphases),
+     usage_(usage),
+     enabled_(false),
+     depth_(0)
+  {
+    assert(nphases <= kMaxPhases);
+    clear();
+  }
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  // Time spent in |phase|, not counting phases nested in it, and how many
+  // times it was entered, as of the last stop().
+  uint64_t ns(size_t phase) const {
+    assert(phase < nphases_);
+    return phases_[phase].ns;
+  }
+  uint64_t entries(size_t phase) const {
+    assert(phase < nphases_);
+    return phases_[phase].entries;
+  }
+
+  void start() {
+    clear();
+    enabled_ = true;
+    depth_ = 0;
+    total_start_ = Clock::now();
+  }
+  void stop() {
+    while (depth_)
+      leave();
+    total_ns_ = ElapsedNs(total_start_, Clock::now());
+    peak_rss_ = PeakResidentBytes();
+    enabled_ = false;
+  }
+
+  void enter(size_t phase) {
+    assert(phase < nphases_);
+    if (!enabled_)
+      return;
+    Clock::time_point now = Clock::now();
+    if (depth_) {
+      charge(stack_[depth_ - 1], now);
+    } else {
+      last_ = now;
+      last_usage_ = usage_ ? usage_() : 0;
+    }
+    if (depth_ < kMaxDepth)
+      stack_[depth_] = phase;
+    depth_++;
+    phases_[phase].entries++;
+  }
+  void leave() {
+    if (!enabled_ || !depth_)
+      return;
+    depth_--;
+    if (depth_ < kMaxDepth)
+      charge(stack_[depth_], Clock::now());
+    if (depth_)
+      return;
+
+    Phase& outer = phases_[stack_[0]];
+    if (usage_) {
+      size_t usage = usage_();
+      outer.memory += int64_t(usage) - int64_t(last_usage_);
+      last_usage_ = usage;
+    }
+    size_t rss = PeakResidentBytes();
+    if (rss > outer.peak_rss)
+      outer.peak_rss = rss;
+  }
+
+  void report(FILE* fp) const {
+    fprintf(fp, "%-24s %10s %7s %10s %12s %12s\n", "Phase", "Time (ms)", "%", "Entries",
+            "Memory (KB)", "Peak RSS (KB)");
+    for (size_t i = 0; i < nphases_; i++) {
+      const Phase& phase = phases_[i];
+      double percent = total_ns_ ? 100.0 * double(phase.ns) / double(total_ns_) : 0.0;
+      fprintf(fp, "%-24s %10.3f %6.2f%% %10llu %12lld %12llu\n", names_[i],
+              double(phase.ns) / 1e6, percent, (unsigned long long)phase.entries,
+              (long long)(phase.memory / 1024), (unsigned long long)(phase.peak_rss / 1024));
+    }
+    fprintf(fp, "%-24s %10.3f %45llu\n", "Total", double(total_ns_) / 1e6,
+            (unsigned long long)(peak_rss_ / 1024));
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  static const size_t kMaxPhases = 16;
+  static const size_t kMaxDepth = 32;
+
+  struct Phase {
+    uint64_t ns;
+    uint64_t entries;
+    int64_t memory;
+    size_t peak_rss;
+  };
+
+  static uint64_t ElapsedNs(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+
+  void clear() {
+    memset(phases_, 0, sizeof(phases_));
+    total_ns_ = 0;
+    peak_rss_ = 0;
+    last_usage_ = 0;
+  }
+
+  // Charges the time since the last switch to |phase|.
+  void charge(size_t phase, Clock::time_point now) {
+    phases_[phase].ns += ElapsedNs(last_, now);
+    last_ = now;
+  }
+
+ private:
+  const char* const* names_;
+  size_t nphases_;
+  UsageFn usage_;
+  bool enabled_;
+  size_t depth_;
+  size_t stack_[kMaxDepth];
+  Phase phases_[kMaxPhases];
+  Clock::time_point total_start_;
+  Clock::time_point last_;
+  size_t last_usage_;
+  uint64_t total_ns_;
+  size_t peak_rss_;
+};
+
+// Runs a phase for the lifetime of the scope.
+class AutoPhase
+{
+ public:
+  AutoPhase(PhaseTimer& timer, size_t phase)
+   : timer_(timer.enabled() ? &timer : nullptr)
+  {
+    if (timer_)
+      timer_->enter(phase);
+  }
+  ~AutoPhase() {
+    if (timer_)
+      timer_->leave();
+  }
+
+ private:
+  PhaseTimer* timer_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_shared_phase_timer_h
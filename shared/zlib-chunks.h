@@ -0,0 +1,186 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2012-2018 David Anderson
+//
+// This file is part of SourcePawn.
+//
+// SourcePawn is free software: you can redistribute it and/or modify it under
+// the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// SourcePawn is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+
+#ifndef _include_sourcepawn_shared_zlib_chunks_h
+#define _include_sourcepawn_shared_zlib_chunks_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <amtl/am-thread.h>
+#include <zlib/zlib.h>
+
+namespace sp {
+
+// Splits a region into fixed-size chunks and compresses each one as its own
+// zlib stream, so both ends can spread the work over several threads. The
+// layout is, in little-endian words:
+//
+//   uint32_t chunk_size;     // Uncompressed size of every chunk but the last.
+//   uint32_t num_chunks;
+//   uint32_t sizes[num_chunks];  // Compressed size of each chunk.
+//   ...                      // The zlib streams, in order.
+static const size_t kZlibChunkSize = 256 * 1024;
+
+namespace detail {
+
+static inline uint32_t
+ZlibChunksRead32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void
+ZlibChunksWrite32(uint8_t* p, uint32_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+// Runs |job| for each index below |count| on up to |max_threads| threads,
+// including this one. If threads can't be made, this thread does the rest.
+static inline void
+ZlibChunksRun(size_t count, size_t max_threads, const std::function<void(size_t)>& job)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]() -> void {
+    for (;;) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count)
+        return;
+      job(i);
+    }
+  };
+
+  if (!max_threads)
+    max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t num_threads = std::min(max_threads, count);
+
+  std::vector<std::unique_ptr<std::thread>> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    if (std::unique_ptr<std::thread> thread = ke::NewThread("SourcePawn Compression", worker))
+      threads.push_back(std::move(thread));
+  }
+  worker();
+  for (const auto& thread : threads)
+    thread->join();
+}
+
+} // namespace detail
+
+// Compresses |length| bytes at |src| into |out| at zlib level |level|, using
+// up to |max_threads| threads (0 for one per core). Returns false if zlib
+// fails.
+static inline bool
+ZlibChunksCompress(const uint8_t* src, size_t length, int level, size_t max_threads,
+                   std::vector<uint8_t>* out)
+{
+  size_t num_chunks = (length + kZlibChunkSize - 1) / kZlibChunkSize;
+  std::vector<std::vector<uint8_t>> chunks(num_chunks);
+  std::atomic<bool> ok(true);
+
+  detail::ZlibChunksRun(num_chunks, max_threads, [&](size_t i) -> void {
+    size_t offset = i * kZlibChunkSize;
+    size_t size = std::min(kZlibChunkSize, length - offset);
+    std::vector<uint8_t>& chunk = chunks[i];
+    chunk.resize(compressBound(uLong(size)));
+
+    uLongf chunk_size = uLongf(chunk.size());
+    if (compress2(chunk.data(), &chunk_size, src + offset, uLong(size), level) != Z_OK) {
+      ok = false;
+      return;
+    }
+    chunk.resize(chunk_size);
+  });
+  if (!ok)
+    return false;
+
+  size_t total = sizeof(uint32_t) * (2 + num_chunks);
+  for (const auto& chunk : chunks)
+    total += chunk.size();
+
+  out->resize(total);
+  uint8_t* ptr = out->data();
+  detail::ZlibChunksWrite32(ptr, uint32_t(kZlibChunkSize));
+  detail::ZlibChunksWrite32(ptr + 4, uint32_t(num_chunks));
+  ptr += 8;
+  for (const auto& chunk : chunks) {
+    detail::ZlibChunksWrite32(ptr, uint32_t(chunk.size()));
+    ptr += 4;
+  }
+  for (const auto& chunk : chunks) {
+    memcpy(ptr, chunk.data(), chunk.size());
+    ptr += chunk.size();
+  }
+  return true;
+}
+
+// Decompresses |srclen| bytes at |src| into exactly |destlen| bytes at
+// |dest|, using up to |max_threads| threads (0 for one per core). Returns
+// false if the input is malformed or doesn't fill |dest|.
+static inline bool
+ZlibChunksDecompress(const uint8_t* src, size_t srclen, uint8_t* dest, size_t destlen,
+                     size_t max_threads)
+{
+  if (srclen < 8)
+    return false;
+  size_t chunk_size = detail::ZlibChunksRead32(src);
+  size_t num_chunks = detail::ZlibChunksRead32(src + 4);
+  if (!chunk_size || num_chunks != (destlen + chunk_size - 1) / chunk_size)
+    return false;
+  if ((srclen - 8) / 4 < num_chunks)
+    return false;
+
+  // Find where each stream starts before handing them out.
+  const uint8_t* sizes = src + 8;
+  std::vector<size_t> offsets(num_chunks + 1);
+  offsets[0] = 8 + num_chunks * 4;
+  for (size_t i = 0; i < num_chunks; i++) {
+    size_t size = detail::ZlibChunksRead32(sizes + i * 4);
+    if (size > srclen - offsets[i])
+      return false;
+    offsets[i + 1] = offsets[i] + size;
+  }
+  if (offsets[num_chunks] != srclen)
+    return false;
+
+  std::atomic<bool> ok(true);
+  detail::ZlibChunksRun(num_chunks, max_threads, [&](size_t i) -> void {
+    size_t offset = i * chunk_size;
+    uLongf expected = uLongf(std::min(chunk_size, destlen - offset));
+    uLongf actual = expected;
+    int rv = uncompress(dest + offset, &actual, src + offsets[i],
+                        uLong(offsets[i + 1] - offsets[i]));
+    if (rv != Z_OK || actual != expected)
+      ok = false;
+  });
+  return ok;
+}
+
+} // namespace sp
+
+#endif // _include_sourcepawn_shared_zlib_chunks_h
@@ -0,0 +1,155 @@
+# vim: set ts=2 sw=2 tw=99 et:
+#
+# Runs the benchmarks in this folder through spshell --bench, once for each
+# engine, and prints one line of results per run. Results can be saved as a
+# baseline, and later runs compared against one:
+#
+#   python bench.py <objdir> --save baseline.json
+#   python bench.py <objdir> --baseline baseline.json
+#
+import argparse
+import json
+import os
+import platform
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import testutil
+
+kEngines = {
+  'jit': [],
+  'tiered': ['--tiered-jit'],
+  'interpreter': ['--disable-jit'],
+  'decoding-interpreter': ['--disable-jit', '--disable-predecode'],
+}
+
+kPlatformNames = {
+  'Linux': 'linux',
+  'Darwin': 'mac',
+  'Windows': 'windows',
+}
+
+def main():
+  parser = argparse.ArgumentParser()
+  parser.add_argument('objdir', type=str, help='Build folder to benchmark.')
+  parser.add_argument('bench', type=str, nargs='?', default=None,
+                      help='Only run benchmarks whose name starts with this.')
+  parser.add_argument('--arch', type=str, default=None,
+                      help='Use binaries for this arch on dual-arch builds.')
+  parser.add_argument('--engine', type=str, default=None, action='append', dest='engines',
+                      choices=sorted(kEngines.keys()),
+                      help='Engine to run (default: every one the shell supports).')
+  parser.add_argument('--time', type=int, default=1000,
+                      help='Milliseconds to run each benchmark for.')
+  parser.add_argument('--save', type=str, default=None,
+                      help='Write the results to this file, for use as a baseline.')
+  parser.add_argument('--baseline', type=str, default=None,
+                      help='Compare the results against a file written by --save.')
+  parser.add_argument('--threshold', type=float, default=5.0,
+                      help='Percent slowdown against the baseline that counts as a regression.')
+  args = parser.parse_args()
+
+  spcomp = find_executable(args, os.path.join('compiler', 'spcomp'), 'spcomp')
+  spshell = find_executable(args, os.path.join('vm', 'spshell'), 'spshell')
+  if not spcomp or not spshell:
+    raise Exception('Could not find spcomp and spshell in {0}'.format(args.objdir))
+
+  engines = args.engines
+  if not engines:
+    rc, stdout, stderr = testutil.exec_argv([spshell, '--version'])
+    engines = ['interpreter', 'decoding-interpreter']
+    if rc == 0 and 'JIT' in stdout:
+      engines = ['jit', 'tiered'] + engines
+
+  bench_path = os.path.dirname(os.path.abspath(__file__))
+  tests_path = os.path.dirname(bench_path)
+  core_include_path = os.path.join(os.path.dirname(tests_path), 'include')
+
+  names = sorted(name for name in os.listdir(bench_path) if name.endswith('.sp'))
+  if args.bench:
+    names = [name for name in names if name.startswith(args.bench)]
+  if not names:
+    raise Exception('No matching benchmarks were found.')
+
+  results = []
+  failed = False
+  with testutil.TempFolder() as temp_folder:
+    for name in names:
+      smx_path = os.path.join(temp_folder, os.path.splitext(name)[0] + '.smx')
+      argv = [
+        spcomp,
+        '-i', core_include_path,
+        '-i', tests_path,
+        '-o', smx_path,
+        os.path.join(bench_path, name),
+      ]
+      rc, stdout, stderr = testutil.exec_argv(argv)
+      if rc != 0:
+        sys.stderr.write('Could not compile {0}:\n{1}{2}'.format(name, stdout, stderr))
+        failed = True
+        continue
+
+      for engine in engines:
+        argv = [spshell, '--bench', str(args.time)] + kEngines[engine] + [smx_path]
+        rc, stdout, stderr = testutil.exec_argv(argv)
+        if rc != 0:
+          sys.stderr.write('{0} failed on {1}:\n{2}'.format(name, engine, stderr))
+          failed = True
+          continue
+        result = json.loads(stdout)
+        results.append(result)
+        print('{file:16} {engine:21} {iterations_per_sec:12.2f}/s  '
+              'compile {jit_compile_ms:8.3f}ms  code {code_bytes:8}B  '
+              'heap {heap_high_water:6}B'.format(**result))
+
+  if args.save:
+    with open(args.save, 'w') as fp:
+      json.dump(results, fp, indent=2, sort_keys=True)
+
+  if args.baseline and not compare(args, results):
+    failed = True
+
+  sys.exit(1 if failed else 0)
+
+def find_executable(args, folder, name):
+  search_in = os.path.join(args.objdir, folder)
+  if not os.path.isdir(search_in):
+    return None
+  our_platform = kPlatformNames.get(platform.system(), platform.system())
+  for subdir in sorted(os.listdir(search_in)):
+    parts = subdir.split('-')
+    if len(parts) < 2 or parts[0] != our_platform:
+      continue
+    if args.arch is not None and parts[1] != args.arch:
+      continue
+    path = os.path.join(search_in, subdir, name)
+    for suffix in ['', '.exe']:
+      if os.path.exists(path + suffix):
+        return os.path.abspath(path + suffix)
+  return None
+
+# Returns false if any benchmark got slower than the threshold allows.
+def compare(args, results):
+  with open(args.baseline, 'r') as fp:
+    baseline = json.load(fp)
+  old = {(entry['file'], entry['engine']): entry for entry in baseline}
+
+  ok = True
+  print('')
+  print('Compared to {0}:'.format(args.baseline))
+  for result in results:
+    key = (result['file'], result['engine'])
+    if key not in old:
+      continue
+    before = old[key]['iterations_per_sec']
+    after = result['iterations_per_sec']
+    change = (after - before) * 100.0 / before
+    note = ''
+    if change < -args.threshold:
+      note = '  REGRESSION'
+      ok = False
+    print('{0:16} {1:21} {2:+7.2f}%{3}'.format(key[0], key[1], change, note))
+  return ok
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,157 @@
+# vim: set ts=2 sw=2 tw=99 et:
+#
+# Compiles a fixed corpus (by default, the plugins in tests/sourcemod) with
+# --time-phases and prints how long the compiler spent in each phase, summed
+# over every plugin. Each plugin is compiled --runs times and the fastest
+# run is kept, to keep noise from other processes out of the totals.
+#
+#   python compile-bench.py <objdir>
+#   python compile-bench.py <objdir> --compiler spcomp2 --save phases.json
+#
+import argparse
+import json
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import testutil
+from bench import find_executable
+
+kSpcomp2Args = [
+  '--show-ast=false',
+  '--show-sema=false',
+  '--pool-stats=false',
+]
+
+def main():
+  bench_path = os.path.dirname(os.path.abspath(__file__))
+  tests_path = os.path.dirname(bench_path)
+
+  parser = argparse.ArgumentParser()
+  parser.add_argument('objdir', type=str, help='Build folder to benchmark.')
+  parser.add_argument('corpus', type=str, nargs='?',
+                      default=os.path.join(tests_path, 'sourcemod'),
+                      help='Folder of .sp files to compile.')
+  parser.add_argument('--arch', type=str, default=None,
+                      help='Use binaries for this arch on dual-arch builds.')
+  parser.add_argument('--compiler', type=str, default='spcomp', choices=['spcomp', 'spcomp2'],
+                      help='Compiler to benchmark.')
+  parser.add_argument('--runs', type=int, default=3,
+                      help='Number of times to compile each plugin.')
+  parser.add_argument('--save', type=str, default=None,
+                      help='Write the per-phase totals to this file.')
+  args = parser.parse_args()
+
+  if args.compiler == 'spcomp2':
+    compiler = find_spcomp2(args)
+    extra_args = kSpcomp2Args
+  else:
+    compiler = find_executable(args, os.path.join('compiler', 'spcomp'), 'spcomp')
+    extra_args = []
+  if not compiler:
+    raise Exception('Could not find {0} in {1}'.format(args.compiler, args.objdir))
+
+  include_paths = [os.path.join(os.path.dirname(tests_path), 'include')]
+  if os.path.isdir(os.path.join(args.corpus, 'include')):
+    include_paths.append(os.path.join(args.corpus, 'include'))
+
+  names = sorted(name for name in os.listdir(args.corpus) if name.endswith('.sp'))
+  if not names:
+    raise Exception('No .sp files were found in {0}'.format(args.corpus))
+
+  totals = {}
+  order = []
+  total_ms = 0.0
+  failed = False
+  with testutil.TempFolder() as temp_folder:
+    for name in names:
+      argv = [compiler, '--time-phases'] + extra_args
+      for path in include_paths:
+        argv += ['-i', path]
+      argv += ['-o', os.path.join(temp_folder, os.path.splitext(name)[0] + '.smx')]
+      argv += [os.path.join(args.corpus, name)]
+
+      best = None
+      for i in range(args.runs):
+        rc, stdout, stderr = testutil.exec_argv(argv)
+        if rc != 0:
+          sys.stderr.write('Could not compile {0}:\n{1}{2}'.format(name, stdout, stderr))
+          failed = True
+          break
+        phases, total = parse_report(stdout + stderr)
+        if best is None or total < best[1]:
+          best = (phases, total)
+      if best is None:
+        continue
+
+      phases, total = best
+      print('{0:32} {1:10.3f}ms'.format(name, total))
+      total_ms += total
+      for phase in phases:
+        if phase['name'] not in totals:
+          order.append(phase['name'])
+          totals[phase['name']] = {'name': phase['name'], 'ms': 0.0, 'memory_kb': 0}
+        totals[phase['name']]['ms'] += phase['ms']
+        totals[phase['name']]['memory_kb'] += phase['memory_kb']
+
+  print('')
+  print('{0:32} {1:>12} {2:>7} {3:>12}'.format('Phase', 'Time (ms)', '%', 'Memory (KB)'))
+  for phase_name in order:
+    phase = totals[phase_name]
+    percent = phase['ms'] * 100.0 / total_ms if total_ms else 0.0
+    print('{0:32} {1:12.3f} {2:6.2f}% {3:12}'.format(phase['name'], phase['ms'], percent,
+                                                   phase['memory_kb']))
+  print('{0:32} {1:12.3f}'.format('Total', total_ms))
+
+  if args.save:
+    with open(args.save, 'w') as fp:
+      json.dump({
+        'compiler': args.compiler,
+        'total_ms': total_ms,
+        'phases': [totals[phase_name] for phase_name in order],
+      }, fp, indent=2, sort_keys=True)
+
+  sys.exit(1 if failed else 0)
+
+def find_spcomp2(args):
+  base = os.path.join(args.objdir, 'exp', 'compiler')
+  if not os.path.isdir(base):
+    return None
+  for subdir in sorted(os.listdir(base)):
+    if not subdir.startswith('spcomp2'):
+      continue
+    if args.arch is not None and subdir != 'spcomp2.' + args.arch:
+      continue
+    path = os.path.join(base, subdir, 'spcomp2')
+    for suffix in ['', '.exe']:
+      if os.path.exists(path + suffix):
+        return os.path.abspath(path + suffix)
+  return None
+
+# Reads the table printed by --time-phases. Returns the phases and the total
+# time in milliseconds.
+def parse_report(text):
+  phases = []
+  total = 0.0
+  in_table = False
+  for line in text.splitlines():
+    if line.startswith('Phase '):
+      in_table = True
+      continue
+    if not in_table:
+      continue
+    if line.startswith('Total '):
+      total = float(line.split()[1])
+      break
+    parts = line.rsplit(None, 5)
+    if len(parts) != 6:
+      continue
+    phases.append({
+      'name': parts[0],
+      'ms': float(parts[1]),
+      'memory_kb': int(parts[4]),
+    })
+  return phases, total
+
+if __name__ == '__main__':
+  main()
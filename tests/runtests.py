@@ -6,6 +6,7 @@ import platform
 import re
 import subprocess
 import sys
+import threading
 import testutil
 from testutil import manifest_get
 
@@ -29,6 +30,15 @@ def main():
   parser.add_argument('--spcomp-arg', default=None, type=str, action='append',
                       dest='spcomp_args',
                       help="Add an extra argument to all spcomp invocations.")
+  parser.add_argument('-j', '--jobs', default=1, type=int,
+                      help="Number of tests to run at once.")
+  parser.add_argument('--cache-dir', default=None, type=str,
+                      help="Where to cache compile and run results "
+                           "(default: <objdir>/test-cache).")
+  parser.add_argument('--no-cache', default=False, action='store_true',
+                      help="Always compile and run every test.")
+  parser.add_argument('--no-server', default=False, action='store_true',
+                      help="Start spcomp once per test instead of keeping one running.")
   args = parser.parse_args()
 
   if args.test and args.test.startswith('tests/'):
@@ -71,6 +81,15 @@ class TestPlan(object):
   def show_cli(self):
     return self.args.show_cli
 
+  @property
+  def cache_dir(self):
+    # Coverage data is only written when the binaries actually run.
+    if self.args.no_cache or self.args.coverage:
+      return None
+    if self.args.cache_dir:
+      return self.args.cache_dir
+    return os.path.join(self.args.objdir, 'test-cache')
+
   def match_arch(self, arch):
     if self.args.arch is None:
       return True
@@ -125,13 +144,32 @@ class TestPlan(object):
         env['LLVM_PROFILE_FILE'] = '{0}/spshell-%9m'.format(self.args.coverage)
 
       rc, stdout, stderr = testutil.exec_argv([path, '--version'])
-      if rc == 0 and 'JIT' in stdout:
+      has_jit = rc == 0 and 'JIT' in stdout
+
+      # Both x86 targets have a JIT. A shell built without one would pass
+      # every test without ever running compiled code.
+      if arch in ['x86', 'x86_64'] and not path.endswith('.js') and not has_jit:
+        raise Exception('{0} was built without its JIT'.format(path))
+
+      if has_jit:
         self.shells.append({
           'path': path,
           'args': [],
           'name': 'default-' + arch,
           'env': env,
           })
+        self.shells.append({
+          'path': path,
+          'args': ['--tiered-jit'],
+          'name': 'tiered-' + arch,
+          'env': env,
+          })
+        self.shells.append({
+          'path': path,
+          'args': ['--background-jit'],
+          'name': 'background-' + arch,
+          'env': env,
+          })
 
       self.shells.append({
         'path': path,
@@ -139,6 +177,12 @@ class TestPlan(object):
         'name': 'interpreter-' + arch,
         'env': env,
       })
+      self.shells.append({
+        'path': path,
+        'args': ['--disable-jit', '--disable-predecode'],
+        'name': 'decoding-interpreter-' + arch,
+        'env': env,
+      })
 
   def find_compilers(self):
     if self.args.spcomp2:
@@ -270,18 +314,17 @@ class Test(object):
     self.stdout_file = None
     self.stderr_file = None
 
-  def prepare(self):
+  # Binaries are written to |output_path|, named after the test's path so
+  # that tests can be compiled at the same time.
+  def prepare(self, output_path):
     if self.local_manifest_ is not None:
       return
 
     self.read_local_manifest()
 
-    smx_path = os.path.basename(self.path)
-    smx_base_path, ext = os.path.splitext(smx_path)
-    if ext == '.sp':
-      self.smx_path = smx_base_path + '.smx'
-    else:
-      self.smx_path += '.smx'
+    smx_name, _ = os.path.splitext(self.unique_name)
+    smx_name = smx_name.replace(os.sep, '_').replace('/', '_')
+    self.smx_path = os.path.join(output_path, smx_name + '.smx')
 
     base_path, _ = os.path.splitext(self.path)
     if os.path.exists(base_path + '.out'):
@@ -379,6 +422,13 @@ class TestRunner(object):
     self.include_path = os.path.dirname(os.path.abspath(__file__))
     self.start_time_ = datetime.datetime.now()
     self.failures_ = set()
+    self.output_path_ = None
+    self.log_ = threading.local()
+    self.servers_ = {}
+    self.servers_lock_ = threading.Lock()
+    self.cache_ = None
+    if plan.cache_dir:
+      self.cache_ = testutil.ResultCache(plan.cache_dir)
 
     # Walk up the test path looking for an 'include' folder.
     search_path, _ = os.path.split(self.include_path)
@@ -394,7 +444,12 @@ class TestRunner(object):
   def run(self):
     with testutil.TempFolder() as temp_folder:
       with testutil.ChangeFolder(temp_folder):
-        self.run_impl()
+        self.output_path_ = temp_folder
+        try:
+          self.run_impl()
+        finally:
+          for server in self.servers_.values():
+            server.close()
 
     if len(self.failures_):
       self.print_failures()
@@ -413,13 +468,36 @@ class TestRunner(object):
       spcomp['name'],
       spcomp['arch']))
 
+    tests = []
     for test in self.plan.tests:
-      test.prepare()
-      if not test.should_run(mode):
-        continue
-      if not self.run_test(mode, test):
+      test.prepare(self.output_path_)
+      if test.should_run(mode):
+        tests.append(test)
+
+    if self.plan.args.jobs <= 1:
+      for test in tests:
+        if not self.run_test(mode, test):
+          self.failures_.add(test)
+      return
+
+    # Each test's output is held back until it finishes, and tests are
+    # reported in order, so the log reads the same as a serial run.
+    results = testutil.parallel_map(lambda test: self.run_test_logged(mode, test), tests,
+                                    self.plan.args.jobs)
+    for test, (ok, log) in zip(tests, results):
+      sys.stdout.write(''.join(log))
+      sys.stdout.flush()
+      if not ok:
         self.failures_.add(test)
 
+  def run_test_logged(self, mode, test):
+    self.log_.lines = []
+    try:
+      ok = self.run_test(mode, test)
+      return ok, self.log_.lines
+    finally:
+      self.log_.lines = None
+
   def should_compile_only(self, test):
     if test.type == 'compiler-output' or test.type == 'compile-only':
       return True
@@ -477,12 +555,52 @@ class TestRunner(object):
     argv += ['-z', '1'] # Fast compilation for tests.
     if test.warnings_are_errors:
       argv += ['-E']
-    if mode['spcomp']['name'] == 'spcomp2':
-      argv += ['-o', test.smx_path]
+    argv += ['-o', self.fix_path(spcomp_path, test.smx_path)]
     argv += [self.fix_path(spcomp_path, test.path)]
 
-    # Run and return output.
-    return self.do_exec(argv, env = mode['spcomp']['env'])
+    cache_key = None
+    if self.cache_ is not None:
+      cache_key = self.compile_cache_key(mode, test, argv)
+      result = self.cache_.get(cache_key, test.smx_path)
+      if result is not None:
+        if self.plan.show_cli:
+          self.out(' '.join(argv) + ' (cached)')
+        return result
+
+    result = None
+    server = self.get_server(mode['spcomp'])
+    if server is not None:
+      if self.plan.show_cli:
+        self.out(' '.join(argv) + ' (server)')
+      server_result = server.compile(argv[1:], self.timeout_for(spcomp_path))
+      if server_result is not None:
+        rc, output = server_result
+        result = (rc, output, '')
+    if result is None:
+      result = self.do_exec(argv, env = mode['spcomp']['env'])
+
+    # Don't remember compiles that were killed.
+    if cache_key is not None and result[0] >= 0:
+      self.cache_.put(cache_key, *result, output_path = test.smx_path)
+    return result
+
+  def compile_cache_key(self, mode, test, argv):
+    parts = ['compile', testutil.file_digest(argv[0]), testutil.file_digest(test.path)]
+    parts += argv[1:]
+    for index, arg in enumerate(argv):
+      if arg == '-i':
+        parts.append(testutil.folder_digest(argv[index + 1], ['.inc']))
+    return testutil.ResultCache.key(parts)
+
+  # Returns the warm compiler for |spcomp|, or None if it can't have one.
+  def get_server(self, spcomp):
+    if self.plan.args.no_server or spcomp['name'] != 'spcomp' or spcomp['path'].endswith('.js'):
+      return None
+    with self.servers_lock_:
+      if spcomp['path'] not in self.servers_:
+        self.servers_[spcomp['path']] = testutil.CompilerServer(
+          spcomp['path'], self.plan.args.jobs, spcomp['env'])
+      return self.servers_[spcomp['path']]
 
   def run_shells(self, mode, test):
     for shell in self.plan.shells:
@@ -495,7 +613,20 @@ class TestRunner(object):
     argv = [shell['path']] + shell['args']
     argv += [self.fix_path(shell['path'], test.smx_path)]
 
-    rc, stdout, stderr = self.do_exec(argv, shell['env'])
+    cache_key = None
+    result = None
+    if self.cache_ is not None:
+      cache_key = testutil.ResultCache.key(['run', testutil.file_digest(shell['path']),
+                                            testutil.file_digest(test.smx_path)] + shell['args'])
+      result = self.cache_.get(cache_key)
+      if result is not None and self.plan.show_cli:
+        self.out(' '.join(argv) + ' (cached)')
+    if result is None:
+      result = self.do_exec(argv, shell['env'])
+    else:
+      cache_key = None
+
+    rc, stdout, stderr = result
     if test.expectedReturnCode != rc:
       self.out("FAIL: Shell '{0}' returned {1}, expected {2}.".format(
         shell['name'], rc, test.expectedReturnCode))
@@ -508,7 +639,11 @@ class TestRunner(object):
     if test.stderr_file is not None:
       if not self.compare_output(test, 'stderr', stderr):
         return False
-        
+
+    # Only passing runs are remembered, so a flaky failure is always retried.
+    if cache_key is not None:
+      self.cache_.put(cache_key, rc, stdout, stderr)
+
     self.out("PASS")
     return True
 
@@ -540,12 +675,12 @@ class TestRunner(object):
     if self.plan.show_cli:
       self.out(' '.join(argv))
 
-    if argv[0].endswith('.js'):
-      timeout = 60
-    else:
-      timeout = 5
+    return testutil.exec_argv(argv, self.timeout_for(argv[0]), logger = self, env = env)
 
-    return testutil.exec_argv(argv, timeout, logger = self, env = env)
+  def timeout_for(self, binary):
+    if binary.endswith('.js'):
+      return 60
+    return 5
 
   def compare_output(self, test, pipe_name, actual):
     expected_lines = test.get_expected_output(pipe_name)
@@ -616,7 +751,12 @@ class TestRunner(object):
 
   def out(self, text):
     when = (datetime.datetime.now() - self.start_time_).total_seconds()
-    sys.stdout.write('[{0:.4f}] {1}\n'.format(when, text))
+    line = '[{0:.4f}] {1}\n'.format(when, text)
+    lines = getattr(self.log_, 'lines', None)
+    if lines is not None:
+      lines.append(line)
+      return
+    sys.stdout.write(line)
     sys.stdout.flush()
 
   def out_io(self, stderr, stdout):
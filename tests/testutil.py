@@ -1,8 +1,12 @@
 # vim: set ts=2 sw=2 tw=99 et:
+import hashlib
+import json
 import os
+import re
 import shutil
 import tempfile
 import subprocess
+import threading
 from threading import Timer
 try:
   import configparser
@@ -58,6 +62,228 @@ def exec_argv(argv, timeout = None, logger = None, env = None):
       timer.cancel()
   return -9, '', 'process killed due to timeout'
 
+# Calls |fn| on each item, on up to |jobs| threads at once, and yields the
+# results in the order of |items|.
+def parallel_map(fn, items, jobs):
+  items = list(items)
+  results = [None] * len(items)
+  errors = [None] * len(items)
+  done = [threading.Event() for item in items]
+  lock = threading.Lock()
+  cursor = [0]
+
+  def worker():
+    while True:
+      with lock:
+        index = cursor[0]
+        if index >= len(items):
+          return
+        cursor[0] += 1
+      try:
+        results[index] = fn(items[index])
+      except Exception as e:
+        errors[index] = e
+      done[index].set()
+
+  for i in range(min(jobs, len(items))):
+    thread = threading.Thread(target = worker)
+    thread.daemon = True
+    thread.start()
+
+  for index in range(len(items)):
+    # Wait in slices, so that Ctrl+C still works.
+    while not done[index].wait(0.25):
+      pass
+    if errors[index] is not None:
+      raise errors[index]
+    yield results[index]
+
+kDigests = {}
+kDigestsLock = threading.Lock()
+
+# Returns a digest of a file's contents, computed once per run.
+def file_digest(path):
+  with kDigestsLock:
+    if path in kDigests:
+      return kDigests[path]
+  h = hashlib.sha1()
+  with open(path, 'rb') as fp:
+    for chunk in iter(lambda: fp.read(1 << 16), b''):
+      h.update(chunk)
+  digest = h.hexdigest()
+  with kDigestsLock:
+    kDigests[path] = digest
+  return digest
+
+# Returns a digest of every file with one of |extensions| under |folder|,
+# computed once per run.
+def folder_digest(folder, extensions):
+  key = (folder, tuple(extensions))
+  with kDigestsLock:
+    if key in kDigests:
+      return kDigests[key]
+  h = hashlib.sha1()
+  for root, dirs, files in os.walk(folder):
+    dirs.sort()
+    for name in sorted(files):
+      if os.path.splitext(name)[1] not in extensions:
+        continue
+      path = os.path.join(root, name)
+      h.update(os.path.relpath(path, folder).encode('utf-8'))
+      h.update(file_digest(path).encode('utf-8'))
+  digest = h.hexdigest()
+  with kDigestsLock:
+    kDigests[key] = digest
+  return digest
+
+# Stores the results of compiles and runs across test runs. Entries are
+# keyed by a digest of everything that can change the result, so stale
+# entries are never found, only left behind.
+class ResultCache(object):
+  def __init__(self, path):
+    self.path = path
+    if not os.path.isdir(path):
+      os.makedirs(path)
+
+  @staticmethod
+  def key(parts):
+    h = hashlib.sha1()
+    for part in parts:
+      h.update(part.encode('utf-8'))
+      h.update(b'\0')
+    return h.hexdigest()
+
+  # Returns (rc, stdout, stderr), or None. If the entry has an output file,
+  # it is copied to |output_path|.
+  def get(self, key, output_path = None):
+    entry_path = os.path.join(self.path, key + '.json')
+    if not os.path.exists(entry_path):
+      return None
+    try:
+      with open(entry_path, 'r') as fp:
+        entry = json.load(fp)
+      if entry['has_output']:
+        if output_path is None:
+          return None
+        shutil.copyfile(os.path.join(self.path, key + '.bin'), output_path)
+    except (IOError, OSError, ValueError, KeyError):
+      return None
+    return entry['rc'], entry['stdout'], entry['stderr']
+
+  def put(self, key, rc, stdout, stderr, output_path = None):
+    has_output = output_path is not None and os.path.exists(output_path)
+    if has_output:
+      shutil.copyfile(output_path, os.path.join(self.path, key + '.bin'))
+
+    # Write under a temporary name, so a reader never sees half an entry.
+    entry_path = os.path.join(self.path, key + '.json')
+    temp_path = '{0}.{1}.tmp'.format(entry_path, threading.current_thread().ident)
+    with open(temp_path, 'w') as fp:
+      json.dump({
+        'rc': rc,
+        'stdout': stdout,
+        'stderr': stderr,
+        'has_output': has_output,
+      }, fp)
+    try:
+      os.rename(temp_path, entry_path)
+    except OSError:
+      # Another run stored the same entry first.
+      os.remove(temp_path)
+
+# A long-running "spcomp --server" process. Compiles can be submitted from
+# any thread; its output is read back in order on a thread of its own. If the
+# server can't be started or goes away, compile() returns None and the caller
+# should run the compiler itself.
+class CompilerServer(object):
+  kDonePattern = re.compile(r'^(.*)@done (-?\d+)$')
+
+  def __init__(self, path, jobs, env = None):
+    self.lock_ = threading.Lock()
+    self.pending_ = []
+    self.alive_ = True
+    argv = [path, '--server']
+    if jobs > 1:
+      argv.append('--jobs={0}'.format(jobs))
+    try:
+      self.proc_ = subprocess.Popen(argv, stdin = subprocess.PIPE, stdout = subprocess.PIPE,
+                                    stderr = subprocess.STDOUT, env = env)
+    except OSError:
+      self.alive_ = False
+      return
+    self.reader_ = threading.Thread(target = self.read_output)
+    self.reader_.daemon = True
+    self.reader_.start()
+
+  # Returns (rc, output), or None if the server could not run the compile.
+  def compile(self, args, timeout):
+    # Jobs are split on whitespace, and quotes can't be escaped.
+    if any('"' in arg or '\n' in arg for arg in args):
+      return None
+
+    job = {'event': threading.Event(), 'result': None}
+    line = ' '.join('"{0}"'.format(arg) for arg in args) + '\n'
+    with self.lock_:
+      if not self.alive_:
+        return None
+      self.pending_.append(job)
+      try:
+        self.proc_.stdin.write(line.encode('utf-8'))
+        self.proc_.stdin.flush()
+      except (IOError, OSError):
+        self.pending_.remove(job)
+        self.shutdown_locked()
+        return None
+
+    if not job['event'].wait(timeout):
+      # Results come back in order, so a hung compile blocks every later
+      # one; give up on the server.
+      with self.lock_:
+        self.shutdown_locked()
+      return None
+    return job['result']
+
+  def read_output(self):
+    output = []
+    for raw_line in iter(self.proc_.stdout.readline, b''):
+      line = raw_line.decode('utf-8').rstrip('\r\n')
+      m = CompilerServer.kDonePattern.match(line)
+      if m is None:
+        output.append(line + '\n')
+        continue
+      output.append(m.group(1))
+      with self.lock_:
+        if not self.pending_:
+          break
+        job = self.pending_.pop(0)
+      job['result'] = (int(m.group(2)), ''.join(output))
+      job['event'].set()
+      output = []
+
+    with self.lock_:
+      self.shutdown_locked()
+
+  def shutdown_locked(self):
+    self.alive_ = False
+    for job in self.pending_:
+      job['event'].set()
+    self.pending_ = []
+    try:
+      self.proc_.kill()
+    except OSError:
+      pass
+
+  def close(self):
+    with self.lock_:
+      if not self.alive_:
+        return
+      self.alive_ = False
+    try:
+      self.proc_.stdin.close()
+      self.proc_.wait()
+    except (IOError, OSError):
+      pass
+
 def parse_manifest(path, local_folder, source = {}):
   manifest = {}
   manifest['folder'] = source.get('folder', {}).copy()
@@ -0,0 +1,189 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+// Microbenchmarks of compiler internals:
+//
+//   spcomp-bench [--filter=<text>] [--samples=<n>] <spcomp arguments>
+//
+// The arguments are those of a normal spcomp run, and its output is written
+// wherever spcomp would write it.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+# include <io.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#include "compiler/sc.h"
+#include "compiler/scvars.h"
+#include "libsmx/data-pool.h"
+#include "microbench.h"
+
+using namespace sp;
+using namespace sp::bench;
+
+// Sends stdout to the null device while alive, for the compiler's banner and
+// phase report.
+class QuietStdout
+{
+ public:
+  QuietStdout() {
+    fflush(stdout);
+#if defined(_WIN32)
+    saved_ = _dup(_fileno(stdout));
+    FILE* null = fopen("NUL", "w");
+    if (null) {
+      _dup2(_fileno(null), _fileno(stdout));
+      fclose(null);
+    }
+#else
+    saved_ = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      close(null);
+    }
+#endif
+  }
+  ~QuietStdout() {
+    fflush(stdout);
+    if (saved_ < 0)
+      return;
+#if defined(_WIN32)
+    _dup2(saved_, _fileno(stdout));
+    _close(saved_);
+#else
+    dup2(saved_, STDOUT_FILENO);
+    close(saved_);
+#endif
+  }
+
+ private:
+  int saved_;
+};
+
+// lex() and stgopt() work on the state pc_compile() sets up around each
+// source file, so they're timed inside whole compiles: --time-phases charges
+// each of them its own phase, and counts how often it was entered.
+class CompileProbe
+{
+ public:
+  CompileProbe(char* program, int argc, char** argv) {
+    args_.push_back(program);
+    args_.push_back("--time-phases");
+    for (int i = 0; i < argc; i++)
+      args_.push_back(argv[i]);
+  }
+
+  bool compile(uint64_t* total_ns) {
+    std::vector<char*> argv;
+    for (std::string& arg : args_)
+      argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    int rv;
+    {
+      QuietStdout quiet;
+      rv = pc_compile((int)argv.size() - 1, argv.data());
+    }
+    *total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+    if (rv != 0) {
+      fprintf(stderr, "The compile failed; run spcomp with the same arguments to see why.\n");
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  std::vector<std::string> args_;
+};
+
+static void
+BenchCompiler(Suite& suite, CompileProbe& probe)
+{
+  suite.sample("pc_compile", [&](uint64_t* ns, uint64_t* ops) -> bool {
+    *ops = 1;
+    return probe.compile(ns);
+  });
+
+  auto phase = [&](size_t index) {
+    return [&probe, index](uint64_t* ns, uint64_t* ops) -> bool {
+      uint64_t total;
+      if (!probe.compile(&total))
+        return false;
+      *ns = gPhaseTimer.ns(index);
+      *ops = gPhaseTimer.entries(index);
+      return true;
+    };
+  };
+
+  // Per call, leaving out the preprocessing done on the way.
+  suite.sample("lex", phase(kPhaseLex));
+  // Per call, which is per flushed run of staged code.
+  suite.sample("stgopt", phase(kPhasePeephole));
+}
+
+static void
+BenchDataPool(Suite& suite)
+{
+  // Runs like the assembler's: many short names and strings, most of them
+  // added more than once, and some that end other runs.
+  std::vector<std::string> runs;
+  for (size_t i = 0; i < 512; i++) {
+    std::string run = "name_" + std::to_string(i * 2654435761u % 100000);
+    run.append(i % 24, char('a' + i % 26));
+    runs.push_back(run);
+    if (i % 4 == 0)
+      runs.push_back(run.substr(run.size() / 2));
+  }
+  std::vector<const std::string*> adds;
+  for (size_t i = 0; i < 4096; i++)
+    adds.push_back(&runs[i * 7 % runs.size()]);
+
+  suite.run("DataPool::add", adds.size(), [&]() -> void {
+    DataPool pool;
+    for (const std::string* run : adds) {
+      uint32_t offset = pool.add(reinterpret_cast<const uint8_t*>(run->c_str()),
+                                 run->size() + 1);
+      Consume(offset);
+    }
+  });
+}
+
+int main(int argc, char** argv)
+{
+  Suite suite(&argc, argv);
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [--filter=<text>] [--samples=<n>] <spcomp arguments>\n",
+            argv[0]);
+    return 1;
+  }
+
+  CompileProbe probe(argv[0], argc - 1, argv + 1);
+
+  suite.printHeader();
+  BenchCompiler(suite, probe);
+  BenchDataPool(suite);
+  return 0;
+}
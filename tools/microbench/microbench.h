@@ -0,0 +1,182 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_tools_microbench_h_
+#define _include_sourcepawn_tools_microbench_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace sp {
+namespace bench {
+
+// Keeps the compiler from discarding |value|, or the work that produced it.
+template <typename T>
+static inline void
+Consume(const T& value)
+{
+#if defined(__GNUC__)
+  __asm__ __volatile__("" : : "r"(&value) : "memory");
+#else
+  static const void* volatile sink;
+  sink = &value;
+#endif
+}
+
+// Runs benchmarks and prints one line per benchmark: the fastest and the
+// median time per operation over a number of samples, and the median absolute
+// deviation from the median, as a share of it. The minimum is the least
+// noisy figure to compare builds by; a large deviation means the machine was
+// busy and the run should be repeated.
+//
+// Each sample of a timed benchmark repeats its body for at least kSampleNs,
+// after one call to warm caches and lazily built state, so timer resolution
+// doesn't matter even for operations of a few nanoseconds.
+class Suite
+{
+ public:
+  static const size_t kSamples = 15;
+  static const uint64_t kSampleNs = 10 * 1000 * 1000;
+
+  // Strips --filter=<text> and --samples=<n> from the arguments. Only
+  // benchmarks whose names contain the filter text are run.
+  Suite(int* argc, char** argv)
+   : filter_(nullptr),
+     samples_(kSamples)
+  {
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+      if (strncmp(argv[i], "--filter=", 9) == 0) {
+        filter_ = argv[i] + 9;
+      } else if (strncmp(argv[i], "--samples=", 10) == 0) {
+        int samples = atoi(argv[i] + 10);
+        if (samples > 0)
+          samples_ = size_t(samples);
+      } else {
+        argv[out++] = argv[i];
+      }
+    }
+    *argc = out;
+    argv[out] = nullptr;
+  }
+
+  bool wants(const char* name) const {
+    return !filter_ || strstr(name, filter_) != nullptr;
+  }
+
+  void printHeader() const {
+    printf("%-36s %14s %14s %9s %8s\n", "Benchmark", "min (ns/op)", "median (ns/op)",
+           "+/- MAD", "samples");
+  }
+
+  // Times |fn|, each call of which performs |ops_per_call| operations.
+  template <typename Fn>
+  void run(const char* name, size_t ops_per_call, Fn fn) {
+    if (!wants(name) || !ops_per_call)
+      return;
+
+    fn();
+
+    uint64_t iterations = 1;
+    for (;;) {
+      uint64_t ns = timeIterations(iterations, fn);
+      if (ns >= kSampleNs)
+        break;
+      // Aim a little past the target, so the next try usually lands.
+      uint64_t scaled = ns ? iterations * kSampleNs * 5 / (ns * 4) : iterations * 100;
+      iterations = std::max(iterations * 2, std::min(scaled, iterations * 100));
+    }
+
+    std::vector<double> samples;
+    for (size_t i = 0; i < samples_; i++) {
+      uint64_t ns = timeIterations(iterations, fn);
+      samples.push_back(double(ns) / double(iterations * ops_per_call));
+    }
+    report(name, &samples);
+  }
+
+  // Records a benchmark that is timed by |fn| itself, for work that can't be
+  // repeated in a tight loop. Each call runs once and stores how long its
+  // operations took, and how many there were. Returning false abandons the
+  // benchmark.
+  template <typename Fn>
+  void sample(const char* name, Fn fn) {
+    if (!wants(name))
+      return;
+
+    uint64_t ns, ops;
+    if (!fn(&ns, &ops))
+      return;
+
+    std::vector<double> samples;
+    for (size_t i = 0; i < samples_; i++) {
+      if (!fn(&ns, &ops))
+        return;
+      if (ops)
+        samples.push_back(double(ns) / double(ops));
+    }
+    report(name, &samples);
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  template <typename Fn>
+  static uint64_t timeIterations(uint64_t iterations, Fn& fn) {
+    Clock::time_point start = Clock::now();
+    for (uint64_t i = 0; i < iterations; i++)
+      fn();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+
+  static double Median(std::vector<double>* values) {
+    std::sort(values->begin(), values->end());
+    size_t n = values->size();
+    if (n % 2)
+      return (*values)[n / 2];
+    return ((*values)[n / 2 - 1] + (*values)[n / 2]) / 2;
+  }
+
+  void report(const char* name, std::vector<double>* samples) const {
+    if (samples->empty()) {
+      printf("%-36s %14s\n", name, "n/a");
+      return;
+    }
+
+    double min = *std::min_element(samples->begin(), samples->end());
+    double median = Median(samples);
+
+    std::vector<double> deviations;
+    for (double sample : *samples)
+      deviations.push_back(sample > median ? sample - median : median - sample);
+    double mad = median > 0 ? 100.0 * Median(&deviations) / median : 0.0;
+
+    printf("%-36s %14.2f %14.2f %8.2f%% %8zu\n", name, min, median, mad, samples->size());
+    fflush(stdout);
+  }
+
+ private:
+  const char* filter_;
+  size_t samples_;
+};
+
+} // namespace bench
+} // namespace sp
+
+#endif // _include_sourcepawn_tools_microbench_h_
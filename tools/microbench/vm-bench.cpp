@@ -0,0 +1,540 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+// Microbenchmarks of VM internals, run against a plugin:
+//
+//   vm-bench [--filter=<text>] [--samples=<n>] <plugin.smx>
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "code-allocator.h"
+#include "environment.h"
+#include "method-info.h"
+#include "microbench.h"
+#include "opcodes.h"
+#include "pcode-visitor.h"
+#include "pcode-reader.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+#include "smx-v1-image.h"
+
+using namespace sp;
+using namespace sp::bench;
+
+// Does nothing with each instruction but count it, so decoding is all that
+// is timed.
+class CountingVisitor final : public PcodeVisitor
+{
+ public:
+  CountingVisitor()
+   : count_(0)
+  {}
+
+  uint64_t instructions() const {
+    return count_;
+  }
+
+  bool visitBREAK() override {
+    return count();
+  }
+  bool visitLOAD(PawnReg dest, cell_t srcaddr) override {
+    return count();
+  }
+  bool visitLOAD_S(PawnReg dest, cell_t srcoffs) override {
+    return count();
+  }
+  bool visitLREF_S(PawnReg dest, cell_t srcoffs) override {
+    return count();
+  }
+  bool visitLOAD_I() override {
+    return count();
+  }
+  bool visitLODB_I(cell_t width) override {
+    return count();
+  }
+  bool visitCONST(PawnReg dest, cell_t imm) override {
+    return count();
+  }
+  bool visitADDR(PawnReg dest, cell_t offset) override {
+    return count();
+  }
+  bool visitSTOR(cell_t address, PawnReg src) override {
+    return count();
+  }
+  bool visitSTOR_S(cell_t offset, PawnReg src) override {
+    return count();
+  }
+  bool visitSREF_S(cell_t offset, PawnReg src) override {
+    return count();
+  }
+  bool visitSTOR_I() override {
+    return count();
+  }
+  bool visitSTRB_I(cell_t width) override {
+    return count();
+  }
+  bool visitLIDX() override {
+    return count();
+  }
+  bool visitIDXADDR() override {
+    return count();
+  }
+  bool visitMOVE(PawnReg reg) override {
+    return count();
+  }
+  bool visitXCHG() override {
+    return count();
+  }
+  bool visitPUSH(PawnReg src) override {
+    return count();
+  }
+  bool visitPUSH_C(const cell_t* vals, size_t nvals) override {
+    return count();
+  }
+  bool visitPUSH(const cell_t* addresses, size_t nvals) override {
+    return count();
+  }
+  bool visitPUSH_S(const cell_t* offsets, size_t nvals) override {
+    return count();
+  }
+  bool visitPOP(PawnReg dest) override {
+    return count();
+  }
+  bool visitSTACK(cell_t amount) override {
+    return count();
+  }
+  bool visitHEAP(cell_t amount) override {
+    return count();
+  }
+  bool visitRETN() override {
+    return count();
+  }
+  bool visitCALL(cell_t offset) override {
+    return count();
+  }
+  bool visitJUMP(cell_t offset) override {
+    return count();
+  }
+  bool visitJcmp(CompareOp op, cell_t offset) override {
+    return count();
+  }
+  bool visitSHL() override {
+    return count();
+  }
+  bool visitSHR() override {
+    return count();
+  }
+  bool visitSSHR() override {
+    return count();
+  }
+  bool visitSHL_C(PawnReg dest, cell_t amount) override {
+    return count();
+  }
+  bool visitSMUL() override {
+    return count();
+  }
+  bool visitSDIV(PawnReg dest) override {
+    return count();
+  }
+  bool visitADD() override {
+    return count();
+  }
+  bool visitSUB() override {
+    return count();
+  }
+  bool visitSUB_ALT() override {
+    return count();
+  }
+  bool visitAND() override {
+    return count();
+  }
+  bool visitOR() override {
+    return count();
+  }
+  bool visitXOR() override {
+    return count();
+  }
+  bool visitNOT() override {
+    return count();
+  }
+  bool visitNEG() override {
+    return count();
+  }
+  bool visitINVERT() override {
+    return count();
+  }
+  bool visitADD_C(cell_t value) override {
+    return count();
+  }
+  bool visitSMUL_C(cell_t value) override {
+    return count();
+  }
+  bool visitZERO(PawnReg dest) override {
+    return count();
+  }
+  bool visitZERO(cell_t address) override {
+    return count();
+  }
+  bool visitZERO_S(cell_t offset) override {
+    return count();
+  }
+  bool visitCompareOp(CompareOp op) override {
+    return count();
+  }
+  bool visitEQ_C(PawnReg src, cell_t value) override {
+    return count();
+  }
+  bool visitINC(PawnReg dest) override {
+    return count();
+  }
+  bool visitINC(cell_t address) override {
+    return count();
+  }
+  bool visitINC_S(cell_t offset) override {
+    return count();
+  }
+  bool visitINC_I() override {
+    return count();
+  }
+  bool visitDEC(PawnReg dest) override {
+    return count();
+  }
+  bool visitDEC(cell_t address) override {
+    return count();
+  }
+  bool visitDEC_S(cell_t offset) override {
+    return count();
+  }
+  bool visitDEC_I() override {
+    return count();
+  }
+  bool visitMOVS(uint32_t amount) override {
+    return count();
+  }
+  bool visitFILL(uint32_t amount) override {
+    return count();
+  }
+  bool visitBOUNDS(uint32_t limit) override {
+    return count();
+  }
+  bool visitSYSREQ_C(uint32_t native_index) override {
+    return count();
+  }
+  bool visitSWAP(PawnReg dest) override {
+    return count();
+  }
+  bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override {
+    return count();
+  }
+  bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override {
+    return count();
+  }
+  bool visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt) override {
+    return count();
+  }
+  bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override {
+    return count();
+  }
+  bool visitCONST(cell_t address, cell_t value) override {
+    return count();
+  }
+  bool visitCONST_S(cell_t offset, cell_t value) override {
+    return count();
+  }
+  bool visitTRACKER_PUSH_C(cell_t amount) override {
+    return count();
+  }
+  bool visitTRACKER_POP_SETHEAP() override {
+    return count();
+  }
+  bool visitGENARRAY(uint32_t dims, bool autozero) override {
+    return count();
+  }
+  bool visitSTRADJUST_PRI() override {
+    return count();
+  }
+  bool visitFABS() override {
+    return count();
+  }
+  bool visitFLOAT() override {
+    return count();
+  }
+  bool visitFLOATADD() override {
+    return count();
+  }
+  bool visitFLOATSUB() override {
+    return count();
+  }
+  bool visitFLOATMUL() override {
+    return count();
+  }
+  bool visitFLOATDIV() override {
+    return count();
+  }
+  bool visitRND_TO_NEAREST() override {
+    return count();
+  }
+  bool visitRND_TO_FLOOR() override {
+    return count();
+  }
+  bool visitRND_TO_CEIL() override {
+    return count();
+  }
+  bool visitRND_TO_ZERO() override {
+    return count();
+  }
+  bool visitFLOATCMP() override {
+    return count();
+  }
+  bool visitFLOAT_CMP_OP(CompareOp op) override {
+    return count();
+  }
+  bool visitFLOAT_NOT() override {
+    return count();
+  }
+  bool visitHALT(cell_t value) override {
+    return count();
+  }
+  bool visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases) override {
+    return count();
+  }
+  bool visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size) override {
+    return count();
+  }
+  bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    return count();
+  }
+  bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    return count();
+  }
+ private:
+  bool count() {
+    count_++;
+    return true;
+  }
+
+ private:
+  uint64_t count_;
+};
+
+// Returns the code offset of every function, found by walking the code one
+// instruction at a time.
+static std::vector<uint32_t>
+FindFunctions(PluginRuntime* rt)
+{
+  std::vector<uint32_t> offsets;
+
+  const auto& code = rt->code();
+  const uint8_t* cip = code.bytes;
+  const uint8_t* end = code.bytes + code.length;
+  while (cip + sizeof(cell_t) <= end) {
+    ucell_t op = *reinterpret_cast<const ucell_t*>(cip);
+    if (op >= OPCODES_TOTAL)
+      break;
+    if (op == OP_PROC)
+      offsets.push_back(uint32_t(cip - code.bytes));
+    cip = NextInstruction(cip);
+  }
+  return offsets;
+}
+
+static bool
+DecodeFunctions(PluginRuntime* rt, const std::vector<uint32_t>& offsets, CountingVisitor* visitor)
+{
+  for (uint32_t offset : offsets) {
+    PcodeReader<CountingVisitor> reader(rt, offset, visitor);
+    reader.begin();
+    while (reader.more() && reader.peekOpcode() != OP_PROC) {
+      if (!reader.visitNext())
+        return false;
+    }
+  }
+  return true;
+}
+
+static void
+BenchImage(Suite& suite, const char* file)
+{
+  // The file is mapped, so this mostly measures parsing and checking the
+  // image rather than reading it.
+  suite.run("SmxV1Image::validate", 1, [file]() -> void {
+    FILE* fp = fopen(file, "rb");
+    if (!fp)
+      return;
+    SmxV1Image image(fp, true);
+    bool ok = image.validate();
+    Consume(ok);
+    fclose(fp);
+  });
+}
+
+static void
+BenchDecode(Suite& suite, PluginRuntime* rt, const std::vector<uint32_t>& offsets)
+{
+  CountingVisitor probe;
+  if (!DecodeFunctions(rt, offsets, &probe) || !probe.instructions()) {
+    fprintf(stderr, "The plugin's code could not be decoded; skipping PcodeReader.\n");
+    return;
+  }
+
+  // Per instruction.
+  suite.run("PcodeReader::visitNext", probe.instructions(), [&]() -> void {
+    CountingVisitor visitor;
+    DecodeFunctions(rt, offsets, &visitor);
+    Consume(visitor);
+  });
+}
+
+static void
+BenchAcquireMethod(Suite& suite, PluginRuntime* rt, const std::vector<uint32_t>& offsets)
+{
+  if (offsets.empty())
+    return;
+
+  // The first call of each function creates its MethodInfo; this times the
+  // lookups that follow, which is what the invoke path pays.
+  suite.run("PluginRuntime::AcquireMethod", offsets.size(), [&]() -> void {
+    for (uint32_t offset : offsets) {
+      RefPtr<MethodInfo> method = rt->AcquireMethod(offset);
+      Consume(method);
+    }
+  });
+}
+
+static void
+BenchCodeAllocator(Suite& suite)
+{
+  static const size_t kChunks = 256;
+
+  // Every chunk is freed before the next call, so each call reuses the same
+  // pool.
+  CodeAllocator allocator;
+  suite.run("CodeAllocator::Allocate (64 bytes)", kChunks, [&]() -> void {
+    std::vector<CodeChunk> chunks;
+    chunks.reserve(kChunks);
+    for (size_t i = 0; i < kChunks; i++)
+      chunks.push_back(allocator.Allocate(64));
+    Consume(chunks);
+  });
+
+  // Sizes of compiled methods vary; freeing every other chunk leaves holes
+  // that best fit has to search.
+  suite.run("CodeAllocator::Allocate (mixed)", kChunks, [&]() -> void {
+    std::vector<CodeChunk> chunks;
+    chunks.reserve(kChunks);
+    for (size_t i = 0; i < kChunks; i++) {
+      chunks.push_back(allocator.Allocate(48 + (i * 7919) % 4096));
+      if (i % 2)
+        chunks[i - 1] = CodeChunk();
+    }
+    Consume(chunks);
+  });
+}
+
+static void
+BenchContext(Suite& suite, PluginContext* cx)
+{
+  static const char kAscii[] = "The quick brown fox jumps over the lazy dog, twice over.";
+  static const char kUtf8[] = "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, "
+                              "\xe4\xb8\x96\xe7\x95\x8c! \xf0\x9f\x98\x80";
+
+  cell_t local_addr;
+  cell_t* phys_addr;
+  if (cx->HeapAlloc(64, &local_addr, &phys_addr) != SP_ERROR_NONE) {
+    fprintf(stderr, "The plugin's heap is too small; skipping PluginContext.\n");
+    return;
+  }
+
+  suite.run("StringToLocalUTF8 (ascii)", 1, [&]() -> void {
+    size_t written;
+    cx->StringToLocalUTF8(local_addr, 64 * sizeof(cell_t), kAscii, &written);
+    Consume(written);
+  });
+  // Truncating has to back up to the start of a multi-byte character.
+  suite.run("StringToLocalUTF8 (utf-8, truncated)", 1, [&]() -> void {
+    size_t written;
+    cx->StringToLocalUTF8(local_addr, 10, kUtf8, &written);
+    Consume(written);
+  });
+
+  cx->HeapPop(local_addr);
+
+  // The dimensions are read from, and the result written to, the plugin's
+  // stack, just below its top.
+  auto full_array = [cx](uint32_t argc, const cell_t* dims) -> bool {
+    cell_t* argv = reinterpret_cast<cell_t*>(cx->memory() + cx->sp()) - argc;
+    memcpy(argv, dims, argc * sizeof(cell_t));
+    if (cx->generateFullArray(argc, argv, 1) != SP_ERROR_NONE)
+      return false;
+    cx->popTrackerAndSetHeap();
+    return true;
+  };
+
+  static const cell_t k2D[] = { 16, 8 };
+  static const cell_t k3D[] = { 8, 4, 4 };
+  if (!full_array(2, k2D) || !full_array(3, k3D)) {
+    fprintf(stderr, "The plugin's heap is too small; skipping GenerateFullArray.\n");
+    return;
+  }
+  suite.run("GenerateFullArray (8x16)", 1, [&]() -> void {
+    full_array(2, k2D);
+  });
+  suite.run("GenerateFullArray (4x4x8)", 1, [&]() -> void {
+    full_array(3, k3D);
+  });
+}
+
+int main(int argc, char** argv)
+{
+  Suite suite(&argc, argv);
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s [--filter=<text>] [--samples=<n>] <plugin.smx>\n", argv[0]);
+    return 1;
+  }
+  const char* file = argv[1];
+
+  Environment* env = Environment::New();
+  if (!env) {
+    fprintf(stderr, "Could not initialize the VM.\n");
+    return 1;
+  }
+
+  int rv = 0;
+  {
+    char error[255];
+    std::unique_ptr<IPluginRuntime> api(env->APIv2()->LoadBinaryFromFile(file, error,
+                                                                         sizeof(error)));
+    if (!api) {
+      fprintf(stderr, "Could not load %s: %s\n", file, error);
+      rv = 1;
+    } else {
+      PluginRuntime* rt = PluginRuntime::FromAPI(api.get());
+      std::vector<uint32_t> offsets = FindFunctions(rt);
+
+      suite.printHeader();
+      BenchImage(suite, file);
+      BenchDecode(suite, rt, offsets);
+      BenchAcquireMethod(suite, rt, offsets);
+      BenchCodeAllocator(suite);
+      BenchContext(suite, rt->GetBaseContext());
+    }
+  }
+
+  env->Shutdown();
+  delete env;
+  return rv;
+}
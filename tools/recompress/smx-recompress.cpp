@@ -0,0 +1,183 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2016 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+// Rewrites an existing .smx file with a different compression codec, so that
+// already-built plugins can be moved to LZ4 without recompiling them.
+//
+//   smx-recompress <none|zlib|lz4> <input.smx> [output.smx]
+//
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <smx/smx-headers.h>
+#include <zlib/zlib.h>
+#include "shared/lz4-block.h"
+
+using namespace sp;
+
+static bool
+ReadFile(const char* path, std::vector<uint8_t>* out)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size < 0) {
+    fclose(fp);
+    return false;
+  }
+  out->resize(size);
+  bool ok = fread(out->data(), 1, out->size(), fp) == out->size();
+  fclose(fp);
+  return ok;
+}
+
+// Returns the fully decompressed image, with the header marked uncompressed.
+static bool
+Decompress(const std::vector<uint8_t>& file, std::vector<uint8_t>* image)
+{
+  if (file.size() < sizeof(sp_file_hdr_t))
+    return false;
+
+  sp_file_hdr_t hdr;
+  memcpy(&hdr, file.data(), sizeof(hdr));
+  if (hdr.magic != SmxConsts::FILE_MAGIC)
+    return false;
+
+  if (hdr.compression == SmxConsts::FILE_COMPRESSION_NONE) {
+    *image = file;
+    return true;
+  }
+
+  if (hdr.disksize > file.size() || hdr.dataoffs < sizeof(sp_file_hdr_t) ||
+      hdr.dataoffs > hdr.disksize || hdr.imagesize < hdr.dataoffs)
+  {
+    return false;
+  }
+
+  image->resize(hdr.imagesize);
+  memcpy(image->data(), file.data(), hdr.dataoffs);
+
+  const uint8_t* src = file.data() + hdr.dataoffs;
+  size_t srclen = hdr.disksize - hdr.dataoffs;
+  uint8_t* dest = image->data() + hdr.dataoffs;
+  size_t destlen = hdr.imagesize - hdr.dataoffs;
+
+  switch (hdr.compression) {
+    case SmxConsts::FILE_COMPRESSION_GZ:
+    {
+      uLongf zlen = destlen;
+      if (uncompress(dest, &zlen, src, srclen) != Z_OK || zlen != destlen)
+        return false;
+      break;
+    }
+    case SmxConsts::FILE_COMPRESSION_LZ4:
+      if (!Lz4Decompress(src, srclen, dest, destlen))
+        return false;
+      break;
+    default:
+      return false;
+  }
+
+  sp_file_hdr_t* out = reinterpret_cast<sp_file_hdr_t*>(image->data());
+  out->compression = SmxConsts::FILE_COMPRESSION_NONE;
+  out->disksize = 0;
+  return true;
+}
+
+static bool
+Compress(const std::vector<uint8_t>& image, uint8_t codec, std::vector<uint8_t>* out)
+{
+  sp_file_hdr_t hdr;
+  memcpy(&hdr, image.data(), sizeof(hdr));
+
+  if (codec == SmxConsts::FILE_COMPRESSION_NONE) {
+    *out = image;
+    return true;
+  }
+
+  const uint8_t* src = image.data() + hdr.dataoffs;
+  size_t srclen = hdr.imagesize - hdr.dataoffs;
+
+  size_t written;
+  if (codec == SmxConsts::FILE_COMPRESSION_GZ) {
+    uLongf zlen = compressBound(srclen);
+    out->resize(hdr.dataoffs + zlen);
+    if (compress2(out->data() + hdr.dataoffs, &zlen, src, srclen, 9) != Z_OK)
+      return false;
+    written = zlen;
+  } else {
+    size_t bound = Lz4CompressBound(srclen);
+    out->resize(hdr.dataoffs + bound);
+    if (!(written = Lz4Compress(src, srclen, out->data() + hdr.dataoffs, bound)))
+      return false;
+  }
+
+  out->resize(hdr.dataoffs + written);
+  memcpy(out->data(), image.data(), hdr.dataoffs);
+
+  hdr.compression = codec;
+  hdr.disksize = uint32_t(out->size());
+  memcpy(out->data(), &hdr, sizeof(hdr));
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Usage: %s <none|zlib|lz4> <input.smx> [output.smx]\n", argv[0]);
+    return 1;
+  }
+
+  uint8_t codec;
+  if (strcmp(argv[1], "none") == 0) {
+    codec = SmxConsts::FILE_COMPRESSION_NONE;
+  } else if (strcmp(argv[1], "zlib") == 0) {
+    codec = SmxConsts::FILE_COMPRESSION_GZ;
+  } else if (strcmp(argv[1], "lz4") == 0) {
+    codec = SmxConsts::FILE_COMPRESSION_LZ4;
+  } else {
+    fprintf(stderr, "Unknown codec: %s\n", argv[1]);
+    return 1;
+  }
+
+  const char* input = argv[2];
+  const char* output = argc == 4 ? argv[3] : argv[2];
+
+  std::vector<uint8_t> file, image, result;
+  if (!ReadFile(input, &file)) {
+    fprintf(stderr, "Could not read %s\n", input);
+    return 1;
+  }
+  if (!Decompress(file, &image)) {
+    fprintf(stderr, "%s is not a valid .smx file\n", input);
+    return 1;
+  }
+  if (!Compress(image, codec, &result)) {
+    fprintf(stderr, "Could not compress %s\n", input);
+    return 1;
+  }
+
+  FILE* fp = fopen(output, "wb");
+  if (!fp || fwrite(result.data(), 1, result.size(), fp) != result.size()) {
+    fprintf(stderr, "Could not write %s\n", output);
+    if (fp)
+      fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+
+  fprintf(stdout, "%s: %zu -> %zu bytes\n", output, file.size(), result.size());
+  return 0;
+}
@@ -0,0 +1,263 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2016 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <amtl/am-string.h>
+#include <amtl/am-thread.h>
+#include "environment.h"
+#include "image-cache.h"
+#include "opcode-histogram.h"
+#include "opcodes.h"
+#include "plugin-runtime.h"
+#include "pool-allocator.h"
+#include "smx-v1-image.h"
+
+using namespace ke;
+using namespace sp;
+using namespace SourcePawn;
+
+static Environment* sEnv = nullptr;
+static bool sSections = false;
+static bool sDisasm = false;
+static bool sHistogram = false;
+static size_t sJobs = 0;
+
+// Files are loaded and analyzed this many at a time, so a large corpus
+// doesn't have to fit in memory at once.
+static const size_t kBatchSize = 64;
+
+struct FileResult
+{
+  std::string report;
+  OpcodeHistogram histogram;
+  size_t code_size;
+  size_t data_size;
+};
+
+static const char*
+CompressionName(uint8_t compression)
+{
+  switch (compression) {
+    case SmxConsts::FILE_COMPRESSION_NONE:
+      return "none";
+    case SmxConsts::FILE_COMPRESSION_GZ:
+      return "zlib";
+    case SmxConsts::FILE_COMPRESSION_LZ4:
+      return "lz4";
+    case SmxConsts::FILE_COMPRESSION_GZ_CHUNKS:
+      return "zlib-chunks";
+    default:
+      return "unknown";
+  }
+}
+
+static void
+DescribeSections(const SmxV1Image* image, std::string* out)
+{
+  const sp_file_hdr_t* hdr = image->hdr();
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(hdr);
+  const sp_file_section_t* sections = reinterpret_cast<const sp_file_section_t*>(hdr + 1);
+  const char* names = reinterpret_cast<const char*>(base + hdr->stringtab);
+
+  size_t disksize = hdr->disksize ? hdr->disksize : hdr->imagesize;
+  *out += StringPrintf("  %u bytes on disk, %u in memory, compression %s\n", unsigned(disksize),
+                       unsigned(hdr->imagesize), CompressionName(hdr->compression));
+  for (size_t i = 0; i < hdr->sections; i++) {
+    *out += StringPrintf("  %-24s %10u %10u\n", names + sections[i].nameoffs,
+                         unsigned(sections[i].dataoffs), unsigned(sections[i].size));
+  }
+}
+
+// Runs on any thread; everything it prints goes into |result|.
+static void
+Analyze(const char* file, IPluginRuntime* api, FileResult* result)
+{
+  PluginRuntime* rt = PluginRuntime::FromAPI(api);
+  result->code_size = rt->code().length;
+  result->data_size = rt->data().length;
+
+  result->report = StringPrintf("%s:\n", file);
+  if (sSections)
+    DescribeSections(rt->shared_image()->image(), &result->report);
+
+  if (sHistogram) {
+    CountStaticOpcodes(rt, &result->histogram);
+    result->report += StringPrintf("  %llu ops\n", (unsigned long long)result->histogram.total());
+  }
+}
+
+static void
+Disassemble(IPluginRuntime* api)
+{
+  PluginRuntime* rt = PluginRuntime::FromAPI(api);
+  const uint8_t* cip = rt->code().bytes;
+  const uint8_t* stop = cip + rt->code().length;
+  const cell_t* start = reinterpret_cast<const cell_t*>(cip);
+
+  while (cip + sizeof(cell_t) <= stop) {
+    ucell_t op = *reinterpret_cast<const cell_t*>(cip);
+    if (op >= OPCODES_TOTAL || (op != OP_CASETBL && !kOpcodeSizes[op]))
+      break;
+
+    if (op == OP_PROC) {
+      uint32_t offset = uint32_t(cip - rt->code().bytes);
+      const char* name = rt->image()->LookupFunction(offset);
+      fprintf(stdout, "%s @ %u:\n", name ? name : "<unknown>", unsigned(offset));
+      start = reinterpret_cast<const cell_t*>(cip);
+    }
+
+    const uint8_t* next = NextInstruction(cip);
+    if (next > stop)
+      break;
+    SpewOpcode(stdout, rt, start, reinterpret_cast<const cell_t*>(cip));
+    cip = next;
+  }
+}
+
+// Runs |job| for every index below |count|, on up to sJobs threads.
+template <typename Job>
+static void
+RunParallel(size_t count, const Job& job)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]() -> void {
+    for (;;) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count)
+        return;
+      job(i);
+    }
+  };
+
+  size_t num_threads = sJobs ? sJobs : std::max(std::thread::hardware_concurrency(), 1u);
+  num_threads = std::min(num_threads, count);
+
+  std::vector<std::unique_ptr<std::thread>> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    auto thread_main = [&worker]() -> void {
+      // Verifying methods allocates from the thread's pool.
+      PoolAllocator::InitDefault();
+      worker();
+      PoolAllocator::FreeDefault();
+    };
+    if (std::unique_ptr<std::thread> thread = ke::NewThread("smxdump", thread_main))
+      threads.push_back(std::move(thread));
+  }
+  worker();
+  for (const auto& thread : threads)
+    thread->join();
+}
+
+static void
+Usage()
+{
+  fprintf(stderr, "Usage: smxdump [options] <file> [<file> ...]\n");
+  fprintf(stderr, "  --sections   List each file's sections and sizes (the default).\n");
+  fprintf(stderr, "  --histogram  Print how often each op appears over all of the files.\n");
+  fprintf(stderr, "  --disasm     Disassemble each file's code.\n");
+  fprintf(stderr, "  --jobs=N     Analyze N files at once (default: one per core).\n");
+}
+
+int main(int argc, char **argv)
+{
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+    if (strcmp(argv[first], "--sections") == 0) {
+      sSections = true;
+    } else if (strcmp(argv[first], "--histogram") == 0) {
+      sHistogram = true;
+    } else if (strcmp(argv[first], "--disasm") == 0) {
+      sDisasm = true;
+    } else if (strncmp(argv[first], "--jobs=", 7) == 0) {
+      sJobs = size_t(std::max(atoi(argv[first] + 7), 0));
+    } else {
+      Usage();
+      return 1;
+    }
+  }
+  if (first == argc) {
+    Usage();
+    return 1;
+  }
+  if (!sHistogram && !sDisasm)
+    sSections = true;
+
+  if ((sEnv = Environment::New()) == nullptr) {
+    fprintf(stderr, "Could not initialize ISourcePawnEngine2\n");
+    return 1;
+  }
+
+  const char* const* files = argv + first;
+  size_t count = size_t(argc - first);
+
+  bool ok = true;
+  OpcodeHistogram corpus;
+  size_t total_code = 0;
+  size_t total_data = 0;
+  size_t loaded = 0;
+  for (size_t batch = 0; batch < count; batch += kBatchSize) {
+    size_t batch_count = std::min(kBatchSize, count - batch);
+
+    std::vector<LoadResult> loads(batch_count);
+    sEnv->APIv2()->LoadBinariesFromFiles(files + batch, batch_count, 0, loads.data());
+
+    std::vector<FileResult> results(batch_count);
+    RunParallel(batch_count, [&](size_t i) -> void {
+      if (loads[i].runtime)
+        Analyze(files[batch + i], loads[i].runtime, &results[i]);
+    });
+
+    // Print in the order the files were given.
+    for (size_t i = 0; i < batch_count; i++) {
+      std::unique_ptr<IPluginRuntime> rt(loads[i].runtime);
+      if (!rt) {
+        fprintf(stderr, "%s: could not load: %s\n", files[batch + i], loads[i].error);
+        ok = false;
+        continue;
+      }
+      loaded++;
+      total_code += results[i].code_size;
+      total_data += results[i].data_size;
+      corpus.merge(results[i].histogram);
+
+      if (sSections || sHistogram)
+        fputs(results[i].report.c_str(), stdout);
+      if (sDisasm)
+        Disassemble(rt.get());
+    }
+  }
+
+  if (count > 1) {
+    fprintf(stdout, "%llu files: %llu bytes of code, %llu bytes of data\n",
+            (unsigned long long)loaded, (unsigned long long)total_code,
+            (unsigned long long)total_data);
+  }
+  if (sHistogram) {
+    fprintf(stdout, "All files: %llu ops\n", (unsigned long long)corpus.total());
+    corpus.report(stdout, OPCODES_TOTAL, true);
+  }
+
+  sEnv->Shutdown();
+  delete sEnv;
+
+  return ok ? 0 : 1;
+}
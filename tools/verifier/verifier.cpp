@@ -12,6 +12,7 @@
 //
 #include "environment.h"
 #include "method-verifier.h"
+#include "opcode-histogram.h"
 #include <set>
 #include <deque>
 
@@ -21,6 +22,9 @@ using namespace SourcePawn;
 
 Environment *sEnv = nullptr;
 bool sVerbose = false;
+bool sHistogram = false;
+bool sPerMethod = false;
+OpcodeHistogram sCorpus;
 
 static bool
 Verify(IPluginRuntime* rt)
@@ -73,6 +77,30 @@ Verify(IPluginRuntime* rt)
   return true;
 }
 
+// Prints how often each op appears in |rt|, and adds it to the corpus.
+static void
+WriteHistogram(const char* file, IPluginRuntime* rt)
+{
+  OpcodeHistogram plugin;
+  std::vector<std::pair<cell_t, OpcodeHistogram>> methods;
+  CountStaticOpcodes(PluginRuntime::FromAPI(rt), &plugin,
+    [&methods](cell_t offset, const OpcodeHistogram& counts) -> void {
+      if (sPerMethod)
+        methods.emplace_back(offset, counts);
+  });
+  sCorpus.merge(plugin);
+
+  fprintf(stdout, "%s: %llu ops\n", file, (unsigned long long)plugin.total());
+  plugin.report(stdout, OPCODES_TOTAL, true);
+  for (const auto& method : methods) {
+    const char* name;
+    if (rt->GetDebugInfo()->LookupFunction(method.first, &name) != SP_ERROR_NONE)
+      name = "<unknown>";
+    fprintf(stdout, "%s: %llu ops\n", name, (unsigned long long)method.second.total());
+    method.second.report(stdout, 10, false);
+  }
+}
+
 static bool
 Analyze(const char* file)
 {
@@ -101,13 +129,37 @@ Analyze(const char* file)
     }
   }
 
-  return Verify(rt.get());
+  if (!Verify(rt.get()))
+    return false;
+  if (sHistogram)
+    WriteHistogram(file, rt.get());
+  return true;
+}
+
+static void
+Usage()
+{
+  fprintf(stderr, "Usage: [--histogram [--methods]] <file> [<file> ...]\n");
+  fprintf(stderr, "  --histogram  Print how often each op and operand value appears, per\n");
+  fprintf(stderr, "               plugin and over all of the files.\n");
+  fprintf(stderr, "  --methods    Also print the most common ops in each method.\n");
 }
 
 int main(int argc, char **argv)
 {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: <file>\n");
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+    if (strcmp(argv[first], "--histogram") == 0) {
+      sHistogram = true;
+    } else if (strcmp(argv[first], "--methods") == 0) {
+      sPerMethod = true;
+    } else {
+      Usage();
+      return 1;
+    }
+  }
+  if (first == argc) {
+    Usage();
     return 1;
   }
 
@@ -118,7 +170,16 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  bool ok = Analyze(argv[1]);
+  bool ok = true;
+  for (int i = first; i < argc; i++) {
+    if (!Analyze(argv[i]))
+      ok = false;
+  }
+
+  if (sHistogram && argc - first > 1) {
+    fprintf(stdout, "All files: %llu ops\n", (unsigned long long)sCorpus.total());
+    sCorpus.report(stdout, OPCODES_TOTAL, true);
+  }
 
   sEnv->Shutdown();
   delete sEnv;
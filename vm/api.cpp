@@ -10,6 +10,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 //
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -38,7 +39,14 @@
 #endif
 #include "code-stubs.h"
 #include "smx-v1-image.h"
+#include "native-registry.h"
+#include "image-cache.h"
+#include "plugin-context.h"
 #include <amtl/am-string.h>
+#include <amtl/am-thread.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 using namespace sp;
 using namespace SourcePawn;
@@ -76,33 +84,89 @@ SourcePawnEngine::ExecAlloc(size_t size)
 #endif
 }
 
+// Hosts write page memory through the pointer they are given, so when code
+// is dual-mapped it can't come from the code allocator. It gets pages of its
+// own instead, which SetReadWrite and SetReadExecute flip between the two.
+struct PageMemoryHeader
+{
+  CodeChunk chunk;
+  size_t mapped_size;  // Non-zero if this owns its own pages.
+};
+
+static void
+ProtectPageMemory(void* ptr, bool executable)
+{
+  PageMemoryHeader* header = (PageMemoryHeader*)((uint8_t*)ptr - sizeof(PageMemoryHeader));
+  if (!header->mapped_size)
+    return;
+#if defined WIN32
+  DWORD old;
+  VirtualProtect(header, header->mapped_size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE,
+                 &old);
+#else
+  mprotect(header, header->mapped_size, executable ? PROT_READ|PROT_EXEC : PROT_READ|PROT_WRITE);
+#endif
+}
+
 void*
 SourcePawnEngine::AllocatePageMemory(size_t size)
 {
-  CodeChunk chunk = Environment::get()->AllocateCode(size + sizeof(CodeChunk));
-  CodeChunk* hidden = (CodeChunk*)chunk.address();
-  new (hidden) CodeChunk(chunk);
-  return hidden + 1;
+  if (CodeAllocator::IsDualMapped()) {
+    size_t bytes = size + sizeof(PageMemoryHeader);
+    if (bytes < size)
+      return nullptr;
+#if defined WIN32
+    void* base = VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    if (!base)
+      return nullptr;
+#else
+    void* base = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+      return nullptr;
+#endif
+    PageMemoryHeader* header = new (base) PageMemoryHeader();
+    header->mapped_size = bytes;
+    return header + 1;
+  }
+
+  CodeChunk chunk = Environment::get()->AllocateCode(size + sizeof(PageMemoryHeader));
+  if (!chunk.address())
+    return nullptr;
+  PageMemoryHeader* header = new (chunk.address()) PageMemoryHeader();
+  header->chunk = chunk;
+  header->mapped_size = 0;
+  return header + 1;
 }
 
 void
 SourcePawnEngine::SetReadExecute(void* ptr)
 {
-  /* already re */
+  ProtectPageMemory(ptr, true);
 }
 
 void
 SourcePawnEngine::SetReadWrite(void* ptr)
 {
-  /* already rw */
+  ProtectPageMemory(ptr, false);
 }
 
 void
 SourcePawnEngine::FreePageMemory(void* ptr)
 {
   assert(ptr);
-  CodeChunk* hidden = (CodeChunk*)((uint8_t*)ptr - sizeof(CodeChunk));
-  hidden->~CodeChunk();
+  PageMemoryHeader* header = (PageMemoryHeader*)((uint8_t*)ptr - sizeof(PageMemoryHeader));
+  if (size_t mapped_size = header->mapped_size) {
+#if defined WIN32
+    VirtualFree(header, 0, MEM_RELEASE);
+#else
+    munmap(header, mapped_size);
+#endif
+    return;
+  }
+
+  // The chunk frees the memory it lives in, so move it out first.
+  CodeChunk chunk = header->chunk;
+  header->~PageMemoryHeader();
 }
 
 void
@@ -247,6 +311,14 @@ SourcePawnEngine2::LoadPlugin(ICompilation* co, const char* file, int* err)
 
 IPluginRuntime*
 SourcePawnEngine2::LoadBinaryFromFile(const char* file, char* error, size_t maxlength)
+{
+  return LoadBinaryFromFileEx(file, 0, error, maxlength);
+}
+
+// Reading, inflating and validating an image touches nothing but the image
+// and the (locked) image cache, so this is safe to run on any thread.
+static RefPtr<SharedImage>
+ReadImage(ImageCache* cache, const char* file, uint32_t flags, char* error, size_t maxlength)
 {
   FILE* fp = fopen(file, "rb");
 
@@ -255,10 +327,22 @@ SourcePawnEngine2::LoadBinaryFromFile(const char* file, char* error, size_t maxl
     return nullptr;
   }
 
-  std::unique_ptr<SmxV1Image> image(new SmxV1Image(fp));
+  std::unique_ptr<SmxV1Image> image(new SmxV1Image(fp, !!(flags & SP_LOADFLAG_MAP_FILE)));
   fclose(fp);
+  image->setFilePath(file);
+
+  // An unchanged plugin reuses the image validated when it was last loaded.
+  // Mapped images (asked for, or page-aligned files) are never cached, since
+  // that would keep the file mapped after the plugin is unloaded.
+  bool mapped = image->mapped();
+  uint8_t key[FastHash::kDigestSize];
+  if (!mapped && image->buffer()) {
+    ImageCache::ComputeKey(image.get(), flags & SP_LOADFLAG_LAZY_DEBUG_INFO, key);
+    if (RefPtr<SharedImage> cached = cache->Find(key))
+      return cached;
+  }
 
-  if (!image->validate()) {
+  if (!image->validate(!!(flags & SP_LOADFLAG_LAZY_DEBUG_INFO))) {
     const char* errorMessage = image->errorMessage();
     if (!errorMessage)
       errorMessage = "file parse error";
@@ -266,7 +350,29 @@ SourcePawnEngine2::LoadBinaryFromFile(const char* file, char* error, size_t maxl
     return nullptr;
   }
 
-  PluginRuntime* pRuntime = new PluginRuntime(image.release());
+  if (mapped)
+    return new SharedImage(std::move(image), nullptr);
+  return cache->Insert(new SharedImage(std::move(image), key));
+}
+
+IPluginRuntime*
+SourcePawnEngine2::LoadBinaryFromFileEx(const char* file, uint32_t flags, char* error,
+                                        size_t maxlength)
+{
+  RefPtr<SharedImage> image =
+    ReadImage(sp::Environment::get()->image_cache(), file, flags, error, maxlength);
+  if (!image)
+    return nullptr;
+  return FinishLoad(image, file, flags, error, maxlength);
+}
+
+// Creating the runtime registers it with the environment, so this must run on
+// the environment's thread.
+IPluginRuntime*
+SourcePawnEngine2::FinishLoad(const RefPtr<SharedImage>& image, const char* file,
+                              uint32_t flags, char* error, size_t maxlength)
+{
+  PluginRuntime* pRuntime = new PluginRuntime(image, !!(flags & SP_LOADFLAG_MD5_HASHES));
   if (!pRuntime->Initialize()) {
     delete pRuntime;
 
@@ -290,6 +396,14 @@ SourcePawnEngine2::LoadBinaryFromFile(const char* file, char* error, size_t maxl
   if (!pRuntime->Name())
     pRuntime->SetNames(file, file);
 
+  if (flags & SP_LOADFLAG_VERIFY_ALL)
+    pRuntime->VerifyAllMethods();
+
+#if defined(SP_HAS_JIT)
+  if ((flags & SP_LOADFLAG_PRECOMPILE) && Environment::get()->IsJitEnabled())
+    pRuntime->StartPrecompile();
+#endif
+
   return pRuntime;
 }
 
@@ -320,6 +434,8 @@ SourcePawnEngine2::GetEngineName()
   } else {
 # if defined(KE_ARCH_X86)
     info = ", jit-x86";
+# elif defined(KE_ARCH_X64)
+    info = ", jit-x64";
 # else
     info = ", unknown";
 # endif
@@ -443,3 +559,225 @@ SourcePawnEngine2::Environment()
 {
   return Environment::get();
 }
+
+bool
+SourcePawnEngine2::StartSampling(size_t interval_ms)
+{
+  return Environment::get()->StartSampling(interval_ms);
+}
+
+void
+SourcePawnEngine2::StopSampling()
+{
+  Environment::get()->StopSampling();
+}
+
+bool
+SourcePawnEngine2::WriteSampleProfile(const char* path)
+{
+  return Environment::get()->WriteSampleProfile(path);
+}
+
+bool
+SourcePawnEngine2::GetPublicStats(IPluginRuntime* runtime, uint32_t index, PublicStats* stats)
+{
+  PluginRuntime* rt = PluginRuntime::FromAPI(runtime);
+  if (index >= rt->GetPublicsNum())
+    return false;
+
+  ScriptedInvoker* fn = rt->GetPublicFunction(index);
+  if (!fn)
+    return false;
+  *stats = fn->stats();
+  return true;
+}
+
+void
+SourcePawnEngine2::ResetPublicStats(IPluginRuntime* runtime)
+{
+  PluginRuntime* rt = PluginRuntime::FromAPI(runtime);
+  for (uint32_t i = 0; i < rt->GetPublicsNum(); i++) {
+    if (ScriptedInvoker* fn = rt->GetPublicFunction(i))
+      fn->ResetStats();
+  }
+}
+
+IPreparedCall*
+SourcePawnEngine2::CreatePreparedCall()
+{
+  return new PreparedCall();
+}
+
+size_t
+SourcePawnEngine2::InvokeBatch(BatchCall* calls, size_t count)
+{
+  sp::Environment* env = sp::Environment::get();
+  EnterProfileScope profileScope("SourcePawn", "InvokeBatch");
+
+  // One scope for the whole batch. Each call's error is captured and then
+  // cleared, so the next call starts clean.
+  ExceptionHandler eh(this);
+
+  size_t succeeded = 0;
+  for (size_t i = 0; i < count; i++) {
+    BatchCall& call = calls[i];
+    call.result = 0;
+
+    bool ok;
+    if (call.args)
+      ok = call.args->Invoke(call.function, &call.result);
+    else
+      ok = call.function->Invoke(&call.result);
+
+    if (ok) {
+      call.error = SP_ERROR_NONE;
+      succeeded++;
+    } else {
+      call.error = env->hasPendingException()
+                   ? env->getPendingExceptionCode()
+                   : SP_ERROR_ABORTED;
+      env->clearPendingException();
+    }
+  }
+  return succeeded;
+}
+
+void
+SourcePawnEngine2::LoadBinariesFromFiles(const char* const* files, size_t count, uint32_t flags,
+                                         LoadResult* results)
+{
+  ImageCache* cache = sp::Environment::get()->image_cache();
+  std::vector<RefPtr<SharedImage>> images(count);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() -> void {
+    for (;;) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count)
+        return;
+      results[i].error[0] = '\0';
+      images[i] = ReadImage(cache, files[i], flags, results[i].error, sizeof(results[i].error));
+    }
+  };
+
+  size_t num_threads = std::min<size_t>(std::thread::hardware_concurrency(), count);
+  std::vector<std::unique_ptr<std::thread>> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    if (std::unique_ptr<std::thread> thread = ke::NewThread("SourcePawn Loader", worker))
+      threads.push_back(std::move(thread));
+  }
+
+  // This thread helps out, which also covers thread creation failing.
+  worker();
+  for (const auto& thread : threads)
+    thread->join();
+
+  // Runtimes are created in order, so the result is the same as loading each
+  // file in turn.
+  for (size_t i = 0; i < count; i++) {
+    results[i].runtime = nullptr;
+    if (!images[i])
+      continue;
+    results[i].runtime = FinishLoad(images[i], files[i], flags, results[i].error,
+                                    sizeof(results[i].error));
+  }
+}
+
+bool
+SourcePawnEngine2::RegisterNatives(const sp_nativeinfo_t* natives)
+{
+  return sp::Environment::get()->natives()->Register(natives);
+}
+
+bool
+SourcePawnEngine2::RegisterTypedNatives(const sp_typed_nativeinfo_t* natives)
+{
+  return sp::Environment::get()->natives()->RegisterTyped(natives);
+}
+
+size_t
+SourcePawnEngine2::BindRegisteredNatives(IPluginRuntime* runtime)
+{
+  return sp::Environment::get()->natives()->BindAll(PluginRuntime::FromAPI(runtime));
+}
+
+bool
+SourcePawnEngine2::WriteMethodProfile(IPluginRuntime* runtime, const char* path)
+{
+  FILE* fp = fopen(path, "wt");
+  if (!fp)
+    return false;
+  bool ok = PluginRuntime::FromAPI(runtime)->WriteMethodProfile(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  return ok;
+}
+
+bool
+SourcePawnEngine2::ApplyMethodProfile(IPluginRuntime* runtime, const char* path)
+{
+  FILE* fp = fopen(path, "rt");
+  if (!fp)
+    return false;
+  bool ok = PluginRuntime::FromAPI(runtime)->ApplyMethodProfile(fp);
+  fclose(fp);
+  return ok;
+}
+
+void
+SourcePawnEngine2::GetMemoryStats(IPluginRuntime* runtime, MemoryStats* stats)
+{
+  PluginRuntime::FromAPI(runtime)->GetBaseContext()->GetMemoryStats(stats);
+}
+
+void
+SourcePawnEngine2::ResetMemoryStats(IPluginRuntime* runtime)
+{
+  PluginRuntime::FromAPI(runtime)->GetBaseContext()->ResetMemoryStats();
+}
+
+void
+SourcePawnEngine2::GetJitStats(IPluginRuntime* runtime, JitStats* stats)
+{
+  PluginRuntime::FromAPI(runtime)->GetJitStats(stats);
+}
+
+bool
+SourcePawnEngine2::WriteJitReport(IPluginRuntime* runtime, const char* path)
+{
+  FILE* fp = fopen(path, "wt");
+  if (!fp)
+    return false;
+  bool ok = PluginRuntime::FromAPI(runtime)->WriteJitReport(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  return ok;
+}
+
+bool
+SourcePawnEngine2::StartRecording(IPluginRuntime* runtime, const char* path)
+{
+  return PluginRuntime::FromAPI(runtime)->StartRecording(path);
+}
+
+bool
+SourcePawnEngine2::StopRecording(IPluginRuntime* runtime)
+{
+  return PluginRuntime::FromAPI(runtime)->StopRecording();
+}
+
+bool
+SourcePawnEngine2::SetNativeManifest(uint32_t id, const char* const* names, size_t count)
+{
+  return sp::Environment::get()->natives()->SetManifest(id, names, count);
+}
+
+bool
+SourcePawnEngine2::ReplaceCode(IPluginRuntime* runtime, const char* file, char* error,
+                               size_t maxlength)
+{
+  RefPtr<SharedImage> image =
+    ReadImage(sp::Environment::get()->image_cache(), file, 0, error, maxlength);
+  if (!image)
+    return false;
+  return PluginRuntime::FromAPI(runtime)->ReplaceCode(image, error, maxlength);
+}
@@ -13,13 +13,18 @@
 #ifndef _include_sourcepawn_vm_api_h_
 #define _include_sourcepawn_vm_api_h_
 
+#include <memory>
+
 #include <sp_vm_api.h>
+#include <amtl/am-refcounting.h>
 #include <am-cxx.h> // Replace with am-cxx later.
 
 namespace sp {
 
 using namespace SourcePawn;
 
+class SharedImage;
+
 class SourcePawnEngine : public ISourcePawnEngine
 {
  public:
@@ -70,6 +75,35 @@ class SourcePawnEngine2 : public ISourcePawnEngine2
   void SetProfilingTool(IProfilingTool* tool) override;
   IPluginRuntime* LoadBinaryFromFile(const char* file, char* error, size_t maxlength) override;
   ISourcePawnEnvironment* Environment() override;
+  IPluginRuntime* LoadBinaryFromFileEx(const char* file, uint32_t flags, char* error,
+                                       size_t maxlength) override;
+  bool StartSampling(size_t interval_ms) override;
+  void StopSampling() override;
+  bool WriteSampleProfile(const char* path) override;
+  bool GetPublicStats(IPluginRuntime* runtime, uint32_t index, PublicStats* stats) override;
+  void ResetPublicStats(IPluginRuntime* runtime) override;
+  IPreparedCall* CreatePreparedCall() override;
+  size_t InvokeBatch(BatchCall* calls, size_t count) override;
+  void LoadBinariesFromFiles(const char* const* files, size_t count, uint32_t flags,
+                             LoadResult* results) override;
+  bool RegisterNatives(const sp_nativeinfo_t* natives) override;
+  bool RegisterTypedNatives(const sp_typed_nativeinfo_t* natives) override;
+  size_t BindRegisteredNatives(IPluginRuntime* runtime) override;
+  bool WriteMethodProfile(IPluginRuntime* runtime, const char* path) override;
+  bool ApplyMethodProfile(IPluginRuntime* runtime, const char* path) override;
+  void GetMemoryStats(IPluginRuntime* runtime, MemoryStats* stats) override;
+  void ResetMemoryStats(IPluginRuntime* runtime) override;
+  void GetJitStats(IPluginRuntime* runtime, JitStats* stats) override;
+  bool WriteJitReport(IPluginRuntime* runtime, const char* path) override;
+  bool StartRecording(IPluginRuntime* runtime, const char* path) override;
+  bool StopRecording(IPluginRuntime* runtime) override;
+  bool SetNativeManifest(uint32_t id, const char* const* names, size_t count) override;
+  bool ReplaceCode(IPluginRuntime* runtime, const char* file, char* error,
+                   size_t maxlength) override;
+
+ private:
+  IPluginRuntime* FinishLoad(const ke::RefPtr<SharedImage>& image, const char* file,
+                             uint32_t flags, char* error, size_t maxlength);
 
  private:
   char engine_name_[256];
@@ -0,0 +1,121 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_append_only_list_h_
+#define _include_sourcepawn_vm_append_only_list_h_
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include <amtl/am-bits.h>
+
+namespace sp {
+
+// A list that one thread appends to while others read it, without a lock.
+// Entries live in segments that double in size and never move, so a reader
+// that loads the length sees every entry below it fully constructed, no
+// matter what the writer does next. Entries can't be removed or replaced.
+template <typename T>
+class AppendOnlyList
+{
+  static const size_t kFirstSegmentBits = 4;
+  static const size_t kFirstSegmentSize = size_t(1) << kFirstSegmentBits;
+  static const size_t kMaxSegments = sizeof(size_t) * 8 - kFirstSegmentBits;
+
+ public:
+  AppendOnlyList()
+   : length_(0)
+  {
+    for (size_t i = 0; i < kMaxSegments; i++)
+      segments_[i] = nullptr;
+  }
+  ~AppendOnlyList() {
+    for (size_t i = 0; i < kMaxSegments; i++)
+      delete[] segments_[i];
+  }
+
+  AppendOnlyList(const AppendOnlyList&) = delete;
+  AppendOnlyList& operator =(const AppendOnlyList&) = delete;
+
+  // Only one thread may append.
+  void append(const T& item) {
+    size_t index = length_.load(std::memory_order_relaxed);
+    size_t segment, offset;
+    locate(index, &segment, &offset);
+    if (!segments_[segment])
+      segments_[segment] = new T[kFirstSegmentSize << segment];
+    segments_[segment][offset] = item;
+    length_.store(index + 1, std::memory_order_release);
+  }
+
+  // Any thread may read up to the length it saw.
+  size_t length() const {
+    return length_.load(std::memory_order_acquire);
+  }
+  const T& at(size_t index) const {
+    size_t segment, offset;
+    locate(index, &segment, &offset);
+    return segments_[segment][offset];
+  }
+
+  class iterator
+  {
+   public:
+    iterator(const AppendOnlyList* list, size_t index)
+     : list_(list),
+       index_(index)
+    {}
+    const T& operator *() const {
+      return list_->at(index_);
+    }
+    iterator& operator ++() {
+      index_++;
+      return *this;
+    }
+    bool operator !=(const iterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    const AppendOnlyList* list_;
+    size_t index_;
+  };
+
+  // The end is fixed when it is asked for; entries appended during a loop
+  // are not visited.
+  iterator begin() const {
+    return iterator(this, 0);
+  }
+  iterator end() const {
+    return iterator(this, length());
+  }
+
+ private:
+  // Segment n holds entries [16 * (2^n - 1), 16 * (2^(n+1) - 1)).
+  static void locate(size_t index, size_t* segment, size_t* offset) {
+    size_t biased = index + kFirstSegmentSize;
+    size_t top = ke::FindLeftmostBit(biased);
+    *segment = top - kFirstSegmentBits;
+    *offset = biased - (size_t(1) << top);
+    assert(*segment < kMaxSegments);
+  }
+
+ private:
+  std::atomic<size_t> length_;
+  T* segments_[kMaxSegments];
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_append_only_list_h_
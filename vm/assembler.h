@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include "label.h"
 
@@ -70,6 +71,32 @@ class AssemblerBase
     return uint32_t(pos_ - buffer_);
   }
 
+  // Pads to a multiple of |bytes| with the long NOP forms, for code that may
+  // be fallen into. The encodings are the same on x86 and x64.
+  void nopAlign(uint32_t bytes) {
+    static const uint8_t kNops[][8] = {
+      { 0x90 },
+      { 0x66, 0x90 },
+      { 0x0f, 0x1f, 0x00 },
+      { 0x0f, 0x1f, 0x40, 0x00 },
+      { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+      { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+      { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+      { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    assert(bytes <= kMaxInstructionSize);
+    if (!ensureSpace())
+      return;
+
+    uint32_t padding = (bytes - (pc() & (bytes - 1))) & (bytes - 1);
+    while (padding) {
+      uint32_t n = padding < 8 ? padding : 8;
+      memcpy(pos_, kNops[n - 1], n);
+      pos_ += n;
+      padding -= n;
+    }
+  }
+
  protected:
   void writeByte(uint8_t byte) {
     write<uint8_t>(byte);
@@ -0,0 +1,828 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#include "bounds-analysis.h"
+#include "plugin-runtime.h"
+#include <smx/smx-v1-opcodes.h>
+#include "opcodes.h"
+
+#include <limits.h>
+
+#include <algorithm>
+
+namespace sp {
+
+typedef BoundsAnalysis::Range Range;
+typedef BoundsAnalysis::RegFact RegFact;
+typedef BoundsAnalysis::State State;
+typedef BoundsAnalysis::BlockData BoundsBlockData;
+
+static const cell_t kFullLo = INT_MIN;
+static const cell_t kFullHi = INT_MAX;
+
+static bool
+IsConditionalJump(cell_t op, CompareOp* cmp)
+{
+  switch (op) {
+    case OP_JZER:
+      *cmp = CompareOp::Zero;
+      return true;
+    case OP_JNZ:
+      *cmp = CompareOp::NotZero;
+      return true;
+    case OP_JEQ:
+      *cmp = CompareOp::Eq;
+      return true;
+    case OP_JNEQ:
+      *cmp = CompareOp::Neq;
+      return true;
+    case OP_JSLESS:
+      *cmp = CompareOp::Sless;
+      return true;
+    case OP_JSLEQ:
+      *cmp = CompareOp::Sleq;
+      return true;
+    case OP_JSGRTR:
+      *cmp = CompareOp::Sgrtr;
+      return true;
+    case OP_JSGEQ:
+      *cmp = CompareOp::Sgeq;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The condition that holds when |op| is false.
+static CompareOp
+NegateCompare(CompareOp op)
+{
+  switch (op) {
+    case CompareOp::Zero:
+      return CompareOp::NotZero;
+    case CompareOp::NotZero:
+      return CompareOp::Zero;
+    case CompareOp::Eq:
+      return CompareOp::Neq;
+    case CompareOp::Neq:
+      return CompareOp::Eq;
+    case CompareOp::Sless:
+      return CompareOp::Sgeq;
+    case CompareOp::Sleq:
+      return CompareOp::Sgrtr;
+    case CompareOp::Sgrtr:
+      return CompareOp::Sleq;
+    case CompareOp::Sgeq:
+      return CompareOp::Sless;
+    default:
+      assert(false);
+      return op;
+  }
+}
+
+// The same condition with its operands swapped.
+static CompareOp
+FlipCompare(CompareOp op)
+{
+  switch (op) {
+    case CompareOp::Sless:
+      return CompareOp::Sgrtr;
+    case CompareOp::Sleq:
+      return CompareOp::Sgeq;
+    case CompareOp::Sgrtr:
+      return CompareOp::Sless;
+    case CompareOp::Sgeq:
+      return CompareOp::Sleq;
+    default:
+      return op;
+  }
+}
+
+BoundsAnalysis::BoundsAnalysis(PluginRuntime* rt, ControlFlowGraph* graph, bool debug_break,
+                               const FrameElementAccesses* elements)
+ : rt_(rt),
+   graph_(graph),
+   debug_break_(debug_break),
+   elements_(elements)
+{
+}
+
+bool
+BoundsAnalysis::isRedundant(const cell_t* cip) const
+{
+  return std::binary_search(redundant_.begin(), redundant_.end(), cip);
+}
+
+int
+BoundsAnalysis::slotIndex(cell_t offset) const
+{
+  auto iter = std::lower_bound(tracked_.begin(), tracked_.end(), offset);
+  if (iter == tracked_.end() || *iter != offset)
+    return -1;
+  return int(iter - tracked_.begin());
+}
+
+// Number each tracked slot, and compute the static stack depth at the start
+// of each block. Returns false if there is nothing to do.
+bool
+BoundsAnalysis::scanBlocks()
+{
+  bool has_bounds = false;
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* block = *iter;
+    BoundsBlockData* data = block->data<BoundsBlockData>();
+    if (block == graph_->entry())
+      data->entry_depth = 0;
+    if (data->entry_depth < 0)
+      return false;
+
+    int32_t depth = data->entry_depth;
+    ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+      if (*cip == OP_BOUNDS || *cip == OP_LIDX_S_BOUNDS || *cip == OP_IDXADDR_S_BOUNDS)
+        has_bounds = true;
+
+      FrameEffects fx;
+      DecodeFrameEffects(cip, prev, debug_break_, &fx, elements_);
+      aliasing_.scan(fx);
+      for (size_t i = 0; i < fx.naccesses; i++)
+        tracked_.push_back(fx.accesses[i].offset);
+      depth -= fx.adjust;
+    });
+
+    for (const auto& succ : block->successors()) {
+      BoundsBlockData* succ_data = succ->data<BoundsBlockData>();
+      if (succ_data->entry_depth < 0)
+        succ_data->entry_depth = depth;
+    }
+  }
+  if (!has_bounds)
+    return false;
+
+  std::sort(tracked_.begin(), tracked_.end());
+  tracked_.erase(std::unique(tracked_.begin(), tracked_.end()), tracked_.end());
+  tracked_.erase(
+    std::remove_if(tracked_.begin(), tracked_.end(),
+                   [this](cell_t offset) -> bool {
+                     return !aliasing_.isTrackable(offset);
+                   }),
+    tracked_.end());
+  return true;
+}
+
+static Range
+FullRange()
+{
+  Range range = { kFullLo, kFullHi };
+  return range;
+}
+
+static Range
+ConstantRange(cell_t value)
+{
+  Range range = { value, value };
+  return range;
+}
+
+static Range
+Hull(const Range& a, const Range& b)
+{
+  Range range = { std::min(a.lo, b.lo), std::max(a.hi, b.hi) };
+  return range;
+}
+
+// An empty intersection means the path is infeasible. We don't prune those,
+// so just keep what we had.
+static Range
+Intersect(const Range& a, const Range& b)
+{
+  Range range = { std::max(a.lo, b.lo), std::min(a.hi, b.hi) };
+  if (range.lo > range.hi)
+    return a;
+  return range;
+}
+
+static Range
+AddConstant(const Range& a, cell_t value)
+{
+  int64_t lo = int64_t(a.lo) + value;
+  int64_t hi = int64_t(a.hi) + value;
+  if (lo < kFullLo || hi > kFullHi)
+    return FullRange();
+  Range range = { cell_t(lo), cell_t(hi) };
+  return range;
+}
+
+// The values of x for which (x op value) holds.
+static bool
+CompareRange(CompareOp op, cell_t value, Range* range)
+{
+  *range = FullRange();
+  switch (op) {
+    case CompareOp::Eq:
+      *range = ConstantRange(value);
+      return true;
+    case CompareOp::Sless:
+      if (value == kFullLo)
+        return false;
+      range->hi = value - 1;
+      return true;
+    case CompareOp::Sleq:
+      range->hi = value;
+      return true;
+    case CompareOp::Sgrtr:
+      if (value == kFullHi)
+        return false;
+      range->lo = value + 1;
+      return true;
+    case CompareOp::Sgeq:
+      range->lo = value;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool
+SameRange(const Range& a, const Range& b)
+{
+  return a.lo == b.lo && a.hi == b.hi;
+}
+
+static RegFact
+UnknownReg()
+{
+  RegFact reg;
+  reg.range.lo = kFullLo;
+  reg.range.hi = kFullHi;
+  reg.slot = 0;
+  reg.cond_slot = 0;
+  reg.cond_op = CompareOp::Zero;
+  reg.cond_value = 0;
+  return reg;
+}
+
+static RegFact
+ConstantReg(cell_t value)
+{
+  RegFact reg = UnknownReg();
+  reg.range.lo = value;
+  reg.range.hi = value;
+  return reg;
+}
+
+static bool
+IsConstant(const RegFact& reg, cell_t* value)
+{
+  if (reg.range.lo != reg.range.hi)
+    return false;
+  *value = reg.range.lo;
+  return true;
+}
+
+static bool
+SameReg(const RegFact& a, const RegFact& b)
+{
+  return SameRange(a.range, b.range) &&
+         a.slot == b.slot &&
+         a.cond_slot == b.cond_slot &&
+         (!a.cond_slot || (a.cond_op == b.cond_op && a.cond_value == b.cond_value));
+}
+
+static RegFact
+JoinReg(const RegFact& a, const RegFact& b)
+{
+  RegFact reg = a;
+  reg.range = Hull(a.range, b.range);
+  if (a.slot != b.slot)
+    reg.slot = 0;
+  if (a.cond_slot != b.cond_slot || a.cond_op != b.cond_op || a.cond_value != b.cond_value)
+    reg.cond_slot = 0;
+  return reg;
+}
+
+static bool
+SameState(const State& a, const State& b)
+{
+  if (!SameReg(a.pri, b.pri) || !SameReg(a.alt, b.alt))
+    return false;
+  for (size_t i = 0; i < a.slots.size(); i++) {
+    if (!SameRange(a.slots[i], b.slots[i]))
+      return false;
+  }
+  return true;
+}
+
+static void
+JoinState(State* state, const State& other)
+{
+  state->pri = JoinReg(state->pri, other.pri);
+  state->alt = JoinReg(state->alt, other.alt);
+  for (size_t i = 0; i < state->slots.size(); i++)
+    state->slots[i] = Hull(state->slots[i], other.slots[i]);
+}
+
+// Any bound still moving at a loop header goes straight to its extreme, so
+// the analysis terminates.
+static Range
+Widen(const Range& old, const Range& now)
+{
+  Range range = Hull(old, now);
+  if (now.lo < old.lo)
+    range.lo = kFullLo;
+  if (now.hi > old.hi)
+    range.hi = kFullHi;
+  return range;
+}
+
+static void
+WidenState(const State& old, State* state)
+{
+  JoinState(state, old);
+  state->pri.range = Widen(old.pri.range, state->pri.range);
+  state->alt.range = Widen(old.alt.range, state->alt.range);
+  for (size_t i = 0; i < state->slots.size(); i++)
+    state->slots[i] = Widen(old.slots[i], state->slots[i]);
+}
+
+void
+BoundsAnalysis::writeSlot(State* state, cell_t offset, const Range& range)
+{
+  int index = slotIndex(offset);
+  if (index < 0)
+    return;
+  state->slots[index] = range;
+
+  for (RegFact* reg : { &state->pri, &state->alt }) {
+    if (reg->slot == offset)
+      reg->slot = 0;
+    if (reg->cond_slot == offset)
+      reg->cond_slot = 0;
+  }
+}
+
+void
+BoundsAnalysis::killSlot(State* state, cell_t offset)
+{
+  writeSlot(state, offset, FullRange());
+}
+
+void
+BoundsAnalysis::refineSlot(State* state, cell_t offset, const Range& range)
+{
+  int index = slotIndex(offset);
+  if (index < 0)
+    return;
+  state->slots[index] = Intersect(state->slots[index], range);
+
+  // Registers holding a copy of the slot learn the same thing.
+  for (RegFact* reg : { &state->pri, &state->alt }) {
+    if (reg->slot == offset)
+      reg->range = Intersect(reg->range, range);
+  }
+}
+
+void
+BoundsAnalysis::refine(State* state, RegFact* reg, CompareOp op, cell_t value)
+{
+  Range range;
+  if (!CompareRange(op, value, &range))
+    return;
+
+  reg->range = Intersect(reg->range, range);
+  if (reg->slot)
+    refineSlot(state, reg->slot, range);
+}
+
+void
+BoundsAnalysis::transfer(State* state, const cell_t* cip, const cell_t* prev, bool record)
+{
+  auto load = [&](RegFact* reg, cell_t offset) -> void {
+    *reg = UnknownReg();
+    int index = slotIndex(offset);
+    if (index < 0)
+      return;
+    reg->range = state->slots[index];
+    reg->slot = offset;
+  };
+  auto store = [&](RegFact* reg, cell_t offset) -> void {
+    writeSlot(state, offset, reg->range);
+    if (slotIndex(offset) >= 0)
+      reg->slot = offset;
+  };
+  auto adjust = [&](cell_t offset, cell_t value) -> void {
+    int index = slotIndex(offset);
+    if (index >= 0)
+      writeSlot(state, offset, AddConstant(state->slots[index], value));
+  };
+  auto compare = [&](CompareOp op) -> void {
+    RegFact result = UnknownReg();
+    result.range.lo = 0;
+    result.range.hi = 1;
+
+    cell_t value;
+    if (state->pri.slot && IsConstant(state->alt, &value)) {
+      result.cond_slot = state->pri.slot;
+      result.cond_op = op;
+      result.cond_value = value;
+    } else if (state->alt.slot && IsConstant(state->pri, &value)) {
+      result.cond_slot = state->alt.slot;
+      result.cond_op = FlipCompare(op);
+      result.cond_value = value;
+    }
+    state->pri = result;
+  };
+  auto compare_c = [&](const RegFact& reg, cell_t value) -> void {
+    RegFact result = UnknownReg();
+    result.range.lo = 0;
+    result.range.hi = 1;
+    if (reg.slot) {
+      result.cond_slot = reg.slot;
+      result.cond_op = CompareOp::Eq;
+      result.cond_value = value;
+    }
+    state->pri = result;
+  };
+
+  switch (*cip) {
+    case OP_PROC:
+    case OP_NOP:
+    case OP_BREAK:
+    case OP_JUMP:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+    case OP_PUSH_PRI:
+    case OP_PUSH_ALT:
+    case OP_PUSH_C:
+    case OP_PUSH2_C:
+    case OP_PUSH3_C:
+    case OP_PUSH4_C:
+    case OP_PUSH5_C:
+    case OP_PUSH:
+    case OP_PUSH2:
+    case OP_PUSH3:
+    case OP_PUSH4:
+    case OP_PUSH5:
+    case OP_PUSH_S:
+    case OP_PUSH2_S:
+    case OP_PUSH3_S:
+    case OP_PUSH4_S:
+    case OP_PUSH5_S:
+    case OP_PUSH_ADR:
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_ADR:
+    case OP_STACK:
+    case OP_STOR_PRI:
+    case OP_STOR_ALT:
+    case OP_STRB_I:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_ZERO:
+    case OP_INC:
+    case OP_DEC:
+    case OP_CONST:
+      break;
+
+    case OP_LOAD_S_PRI:
+      load(&state->pri, cip[1]);
+      break;
+    case OP_LOAD_S_ALT:
+      load(&state->alt, cip[1]);
+      break;
+    case OP_LOAD_S_BOTH:
+      load(&state->pri, cip[1]);
+      load(&state->alt, cip[2]);
+      break;
+
+    case OP_STOR_S_PRI:
+      store(&state->pri, cip[1]);
+      break;
+    case OP_STOR_S_ALT:
+      store(&state->alt, cip[1]);
+      break;
+
+    case OP_ZERO_S:
+      writeSlot(state, cip[1], ConstantRange(0));
+      break;
+
+    // Array elements at a known offset are slots like any other.
+    case OP_LOAD_I:
+    {
+      cell_t offset;
+      if (elements_ && elements_->slotFor(cip, &offset))
+        load(&state->pri, offset);
+      else
+        state->pri = UnknownReg();
+      break;
+    }
+    case OP_STOR_I:
+    {
+      cell_t offset;
+      if (elements_ && elements_->slotFor(cip, &offset))
+        store(&state->pri, offset);
+      break;
+    }
+    case OP_FILL:
+    {
+      cell_t offset;
+      if (elements_ && elements_->slotFor(cip, &offset)) {
+        for (cell_t i = 0; i < cip[1]; i += sizeof(cell_t))
+          writeSlot(state, offset + i, state->pri.range);
+      }
+      break;
+    }
+    case OP_CONST_S:
+      writeSlot(state, cip[1], ConstantRange(cip[2]));
+      break;
+    case OP_INC_S:
+      adjust(cip[1], 1);
+      break;
+    case OP_DEC_S:
+      adjust(cip[1], -1);
+      break;
+
+    case OP_CONST_PRI:
+      state->pri = ConstantReg(cip[1]);
+      break;
+    case OP_CONST_ALT:
+      state->alt = ConstantReg(cip[1]);
+      break;
+    case OP_ZERO_PRI:
+      state->pri = ConstantReg(0);
+      break;
+    case OP_ZERO_ALT:
+      state->alt = ConstantReg(0);
+      break;
+
+    case OP_ADD_C:
+    {
+      Range range = AddConstant(state->pri.range, cip[1]);
+      state->pri = UnknownReg();
+      state->pri.range = range;
+      break;
+    }
+    case OP_INC_PRI:
+    case OP_DEC_PRI:
+    {
+      Range range = AddConstant(state->pri.range, (*cip == OP_INC_PRI) ? 1 : -1);
+      state->pri = UnknownReg();
+      state->pri.range = range;
+      break;
+    }
+    case OP_INC_ALT:
+    case OP_DEC_ALT:
+    {
+      Range range = AddConstant(state->alt.range, (*cip == OP_INC_ALT) ? 1 : -1);
+      state->alt = UnknownReg();
+      state->alt.range = range;
+      break;
+    }
+
+    case OP_MOVE_PRI:
+      state->pri = state->alt;
+      break;
+    case OP_MOVE_ALT:
+      state->alt = state->pri;
+      break;
+    case OP_XCHG:
+      std::swap(state->pri, state->alt);
+      break;
+
+    case OP_EQ:
+      compare(CompareOp::Eq);
+      break;
+    case OP_NEQ:
+      compare(CompareOp::Neq);
+      break;
+    case OP_SLESS:
+      compare(CompareOp::Sless);
+      break;
+    case OP_SLEQ:
+      compare(CompareOp::Sleq);
+      break;
+    case OP_SGRTR:
+      compare(CompareOp::Sgrtr);
+      break;
+    case OP_SGEQ:
+      compare(CompareOp::Sgeq);
+      break;
+    case OP_EQ_C_PRI:
+      compare_c(state->pri, cip[1]);
+      break;
+    case OP_EQ_C_ALT:
+      compare_c(state->alt, cip[1]);
+      break;
+
+    case OP_BOUNDS:
+    {
+      // BOUNDS is an unsigned compare, so a limit that doesn't fit in a cell
+      // says nothing about negative indexes.
+      cell_t limit = cip[1];
+      if (limit < 0)
+        break;
+      if (record && state->pri.range.lo >= 0 && state->pri.range.hi <= limit)
+        redundant_.push_back(cip);
+      refine(state, &state->pri, CompareOp::Sgeq, 0);
+      refine(state, &state->pri, CompareOp::Sleq, limit);
+      break;
+    }
+
+    case OP_LIDX_S_BOUNDS:
+    case OP_IDXADDR_S_BOUNDS:
+    {
+      // The index is checked just like BOUNDS, which narrows its slot; the
+      // registers end up holding an element and the array's address.
+      cell_t limit = cip[3];
+      load(&state->pri, cip[2]);
+      if (limit >= 0) {
+        if (record && state->pri.range.lo >= 0 && state->pri.range.hi <= limit)
+          redundant_.push_back(cip);
+        refine(state, &state->pri, CompareOp::Sgeq, 0);
+        refine(state, &state->pri, CompareOp::Sleq, limit);
+      }
+      state->pri = UnknownReg();
+      state->alt = UnknownReg();
+      break;
+    }
+
+    case OP_HEAP:
+      state->alt = UnknownReg();
+      break;
+
+    default:
+      state->pri = UnknownReg();
+      state->alt = UnknownReg();
+      break;
+  }
+
+  FrameEffects fx;
+  DecodeFrameEffects(cip, prev, debug_break_, &fx, elements_);
+
+  for (int32_t i = 1; i <= fx.pushes; i++)
+    killSlot(state, -cell_t(sizeof(cell_t)) * (state->depth + i));
+  state->depth += fx.pushes;
+
+  for (int32_t i = 0; i < fx.overwrites; i++)
+    killSlot(state, -cell_t(sizeof(cell_t)) * (state->depth - i));
+
+  if (fx.clobber == Clobber::All) {
+    for (cell_t offset : tracked_)
+      killSlot(state, offset);
+  } else if (fx.clobber != Clobber::None) {
+    cell_t top = -cell_t(sizeof(cell_t)) * state->depth;
+    for (cell_t offset : tracked_) {
+      if (offset < top)
+        killSlot(state, offset);
+    }
+  }
+
+  state->depth -= fx.adjust + fx.pushes;
+}
+
+// Compute the state flowing along the edge from |pred| to |succ|, narrowing
+// it by the branch condition if the edge is one arm of a conditional jump.
+bool
+BoundsAnalysis::edgeState(Block* pred, Block* succ, State* state)
+{
+  *state = pred->data<BoundsBlockData>()->exit;
+  if (pred->endType() != BlockEnd::Insn)
+    return true;
+
+  const cell_t* cip = reinterpret_cast<const cell_t*>(pred->end());
+  CompareOp op;
+  if (!IsConditionalJump(*cip, &op))
+    return true;
+
+  const uint8_t* target = rt_->code().bytes + cip[1];
+  const uint8_t* fallthrough = NextInstruction(pred->end());
+  if (target == fallthrough)
+    return true;
+  if (succ->start() != target)
+    op = NegateCompare(op);
+
+  switch (op) {
+    case CompareOp::Zero:
+      refine(state, &state->pri, CompareOp::Eq, 0);
+      if (state->pri.cond_slot) {
+        Range range;
+        if (CompareRange(NegateCompare(state->pri.cond_op), state->pri.cond_value, &range))
+          refineSlot(state, state->pri.cond_slot, range);
+      }
+      break;
+    case CompareOp::NotZero:
+      if (state->pri.cond_slot) {
+        Range range;
+        if (CompareRange(state->pri.cond_op, state->pri.cond_value, &range))
+          refineSlot(state, state->pri.cond_slot, range);
+      }
+      break;
+    default:
+    {
+      cell_t value;
+      if (IsConstant(state->alt, &value))
+        refine(state, &state->pri, op, value);
+      else if (IsConstant(state->pri, &value))
+        refine(state, &state->alt, FlipCompare(op), value);
+      break;
+    }
+  }
+  return true;
+}
+
+bool
+BoundsAnalysis::entryState(Block* block, State* state)
+{
+  BoundsBlockData* data = block->data<BoundsBlockData>();
+  if (block == graph_->entry()) {
+    state->pri = UnknownReg();
+    state->alt = UnknownReg();
+    state->slots.assign(tracked_.size(), FullRange());
+    state->depth = 0;
+    return true;
+  }
+
+  bool found = false;
+  for (const auto& pred : block->predecessors()) {
+    if (!pred->data<BoundsBlockData>()->has_exit)
+      continue;
+
+    State edge;
+    edgeState(pred, block, &edge);
+    if (!found) {
+      *state = edge;
+      found = true;
+    } else {
+      JoinState(state, edge);
+    }
+  }
+  state->depth = data->entry_depth;
+  return found;
+}
+
+void
+BoundsAnalysis::analyze()
+{
+  AutoClearBlockData<BoundsBlockData> clear(graph_);
+  if (!scanBlocks())
+    return;
+
+  for (;;) {
+    bool changed = false;
+    for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+      Block* block = *iter;
+      BoundsBlockData* data = block->data<BoundsBlockData>();
+
+      State state;
+      if (!entryState(block, &state))
+        continue;
+      if (data->has_exit) {
+        if (block->isLoopHeader())
+          WidenState(data->entry, &state);
+        if (SameState(state, data->entry))
+          continue;
+      }
+
+      data->entry = state;
+      ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+        transfer(&state, cip, prev, false);
+      });
+      data->exit = std::move(state);
+      data->has_exit = true;
+      changed = true;
+    }
+    if (!changed)
+      break;
+  }
+
+  // The states are stable, so one more pass can decide each check.
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    BoundsBlockData* data = iter->data<BoundsBlockData>();
+    if (!data->has_exit)
+      continue;
+
+    State state = data->entry;
+    ForEachInstruction(*iter, [&](const cell_t* cip, const cell_t* prev) -> void {
+      transfer(&state, cip, prev, true);
+    });
+  }
+  std::sort(redundant_.begin(), redundant_.end());
+}
+
+} // namespace sp
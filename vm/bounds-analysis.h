@@ -0,0 +1,114 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#ifndef _include_sourcepawn_vm_bounds_analysis_h_
+#define _include_sourcepawn_vm_bounds_analysis_h_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_types.h>
+#include "control-flow.h"
+#include "frame-effects.h"
+#include "pcode-visitor.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// Finds BOUNDS instructions that can never fail. This is an interval analysis
+// over PRI, ALT, and every frame slot whose address is never taken. Compares
+// feeding a conditional jump narrow the ranges on each outgoing edge, and loop
+// headers widen any bound that is still moving, so a loop counter compared
+// against a constant limit is known to be in range inside the loop body.
+class BoundsAnalysis
+{
+ public:
+  BoundsAnalysis(PluginRuntime* rt, ControlFlowGraph* graph, bool debug_break,
+                 const FrameElementAccesses* elements);
+
+  void analyze();
+
+  // Returns whether the BOUNDS instruction at |cip| is known to pass.
+  bool isRedundant(const cell_t* cip) const;
+
+  size_t numRedundant() const {
+    return redundant_.size();
+  }
+
+  // The lattice, shared with the helpers in bounds-analysis.cpp.
+  struct Range {
+    cell_t lo;
+    cell_t hi;
+  };
+
+  // What is known about PRI or ALT. If |slot| is non-zero, the register holds
+  // a copy of that frame slot. If |cond_slot| is non-zero, the register is the
+  // boolean result of comparing that slot against |cond_value|.
+  struct RegFact {
+    Range range;
+    cell_t slot;
+    cell_t cond_slot;
+    CompareOp cond_op;
+    cell_t cond_value;
+  };
+
+  struct State {
+    RegFact pri;
+    RegFact alt;
+    std::vector<Range> slots;
+    int32_t depth;
+  };
+
+  struct BlockData : public IBlockData {
+    BlockData()
+     : entry_depth(-1),
+       has_exit(false)
+    {}
+
+    int32_t entry_depth;
+    bool has_exit;
+    State entry;
+    State exit;
+  };
+
+ private:
+  bool scanBlocks();
+  void transfer(State* state, const cell_t* cip, const cell_t* prev, bool record);
+  bool edgeState(Block* pred, Block* succ, State* state);
+  bool entryState(Block* block, State* state);
+
+  int slotIndex(cell_t offset) const;
+  void writeSlot(State* state, cell_t offset, const Range& range);
+  void killSlot(State* state, cell_t offset);
+  void refineSlot(State* state, cell_t offset, const Range& range);
+  void refine(State* state, RegFact* reg, CompareOp op, cell_t value);
+
+ private:
+  PluginRuntime* rt_;
+  ControlFlowGraph* graph_;
+  bool debug_break_;
+  const FrameElementAccesses* elements_;
+  FrameAliasing aliasing_;
+
+  // Sorted offsets of every tracked slot.
+  std::vector<cell_t> tracked_;
+
+  // Sorted cips of every redundant BOUNDS.
+  std::vector<const cell_t*> redundant_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_bounds_analysis_h_
@@ -0,0 +1,390 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "plugin-context.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define SP_HAS_SSE2_ARRAYS
+# include <emmintrin.h>
+#endif
+
+// Array and string natives that work on plugin memory directly. Each checks
+// its whole range once, up front, and then runs over it four cells or
+// sixteen bytes at a time where SSE2 is available. None of them read past
+// the range they were given.
+
+namespace sp {
+
+using namespace SourcePawn;
+
+static inline PluginContext*
+ToContext(IPluginContext* pCtx)
+{
+  return static_cast<PluginContext*>(pCtx);
+}
+
+// Resolves |params[arg]| to |params[size_arg]| cells, or reports an error.
+static bool
+GetCellRange(IPluginContext* pCtx, const cell_t* params, int arg, int size_arg,
+             cell_t** out, size_t* count)
+{
+  cell_t size = params[size_arg];
+  if (size < 0) {
+    pCtx->ReportError("Invalid array size: %d", size);
+    return false;
+  }
+  if (int err = ToContext(pCtx)->LocalToPhysRange(params[arg], size_t(size), out)) {
+    pCtx->ReportErrorNumber(err);
+    return false;
+  }
+  *count = size_t(size);
+  return true;
+}
+
+static inline uint8_t
+FoldAscii(uint8_t c)
+{
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+#if defined(SP_HAS_SSE2_ARRAYS)
+static inline __m128i
+FoldAscii(__m128i v)
+{
+  // Bytes from 0x80 up are negative, so they never land in the range.
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static inline __m128i
+Load(const void* ptr)
+{
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+}
+
+static inline cell_t
+HorizontalSum(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+// SSE2 has no signed 32-bit min or max, so blend on a compare.
+static inline __m128i
+Select(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#endif
+
+static size_t
+FindCell(const cell_t* array, size_t count, cell_t value)
+{
+  size_t i = 0;
+#if defined(SP_HAS_SSE2_ARRAYS)
+  __m128i needle = _mm_set1_epi32(value);
+  for (; i + 4 <= count; i += 4) {
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(Load(array + i), needle)));
+    if (mask) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+      }
+      return i;
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    if (array[i] == value)
+      return i;
+  }
+  return count;
+}
+
+static size_t
+CountCells(const cell_t* array, size_t count, cell_t value)
+{
+  size_t i = 0;
+  size_t total = 0;
+#if defined(SP_HAS_SSE2_ARRAYS)
+  // Each match is -1 in its lane. Lanes can't overflow, since no array has
+  // more than INT_MAX cells.
+  __m128i needle = _mm_set1_epi32(value);
+  __m128i matches = _mm_setzero_si128();
+  for (; i + 4 <= count; i += 4)
+    matches = _mm_sub_epi32(matches, _mm_cmpeq_epi32(Load(array + i), needle));
+  total = size_t(uint32_t(HorizontalSum(matches)));
+#endif
+  for (; i < count; i++)
+    total += array[i] == value;
+  return total;
+}
+
+static cell_t
+ReduceCells(const cell_t* array, size_t count, bool find_max)
+{
+  size_t i = 0;
+  cell_t best = array[0];
+#if defined(SP_HAS_SSE2_ARRAYS)
+  if (count >= 4) {
+    __m128i acc = Load(array);
+    for (i = 4; i + 4 <= count; i += 4) {
+      __m128i v = Load(array + i);
+      acc = find_max ? Select(_mm_cmpgt_epi32(v, acc), v, acc)
+                     : Select(_mm_cmplt_epi32(v, acc), v, acc);
+    }
+    cell_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    best = find_max ? std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]))
+                    : std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+  }
+#endif
+  for (; i < count; i++)
+    best = find_max ? std::max(best, array[i]) : std::min(best, array[i]);
+  return best;
+}
+
+// Returns where |a| and |b| first differ within |length| bytes, or |length|.
+static size_t
+Mismatch(const uint8_t* a, const uint8_t* b, size_t length, bool fold)
+{
+  size_t i = 0;
+#if defined(SP_HAS_SSE2_ARRAYS)
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = Load(a + i);
+    __m128i y = Load(b + i);
+    if (fold) {
+      x = FoldAscii(x);
+      y = FoldAscii(y);
+    }
+    uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) ^ 0xffff;
+    if (mask) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+      }
+      return i;
+    }
+  }
+#endif
+  for (; i < length; i++) {
+    uint8_t x = fold ? FoldAscii(a[i]) : a[i];
+    uint8_t y = fold ? FoldAscii(b[i]) : b[i];
+    if (x != y)
+      return i;
+  }
+  return length;
+}
+
+// Returns where |needle| first appears in |haystack|, or -1.
+static cell_t
+FindSubstring(const uint8_t* haystack, size_t length, const uint8_t* needle,
+              size_t needle_length, bool fold)
+{
+  if (!needle_length)
+    return 0;
+  if (needle_length > length)
+    return -1;
+
+  size_t last = length - needle_length;
+  uint8_t first = fold ? FoldAscii(needle[0]) : needle[0];
+  size_t i = 0;
+#if defined(SP_HAS_SSE2_ARRAYS)
+  // Find candidates for the first byte sixteen at a time, then check each.
+  __m128i lead = _mm_set1_epi8(char(first));
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i block = Load(haystack + i);
+    if (fold)
+      block = FoldAscii(block);
+    uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(block, lead)));
+    for (size_t at = i; mask; mask >>= 1, at++) {
+      if ((mask & 1) &&
+          Mismatch(haystack + at + 1, needle + 1, needle_length - 1, fold) == needle_length - 1)
+      {
+        return cell_t(at);
+      }
+    }
+  }
+#endif
+  for (; i <= last; i++) {
+    uint8_t c = fold ? FoldAscii(haystack[i]) : haystack[i];
+    if (c == first &&
+        Mismatch(haystack + i + 1, needle + 1, needle_length - 1, fold) == needle_length - 1)
+    {
+      return cell_t(i);
+    }
+  }
+  return -1;
+}
+
+// __array_fill(any[] array, int size, any value)
+static cell_t
+ArrayFill(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* array;
+  size_t count;
+  if (!GetCellRange(pCtx, params, 1, 2, &array, &count))
+    return 0;
+
+  cell_t value = params[3];
+  size_t i = 0;
+#if defined(SP_HAS_SSE2_ARRAYS)
+  __m128i v = _mm_set1_epi32(value);
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(array + i), v);
+#endif
+  for (; i < count; i++)
+    array[i] = value;
+  return 0;
+}
+
+// __array_copy(any[] dest, const any[] src, int size)
+static cell_t
+ArrayCopy(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* dest;
+  cell_t* src;
+  size_t count;
+  if (!GetCellRange(pCtx, params, 1, 3, &dest, &count) ||
+      !GetCellRange(pCtx, params, 2, 3, &src, &count))
+  {
+    return 0;
+  }
+
+  // The ranges may overlap.
+  memmove(dest, src, count * sizeof(cell_t));
+  return 0;
+}
+
+// int __array_find(const any[] array, int size, any value)
+static cell_t
+ArrayFind(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* array;
+  size_t count;
+  if (!GetCellRange(pCtx, params, 1, 2, &array, &count))
+    return 0;
+
+  size_t index = FindCell(array, count, params[3]);
+  return index < count ? cell_t(index) : -1;
+}
+
+// int __array_count(const any[] array, int size, any value)
+static cell_t
+ArrayCount(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* array;
+  size_t count;
+  if (!GetCellRange(pCtx, params, 1, 2, &array, &count))
+    return 0;
+  return cell_t(CountCells(array, count, params[3]));
+}
+
+static cell_t
+ArrayReduce(IPluginContext* pCtx, const cell_t* params, bool find_max)
+{
+  cell_t* array;
+  size_t count;
+  if (!GetCellRange(pCtx, params, 1, 2, &array, &count))
+    return 0;
+  if (!count) {
+    pCtx->ReportError("Array must not be empty");
+    return 0;
+  }
+  return ReduceCells(array, count, find_max);
+}
+
+// int __array_min(const int[] array, int size)
+static cell_t
+ArrayMin(IPluginContext* pCtx, const cell_t* params)
+{
+  return ArrayReduce(pCtx, params, false);
+}
+
+// int __array_max(const int[] array, int size)
+static cell_t
+ArrayMax(IPluginContext* pCtx, const cell_t* params)
+{
+  return ArrayReduce(pCtx, params, true);
+}
+
+// int __string_compare(const char[] a, const char[] b, bool caseSensitive)
+static cell_t
+StringCompare(IPluginContext* pCtx, const cell_t* params)
+{
+  const char* a;
+  const char* b;
+  size_t a_length, b_length;
+  if (int err = pCtx->LocalToStringView(params[1], &a, &a_length)) {
+    pCtx->ReportErrorNumber(err);
+    return 0;
+  }
+  if (int err = pCtx->LocalToStringView(params[2], &b, &b_length)) {
+    pCtx->ReportErrorNumber(err);
+    return 0;
+  }
+
+  // Include the terminator of the shorter string, so a prefix compares
+  // lower.
+  bool fold = !params[3];
+  size_t length = std::min(a_length, b_length) + 1;
+  const uint8_t* x = reinterpret_cast<const uint8_t*>(a);
+  const uint8_t* y = reinterpret_cast<const uint8_t*>(b);
+  size_t at = Mismatch(x, y, length, fold);
+  if (at == length)
+    return 0;
+
+  uint8_t cx = fold ? FoldAscii(x[at]) : x[at];
+  uint8_t cy = fold ? FoldAscii(y[at]) : y[at];
+  return cx < cy ? -1 : 1;
+}
+
+// int __string_find(const char[] str, const char[] substr, bool caseSensitive)
+static cell_t
+StringFind(IPluginContext* pCtx, const cell_t* params)
+{
+  const char* str;
+  const char* substr;
+  size_t length, sub_length;
+  if (int err = pCtx->LocalToStringView(params[1], &str, &length)) {
+    pCtx->ReportErrorNumber(err);
+    return 0;
+  }
+  if (int err = pCtx->LocalToStringView(params[2], &substr, &sub_length)) {
+    pCtx->ReportErrorNumber(err);
+    return 0;
+  }
+
+  return FindSubstring(reinterpret_cast<const uint8_t*>(str), length,
+                       reinterpret_cast<const uint8_t*>(substr), sub_length, !params[3]);
+}
+
+sp_nativeinfo_t gBuiltinArrayNatives[] = {
+  {"__array_fill",      ArrayFill},
+  {"__array_copy",      ArrayCopy},
+  {"__array_find",      ArrayFind},
+  {"__array_count",     ArrayCount},
+  {"__array_min",       ArrayMin},
+  {"__array_max",       ArrayMax},
+  {"__string_compare",  StringCompare},
+  {"__string_find",     StringFind},
+  {nullptr,             nullptr},
+};
+
+} // namespace sp
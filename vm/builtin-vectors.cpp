@@ -0,0 +1,322 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <float.h>
+#include <math.h>
+
+#include <sp_typeutil.h>
+#include "plugin-context.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+# define SP_HAS_SSE_VECTORS
+# include <xmmintrin.h>
+#endif
+
+// Natives for float[3] vectors. Each operand is checked once, as a whole,
+// and then loaded into a register; all three components are worked on at
+// once where SSE is available. Results are only stored after every operand
+// has been read, so the output may be one of the inputs.
+//
+// These are bound under both the __vector_ names and the names SourceMod
+// uses, and compute the same results as SourceMod's, so a host that doesn't
+// bind its own gets these.
+
+namespace sp {
+
+using namespace SourcePawn;
+
+static bool
+GetVector(IPluginContext* pCtx, cell_t local_addr, cell_t** out)
+{
+  PluginContext* cx = static_cast<PluginContext*>(pCtx);
+  if (int err = cx->LocalToPhysRange(local_addr, 3, out)) {
+    pCtx->ReportErrorNumber(err);
+    return false;
+  }
+  return true;
+}
+
+#if defined(SP_HAS_SSE_VECTORS)
+typedef __m128 Vector3;
+
+// Only the three cells are touched; the fourth lane is zero.
+static inline Vector3
+Load(const cell_t* addr)
+{
+  const float* p = reinterpret_cast<const float*>(addr);
+  __m128 xy = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(p));
+  return _mm_movelh_ps(xy, _mm_load_ss(p + 2));
+}
+
+static inline void
+Store(cell_t* addr, Vector3 v)
+{
+  float* p = reinterpret_cast<float*>(addr);
+  _mm_storel_pi(reinterpret_cast<__m64*>(p), v);
+  _mm_store_ss(p + 2, _mm_movehl_ps(v, v));
+}
+
+static inline Vector3
+Add(Vector3 a, Vector3 b)
+{
+  return _mm_add_ps(a, b);
+}
+
+static inline Vector3
+Sub(Vector3 a, Vector3 b)
+{
+  return _mm_sub_ps(a, b);
+}
+
+static inline Vector3
+Scale(Vector3 v, float scale)
+{
+  return _mm_mul_ps(v, _mm_set1_ps(scale));
+}
+
+static inline Vector3
+Negate(Vector3 v)
+{
+  return _mm_xor_ps(v, _mm_set1_ps(-0.0f));
+}
+
+// Summed in x, y, z order, the same as the scalar version.
+static inline float
+Dot(Vector3 a, Vector3 b)
+{
+  __m128 m = _mm_mul_ps(a, b);
+  __m128 sum = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(m, m)));
+}
+
+static inline Vector3
+Cross(Vector3 a, Vector3 b)
+{
+  __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 a_zxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+  __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 b_zxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+  return _mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx));
+}
+#else
+struct Vector3 {
+  float x, y, z;
+};
+
+static inline Vector3
+Load(const cell_t* addr)
+{
+  return Vector3{sp_ctof(addr[0]), sp_ctof(addr[1]), sp_ctof(addr[2])};
+}
+
+static inline void
+Store(cell_t* addr, const Vector3& v)
+{
+  addr[0] = sp_ftoc(v.x);
+  addr[1] = sp_ftoc(v.y);
+  addr[2] = sp_ftoc(v.z);
+}
+
+static inline Vector3
+Add(const Vector3& a, const Vector3& b)
+{
+  return Vector3{a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static inline Vector3
+Sub(const Vector3& a, const Vector3& b)
+{
+  return Vector3{a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static inline Vector3
+Scale(const Vector3& v, float scale)
+{
+  return Vector3{v.x * scale, v.y * scale, v.z * scale};
+}
+
+static inline Vector3
+Negate(const Vector3& v)
+{
+  return Vector3{-v.x, -v.y, -v.z};
+}
+
+static inline float
+Dot(const Vector3& a, const Vector3& b)
+{
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline Vector3
+Cross(const Vector3& a, const Vector3& b)
+{
+  return Vector3{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+#endif
+
+static inline cell_t
+LengthResult(float squared_length, bool squared)
+{
+  return sp_ftoc(squared ? squared_length : sqrtf(squared_length));
+}
+
+// float GetVectorLength(const float vec[3], bool squared=false)
+static cell_t
+VectorLength(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec;
+  if (!GetVector(pCtx, params[1], &vec))
+    return 0;
+
+  Vector3 v = Load(vec);
+  return LengthResult(Dot(v, v), params[0] >= 2 && params[2]);
+}
+
+// float GetVectorDistance(const float vec1[3], const float vec2[3], bool squared=false)
+static cell_t
+VectorDistance(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec1;
+  cell_t* vec2;
+  if (!GetVector(pCtx, params[1], &vec1) || !GetVector(pCtx, params[2], &vec2))
+    return 0;
+
+  Vector3 delta = Sub(Load(vec1), Load(vec2));
+  return LengthResult(Dot(delta, delta), params[0] >= 3 && params[3]);
+}
+
+// float GetVectorDotProduct(const float vec1[3], const float vec2[3])
+static cell_t
+VectorDotProduct(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec1;
+  cell_t* vec2;
+  if (!GetVector(pCtx, params[1], &vec1) || !GetVector(pCtx, params[2], &vec2))
+    return 0;
+  return sp_ftoc(Dot(Load(vec1), Load(vec2)));
+}
+
+// void GetVectorCrossProduct(const float vec1[3], const float vec2[3], float result[3])
+static cell_t
+VectorCrossProduct(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec1;
+  cell_t* vec2;
+  cell_t* result;
+  if (!GetVector(pCtx, params[1], &vec1) ||
+      !GetVector(pCtx, params[2], &vec2) ||
+      !GetVector(pCtx, params[3], &result))
+  {
+    return 0;
+  }
+  Store(result, Cross(Load(vec1), Load(vec2)));
+  return 0;
+}
+
+// float NormalizeVector(const float vec[3], float result[3])
+static cell_t
+VectorNormalize(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec;
+  cell_t* result;
+  if (!GetVector(pCtx, params[1], &vec) || !GetVector(pCtx, params[2], &result))
+    return 0;
+
+  // As in the Source SDK, the epsilon keeps a zero vector from dividing by
+  // zero; it comes out as zero.
+  Vector3 v = Load(vec);
+  float length = sqrtf(Dot(v, v));
+  Store(result, Scale(v, 1.0f / (length + FLT_EPSILON)));
+  return sp_ftoc(length);
+}
+
+// void AddVectors(const float vec1[3], const float vec2[3], float result[3])
+static cell_t
+VectorAdd(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec1;
+  cell_t* vec2;
+  cell_t* result;
+  if (!GetVector(pCtx, params[1], &vec1) ||
+      !GetVector(pCtx, params[2], &vec2) ||
+      !GetVector(pCtx, params[3], &result))
+  {
+    return 0;
+  }
+  Store(result, Add(Load(vec1), Load(vec2)));
+  return 0;
+}
+
+// void SubtractVectors(const float vec1[3], const float vec2[3], float result[3])
+static cell_t
+VectorSubtract(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec1;
+  cell_t* vec2;
+  cell_t* result;
+  if (!GetVector(pCtx, params[1], &vec1) ||
+      !GetVector(pCtx, params[2], &vec2) ||
+      !GetVector(pCtx, params[3], &result))
+  {
+    return 0;
+  }
+  Store(result, Sub(Load(vec1), Load(vec2)));
+  return 0;
+}
+
+// void ScaleVector(float vec[3], float scale)
+static cell_t
+VectorScale(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec;
+  if (!GetVector(pCtx, params[1], &vec))
+    return 0;
+  Store(vec, Scale(Load(vec), sp_ctof(params[2])));
+  return 0;
+}
+
+// void NegateVector(float vec[3])
+static cell_t
+VectorNegate(IPluginContext* pCtx, const cell_t* params)
+{
+  cell_t* vec;
+  if (!GetVector(pCtx, params[1], &vec))
+    return 0;
+  Store(vec, Negate(Load(vec)));
+  return 0;
+}
+
+sp_nativeinfo_t gBuiltinVectorNatives[] = {
+  {"__vector_length",         VectorLength},
+  {"__vector_distance",       VectorDistance},
+  {"__vector_dot",            VectorDotProduct},
+  {"__vector_cross",          VectorCrossProduct},
+  {"__vector_normalize",      VectorNormalize},
+  {"__vector_add",            VectorAdd},
+  {"__vector_sub",            VectorSubtract},
+  {"__vector_scale",          VectorScale},
+  {"__vector_negate",         VectorNegate},
+
+  // SourceMod's names.
+  {"GetVectorLength",         VectorLength},
+  {"GetVectorDistance",       VectorDistance},
+  {"GetVectorDotProduct",     VectorDotProduct},
+  {"GetVectorCrossProduct",   VectorCrossProduct},
+  {"NormalizeVector",         VectorNormalize},
+  {"AddVectors",              VectorAdd},
+  {"SubtractVectors",         VectorSubtract},
+  {"ScaleVector",             VectorScale},
+  {"NegateVector",            VectorNegate},
+  {nullptr,                   nullptr},
+};
+
+} // namespace sp
@@ -19,6 +19,8 @@ namespace sp {
 using namespace SourcePawn;
 
 extern sp_nativeinfo_t gBuiltinFloatNatives[];
+extern sp_nativeinfo_t gBuiltinArrayNatives[];
+extern sp_nativeinfo_t gBuiltinVectorNatives[];
 
 BuiltinNatives::BuiltinNatives()
 {
@@ -27,14 +29,18 @@ BuiltinNatives::BuiltinNatives()
 bool
 BuiltinNatives::Initialize()
 {
-  if (!map_.init(32))
+  if (!map_.init(64))
     return false;
 
-  for (size_t i = 0; gBuiltinFloatNatives[i].name != nullptr; i++) {
-    const sp_nativeinfo_t& entry = gBuiltinFloatNatives[i];
-    NativeMap::Insert p = map_.findForAdd(entry.name);
-    assert(!p.found());
-    map_.add(p, entry.name, entry.func);
+  for (const sp_nativeinfo_t* table :
+       {gBuiltinFloatNatives, gBuiltinArrayNatives, gBuiltinVectorNatives})
+  {
+    for (size_t i = 0; table[i].name != nullptr; i++) {
+      const sp_nativeinfo_t& entry = table[i];
+      NativeMap::Insert p = map_.findForAdd(entry.name);
+      assert(!p.found());
+      map_.add(p, entry.name, entry.func);
+    }
   }
 
   return true;
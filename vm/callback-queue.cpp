@@ -0,0 +1,124 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "callback-queue.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+#include "scripted-invoker.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+CallbackQueue::CallbackQueue()
+ : next_sequence_(0)
+{
+}
+
+bool
+CallbackQueue::RunsAfter(const Entry& a, const Entry& b)
+{
+  if (a.priority != b.priority)
+    return a.priority < b.priority;
+  if (a.deadline != b.deadline) {
+    // Callbacks without a deadline go after any that have one.
+    if (!a.deadline || !b.deadline)
+      return !a.deadline;
+    return a.deadline > b.deadline;
+  }
+  return a.sequence > b.sequence;
+}
+
+bool
+CallbackQueue::add(ScriptedInvoker* fn, const cell_t* params, unsigned int num_params,
+                   int priority, uint64_t deadline, SPVM_QUEUED_CALLBACK_FUNC done, void* data)
+{
+  if (num_params > SP_MAX_EXEC_PARAMS)
+    return false;
+
+  Entry entry;
+  entry.fn = fn;
+  entry.priority = priority;
+  entry.deadline = deadline;
+  entry.sequence = next_sequence_++;
+  entry.done = done;
+  entry.data = data;
+  entry.num_params = num_params;
+  if (num_params)
+    memcpy(entry.params, params, num_params * sizeof(cell_t));
+
+  entries_.push_back(entry);
+  std::push_heap(entries_.begin(), entries_.end(), RunsAfter);
+  return true;
+}
+
+size_t
+CallbackQueue::run(uint32_t max_us)
+{
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point stop = Clock::now() + std::chrono::microseconds(max_us);
+
+  // Anything a callback queues waits for the next batch, so a callback
+  // that requeues itself can't keep the host here.
+  uint64_t cutoff = next_sequence_;
+
+  size_t count = 0;
+  while (!entries_.empty()) {
+    std::pop_heap(entries_.begin(), entries_.end(), RunsAfter);
+    Entry entry = entries_.back();
+    entries_.pop_back();
+
+    if (entry.sequence >= cutoff) {
+      deferred_.push_back(entry);
+      continue;
+    }
+
+    cell_t result = 0;
+    bool ok = false;
+    if (entry.fn->IsRunnable()) {
+      PluginContext* cx = entry.fn->context();
+      ok = cx->Invoke(entry.fn, entry.params, entry.num_params, &result);
+    }
+    if (entry.done)
+      entry.done(entry.fn, ok, result, entry.data);
+    count++;
+
+    if (max_us && Clock::now() >= stop)
+      break;
+  }
+
+  for (const Entry& entry : deferred_) {
+    entries_.push_back(entry);
+    std::push_heap(entries_.begin(), entries_.end(), RunsAfter);
+  }
+  deferred_.clear();
+  return count;
+}
+
+void
+CallbackQueue::purge(PluginRuntime* rt)
+{
+  auto owned = [rt](const Entry& entry) -> bool {
+    return entry.fn->GetParentRuntime() == rt;
+  };
+  deferred_.erase(std::remove_if(deferred_.begin(), deferred_.end(), owned), deferred_.end());
+
+  auto end = std::remove_if(entries_.begin(), entries_.end(), owned);
+  if (end == entries_.end())
+    return;
+  entries_.erase(end, entries_.end());
+  std::make_heap(entries_.begin(), entries_.end(), RunsAfter);
+}
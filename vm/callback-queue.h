@@ -0,0 +1,70 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_callback_queue_h_
+#define _include_sourcepawn_vm_callback_queue_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_api.h>
+
+namespace sp {
+
+class PluginRuntime;
+class ScriptedInvoker;
+
+// Plugin calls the host has deferred, so it can run a frame's worth of them
+// in one go. The queue is a heap ordered by priority, then deadline, then
+// the order they were queued in.
+class CallbackQueue
+{
+ public:
+  CallbackQueue();
+
+  bool add(ScriptedInvoker* fn, const cell_t* params, unsigned int num_params, int priority,
+           uint64_t deadline, SourcePawn::SPVM_QUEUED_CALLBACK_FUNC done, void* data);
+
+  // Runs what was queued before this was called, until it runs out or
+  // |max_us| microseconds have passed.
+  size_t run(uint32_t max_us);
+
+  // Drops everything queued for |rt|, which is going away.
+  void purge(PluginRuntime* rt);
+
+ private:
+  struct Entry {
+    ScriptedInvoker* fn;
+    int priority;
+    uint64_t deadline;
+    uint64_t sequence;
+    SourcePawn::SPVM_QUEUED_CALLBACK_FUNC done;
+    void* data;
+    unsigned int num_params;
+    cell_t params[SP_MAX_EXEC_PARAMS];
+  };
+
+  // Orders the heap so the entry that should run first is at the front.
+  static bool RunsAfter(const Entry& a, const Entry& b);
+
+ private:
+  std::vector<Entry> entries_;
+  // Callbacks queued while a batch runs, held back until it's done.
+  std::vector<Entry> deferred_;
+  uint64_t next_sequence_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_callback_queue_h_
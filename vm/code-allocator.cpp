@@ -12,74 +12,112 @@
 //
 #include <assert.h>
 #include "code-allocator.h"
+#include <stdio.h>
 #if defined(_WIN32)
 # include <Windows.h>
 #else
+# include <fcntl.h>
 # include <unistd.h>
 # include <sys/mman.h>
+# if defined(__linux__)
+#  include <sys/syscall.h>
+# endif
 #endif
+#include <atomic>
+#include <mutex>
 #include <amtl/am-bits.h>
 
 using namespace sp;
 
-static const size_t kMaxCachedPools = 8;
+static std::atomic<bool> sDualMapping(false);
+
+// Dual-mapped pools, by the start of their executable view, so patching code
+// can find the writable view of any code address. Precompiler threads create
+// pools too, so this is locked.
+static std::mutex sDualPoolsLock;
+static std::map<uint8_t*, CodePool*> sDualPools;
+
+void
+CodeAllocator::SetDualMapping(bool enabled)
+{
+  sDualMapping.store(enabled, std::memory_order_relaxed);
+}
+
+bool
+CodeAllocator::IsDualMapped()
+{
+  return sDualMapping.load(std::memory_order_relaxed);
+}
+
+uint8_t*
+sp::WritableCodeAddress(void* ptr)
+{
+  uint8_t* address = reinterpret_cast<uint8_t*>(ptr);
+
+  std::lock_guard<std::mutex> lock(sDualPoolsLock);
+  auto iter = sDualPools.upper_bound(address);
+  if (iter == sDualPools.begin())
+    return address;
+  --iter;
+  if (!iter->second->contains(address))
+    return address;
+  return iter->second->writable(address);
+}
 
 CodeAllocator::CodeAllocator()
+ : reserved_(0),
+   hot_reserved_(0),
+   in_use_(0)
 {
 }
 
 CodeAllocator::~CodeAllocator()
 {
+  // Code may outlive the allocator (precompiled code does), so surviving
+  // pools are just detached.
+  spare_ = nullptr;
+  for (CodePool* pool : pools_)
+    pool->owner_ = nullptr;
 }
 
 CodeChunk
-CodeAllocator::Allocate(size_t rawBytes)
+CodeAllocator::Allocate(size_t rawBytes, bool hot)
 {
   size_t bytes = ke::Align(rawBytes, ke::kMallocAlignment);
   if (bytes < rawBytes)
     return CodeChunk();
 
-  // First search the cache for any pools we can re-use.
-  RefPtr<CodePool> pool = findPool(bytes);
+  // First search for any pools we can re-use.
+  RefPtr<CodePool> pool = findPool(bytes, hot);
   if (pool)
     return allocateInPool(pool, bytes);
 
-  pool = CodePool::AllocateFor(bytes);
+  pool = CodePool::AllocateFor(this, bytes, hot);
   if (!pool)
     return CodeChunk();
 
-  CodeChunk chunk = allocateInPool(pool, bytes);
-
-  // Enter this pool into the cache if we can.
-  if (cached_pools_.size() < kMaxCachedPools) {
-    cached_pools_.push_back(pool);
-  } else {
-    // If this pool has more free space than any of our cached pools, then
-    // evict the pool with the least amount of free space left.
-    size_t min_index = 0;
-    for (size_t i = 1; i < cached_pools_.size(); i++) {
-      if (cached_pools_[i]->bytesFree() < cached_pools_[min_index]->bytesFree())
-        min_index = i;
-    }
-    if (cached_pools_[min_index]->bytesFree() < pool->bytesFree())
-      cached_pools_[min_index] = pool;
-  }
-
-  return chunk;
+  // Only keep one pool around while it's empty. Hot pools are only created
+  // once code is already running, so they are not worth holding.
+  if (!hot && (!spare_ || pool->size() >= spare_->size()))
+    spare_ = pool;
+  return allocateInPool(pool, bytes);
 }
 
 RefPtr<CodePool>
-CodeAllocator::findPool(size_t bytes)
-{
-  // Find the cached pool with the smallest free region that holds |bytes|, to
-  // reduce fragmentation.
-  RefPtr<CodePool> min;
-  for (size_t i = 0; i < cached_pools_.size(); i++) {
-    RefPtr<CodePool> pool = cached_pools_[i];
-    if (bytes > pool->bytesFree())
+CodeAllocator::findPool(size_t bytes, bool hot)
+{
+  // Find the pool with the smallest region that holds |bytes|, to reduce
+  // fragmentation.
+  CodePool* min = nullptr;
+  size_t min_fit = 0;
+  for (CodePool* pool : pools_) {
+    if (pool->hot() != hot || !pool->canAllocate(bytes))
       continue;
-    if (!min || pool->bytesFree() < min->bytesFree())
+    size_t fit = pool->bestFit(bytes);
+    if (!min || fit < min_fit) {
       min = pool;
+      min_fit = fit;
+    }
   }
   return min;
 }
@@ -88,14 +126,42 @@ CodeChunk
 CodeAllocator::allocateInPool(RefPtr<CodePool> pool, size_t bytes)
 {
   uint8_t* address = pool->allocate(bytes);
-  return CodeChunk(pool, address, bytes);
+  if (!address)
+    return CodeChunk();
+  return CodeChunk(new CodeRegion(pool, address, bytes), address, pool->writable(address),
+                   bytes);
+}
+
+void
+CodeAllocator::poolDestroyed(CodePool* pool)
+{
+  for (size_t i = 0; i < pools_.size(); i++) {
+    if (pools_[i] == pool) {
+      pools_[i] = pools_.back();
+      pools_.pop_back();
+      break;
+    }
+  }
+  reserved_ -= pool->size();
+  if (pool->hot())
+    hot_reserved_ -= pool->size();
+}
+
+void
+CodeAllocator::GetStats(CodeMemoryStats* stats) const
+{
+  stats->reserved = reserved_;
+  stats->in_use = in_use_;
+  stats->num_pools = pools_.size();
+  stats->hot_reserved = hot_reserved_;
 }
 
 static size_t kPageGranularity = 0;
 static size_t kMinPoolSize = 1 * kMB;
+static size_t kHugePageSize = 2 * kMB;
 
 RefPtr<CodePool>
-CodePool::AllocateFor(size_t askBytes)
+CodePool::AllocateFor(CodeAllocator* owner, size_t askBytes, bool hot)
 {
   if (!kPageGranularity) {
     // On Windows, the page granularity is defined as 64KB. On POSIX systems it's
@@ -117,29 +183,201 @@ CodePool::AllocateFor(size_t askBytes)
                  : ke::Align(askBytes, kPageGranularity);
   assert(ke::IsAligned(bytes, kPageGranularity));
 
+  // Hot pools are whole huge pages.
+  if (hot)
+    bytes = ke::Align(bytes, kHugePageSize);
+
+  if (!sDualMapping.load(std::memory_order_relaxed)) {
+    void* address;
+    if (hot) {
+      address = MapHot(bytes);
+    } else {
 #if defined(_WIN32)
-  void* address = (uint8_t* )VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-  if (!address)
+      address = VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+      address = mmap(nullptr, bytes, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON, -1, 0);
+      if (address == MAP_FAILED)
+        address = nullptr;
+#endif
+    }
+    if (address) {
+      RefPtr<CodePool> pool = new CodePool(owner, (uint8_t*)address, (uint8_t*)address, bytes);
+      pool->hot_ = hot;
+      owner->pools_.push_back(pool.get());
+      owner->reserved_ += bytes;
+      if (hot)
+        owner->hot_reserved_ += bytes;
+      return pool;
+    }
+
+    // Hardened systems refuse W+X mappings outright; from now on, map code
+    // twice instead.
+    sDualMapping.store(true, std::memory_order_relaxed);
+  }
+
+  // Dual-mapped pools are backed by shared memory, which can't use
+  // transparent huge pages; hot code still gets its own pools, so it stays
+  // packed together.
+  RefPtr<CodePool> pool = AllocateDualMapped(owner, bytes);
+  if (pool && hot) {
+    pool->hot_ = true;
+    owner->hot_reserved_ += bytes;
+  }
+  return pool;
+}
+
+// Maps a read-write-execute region of |bytes| (a multiple of the huge page
+// size) for hot code, preferring huge pages. Returns null on failure.
+void*
+CodePool::MapHot(size_t bytes)
+{
+#if defined(_WIN32)
+  // Large pages need SeLockMemoryPrivilege, which most hosts don't have.
+  size_t large = GetLargePageMinimum();
+  if (large && ke::IsAligned(bytes, large)) {
+    void* address = VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES,
+                                 PAGE_EXECUTE_READWRITE);
+    if (address)
+      return address;
+  }
+  return VirtualAlloc(nullptr, bytes, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+  int prot = PROT_READ|PROT_WRITE|PROT_EXEC;
+# if defined(MAP_HUGETLB)
+  // Explicit huge pages only exist if the administrator reserved some.
+  void* address = mmap(nullptr, bytes, prot, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+  if (address != MAP_FAILED)
+    return address;
+# endif
+
+  // Otherwise, over-map so the region can be aligned to a huge page, and ask
+  // for transparent huge pages.
+  size_t mapped = bytes + kHugePageSize;
+  uint8_t* base = (uint8_t*)mmap(nullptr, mapped, prot, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if (base == MAP_FAILED)
     return nullptr;
+  uint8_t* start = (uint8_t*)ke::Align(uintptr_t(base), kHugePageSize);
+  if (start != base)
+    munmap(base, start - base);
+  if (start + bytes != base + mapped)
+    munmap(start + bytes, (base + mapped) - (start + bytes));
+# if defined(MADV_HUGEPAGE)
+  madvise(start, bytes, MADV_HUGEPAGE);
+# endif
+  return start;
+#endif
+}
+
+#if !defined(_WIN32)
+static int
+CreateCodeMemory()
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+  int memfd = (int)syscall(SYS_memfd_create, "sourcepawn-code", 1 /* MFD_CLOEXEC */);
+  if (memfd >= 0)
+    return memfd;
+#endif
+
+  static std::atomic<unsigned> sCounter(0);
+  char name[64];
+  snprintf(name, sizeof(name), "/sourcepawn-code-%d-%u", (int)getpid(), sCounter++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return -1;
+  shm_unlink(name);
+  return fd;
+}
+#endif
+
+RefPtr<CodePool>
+CodePool::AllocateDualMapped(CodeAllocator* owner, size_t bytes)
+{
+#if defined(_WIN32)
+  uint64_t size = bytes;
+  HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE,
+                                      DWORD(size >> 32), DWORD(size), nullptr);
+  if (!section)
+    return nullptr;
+  void* exec = MapViewOfFile(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, bytes);
+  void* write = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, bytes);
+  if (!exec || !write) {
+    if (exec)
+      UnmapViewOfFile(exec);
+    if (write)
+      UnmapViewOfFile(write);
+    CloseHandle(section);
+    return nullptr;
+  }
 #else
-  void* address = mmap(nullptr, bytes, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON, -1, 0);
-  if (address == MAP_FAILED)
+  int fd = CreateCodeMemory();
+  if (fd < 0)
+    return nullptr;
+  if (ftruncate(fd, bytes) != 0) {
+    close(fd);
     return nullptr;
+  }
+  void* exec = mmap(nullptr, bytes, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+  void* write = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (exec == MAP_FAILED || write == MAP_FAILED) {
+    if (exec != MAP_FAILED)
+      munmap(exec, bytes);
+    if (write != MAP_FAILED)
+      munmap(write, bytes);
+    return nullptr;
+  }
 #endif
 
-  return new CodePool((uint8_t*)address, bytes);
+  RefPtr<CodePool> pool = new CodePool(owner, (uint8_t*)exec, (uint8_t*)write, bytes);
+#if defined(_WIN32)
+  pool->section_ = section;
+#endif
+  {
+    std::lock_guard<std::mutex> lock(sDualPoolsLock);
+    sDualPools[pool->start_] = pool.get();
+  }
+  owner->pools_.push_back(pool.get());
+  owner->reserved_ += bytes;
+  return pool;
 }
 
-CodePool::CodePool(uint8_t* start, size_t size)
- : start_(start),
+CodePool::CodePool(CodeAllocator* owner, uint8_t* start, uint8_t* writable, size_t size)
+ : owner_(owner),
+   start_(start),
+   writable_(writable),
+#if defined(_WIN32)
+   section_(nullptr),
+#endif
    ptr_(start),
    end_(start + size),
-   size_(size)
+   size_(size),
+   in_use_(0),
+   hot_(false)
 {
 }
 
 CodePool::~CodePool()
 {
+  assert(!in_use_);
+  if (owner_)
+    owner_->poolDestroyed(this);
+
+  if (writable_ != start_) {
+    {
+      std::lock_guard<std::mutex> lock(sDualPoolsLock);
+      sDualPools.erase(start_);
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(writable_);
+    UnmapViewOfFile(start_);
+    CloseHandle(section_);
+#else
+    munmap(writable_, size_);
+    munmap(start_, size_);
+#endif
+    return;
+  }
+
 #if defined(_WIN32)
   VirtualFree(start_, 0, MEM_RELEASE);
 #else
@@ -147,11 +385,96 @@ CodePool::~CodePool()
 #endif
 }
 
+bool
+CodePool::canAllocate(size_t bytes) const
+{
+  if (size_t(end_ - ptr_) >= bytes)
+    return true;
+  return free_by_size_.lower_bound(bytes) != free_by_size_.end();
+}
+
+size_t
+CodePool::bestFit(size_t bytes) const
+{
+  auto iter = free_by_size_.lower_bound(bytes);
+  if (iter != free_by_size_.end())
+    return iter->first;
+  return size_t(end_ - ptr_);
+}
+
 uint8_t*
 CodePool::allocate(size_t bytes)
 {
-  assert(ptr_ + bytes <= end_);
-  uint8_t* result = ptr_;
-  ptr_ += bytes;
+  uint8_t* result;
+  auto iter = free_by_size_.lower_bound(bytes);
+  if (iter != free_by_size_.end()) {
+    result = iter->second;
+    size_t size = iter->first;
+    removeFree(free_by_addr_.find(result));
+    if (size > bytes)
+      addFree(result + bytes, size - bytes);
+  } else {
+    if (size_t(end_ - ptr_) < bytes)
+      return nullptr;
+    result = ptr_;
+    ptr_ += bytes;
+  }
+
+  in_use_ += bytes;
+  if (owner_)
+    owner_->in_use_ += bytes;
   return result;
 }
+
+void
+CodePool::release(uint8_t* address, size_t bytes)
+{
+  assert(address >= start_ && address + bytes <= ptr_);
+  assert(in_use_ >= bytes);
+  in_use_ -= bytes;
+  if (owner_)
+    owner_->in_use_ -= bytes;
+
+  // Coalesce with the free ranges on either side.
+  auto next = free_by_addr_.lower_bound(address);
+  if (next != free_by_addr_.end() && next->first == address + bytes) {
+    bytes += next->second;
+    removeFree(next);
+  }
+  auto prev = free_by_addr_.lower_bound(address);
+  if (prev != free_by_addr_.begin()) {
+    --prev;
+    if (prev->first + prev->second == address) {
+      address = prev->first;
+      bytes += prev->second;
+      removeFree(prev);
+    }
+  }
+
+  // A range ending at the bump pointer just moves it back.
+  if (address + bytes == ptr_) {
+    ptr_ = address;
+    return;
+  }
+  addFree(address, bytes);
+}
+
+void
+CodePool::addFree(uint8_t* address, size_t bytes)
+{
+  free_by_addr_.emplace(address, bytes);
+  free_by_size_.emplace(bytes, address);
+}
+
+void
+CodePool::removeFree(std::map<uint8_t*, size_t>::iterator iter)
+{
+  auto range = free_by_size_.equal_range(iter->second);
+  for (auto i = range.first; i != range.second; i++) {
+    if (i->second == iter->first) {
+      free_by_size_.erase(i);
+      break;
+    }
+  }
+  free_by_addr_.erase(iter);
+}
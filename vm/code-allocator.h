@@ -18,37 +18,118 @@
 #include <am-refcounting.h>
 #include <am-vector.h>
 
+#include <map>
+#include <vector>
+
 namespace sp {
 
 using namespace ke;
 
-// Manages CodeChunks, optimized for the underlying system allocator.
+class CodeAllocator;
+
+// Returns the address through which the code at |address| can be written.
+// If code is not dual-mapped, this is |address| itself.
+uint8_t* WritableCodeAddress(void* address);
+
+// A region of executable memory. Chunks are carved out of free ranges first
+// (best fit, so small holes get reused by small methods), then from the
+// untouched end of the pool. Freed chunks are coalesced with their
+// neighbours, and the pool itself is unmapped once nothing in it is live.
+//
+// Normally a pool is a single read-write-execute mapping. In dual-mapped mode
+// (for systems that refuse memory that is writable and executable at once),
+// the same pages are mapped twice: read-execute, where code runs and which
+// every code address refers to, and read-write, through which code is
+// written and patched.
+//
+// Hot pools hold only methods that tiering has promoted. They are sized and
+// aligned to the huge page size, and backed by huge pages where the system
+// allows it, so the code that runs the most shares a handful of TLB entries
+// and is laid out in the order it became hot.
 class CodePool : public ke::Refcounted<CodePool>
 {
   friend class CodeAllocator;
+  friend class CodeRegion;
+  friend uint8_t* WritableCodeAddress(void* address);
 
  public:
   ~CodePool();
 
  private:
-  CodePool(uint8_t* start, size_t size);
+  CodePool(CodeAllocator* owner, uint8_t* start, uint8_t* writable, size_t size);
 
-  static RefPtr<CodePool> AllocateFor(size_t bytes);
+  static RefPtr<CodePool> AllocateFor(CodeAllocator* owner, size_t bytes, bool hot);
+  static RefPtr<CodePool> AllocateDualMapped(CodeAllocator* owner, size_t bytes);
+  static void* MapHot(size_t bytes);
 
+  // Returns null if no free range or the tail can hold |bytes|.
   uint8_t* allocate(size_t bytes);
-  size_t bytesFree() const {
-    return end_ - ptr_;
+  void release(uint8_t* address, size_t bytes);
+
+  bool canAllocate(size_t bytes) const;
+  // The smallest region |bytes| would come from, for picking a pool.
+  size_t bestFit(size_t bytes) const;
+
+  size_t size() const {
+    return size_;
+  }
+  size_t bytesInUse() const {
+    return in_use_;
+  }
+  bool contains(const uint8_t* address) const {
+    return address >= start_ && address < end_;
+  }
+  uint8_t* writable(uint8_t* address) const {
+    return writable_ + (address - start_);
+  }
+  bool hot() const {
+    return hot_;
   }
 
  private:
   CodePool(const CodePool&) = delete;
   void operator =(const CodePool&) = delete;
 
+  void addFree(uint8_t* address, size_t bytes);
+  void removeFree(std::map<uint8_t*, size_t>::iterator iter);
+
  private:
+  CodeAllocator* owner_;
   uint8_t* start_;
+  uint8_t* writable_;
+#if defined(_WIN32)
+  void* section_;
+#endif
   uint8_t* ptr_;
   uint8_t* end_;
   size_t size_;
+  size_t in_use_;
+  bool hot_;
+
+  // Free ranges below |ptr_|, by address (for coalescing) and by size (for
+  // best-fit lookups).
+  std::map<uint8_t*, size_t> free_by_addr_;
+  std::multimap<size_t, uint8_t*> free_by_size_;
+};
+
+// A single allocation. The memory is given back to its pool when the last
+// CodeChunk referencing it goes away.
+class CodeRegion : public ke::Refcounted<CodeRegion>
+{
+ public:
+  CodeRegion(RefPtr<CodePool> pool, uint8_t* address, size_t bytes)
+   : pool_(pool),
+     address_(address),
+     bytes_(bytes)
+  {}
+  ~CodeRegion() {
+    pool_->release(address_, bytes_);
+  }
+
+ private:
+  RefPtr<CodePool> pool_;
+  uint8_t* address_;
+  size_t bytes_;
 };
 
 // Raw reference to allocated code.
@@ -56,47 +137,84 @@ struct CodeChunk
 {
   CodeChunk()
    : address_(nullptr),
+     writable_(nullptr),
      bytes_(0)
   {}
-  CodeChunk(RefPtr<CodePool> pool, uint8_t* address, size_t bytes)
-   : pool_(pool),
+  CodeChunk(RefPtr<CodeRegion> region, uint8_t* address, uint8_t* writable, size_t bytes)
+   : region_(region),
      address_(address),
+     writable_(writable),
      bytes_(bytes)
   {}
 
+  // Where the code runs.
   uint8_t* address() const {
     return address_;
   }
+  // Where the code is written; the same as address() unless dual-mapped.
+  uint8_t* writable() const {
+    return writable_;
+  }
   size_t bytes() const {
     return bytes_;
   }
 
  private:
-  RefPtr<CodePool> pool_;
+  RefPtr<CodeRegion> region_;
   uint8_t* address_;
+  uint8_t* writable_;
   size_t bytes_;
 };
 
-// Manages CodePools.
+struct CodeMemoryStats
+{
+  size_t reserved;    // Bytes mapped for code.
+  size_t in_use;      // Bytes held by live chunks.
+  size_t num_pools;
+  size_t hot_reserved;  // Bytes of |reserved| in hot pools.
+};
+
+// Manages CodePools. Code is allocated and freed on the thread that owns the
+// allocator. (The precompiler's allocator hands its code to the VM thread
+// only after its thread has finished.)
 class CodeAllocator
 {
+  friend class CodePool;
+
  public:
   CodeAllocator();
   ~CodeAllocator();
 
-  CodeChunk Allocate(size_t bytes);
+  // |hot| places the code in a hot pool; see CodePool.
+  CodeChunk Allocate(size_t bytes, bool hot = false);
+
+  void GetStats(CodeMemoryStats* stats) const;
+
+  // Dual mapping is used for every pool created after it is enabled. It is
+  // also turned on automatically if the system refuses a writable and
+  // executable mapping.
+  static void SetDualMapping(bool enabled);
+  static bool IsDualMapped();
 
  private:
-  RefPtr<CodePool> newPool(size_t bytes);
-  RefPtr<CodePool> findPool(size_t bytes);
+  RefPtr<CodePool> findPool(size_t bytes, bool hot);
   CodeChunk allocateInPool(RefPtr<CodePool> pool, size_t bytes);
 
+  void poolDestroyed(CodePool* pool);
+
  private:
   CodeAllocator(const CodeAllocator&) = delete;
   void operator =(const CodeAllocator&) = delete;
 
  private:
-  std::vector<RefPtr<CodePool>> cached_pools_;
+  // Pools are kept alive by their chunks; this only tracks them. The most
+  // recently created pool is also held, so a plugin being unloaded and
+  // reloaded doesn't unmap and remap it.
+  std::vector<CodePool*> pools_;
+  RefPtr<CodePool> spare_;
+  size_t reserved_;
+  size_t hot_reserved_;
+  size_t in_use_;
 };
 
 } // namespace sp
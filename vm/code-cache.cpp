@@ -0,0 +1,650 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "code-cache.h"
+#include "code-stubs.h"
+#include "compiled-function.h"
+#include "environment.h"
+#include "file-utils.h"
+#include "image-cache.h"
+#include "macro-assembler.h"
+#include "method-info.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <memory>
+
+#if defined(KE_POSIX)
+# include <dlfcn.h>
+#elif defined(KE_WINDOWS)
+# include <windows.h>
+#endif
+
+namespace sp {
+
+static const uint32_t kCacheMagic = 0x434a5053; // 'SPJC'
+static const uint32_t kCacheVersion = 5;
+
+static const uint32_t kVerifiedMagic = 0x564a5053; // 'SPJV'
+
+static const uint32_t kFlagDebugBreak = (1 << 0);
+static const uint32_t kFlagOsrEntries = (1 << 1);
+static const uint32_t kFlagPollInterrupts = (1 << 2);
+static const uint32_t kFlagTableUnwinding = (1 << 3);
+static const uint32_t kFlagBudgets = (1 << 4);
+static const uint32_t kFlagSse41 = (1 << 5);
+
+enum class RelocKind : uint32_t
+{
+  // Relative to the start of the method's own code.
+  Code,
+  // Relative to the PluginContext.
+  Context,
+  // Relative to the PluginRuntime.
+  Runtime,
+  // Relative to the runtime's native table.
+  Natives,
+  // The function bound to the native whose index is the addend.
+  NativeFunction,
+  // Relative to the Environment.
+  Environment,
+  // The shared return stub.
+  ReturnStub,
+  // Relative to the base of the module containing the VM.
+  Module,
+  // The shared native stub.
+  NativeStub
+};
+
+struct CacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t build_id;
+  uint8_t code_hash[16];
+  uint32_t pcode_offset;
+  uint32_t natives_signature;
+  uint32_t data_size;
+  uint32_t heap_size;
+  uint32_t flags;
+  uint32_t code_length;
+  uint32_t num_relocs;
+  uint32_t num_edges;
+  uint32_t num_cip_map;
+  uint32_t num_osr_entries;
+  uint32_t num_unwind_entries;
+  uint32_t num_break_sites;
+};
+
+struct Relocation
+{
+  // Offset just past the 64-bit address.
+  uint32_t offset;
+  RelocKind kind;
+  uint64_t addend;
+};
+
+static const char sModuleAnchor = 0;
+
+static uintptr_t
+ModuleBase(const void* address)
+{
+#if defined(KE_POSIX)
+  Dl_info info;
+  if (!dladdr(address, &info))
+    return 0;
+  return uintptr_t(info.dli_fbase);
+#elif defined(KE_WINDOWS)
+  HMODULE module;
+  DWORD flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+  if (!GetModuleHandleExA(flags, reinterpret_cast<LPCSTR>(address), &module))
+    return 0;
+  return uintptr_t(module);
+#else
+  return 0;
+#endif
+}
+
+static uint64_t
+Fnv1a(uint64_t hash, const void* data, size_t length)
+{
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Identifies the VM binary, since cached code bakes in the layout of VM
+// structures and the offsets of VM functions.
+static uint64_t
+BuildId()
+{
+  static const char kStamp[] = SOURCEPAWN_VERSION " " __DATE__ " " __TIME__;
+
+  uint64_t hash = Fnv1a(0xcbf29ce484222325ull, kStamp, sizeof(kStamp));
+
+  char path[1024] = {};
+#if defined(KE_POSIX)
+  Dl_info info;
+  if (dladdr(&sModuleAnchor, &info) && info.dli_fname)
+    snprintf(path, sizeof(path), "%s", info.dli_fname);
+#elif defined(KE_WINDOWS)
+  HMODULE module;
+  DWORD flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+  if (GetModuleHandleExA(flags, &sModuleAnchor, &module))
+    GetModuleFileNameA(module, path, sizeof(path));
+#endif
+
+  struct stat s;
+  if (path[0] && stat(path, &s) == 0) {
+    uint64_t size = uint64_t(s.st_size);
+    uint64_t mtime = uint64_t(s.st_mtime);
+    hash = Fnv1a(hash, &size, sizeof(size));
+    hash = Fnv1a(hash, &mtime, sizeof(mtime));
+  }
+  return hash;
+}
+
+// Code is specialized on how natives were bound when it was compiled (for
+// example, float natives are inlined, and immutable natives are called
+// without a status check), so the binding state is part of the key.
+static uint32_t
+NativesSignature(PluginRuntime* rt)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < rt->image()->NumNatives(); i++) {
+    NativeEntry* native = rt->NativeAt(i);
+    const sp_typed_nativeinfo_t& sig = native->typed;
+    uint32_t bits[4] = {
+      native->status,
+      native->flags,
+      (native->legacy_fn ? 1u : 0u) | (native->callback ? 2u : 0u) | (sig.func ? 4u : 0u),
+      sig.nargs | (uint32_t(sig.args[0]) << 8) | (uint32_t(sig.args[1]) << 16) |
+        (uint32_t(sig.args[2]) << 24)
+    };
+    hash = Fnv1a(hash, bits, sizeof(bits));
+  }
+  return uint32_t(hash ^ (hash >> 32));
+}
+
+static uint32_t
+CompileFlags(Environment* env)
+{
+  uint32_t flags = 0;
+  if (env->IsDebugBreakEnabled())
+    flags |= kFlagDebugBreak;
+  if (env->jit_threshold())
+    flags |= kFlagOsrEntries;
+  if (env->polls_interrupts())
+    flags |= kFlagPollInterrupts;
+  if (env->table_unwinding())
+    flags |= kFlagTableUnwinding;
+  if (env->has_budgets())
+    flags |= kFlagBudgets;
+  // Code compiled for SSE4.1 can't run where it's missing.
+  if (MacroAssembler::Features().sse4_1)
+    flags |= kFlagSse41;
+  return flags;
+}
+
+static void
+FillHeader(PluginRuntime* rt, MethodInfo* method, CacheHeader* header)
+{
+  Environment* env = Environment::get();
+  PluginContext* cx = rt->GetBaseContext();
+
+  memset(header, 0, sizeof(*header));
+  header->magic = kCacheMagic;
+  header->version = kCacheVersion;
+  header->build_id = BuildId();
+  memcpy(header->code_hash, rt->GetCodeHash(), sizeof(header->code_hash));
+  header->pcode_offset = method->pcode_offset();
+  header->natives_signature = NativesSignature(rt);
+  header->data_size = uint32_t(cx->DataSize());
+  header->heap_size = uint32_t(cx->HeapSize());
+  header->flags = CompileFlags(env);
+}
+
+static bool
+InRange(uintptr_t value, const void* base, size_t length, uint64_t* addend)
+{
+  uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  if (value < start || value >= start + length)
+    return false;
+  *addend = value - start;
+  return true;
+}
+
+static bool
+Classify(PluginRuntime* rt, CompiledFunction* fun, uintptr_t value, Relocation* reloc)
+{
+  Environment* env = Environment::get();
+  size_t num_natives = rt->image()->NumNatives();
+
+  if (InRange(value, fun->GetEntryAddress(), fun->GetCodeLength(), &reloc->addend)) {
+    reloc->kind = RelocKind::Code;
+    return true;
+  }
+  if (InRange(value, rt->GetBaseContext(), sizeof(PluginContext), &reloc->addend)) {
+    reloc->kind = RelocKind::Context;
+    return true;
+  }
+  if (InRange(value, rt, sizeof(PluginRuntime), &reloc->addend)) {
+    reloc->kind = RelocKind::Runtime;
+    return true;
+  }
+  if (num_natives &&
+      InRange(value, rt->NativeAt(0), num_natives * sizeof(NativeEntry), &reloc->addend))
+  {
+    reloc->kind = RelocKind::Natives;
+    return true;
+  }
+  for (size_t i = 0; i < num_natives; i++) {
+    if (value == reinterpret_cast<uintptr_t>(rt->NativeAt(i)->direct_fn())) {
+      reloc->kind = RelocKind::NativeFunction;
+      reloc->addend = i;
+      return true;
+    }
+  }
+  if (InRange(value, env, sizeof(Environment), &reloc->addend)) {
+    reloc->kind = RelocKind::Environment;
+    return true;
+  }
+  if (value == reinterpret_cast<uintptr_t>(env->stubs()->ReturnStub())) {
+    reloc->kind = RelocKind::ReturnStub;
+    reloc->addend = 0;
+    return true;
+  }
+  if (value == reinterpret_cast<uintptr_t>(env->stubs()->NativeStub())) {
+    reloc->kind = RelocKind::NativeStub;
+    reloc->addend = 0;
+    return true;
+  }
+
+  uintptr_t base = ModuleBase(&sModuleAnchor);
+  if (base && ModuleBase(reinterpret_cast<const void*>(value)) == base) {
+    reloc->kind = RelocKind::Module;
+    reloc->addend = value - base;
+    return true;
+  }
+  return false;
+}
+
+static bool
+Resolve(PluginRuntime* rt, uint8_t* code, size_t code_length, const Relocation& reloc,
+        uintptr_t* value)
+{
+  Environment* env = Environment::get();
+  size_t num_natives = rt->image()->NumNatives();
+
+  uintptr_t base;
+  switch (reloc.kind) {
+    case RelocKind::Code:
+      if (reloc.addend >= code_length)
+        return false;
+      base = reinterpret_cast<uintptr_t>(code);
+      break;
+    case RelocKind::Context:
+      base = reinterpret_cast<uintptr_t>(rt->GetBaseContext());
+      break;
+    case RelocKind::Runtime:
+      base = reinterpret_cast<uintptr_t>(rt);
+      break;
+    case RelocKind::Natives:
+      if (!num_natives)
+        return false;
+      base = reinterpret_cast<uintptr_t>(rt->NativeAt(0));
+      break;
+    case RelocKind::NativeFunction:
+      if (reloc.addend >= num_natives || !rt->NativeAt(reloc.addend)->direct_fn())
+        return false;
+      *value = reinterpret_cast<uintptr_t>(rt->NativeAt(reloc.addend)->direct_fn());
+      return true;
+    case RelocKind::Environment:
+      base = reinterpret_cast<uintptr_t>(env);
+      break;
+    case RelocKind::ReturnStub:
+      *value = reinterpret_cast<uintptr_t>(env->stubs()->ReturnStub());
+      return true;
+    case RelocKind::NativeStub:
+      *value = reinterpret_cast<uintptr_t>(env->stubs()->NativeStub());
+      return true;
+    case RelocKind::Module:
+      base = ModuleBase(&sModuleAnchor);
+      if (!base)
+        return false;
+      break;
+    default:
+      return false;
+  }
+  *value = base + uintptr_t(reloc.addend);
+  return true;
+}
+
+struct VerifiedHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t build_id;
+  uint8_t code_hash[16];
+  uint32_t num_methods;
+  uint32_t reserved;
+};
+
+CodeCache::CodeCache(const char* path)
+ : path_(path)
+{
+}
+
+std::string
+CodeCache::PathFor(PluginRuntime* rt, MethodInfo* method)
+{
+  char name[64];
+  const unsigned char* hash = rt->GetCodeHash();
+  for (size_t i = 0; i < 16; i++)
+    snprintf(name + i * 2, 3, "%02x", hash[i]);
+  snprintf(name + 32, sizeof(name) - 32, "-%08x.jit", method->pcode_offset());
+
+  return path_ + "/" + name;
+}
+
+CompiledFunction*
+CodeCache::Lookup(PluginRuntime* rt, MethodInfo* method)
+{
+  std::string path = PathFor(rt, method);
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return nullptr;
+  FileReader reader(fp);
+  fclose(fp);
+
+  const uint8_t* ptr = reader.buffer();
+  const uint8_t* end = ptr + reader.length();
+  if (!ptr || size_t(end - ptr) < sizeof(CacheHeader))
+    return nullptr;
+
+  CacheHeader expected, header;
+  FillHeader(rt, method, &expected);
+  memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+
+  // Everything up to the section counts must match.
+  if (memcmp(&header, &expected, offsetof(CacheHeader, code_length)) != 0)
+    return nullptr;
+
+  uint64_t needed = uint64_t(header.code_length) +
+                    uint64_t(header.num_relocs) * sizeof(Relocation) +
+                    uint64_t(header.num_edges) * sizeof(LoopEdge) +
+                    uint64_t(header.num_cip_map) * sizeof(CipMapEntry) +
+                    uint64_t(header.num_osr_entries) * sizeof(OsrEntry) +
+                    uint64_t(header.num_unwind_entries) * sizeof(UnwindEntry) +
+                    uint64_t(header.num_break_sites) * sizeof(BreakSite);
+  if (!header.code_length || needed != uint64_t(end - ptr))
+    return nullptr;
+
+  const uint8_t* code_bytes = ptr;
+  ptr += header.code_length;
+
+  std::unique_ptr<Relocation[]> relocs = std::make_unique<Relocation[]>(header.num_relocs);
+  memcpy(relocs.get(), ptr, header.num_relocs * sizeof(Relocation));
+  ptr += header.num_relocs * sizeof(Relocation);
+
+  // Resolve everything before allocating code, since code memory can't be
+  // given back.
+  std::unique_ptr<uintptr_t[]> values = std::make_unique<uintptr_t[]>(header.num_relocs);
+  for (uint32_t i = 0; i < header.num_relocs; i++) {
+    const Relocation& reloc = relocs[i];
+    if (reloc.offset < sizeof(uint64_t) || reloc.offset > header.code_length)
+      return nullptr;
+    if (reloc.kind != RelocKind::Code && !Resolve(rt, nullptr, header.code_length, reloc, &values[i]))
+      return nullptr;
+  }
+
+  std::unique_ptr<FixedArray<LoopEdge>> edges(new FixedArray<LoopEdge>(header.num_edges));
+  memcpy(edges->buffer(), ptr, header.num_edges * sizeof(LoopEdge));
+  ptr += header.num_edges * sizeof(LoopEdge);
+
+  std::unique_ptr<FixedArray<CipMapEntry>> cipmap(
+    new FixedArray<CipMapEntry>(header.num_cip_map));
+  memcpy(cipmap->buffer(), ptr, header.num_cip_map * sizeof(CipMapEntry));
+  ptr += header.num_cip_map * sizeof(CipMapEntry);
+
+  std::unique_ptr<FixedArray<OsrEntry>> osr_entries(
+    new FixedArray<OsrEntry>(header.num_osr_entries));
+  memcpy(osr_entries->buffer(), ptr, header.num_osr_entries * sizeof(OsrEntry));
+  ptr += header.num_osr_entries * sizeof(OsrEntry);
+
+  std::unique_ptr<FixedArray<UnwindEntry>> unwind_entries(
+    new FixedArray<UnwindEntry>(header.num_unwind_entries));
+  memcpy(unwind_entries->buffer(), ptr, header.num_unwind_entries * sizeof(UnwindEntry));
+  ptr += header.num_unwind_entries * sizeof(UnwindEntry);
+
+  std::unique_ptr<FixedArray<BreakSite>> break_sites(
+    new FixedArray<BreakSite>(header.num_break_sites));
+  memcpy(break_sites->buffer(), ptr, header.num_break_sites * sizeof(BreakSite));
+  ptr += header.num_break_sites * sizeof(BreakSite);
+
+  for (uint32_t i = 0; i < header.num_edges; i++) {
+    if (edges->at(i).offset > header.code_length)
+      return nullptr;
+  }
+  for (uint32_t i = 0; i < header.num_break_sites; i++) {
+    const BreakSite& site = break_sites->at(i);
+    if (site.offset < sizeof(int32_t) || site.offset > header.code_length ||
+        int64_t(site.offset) + site.disp32 < 0 ||
+        int64_t(site.offset) + site.disp32 >= int64_t(header.code_length))
+    {
+      return nullptr;
+    }
+  }
+  for (uint32_t i = 0; i < header.num_unwind_entries; i++) {
+    const UnwindEntry& entry = unwind_entries->at(i);
+    if (entry.site >= header.code_length || entry.ret > header.code_length ||
+        entry.landing >= header.code_length || (i && entry.site < unwind_entries->at(i - 1).site))
+    {
+      return nullptr;
+    }
+  }
+
+  CodeChunk code = Environment::get()->AllocateCode(header.code_length);
+  if (!code.address())
+    return nullptr;
+
+  memcpy(code.writable(), code_bytes, header.code_length);
+  for (uint32_t i = 0; i < header.num_relocs; i++) {
+    const Relocation& reloc = relocs[i];
+    uintptr_t value = values[i];
+    if (reloc.kind == RelocKind::Code)
+      Resolve(rt, code.address(), header.code_length, reloc, &value);
+    memcpy(code.writable() + reloc.offset - sizeof(uint64_t), &value, sizeof(uint64_t));
+  }
+
+  if (CodeMap* map = Environment::get()->code_map()) {
+    map->AddMethod(rt, method->pcode_offset(), code.address(), header.code_length,
+                   cipmap->buffer(), cipmap->length());
+  }
+
+  CompiledFunction* fun = new CompiledFunction(code, method->pcode_offset(), edges.release(),
+                                               cipmap.release(), osr_entries.release(),
+                                               unwind_entries.release(), break_sites.release());
+  CompileStats stats = {};
+  stats.cached = true;
+  fun->set_stats(stats);
+  return fun;
+}
+
+void
+CodeCache::Store(PluginRuntime* rt, MethodInfo* method, CompiledFunction* fun,
+                 const std::vector<uint32_t>& refs)
+{
+  const uint8_t* code = reinterpret_cast<const uint8_t*>(fun->GetEntryAddress());
+
+  std::vector<Relocation> relocs;
+  for (uint32_t offset : refs) {
+    uint64_t value;
+    memcpy(&value, code + offset - sizeof(uint64_t), sizeof(value));
+
+    Relocation reloc;
+    reloc.offset = offset;
+    if (!Classify(rt, fun, uintptr_t(value), &reloc))
+      return;
+    relocs.push_back(reloc);
+  }
+
+  CacheHeader header;
+  FillHeader(rt, method, &header);
+  header.code_length = uint32_t(fun->GetCodeLength());
+  header.num_relocs = uint32_t(relocs.size());
+  header.num_edges = fun->NumLoopEdges();
+  header.num_cip_map = uint32_t(fun->cip_map().length());
+  header.num_osr_entries = uint32_t(fun->osr_entries().length());
+  header.num_unwind_entries = uint32_t(fun->unwind_entries().length());
+  header.num_break_sites = uint32_t(fun->break_sites().length());
+
+  // Code is saved as it was linked, before anything (such as the watchdog or
+  // call thunk resolution) has patched it.
+  std::string path = PathFor(rt, method);
+  char temp[32];
+  snprintf(temp, sizeof(temp), ".%p.tmp", static_cast<void*>(fun));
+  std::string temp_path = path + temp;
+
+  FILE* fp = fopen(temp_path.c_str(), "wb");
+  if (!fp)
+    return;
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(code, header.code_length, 1, fp) == 1;
+  if (ok && !relocs.empty())
+    ok = fwrite(relocs.data(), sizeof(Relocation) * relocs.size(), 1, fp) == 1;
+  for (uint32_t i = 0; ok && i < header.num_edges; i++)
+    ok = fwrite(&fun->GetLoopEdge(i), sizeof(LoopEdge), 1, fp) == 1;
+  if (ok && header.num_cip_map) {
+    std::vector<CipMapEntry> cip_map;
+    cip_map.reserve(header.num_cip_map);
+    fun->cip_map().decode(&cip_map);
+    ok = fwrite(cip_map.data(), sizeof(CipMapEntry) * header.num_cip_map, 1, fp) == 1;
+  }
+  if (ok && header.num_osr_entries)
+    ok = fwrite(fun->osr_entries().buffer(), sizeof(OsrEntry) * header.num_osr_entries, 1, fp) == 1;
+  if (ok && header.num_unwind_entries) {
+    ok = fwrite(fun->unwind_entries().buffer(), sizeof(UnwindEntry) * header.num_unwind_entries,
+                1, fp) == 1;
+  }
+  if (ok && header.num_break_sites) {
+    ok = fwrite(fun->break_sites().buffer(), sizeof(BreakSite) * header.num_break_sites, 1,
+                fp) == 1;
+  }
+
+  if (fclose(fp) != 0)
+    ok = false;
+
+  // Rename into place, so readers never see a partial entry.
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+    remove(temp_path.c_str());
+}
+
+std::string
+CodeCache::VerifiedPathFor(PluginRuntime* rt)
+{
+  char name[64];
+  const unsigned char* hash = rt->GetCodeHash();
+  for (size_t i = 0; i < 16; i++)
+    snprintf(name + i * 2, 3, "%02x", hash[i]);
+  snprintf(name + 32, sizeof(name) - 32, ".verified");
+
+  return path_ + "/" + name;
+}
+
+static void
+FillVerifiedHeader(PluginRuntime* rt, VerifiedHeader* header)
+{
+  memset(header, 0, sizeof(*header));
+  header->magic = kVerifiedMagic;
+  header->version = kCacheVersion;
+  header->build_id = BuildId();
+  memcpy(header->code_hash, rt->GetCodeHash(), sizeof(header->code_hash));
+}
+
+bool
+CodeCache::LoadVerified(PluginRuntime* rt, SharedImage* image)
+{
+  std::string path = VerifiedPathFor(rt);
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return false;
+  FileReader reader(fp);
+  fclose(fp);
+
+  const uint8_t* ptr = reader.buffer();
+  const uint8_t* end = ptr + reader.length();
+  if (!ptr || size_t(end - ptr) < sizeof(VerifiedHeader))
+    return false;
+
+  VerifiedHeader expected, header;
+  FillVerifiedHeader(rt, &expected);
+  memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+
+  if (memcmp(&header, &expected, offsetof(VerifiedHeader, num_methods)) != 0)
+    return false;
+  if (uint64_t(header.num_methods) * sizeof(SharedImage::VerifiedMethod) != uint64_t(end - ptr))
+    return false;
+
+  size_t code_length = rt->code().length;
+  for (uint32_t i = 0; i < header.num_methods; i++) {
+    SharedImage::VerifiedMethod method;
+    memcpy(&method, ptr + i * sizeof(method), sizeof(method));
+    if (method.pcode_offset >= code_length)
+      return false;
+    image->AddVerified(method.pcode_offset, method.error, method.max_stack);
+  }
+  return true;
+}
+
+void
+CodeCache::StoreVerified(PluginRuntime* rt, SharedImage* image)
+{
+  std::vector<SharedImage::VerifiedMethod> methods = image->GetVerified();
+
+  VerifiedHeader header;
+  FillVerifiedHeader(rt, &header);
+  header.num_methods = uint32_t(methods.size());
+
+  std::string path = VerifiedPathFor(rt);
+  char temp[32];
+  snprintf(temp, sizeof(temp), ".%p.tmp", static_cast<void*>(image));
+  std::string temp_path = path + temp;
+
+  FILE* fp = fopen(temp_path.c_str(), "wb");
+  if (!fp)
+    return;
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  if (ok && !methods.empty())
+    ok = fwrite(methods.data(), sizeof(methods[0]) * methods.size(), 1, fp) == 1;
+
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+    remove(temp_path.c_str());
+}
+
+} // namespace sp
@@ -0,0 +1,72 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_code_cache_h_
+#define _include_sourcepawn_vm_code_cache_h_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <amtl/am-platform.h>
+
+// Only the x64 assembler can emit relocatable code.
+#if defined(SP_HAS_JIT) && defined(KE_ARCH_X64)
+# define SP_HAS_CODE_CACHE
+#endif
+
+namespace sp {
+
+class CompiledFunction;
+class MethodInfo;
+class PluginRuntime;
+class SharedImage;
+
+// Saves compiled methods to disk, keyed by the plugin's code hash, so that
+// loading the same plugin later can skip the JIT. Every absolute address in
+// saved code is stored relative to whatever it points into (the code itself,
+// the context, the runtime, the environment, or the VM library), so cached
+// code is rebased on load and survives ASLR.
+//
+// Compiled code also depends on how natives were bound and on the VM build,
+// so both are part of each entry, and any mismatch is treated as a miss.
+class CodeCache
+{
+ public:
+  explicit CodeCache(const char* path);
+
+  // Returns a linked copy of |method| from the cache, or null.
+  CompiledFunction* Lookup(PluginRuntime* rt, MethodInfo* method);
+
+  // Saves |fun|. |refs| are the offsets just past each 64-bit absolute
+  // address in its code. Code that can't be described is not saved.
+  void Store(PluginRuntime* rt, MethodInfo* method, CompiledFunction* fun,
+             const std::vector<uint32_t>& refs);
+
+  // Verification results for a whole image, saved once all of its methods
+  // have been verified. Loading adds them to |image| and returns true only
+  // if a complete entry for this code was found.
+  bool LoadVerified(PluginRuntime* rt, SharedImage* image);
+  void StoreVerified(PluginRuntime* rt, SharedImage* image);
+
+ private:
+  std::string PathFor(PluginRuntime* rt, MethodInfo* method);
+  std::string VerifiedPathFor(PluginRuntime* rt);
+
+ private:
+  std::string path_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_code_cache_h_
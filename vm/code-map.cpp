@@ -0,0 +1,291 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <amtl/am-platform.h>
+#include <amtl/am-string.h>
+#include "code-map.h"
+#include "compiled-function.h"
+#include "legacy-image.h"
+#include "plugin-runtime.h"
+
+#if defined(KE_POSIX)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+#if defined(__linux__)
+# include <elf.h>
+# include <sys/syscall.h>
+#endif
+
+using namespace sp;
+
+// Record layouts from perf's jitdump-specification.txt.
+namespace {
+
+static const uint32_t kJitDumpMagic = 0x4A695444;
+static const uint32_t kJitDumpVersion = 1;
+
+enum JitRecordId : uint32_t {
+  JIT_CODE_LOAD = 0,
+  JIT_CODE_DEBUG_INFO = 2,
+  JIT_CODE_CLOSE = 3,
+};
+
+struct JitDumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitRecordHeader {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+// Followed by the name, then the code itself.
+struct JitCodeLoad {
+  JitRecordHeader header;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+// Followed by |nr_entry| entries.
+struct JitDebugInfo {
+  JitRecordHeader header;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+};
+
+// Followed by the file name.
+struct JitDebugEntry {
+  uint64_t code_addr;
+  uint32_t line;
+  uint32_t discrim;
+};
+
+} // anonymous namespace
+
+// perf record -k 1 timestamps samples with the monotonic clock, so records
+// must use it too.
+static uint64_t
+Timestamp()
+{
+#if defined(KE_POSIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#else
+  return 0;
+#endif
+}
+
+std::unique_ptr<CodeMap>
+CodeMap::Open(Format format)
+{
+#if defined(__linux__)
+  std::string path;
+  if (format == Format::PerfMap)
+    path = ke::StringPrintf("/tmp/perf-%d.map", int(getpid()));
+  else
+    path = ke::StringPrintf("/tmp/jit-%d.dump", int(getpid()));
+
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (fd < 0)
+    return nullptr;
+  FILE* fp = fdopen(fd, format == Format::PerfMap ? "w" : "wb");
+  if (!fp) {
+    close(fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<CodeMap> map(new CodeMap(format, fp));
+  if (format == Format::JitDump && !map->writeHeader())
+    return nullptr;
+  return map;
+#else
+  return nullptr;
+#endif
+}
+
+CodeMap::CodeMap(Format format, FILE* fp)
+ : format_(format),
+   fp_(fp),
+   marker_(nullptr),
+   marker_size_(0),
+   code_index_(0)
+{
+}
+
+CodeMap::~CodeMap()
+{
+  if (format_ == Format::JitDump) {
+    JitRecordHeader close_record = {JIT_CODE_CLOSE, sizeof(JitRecordHeader), Timestamp()};
+    fwrite(&close_record, sizeof(close_record), 1, fp_);
+  }
+#if defined(KE_POSIX)
+  if (marker_)
+    munmap(marker_, marker_size_);
+#endif
+  fclose(fp_);
+}
+
+bool
+CodeMap::writeHeader()
+{
+#if defined(__linux__)
+  JitDumpHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kJitDumpMagic;
+  header.version = kJitDumpVersion;
+  header.total_size = sizeof(header);
+# if defined(KE_ARCH_X64)
+  header.elf_mach = EM_X86_64;
+# else
+  header.elf_mach = EM_386;
+# endif
+  header.pid = uint32_t(getpid());
+  header.timestamp = Timestamp();
+  if (fwrite(&header, sizeof(header), 1, fp_) != 1 || fflush(fp_) != 0)
+    return false;
+
+  // perf finds the dump through this mapping: perf inject looks for an
+  // executable mapping of a file named jit-<pid>.dump.
+  marker_size_ = size_t(sysconf(_SC_PAGESIZE));
+  marker_ = mmap(nullptr, marker_size_, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(fp_), 0);
+  if (marker_ == MAP_FAILED) {
+    marker_ = nullptr;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void
+CodeMap::AddStub(const char* name, const void* address, size_t bytes)
+{
+  std::lock_guard<ke::Mutex> lock(lock_);
+  add(name, address, bytes);
+}
+
+void
+CodeMap::AddMethod(PluginRuntime* rt, uint32_t pcode_offset, const void* address, size_t bytes,
+                   const CipMapEntry* cipmap, size_t ncipmap)
+{
+  std::string name;
+  if (const char* fun_name = rt->image()->LookupFunction(pcode_offset))
+    name = ke::StringPrintf("%s::%s", rt->Name(), fun_name);
+  else
+    name = ke::StringPrintf("%s::<%x>", rt->Name(), pcode_offset);
+
+  std::lock_guard<ke::Mutex> lock(lock_);
+  if (format_ == Format::JitDump)
+    writeLineTable(rt, pcode_offset, address, cipmap, ncipmap);
+  add(name.c_str(), address, bytes);
+}
+
+void
+CodeMap::add(const char* name, const void* address, size_t bytes)
+{
+  if (format_ == Format::PerfMap) {
+    fprintf(fp_, "%" PRIxPTR " %llx %s\n", uintptr_t(address), (unsigned long long)bytes, name);
+    fflush(fp_);
+    return;
+  }
+
+#if defined(__linux__)
+  size_t name_size = strlen(name) + 1;
+
+  JitCodeLoad record;
+  record.header.id = JIT_CODE_LOAD;
+  record.header.total_size = uint32_t(sizeof(record) + name_size + bytes);
+  record.header.timestamp = Timestamp();
+  record.pid = uint32_t(getpid());
+  record.tid = uint32_t(syscall(SYS_gettid));
+  record.vma = uint64_t(uintptr_t(address));
+  record.code_addr = uint64_t(uintptr_t(address));
+  record.code_size = bytes;
+  record.code_index = code_index_++;
+
+  fwrite(&record, sizeof(record), 1, fp_);
+  fwrite(name, name_size, 1, fp_);
+  fwrite(address, bytes, 1, fp_);
+  fflush(fp_);
+#endif
+}
+
+// The line table must come before the code it describes.
+void
+CodeMap::writeLineTable(PluginRuntime* rt, uint32_t pcode_offset, const void* address,
+                        const CipMapEntry* cipmap, size_t ncipmap)
+{
+  struct Line {
+    uint32_t pcoffs;
+    uint32_t line;
+    const char* file;
+  };
+  std::vector<Line> lines;
+  for (size_t i = 0; i < ncipmap; i++) {
+    uint32_t cip = pcode_offset + cipmap[i].cipoffs;
+    uint32_t line;
+    if (!rt->image()->LookupLine(cip, &line))
+      continue;
+    const char* file = rt->image()->LookupFile(cip);
+    if (!file)
+      continue;
+    if (!lines.empty() && lines.back().line == line && lines.back().file == file)
+      continue;
+    lines.push_back(Line{cipmap[i].pcoffs, line, file});
+  }
+  if (lines.empty())
+    return;
+
+  size_t total_size = sizeof(JitDebugInfo);
+  for (const Line& line : lines)
+    total_size += sizeof(JitDebugEntry) + strlen(line.file) + 1;
+
+  JitDebugInfo info;
+  info.header.id = JIT_CODE_DEBUG_INFO;
+  info.header.total_size = uint32_t(total_size);
+  info.header.timestamp = Timestamp();
+  info.code_addr = uint64_t(uintptr_t(address));
+  info.nr_entry = lines.size();
+  fwrite(&info, sizeof(info), 1, fp_);
+
+  for (const Line& line : lines) {
+    JitDebugEntry entry;
+    entry.code_addr = uint64_t(uintptr_t(address) + line.pcoffs);
+    entry.line = line.line;
+    entry.discrim = 0;
+    fwrite(&entry, sizeof(entry), 1, fp_);
+    fwrite(line.file, strlen(line.file) + 1, 1, fp_);
+  }
+}
@@ -0,0 +1,83 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_code_map_h_
+#define _include_sourcepawn_vm_code_map_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+
+#include <amtl/am-mutex.h>
+
+namespace sp {
+
+class PluginRuntime;
+struct CipMapEntry;
+
+// Tells external profilers which plugin function each piece of JIT code
+// belongs to, so samples in it get symbols instead of showing up as
+// anonymous memory.
+//
+// PerfMap writes /tmp/perf-<pid>.map, which perf and most other Linux
+// profilers read at report time. JitDump writes /tmp/jit-<pid>.dump in
+// perf's JITDUMP format, which also carries a copy of the code and a line
+// table; use perf record -k 1, then perf inject --jit.
+//
+// Neither format can express code going away. JITDUMP records are
+// timestamped, so code placed where freed code used to be is told apart;
+// a perf map just lists every function that was ever compiled.
+class CodeMap
+{
+ public:
+  enum class Format {
+    PerfMap,
+    JitDump
+  };
+
+  // Returns null if the file can't be created, or the platform doesn't
+  // support |format|.
+  static std::unique_ptr<CodeMap> Open(Format format);
+  ~CodeMap();
+
+  // Describes code that isn't a plugin function, like the invoke stub.
+  void AddStub(const char* name, const void* address, size_t bytes);
+
+  // Describes a compiled method. |cipmap| maps its code back to pcode, and
+  // is used for the line table.
+  void AddMethod(PluginRuntime* rt, uint32_t pcode_offset, const void* address, size_t bytes,
+                 const CipMapEntry* cipmap, size_t ncipmap);
+
+ private:
+  CodeMap(Format format, FILE* fp);
+
+  bool writeHeader();
+  void add(const char* name, const void* address, size_t bytes);
+  void writeLineTable(PluginRuntime* rt, uint32_t pcode_offset, const void* address,
+                      const CipMapEntry* cipmap, size_t ncipmap);
+
+ private:
+  Format format_;
+  FILE* fp_;
+  void* marker_;
+  size_t marker_size_;
+  uint64_t code_index_;
+
+  // Methods are compiled on the precompiler's thread too.
+  ke::Mutex lock_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_code_map_h_
@@ -10,6 +10,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 //
+#include "code-map.h"
 #include "code-stubs.h"
 #include "environment.h"
 
@@ -29,6 +30,19 @@ CodeStubs::Initialize()
     return false;
   if (!CompileInvokeStub())
     return false;
+#endif
+#if defined(SP_HAS_JIT) && defined(KE_ARCH_X64)
+  if (!CompileNativeStub())
+    return false;
 #endif
   return true;
 }
+
+void
+CodeStubs::DescribeTo(CodeMap* map) const
+{
+  if (invoke_stub_.address())
+    map->AddStub("sp::InvokeStub", invoke_stub_.address(), invoke_stub_.bytes());
+  if (native_stub_.address())
+    map->AddStub("sp::NativeStub", native_stub_.address(), native_stub_.bytes());
+}
@@ -15,10 +15,12 @@
 
 #include <stdint.h>
 #include <sp_vm_api.h>
+#include <amtl/am-platform.h>
 #include "code-allocator.h"
 
 namespace sp {
 
+class CodeMap;
 class PluginContext;
 class Environment;
 
@@ -39,16 +41,33 @@ class CodeStubs
     return return_stub_;
   }
 
+  // Calls a native through SharedNativeInvokeThunk, building the exit frame
+  // for it, so call sites that don't call a native directly only have to
+  // load three registers: the native's exit frame id in scratch0, its
+  // NativeEntry in scratch1, and the context in scratch2. HP is saved and
+  // restored, but the caller still has to check for an exception. Only the
+  // x64 JIT has one.
+  void* NativeStub() const {
+    return native_stub_.address();
+  }
+
+  // Describes the stubs to an external profiler.
+  void DescribeTo(CodeMap* map) const;
+
  private:
   bool InitializeFeatureDetection();
 #if defined(SP_HAS_JIT)
   bool CompileInvokeStub();
 #endif
+#if defined(SP_HAS_JIT) && defined(KE_ARCH_X64)
+  bool CompileNativeStub();
+#endif
 
  private:
   Environment* env_;
   CodeChunk invoke_stub_;
   void* return_stub_;   // Owned by invoke_stub_.
+  CodeChunk native_stub_;
 };
 
 }
@@ -0,0 +1,175 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "compile-queue.h"
+
+#include <amtl/am-thread.h>
+#include "environment.h"
+#include "jit.h"
+#include "plugin-runtime.h"
+#include "pool-allocator.h"
+
+namespace sp {
+
+CompileQueue::CompileQueue(PluginRuntime* rt)
+ : rt_(rt),
+   num_finished_(0),
+   cancel_(false)
+{
+}
+
+CompileQueue::~CompileQueue()
+{
+  if (thread_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancel_.store(true, std::memory_order_relaxed);
+      cv_.notify_all();
+    }
+    thread_->join();
+  }
+}
+
+bool
+CompileQueue::Enqueue(MethodInfo* root)
+{
+  cell_t root_offset = root->pcode_offset();
+  if (queued_.count(root_offset))
+    return true;
+  if (failed_.count(root_offset))
+    return false;
+
+  // As with the precompiler, acquiring and verifying methods is only safe on
+  // this thread, so the call graph is walked here and each verified graph is
+  // handed to the compile thread.
+  std::unordered_set<cell_t> seen;
+  std::vector<RefPtr<MethodInfo>> worklist;
+
+  auto enqueue = [&](cell_t offset) -> void {
+    if (queued_.count(offset) || failed_.count(offset) || !seen.insert(offset).second)
+      return;
+    if (RefPtr<MethodInfo> method = rt_->AcquireMethod(offset))
+      worklist.push_back(method);
+  };
+  enqueue(root_offset);
+
+  Batch batch;
+  while (!worklist.empty()) {
+    RefPtr<MethodInfo> method = worklist.back();
+    worklist.pop_back();
+
+    if (method->jit())
+      continue;
+
+    RefPtr<ControlFlowGraph> graph = method->ValidateWithCallees(enqueue);
+    if (!graph) {
+      if (method == root)
+        return false;
+      continue;
+    }
+
+    Job job;
+    job.method = method;
+    job.graph = graph;
+    batch.push_back(std::move(job));
+  }
+  if (batch.empty())
+    return false;
+
+  if (!thread_) {
+    // Describing code looks up names and lines, and the image's debug info
+    // is validated on first use; make sure that happens on this thread.
+    if (rt_->env()->code_map())
+      rt_->image()->LookupFunction(0);
+
+    thread_ = ke::NewThread("SourcePawn Compile Queue", [this]() -> void {
+      Run();
+    });
+    if (!thread_)
+      return false;
+  }
+
+  for (const Job& job : batch)
+    queued_.insert(job.method->pcode_offset());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back(std::move(batch));
+  cv_.notify_all();
+  return true;
+}
+
+void
+CompileQueue::Run()
+{
+  // The compiler reads environment settings and the addresses it embeds in
+  // code through Environment::get().
+  Environment::AttachToThread(rt_->env());
+  PoolAllocator::InitDefault();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this]() -> bool {
+      return cancel_.load(std::memory_order_relaxed) || !pending_.empty();
+    });
+    if (cancel_.load(std::memory_order_relaxed))
+      break;
+
+    Batch batch = std::move(pending_.front());
+    pending_.pop_front();
+    lock.unlock();
+
+    for (Job& job : batch) {
+      if (cancel_.load(std::memory_order_relaxed))
+        break;
+      job.fun.reset(CompilerBase::CompileOffThread(rt_, job.method.get(), job.graph,
+                                                   &code_alloc_));
+      job.graph = nullptr;
+    }
+
+    lock.lock();
+    finished_.push_back(std::move(batch));
+    num_finished_.store(finished_.size(), std::memory_order_release);
+  }
+  lock.unlock();
+
+  PoolAllocator::FreeDefault();
+  Environment::AttachToThread(nullptr);
+}
+
+void
+CompileQueue::Install()
+{
+  std::vector<Batch> batches;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batches.swap(finished_);
+    num_finished_.store(0, std::memory_order_release);
+  }
+
+  for (Batch& batch : batches) {
+    for (Job& job : batch) {
+      cell_t offset = job.method->pcode_offset();
+      queued_.erase(offset);
+      if (job.method->jit())
+        continue;
+
+      // Compiling it on the VM thread will report the error.
+      if (!job.fun) {
+        failed_.insert(offset);
+        continue;
+      }
+      job.method->setCompiledFunction(job.fun.release());
+    }
+  }
+}
+
+} // namespace sp
@@ -0,0 +1,95 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_compile_queue_h_
+#define _include_sourcepawn_vm_compile_queue_h_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <amtl/am-refcounting.h>
+#include "code-allocator.h"
+#include "compiled-function.h"
+#include "control-flow.h"
+#include "method-info.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// Compiles methods on a background thread as they are first reached, while
+// the interpreter runs them, so the VM thread never waits for the JIT. Each
+// request covers a method and every method it can reach that isn't compiled
+// yet. They are verified on the VM thread, compiled together, and installed
+// together, so the new code doesn't stop to compile its callees either.
+class CompileQueue
+{
+ public:
+  explicit CompileQueue(PluginRuntime* rt);
+  ~CompileQueue();
+
+  // Queues |method| and its callees, returning true if |method| is now
+  // queued. If it fails to verify, the caller should compile it itself to
+  // report the error; methods that failed to compile are never queued again
+  // for the same reason.
+  bool Enqueue(MethodInfo* method);
+
+  // Whether compiled code is waiting for Install().
+  bool hasFinished() const {
+    return num_finished_.load(std::memory_order_acquire) != 0;
+  }
+
+  // Installs every method compiled so far that wasn't compiled on the VM
+  // thread in the meantime. Call sites are patched to the new code the next
+  // time they run. Must be called on the VM thread.
+  void Install();
+
+ private:
+  void Run();
+
+ private:
+  struct Job {
+    ke::RefPtr<MethodInfo> method;
+    ke::RefPtr<ControlFlowGraph> graph;
+    std::unique_ptr<CompiledFunction> fun;
+  };
+  typedef std::vector<Job> Batch;
+
+  PluginRuntime* rt_;
+
+  // The code offsets of methods that are queued, or that failed to compile.
+  // Only used on the VM thread.
+  std::unordered_set<cell_t> queued_;
+  std::unordered_set<cell_t> failed_;
+
+  // Only the compile thread allocates from this.
+  CodeAllocator code_alloc_;
+  std::unique_ptr<std::thread> thread_;
+
+  // Guards the batches, which move from |pending_| to |finished_|.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Batch> pending_;
+  std::vector<Batch> finished_;
+  std::atomic<size_t> num_finished_;
+  std::atomic<bool> cancel_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_compile_queue_h_
@@ -13,45 +13,132 @@
 #include "compiled-function.h"
 #include "environment.h"
 #include <amtl/am-platform.h>
+#include <string.h>
+#include <algorithm>
 
 using namespace sp;
 
 CompiledFunction::CompiledFunction(const CodeChunk& code,
                                    cell_t pcode_offs,
                                    FixedArray<LoopEdge>* edges,
-                                   FixedArray<CipMapEntry>* cipmap)
+                                   FixedArray<CipMapEntry>* cipmap,
+                                   FixedArray<OsrEntry>* osr_entries,
+                                   FixedArray<UnwindEntry>* unwind_entries,
+                                   FixedArray<BreakSite>* break_sites)
  : code_(code),
    code_offset_(pcode_offs),
    edges_(edges),
-   cip_map_(cipmap),
-   cip_map_sorted_(false)
+   cip_map_(cipmap->buffer(), cipmap->length()),
+   osr_entries_(osr_entries),
+   unwind_entries_(unwind_entries),
+   break_sites_(break_sites)
 {
+  // Only the encoded copy is kept.
+  delete cipmap;
+  memset(&stats_, 0, sizeof(stats_));
 }
 
 CompiledFunction::~CompiledFunction()
 {
 }
 
-static int cip_map_entry_sort_cmp(const void* a1, const void* a2)
+static inline void
+WriteVarint(std::vector<uint8_t>* out, uint32_t value)
 {
-  const CipMapEntry* c1 = reinterpret_cast<const CipMapEntry*>(a1);
-  const CipMapEntry* c2 = reinterpret_cast<const CipMapEntry*>(a2);
-  if (c1->pcoffs < c2->pcoffs)
-    return -1;
-  if (c1->pcoffs == c2->pcoffs)
-    return 0;
-  return 1;
+  while (value >= 0x80) {
+    out->push_back(uint8_t(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(uint8_t(value));
+}
+
+CipMap::CipMap(const CipMapEntry* entries, size_t count)
+ : count_(count)
+{
+  // Out-of-line paths are emitted after the code that reaches them, so the
+  // entries aren't quite in pc order to begin with.
+  std::vector<CipMapEntry> sorted(entries, entries + count);
+  std::stable_sort(sorted.begin(), sorted.end(),
+    [](const CipMapEntry& a, const CipMapEntry& b) -> bool {
+      return a.pcoffs < b.pcoffs;
+    });
+
+  encoded_.reserve(count * 3);
+  checkpoints_.reserve((count + kCheckpointInterval - 1) / kCheckpointInterval);
+  for (size_t i = 0; i < count; i++) {
+    const CipMapEntry& entry = sorted[i];
+    if (i % kCheckpointInterval == 0) {
+      Checkpoint checkpoint;
+      checkpoint.entry = entry;
+      checkpoint.next = uint32_t(encoded_.size());
+      checkpoints_.push_back(checkpoint);
+      continue;
+    }
+
+    const CipMapEntry& prev = sorted[i - 1];
+    int32_t cip_delta = int32_t(entry.cipoffs - prev.cipoffs);
+    WriteVarint(&encoded_, entry.pcoffs - prev.pcoffs);
+    WriteVarint(&encoded_, (uint32_t(cip_delta) << 1) ^ uint32_t(cip_delta >> 31));
+  }
+  encoded_.shrink_to_fit();
+}
+
+uint32_t
+CipMap::ReadVarint(const uint8_t** ptr)
+{
+  uint32_t value = 0;
+  for (uint32_t shift = 0;; shift += 7) {
+    uint8_t byte = *(*ptr)++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+}
+
+bool
+CipMap::lookup(uint32_t pcoffs, uint32_t* cipoffs) const
+{
+  // Find the last checkpoint at or before |pcoffs|.
+  auto iter = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), pcoffs,
+    [](uint32_t offs, const Checkpoint& checkpoint) -> bool {
+      return offs < checkpoint.entry.pcoffs;
+    });
+  if (iter == checkpoints_.begin())
+    return false;
+  iter--;
+
+  CipMapEntry entry = iter->entry;
+  size_t index = size_t(iter - checkpoints_.begin()) * kCheckpointInterval;
+  const uint8_t* ptr = encoded_.data() + iter->next;
+  for (;;) {
+    if (entry.pcoffs == pcoffs) {
+      *cipoffs = entry.cipoffs;
+      return true;
+    }
+    if (entry.pcoffs > pcoffs || ++index % kCheckpointInterval == 0 || index >= count_)
+      return false;
+
+    entry.pcoffs += ReadVarint(&ptr);
+    uint32_t zigzag = ReadVarint(&ptr);
+    entry.cipoffs += (zigzag >> 1) ^ (0u - (zigzag & 1));
+  }
 }
 
-static int cip_map_entry_cmp(const void* a1, const void* aEntry)
+void
+CipMap::decode(std::vector<CipMapEntry>* out) const
 {
-  uint32_t pcoffs = (uint32_t)(intptr_t)a1;
-  const CipMapEntry* entry = reinterpret_cast<const CipMapEntry*>(aEntry);
-  if (pcoffs < entry->pcoffs)
-    return -1;
-  if (pcoffs == entry->pcoffs)
-    return 0;
-  return pcoffs > entry->pcoffs;
+  const uint8_t* ptr = encoded_.data();
+  CipMapEntry entry = {};
+  for (size_t i = 0; i < count_; i++) {
+    if (i % kCheckpointInterval == 0) {
+      entry = checkpoints_[i / kCheckpointInterval].entry;
+    } else {
+      entry.pcoffs += ReadVarint(&ptr);
+      uint32_t zigzag = ReadVarint(&ptr);
+      entry.cipoffs += (zigzag >> 1) ^ (0u - (zigzag & 1));
+    }
+    out->push_back(entry);
+  }
 }
 
 ucell_t
@@ -64,26 +151,63 @@ CompiledFunction::FindCipByPc(void* pc)
   if (pcoffs > code_.bytes())
     return kInvalidCip;
 
-  if (!cip_map_sorted_) {
-    qsort(cip_map_->buffer(),
-          cip_map_->length(),
-          sizeof(CipMapEntry),
-          cip_map_entry_sort_cmp);
-    cip_map_sorted_ = true;
+  uint32_t cipoffs;
+  if (!cip_map_.lookup(pcoffs, &cipoffs)) {
+    // Shouldn't happen, but fail gracefully.
+    assert(false);
+    return kInvalidCip;
   }
+  return code_offset_ + cipoffs;
+}
 
-  void* ptr = bsearch(
-    (void*)(uintptr_t)pcoffs,
-    cip_map_->buffer(),
-    cip_map_->length(),
-    sizeof(CipMapEntry),
-    cip_map_entry_cmp);
-  assert(ptr);
+void*
+CompiledFunction::FindOsrEntry(cell_t cip)
+{
+  if (cip < code_offset_)
+    return nullptr;
 
-  if (!ptr) {
-    // Shouldn't happen, but fail gracefully.
-    return kInvalidCip;
+  uint32_t cipoffs = cip - code_offset_;
+  for (size_t i = 0; i < osr_entries_->length(); i++) {
+    const OsrEntry& entry = osr_entries_->at(i);
+    if (entry.cipoffs == cipoffs)
+      return reinterpret_cast<uint8_t*>(code_.address()) + entry.pcoffs;
   }
+  return nullptr;
+}
+
+bool
+CompiledFunction::RedirectToLandingPad(intptr_t* exit_fp, void* site)
+{
+  uint8_t* base = code_.address();
+  uint8_t* pc = reinterpret_cast<uint8_t*>(site);
+  if (pc < base || pc >= base + code_.bytes())
+    return false;
+
+  // Entries are recorded in code order.
+  uint32_t site_offs = uint32_t(pc - base);
+  const UnwindEntry* begin = unwind_entries_->buffer();
+  const UnwindEntry* end = begin + unwind_entries_->length();
+  const UnwindEntry* iter = std::lower_bound(begin, end, site_offs,
+    [](const UnwindEntry& entry, uint32_t offs) -> bool {
+      return entry.site < offs;
+    });
 
-  return code_offset_ + reinterpret_cast<CipMapEntry*>(ptr)->cipoffs;
+  // Only one of a site's calls can be in progress; it's the one whose return
+  // address is in its slot.
+  for (; iter != end && iter->site == site_offs; iter++) {
+    void** slot = reinterpret_cast<void**>(exit_fp - iter->slot);
+    if (*slot != base + iter->ret)
+      continue;
+    *slot = base + iter->landing;
+    return true;
+  }
+  return false;
+}
+
+void
+CompiledFunction::ArmBreakSite(size_t index, bool armed)
+{
+  const BreakSite& site = break_sites_->at(index);
+  int32_t disp32 = armed ? site.disp32 : 0;
+  memcpy(code_.writable() + site.offset - sizeof(int32_t), &disp32, sizeof(disp32));
 }
@@ -14,6 +14,7 @@
 #define _INCLUDE_SOURCEPAWN_JIT2_FUNCTION_H_
 
 #include <memory>
+#include <vector>
 
 #include <amtl/am-fixedarray.h>
 #include <amtl/am-refcounting.h>
@@ -36,6 +37,20 @@ struct LoopEdge
   int32_t disp32;
 };
 
+// With debug breaks enabled, a BREAK compiles to a jump to the next
+// instruction, which costs next to nothing until the runtime arms it by
+// pointing the jump at an out-of-line call to the debugger instead.
+struct BreakSite
+{
+  // Offset from the first cip of the function.
+  uint32_t cipoffs;
+  // Offset just past the jump, such that (base + offset - 4) is its
+  // displacement.
+  uint32_t offset;
+  // The displacement that reaches the debugger call.
+  int32_t disp32;
+};
+
 struct CipMapEntry {
   // Offset from the first cip of the function.
   uint32_t cipoffs;
@@ -43,21 +58,110 @@ struct CipMapEntry {
   uint32_t pcoffs;
 };
 
+// An entry point at a loop header, for transferring an interpreted
+// invocation into compiled code.
+struct OsrEntry {
+  // Offset from the first cip of the function.
+  uint32_t cipoffs;
+  // Offset from the first pc of the function.
+  uint32_t pcoffs;
+};
+
+// With table unwinding, a native call site doesn't test for a pending
+// exception after the call. If the native leaves one pending, its return
+// address is replaced with the site's landing pad instead. A site where the
+// native may be reached two ways has an entry for each.
+struct UnwindEntry {
+  // Offset of the return address recorded in the call's exit frame.
+  uint32_t site;
+  // Offset of the native call's own return address.
+  uint32_t ret;
+  // Where that return address is stored, in words below the exit frame
+  // pointer.
+  uint32_t slot;
+  // Offset of the landing pad.
+  uint32_t landing;
+};
+
+// What it cost to produce a method's code, for JitStats.
+struct CompileStats {
+  // Reachable p-code that was compiled, in bytes.
+  uint32_t pcode_bytes;
+  // Out-of-line paths, and timeout thunks for backward jumps.
+  uint32_t ool_paths;
+  uint32_t thunks;
+  // Time spent in the compiler, including verification.
+  uint64_t compile_ns;
+  // Set if the code was loaded from the code cache instead; nothing else
+  // is known then.
+  bool cached;
+};
+
 static const ucell_t kInvalidCip = 0xffffffff;
 
+// A method's return addresses and the cips they map to, delta-encoded in pc
+// order. Entries are only looked up to walk the stack, so they're kept as
+// small as possible rather than fast to search: a few bytes each, plus a
+// checkpoint every kCheckpointInterval entries so a lookup only decodes
+// from the nearest one.
+class CipMap
+{
+ public:
+  CipMap(const CipMapEntry* entries, size_t count);
+
+  size_t length() const {
+    return count_;
+  }
+  size_t bytes() const {
+    return encoded_.size() + checkpoints_.size() * sizeof(Checkpoint);
+  }
+
+  // Returns the cip offset recorded for |pcoffs|, or false if there is none.
+  bool lookup(uint32_t pcoffs, uint32_t* cipoffs) const;
+
+  // Appends every entry to |out|, in pc order.
+  void decode(std::vector<CipMapEntry>* out) const;
+
+ private:
+  static const size_t kCheckpointInterval = 32;
+
+  struct Checkpoint {
+    CipMapEntry entry;
+    // Where the entry after this one starts in |encoded_|.
+    uint32_t next;
+  };
+
+  static uint32_t ReadVarint(const uint8_t** ptr);
+
+ private:
+  // For each entry after a checkpoint, the pc delta and then the zigzagged
+  // cip delta, as varints.
+  std::vector<uint8_t> encoded_;
+  std::vector<Checkpoint> checkpoints_;
+  size_t count_;
+};
+
 class CompiledFunction
 {
  public:
   CompiledFunction(const CodeChunk& code,
                    cell_t pcode_offs,
                    FixedArray<LoopEdge>* edges,
-                   FixedArray<CipMapEntry>* cip_map);
+                   FixedArray<CipMapEntry>* cip_map,
+                   FixedArray<OsrEntry>* osr_entries,
+                   FixedArray<UnwindEntry>* unwind_entries,
+                   FixedArray<BreakSite>* break_sites);
   ~CompiledFunction();
 
  public:
   void* GetEntryAddress() const {
     return code_.address();
   }
+  // Patches must be written here, which differs from the entry address if
+  // code is dual-mapped.
+  uint8_t* GetWritableAddress() const {
+    return code_.writable();
+  }
   cell_t GetCodeOffset() const {
     return code_offset_;
   }
@@ -67,15 +171,51 @@ class CompiledFunction
   LoopEdge& GetLoopEdge(size_t i) {
     return edges_->at(i);
   }
+  size_t GetCodeLength() const {
+    return code_.bytes();
+  }
+  const CipMap& cip_map() const {
+    return cip_map_;
+  }
+  const FixedArray<OsrEntry>& osr_entries() const {
+    return *osr_entries_.get();
+  }
+  const FixedArray<UnwindEntry>& unwind_entries() const {
+    return *unwind_entries_.get();
+  }
+  const FixedArray<BreakSite>& break_sites() const {
+    return *break_sites_.get();
+  }
+
+  // Points the jump at break site |index| at the debugger call, or past it.
+  void ArmBreakSite(size_t index, bool armed);
+  const CompileStats& stats() const {
+    return stats_;
+  }
+  void set_stats(const CompileStats& stats) {
+    stats_ = stats;
+  }
 
   ucell_t FindCipByPc(void* pc);
 
+  // Returns the entry point for the loop header at |cip|, or null if there
+  // is none.
+  void* FindOsrEntry(cell_t cip);
+
+  // Makes the native call whose inline exit frame is at |exit_fp|, and which
+  // recorded |site| as its return address, return to its landing pad.
+  // Returns false if the call has no landing pad, or already returns to it.
+  bool RedirectToLandingPad(intptr_t* exit_fp, void* site);
+
  private:
   CodeChunk code_;
   cell_t code_offset_;
   std::unique_ptr<FixedArray<LoopEdge>> edges_;
-  std::unique_ptr<FixedArray<CipMapEntry>> cip_map_;
-  bool cip_map_sorted_;
+  CipMap cip_map_;
+  std::unique_ptr<FixedArray<OsrEntry>> osr_entries_;
+  std::unique_ptr<FixedArray<UnwindEntry>> unwind_entries_;
+  std::unique_ptr<FixedArray<BreakSite>> break_sites_;
+  CompileStats stats_;
 };
 
 }
@@ -19,6 +19,71 @@ namespace sp {
 
 using namespace ke;
 
+namespace {
+
+struct FreeBlock
+{
+  FreeBlock* next;
+};
+
+class BlockFreeList
+{
+ public:
+  static const size_t kMaxFreeBlocks = 512;
+
+  ~BlockFreeList() {
+    while (head_) {
+      FreeBlock* next = head_->next;
+      ::operator delete(head_);
+      head_ = next;
+    }
+  }
+  void* take() {
+    if (!head_)
+      return nullptr;
+    FreeBlock* block = head_;
+    head_ = block->next;
+    count_--;
+    return block;
+  }
+  bool give(void* ptr) {
+    if (count_ >= kMaxFreeBlocks)
+      return false;
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(ptr);
+    block->next = head_;
+    head_ = block;
+    count_++;
+    return true;
+  }
+
+ private:
+  FreeBlock* head_ = nullptr;
+  size_t count_ = 0;
+};
+
+// Blocks may be released on a different thread than the one that made them
+// (the precompiler hands graphs off), which is fine: the memory simply moves
+// to that thread's list.
+thread_local BlockFreeList sFreeBlocks;
+
+} // anonymous namespace
+
+void*
+Block::operator new(size_t size)
+{
+  assert(size == sizeof(Block));
+  if (void* ptr = sFreeBlocks.take())
+    return ptr;
+  return ::operator new(size);
+}
+
+void
+Block::operator delete(void* ptr)
+{
+  if (ptr && !sFreeBlocks.give(ptr))
+    ::operator delete(ptr);
+}
+
 ControlFlowGraph::ControlFlowGraph(PluginRuntime* rt, const uint8_t* start_offset)
  : rt_(rt),
    epoch_(1)
@@ -60,6 +60,11 @@ class Block :
     assert(!successors_.size());
   }
 
+  // Every verified method builds and throws away a graph, so blocks are
+  // recycled through a per-thread free list instead of the heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+
   const uint8_t* start() const {
     return start_;
   }
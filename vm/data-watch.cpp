@@ -0,0 +1,81 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include "data-watch.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+DataWatcher::DataWatcher()
+ : next_id_(1),
+   callback_(nullptr),
+   callback_data_(nullptr)
+{
+}
+
+uint32_t
+DataWatcher::add(const uint8_t* memory, cell_t local_addr, uint32_t bytes)
+{
+  Watch watch;
+  watch.id = next_id_++;
+  watch.local_addr = local_addr;
+  watch.bytes = bytes;
+  watch.snapshot = snapshots_.size();
+  watches_.push_back(watch);
+
+  snapshots_.insert(snapshots_.end(), memory + local_addr, memory + local_addr + bytes);
+  return watch.id;
+}
+
+bool
+DataWatcher::remove(uint32_t id)
+{
+  for (size_t i = 0; i < watches_.size(); i++) {
+    if (watches_[i].id != id)
+      continue;
+
+    // Close the gap in the snapshots, so they stay packed in watch order.
+    Watch removed = watches_[i];
+    snapshots_.erase(snapshots_.begin() + removed.snapshot,
+                     snapshots_.begin() + removed.snapshot + removed.bytes);
+    watches_.erase(watches_.begin() + i);
+    for (size_t j = i; j < watches_.size(); j++)
+      watches_[j].snapshot -= removed.bytes;
+    return true;
+  }
+  return false;
+}
+
+void
+DataWatcher::check(IPluginRuntime* rt, const uint8_t* memory)
+{
+  // Without a callback, changes wait until there is one.
+  if (!callback_)
+    return;
+
+  // The callback may change the watches, or call back into the plugin, so
+  // the list is local.
+  std::vector<uint32_t> changed;
+  for (const Watch& watch : watches_) {
+    const uint8_t* current = memory + watch.local_addr;
+    uint8_t* snapshot = snapshots_.data() + watch.snapshot;
+    if (memcmp(current, snapshot, watch.bytes) == 0)
+      continue;
+    memcpy(snapshot, current, watch.bytes);
+    changed.push_back(watch.id);
+  }
+
+  if (!changed.empty())
+    callback_(rt, changed.data(), changed.size(), callback_data_);
+}
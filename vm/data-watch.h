@@ -0,0 +1,70 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_data_watch_h_
+#define _include_sourcepawn_vm_data_watch_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_api.h>
+
+namespace sp {
+
+// Ranges of a plugin's global data that the host wants to hear about when
+// they change. Global data only changes while the plugin runs, or when the
+// host writes it, so rather than trapping stores, each range is compared
+// with a snapshot of it when the plugin's outermost invocation returns.
+// That costs nothing for plugins without watches, and only the watched
+// bytes for the rest.
+class DataWatcher
+{
+ public:
+  DataWatcher();
+
+  void setCallback(SourcePawn::SPVM_DATAWATCH_FUNC callback, void* data) {
+    callback_ = callback;
+    callback_data_ = data;
+  }
+
+  // |memory| is the plugin's memory, and the range must be within it.
+  uint32_t add(const uint8_t* memory, cell_t local_addr, uint32_t bytes);
+  bool remove(uint32_t id);
+
+  bool empty() const {
+    return watches_.empty();
+  }
+
+  // Takes new snapshots of the ranges that changed, and reports them.
+  void check(SourcePawn::IPluginRuntime* rt, const uint8_t* memory);
+
+ private:
+  struct Watch {
+    uint32_t id;
+    cell_t local_addr;
+    uint32_t bytes;
+    // Where its snapshot starts in |snapshots_|.
+    size_t snapshot;
+  };
+
+  std::vector<Watch> watches_;
+  std::vector<uint8_t> snapshots_;
+  uint32_t next_id_;
+  SourcePawn::SPVM_DATAWATCH_FUNC callback_;
+  void* callback_data_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_data_watch_h_
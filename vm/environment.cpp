@@ -18,19 +18,33 @@
 #include "pool-allocator.h"
 #include "method-info.h"
 #include "compiled-function.h"
+#include "code-cache.h"
 #include "code-stubs.h"
+#include "sampling-profiler.h"
+#include "plugin-memory.h"
 #if defined(SP_HAS_JIT)
 #include "jit.h"
 #endif
 #include "interpreter.h"
 #include "builtins.h"
+#include "native-registry.h"
+#include "image-cache.h"
+#include "callback-queue.h"
+#include "scripted-invoker.h"
 #include "debugging.h"
+#include "native-tracer.h"
+#include "timeline.h"
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <amtl/am-threadlocal.h>
 
 using namespace sp;
 using namespace SourcePawn;
 
-static Environment* sEnvironment = nullptr;
+static ke::ThreadLocal<Environment*> sEnvironment;
 
 Environment::Environment()
  : debug_break_enabled_(false),
@@ -38,14 +52,35 @@ Environment::Environment()
    debugger_(nullptr),
    eh_top_(nullptr),
    exception_code_(SP_ERROR_NONE),
+   pending_message_(""),
    profiler_(nullptr),
 #if defined(SP_HAS_JIT)
    jit_enabled_(true),
 #else
    jit_enabled_(false),
 #endif
+   jit_threshold_(0),
+   background_compilation_(false),
+   predecode_enabled_(true),
+   opcode_counting_(false),
+   poll_interrupts_(false),
+   table_unwinding_(false),
+   budgets_enabled_(false),
    profiling_enabled_(false),
-   top_(nullptr)
+   sampling_enabled_(false),
+   timeline_enabled_(false),
+   top_(nullptr),
+   native_calls_(0),
+   memo_epoch_(0),
+   native_tracing_(false),
+   native_hooks_(0),
+   stats_top_(nullptr),
+   jit_compile_ns_(0),
+   jit_compiles_(0),
+   interrupt_(0),
+   budget_(INT32_MAX),
+   budget_limit_(INT32_MAX),
+   budget_spent_(0)
 {
 }
 
@@ -56,24 +91,31 @@ Environment::~Environment()
 Environment*
 Environment::New()
 {
-  assert(!sEnvironment);
-  if (sEnvironment)
+  assert(!sEnvironment.get());
+  if (sEnvironment.get())
     return nullptr;
 
-  sEnvironment = new Environment();
-  if (!sEnvironment->Initialize()) {
-    delete sEnvironment;
+  Environment* env = new Environment();
+  sEnvironment = env;
+  if (!env->Initialize()) {
+    delete env;
     sEnvironment = nullptr;
     return nullptr;
   }
 
-  return sEnvironment;
+  return env;
 }
 
 Environment*
 Environment::get()
 {
-  return sEnvironment;
+  return sEnvironment.get();
+}
+
+void
+Environment::AttachToThread(Environment* env)
+{
+  sEnvironment = env;
 }
 
 bool
@@ -84,6 +126,9 @@ Environment::Initialize()
   api_v2_ = std::make_unique<SourcePawnEngine2>();
   watchdog_timer_ = std::make_unique<WatchdogTimer>(this);
   builtins_ = std::make_unique<BuiltinNatives>();
+  natives_ = std::make_unique<NativeRegistry>(&atoms_);
+  image_cache_ = std::make_unique<ImageCache>();
+  callbacks_ = std::make_unique<CallbackQueue>();
   code_alloc_ = std::make_unique<CodeAllocator>();
   code_stubs_ = std::make_unique<CodeStubs>(this);
 
@@ -92,6 +137,15 @@ Environment::Initialize()
     return false;
   if (!builtins_->Initialize())
     return false;
+  if (!natives_->Initialize())
+    return false;
+
+  if (const char* format = getenv("SOURCEPAWN_PERF_MAP")) {
+    if (strcmp(format, "map") == 0)
+      EnableCodeMap(CodeMap::Format::PerfMap);
+    else if (strcmp(format, "jitdump") == 0)
+      EnableCodeMap(CodeMap::Format::JitDump);
+  }
 
   return true;
 }
@@ -100,12 +154,15 @@ void
 Environment::Shutdown()
 {
   watchdog_timer_->Shutdown();
+  retired_methods_.clear();
   builtins_ = nullptr;
+  natives_ = nullptr;
   code_stubs_ = nullptr;
   code_alloc_ = nullptr;
+  code_map_ = nullptr;
   PoolAllocator::FreeDefault();
 
-  assert(sEnvironment == this);
+  assert(sEnvironment.get() == this);
   sEnvironment = nullptr;
 }
 
@@ -115,6 +172,33 @@ Environment::SetJitEnabled(bool enabled)
   jit_enabled_ = enabled;
 }
 
+void
+Environment::SetDualMappedCode(bool enabled)
+{
+  CodeAllocator::SetDualMapping(enabled);
+}
+
+bool
+Environment::EnableCodeMap(CodeMap::Format format)
+{
+  code_map_ = CodeMap::Open(format);
+  if (!code_map_)
+    return false;
+  code_stubs_->DescribeTo(code_map_.get());
+  return true;
+}
+
+void
+Environment::SetCodeCacheDirectory(const char* path)
+{
+#if defined(SP_HAS_CODE_CACHE)
+  if (path && path[0])
+    code_cache_ = std::make_unique<CodeCache>(path);
+  else
+    code_cache_ = nullptr;
+#endif
+}
+
 bool
 Environment::EnableDebugBreak()
 {
@@ -126,6 +210,75 @@ Environment::EnableDebugBreak()
   return true;
 }
 
+bool
+Environment::SetInterruptPolling(bool enabled)
+{
+  // Back-edges are compiled one way or the other.
+  if (!runtimes_.empty())
+    return false;
+
+  poll_interrupts_ = enabled;
+  return true;
+}
+
+bool
+Environment::SetInvocationBudgets(bool enabled)
+{
+  // Calls and back-edges are compiled one way or the other.
+  if (!runtimes_.empty())
+    return false;
+
+  budgets_enabled_ = enabled;
+  return true;
+}
+
+bool
+Environment::EnableInvocationBudgets()
+{
+  return SetInvocationBudgets(true);
+}
+
+void
+Environment::SetInvocationBudget(uint32_t units)
+{
+  if (!units || units > uint32_t(INT32_MAX))
+    budget_limit_ = INT32_MAX;
+  else
+    budget_limit_ = int32_t(units);
+}
+
+uint32_t
+Environment::GetInvocationBudgetSpent()
+{
+  return budget_spent_;
+}
+
+bool
+Environment::QueueCallback(IPluginFunction* function, const cell_t* params,
+                           unsigned int num_params, int priority, uint64_t deadline,
+                           SPVM_QUEUED_CALLBACK_FUNC done, void* data)
+{
+  ScriptedInvoker* fn = static_cast<ScriptedInvoker*>(function);
+  return callbacks_->add(fn, params, num_params, priority, deadline, done, data);
+}
+
+size_t
+Environment::RunQueuedCallbacks(uint32_t max_us)
+{
+  return callbacks_->run(max_us);
+}
+
+bool
+Environment::SetTableUnwinding(bool enabled)
+{
+  // Native call sites are compiled one way or the other.
+  if (!runtimes_.empty())
+    return false;
+
+  table_unwinding_ = enabled;
+  return true;
+}
+
 void
 Environment::EnableProfiling()
 {
@@ -144,6 +297,93 @@ Environment::InstallWatchdogTimer(int timeout_ms)
   return watchdog_timer_->Initialize(timeout_ms);
 }
 
+bool
+Environment::StartSampling(size_t interval_ms)
+{
+  if (!interval_ms)
+    return false;
+  if (!sampler_)
+    sampler_ = std::make_unique<SamplingProfiler>();
+  if (!watchdog_timer_->SetSampleInterval(interval_ms))
+    return false;
+  sampling_enabled_ = true;
+  return true;
+}
+
+void
+Environment::StopSampling()
+{
+  if (!sampling_enabled_)
+    return;
+  watchdog_timer_->SetSampleInterval(0);
+  sampling_enabled_ = false;
+}
+
+bool
+Environment::WriteSampleProfile(const char* path)
+{
+  if (!sampler_)
+    return false;
+
+  FILE* fp = fopen(path, "wt");
+  if (!fp)
+    return false;
+  bool ok = sampler_->Write(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  if (ok)
+    sampler_->Clear();
+  return ok;
+}
+
+void
+Environment::StartTimeline(size_t capacity)
+{
+  if (timeline_enabled_)
+    return;
+  if (!timeline_)
+    timeline_ = std::make_unique<Timeline>(capacity);
+  AddNativeHook();
+  timeline_enabled_ = true;
+}
+
+void
+Environment::StopTimeline()
+{
+  if (!timeline_enabled_)
+    return;
+  RemoveNativeHook();
+  timeline_enabled_ = false;
+}
+
+bool
+Environment::WriteTimeline(const char* path)
+{
+  if (!timeline_)
+    return false;
+
+  FILE* fp = fopen(path, "wt");
+  if (!fp)
+    return false;
+  bool ok = timeline_->Write(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  if (ok)
+    timeline_->Clear();
+  return ok;
+}
+
+void
+Environment::WriteNativeTrace(FILE* fp)
+{
+  std::lock_guard<ke::Mutex> lock(mutex_);
+
+  std::vector<PluginRuntime*> runtimes;
+  for (ke::InlineList<PluginRuntime>::iterator iter = runtimes_.begin(); iter != runtimes_.end(); iter++)
+    runtimes.push_back(*iter);
+  sp::WriteNativeTrace(runtimes, fp);
+}
+
 ISourcePawnEngine*
 Environment::APIv1()
 {
@@ -190,21 +430,22 @@ static const char* sErrorMsgTable[] =
   "Integer overflow",
   "Script execution timed out",
   "Custom error",
-  "Fatal error"
+  "Fatal error",
+  "Script ran out of its instruction budget"
 };
 
 const char*
 Environment::GetErrorString(int error)
 {
-  if (error < 1 || error > int(sizeof(sErrorMsgTable) / sizeof(sErrorMsgTable[0])))
+  if (error < 1 || error >= int(sizeof(sErrorMsgTable) / sizeof(sErrorMsgTable[0])))
     return NULL;
   return sErrorMsgTable[error];
 }
 
 CodeChunk
-Environment::AllocateCode(size_t size)
+Environment::AllocateCode(size_t size, bool hot)
 {
-  return code_alloc_->Allocate(size);
+  return code_alloc_->Allocate(size, hot);
 }
 
 void
@@ -219,6 +460,48 @@ Environment::DeregisterRuntime(PluginRuntime* rt)
 {
   mutex_.AssertCurrentThreadOwns();
   runtimes_.remove(rt);
+  callbacks_->purge(rt);
+  if (timeline_)
+    timeline_->forgetRuntime(rt);
+}
+
+void
+Environment::RetireMethods(std::unique_ptr<PluginRuntime::MethodList> methods)
+{
+  retired_methods_.push_back(std::move(methods));
+}
+
+bool
+Environment::ReclaimRetiredMethods()
+{
+  if (retired_methods_.empty())
+    return false;
+  retired_methods_.pop_back();
+  return true;
+}
+
+DataImage*
+Environment::FindDataImage(size_t length, const unsigned char hash[16])
+{
+  for (DataImage* image : data_images_) {
+    if (image->matches(length, hash))
+      return image;
+  }
+  return nullptr;
+}
+
+void
+Environment::RegisterDataImage(DataImage* image)
+{
+  data_images_.push_back(image);
+}
+
+void
+Environment::UnregisterDataImage(DataImage* image)
+{
+  auto iter = std::find(data_images_.begin(), data_images_.end(), image);
+  assert(iter != data_images_.end());
+  data_images_.erase(iter);
 }
 
 static inline void
@@ -237,13 +520,12 @@ Environment::PatchAllJumpsForTimeout()
   for (ke::InlineList<PluginRuntime>::iterator iter = runtimes_.begin(); iter != runtimes_.end(); iter++) {
     PluginRuntime* rt = *iter;
 
-    const std::vector<RefPtr<MethodInfo>>& methods = rt->AllMethods();
-    for (size_t i = 0; i < methods.size(); i++) {
-      CompiledFunction* fun = methods[i]->jit();
+    for (const RefPtr<MethodInfo>& method : rt->AllMethods()) {
+      CompiledFunction* fun = method->jit();
       if (!fun)
         continue;
 
-      uint8_t* base = reinterpret_cast<uint8_t*>(fun->GetEntryAddress());
+      uint8_t* base = fun->GetWritableAddress();
 
       for (size_t j = 0; j < fun->NumLoopEdges(); j++)
         SwapLoopEdge(base, fun->GetLoopEdge(j));
@@ -258,13 +540,12 @@ Environment::UnpatchAllJumpsFromTimeout()
   for (ke::InlineList<PluginRuntime>::iterator iter = runtimes_.begin(); iter != runtimes_.end(); iter++) {
     PluginRuntime* rt = *iter;
 
-    const std::vector<RefPtr<MethodInfo>>& methods = rt->AllMethods();
-    for (size_t i = 0; i < methods.size(); i++) {
-      CompiledFunction* fun = methods[i]->jit();
+    for (const RefPtr<MethodInfo>& method : rt->AllMethods()) {
+      CompiledFunction* fun = method->jit();
       if (!fun)
         continue;
 
-      uint8_t* base = reinterpret_cast<uint8_t*>(fun->GetEntryAddress());
+      uint8_t* base = fun->GetWritableAddress();
 
       for (size_t j = 0; j < fun->NumLoopEdges(); j++)
         SwapLoopEdge(base, fun->GetLoopEdge(j));
@@ -272,14 +553,60 @@ Environment::UnpatchAllJumpsFromTimeout()
   }
 }
 
+bool
+Environment::ShouldCompile(MethodInfo* method)
+{
+  if (method->jit() || !jit_threshold_)
+    return true;
+
+  // Cold methods stay in the interpreter, which counts their loop iterations,
+  // until they've earned compilation.
+  method->addInvocation();
+  return method->hotness() >= jit_threshold_;
+}
+
+bool
+Environment::ShouldInterpretCall(PluginContext* cx, MethodInfo* method)
+{
+  if (!ShouldCompile(method))
+    return true;
+  return background_compilation_ && cx->runtime()->QueueCompile(method);
+}
+
 bool
 Environment::Invoke(PluginContext* cx,
                     const RefPtr<MethodInfo>& method,
                     cell_t* result)
 {
+  bool interpret;
+  if (!TryInvokeCompiled(cx, method.get(), result, &interpret))
+    return false;
+  if (!interpret)
+    return true;
+  return Interpreter::Run(cx, method, result);
+}
+
+bool
+Environment::TryInvokeCompiled(PluginContext* cx, MethodInfo* method, cell_t* result,
+                               bool* interpret)
+{
+  *interpret = false;
+
+  // The host may have changed anything a pure native reads.
+  bumpMemoEpoch();
+
 #if defined(SP_HAS_JIT)
-  if (jit_enabled_) {
-    if (!method->jit()) {
+  // Entering the runtime is a safe point to install background compiles.
+  PluginRuntime* rt = cx->runtime();
+  if (rt->HasPendingPrecompile())
+    rt->PublishPrecompiledCode(false);
+  if (rt->HasQueuedCode())
+    rt->InstallQueuedCode();
+
+  if (jit_enabled_ && ShouldCompile(method)) {
+    // Until the background compile is done, the interpreter runs it.
+    bool queued = !method->jit() && background_compilation_ && rt->QueueCompile(method);
+    if (!queued && !method->jit()) {
       int err = SP_ERROR_NONE;
       if (!CompilerBase::Compile(cx, method, &err)) {
         cx->ReportErrorNumber(err);
@@ -288,6 +615,13 @@ Environment::Invoke(PluginContext* cx,
     }
 
     if (CompiledFunction* fn = method->jit()) {
+      // Compiled leaf methods rely on their caller for a stack check, so
+      // make sure the guard they expect is there.
+      if (cx->sp() - kLeafStackGuard < cx->hp() + STACK_MARGIN) {
+        cx->ReportErrorNumber(SP_ERROR_STACKLOW);
+        return false;
+      }
+
       JitInvokeFrame ivkframe(cx, fn->GetCodeOffset()); 
 
       assert(top_ && top_->cx() == cx);
@@ -307,7 +641,8 @@ Environment::Invoke(PluginContext* cx,
     return false;
   }
 
-  return Interpreter::Run(cx, method, result);
+  *interpret = true;
+  return true;
 }
 
 void
@@ -315,23 +650,58 @@ Environment::ReportError(int code)
 {
   const char* message = GetErrorString(code);
   if (!message) {
-    char buffer[255];
-    UTIL_Format(buffer, sizeof(buffer), "Unknown error code %d", code);
-    ReportError(code, buffer);
-  } else {
-    ReportError(code, message);
+    ReportErrorFmt(code, "Unknown error code %d", code);
+    return;
   }
+
+  // Error strings are static, so there's nothing to copy.
+  ErrorReport report(code, message, top_ ? top_->cx() : nullptr, nullptr, true);
+  DispatchReport(report);
 }
 
-ErrorReport::ErrorReport(int code, const char* message, PluginContext* cx, SourcePawn::IPluginFunction* pf)
+ErrorReport::ErrorReport(int code, const char* message, PluginContext* cx,
+                         SourcePawn::IPluginFunction* pf, bool is_static)
    : code_(code),
      message_(message),
+     buffer_(nullptr),
+     maxlength_(0),
+     fmt_(nullptr),
+     is_lazy_(false),
+     is_static_(is_static),
      context_(cx),
      blame_(pf)
   {}
 
+ErrorReport::ErrorReport(int code, char* buffer, size_t maxlength, const char* fmt, va_list ap,
+                         PluginContext* cx, SourcePawn::IPluginFunction* pf)
+   : code_(code),
+     message_(nullptr),
+     buffer_(buffer),
+     maxlength_(maxlength),
+     fmt_(fmt),
+     is_lazy_(true),
+     is_static_(false),
+     context_(cx),
+     blame_(pf)
+{
+  va_copy(ap_, ap);
+}
+
+ErrorReport::~ErrorReport()
+{
+  if (is_lazy_)
+    va_end(ap_);
+}
+
 const char*
 ErrorReport::Message() const {
+  if (!message_) {
+    va_list ap;
+    va_copy(ap, ap_);
+    UTIL_FormatVA(buffer_, maxlength_, fmt_, ap);
+    va_end(ap);
+    message_ = buffer_;
+  }
   return message_;
 }
 
@@ -383,10 +753,12 @@ Environment::ReportErrorVA(const char* fmt, va_list ap)
 void
 Environment::ReportErrorVA(int code, const char* fmt, va_list ap)
 {
-  // :TODO: right-size the string rather than rely on this buffer.
-  char buffer[1024];
-  UTIL_FormatVA(buffer, sizeof(buffer), fmt, ap);
-  ReportError(code, buffer);
+  // The message is only formatted if a handler or listener needs it. It
+  // can't be formatted straight into |exception_message_|: a handler that
+  // re-reports the pending exception passes that very buffer as an argument.
+  char buffer[sizeof(exception_message_)];
+  ErrorReport report(code, buffer, sizeof(buffer), fmt, ap, top_ ? top_->cx() : nullptr, nullptr);
+  DispatchReport(report);
 }
 
 void
@@ -407,10 +779,10 @@ Environment::ReportError(int code, const char* message)
 
 void Environment::BlamePluginErrorVA(SourcePawn::IPluginFunction* pf, const char* fmt, va_list ap)
 {
-  // :TODO: right-size the string rather than rely on this buffer.
-  char buffer[1024];
-  UTIL_FormatVA(buffer, sizeof(buffer), fmt, ap);
-  ErrorReport report(SP_ERROR_USER, buffer, top_ ? top_->cx() : nullptr, pf); 
+  // See ReportErrorVA.
+  char buffer[sizeof(exception_message_)];
+  ErrorReport report(SP_ERROR_USER, buffer, sizeof(buffer), fmt, ap, top_ ? top_->cx() : nullptr,
+                     pf);
   DispatchReport(report);
 }
 
@@ -425,7 +797,20 @@ Environment::DispatchReport(const ErrorReport& report)
   // Save the exception state.
   if (eh_top_) {
     exception_code_ = report.Code();
-    UTIL_Format(exception_message_, sizeof(exception_message_), "%s", report.Message());
+    const char* message = report.Message();
+    if (report.IsStatic() || message == exception_message_) {
+      pending_message_ = message;
+    } else if (message > exception_message_ &&
+               message < exception_message_ + sizeof(exception_message_))
+    {
+      // Part of the last message, passed back in.
+      memmove(exception_message_, message, strlen(message) + 1);
+      pending_message_ = exception_message_;
+    } else {
+      UTIL_Format(exception_message_, sizeof(exception_message_), "%s", message);
+      pending_message_ = exception_message_;
+    }
+    UnwindNativeCall();
   }
 
   // For now, we always report exceptions even if they might be handled.
@@ -437,25 +822,6 @@ Environment::DispatchReport(const ErrorReport& report)
     InvokeDebugger(top_->cx(), &report);
 }
 
-void
-Environment::EnterExceptionHandlingScope(ExceptionHandler* handler)
-{
-  handler->next_ = eh_top_;
-  eh_top_ = handler;
-}
-
-void
-Environment::LeaveExceptionHandlingScope(ExceptionHandler* handler)
-{
-  assert(handler == eh_top_);
-  eh_top_ = eh_top_->next_;
-
-  // To preserve compatibility with older API, we clear the exception state
-  // when there is no EH handler.
-  if (!eh_top_ || handler->catch_)
-    exception_code_ = SP_ERROR_NONE;
-}
-
 bool
 Environment::HasPendingException(const ExceptionHandler* handler)
 {
@@ -472,7 +838,7 @@ Environment::GetPendingExceptionMessage(const ExceptionHandler* handler)
   // API may need to query the handler.
   assert(handler == eh_top_);
   assert(HasPendingException(handler));
-  return exception_message_;
+  return pending_message_;
 }
 
 bool
@@ -487,6 +853,30 @@ Environment::clearPendingException()
   exception_code_ = SP_ERROR_NONE;
 }
 
+void
+Environment::setPendingException(int code, const char* message)
+{
+  assert(!hasPendingException());
+  if (!eh_top_)
+    return;
+  exception_code_ = code;
+  UTIL_Format(exception_message_, sizeof(exception_message_), "%s", message);
+  pending_message_ = exception_message_;
+}
+
+void
+Environment::swapStackState(StackState* state)
+{
+  // Code that starts running again counts as a new frame, for the watchdog.
+  if (!top_ && state->top)
+    frame_id_++;
+
+  std::swap(top_, state->top);
+  std::swap(exit_fp_, state->exit_fp);
+  std::swap(eh_top_, state->eh_top);
+  std::swap(stats_top_, state->stats_top);
+}
+
 int
 Environment::getPendingExceptionCode() const
 {
@@ -499,6 +889,9 @@ Environment::enterInvoke(InvokeFrame* frame)
   if (!top_)
     frame_id_++;
   top_ = frame;
+
+  if (Timeline* timeline = this->timeline())
+    timeline->begin(Timeline::Kind::Invoke, frame->cx()->runtime(), frame->entry_cip());
 }
 
 void
@@ -511,5 +904,94 @@ Environment::leaveJitInvoke(JitInvokeFrame* frame)
 void
 Environment::leaveInvoke()
 {
+  if (Timeline* timeline = this->timeline())
+    timeline->end(Timeline::Kind::Invoke, top_->cx()->runtime(), top_->entry_cip());
+
   top_ = top_->prev();
+
+  // An exception left by a nested invocation propagates through the native
+  // that made it.
+  if (hasPendingException())
+    UnwindNativeCall();
+
+  // No code is running now, including any of a runtime destroyed by a
+  // native it called.
+  if (!top_ && !retired_methods_.empty())
+    ReclaimRetiredMethods();
+}
+
+// With table unwinding, sends the native call compiled code is waiting on to
+// its landing pad, which then propagates the pending exception.
+void
+Environment::UnwindNativeCall()
+{
+#if defined(SP_HAS_JIT)
+  if (!table_unwinding_ || !top_)
+    return;
+
+  // If compiled code is in a native call, that call's exit frame is the most
+  // recent one in this invocation.
+  JitInvokeFrame* ivk = top_->AsJitInvokeFrame();
+  if (!ivk || !exit_fp_ || exit_fp_ == ivk->prev_exit_fp())
+    return;
+
+  FrameLayout* exit = FrameLayout::FromFp(exit_fp_);
+  if (exit->frame_type != intptr_t(JitFrameType::Exit) ||
+      GetExitFrameType(exit->function_id) != ExitFrameType::Native)
+  {
+    return;
+  }
+
+  FrameLayout* caller = FrameLayout::FromFp(exit->prev_fp);
+  if (caller->frame_type != intptr_t(JitFrameType::Scripted))
+    return;
+
+  RefPtr<MethodInfo> method = ivk->cx()->runtime()->GetMethod(caller->function_id);
+  if (!method || !method->jit())
+    return;
+  method->jit()->RedirectToLandingPad(exit_fp_, exit->return_address);
+#endif
+}
+
+EnterStatsScope::EnterStatsScope(PluginContext* cx, PublicStats* stats)
+ : env_(Environment::get()),
+   cx_(cx),
+   stats_(stats),
+   prev_(env_->stats_top_),
+   start_(std::chrono::steady_clock::now()),
+   child_ns_(0),
+   natives_at_entry_(env_->native_calls()),
+   child_natives_(0),
+   hp_at_entry_(cx->hp()),
+   saved_high_water_(cx->hp_high_water())
+{
+  cx_->set_hp_high_water(hp_at_entry_);
+  env_->stats_top_ = this;
+}
+
+EnterStatsScope::~EnterStatsScope()
+{
+  assert(env_->stats_top_ == this);
+  env_->stats_top_ = prev_;
+
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+  uint32_t natives = env_->native_calls() - natives_at_entry_;
+
+  stats_->calls++;
+  stats_->total_ns += elapsed;
+  stats_->self_ns += elapsed - std::min(elapsed, child_ns_);
+  stats_->max_ns = std::max(stats_->max_ns, elapsed);
+  stats_->native_calls += natives - child_natives_;
+
+  uint32_t heap_used = uint32_t(cx_->hp_high_water() - hp_at_entry_);
+  stats_->heap_high_water = std::max(stats_->heap_high_water, heap_used);
+
+  // Heap used here counts toward any invocation we're nested in.
+  cx_->set_hp_high_water(std::max(saved_high_water_, cx_->hp_high_water()));
+
+  if (prev_) {
+    prev_->child_ns_ += elapsed;
+    prev_->child_natives_ += natives;
+  }
 }
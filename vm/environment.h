@@ -13,14 +13,21 @@
 #ifndef _include_sourcepawn_vm_environment_h_
 #define _include_sourcepawn_vm_environment_h_
 
+#include <stdarg.h>
+
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <vector>
 
 #include <sp_vm_api.h>
 #include <amtl/am-cxx.h>
 #include <amtl/am-inlinelist.h>
 #include <amtl/am-mutex.h>
 #include "code-allocator.h"
+#include "code-map.h"
 #include "plugin-runtime.h"
+#include "shared/string-pool.h"
 #include "stack-frames.h"
 
 namespace sp {
@@ -32,13 +39,21 @@ class CodeStubs;
 class WatchdogTimer;
 class ErrorReport;
 class BuiltinNatives;
+class CodeCache;
+class SamplingProfiler;
+class Timeline;
+class EnterStatsScope;
+class DataImage;
+class NativeRegistry;
+class ImageCache;
+class CallbackQueue;
 
 // An Environment encapsulates everything that's needed to load and run
 // instances of plugins on a single thread. There can be at most one
-// environment per thread.
-//
-// Currently, the VM is single threaded in that no more than one
-// Environment can be created per process.
+// environment per thread, and it belongs to the thread that created it.
+// Environments on different threads share nothing: each has its own code
+// allocator, watchdog, exception state, and runtimes, so they can run
+// concurrently. Objects from one environment must not be passed to another.
 class Environment : public ISourcePawnEnvironment
 {
  public:
@@ -54,16 +69,38 @@ class Environment : public ISourcePawnEnvironment
     return SOURCEPAWN_API_VERSION;
   }
 
-  // Access the current Environment.
+  // Access the current thread's Environment.
   static Environment* get();
 
+  // Makes |env| the current environment on a helper thread (such as the
+  // background compiler) that works on its behalf. Pass null to detach.
+  static void AttachToThread(Environment* env);
+
   bool InstallWatchdogTimer(int timeout_ms);
 
-  void EnterExceptionHandlingScope(ExceptionHandler* handler) override;
-  void LeaveExceptionHandlingScope(ExceptionHandler* handler) override;
+  void EnterExceptionHandlingScope(ExceptionHandler* handler) override {
+    handler->next_ = eh_top_;
+    eh_top_ = handler;
+  }
+  void LeaveExceptionHandlingScope(ExceptionHandler* handler) override {
+    assert(handler == eh_top_);
+    eh_top_ = eh_top_->next_;
+
+    // To preserve compatibility with older API, we clear the exception state
+    // when there is no EH handler.
+    if (!eh_top_ || handler->catch_)
+      exception_code_ = SP_ERROR_NONE;
+  }
   bool HasPendingException(const ExceptionHandler* handler) override;
   const char* GetPendingExceptionMessage(const ExceptionHandler* handler) override;
   bool EnableDebugBreak() override;
+  bool EnableInvocationBudgets() override;
+  void SetInvocationBudget(uint32_t units) override;
+  uint32_t GetInvocationBudgetSpent() override;
+  bool QueueCallback(IPluginFunction* function, const cell_t* params, unsigned int num_params,
+                     int priority, uint64_t deadline, SPVM_QUEUED_CALLBACK_FUNC done,
+                     void* data) override;
+  size_t RunQueuedCallbacks(uint32_t max_us) override;
 
   // Runtime functions.
   const char* GetErrorString(int err);
@@ -75,7 +112,23 @@ class Environment : public ISourcePawnEnvironment
   void BlamePluginErrorVA(SourcePawn::IPluginFunction* pf, const char* fmt, va_list ap);
 
   // Allocate and free executable memory.
-  CodeChunk AllocateCode(size_t size);
+  CodeChunk AllocateCode(size_t size, bool hot = false);
+  void GetCodeMemoryStats(CodeMemoryStats* stats) const {
+    code_alloc_->GetStats(stats);
+  }
+
+  // Time spent compiling methods on this thread, for benchmarking. Methods
+  // compiled in the background or loaded from the code cache aren't counted.
+  void addJitCompileTime(uint64_t ns) {
+    jit_compile_ns_ += ns;
+    jit_compiles_++;
+  }
+  uint64_t jit_compile_ns() const {
+    return jit_compile_ns_;
+  }
+  uint32_t jit_compiles() const {
+    return jit_compiles_;
+  }
 
   CodeStubs* stubs() {
     return code_stubs_.get();
@@ -83,11 +136,37 @@ class Environment : public ISourcePawnEnvironment
   BuiltinNatives* builtins() {
     return builtins_.get();
   }
+  NativeRegistry* natives() {
+    return natives_.get();
+  }
+
+  // Native and public names of every loaded plugin, interned, so each name
+  // is stored once and comparing two is pointer equality. Like the native
+  // registry, this is only used from the thread that loads plugins.
+  StringPool* atoms() {
+    return &atoms_;
+  }
+  ImageCache* image_cache() {
+    return image_cache_.get();
+  }
 
   // Runtime management.
   void RegisterRuntime(PluginRuntime* rt);
   void DeregisterRuntime(PluginRuntime* rt);
+
+  // Takes the methods of a runtime being destroyed. They, and the code
+  // compiled for them, are freed a runtime at a time whenever the outermost
+  // invocation returns, so unloading many plugins at once stays cheap.
+  void RetireMethods(std::unique_ptr<PluginRuntime::MethodList> methods);
+  // Frees the methods of one retired runtime. Returns false if there were
+  // none left.
+  bool ReclaimRetiredMethods();
   void PatchAllJumpsForTimeout();
+
+  // Shared .data images, so contexts with identical data map the same pages.
+  DataImage* FindDataImage(size_t length, const unsigned char hash[16]);
+  void RegisterDataImage(DataImage* image);
+  void UnregisterDataImage(DataImage* image);
   void UnpatchAllJumpsFromTimeout();
   ke::Mutex& lock() {
     return mutex_;
@@ -95,6 +174,18 @@ class Environment : public ISourcePawnEnvironment
 
   bool Invoke(PluginContext* cx, const RefPtr<MethodInfo>& method, cell_t* result);
 
+  // Runs |method| if it is compiled, or should be now. Otherwise validates
+  // it and sets |*interpret|, leaving the caller to interpret it.
+  bool TryInvokeCompiled(PluginContext* cx, MethodInfo* method, cell_t* result,
+                         bool* interpret);
+
+  // For a call from compiled code to |method|, which isn't compiled: whether
+  // it should be interpreted for now, as Invoke would.
+  bool ShouldInterpretCall(PluginContext* cx, MethodInfo* method);
+
+  // A reasonable threshold for tiered compilation.
+  static const uint32_t kDefaultJitThreshold = 1000;
+
   // Helpers.
   void SetProfiler(IProfilingTool* profiler) {
     profiler_ = profiler;
@@ -108,10 +199,155 @@ class Environment : public ISourcePawnEnvironment
   void EnableProfiling();
   void DisableProfiling();
 
+  // The built-in sampling profiler needs the watchdog timer to be running.
+  // Samples are kept until written or the environment is destroyed.
+  bool StartSampling(size_t interval_ms);
+  void StopSampling();
+  bool IsSamplingEnabled() const {
+    return sampling_enabled_;
+  }
+  SamplingProfiler* sampler() const {
+    return sampler_.get();
+  }
+  bool WriteSampleProfile(const char* path);
+
+  // Times every native call, per plugin and per native; see NativeCallStats.
+  // Stats are kept by each plugin runtime, and go away when it is unloaded.
+  void SetNativeTracing(bool enabled) {
+    if (enabled == native_tracing_)
+      return;
+    native_tracing_ = enabled;
+    if (enabled)
+      AddNativeHook();
+    else
+      RemoveNativeHook();
+  }
+  bool IsNativeTracingEnabled() const {
+    return native_tracing_;
+  }
+  void WriteNativeTrace(FILE* fp);
+
+  // Records invokes, native calls, JIT compiles and watchdog timeouts as a
+  // timeline, keeping the last |capacity| events; see Timeline. Events are
+  // kept until written or the environment is destroyed.
+  void StartTimeline(size_t capacity);
+  void StopTimeline();
+  Timeline* timeline() const {
+    return timeline_enabled_ ? timeline_.get() : nullptr;
+  }
+  bool WriteTimeline(const char* path);
+
+  // While anything needs to see native calls (tracing, or a runtime being
+  // recorded), compiled code sends direct native calls through the native
+  // thunk instead. Otherwise, it pays one compare per direct call.
+  void AddNativeHook() {
+    native_hooks_++;
+  }
+  void RemoveNativeHook() {
+    assert(native_hooks_);
+    native_hooks_--;
+  }
+  bool HasNativeHooks() const {
+    return !!native_hooks_;
+  }
+  uint32_t* addressOfNativeHooks() {
+    return &native_hooks_;
+  }
+
   void SetJitEnabled(bool enabled);
   bool IsJitEnabled() const {
     return jit_enabled_;
   }
+
+  // Maps JIT code twice, writable and executable, so no page is ever both.
+  // This is process-wide and should be set before creating an environment;
+  // it is also enabled automatically if the system refuses W+X memory.
+  static void SetDualMappedCode(bool enabled);
+
+  // When enabled, compiled code checks an interrupt flag at every loop
+  // back-edge, and a timeout just sets the flag. Otherwise back-edges cost
+  // nothing, but a timeout has to patch every loop in every loaded method,
+  // under the environment lock. Must be set before any plugins are loaded.
+  bool SetInterruptPolling(bool enabled);
+  bool polls_interrupts() const {
+    return poll_interrupts_;
+  }
+
+  // When enabled, compiled code and the interpreter spend one unit of budget
+  // at every function entry and loop test, and throw SP_ERROR_BUDGET once it
+  // runs out. The budget is refilled each time the host enters the VM, so a
+  // plugin's cost is the same on every run, however busy the machine is.
+  // Must be set before any plugins are loaded.
+  bool SetInvocationBudgets(bool enabled);
+  bool has_budgets() const {
+    return budgets_enabled_;
+  }
+
+  // When enabled, compiled code doesn't test for an exception after each
+  // native call. A native that leaves one pending has its return address
+  // redirected to the call site's landing pad instead (see UnwindEntry).
+  // This rewrites return addresses, so it can't be used with hardware
+  // shadow stacks. Must be set before any plugins are loaded.
+  bool SetTableUnwinding(bool enabled);
+  bool table_unwinding() const {
+    return table_unwinding_;
+  }
+
+  // When enabled, the interpreter translates each method into pre-decoded,
+  // threaded code the first time it runs it.
+  void SetPredecodeEnabled(bool enabled) {
+    predecode_enabled_ = enabled;
+  }
+  bool IsPredecodeEnabled() const {
+    return predecode_enabled_;
+  }
+
+  // When enabled, the interpreter counts each op it runs, per method; see
+  // PluginRuntime::WriteOpcodeHistogram(). Counting needs the decoding
+  // loop, so pre-decoded code isn't used while it's on.
+  void SetOpcodeCounting(bool enabled) {
+    opcode_counting_ = enabled;
+  }
+  bool IsOpcodeCountingEnabled() const {
+    return opcode_counting_;
+  }
+
+  // If non-zero, methods are interpreted until the sum of their invocations
+  // and loop iterations reaches this threshold, and are then compiled.
+  void SetJitThreshold(uint32_t threshold) {
+    jit_threshold_ = threshold;
+  }
+  uint32_t jit_threshold() const {
+    return jit_threshold_;
+  }
+
+  // When enabled, a method that would be compiled when it is invoked runs in
+  // the interpreter instead, while it and everything it calls are compiled
+  // on a background thread. The code is installed the next time the runtime
+  // is entered after the compile finishes.
+  void SetBackgroundCompilation(bool enabled) {
+    background_compilation_ = enabled;
+  }
+  bool background_compilation() const {
+    return background_compilation_;
+  }
+
+  // Compiled methods are saved to and loaded from |path| (which must already
+  // exist), keyed by each plugin's code hash. Passing null or an empty path
+  // disables the cache. Only supported by the x64 JIT.
+  void SetCodeCacheDirectory(const char* path);
+  CodeCache* code_cache() const {
+    return code_cache_.get();
+  }
+
+  // Describes JIT code to external profilers; see CodeMap. Code compiled
+  // earlier is not described, so this should be called before any plugin
+  // is loaded. Setting SOURCEPAWN_PERF_MAP to "map" or "jitdump" enables it
+  // at startup, for hosts that can't call this.
+  bool EnableCodeMap(CodeMap::Format format);
+  CodeMap* code_map() const {
+    return code_map_.get();
+  }
   void SetDebugger(IDebugListener* debugger) {
     debugger_ = debugger;
   }
@@ -137,6 +373,26 @@ class Environment : public ISourcePawnEnvironment
   void clearPendingException();
   int getPendingExceptionCode() const;
 
+  // Leaves an exception pending in the current handler scope without
+  // reporting it again, for an error already reported on another stack.
+  void setPendingException(int code, const char* message);
+
+  // The part of the environment's state that lives on one native stack.
+  // A suspended invocation keeps its own while the host runs.
+  struct StackState {
+    StackState()
+     : top(nullptr),
+       exit_fp(nullptr),
+       eh_top(nullptr),
+       stats_top(nullptr)
+    {}
+    InvokeFrame* top;
+    intptr_t* exit_fp;
+    ExceptionHandler* eh_top;
+    EnterStatsScope* stats_top;
+  };
+  void swapStackState(StackState* state);
+
   // These are indicators used for the watchdog timer.
   uintptr_t FrameId() const {
     return frame_id_;
@@ -167,20 +423,77 @@ class Environment : public ISourcePawnEnvironment
   void* addressOfExit() {
     return &exit_fp_;
   }
+  uint32_t* addressOfNativeCalls() {
+    return &native_calls_;
+  }
+
+  // Counts every native call, for PublicStats. Compiled code increments
+  // this inline. It may wrap, so only differences are meaningful.
+  void countNativeCall() {
+    native_calls_++;
+  }
+  uint32_t native_calls() const {
+    return native_calls_;
+  }
+
+  // Bumped on entry from the host and on every call to a native that isn't
+  // SP_NTVFLAG_PURE, so a pure native's result remembered under the same
+  // epoch is still valid. Compiled code reads and increments this inline.
+  uint32_t memo_epoch() const {
+    return memo_epoch_;
+  }
+  uint32_t* addressOfMemoEpoch() {
+    return &memo_epoch_;
+  }
+  void bumpMemoEpoch() {
+    memo_epoch_++;
+  }
   void* addressOfExceptionCode() {
     return &exception_code_;
   }
+  void* addressOfInterrupt() {
+    return &interrupt_;
+  }
+  void* addressOfBudget() {
+    return &budget_;
+  }
+
+  // The interpreter's half of what compiled code does inline.
+  bool spendBudget() {
+    return --budget_ >= 0;
+  }
+  // Called when the host enters the VM, and when it leaves again.
+  void refillBudget() {
+    budget_ = budget_limit_;
+  }
+  void noteBudgetSpent() {
+    budget_spent_ = uint32_t(budget_ < 0 ? budget_limit_ : budget_limit_ - budget_);
+  }
+
+  // Called from the watchdog thread, under its own lock.
+  void RequestInterrupt() {
+    interrupt_.store(1, std::memory_order_release);
+  }
+  void ClearInterrupt() {
+    interrupt_.store(0, std::memory_order_relaxed);
+  }
 
  private:
   bool Initialize();
 
   void DispatchReport(const ErrorReport& report);
+  void UnwindNativeCall();
+  bool ShouldCompile(MethodInfo* method);
 
  private:
   std::unique_ptr<ISourcePawnEngine> api_v1_;
   std::unique_ptr<ISourcePawnEngine2> api_v2_;
   std::unique_ptr<WatchdogTimer> watchdog_timer_;
   std::unique_ptr<BuiltinNatives> builtins_;
+  std::unique_ptr<NativeRegistry> natives_;
+  std::unique_ptr<ImageCache> image_cache_;
+  std::unique_ptr<CallbackQueue> callbacks_;
+  StringPool atoms_;
   ke::Mutex mutex_;
 
   bool debug_break_enabled_;
@@ -189,21 +502,61 @@ class Environment : public ISourcePawnEnvironment
   IDebugListener* debugger_;
   ExceptionHandler* eh_top_;
   int exception_code_;
+  // The pending exception's message, which is either a static string or
+  // |exception_message_|.
+  const char* pending_message_;
   char exception_message_[1024];
 
   IProfilingTool* profiler_;
   bool jit_enabled_;
+  uint32_t jit_threshold_;
+  bool background_compilation_;
+  bool predecode_enabled_;
+  bool opcode_counting_;
+  bool poll_interrupts_;
+  bool table_unwinding_;
+  bool budgets_enabled_;
   bool profiling_enabled_;
+  bool sampling_enabled_;
+  std::unique_ptr<SamplingProfiler> sampler_;
+  bool timeline_enabled_;
+  std::unique_ptr<Timeline> timeline_;
 
   std::unique_ptr<CodeAllocator> code_alloc_;
   std::unique_ptr<CodeStubs> code_stubs_;
+  std::unique_ptr<CodeCache> code_cache_;
+  std::unique_ptr<CodeMap> code_map_;
 
   ke::InlineList<PluginRuntime> runtimes_;
+  std::vector<std::unique_ptr<PluginRuntime::MethodList>> retired_methods_;
+  std::vector<DataImage*> data_images_;
 
   uintptr_t frame_id_;
 
   InvokeFrame* top_;
   intptr_t* exit_fp_;
+
+  uint32_t native_calls_;
+  uint32_t memo_epoch_;
+  bool native_tracing_;
+  uint32_t native_hooks_;
+  EnterStatsScope* stats_top_;
+
+  uint64_t jit_compile_ns_;
+  uint32_t jit_compiles_;
+
+  // Non-zero while a timeout is pending. Compiled code reads this directly.
+  std::atomic<int32_t> interrupt_;
+  static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t),
+                "compiled code reads the interrupt flag as a plain int32");
+
+  // What's left of the current invocation's budget. Compiled code
+  // decrements this directly.
+  int32_t budget_;
+  int32_t budget_limit_;
+  uint32_t budget_spent_;
+
+  friend class EnterStatsScope;
 };
 
 class EnterProfileScope
@@ -227,10 +580,39 @@ class EnterProfileScope
   bool scope_entered_ = false;
 };
 
+// Adds one invocation of a public to its PublicStats. Scopes nest, and each
+// one subtracts the time and native calls of the scopes inside it from its
+// own self time and native count.
+class EnterStatsScope
+{
+ public:
+  EnterStatsScope(PluginContext* cx, PublicStats* stats);
+  ~EnterStatsScope();
+
+ private:
+  Environment* env_;
+  PluginContext* cx_;
+  PublicStats* stats_;
+  EnterStatsScope* prev_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t child_ns_;
+  uint32_t natives_at_entry_;
+  uint32_t child_natives_;
+  cell_t hp_at_entry_;
+  cell_t saved_high_water_;
+};
+
 class ErrorReport : public SourcePawn::IErrorReport
 {
   public:
-  ErrorReport(int code, const char* message, PluginContext* cx, SourcePawn::IPluginFunction* pf);
+  ErrorReport(int code, const char* message, PluginContext* cx, SourcePawn::IPluginFunction* pf,
+              bool is_static = false);
+  // The message is formatted into |buffer| the first time it is asked for,
+  // so an error nothing looks at costs no formatting. |ap| must outlive the
+  // report.
+  ErrorReport(int code, char* buffer, size_t maxlength, const char* fmt, va_list ap,
+              PluginContext* cx, SourcePawn::IPluginFunction* pf);
+  ~ErrorReport();
 
   public: //IErrorReport
   const char* Message() const override;
@@ -239,9 +621,20 @@ class ErrorReport : public SourcePawn::IErrorReport
   bool IsFatal() const override;
   IPluginContext* Context() const override;
 
+  // True if Message() lives as long as the program does.
+  bool IsStatic() const {
+    return is_static_;
+  }
+
  private:
   int code_;
-  const char* message_;
+  mutable const char* message_;
+  char* buffer_;
+  size_t maxlength_;
+  const char* fmt_;
+  mutable va_list ap_;
+  bool is_lazy_;
+  bool is_static_;
   PluginContext* context_;
   IPluginFunction* blame_;
 };
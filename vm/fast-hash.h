@@ -0,0 +1,153 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_fast_hash_h_
+#define _include_sourcepawn_vm_fast_hash_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace sp {
+
+// An incremental, non-cryptographic 128-bit digest used to identify plugin
+// code and data. It is built on the xxHash64 round function with four
+// independent lanes, so it runs at memory speed on large images; the two
+// halves of the digest fold the lanes together differently. It is not
+// resistant to deliberate collisions - hosts that need that should opt into
+// MD5 with SP_LOADFLAG_MD5_HASHES.
+class FastHash
+{
+ public:
+  static const size_t kDigestSize = 16;
+
+  FastHash() {
+    lanes_[0] = kPrime1 + kPrime2;
+    lanes_[1] = kPrime2;
+    lanes_[2] = 0;
+    lanes_[3] = 0 - kPrime1;
+    total_ = 0;
+    pending_ = 0;
+  }
+
+  void update(const void* data, size_t length) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    total_ += length;
+
+    if (pending_) {
+      size_t take = kStripe - pending_;
+      if (take > length)
+        take = length;
+      memcpy(buffer_ + pending_, p, take);
+      pending_ += take;
+      p += take;
+      length -= take;
+      if (pending_ < kStripe)
+        return;
+      consume(buffer_);
+      pending_ = 0;
+    }
+
+    while (length >= kStripe) {
+      consume(p);
+      p += kStripe;
+      length -= kStripe;
+    }
+
+    memcpy(buffer_, p, length);
+    pending_ = length;
+  }
+
+  void finalize(uint8_t digest[kDigestSize]) const {
+    uint64_t lo = Rotl(lanes_[0], 1) + Rotl(lanes_[1], 7) + Rotl(lanes_[2], 12) +
+                  Rotl(lanes_[3], 18);
+    uint64_t hi = Rotl(lanes_[3], 1) + Rotl(lanes_[2], 7) + Rotl(lanes_[1], 12) +
+                  Rotl(lanes_[0], 18);
+    for (size_t i = 0; i < 4; i++) {
+      lo = (lo ^ Round(0, lanes_[i])) * kPrime1 + kPrime4;
+      hi = (hi ^ Round(0, lanes_[3 - i])) * kPrime2 + kPrime3;
+    }
+
+    lo += total_;
+    hi += total_ * kPrime5;
+
+    // Mix in the tail one word at a time, then bytewise.
+    size_t i = 0;
+    for (; i + 8 <= pending_; i += 8) {
+      uint64_t k = Round(0, Read64(buffer_ + i));
+      lo = Rotl(lo ^ k, 27) * kPrime1 + kPrime4;
+      hi = Rotl(hi ^ k, 31) * kPrime2 + kPrime3;
+    }
+    for (; i < pending_; i++) {
+      lo = Rotl(lo ^ (buffer_[i] * kPrime5), 11) * kPrime1;
+      hi = Rotl(hi ^ (buffer_[i] * kPrime1), 13) * kPrime2;
+    }
+
+    lo = Avalanche(lo);
+    hi = Avalanche(hi ^ lo);
+    memcpy(digest, &lo, sizeof(lo));
+    memcpy(digest + sizeof(lo), &hi, sizeof(hi));
+  }
+
+  static void Compute(const void* data, size_t length, uint8_t digest[kDigestSize]) {
+    FastHash hash;
+    hash.update(data, length);
+    hash.finalize(digest);
+  }
+
+ private:
+  static const size_t kStripe = 32;
+  static const uint64_t kPrime1 = 0x9e3779b185ebca87ull;
+  static const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4full;
+  static const uint64_t kPrime3 = 0x165667b19e3779f9ull;
+  static const uint64_t kPrime4 = 0x85ebca77c2b2ae63ull;
+  static const uint64_t kPrime5 = 0x27d4eb2f165667c5ull;
+
+  static inline uint64_t Rotl(uint64_t v, unsigned bits) {
+    return (v << bits) | (v >> (64 - bits));
+  }
+  static inline uint64_t Read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  static inline uint64_t Round(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    acc = Rotl(acc, 31);
+    return acc * kPrime1;
+  }
+  static inline uint64_t Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  void consume(const uint8_t* p) {
+    lanes_[0] = Round(lanes_[0], Read64(p));
+    lanes_[1] = Round(lanes_[1], Read64(p + 8));
+    lanes_[2] = Round(lanes_[2], Read64(p + 16));
+    lanes_[3] = Round(lanes_[3], Read64(p + 24));
+  }
+
+ private:
+  uint64_t lanes_[4];
+  uint64_t total_;
+  uint8_t buffer_[kStripe];
+  size_t pending_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_fast_hash_h_
@@ -12,6 +12,14 @@
 #include <memory>
 #include <utility>
 
+#if defined(_WIN32)
+# include <Windows.h>
+# include <io.h>
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
 #include <smx/smx-headers.h>
 #include "file-utils.h"
 
@@ -30,9 +38,28 @@ sp::DetectFileType(FILE* fp)
   return FileType::UNKNOWN;
 }
 
-FileReader::FileReader(FILE* fp)
- : length_(0)
+FileReader::FileReader()
+ : bytes_(nullptr),
+   length_(0),
+   mapping_(nullptr)
+#if defined(_WIN32)
+   , section_(nullptr)
+#endif
+{
+}
+
+FileReader::FileReader(FILE* fp, bool map_file)
+ : FileReader()
 {
+  readFile(fp, map_file);
+}
+
+void
+FileReader::readFile(FILE* fp, bool map_file)
+{
+  if (map_file && mapFile(fp))
+    return;
+
   if (fseek(fp, 0, SEEK_END) != 0)
     return;
   long size = ftell(fp);
@@ -45,12 +72,87 @@ FileReader::FileReader(FILE* fp)
   if (!bytes || fread(bytes.get(), sizeof(uint8_t), size, fp) != (size_t)size)
     return;
 
-  buffer_ = std::move(bytes);
-  length_ = size;
+  setBuffer(std::move(bytes), size);
 }
 
 FileReader::FileReader(std::unique_ptr<uint8_t[]>&& buffer, size_t length)
  : buffer_(std::move(buffer)),
-   length_(length)
+   bytes_(buffer_.get()),
+   length_(length),
+   mapping_(nullptr)
+#if defined(_WIN32)
+   , section_(nullptr)
+#endif
+{
+}
+
+FileReader::~FileReader()
+{
+  unmap();
+}
+
+void
+FileReader::setBuffer(std::unique_ptr<uint8_t[]>&& buffer, size_t length)
 {
+  unmap();
+  buffer_ = std::move(buffer);
+  bytes_ = buffer_.get();
+  length_ = length;
+}
+
+bool
+FileReader::mapFile(FILE* fp)
+{
+#if defined(_WIN32)
+  HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(fp)));
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || uint64_t(size.QuadPart) > SIZE_MAX)
+    return false;
+
+  HANDLE section = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!section)
+    return false;
+  void* view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(section);
+    return false;
+  }
+
+  section_ = section;
+  mapping_ = view;
+  length_ = size_t(size.QuadPart);
+#else
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0 || st.st_size <= 0)
+    return false;
+
+  void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  if (view == MAP_FAILED)
+    return false;
+
+  mapping_ = view;
+  length_ = st.st_size;
+#endif
+
+  bytes_ = reinterpret_cast<const uint8_t*>(mapping_);
+  return true;
+}
+
+void
+FileReader::unmap()
+{
+  if (!mapping_)
+    return;
+
+#if defined(_WIN32)
+  UnmapViewOfFile(mapping_);
+  CloseHandle(section_);
+  section_ = nullptr;
+#else
+  munmap(mapping_, length_);
+#endif
+  mapping_ = nullptr;
 }
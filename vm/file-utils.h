@@ -10,6 +10,7 @@
 #ifndef _include_sourcepawn_file_parser_h_
 #define _include_sourcepawn_file_parser_h_
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include <memory>
@@ -28,19 +29,46 @@ FileType DetectFileType(FILE* fp);
 class FileReader
 {
  public:
-  FileReader(FILE* fp);
+  // If |map_file| is true, the file is mapped read-only instead of being read
+  // into memory, falling back to reading it if the mapping fails. A mapped
+  // file must not be rewritten in place while the reader is alive.
+  explicit FileReader(FILE* fp, bool map_file = false);
   FileReader(std::unique_ptr<uint8_t[]>&& buffer, size_t length);
+  ~FileReader();
 
   const uint8_t* buffer() const {
-    return buffer_.get();
+    return bytes_;
   }
   size_t length() const {
     return length_;
   }
+  bool mapped() const {
+    return !!mapping_;
+  }
+
+ protected:
+  // For readers that fill themselves in, with readFile() or setBuffer().
+  FileReader();
+
+  void readFile(FILE* fp, bool map_file);
+
+  // Replaces the contents, releasing the mapping if there is one.
+  void setBuffer(std::unique_ptr<uint8_t[]>&& buffer, size_t length);
+
+ private:
+  bool mapFile(FILE* fp);
+  void unmap();
 
  protected:
   std::unique_ptr<uint8_t[]> buffer_;
+  const uint8_t* bytes_;
   size_t length_;
+
+ private:
+  void* mapping_;
+#if defined(_WIN32)
+  void* section_;
+#endif
 };
 
 } // namespace sp
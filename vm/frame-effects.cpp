@@ -0,0 +1,444 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#include "frame-effects.h"
+#include <smx/smx-v1-opcodes.h>
+
+#include <limits.h>
+
+#include <algorithm>
+
+namespace sp {
+
+// A FILL through an array's address is decoded as one access per cell, so it
+// has to fit in FrameEffects::accesses.
+static const cell_t kMaxElementFill = 4 * sizeof(cell_t);
+
+static bool
+ExtractPushCount(const cell_t* cip, cell_t* value)
+{
+  switch (*cip) {
+    case OP_PUSH_C:
+      *value = cip[1];
+      return true;
+    case OP_PUSH2_C:
+      *value = cip[2];
+      return true;
+    case OP_PUSH3_C:
+      *value = cip[3];
+      return true;
+    case OP_PUSH4_C:
+      *value = cip[4];
+      return true;
+    case OP_PUSH5_C:
+      *value = cip[5];
+      return true;
+    default:
+      return false;
+  }
+}
+
+void
+DecodeFrameEffects(const cell_t* cip, const cell_t* prev, bool debug_break, FrameEffects* fx,
+                   const FrameElementAccesses* elements)
+{
+  switch (*cip) {
+    case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT:
+    case OP_LREF_S_PRI:
+    case OP_LREF_S_ALT:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_INC_S:
+    case OP_DEC_S:
+      fx->access(cip[1], true);
+      break;
+
+    case OP_LOAD_S_BOTH:
+      fx->access(cip[1], true);
+      fx->access(cip[2], true);
+      break;
+
+    case OP_LIDX_S_BOUNDS:
+    case OP_IDXADDR_S_BOUNDS:
+      fx->access(cip[2], true);
+      fx->taken[fx->ntaken++] = cip[1];
+      break;
+
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_ZERO_S:
+    case OP_CONST_S:
+      fx->access(cip[1], false);
+      break;
+
+    case OP_ADDR_PRI:
+    case OP_ADDR_ALT:
+      if (!elements || !elements->isContained(cip))
+        fx->taken[fx->ntaken++] = cip[1];
+      break;
+
+    case OP_LOAD_I:
+    case OP_STOR_I:
+    {
+      cell_t offset;
+      if (elements && elements->slotFor(cip, &offset))
+        fx->access(offset, *cip == OP_LOAD_I);
+      break;
+    }
+
+    case OP_FILL:
+    {
+      cell_t offset;
+      if (elements && elements->slotFor(cip, &offset)) {
+        for (cell_t i = 0; i < cip[1]; i += sizeof(cell_t))
+          fx->access(offset + i, false);
+      }
+      break;
+    }
+
+    case OP_PUSH_S:
+    case OP_PUSH2_S:
+    case OP_PUSH3_S:
+    case OP_PUSH4_S:
+    case OP_PUSH5_S:
+    {
+      int32_t n = (*cip == OP_PUSH_S) ? 1 : int32_t((*cip - OP_PUSH2_S) / 4 + 2);
+      for (int32_t i = 1; i <= n; i++)
+        fx->access(cip[i], true);
+      fx->push(n);
+      break;
+    }
+
+    case OP_PUSH_ADR:
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_ADR:
+    {
+      int32_t n = (*cip == OP_PUSH_ADR) ? 1 : int32_t((*cip - OP_PUSH2_ADR) / 4 + 2);
+      for (int32_t i = 1; i <= n; i++)
+        fx->taken[fx->ntaken++] = cip[i];
+      fx->push(n);
+      break;
+    }
+
+    case OP_PUSH_PRI:
+    case OP_PUSH_ALT:
+    case OP_PUSH_C:
+    case OP_PUSH:
+      fx->push(1);
+      break;
+
+    case OP_PUSH2_C:
+    case OP_PUSH2:
+      fx->push(2);
+      break;
+    case OP_PUSH3_C:
+    case OP_PUSH3:
+      fx->push(3);
+      break;
+    case OP_PUSH4_C:
+    case OP_PUSH4:
+      fx->push(4);
+      break;
+    case OP_PUSH5_C:
+    case OP_PUSH5:
+      fx->push(5);
+      break;
+
+    case OP_POP_PRI:
+    case OP_POP_ALT:
+      fx->adjust = 1;
+      break;
+
+    case OP_SWAP_PRI:
+    case OP_SWAP_ALT:
+      fx->overwrites = 1;
+      break;
+
+    case OP_STACK:
+      fx->adjust = cip[1] / cell_t(sizeof(cell_t));
+      break;
+
+    case OP_CALL:
+    {
+      // The verifier guarantees the argument count was pushed right before.
+      cell_t nparams = 0;
+      if (prev)
+        ExtractPushCount(prev, &nparams);
+      fx->clobber = Clobber::Calls;
+      fx->adjust = nparams + 1;
+      break;
+    }
+
+    case OP_SYSREQ_C:
+      fx->clobber = Clobber::Dead;
+      break;
+
+    case OP_SYSREQ_N:
+      fx->push(1);
+      fx->clobber = Clobber::Dead;
+      fx->adjust += cip[2] + 1;
+      break;
+
+    case OP_GENARRAY:
+    case OP_GENARRAY_Z:
+      fx->overwrites = cip[1];
+      fx->adjust = cip[1] - 1;
+      break;
+
+    case OP_BREAK:
+      if (debug_break)
+        fx->clobber = Clobber::All;
+      break;
+
+    default:
+      break;
+  }
+}
+
+FrameAliasing::FrameAliasing()
+ : lowest_taken_local_(0),
+   lowest_taken_arg_(INT_MAX)
+{
+}
+
+void
+FrameAliasing::scan(const FrameEffects& fx)
+{
+  for (size_t i = 0; i < fx.ntaken; i++) {
+    cell_t offset = fx.taken[i];
+    if (offset < 0)
+      lowest_taken_local_ = std::min(lowest_taken_local_, offset);
+    else
+      lowest_taken_arg_ = std::min(lowest_taken_arg_, offset);
+  }
+}
+
+bool
+FrameAliasing::isTrackable(cell_t offset) const
+{
+  if (offset < 0)
+    return offset < lowest_taken_local_;
+  return offset >= kFirstArgOffset && offset < lowest_taken_arg_;
+}
+
+FrameElementAccesses::FrameElementAccesses(ControlFlowGraph* graph)
+ : graph_(graph)
+{
+}
+
+void
+FrameElementAccesses::analyze()
+{
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++)
+    scanBlock(*iter);
+  candidates_.clear();
+
+  std::sort(contained_.begin(), contained_.end());
+  std::sort(elements_.begin(), elements_.end(),
+            [](const Element& a, const Element& b) -> bool {
+              return a.cip < b.cip;
+            });
+}
+
+// Addresses are only followed within a block: one still in PRI or ALT at the
+// end of the block escapes, as does one used by anything but the handful of
+// instructions below. Whatever else an instruction does to PRI or ALT, it
+// must not read an address it doesn't know about.
+void
+FrameElementAccesses::scanBlock(Block* block)
+{
+  candidates_.clear();
+
+  const Tracked kNone = { -1, 0, 0 };
+  Tracked pri = kNone;
+  Tracked alt = kNone;
+  ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+    switch (*cip) {
+      case OP_ADDR_PRI:
+      case OP_ADDR_ALT:
+      {
+        Tracked* reg = (*cip == OP_ADDR_PRI) ? &pri : &alt;
+        *reg = kNone;
+
+        // Only locals; an argument's slot holds a reference to an array
+        // somewhere else.
+        cell_t offset = cip[1];
+        if (offset >= 0 || offset % cell_t(sizeof(cell_t)) != 0)
+          break;
+        Candidate candidate = { cip, false, {} };
+        candidates_.push_back(candidate);
+        reg->candidate = int(candidates_.size() - 1);
+        reg->base = offset;
+        reg->offset = offset;
+        break;
+      }
+
+      case OP_ADD_C:
+        if (pri.candidate >= 0)
+          pri.offset += cip[1];
+        break;
+
+      case OP_MOVE_PRI:
+        pri = alt;
+        break;
+      case OP_MOVE_ALT:
+        alt = pri;
+        break;
+      case OP_XCHG:
+        std::swap(pri, alt);
+        break;
+
+      case OP_LOAD_I:
+        use(&pri, cip, sizeof(cell_t));
+        pri = kNone;
+        break;
+      case OP_STOR_I:
+        escape(&pri);
+        use(&alt, cip, sizeof(cell_t));
+        break;
+      case OP_FILL:
+        escape(&pri);
+        if (cip[1] > 0 && cip[1] <= kMaxElementFill && cip[1] % cell_t(sizeof(cell_t)) == 0)
+          use(&alt, cip, cip[1]);
+        else
+          escape(&alt);
+        break;
+
+      // These overwrite a register without reading either.
+      case OP_LOAD_PRI:
+      case OP_LOAD_S_PRI:
+      case OP_LREF_S_PRI:
+      case OP_CONST_PRI:
+      case OP_ZERO_PRI:
+        pri = kNone;
+        break;
+      case OP_LOAD_ALT:
+      case OP_LOAD_S_ALT:
+      case OP_LREF_S_ALT:
+      case OP_CONST_ALT:
+      case OP_ZERO_ALT:
+        alt = kNone;
+        break;
+      case OP_LOAD_S_BOTH:
+        pri = kNone;
+        alt = kNone;
+        break;
+
+      // These read PRI but not ALT.
+      case OP_SMUL_C:
+      case OP_SHL_C_PRI:
+      case OP_NEG:
+      case OP_INVERT:
+      case OP_NOT:
+      case OP_INC_PRI:
+      case OP_DEC_PRI:
+      case OP_EQ_C_PRI:
+      case OP_STOR_PRI:
+      case OP_STOR_S_PRI:
+      case OP_PUSH_PRI:
+        escape(&pri);
+        break;
+
+      // These read ALT but not PRI.
+      case OP_STOR_ALT:
+      case OP_STOR_S_ALT:
+      case OP_PUSH_ALT:
+        escape(&alt);
+        break;
+
+      // These use neither register, and only ever grow the stack, so an
+      // address taken before them is still valid after.
+      case OP_NOP:
+      case OP_BREAK:
+      case OP_PUSH_C:
+      case OP_PUSH2_C:
+      case OP_PUSH3_C:
+      case OP_PUSH4_C:
+      case OP_PUSH5_C:
+      case OP_PUSH_S:
+      case OP_PUSH2_S:
+      case OP_PUSH3_S:
+      case OP_PUSH4_S:
+      case OP_PUSH5_S:
+      case OP_ZERO_S:
+      case OP_CONST_S:
+      case OP_INC_S:
+      case OP_DEC_S:
+        break;
+
+      default:
+        escape(&pri);
+        escape(&alt);
+        break;
+    }
+  });
+  escape(&pri);
+  escape(&alt);
+
+  for (const auto& candidate : candidates_) {
+    if (candidate.escaped)
+      continue;
+    contained_.push_back(candidate.addr);
+    elements_.insert(elements_.end(), candidate.elements.begin(), candidate.elements.end());
+  }
+}
+
+void
+FrameElementAccesses::use(Tracked* reg, const cell_t* cip, cell_t bytes)
+{
+  if (reg->candidate < 0)
+    return;
+
+  // Everything accessed must be a whole slot between the start of the array
+  // and the frame. The verifier checked the start is on the stack.
+  int64_t last = reg->offset + bytes - int64_t(sizeof(cell_t));
+  if (reg->offset < reg->base || last >= 0 || reg->offset % int64_t(sizeof(cell_t)) != 0) {
+    escape(reg);
+    return;
+  }
+
+  Element element = { cip, cell_t(reg->offset) };
+  candidates_[reg->candidate].elements.push_back(element);
+}
+
+void
+FrameElementAccesses::escape(Tracked* reg)
+{
+  if (reg->candidate >= 0)
+    candidates_[reg->candidate].escaped = true;
+  reg->candidate = -1;
+}
+
+bool
+FrameElementAccesses::isContained(const cell_t* cip) const
+{
+  return std::binary_search(contained_.begin(), contained_.end(), cip);
+}
+
+bool
+FrameElementAccesses::slotFor(const cell_t* cip, cell_t* offset) const
+{
+  auto iter = std::lower_bound(elements_.begin(), elements_.end(), cip,
+                               [](const Element& element, const cell_t* cip) -> bool {
+                                 return element.cip < cip;
+                               });
+  if (iter == elements_.end() || iter->cip != cip)
+    return false;
+  *offset = iter->offset;
+  return true;
+}
+
+} // namespace sp
@@ -0,0 +1,183 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#ifndef _include_sourcepawn_vm_frame_effects_h_
+#define _include_sourcepawn_vm_frame_effects_h_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_types.h>
+#include "control-flow.h"
+#include "opcodes.h"
+
+namespace sp {
+
+// Non-negative frame offsets below this are the saved frame and the argument
+// count.
+static const cell_t kFirstArgOffset = 12;
+
+enum class Clobber {
+  None,
+  Dead,   // Anything below the stack pointer may be overwritten.
+  Calls,  // As above, and registers not preserved across calls are lost.
+  All     // The debugger may have changed any slot.
+};
+
+struct SlotAccess {
+  cell_t offset;
+  bool reads;
+};
+
+// The effects of one instruction on the frame. They occur in the order:
+// slot accesses, pushes, in-place writes to the top of the stack, clobbers,
+// and finally the stack adjustment. Stack depths are in cells below the
+// frame, so the top of the stack at depth |d| is at offset -4*d.
+struct FrameEffects {
+  SlotAccess accesses[5];
+  size_t naccesses;
+  cell_t taken[5];
+  size_t ntaken;
+  int32_t pushes;
+  int32_t overwrites;
+  Clobber clobber;
+  int32_t adjust;
+
+  FrameEffects()
+   : naccesses(0),
+     ntaken(0),
+     pushes(0),
+     overwrites(0),
+     clobber(Clobber::None),
+     adjust(0)
+  {}
+
+  void access(cell_t offset, bool reads) {
+    assert(naccesses < sizeof(accesses) / sizeof(accesses[0]));
+    accesses[naccesses].offset = offset;
+    accesses[naccesses].reads = reads;
+    naccesses++;
+  }
+  void push(int32_t ncells) {
+    pushes += ncells;
+    adjust -= ncells;
+  }
+};
+
+class FrameElementAccesses;
+
+// Decode the frame effects of the instruction at |cip|. |prev| is the
+// previous instruction in the same block, if any. If |elements| is given,
+// the local array accesses it found are decoded as slot accesses.
+void DecodeFrameEffects(const cell_t* cip, const cell_t* prev, bool debug_break,
+                        FrameEffects* fx, const FrameElementAccesses* elements = nullptr);
+
+// Finds constant-index accesses to local arrays, like |vec[1]| for a local
+// |float vec[3]|. These compile to an ADDR of the array, maybe an ADD.C,
+// and a LOAD.I, STOR.I, or FILL through the address. When the address is
+// used for nothing else before the end of its block, those instructions
+// touch known frame slots, and the ADDR doesn't take the array's address.
+class FrameElementAccesses
+{
+ public:
+  explicit FrameElementAccesses(ControlFlowGraph* graph);
+
+  void analyze();
+
+  // Returns true if |cip| is an ADDR whose value is only used for element
+  // accesses.
+  bool isContained(const cell_t* cip) const;
+
+  // If |cip| is a LOAD.I, STOR.I, or FILL through a contained ADDR, returns
+  // true and sets |offset| to the (first) frame slot it accesses.
+  bool slotFor(const cell_t* cip, cell_t* offset) const;
+
+  size_t numElements() const {
+    return elements_.size();
+  }
+
+ private:
+  struct Element {
+    const cell_t* cip;
+    cell_t offset;
+  };
+  struct Candidate {
+    const cell_t* addr;
+    bool escaped;
+    std::vector<Element> elements;
+  };
+  // What PRI or ALT holds: if |candidate| is not -1, the address of the frame
+  // slot at |offset|, derived from the ADDR of |base|.
+  struct Tracked {
+    int candidate;
+    cell_t base;
+    int64_t offset;
+  };
+
+  void scanBlock(Block* block);
+  void use(Tracked* reg, const cell_t* cip, cell_t bytes);
+  void escape(Tracked* reg);
+
+ private:
+  ControlFlowGraph* graph_;
+
+  // The ADDRs in the block being scanned.
+  std::vector<Candidate> candidates_;
+
+  // Both sorted by cip.
+  std::vector<const cell_t*> contained_;
+  std::vector<Element> elements_;
+};
+
+// Tracks which frame slots are safe to reason about: slots whose address is
+// never taken, and that are not inside or above an address-taken array.
+class FrameAliasing
+{
+ public:
+  FrameAliasing();
+
+  void scan(const FrameEffects& fx);
+
+  bool isTrackable(cell_t offset) const;
+
+ private:
+  // Arrays grow upward from their base, so nothing at or above these is
+  // trackable.
+  cell_t lowest_taken_local_;
+  cell_t lowest_taken_arg_;
+};
+
+template <typename Func>
+static inline void
+ForEachInstruction(Block* block, Func func)
+{
+  const uint8_t* cip = block->start();
+  const uint8_t* stop = block->end();
+  if (block->endType() == BlockEnd::Insn)
+    stop = NextInstruction(stop);
+
+  const cell_t* prev = nullptr;
+  while (cip < stop) {
+    const cell_t* insn = reinterpret_cast<const cell_t*>(cip);
+    func(insn, prev);
+    prev = insn;
+    cip = NextInstruction(cip);
+  }
+}
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_frame_effects_h_
@@ -0,0 +1,463 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#include "frame-slot-allocator.h"
+#include "plugin-runtime.h"
+#include <smx/smx-v1-opcodes.h>
+#include "frame-effects.h"
+#include "opcodes.h"
+
+#include <limits.h>
+
+#include <algorithm>
+
+namespace sp {
+
+// Loop nesting past this depth does not increase a use's weight.
+static const uint32_t kMaxLoopWeightDepth = 4;
+
+// A register state of 0 means the register holds no slot, since offset 0 is
+// never cached.
+static const cell_t kNoSlot = 0;
+
+namespace {
+
+struct SlotBlockData : public IBlockData
+{
+  SlotBlockData()
+   : entry_depth(-1),
+     first_pos(0),
+     end_pos(0),
+     has_exit_state(false)
+  {}
+
+  // Static stack depth in cells, relative to the frame, on entry.
+  int32_t entry_depth;
+  // Instruction numbers covered by this block, [first_pos, end_pos).
+  uint32_t first_pos;
+  uint32_t end_pos;
+  // Indexes into the loop list, for each loop containing this block.
+  std::vector<size_t> loops;
+  // The slot each register holds on exit, if computed.
+  std::vector<cell_t> exit_state;
+  bool has_exit_state;
+};
+
+} // namespace
+
+int
+FrameSlotAllocation::registerFor(cell_t offset) const
+{
+  auto iter = std::lower_bound(slots_.begin(), slots_.end(), offset,
+    [](const CachedSlot& slot, cell_t offset) -> bool {
+      return slot.offset < offset;
+    });
+  if (iter == slots_.end() || iter->offset != offset)
+    return -1;
+  return iter->reg;
+}
+
+bool
+FrameSlotAllocation::needsReload(const cell_t* cip, cell_t offset) const
+{
+  Reload key = { cip, offset };
+  return std::binary_search(reloads_.begin(), reloads_.end(), key,
+    [](const Reload& a, const Reload& b) -> bool {
+      if (a.cip != b.cip)
+        return a.cip < b.cip;
+      return a.offset < b.offset;
+    });
+}
+
+cell_t
+FrameSlotAllocation::slotAtLoopHeader(const uint8_t* header, size_t reg) const
+{
+  for (const auto& state : headers_) {
+    if (state.header == header)
+      return state.slots[reg];
+  }
+  return kNoSlot;
+}
+
+FrameSlotAllocator::FrameSlotAllocator(PluginRuntime* rt, ControlFlowGraph* graph,
+                                       size_t num_registers, bool debug_break,
+                                       const FrameElementAccesses* elements)
+ : rt_(rt),
+   graph_(graph),
+   num_registers_(num_registers),
+   debug_break_(debug_break),
+   elements_(elements)
+{
+}
+
+std::unique_ptr<FrameSlotAllocation>
+FrameSlotAllocator::allocate()
+{
+  bool has_loops = false;
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    if (iter->isLoopHeader()) {
+      has_loops = true;
+      break;
+    }
+  }
+  if (!has_loops || !num_registers_)
+    return nullptr;
+
+  AutoClearBlockData<SlotBlockData> clear(graph_);
+
+  if (!scanBlocks())
+    return nullptr;
+
+  findLoops();
+  collectCandidates();
+  if (candidates_.empty())
+    return nullptr;
+
+  linearScan();
+  if (result_->slots_.empty())
+    return nullptr;
+
+  computeReloads();
+  return std::move(result_);
+}
+
+// Number each instruction, compute the static stack depth at the start of
+// each block, and find every address-taken slot.
+bool
+FrameSlotAllocator::scanBlocks()
+{
+  uint32_t pos = 0;
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* block = *iter;
+    SlotBlockData* data = block->data<SlotBlockData>();
+    if (block == graph_->entry())
+      data->entry_depth = 0;
+
+    // In reverse postorder, a block in a reducible graph is always preceded
+    // by at least one of its forward predecessors.
+    if (data->entry_depth < 0)
+      return false;
+
+    int32_t depth = data->entry_depth;
+    data->first_pos = pos;
+    ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+      FrameEffects fx;
+      DecodeFrameEffects(cip, prev, debug_break_, &fx, elements_);
+      aliasing_.scan(fx);
+      depth -= fx.adjust;
+      pos++;
+    });
+    data->end_pos = pos;
+
+    for (const auto& succ : block->successors()) {
+      SlotBlockData* succ_data = succ->data<SlotBlockData>();
+      if (succ_data->entry_depth < 0)
+        succ_data->entry_depth = depth;
+    }
+  }
+  return true;
+}
+
+// Find natural loops. Each header's body is every block that reaches one of
+// its back edges without passing through the header.
+void
+FrameSlotAllocator::findLoops()
+{
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* header = *iter;
+    if (!header->isLoopHeader())
+      continue;
+
+    graph_->newEpoch();
+    header->setVisited();
+
+    std::vector<Block*> body = { header };
+    std::vector<Block*> worklist;
+    for (const auto& pred : header->predecessors()) {
+      if (header->dominates(pred) && !pred->visited()) {
+        pred->setVisited();
+        worklist.push_back(pred);
+      }
+    }
+    while (!worklist.empty()) {
+      Block* block = worklist.back();
+      worklist.pop_back();
+      body.push_back(block);
+
+      for (const auto& pred : block->predecessors()) {
+        if (!pred->visited()) {
+          pred->setVisited();
+          worklist.push_back(pred);
+        }
+      }
+    }
+
+    size_t index = loops_.size();
+    Loop loop = { UINT_MAX, 0 };
+    for (Block* block : body) {
+      SlotBlockData* data = block->data<SlotBlockData>();
+      data->loops.push_back(index);
+      loop.start = std::min(loop.start, data->first_pos);
+      loop.end = std::max(loop.end, data->end_pos);
+    }
+    loops_.push_back(loop);
+  }
+}
+
+bool
+FrameSlotAllocator::isCacheable(cell_t offset) const
+{
+  return aliasing_.isTrackable(offset);
+}
+
+FrameSlotAllocator::Candidate*
+FrameSlotAllocator::findCandidate(cell_t offset)
+{
+  for (auto& candidate : candidates_) {
+    if (candidate.offset == offset)
+      return &candidate;
+  }
+  return nullptr;
+}
+
+void
+FrameSlotAllocator::collectCandidates()
+{
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* block = *iter;
+    SlotBlockData* data = block->data<SlotBlockData>();
+
+    uint32_t nesting = std::min(uint32_t(data->loops.size()), kMaxLoopWeightDepth);
+    uint64_t weight = uint64_t(1) << (3 * nesting);
+
+    uint32_t pos = data->first_pos;
+    ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+      FrameEffects fx;
+      DecodeFrameEffects(cip, prev, debug_break_, &fx, elements_);
+      for (size_t i = 0; i < fx.naccesses; i++) {
+        cell_t offset = fx.accesses[i].offset;
+        if (!isCacheable(offset))
+          continue;
+
+        Candidate* candidate = findCandidate(offset);
+        if (!candidate) {
+          Candidate entry = { offset, pos, pos, 0, false, -1 };
+          candidates_.push_back(entry);
+          candidate = &candidates_.back();
+        }
+        candidate->start = std::min(candidate->start, pos);
+        candidate->end = std::max(candidate->end, pos);
+        candidate->weight += weight;
+
+        // A value used in a loop is live around the whole loop.
+        for (size_t index : data->loops) {
+          candidate->start = std::min(candidate->start, loops_[index].start);
+          candidate->end = std::max(candidate->end, loops_[index].end);
+          candidate->in_loop = true;
+        }
+      }
+      pos++;
+    });
+  }
+
+  candidates_.erase(
+    std::remove_if(candidates_.begin(), candidates_.end(),
+                   [](const Candidate& c) -> bool {
+                     return !c.in_loop;
+                   }),
+    candidates_.end());
+}
+
+void
+FrameSlotAllocator::linearScan()
+{
+  std::sort(candidates_.begin(), candidates_.end(),
+            [](const Candidate& a, const Candidate& b) -> bool {
+              return a.start < b.start;
+            });
+
+  std::vector<Candidate*> active;
+  std::vector<int> free_regs;
+  for (size_t i = num_registers_; i > 0; i--)
+    free_regs.push_back(int(i - 1));
+
+  for (auto& current : candidates_) {
+    // Expire anything that ended before this interval.
+    for (size_t i = 0; i < active.size();) {
+      if (active[i]->end < current.start) {
+        free_regs.push_back(active[i]->reg);
+        active[i] = active.back();
+        active.pop_back();
+      } else {
+        i++;
+      }
+    }
+
+    if (!free_regs.empty()) {
+      current.reg = free_regs.back();
+      free_regs.pop_back();
+      active.push_back(&current);
+      continue;
+    }
+
+    // Spill whichever interval is least valuable. Intervals are never split,
+    // so a spilled slot stays in memory for the whole method.
+    Candidate** victim = &active[0];
+    for (auto& other : active) {
+      if (other->weight < (*victim)->weight)
+        victim = &other;
+    }
+    if ((*victim)->weight >= current.weight)
+      continue;
+
+    current.reg = (*victim)->reg;
+    (*victim)->reg = -1;
+    *victim = &current;
+  }
+
+  result_ = std::make_unique<FrameSlotAllocation>();
+  for (const auto& candidate : candidates_) {
+    if (candidate.reg < 0)
+      continue;
+    FrameSlotAllocation::CachedSlot slot = { candidate.offset, candidate.reg };
+    result_->slots_.push_back(slot);
+  }
+  std::sort(result_->slots_.begin(), result_->slots_.end(),
+            [](const FrameSlotAllocation::CachedSlot& a,
+               const FrameSlotAllocation::CachedSlot& b) -> bool {
+              return a.offset < b.offset;
+            });
+}
+
+// Compute which slot each register validly holds at each instruction, and
+// note every read that must reload its register. A register's state is
+// merged pessimistically across predecessors until nothing changes.
+void
+FrameSlotAllocator::computeReloads()
+{
+  FrameSlotAllocation* result = result_.get();
+
+  auto kill = [result](std::vector<cell_t>& state, cell_t offset) -> void {
+    int reg = result->registerFor(offset);
+    if (reg >= 0 && state[reg] == offset)
+      state[reg] = kNoSlot;
+  };
+
+  auto transfer = [&](std::vector<cell_t>& state, int32_t& depth,
+                      const cell_t* cip, const cell_t* prev, bool record) -> void
+  {
+    FrameEffects fx;
+    DecodeFrameEffects(cip, prev, debug_break_, &fx, elements_);
+
+    for (size_t i = 0; i < fx.naccesses; i++) {
+      const SlotAccess& access = fx.accesses[i];
+      int reg = result->registerFor(access.offset);
+      if (reg < 0)
+        continue;
+      if (record && access.reads && state[reg] != access.offset) {
+        FrameSlotAllocation::Reload reload = { cip, access.offset };
+        result->reloads_.push_back(reload);
+      }
+      state[reg] = access.offset;
+    }
+
+    for (int32_t i = 1; i <= fx.pushes; i++)
+      kill(state, -cell_t(sizeof(cell_t)) * (depth + i));
+    depth += fx.pushes;
+
+    for (int32_t i = 0; i < fx.overwrites; i++)
+      kill(state, -cell_t(sizeof(cell_t)) * (depth - i));
+
+    if (fx.clobber == Clobber::Calls || fx.clobber == Clobber::All) {
+      std::fill(state.begin(), state.end(), kNoSlot);
+    } else if (fx.clobber == Clobber::Dead) {
+      cell_t top = -cell_t(sizeof(cell_t)) * depth;
+      for (auto& slot : state) {
+        if (slot < top)
+          slot = kNoSlot;
+      }
+    }
+
+    depth -= fx.adjust + fx.pushes;
+  };
+
+  auto entry_state = [this](Block* block, std::vector<cell_t>* state) -> void {
+    state->assign(num_registers_, kNoSlot);
+    if (block == graph_->entry())
+      return;
+
+    bool first = true;
+    for (const auto& pred : block->predecessors()) {
+      SlotBlockData* pred_data = pred->data<SlotBlockData>();
+      if (!pred_data->has_exit_state)
+        continue;
+      if (first) {
+        *state = pred_data->exit_state;
+        first = false;
+        continue;
+      }
+      for (size_t i = 0; i < num_registers_; i++) {
+        if ((*state)[i] != pred_data->exit_state[i])
+          (*state)[i] = kNoSlot;
+      }
+    }
+  };
+
+  std::vector<cell_t> state;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+      Block* block = *iter;
+      SlotBlockData* data = block->data<SlotBlockData>();
+
+      entry_state(block, &state);
+      int32_t depth = data->entry_depth;
+      ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+        transfer(state, depth, cip, prev, false);
+      });
+
+      if (!data->has_exit_state || data->exit_state != state) {
+        data->exit_state = state;
+        data->has_exit_state = true;
+        changed = true;
+      }
+    }
+  }
+
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* block = *iter;
+    SlotBlockData* data = block->data<SlotBlockData>();
+
+    entry_state(block, &state);
+    if (block->isLoopHeader()) {
+      FrameSlotAllocation::HeaderState header = { block->start(), state };
+      result->headers_.push_back(header);
+    }
+
+    int32_t depth = data->entry_depth;
+    ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+      transfer(state, depth, cip, prev, true);
+    });
+  }
+
+  std::sort(result->reloads_.begin(), result->reloads_.end(),
+            [](const FrameSlotAllocation::Reload& a,
+               const FrameSlotAllocation::Reload& b) -> bool {
+              if (a.cip != b.cip)
+                return a.cip < b.cip;
+              return a.offset < b.offset;
+            });
+}
+
+} // namespace sp
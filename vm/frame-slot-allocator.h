@@ -0,0 +1,132 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#ifndef _include_sourcepawn_vm_frame_slot_allocator_h_
+#define _include_sourcepawn_vm_frame_slot_allocator_h_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <sp_vm_types.h>
+#include "control-flow.h"
+#include "frame-effects.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// The set of frame slots a method keeps cached in registers. Stores always
+// write through to memory, so the frame stays valid for natives, the debugger,
+// and error reporting. A register only goes stale when its slot is written
+// behind the JIT's back (by a push, a call, or a native), so each read of a
+// cached slot records whether the register must be refreshed first.
+class FrameSlotAllocation
+{
+  friend class FrameSlotAllocator;
+
+ public:
+  // Returns the index of the register caching the slot at |offset|, or -1 if
+  // the slot lives only in memory.
+  int registerFor(cell_t offset) const;
+
+  // Returns true if the register caching |offset| must be reloaded from
+  // memory before the instruction at |cip| reads it.
+  bool needsReload(const cell_t* cip, cell_t offset) const;
+
+  // Returns the offset of the slot register |reg| holds on entry to the loop
+  // header starting at |header|, or 0 if it holds none.
+  cell_t slotAtLoopHeader(const uint8_t* header, size_t reg) const;
+
+  size_t numCachedSlots() const {
+    return slots_.size();
+  }
+
+ private:
+  struct CachedSlot {
+    cell_t offset;
+    int reg;
+  };
+  struct Reload {
+    const cell_t* cip;
+    cell_t offset;
+  };
+  struct HeaderState {
+    const uint8_t* header;
+    std::vector<cell_t> slots;
+  };
+
+  // Sorted by offset.
+  std::vector<CachedSlot> slots_;
+  // Sorted by cip, then offset.
+  std::vector<Reload> reloads_;
+  std::vector<HeaderState> headers_;
+};
+
+// Linear-scan allocation of frame slots to a small, fixed set of registers.
+// Instructions are numbered in reverse postorder, and each slot's live range
+// runs from its first to its last use, widened to cover any loop it is used
+// in. Only slots used inside a loop are considered, and when registers run
+// out, the slot with the lowest loop-weighted use count is left in memory.
+class FrameSlotAllocator
+{
+ public:
+  FrameSlotAllocator(PluginRuntime* rt, ControlFlowGraph* graph, size_t num_registers,
+                     bool debug_break, const FrameElementAccesses* elements);
+
+  // Returns null if the method has no loops or nothing is worth caching, in
+  // which case every frame access should be emitted as a memory operand.
+  std::unique_ptr<FrameSlotAllocation> allocate();
+
+ private:
+  struct Loop {
+    uint32_t start;
+    uint32_t end;
+  };
+  struct Candidate {
+    cell_t offset;
+    uint32_t start;
+    uint32_t end;
+    uint64_t weight;
+    bool in_loop;
+    int reg;
+  };
+
+  bool scanBlocks();
+  void findLoops();
+  void collectCandidates();
+  void linearScan();
+  void computeReloads();
+
+  Candidate* findCandidate(cell_t offset);
+  bool isCacheable(cell_t offset) const;
+
+ private:
+  PluginRuntime* rt_;
+  ControlFlowGraph* graph_;
+  size_t num_registers_;
+  bool debug_break_;
+  const FrameElementAccesses* elements_;
+
+  std::vector<Loop> loops_;
+  std::vector<Candidate> candidates_;
+
+  FrameAliasing aliasing_;
+
+  std::unique_ptr<FrameSlotAllocation> result_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_frame_slot_allocator_h_
@@ -0,0 +1,134 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "heap-checks.h"
+#include "frame-effects.h"
+#include <smx/smx-v1-opcodes.h>
+#include "opcodes.h"
+
+#include <algorithm>
+
+using namespace sp;
+
+HeapCheckAnalysis::HeapCheckAnalysis(ControlFlowGraph* graph, bool debug_break)
+ : graph_(graph),
+   debug_break_(debug_break)
+{
+}
+
+bool
+HeapCheckAnalysis::leadsRun(const cell_t* cip, cell_t* reserve, cell_t* peak) const
+{
+  Lead key = { cip, 0, 0 };
+  auto iter = std::lower_bound(leads_.begin(), leads_.end(), key);
+  if (iter == leads_.end() || iter->cip != cip)
+    return false;
+  *reserve = iter->reserve;
+  *peak = iter->peak;
+  return true;
+}
+
+bool
+HeapCheckAnalysis::isCovered(const cell_t* cip) const
+{
+  return std::binary_search(covered_.begin(), covered_.end(), cip);
+}
+
+// Returns whether |cip| ends a run. The verifier keeps calls balanced on the
+// heap, but a callee's heap use still can't count against this frame's
+// check, so anything that calls out ends the run too.
+static bool
+EndsRun(const cell_t* cip, const FrameEffects& fx)
+{
+  switch (*cip) {
+    case OP_TRACKER_PUSH_C:
+    case OP_TRACKER_POP_SETHEAP:
+    case OP_GENARRAY:
+    case OP_GENARRAY_Z:
+    case OP_HALT:
+      return true;
+    default:
+      return fx.clobber != Clobber::None;
+  }
+}
+
+void
+HeapCheckAnalysis::scanBlock(Block* block)
+{
+  // The run being built: its first HEAP, how far the heap and the stack have
+  // moved since, and the HEAPs after the first.
+  const cell_t* first = nullptr;
+  cell_t heap = 0;
+  cell_t stack = 0;
+  cell_t reserve = 0;
+  cell_t peak = 0;
+  std::vector<const cell_t*> rest;
+
+  auto finish = [&]() -> void {
+    if (first && !rest.empty()) {
+      Lead lead = { first, reserve, peak };
+      leads_.push_back(lead);
+      covered_.insert(covered_.end(), rest.begin(), rest.end());
+    }
+    first = nullptr;
+    rest.clear();
+  };
+
+  ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+    if (*cip == OP_HEAP) {
+      cell_t amount = cip[1];
+      if (amount > 0) {
+        if (!first) {
+          first = cip;
+          heap = stack = reserve = peak = 0;
+        } else {
+          rest.push_back(cip);
+        }
+      }
+      if (first) {
+        heap += amount;
+        peak = std::max(peak, heap);
+        if (amount > 0)
+          reserve = std::max(reserve, heap + stack);
+      }
+      return;
+    }
+    if (!first)
+      return;
+
+    FrameEffects fx;
+    DecodeFrameEffects(cip, prev, debug_break_, &fx);
+    if (EndsRun(cip, fx)) {
+      finish();
+      return;
+    }
+    stack -= fx.adjust * cell_t(sizeof(cell_t));
+
+    // Amounts are small, but keep a long run from wrapping.
+    if (heap > 0xfffff || stack > 0xfffff || stack < -0xfffff)
+      finish();
+  });
+  finish();
+}
+
+void
+HeapCheckAnalysis::analyze()
+{
+  if (debug_break_)
+    return;
+
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++)
+    scanBlock(*iter);
+
+  std::sort(leads_.begin(), leads_.end());
+  std::sort(covered_.begin(), covered_.end());
+}
@@ -0,0 +1,75 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#ifndef _include_sourcepawn_vm_heap_checks_h_
+#define _include_sourcepawn_vm_heap_checks_h_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_types.h>
+#include "control-flow.h"
+
+namespace sp {
+
+// Finds runs of HEAP allocations within a block whose overflow checks can be
+// done at once, by the first allocation of the run. A run ends at anything
+// that moves the heap other than HEAP itself, or that calls out, so between
+// its allocations only pushes and pops can change how close the heap is to
+// the stack. The first allocation checks for the most room the run will
+// need at any of its allocations, and the rest don't check at all.
+//
+// The heap is still moved by each HEAP. If the combined check fails, the
+// error is reported at the first allocation instead of the one that ran out.
+class HeapCheckAnalysis
+{
+ public:
+  HeapCheckAnalysis(ControlFlowGraph* graph, bool debug_break);
+
+  void analyze();
+
+  // If the HEAP at |cip| checks for a run, returns true and sets |reserve|
+  // to the bytes of room above the heap pointer (before this HEAP) it must
+  // check for, not counting the stack margin, and |peak| to how far above
+  // it the heap pointer gets.
+  bool leadsRun(const cell_t* cip, cell_t* reserve, cell_t* peak) const;
+
+  // Returns whether the HEAP at |cip| was checked by the start of its run.
+  bool isCovered(const cell_t* cip) const;
+
+ private:
+  struct Lead {
+    const cell_t* cip;
+    cell_t reserve;
+    cell_t peak;
+
+    bool operator <(const Lead& other) const {
+      return cip < other.cip;
+    }
+  };
+
+  void scanBlock(Block* block);
+
+ private:
+  ControlFlowGraph* graph_;
+  bool debug_break_;
+
+  // Both are sorted by cip.
+  std::vector<Lead> leads_;
+  std::vector<const cell_t*> covered_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_heap_checks_h_
@@ -0,0 +1,163 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "image-cache.h"
+#include "smx-v1-image.h"
+
+using namespace sp;
+
+SharedImage::SharedImage(std::unique_ptr<SmxV1Image> image, const uint8_t* key)
+ : image_(std::move(image)),
+   cacheable_(!!key),
+   fully_verified_(false),
+   users_(0),
+   idle_since_(0)
+{
+  if (key)
+    memcpy(key_, key, sizeof(key_));
+  else
+    memset(key_, 0, sizeof(key_));
+  verified_.init(16);
+}
+
+SharedImage::~SharedImage()
+{
+}
+
+bool
+SharedImage::LookupVerified(uint32_t pcode_offset, int* error, int32_t* max_stack)
+{
+  std::lock_guard<ke::Mutex> lock(verified_lock_);
+  VerifiedMap::Result r = verified_.find(pcode_offset);
+  if (!r.found())
+    return false;
+  *error = r->value.error;
+  *max_stack = r->value.max_stack;
+  return true;
+}
+
+void
+SharedImage::AddVerified(uint32_t pcode_offset, int error, int32_t max_stack)
+{
+  std::lock_guard<ke::Mutex> lock(verified_lock_);
+  VerifiedMap::Insert i = verified_.findForAdd(pcode_offset);
+  if (i.found())
+    return;
+  verified_.add(i, pcode_offset, Verified{error, max_stack});
+}
+
+std::vector<SharedImage::VerifiedMethod>
+SharedImage::GetVerified()
+{
+  std::lock_guard<ke::Mutex> lock(verified_lock_);
+
+  std::vector<VerifiedMethod> methods;
+  methods.reserve(verified_.elements());
+  for (VerifiedMap::iterator iter = verified_.iter(); !iter.empty(); iter.next())
+    methods.push_back(VerifiedMethod{iter->key, iter->value.error, iter->value.max_stack});
+  return methods;
+}
+
+ImageCache::ImageCache()
+ : clock_(0)
+{
+}
+
+ImageCache::~ImageCache()
+{
+}
+
+void
+ImageCache::ComputeKey(const SmxV1Image* image, uint32_t flags,
+                       uint8_t key[FastHash::kDigestSize])
+{
+  FastHash hash;
+  hash.update(image->buffer(), image->length());
+  hash.update(&flags, sizeof(flags));
+  hash.finalize(key);
+}
+
+SharedImage*
+ImageCache::FindLocked(const uint8_t key[FastHash::kDigestSize])
+{
+  for (const auto& image : images_) {
+    if (memcmp(image->key_, key, sizeof(image->key_)) == 0)
+      return image.get();
+  }
+  return nullptr;
+}
+
+ke::RefPtr<SharedImage>
+ImageCache::Find(const uint8_t key[FastHash::kDigestSize])
+{
+  std::lock_guard<ke::Mutex> lock(lock_);
+  return FindLocked(key);
+}
+
+ke::RefPtr<SharedImage>
+ImageCache::Insert(const ke::RefPtr<SharedImage>& image)
+{
+  assert(image->cacheable_);
+
+  std::lock_guard<ke::Mutex> lock(lock_);
+  if (SharedImage* existing = FindLocked(image->key_))
+    return existing;
+
+  // Nothing uses the image yet, so it starts out idle.
+  image->idle_since_ = ++clock_;
+  images_.push_back(image);
+  TrimLocked();
+  return image;
+}
+
+void
+ImageCache::Acquire(SharedImage* image)
+{
+  std::lock_guard<ke::Mutex> lock(lock_);
+  image->users_++;
+}
+
+void
+ImageCache::Release(SharedImage* image)
+{
+  std::lock_guard<ke::Mutex> lock(lock_);
+  assert(image->users_);
+  if (--image->users_)
+    return;
+  image->idle_since_ = ++clock_;
+  TrimLocked();
+}
+
+void
+ImageCache::TrimLocked()
+{
+  for (;;) {
+    size_t idle = 0;
+    auto oldest = images_.end();
+    for (auto iter = images_.begin(); iter != images_.end(); iter++) {
+      if ((*iter)->users_)
+        continue;
+      idle++;
+      if (oldest == images_.end() || (*iter)->idle_since_ < (*oldest)->idle_since_)
+        oldest = iter;
+    }
+    if (idle <= kMaxIdleImages)
+      return;
+    images_.erase(oldest);
+  }
+}
@@ -0,0 +1,135 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_image_cache_h_
+#define _include_sourcepawn_vm_image_cache_h_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <amtl/am-hashmap.h>
+#include <amtl/am-refcounting.h>
+#include <amtl/am-mutex.h>
+#include "fast-hash.h"
+
+namespace sp {
+
+class SmxV1Image;
+
+// A validated image, shared read-only by every runtime loaded from the same
+// bytes. Method verification only depends on the image, so its results are
+// kept here too, and a reloaded plugin skips re-verifying methods that an
+// earlier instance already checked.
+class SharedImage final : public ke::RefcountedThreadsafe<SharedImage>
+{
+  friend class ImageCache;
+
+ public:
+  // A null |key| means the image is never cached.
+  SharedImage(std::unique_ptr<SmxV1Image> image, const uint8_t* key);
+  ~SharedImage();
+
+  SmxV1Image* image() const {
+    return image_.get();
+  }
+
+  bool LookupVerified(uint32_t pcode_offset, int* error, int32_t* max_stack);
+  void AddVerified(uint32_t pcode_offset, int error, int32_t max_stack);
+
+  struct VerifiedMethod {
+    uint32_t pcode_offset;
+    int32_t error;
+    int32_t max_stack;
+  };
+  std::vector<VerifiedMethod> GetVerified();
+
+  // Set once every method reachable from a public has been verified (or the
+  // results were loaded from the code cache).
+  bool fully_verified() const {
+    return fully_verified_.load(std::memory_order_acquire);
+  }
+  void setFullyVerified() {
+    fully_verified_.store(true, std::memory_order_release);
+  }
+
+ private:
+  struct Verified {
+    int error;
+    int32_t max_stack;
+  };
+  struct VerifiedPolicy {
+    static inline uint32_t hash(uint32_t value) {
+      return ke::HashInteger<4>(value);
+    }
+    static inline bool matches(uint32_t a, uint32_t b) {
+      return a == b;
+    }
+  };
+  typedef ke::HashMap<uint32_t, Verified, VerifiedPolicy> VerifiedMap;
+
+  std::unique_ptr<SmxV1Image> image_;
+  bool cacheable_;
+  uint8_t key_[FastHash::kDigestSize];
+
+  // Methods may be verified on the precompiler's thread.
+  ke::Mutex verified_lock_;
+  VerifiedMap verified_;
+  std::atomic<bool> fully_verified_;
+
+  // Guarded by the cache's lock.
+  uint32_t users_;
+  uint64_t idle_since_;
+};
+
+// Images of recently loaded plugins, keyed by a digest of their contents, so
+// that reloading an unchanged plugin skips parsing and validation. Images in
+// use are always kept; a bounded number of unused ones are kept for reloads,
+// oldest evicted first. Safe to use from any thread.
+class ImageCache
+{
+ public:
+  static const size_t kMaxIdleImages = 32;
+
+  ImageCache();
+  ~ImageCache();
+
+  // Computes the key for an image that has been read but not validated.
+  // |flags| are the SP_LOADFLAG_* flags that affect validation.
+  static void ComputeKey(const SmxV1Image* image, uint32_t flags,
+                         uint8_t key[FastHash::kDigestSize]);
+
+  ke::RefPtr<SharedImage> Find(const uint8_t key[FastHash::kDigestSize]);
+
+  // Adds |image|, unless an image with the same key was added first, in
+  // which case that one is returned instead.
+  ke::RefPtr<SharedImage> Insert(const ke::RefPtr<SharedImage>& image);
+
+  // Runtimes call these while they hold an image.
+  void Acquire(SharedImage* image);
+  void Release(SharedImage* image);
+
+ private:
+  SharedImage* FindLocked(const uint8_t key[FastHash::kDigestSize]);
+  void TrimLocked();
+
+ private:
+  ke::Mutex lock_;
+  std::vector<ke::RefPtr<SharedImage>> images_;
+  uint64_t clock_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_image_cache_h_
@@ -25,11 +25,19 @@
 #include "debugging.h"
 #include "environment.h"
 #include "method-info.h"
+#include "opcode-histogram.h"
 #include "plugin-context.h"
 #include "pcode-reader.h"
 #include "runtime-helpers.h"
+#include "threaded-code.h"
+#include "typed-natives.h"
 #include "watchdog_timer.h"
 #include <amtl/am-float.h>
+#if defined(SP_HAS_JIT)
+# include "code-stubs.h"
+# include "compiled-function.h"
+# include "jit.h"
+#endif
 
 namespace sp {
 
@@ -51,7 +59,9 @@ Interpreter::Interpreter(PluginContext* cx, RefPtr<MethodInfo> method)
    reader_(rt_, method->pcode_offset(), this),
    method_(method),
    has_returned_(false),
-   return_value_(0)
+   return_value_(0),
+   cip_(nullptr),
+   osr_entry_(nullptr)
 {
 }
 
@@ -60,40 +70,557 @@ Interpreter::run()
 {
   assert(reader_.peekOpcode() == OP_PROC);
 
-  InterpInvokeFrame ivk(cx_, method_, reader_.cip());
-  ke::SaveAndSet<InterpInvokeFrame*> enterIvk(&ivk_, &ivk);
+  if (env_->has_budgets() && !env_->spendBudget()) {
+    cx_->ReportErrorNumber(SP_ERROR_BUDGET);
+    return false;
+  }
+
+  OpcodeHistogram* counts =
+    env_->IsOpcodeCountingEnabled() ? method_->countExecutedOps() : nullptr;
+  ThreadedCode* code =
+    env_->IsPredecodeEnabled() && !counts ? method_->threadedCode() : nullptr;
 
-  reader_.begin();
+  {
+    // The frame tracks whichever position the chosen loop keeps current.
+    const cell_t* const& cip = code ? cip_ : reader_.cip();
+    InterpInvokeFrame ivk(cx_, method_, cip);
+    ke::SaveAndSet<InterpInvokeFrame*> enterIvk(&ivk_, &ivk);
 
+    reader_.begin();
+    cip_ = reader_.cip();
+
+    if (!enterFrame())
+      return false;
+
+    if (code) {
+      bool ok = runThreaded(code);
+
+      // An error leaves behind the calls it interrupted, which have to be
+      // unwound innermost first.
+      while (!calls_.empty())
+        calls_.pop_back();
+      if (!ok)
+        return false;
+    } else {
+      while (!has_returned_ && !osr_entry_ && reader_.more()) {
+        if (reader_.peekOpcode() == OP_PROC || reader_.peekOpcode() == OP_ENDPROC)
+          break;
+        if (counts)
+          counts->add(reader_.cip());
+        if (!reader_.visitNext())
+          return false;
+      }
+    }
+  }
+
+#if defined(SP_HAS_JIT)
+  // The interpreter's frame is gone, so the rest of this invocation only
+  // shows up as a JIT frame.
+  if (osr_entry_) {
+    has_returned_ = true;
+    return enterJit(method_, &return_value_);
+  }
+#endif
+  return true;
+}
+
+bool
+Interpreter::enterFrame()
+{
   if (!cx_->pushAmxFrame())
     return false;
 
-  while (!has_returned_ && reader_.more()) {
-    if (reader_.peekOpcode() == OP_PROC || reader_.peekOpcode() == OP_ENDPROC)
-      break;
-    if (!reader_.visitNext())
+  // Like the JIT prologue, check once that the deepest stack the verifier
+  // allows fits, so the threaded loop can push and pop without checking.
+  cell_t stack_low = cx_->sp() - method_->max_stack();
+  if (stack_low < cx_->hp() + STACK_MARGIN) {
+    cx_->ReportErrorNumber(SP_ERROR_STACKLOW);
+    return false;
+  }
+  cx_->noteStackUse(stack_low);
+  return true;
+}
+
+MethodInfo*
+Interpreter::callTarget(ThreadedCode* code, const ThreadedInsn* insn)
+{
+  if (insn->callee)
+    return insn->callee;
+
+  RefPtr<MethodInfo> target = rt_->AcquireMethod(insn->a);
+  if (!target) {
+    cx_->ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
+    return nullptr;
+  }
+
+  // The runtime keeps every method it hands out, so the call site can hold
+  // on to it without a reference.
+  code->setCallee(insn, target.get());
+  return target.get();
+}
+
+bool
+Interpreter::runThreaded(ThreadedCode* code)
+{
+  const ThreadedInsn* ip = code->start();
+
+  // Ops that only move the stack or touch the frame are done here, on local
+  // copies of sp and frm, the way compiled code does them. Visitors see
+  // cx_->sp(), so it is written back before each one and reloaded after.
+  uint8_t* const memory = cx_->memory();
+  cell_t frm = cx_->frm();
+  uint8_t* frame = memory + frm;
+  cell_t stack_low = cx_->sp() - method_->max_stack();
+  cell_t* sp = reinterpret_cast<cell_t*>(memory + cx_->sp());
+
+  // Scripted calls that stay in the interpreter are run by this loop too,
+  // each with its own entry on calls_. This is where the innermost one
+  // keeps its position.
+  const cell_t** cip = &cip_;
+
+#if defined(SP_THREADED_DISPATCH)
+  static const void* const handlers[] = {
+# define _O(name) &&op_##name,
+    THREADED_OPS(_O)
+# undef _O
+  };
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == size_t(ThreadedOp::Total),
+                "handler table must cover every op");
+  if (!code->linked())
+    code->link(handlers);
+
+# define CASE(name)  op_##name:
+# define DISPATCH()  do { *cip = ip->cip; goto *ip->handler; } while (0)
+#else
+# define CASE(name)  case ThreadedOp::name:
+# define DISPATCH()  goto dispatch
+#endif
+#define NEXT()       do { ip++; DISPATCH(); } while (0)
+#define SAVE_SP()    (*cx_->addressOfSp() = cell_t(reinterpret_cast<uint8_t*>(sp) - memory))
+#define LOAD_SP()    (sp = reinterpret_cast<cell_t*>(memory + cx_->sp()))
+#define LOAD_FRAME() do { frm = cx_->frm(); frame = memory + frm; LOAD_SP(); } while (0)
+#define STEP(expr)                                    \
+  do {                                                \
+    SAVE_SP();                                        \
+    if (!(expr))                                      \
+      return false;                                   \
+    LOAD_SP();                                        \
+    NEXT();                                           \
+  } while (0)
+#define LOCAL(stmt)  do { stmt; NEXT(); } while (0)
+#define FRAME(offs)  (*reinterpret_cast<cell_t*>(frame + (offs)))
+#define REG(value)   PawnReg(value)
+// Anything that grows the heap must leave room for the rest of the frame,
+// since pushes are no longer checked against it.
+#define STEP_HEAP(expr)                               \
+  do {                                                \
+    SAVE_SP();                                        \
+    if (!(expr))                                      \
+      return false;                                   \
+    if (cx_->hp() + STACK_MARGIN > stack_low) {       \
+      cx_->ReportErrorNumber(SP_ERROR_HEAPLOW);       \
+      return false;                                   \
+    }                                                 \
+    LOAD_SP();                                        \
+    NEXT();                                           \
+  } while (0)
+// Moves to the second half of a superinstruction.
+#define FUSED_NEXT() do { ip++; *cip = ip->cip; } while (0)
+#define JUMP_IF(cond)                                 \
+  do {                                                \
+    if (!(cond))                                      \
+      NEXT();                                         \
+    if (ip->target <= ip) {                           \
+      SAVE_SP();                                      \
+      if (!visitBackEdge(ip->a))                      \
+        return false;                                 \
+      if (osr_entry_) {                               \
+        if (calls_.empty())                           \
+          return true;                                \
+        goto call_osr;                                \
+      }                                               \
+    }                                                 \
+    ip = ip->target;                                  \
+    DISPATCH();                                       \
+  } while (0)
+
+  // Picks the caller back up when a call run by this loop is done.
+  auto leaveCall = [&]() -> void {
+    CallFrame& call = calls_.back();
+    method_ = std::move(call.caller);
+    ivk_ = call.caller_ivk;
+    code = call.caller_code;
+    ip = call.return_ip;
+    stack_low = call.caller_stack_low;
+    calls_.pop_back();
+    cip = calls_.empty() ? &cip_ : &calls_.back().cip;
+  };
+
+#if defined(SP_THREADED_DISPATCH)
+  DISPATCH();
+#else
+ dispatch:
+  *cip = ip->cip;
+  switch (ip->op) {
+#endif
+
+  CASE(BREAK)          STEP(visitBREAK());
+  CASE(LOAD)           STEP(visitLOAD(REG(ip->b), ip->a));
+  CASE(LOAD_S)         LOCAL(regs_[REG(ip->b)] = FRAME(ip->a));
+  CASE(LREF_S)         STEP(visitLREF_S(REG(ip->b), ip->a));
+  CASE(LOAD_I)         STEP(visitLOAD_I());
+  CASE(LODB_I)         STEP(visitLODB_I(ip->a));
+  CASE(CONST)          STEP(visitCONST(REG(ip->b), ip->a));
+  CASE(ADDR)           STEP(visitADDR(REG(ip->b), ip->a));
+  CASE(STOR)           STEP(visitSTOR(ip->a, REG(ip->b)));
+  CASE(STOR_S)         LOCAL(FRAME(ip->a) = regs_[REG(ip->b)]);
+  CASE(SREF_S)         STEP(visitSREF_S(ip->a, REG(ip->b)));
+  CASE(STOR_I)         STEP(visitSTOR_I());
+  CASE(STRB_I)         STEP(visitSTRB_I(ip->a));
+  CASE(LIDX)           STEP(visitLIDX());
+  CASE(IDXADDR)        STEP(visitIDXADDR());
+  CASE(MOVE)           STEP(visitMOVE(REG(ip->b)));
+  CASE(XCHG)           STEP(visitXCHG());
+  CASE(PUSH_REG)       LOCAL(*--sp = regs_[REG(ip->b)]);
+  CASE(PUSH_C)
+  {
+    for (cell_t i = 0; i < ip->a; i++)
+      *--sp = ip->ptr[i];
+    NEXT();
+  }
+  CASE(PUSH)           STEP(visitPUSH(ip->ptr, size_t(ip->a)));
+  CASE(PUSH_S)
+  {
+    for (cell_t i = 0; i < ip->a; i++)
+      *--sp = FRAME(ip->ptr[i]);
+    NEXT();
+  }
+  CASE(POP)            LOCAL(regs_[REG(ip->b)] = *sp++);
+  CASE(STACK)
+    LOCAL(sp = reinterpret_cast<cell_t*>(reinterpret_cast<uint8_t*>(sp) + ip->a));
+  CASE(HEAP)           STEP_HEAP(visitHEAP(ip->a));
+  CASE(CALL)
+  {
+    SAVE_SP();
+    MethodInfo* callee = callTarget(code, ip);
+    if (!callee)
+      return false;
+
+    bool interpret;
+    cell_t value = 0;
+    if (!env_->TryInvokeCompiled(cx_, callee, &value, &interpret))
       return false;
+
+    ThreadedCode* callee_code = nullptr;
+    if (interpret && env_->IsPredecodeEnabled() && !env_->IsOpcodeCountingEnabled())
+      callee_code = callee->threadedCode();
+    if (!callee_code) {
+      if (interpret && !Interpreter::Run(cx_, callee, &value))
+        return false;
+      regs_.pri() = value;
+      LOAD_SP();
+      NEXT();
+    }
+
+    if (env_->has_budgets() && !env_->spendBudget()) {
+      cx_->ReportErrorNumber(SP_ERROR_BUDGET);
+      return false;
+    }
+
+    calls_.emplace_back(cx_, callee, rt_->code().bytes + callee->pcode_offset());
+    CallFrame& call = calls_.back();
+    call.caller = std::move(method_);
+    call.caller_ivk = ivk_;
+    call.caller_code = code;
+    call.return_ip = ip;
+    call.caller_stack_low = stack_low;
+    method_ = callee;
+    ivk_ = &call.ivk;
+    cip = &call.cip;
+    if (!enterFrame())
+      return false;
+
+#if defined(SP_THREADED_DISPATCH)
+    if (!callee_code->linked())
+      callee_code->link(handlers);
+#endif
+    code = callee_code;
+    stack_low = cx_->sp() - method_->max_stack();
+    LOAD_FRAME();
+    ip = code->start();
+    DISPATCH();
+  }
+  CASE(JUMP)           JUMP_IF(true);
+  CASE(JZER)           JUMP_IF(regs_.pri() == 0);
+  CASE(JNZ)            JUMP_IF(regs_.pri() != 0);
+  CASE(JEQ)            JUMP_IF(regs_.pri() == regs_.alt());
+  CASE(JNEQ)           JUMP_IF(regs_.pri() != regs_.alt());
+  CASE(JSLESS)         JUMP_IF(regs_.pri() < regs_.alt());
+  CASE(JSLEQ)          JUMP_IF(regs_.pri() <= regs_.alt());
+  CASE(JSGRTR)         JUMP_IF(regs_.pri() > regs_.alt());
+  CASE(JSGEQ)          JUMP_IF(regs_.pri() >= regs_.alt());
+  CASE(SHL)            STEP(visitSHL());
+  CASE(SHR)            STEP(visitSHR());
+  CASE(SSHR)           STEP(visitSSHR());
+  CASE(SHL_C)          STEP(visitSHL_C(REG(ip->b), ip->a));
+  CASE(SMUL)           STEP(visitSMUL());
+  CASE(SDIV)           STEP(visitSDIV(REG(ip->b)));
+  CASE(ADD)            STEP(visitADD());
+  CASE(SUB)            STEP(visitSUB());
+  CASE(SUB_ALT)        STEP(visitSUB_ALT());
+  CASE(AND)            STEP(visitAND());
+  CASE(OR)             STEP(visitOR());
+  CASE(XOR)            STEP(visitXOR());
+  CASE(NOT)            STEP(visitNOT());
+  CASE(NEG)            STEP(visitNEG());
+  CASE(INVERT)         STEP(visitINVERT());
+  CASE(ADD_C)          STEP(visitADD_C(ip->a));
+  CASE(SMUL_C)         STEP(visitSMUL_C(ip->a));
+  CASE(ZERO_REG)       STEP(visitZERO(REG(ip->b)));
+  CASE(ZERO)           STEP(visitZERO(ip->a));
+  CASE(ZERO_S)         LOCAL(FRAME(ip->a) = 0);
+  CASE(COMPARE)        STEP(visitCompareOp(CompareOp(ip->a)));
+  CASE(EQ_C)           STEP(visitEQ_C(REG(ip->b), ip->a));
+  CASE(INC_REG)        STEP(visitINC(REG(ip->b)));
+  CASE(INC)            STEP(visitINC(ip->a));
+  CASE(INC_S)          LOCAL(FRAME(ip->a) += 1);
+  CASE(INC_I)          STEP(visitINC_I());
+  CASE(DEC_REG)        STEP(visitDEC(REG(ip->b)));
+  CASE(DEC)            STEP(visitDEC(ip->a));
+  CASE(DEC_S)          LOCAL(FRAME(ip->a) -= 1);
+  CASE(DEC_I)          STEP(visitDEC_I());
+  CASE(MOVS)           STEP(visitMOVS(uint32_t(ip->a)));
+  CASE(FILL)           STEP(visitFILL(uint32_t(ip->a)));
+  CASE(BOUNDS)         STEP(visitBOUNDS(uint32_t(ip->a)));
+  CASE(SYSREQ_C)       STEP(visitSYSREQ_C(uint32_t(ip->a)));
+  CASE(SWAP)           STEP(visitSWAP(REG(ip->b)));
+  CASE(PUSH_ADR)
+  {
+    for (cell_t i = 0; i < ip->a; i++)
+      *--sp = frm + ip->ptr[i];
+    NEXT();
+  }
+  CASE(SYSREQ_N)       STEP(visitSYSREQ_N(uint32_t(ip->a), uint32_t(ip->b)));
+  CASE(LOAD_BOTH)      STEP(visitLOAD_BOTH(ip->a, ip->b));
+  CASE(LOAD_S_BOTH)
+  {
+    regs_.pri() = FRAME(ip->a);
+    regs_.alt() = FRAME(ip->b);
+    NEXT();
+  }
+  CASE(CONST_ADDR)     STEP(visitCONST(ip->a, ip->b));
+  CASE(CONST_S)        LOCAL(FRAME(ip->a) = ip->b);
+  CASE(TRACKER_PUSH_C) STEP_HEAP(visitTRACKER_PUSH_C(ip->a));
+  CASE(TRACKER_POP_SETHEAP) STEP(visitTRACKER_POP_SETHEAP());
+  CASE(GENARRAY)       STEP_HEAP(visitGENARRAY(uint32_t(ip->a), ip->b != 0));
+  CASE(STRADJUST_PRI)  STEP(visitSTRADJUST_PRI());
+  CASE(FABS)           STEP(visitFABS());
+  CASE(FLOAT)          STEP(visitFLOAT());
+  CASE(FLOATADD)       STEP(visitFLOATADD());
+  CASE(FLOATSUB)       STEP(visitFLOATSUB());
+  CASE(FLOATMUL)       STEP(visitFLOATMUL());
+  CASE(FLOATDIV)       STEP(visitFLOATDIV());
+  CASE(RND_TO_NEAREST) STEP(visitRND_TO_NEAREST());
+  CASE(RND_TO_FLOOR)   STEP(visitRND_TO_FLOOR());
+  CASE(RND_TO_CEIL)    STEP(visitRND_TO_CEIL());
+  CASE(RND_TO_ZERO)    STEP(visitRND_TO_ZERO());
+  CASE(FLOATCMP)       STEP(visitFLOATCMP());
+  CASE(FLOAT_CMP_OP)   STEP(visitFLOAT_CMP_OP(CompareOp(ip->a)));
+  CASE(FLOAT_NOT)      STEP(visitFLOAT_NOT());
+  CASE(HALT)           STEP(visitHALT(ip->a));
+  CASE(REBASE)         STEP(visitREBASE(ip->a, ip->b, ip->c));
+  CASE(LIDX_S_BOUNDS)  STEP(visitLIDX_S_BOUNDS(ip->a, ip->b, uint32_t(ip->c)));
+  CASE(IDXADDR_S_BOUNDS) STEP(visitIDXADDR_S_BOUNDS(ip->a, ip->b, uint32_t(ip->c)));
+
+  CASE(LOAD_S_PUSH)
+  {
+    regs_[REG(ip->b)] = FRAME(ip->a);
+    FUSED_NEXT();
+    LOCAL(*--sp = regs_[REG(ip->b)]);
+  }
+  CASE(LOAD_S_LIDX)
+  {
+    regs_.pri() = FRAME(ip->a);
+    FUSED_NEXT();
+    STEP(visitLIDX());
+  }
+  CASE(CONST_JEQ)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() == regs_.alt());
+  }
+  CASE(CONST_JNEQ)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() != regs_.alt());
+  }
+  CASE(CONST_JSLESS)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() < regs_.alt());
   }
+  CASE(CONST_JSLEQ)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() <= regs_.alt());
+  }
+  CASE(CONST_JSGRTR)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() > regs_.alt());
+  }
+  CASE(CONST_JSGEQ)
+  {
+    visitCONST(REG(ip->b), ip->a);
+    FUSED_NEXT();
+    JUMP_IF(regs_.pri() >= regs_.alt());
+  }
+
+  CASE(SWITCH)
+  {
+    ip = ip->table->lookup(regs_.pri());
+    DISPATCH();
+  }
+
+  CASE(RETN)
+  {
+    SAVE_SP();
+    if (!visitRETN())
+      return false;
+    if (calls_.empty())
+      return true;
 
+    has_returned_ = false;
+    regs_.pri() = return_value_;
+    leaveCall();
+    LOAD_FRAME();
+    NEXT();
+  }
+
+  CASE(END)
+    SAVE_SP();
+    return true;
+
+ call_osr:
+  {
+#if defined(SP_HAS_JIT)
+    // A call's frame is laid out the way compiled code expects too, so it
+    // finishes there and its caller carries on here.
+    RefPtr<MethodInfo> callee = method_;
+    leaveCall();
+
+    cell_t value;
+    if (!enterJit(callee, &value))
+      return false;
+    regs_.pri() = value;
+    LOAD_FRAME();
+    NEXT();
+#else
+    assert(false);
+    return false;
+#endif
+  }
+
+#if !defined(SP_THREADED_DISPATCH)
+  default:
+    assert(false);
+    return false;
+  }
+#endif
+
+#undef JUMP_IF
+#undef FUSED_NEXT
+#undef STEP_HEAP
+#undef REG
+#undef FRAME
+#undef LOCAL
+#undef STEP
+#undef LOAD_FRAME
+#undef LOAD_SP
+#undef SAVE_SP
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+}
+
+#if defined(SP_HAS_JIT)
+bool
+Interpreter::checkOsr(cell_t target)
+{
+  uint32_t threshold = env_->jit_threshold();
+  if (!env_->IsJitEnabled() || !threshold || method_->hotness() < threshold)
+    return true;
+
+  // A loop is as good a place as any to pick up background compiles.
+  PluginRuntime* rt = cx_->runtime();
+  if (!method_->jit() && env_->background_compilation()) {
+    if (rt->HasQueuedCode())
+      rt->InstallQueuedCode();
+    if (!method_->jit() && rt->QueueCompile(method_))
+      return true;
+  }
+
+  if (!method_->jit()) {
+    int err = SP_ERROR_NONE;
+    if (!CompilerBase::Compile(cx_, method_, &err)) {
+      cx_->ReportErrorNumber(err);
+      return false;
+    }
+  }
+
+  // Methods compiled before tiering was enabled have no entry points, and
+  // just run compiled on their next invocation.
+  osr_entry_ = method_->jit()->FindOsrEntry(target);
   return true;
 }
 
+bool
+Interpreter::enterJit(MethodInfo* method, cell_t* result)
+{
+  // Our frame is already laid out the way compiled code expects. The entry
+  // point picks up pri and alt from the stack.
+  if (!cx_->pushStack(regs_.pri()) || !cx_->pushStack(regs_.alt()))
+    return false;
+
+  CompiledFunction* fn = method->jit();
+  JitInvokeFrame ivkframe(cx_, fn->GetCodeOffset());
+
+  void* entry = osr_entry_;
+  osr_entry_ = nullptr;
+
+  InvokeStubFn invoke = env_->stubs()->InvokeStub();
+  invoke(cx_, entry, result);
+  return !env_->hasPendingException();
+}
+#endif
+
 bool
 Interpreter::invokeNative(uint32_t native_index)
 {
   NativeEntry* native = rt_->NativeAt(native_index);
 
   ivk_->enterNativeCall(native_index);
+  env_->watchdog()->HandleSampleRequest();
+  env_->countNativeCall();
+  if (!(native->flags & SP_NTVFLAG_PURE))
+    env_->bumpMemoEpoch();
+
   if (native->status == SP_NATIVE_BOUND) {
     ke::SaveAndSet<cell_t> saveSp(cx_->addressOfSp(), cx_->sp());
     ke::SaveAndSet<cell_t> saveHp(cx_->addressOfHp(), cx_->hp());
 
     const cell_t* params = reinterpret_cast<const cell_t*>(cx_->memory() + cx_->sp());
 
-    if (native->legacy_fn)
-      regs_.pri() = native->legacy_fn(cx_, params);
-    else
-      regs_.pri() = native->callback->Invoke(cx_, params);
+    AutoTraceNative trace(env_, rt_, native_index);
+    regs_.pri() = InvokeNative(native, cx_, params);
+
+    if (InvocationRecorder* recorder = rt_->recorder())
+      recorder->native(native_index, regs_.pri());
   } else {
     cx_->ReportErrorNumber(SP_ERROR_INVALID_NATIVE);
   }
@@ -155,15 +682,11 @@ Interpreter::visitCALL(cell_t offset)
     cx_->ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
     return false;
   }
-  int err = target->Validate();
-  if (err != SP_ERROR_NONE) {
-    cx_->ReportErrorNumber(err);
-    return false;
-  }
 
-  // We don't interleave between the interpreter and JIT (yet).
+  // Go through the environment, so that a callee hot enough to be compiled
+  // can run as JIT code. Both tiers use the same stack layout for calls.
   cell_t value = 0;
-  if (!Run(cx_, target, &value))
+  if (!env_->Invoke(cx_, target, &value))
     return false;
 
   regs_.pri() = value;
@@ -291,15 +814,35 @@ Interpreter::visitSTOR_S(cell_t offset, PawnReg src)
   return cx_->setFrameValue(offset, regs_[src]);
 }
 
+bool
+Interpreter::visitBackEdge(cell_t target)
+{
+  method_->addBackEdge();
+
+  if (env_->has_budgets() && !env_->spendBudget()) {
+    cx_->ReportErrorNumber(SP_ERROR_BUDGET);
+    return false;
+  }
+
+  // Check the watchdog timer if we're looping backwards.
+  if (!env_->watchdog()->HandleInterrupt()) {
+    cx_->ReportErrorNumber(SP_ERROR_TIMEOUT);
+    return false;
+  }
+
+#if defined(SP_HAS_JIT)
+  return checkOsr(target);
+#else
+  return true;
+#endif
+}
+
 bool
 Interpreter::visitJUMP(cell_t offset)
 {
   if (offset < reader_.cip_offset()) {
-    // Check the watchdog timer if we're looping backwards.
-    if (!Environment::get()->watchdog()->HandleInterrupt()) {
-      cx_->ReportErrorNumber(SP_ERROR_TIMEOUT);
+    if (!visitBackEdge(offset))
       return false;
-    }
   }
 
   reader_.jump(offset);
@@ -341,11 +884,8 @@ Interpreter::visitJcmp(CompareOp op, cell_t offset)
 
   if (jump) {
     if (offset < reader_.cip_offset()) {
-      // Check the watchdog timer if we're looping backwards.
-      if (!Environment::get()->watchdog()->HandleInterrupt()) {
-        cx_->ReportErrorNumber(SP_ERROR_TIMEOUT);
+      if (!visitBackEdge(offset))
         return false;
-      }
     }
 
     reader_.jump(offset);
@@ -647,8 +1187,17 @@ Interpreter::visitFILL(uint32_t amount)
   cell_t* dest = cx_->acquireAddrRange(regs_.alt(), amount);
   if (!dest)
     return false;
-  for (size_t i = 0; i < (amount / sizeof(cell_t)); i++)
-    dest[i] = regs_.pri();
+  // Zeroing (and other byte-uniform values, like -1) is the common case,
+  // and memset is faster than any loop here.
+  cell_t value = regs_.pri();
+  size_t cells = amount / sizeof(cell_t);
+  uint8_t byte = uint8_t(value);
+  if (value == cell_t(byte * 0x01010101u)) {
+    memset(dest, byte, cells * sizeof(cell_t));
+    return true;
+  }
+  for (size_t i = 0; i < cells; i++)
+    dest[i] = value;
   return true;
 }
 
@@ -690,6 +1239,24 @@ Interpreter::visitLIDX()
   return cx_->getCellValue(address, &regs_.pri());
 }
 
+bool
+Interpreter::visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  visitADDR(PawnReg::Alt, array);
+  if (!visitLOAD_S(PawnReg::Pri, index) || !visitBOUNDS(limit))
+    return false;
+  return visitLIDX();
+}
+
+bool
+Interpreter::visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  visitADDR(PawnReg::Alt, array);
+  if (!visitLOAD_S(PawnReg::Pri, index) || !visitBOUNDS(limit))
+    return false;
+  return visitIDXADDR();
+}
+
 bool
 Interpreter::visitLREF_S(PawnReg dest, cell_t srcoffs)
 {
@@ -1045,6 +1612,11 @@ Interpreter::visitBREAK()
   if (!Environment::get()->IsDebugBreakEnabled())
     return true;
 
+  // BREAK has no operands, so it's the cell before the current position.
+  const cell_t* cip = ivk_->cip() - 1;
+  if (!rt_->ShouldBreakAt(ucell_t(reinterpret_cast<const uint8_t*>(cip) - rt_->code().bytes)))
+    return true;
+
   InvokeDebugger(cx_, nullptr);
   return !env_->hasPendingException();
 }
@@ -19,6 +19,9 @@
 #define _include_sourcepawn_vm_interpreter_h_
 
 #include <assert.h>
+
+#include <deque>
+
 #include <amtl/am-refcounting.h>
 #include <sp_vm_types.h>
 #include "pcode-visitor.h"
@@ -33,6 +36,8 @@ class Environment;
 class PluginContext;
 class PluginRuntime;
 class MethodInfo;
+class ThreadedCode;
+struct ThreadedInsn;
 
 class InterpRegs
 {
@@ -151,11 +156,16 @@ class Interpreter final : public PcodeVisitor
   bool visitBREAK() override;
   bool visitHALT(cell_t value) override;
   bool visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size) override;
+  bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override;
+  bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override;
 
  private:
   Interpreter(PluginContext* cx, RefPtr<MethodInfo> method);
 
   bool run();
+  bool runThreaded(ThreadedCode* code);
+  bool enterFrame();
+  MethodInfo* callTarget(ThreadedCode* code, const ThreadedInsn* insn);
 
   cell_t return_value() const {
     return return_value_;
@@ -163,6 +173,11 @@ class Interpreter final : public PcodeVisitor
 
  private:
   bool invokeNative(uint32_t native_index);
+  bool visitBackEdge(cell_t target);
+#if defined(SP_HAS_JIT)
+  bool checkOsr(cell_t target);
+  bool enterJit(MethodInfo* method, cell_t* result);
+#endif
 
  private:
   Environment* env_;
@@ -174,6 +189,36 @@ class Interpreter final : public PcodeVisitor
   cell_t return_value_;
   InterpRegs regs_;
   InterpInvokeFrame* ivk_;
+
+  // When running pre-decoded code, the pcode position of the current
+  // instruction, for frame iteration.
+  const cell_t* cip_;
+
+  // Set when this invocation should continue in compiled code.
+  void* osr_entry_;
+
+  // A scripted call run by the caller's dispatch loop, rather than by a new
+  // Interpreter. It holds what the caller needs back when the call returns.
+  struct CallFrame
+  {
+    CallFrame(PluginContext* cx, MethodInfo* method, const uint8_t* entry)
+     : cip(reinterpret_cast<const cell_t*>(entry)),
+       ivk(cx, method, cip)
+    {}
+
+    RefPtr<MethodInfo> caller;
+    InterpInvokeFrame* caller_ivk;
+    ThreadedCode* caller_code;
+    const ThreadedInsn* return_ip;
+    cell_t caller_stack_low;
+    // The callee's position, for frame iteration.
+    const cell_t* cip;
+    InterpInvokeFrame ivk;
+  };
+
+  // Calls in progress, innermost last. A deque never moves its entries,
+  // which the environment's list of invoke frames relies on.
+  std::deque<CallFrame> calls_;
 };
 
 } // namespace sp
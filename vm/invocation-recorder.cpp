@@ -0,0 +1,237 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include "invocation-recorder.h"
+#include "plugin-runtime.h"
+
+using namespace sp;
+
+static const uint32_t kRecordingMagic = 0x43525053; // 'SPRC'
+static const uint32_t kRecordingVersion = 2;
+static const size_t kCodeHashSize = 16;
+
+static const uint8_t kInvokeRecord = 'I';
+static const uint8_t kNativeRecord = 'N';
+static const uint8_t kReturnRecord = 'R';
+
+std::unique_ptr<InvocationRecorder>
+InvocationRecorder::Open(PluginRuntime* rt, const char* path)
+{
+  FILE* fp = fopen(path, "wb");
+  if (!fp)
+    return nullptr;
+
+  std::unique_ptr<InvocationRecorder> recorder(new InvocationRecorder(fp));
+  recorder->write(&kRecordingMagic, sizeof(kRecordingMagic));
+  recorder->write(&kRecordingVersion, sizeof(kRecordingVersion));
+  recorder->write(rt->GetCodeHash(), kCodeHashSize);
+  return recorder;
+}
+
+InvocationRecorder::InvocationRecorder(FILE* fp)
+ : fp_(fp),
+   ok_(true),
+   depth_(0)
+{
+}
+
+InvocationRecorder::~InvocationRecorder()
+{
+  close();
+}
+
+bool
+InvocationRecorder::close()
+{
+  if (fp_) {
+    if (fclose(fp_) != 0)
+      ok_ = false;
+    fp_ = nullptr;
+  }
+  return ok_;
+}
+
+void
+InvocationRecorder::write(const void* data, size_t bytes)
+{
+  if (fp_ && fwrite(data, 1, bytes, fp_) != bytes)
+    ok_ = false;
+}
+
+void
+InvocationRecorder::enter(funcid_t func_id, const cell_t* params, uint32_t num_params,
+                          const uint8_t* heap, uint32_t heap_bytes)
+{
+  if (depth_++)
+    return;
+
+  write(&kInvokeRecord, sizeof(kInvokeRecord));
+  write(&func_id, sizeof(func_id));
+  write(&num_params, sizeof(num_params));
+  write(params, sizeof(cell_t) * num_params);
+  write(&heap_bytes, sizeof(heap_bytes));
+  write(heap, heap_bytes);
+  start_ = std::chrono::steady_clock::now();
+}
+
+void
+InvocationRecorder::leave(bool ok, cell_t result)
+{
+  // Recording may have started inside this invocation.
+  if (!depth_ || --depth_)
+    return;
+
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+  uint8_t succeeded = ok ? 1 : 0;
+  write(&kReturnRecord, sizeof(kReturnRecord));
+  write(&succeeded, sizeof(succeeded));
+  write(&result, sizeof(result));
+  write(&ns, sizeof(ns));
+}
+
+void
+InvocationRecorder::native(uint32_t native_index, cell_t result)
+{
+  if (depth_ != 1)
+    return;
+
+  write(&kNativeRecord, sizeof(kNativeRecord));
+  write(&native_index, sizeof(native_index));
+  write(&result, sizeof(result));
+}
+
+ReplayReader::ReplayReader()
+ : fp_(nullptr)
+{
+}
+
+ReplayReader::~ReplayReader()
+{
+  if (fp_)
+    fclose(fp_);
+}
+
+bool
+ReplayReader::Open(PluginRuntime* rt, const char* path, std::string* error)
+{
+  fp_ = fopen(path, "rb");
+  if (!fp_) {
+    *error = "could not open file";
+    return false;
+  }
+
+  uint32_t magic, version;
+  uint8_t hash[kCodeHashSize];
+  if (!read(&magic, sizeof(magic)) || !read(&version, sizeof(version)) ||
+      !read(hash, sizeof(hash)) || magic != kRecordingMagic)
+  {
+    *error = "not a recording";
+    return false;
+  }
+  if (version != kRecordingVersion) {
+    *error = "unsupported recording version";
+    return false;
+  }
+  if (memcmp(hash, rt->GetCodeHash(), sizeof(hash)) != 0) {
+    *error = "recorded for different code";
+    return false;
+  }
+  return true;
+}
+
+bool
+ReplayReader::read(void* data, size_t bytes)
+{
+  return fread(data, 1, bytes, fp_) == bytes;
+}
+
+bool
+ReplayReader::peek(uint8_t* kind)
+{
+  int c = fgetc(fp_);
+  if (c == EOF)
+    return false;
+  ungetc(c, fp_);
+  *kind = uint8_t(c);
+  return true;
+}
+
+bool
+ReplayReader::NextInvocation(Invocation* out)
+{
+  uint8_t kind;
+  while (peek(&kind) && kind != kInvokeRecord) {
+    Return ignore;
+    if (!ReadReturn(&ignore))
+      return false;
+  }
+
+  uint32_t num_params, heap_bytes;
+  if (!read(&kind, sizeof(kind)) || kind != kInvokeRecord ||
+      !read(&out->func_id, sizeof(out->func_id)) ||
+      !read(&num_params, sizeof(num_params)) || num_params > SP_MAX_EXEC_PARAMS)
+  {
+    return false;
+  }
+  out->params.resize(num_params);
+  if (!read(out->params.data(), sizeof(cell_t) * num_params) ||
+      !read(&heap_bytes, sizeof(heap_bytes)))
+  {
+    return false;
+  }
+  out->heap.resize(heap_bytes);
+  return read(out->heap.data(), heap_bytes);
+}
+
+bool
+ReplayReader::NextNative(uint32_t native_index, cell_t* result)
+{
+  uint8_t kind;
+  if (!peek(&kind) || kind != kNativeRecord)
+    return false;
+
+  uint32_t index;
+  if (!read(&kind, sizeof(kind)) || !read(&index, sizeof(index)) ||
+      !read(result, sizeof(*result)))
+  {
+    return false;
+  }
+  return index == native_index;
+}
+
+bool
+ReplayReader::ReadReturn(Return* out)
+{
+  uint8_t kind;
+  while (peek(&kind) && kind == kNativeRecord) {
+    uint32_t index;
+    cell_t result;
+    if (!read(&kind, sizeof(kind)) || !read(&index, sizeof(index)) ||
+        !read(&result, sizeof(result)))
+    {
+      return false;
+    }
+  }
+
+  uint8_t ok;
+  if (!read(&kind, sizeof(kind)) || kind != kReturnRecord ||
+      !read(&ok, sizeof(ok)) || !read(&out->result, sizeof(out->result)) ||
+      !read(&out->ns, sizeof(out->ns)))
+  {
+    return false;
+  }
+  out->ok = !!ok;
+  return true;
+}
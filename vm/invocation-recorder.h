@@ -0,0 +1,117 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_invocation_recorder_h_
+#define _include_sourcepawn_vm_invocation_recorder_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sp_vm_types.h>
+
+namespace sp {
+
+class PluginRuntime;
+
+// Records the invocations a host makes into one plugin, so they can be run
+// again offline against the same code with the natives stubbed out; see
+// ReplayReader and spshell --replay. For each invocation the stream has:
+//   - the function ID, its arguments, and the heap they may point into;
+//   - the return value of every native it calls, in order;
+//   - its result, and how long it took.
+//
+// Only invocations that don't start inside another invocation of the same
+// plugin are recorded, with the natives they call themselves. A native that
+// calls back into the plugin is replayed as just its return value, and what
+// natives write through reference arguments is not recorded.
+class InvocationRecorder
+{
+ public:
+  // Returns null if |path| can't be created.
+  static std::unique_ptr<InvocationRecorder> Open(PluginRuntime* rt, const char* path);
+  ~InvocationRecorder();
+
+  // Called by PluginContext::Invoke around each invocation. |heap| is
+  // everything allocated on the heap when the invocation starts.
+  void enter(funcid_t func_id, const cell_t* params, uint32_t num_params,
+             const uint8_t* heap, uint32_t heap_bytes);
+  void leave(bool ok, cell_t result);
+
+  // Called after each native call.
+  void native(uint32_t native_index, cell_t result);
+
+  // Flushes the stream; returns false if anything failed to write.
+  bool close();
+
+ private:
+  explicit InvocationRecorder(FILE* fp);
+
+  void write(const void* data, size_t bytes);
+
+ private:
+  FILE* fp_;
+  bool ok_;
+  uint32_t depth_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Reads a stream written by InvocationRecorder. Records come in the order
+// Invocation, the natives it called, then Return.
+class ReplayReader
+{
+ public:
+  struct Invocation {
+    funcid_t func_id;
+    std::vector<cell_t> params;
+    std::vector<uint8_t> heap;
+  };
+  struct Return {
+    bool ok;
+    cell_t result;
+    uint64_t ns;
+  };
+
+  ReplayReader();
+  ~ReplayReader();
+
+  // Fails if the file can't be read, or was recorded for different code.
+  bool Open(PluginRuntime* rt, const char* path, std::string* error);
+
+  // Reads the next invocation, skipping any records left over from the last
+  // one. Returns false at the end of the stream.
+  bool NextInvocation(Invocation* out);
+
+  // Reads the return value of the next native call, which must be a call
+  // to |native_index|.
+  bool NextNative(uint32_t native_index, cell_t* result);
+
+  // Reads how the current invocation ended, skipping any natives it called
+  // that the replay didn't.
+  bool ReadReturn(Return* out);
+
+ private:
+  bool read(void* data, size_t bytes);
+  bool peek(uint8_t* kind);
+
+ private:
+  FILE* fp_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_invocation_recorder_h_
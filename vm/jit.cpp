@@ -16,7 +16,10 @@
 // along with SourcePawn.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include "jit.h"
+#include "code-cache.h"
 #include "environment.h"
+#include "frame-effects.h"
+#include "interpreter.h"
 #include "linking.h"
 #include "method-info.h"
 #include "opcodes.h"
@@ -24,9 +27,12 @@
 #include "pcode-reader.h"
 #include "plugin-runtime.h"
 #include "stack-frames.h"
+#include "timeline.h"
 #include "watchdog_timer.h"
 #if defined(KE_ARCH_X86)
 # include "x86/jit_x86.h"
+#elif defined(KE_ARCH_X64)
+# include "x64/jit_x64.h"
 #endif
 
 namespace sp {
@@ -36,7 +42,7 @@ using namespace SourcePawn;
 #define __ masm.
 
 CompilerBase::CompilerBase(PluginRuntime* rt, MethodInfo* method)
- : env_(Environment::get()),
+ : env_(rt->env()),
    rt_(rt),
    context_(rt->GetBaseContext()),
    image_(rt_->image()),
@@ -44,7 +50,13 @@ CompilerBase::CompilerBase(PluginRuntime* rt, MethodInfo* method)
    error_(SP_ERROR_NONE),
    pcode_start_(0),
    code_start_(nullptr),
-   op_cip_(nullptr)
+   op_cip_(nullptr),
+   prev_cip_(nullptr),
+   code_alloc_(nullptr),
+   makes_calls_(false),
+   inlining_(false),
+   unrolling_(nullptr),
+   copy_next_(nullptr)
 {
 }
 
@@ -55,6 +67,21 @@ CompilerBase::~CompilerBase()
 CompiledFunction*
 CompilerBase::Compile(PluginContext* cx, RefPtr<MethodInfo> method, int* err)
 {
+  // If the method is being compiled in the background, take that instead.
+  cx->runtime()->PublishPrecompiledCode(true);
+  if (CompiledFunction* fun = method->jit())
+    return fun;
+
+#if defined(SP_HAS_CODE_CACHE)
+  CodeCache* cache = Environment::get()->code_cache();
+  if (cache) {
+    if (CompiledFunction* fun = cache->Lookup(cx->runtime(), method)) {
+      method->setCompiledFunction(fun);
+      return fun;
+    }
+  }
+#endif
+
   Compiler cc(cx->runtime(), method);
 
   CompiledFunction* fun = cc.emit();
@@ -62,23 +89,62 @@ CompilerBase::Compile(PluginContext* cx, RefPtr<MethodInfo> method, int* err)
     *err = cc.error();
     return nullptr;
   }
+  Environment::get()->addJitCompileTime(fun->stats().compile_ns);
+
+#if defined(SP_HAS_CODE_CACHE)
+  if (cache)
+    cache->Store(cx->runtime(), method, fun, cc.masm.absolute_refs());
+#endif
 
   method->setCompiledFunction(fun);
   return fun;
 }
 
+CompiledFunction*
+CompilerBase::CompileOffThread(PluginRuntime* rt, MethodInfo* method,
+                               RefPtr<ControlFlowGraph> graph, CodeAllocator* alloc)
+{
+  Compiler cc(rt, method);
+  cc.graph_ = graph;
+  cc.code_alloc_ = alloc;
+  return cc.emit();
+}
+
 CompiledFunction*
 CompilerBase::emit()
 {
-  graph_ = method_info_->ValidateWithGraph();
+  auto start = std::chrono::steady_clock::now();
+  AutoTimelineEvent event(env_->timeline(), Timeline::Kind::Compile, rt_,
+                          method_info_->pcode_offset());
+
   if (!graph_) {
-    reportError(method_info_->validationError());
-    return nullptr;
+    graph_ = method_info_->ValidateWithGraph();
+    if (!graph_) {
+      reportError(method_info_->validationError());
+      return nullptr;
+    }
   }
 
   pcode_start_ = method_info_->pcode_offset();
   code_start_ = reinterpret_cast<const cell_t*>(rt_->code().bytes + pcode_start_);
 
+  elements_ = std::make_unique<FrameElementAccesses>(graph_);
+  elements_->analyze();
+  bounds_ = std::make_unique<BoundsAnalysis>(rt_, graph_, env_->IsDebugBreakEnabled(),
+                                             elements_.get());
+  bounds_->analyze();
+  heap_checks_ = std::make_unique<HeapCheckAnalysis>(graph_, env_->IsDebugBreakEnabled());
+  heap_checks_->analyze();
+
+  // Polls, budgets, and the debugger all count on what runs per back-edge,
+  // or per cip.
+  if (!env_->IsDebugBreakEnabled() && !env_->has_budgets()) {
+    loops_ = std::make_unique<LoopAnalysis>(graph_, elements_.get());
+    loops_->analyze();
+    for (size_t i = 0; i < loops_->numLoops(); i++)
+      copy_labels_.push_back(std::make_unique<Label[]>(loops_->loop(i).body.size()));
+  }
+
 #if defined JIT_SPEW
   Environment::get()->debugger()->OnDebugSpew(
       "Compiling function %s::%s\n",
@@ -88,30 +154,43 @@ CompilerBase::emit()
   SpewOpcode(stdout, rt_, code_start_, reader.cip());
 #endif
 
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd() && !makes_calls_; iter++) {
+    ForEachInstruction(*iter, [this](const cell_t* cip, const cell_t* prev) -> void {
+      if (*cip == OP_CALL)
+        makes_calls_ = true;
+    });
+  }
+
   emitPrologue();
 
   for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
     block_ = *iter;
-    __ bind(block_->label());
 
-    PcodeReader<CompilerBase> reader(rt_, block_, this);
-    reader.begin();
+    // Loop headers are where the taken back-edges land, so starting them on
+    // a fetch boundary is worth the few bytes of padding on the way in.
+    if (block_->isLoopHeader())
+      __ nopAlign(kLoopHeaderAlignment);
+    if (!emitBlock(block_->label()))
+      return nullptr;
+  }
+  if (!emitLoopCopies())
+    return nullptr;
 
-    while (reader.more()) {
-#if defined JIT_SPEW
-      SpewOpcode(rt_, code_start_, reader.cip());
-#endif
+  // With tiering, a long-running interpreted invocation can move into
+  // compiled code at any loop header.
+  if (env_->jit_threshold()) {
+    for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+      if (!iter->isLoopHeader())
+        continue;
 
-      // Save the start of the opcode for emitCipMap().
-      op_cip_ = reader.cip();
+      OsrEntry entry;
+      entry.cipoffs = uintptr_t(iter->start()) - uintptr_t(code_start_);
+      entry.pcoffs = masm.pc();
+      osr_entries_.push_back(entry);
 
-      if (!reader.visitNext() || error_)
-        return nullptr;
+      op_cip_ = reinterpret_cast<const cell_t*>(iter->start());
+      emitOsrEntry(*iter);
     }
-
-    // Note: the offset is ignored.
-    if (block_->endType() == BlockEnd::Jump)
-      visitJUMP(0);
   }
 
   for (size_t i = 0; i < ool_paths_.size(); i++) {
@@ -123,6 +202,7 @@ CompilerBase::emit()
 
   // For each backward jump, emit a little thunk so we can exit from a timeout.
   // Track the offset of where the thunk is, so the watchdog timer can patch it.
+  // (There are none if back-edges poll for interrupts instead.)
   for (size_t i = 0; i < backward_jumps_.size(); i++) {
     BackwardJump& jump = backward_jumps_[i];
     jump.timeout_offset = masm.pc();
@@ -140,6 +220,7 @@ CompilerBase::emit()
   emitThrowPathIfNeeded(SP_ERROR_HEAPMIN);
   emitThrowPathIfNeeded(SP_ERROR_INTEGER_OVERFLOW);
   emitThrowPathIfNeeded(SP_ERROR_INVALID_NATIVE);
+  emitThrowPathIfNeeded(SP_ERROR_BUDGET);
 
   // Common path for invoking line debugger.
   emitDebugBreakHandler();
@@ -151,12 +232,22 @@ CompilerBase::emit()
   if (error_)
     return nullptr;
 
-  CodeChunk code = LinkCode(env_, masm);
+  // Methods that tiering promoted are the ones that actually run the most, so
+  // they're packed together in hot code memory, in the order they became hot
+  // - which tends to put callers near the callees that got hot with them.
+  bool hot = env_->jit_threshold() && method_info_->hotness() >= env_->jit_threshold();
+
+  CodeChunk code = code_alloc_ ? LinkCode(code_alloc_, masm, hot) : LinkCode(env_, masm, hot);
   if (!code.address()) {
     reportError(SP_ERROR_OUT_OF_MEMORY);
     return nullptr;
   }
 
+  if (CodeMap* map = env_->code_map()) {
+    map->AddMethod(rt_, pcode_start_, code.address(), code.bytes(), cip_map_.data(),
+                   cip_map_.size());
+  }
+
   std::unique_ptr<FixedArray<LoopEdge>> edges(
     new FixedArray<LoopEdge>(backward_jumps_.size()));
   for (size_t i = 0; i < backward_jumps_.size(); i++) {
@@ -169,8 +260,235 @@ CompilerBase::emit()
     new FixedArray<CipMapEntry>(cip_map_.size()));
   memcpy(cipmap->buffer(), cip_map_.data(), cip_map_.size() * sizeof(CipMapEntry));
 
+  std::unique_ptr<FixedArray<BreakSite>> break_sites(
+    new FixedArray<BreakSite>(break_paths_.size()));
+  for (size_t i = 0; i < break_paths_.size(); i++) {
+    DebugBreakPath* path = break_paths_[i];
+    break_sites->at(i).cipoffs = uintptr_t(path->cip) - uintptr_t(code_start_);
+    break_sites->at(i).offset = path->site;
+    break_sites->at(i).disp32 = int32_t(path->label()->offset()) - int32_t(path->site);
+  }
+
+  std::unique_ptr<FixedArray<OsrEntry>> osr_entries(
+    new FixedArray<OsrEntry>(osr_entries_.size()));
+  memcpy(osr_entries->buffer(), osr_entries_.data(), osr_entries_.size() * sizeof(OsrEntry));
+
+  std::unique_ptr<FixedArray<UnwindEntry>> unwind_entries(
+    new FixedArray<UnwindEntry>(unwind_entries_.size()));
+  for (size_t i = 0; i < unwind_entries_.size(); i++) {
+    unwind_entries->at(i) = unwind_entries_[i];
+    unwind_entries->at(i).landing = landing_pads_[i]->offset();
+  }
+
+  CompileStats stats = {};
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++)
+    stats.pcode_bytes += uint32_t(iter->end() - iter->start());
+  stats.ool_paths = uint32_t(ool_paths_.size());
+  stats.thunks = uint32_t(backward_jumps_.size());
+  stats.compile_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
   assert(error_ == SP_ERROR_NONE);
-  return new CompiledFunction(code, pcode_start_, edges.release(), cipmap.release());
+  CompiledFunction* fun = new CompiledFunction(code, pcode_start_, edges.release(),
+                                               cipmap.release(), osr_entries.release(),
+                                               unwind_entries.release(), break_sites.release());
+  fun->set_stats(stats);
+  return fun;
+}
+
+bool
+CompilerBase::isInlinable(cell_t offset)
+{
+  // Off the VM thread, other methods can't be looked at. With the debugger,
+  // every line has to be visible.
+  if (offThread() || env_->IsDebugBreakEnabled())
+    return false;
+
+  if (offset < 0 ||
+      size_t(offset) >= rt_->code().length ||
+      !ke::IsAligned(offset, sizeof(cell_t)))
+  {
+    return false;
+  }
+
+  const uint8_t* code = rt_->code().bytes;
+  const uint8_t* end = code + rt_->code().length;
+  const uint8_t* cip = code + offset;
+  if (*reinterpret_cast<const cell_t*>(cip) != OP_PROC)
+    return false;
+  cip = NextInstruction(cip);
+
+  // Only instructions that never fault, call, or touch the stack or the
+  // callee's own frame are allowed, so the body needs no frame at all.
+  for (size_t i = 0; i <= kMaxInlineInstructions; i++) {
+    if (cip + sizeof(cell_t) > end)
+      return false;
+    const cell_t* insn = reinterpret_cast<const cell_t*>(cip);
+    if (insn[0] == OP_NONE || ucell_t(insn[0]) >= OPCODES_TOTAL)
+      return false;
+    OPCODE op = (OPCODE)insn[0];
+    if (cip + kOpcodeSizes[op] * sizeof(cell_t) > end)
+      return false;
+
+    switch (op) {
+      case OP_RETN:
+        // The body still has to pass the verifier.
+        if (RefPtr<MethodInfo> callee = rt_->AcquireMethod(offset))
+          return callee->Validate() == SP_ERROR_NONE;
+        return false;
+
+      case OP_LOAD_S_PRI:
+      case OP_LOAD_S_ALT:
+      case OP_LREF_S_PRI:
+      case OP_LREF_S_ALT:
+        // Arguments and the argument count only.
+        if (insn[1] < kInlineFrameBias)
+          return false;
+        break;
+      case OP_LOAD_S_BOTH:
+        if (insn[1] < kInlineFrameBias || insn[2] < kInlineFrameBias)
+          return false;
+        break;
+
+      case OP_LOAD_PRI:
+      case OP_LOAD_ALT:
+      case OP_LOAD_BOTH:
+      case OP_CONST_PRI:
+      case OP_CONST_ALT:
+      case OP_ZERO_PRI:
+      case OP_ZERO_ALT:
+      case OP_MOVE_PRI:
+      case OP_MOVE_ALT:
+      case OP_XCHG:
+      case OP_SHL:
+      case OP_SHR:
+      case OP_SSHR:
+      case OP_SHL_C_PRI:
+      case OP_SHL_C_ALT:
+      case OP_SMUL:
+      case OP_SMUL_C:
+      case OP_ADD:
+      case OP_ADD_C:
+      case OP_SUB:
+      case OP_SUB_ALT:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_NOT:
+      case OP_NEG:
+      case OP_INVERT:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_SLESS:
+      case OP_SLEQ:
+      case OP_SGRTR:
+      case OP_SGEQ:
+      case OP_EQ_C_PRI:
+      case OP_EQ_C_ALT:
+      case OP_INC_PRI:
+      case OP_INC_ALT:
+      case OP_DEC_PRI:
+      case OP_DEC_ALT:
+      case OP_NOP:
+      case OP_BREAK:
+        break;
+
+      default:
+        return false;
+    }
+    cip = NextInstruction(cip);
+  }
+  return false;
+}
+
+bool
+CompilerBase::tryInlineCall(cell_t offset)
+{
+  if (!isInlinable(offset))
+    return false;
+
+  // The body is re-read with the same visitors as the caller. op_cip_ stays
+  // on the CALL, but nothing in the body records it.
+  inlining_ = true;
+  PcodeReader<CompilerBase> reader(rt_, offset, this);
+  reader.begin();
+  while (reader.peekOpcode() != OP_RETN) {
+    if (!reader.visitNext() || error_) {
+      inlining_ = false;
+      return true;
+    }
+  }
+  inlining_ = false;
+
+  emitInlineReturn();
+  return true;
+}
+
+bool
+CompilerBase::needsStackCheck() const
+{
+  cell_t frame = method_info_->max_stack() + 2 * cell_t(sizeof(cell_t));
+  return makes_calls_ || frame > kLeafStackGuard;
+}
+
+cell_t
+CompilerBase::HeapMargin()
+{
+  return STACK_MARGIN + kLeafStackGuard;
+}
+
+bool
+CompilerBase::knownConstant(PawnReg reg, cell_t* value) const
+{
+  // An inlined body's instructions aren't where op_cip_ is.
+  if (inlining_ || !prev_cip_)
+    return false;
+
+  const uint8_t* prev = reinterpret_cast<const uint8_t*>(prev_cip_);
+  if (NextInstruction(prev) != reinterpret_cast<const uint8_t*>(op_cip_))
+    return false;
+
+  OPCODE op = (OPCODE)prev_cip_[0];
+  if (op != (reg == PawnReg::Pri ? OP_CONST_PRI : OP_CONST_ALT))
+    return false;
+  *value = prev_cip_[1];
+  return true;
+}
+
+void
+CompilerBase::ComputeDivisionMagic(int32_t divisor, int32_t* multiplier, int32_t* shift)
+{
+  const uint32_t two31 = 0x80000000;
+  uint32_t ad = divisor < 0 ? 0u - uint32_t(divisor) : uint32_t(divisor);
+  uint32_t t = two31 + (uint32_t(divisor) >> 31);
+  uint32_t anc = t - 1 - t % ad;
+  int32_t p = 31;
+  uint32_t q1 = two31 / anc;
+  uint32_t r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad;
+  uint32_t r2 = two31 - q2 * ad;
+  uint32_t delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *multiplier = int32_t(q2 + 1);
+  if (divisor < 0)
+    *multiplier = int32_t(0u - uint32_t(*multiplier));
+  *shift = p - 32;
 }
 
 void
@@ -206,6 +524,20 @@ CompilerBase::emitErrorPath(ErrorPath* path)
   emitCipMapping(path->cip);
 }
 
+ErrorPath*
+CompilerBase::errorPathFor(int err)
+{
+  for (ErrorPath* path : op_error_paths_) {
+    if (path->cip == op_cip_ && path->err == err)
+      return path;
+  }
+
+  ErrorPath* path = new ErrorPath(op_cip_, err);
+  ool_paths_.push_back(path);
+  op_error_paths_.push_back(path);
+  return path;
+}
+
 void
 CompilerBase::emitThrowPathIfNeeded(int err)
 {
@@ -226,7 +558,8 @@ CompilerBase::reportError(int err)
 }
 
 int
-CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void** addrp, uint8_t* pc)
+CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, CallThunkResult* out,
+                               uint8_t* pc)
 {
   // If the watchdog timer has declared a timeout, we must process it now,
   // and possibly refuse to compile, since otherwise we will compile a
@@ -239,6 +572,18 @@ CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void** addr
     return SP_ERROR_INVALID_ADDRESS;
 
   CompiledFunction* fn = method->jit();
+  if (!fn && Environment::get()->ShouldInterpretCall(cx, method)) {
+    int err = method->Validate();
+    if (err != SP_ERROR_NONE)
+      return err;
+
+    // The thunk stays, so that once the callee is compiled, later calls
+    // patch it. An error is left pending for the thunk to find.
+    out->target = nullptr;
+    out->result = 0;
+    Interpreter::Run(cx, method, &out->result);
+    return SP_ERROR_NONE;
+  }
   if (!fn) {
     int err;
     fn = Compile(cx, method, &err);
@@ -253,9 +598,8 @@ CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void** addr
       cx->runtime()->image()->LookupFunction(pcode_offs));
 #endif
 
-  *addrp = fn->GetEntryAddress();
+  out->target = fn->GetEntryAddress();
 
-  /* Right now, we always keep the code RWE */
   PatchCallThunk(pc, fn->GetEntryAddress());
   return SP_ERROR_NONE;
 }
@@ -301,6 +645,132 @@ ErrorPath::emit(Compiler* cc)
   return true;
 }
 
+bool
+CompilerBase::emitBlock(Label* label)
+{
+  __ bind(label);
+
+  PcodeReader<CompilerBase> reader(rt_, block_, this);
+  if (offThread())
+    reader.disableNativeReplacement();
+  reader.begin();
+
+  prev_cip_ = nullptr;
+  while (reader.more()) {
+#if defined JIT_SPEW
+    SpewOpcode(rt_, code_start_, reader.cip());
+#endif
+
+    // Save the start of the opcode for emitCipMap().
+    op_cip_ = reader.cip();
+    op_error_paths_.clear();
+
+    if (!reader.visitNext() || error_)
+      return false;
+    prev_cip_ = op_cip_;
+  }
+
+  // Note: the offset is ignored.
+  if (block_->endType() == BlockEnd::Jump)
+    visitJUMP(0);
+  return true;
+}
+
+// The copy of each unrolled loop goes after the rest of the method. It is
+// only entered from the original's back-edge, and everything leaving it goes
+// to the original blocks, including its own back-edge to the header.
+bool
+CompilerBase::emitLoopCopies()
+{
+  for (size_t i = 0; loops_ && i < loops_->numLoops(); i++) {
+    unrolling_ = &loops_->loop(i);
+    const std::vector<Block*>& body = unrolling_->body;
+    for (size_t j = 0; j < body.size(); j++) {
+      block_ = body[j];
+      copy_next_ = (j + 1 < body.size()) ? body[j + 1] : nullptr;
+      if (!emitBlock(&copy_labels_[i][j]))
+        return false;
+    }
+  }
+  unrolling_ = nullptr;
+  copy_next_ = nullptr;
+  return true;
+}
+
+Label*
+CompilerBase::labelFor(Block* target)
+{
+  if (unrolling_) {
+    if (target != unrolling_->header && unrolling_->contains(target))
+      return copyLabel(unrolling_, target);
+  } else if (loops_ && isUnrolledBackedge(target)) {
+    return copyLabel(loops_->unrollableAt(target), target);
+  }
+  return target->label();
+}
+
+bool
+CompilerBase::isUnrolledBackedge(Block* target) const
+{
+  const LoopAnalysis::Loop* loop = loops_->unrollableAt(target);
+  return loop && block_ == loop->latch;
+}
+
+Label*
+CompilerBase::copyLabel(const LoopAnalysis::Loop* loop, Block* block)
+{
+  size_t index = loop - &loops_->loop(0);
+  auto iter = std::lower_bound(loop->body.begin(), loop->body.end(), block,
+                               [](Block* a, Block* b) -> bool {
+                                 return a->id() < b->id();
+                               });
+  assert(iter != loop->body.end() && *iter == block);
+  return &copy_labels_[index][iter - loop->body.begin()];
+}
+
+void
+CompilerBase::emitInterruptCheckPath(InterruptCheckPath* path)
+{
+  __ call(&throw_timeout_);
+  emitCipMapping(path->cip);
+}
+
+bool
+InterruptCheckPath::emit(Compiler* cc)
+{
+  cc->emitInterruptCheckPath(this);
+  return true;
+}
+
+void
+CompilerBase::emitDebugBreakSite()
+{
+  DebugBreakPath* path = new DebugBreakPath(op_cip_);
+  ool_paths_.push_back(path);
+  break_paths_.push_back(path);
+
+  // The jump is linked to the path, which arms it; the runtime decides
+  // whether it stays that way once the code is installed.
+  __ jmp32(path->label());
+  path->site = masm.pc();
+  __ bind(path->done());
+}
+
+void
+CompilerBase::emitDebugBreakPath(DebugBreakPath* path)
+{
+  __ call(&debug_break_);
+  emitCipMapping(path->cip);
+  __ jmp(path->done());
+}
+
+bool
+DebugBreakPath::emit(Compiler* cc)
+{
+  cc->emitDebugBreakPath(this);
+  return true;
+}
+
 bool
 OutOfBoundsErrorPath::emit(Compiler* cc)
 {
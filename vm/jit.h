@@ -20,6 +20,7 @@
 #include <sp_vm_types.h>
 #include <sp_vm_api.h>
 #include <am-vector.h>
+#include <memory>
 #include "macro-assembler.h"
 #include "opcodes.h"
 #include "pool-allocator.h"
@@ -27,21 +28,42 @@
 #include "pcode-visitor.h"
 #include "compiled-function.h"
 #include "control-flow.h"
+#include "bounds-analysis.h"
+#include "heap-checks.h"
+#include "loop-analysis.h"
 
 namespace sp {
 
 using namespace SourcePawn;
 
+class CodeAllocator;
 class PluginRuntime;
 class PluginContext;
 class LegacyImage;
 
+// A callee's frame pointer sits this far below the caller's stack pointer at
+// a CALL, past the saved heap and frame pointers.
+static const cell_t kInlineFrameBias = 8;
+
+// Callees with at most this many instructions may be inlined.
+static const size_t kMaxInlineInstructions = 12;
+
+// MOVS and FILL of at most this many bytes are unrolled into plain moves,
+// which beat the startup cost of a rep-prefixed instruction.
+static const uint32_t kMaxUnrolledMoveBytes = 32;
+static const uint32_t kMaxUnrolledFillBytes = 64;
+
+// Loop headers start on a boundary of this many bytes.
+static const uint32_t kLoopHeaderAlignment = 16;
+
 struct BackwardJump {
   // The pc at the jump instruction (i.e. after it).
   uint32_t pc;
   // The cip of the jump.
   const cell_t* cip;
-  // The offset of the timeout thunk. This is filled in at the end.
+  // The offset of the timeout thunk. This is filled in at the end. Back-edges
+  // are only recorded when they are patched for timeouts, rather than polling
+  // the interrupt flag.
   uint32_t timeout_offset;
 
   BackwardJump()
@@ -52,9 +74,18 @@ struct BackwardJump {
   {}
 };
 
+// What a call thunk does next: jump to |target|, or if that is null, carry
+// on as if the call had returned |result|, since the interpreter ran it.
+struct CallThunkResult {
+  void* target;
+  cell_t result;
+};
+
 class CompilerBase : public PcodeVisitor
 {
   friend class ErrorPath;
+  friend class InterruptCheckPath;
+  friend class DebugBreakPath;
 
  public:
   CompilerBase(PluginRuntime* rt, MethodInfo* method);
@@ -62,12 +93,27 @@ class CompilerBase : public PcodeVisitor
 
   static CompiledFunction* Compile(PluginContext* cx, RefPtr<MethodInfo> method, int* err);
 
+  // Compiles |method| from a |graph| verified earlier, on a thread other than
+  // the VM thread. Nothing script execution can change is read, so natives
+  // are always called through the generic path, and calls go through thunks.
+  // Code is allocated from |alloc|, which must not be shared. The result is
+  // not installed.
+  static CompiledFunction* CompileOffThread(PluginRuntime* rt, MethodInfo* method,
+                                            RefPtr<ControlFlowGraph> graph,
+                                            CodeAllocator* alloc);
+
   int error() const {
     return error_;
   }
 
  protected:
   CompiledFunction* emit();
+  bool emitBlock(Label* label);
+  bool emitLoopCopies();
+
+  bool offThread() const {
+    return !!code_alloc_;
+  }
 
   virtual void emitPrologue() = 0;
   virtual void emitThrowPath(int err) = 0;
@@ -75,8 +121,38 @@ class CompilerBase : public PcodeVisitor
   virtual void emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path) = 0;
   virtual void emitDebugBreakHandler() = 0;
 
+  // Enter the function from the interpreter at a loop header. The entry must
+  // set up the native frame and registers, and then jump to the header.
+  virtual void emitOsrEntry(Block* header) = 0;
+
+  // Pop the arguments of an inlined call, the way RETN would.
+  virtual void emitInlineReturn() = 0;
+
+  // Inline the method at |offset|, if it's a short, straight-line body that
+  // can't fail or leave the method. Such a body can't be observed by a frame
+  // walk, so the missing frame is never noticed. Returns false if the call
+  // must be emitted normally.
+  bool tryInlineCall(cell_t offset);
+  bool isInlinable(cell_t offset);
+
+  // Leaf methods whose frame fits in kLeafStackGuard skip the prologue's
+  // stack check; whoever calls them has already made room.
+  bool needsStackCheck() const;
+  // The room heap growth must leave below the stack pointer.
+  static cell_t HeapMargin();
+
+  // If the previous instruction in the block set |reg| to a constant,
+  // returns true and sets |value|.
+  bool knownConstant(PawnReg reg, cell_t* value) const;
+
+  // The multiplier and shift that divide by |divisor| with a multiply, as in
+  // Hacker's Delight, 10-1. |divisor| must not be 0, 1, -1, INT_MIN or a
+  // power of two.
+  static void ComputeDivisionMagic(int32_t divisor, int32_t* multiplier, int32_t* shift);
+
   // Helpers.
-  static int CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void** addrp, uint8_t* pc);
+  static int CompileFromThunk(PluginContext* cx, cell_t pcode_offs, CallThunkResult* out,
+                              uint8_t* pc);
   static void* find_entry_fp();
   static void InvokeReportError(int err);
   static void InvokeReportTimeout();
@@ -96,18 +172,63 @@ class CompilerBase : public PcodeVisitor
   }
 
   bool isNextBlock(Block* target) {
+    if (unrolling_)
+      return target == copy_next_ && target != unrolling_->header;
     return target->id() == (block_->id() + 1);
   }
   bool isBackedge(Block* target) {
+    if (!unrolling_ && loops_ && isUnrolledBackedge(target))
+      return false;
     return target->id() <= block_->id();
   }
 
+  // Where a jump from the current block to |target| goes. This is the
+  // block's own label, unless an unrolled loop is involved; see LoopAnalysis.
+  Label* labelFor(Block* target);
+  // Whether a jump to |target| is the back-edge of a loop that is unrolled.
+  bool isUnrolledBackedge(Block* target) const;
+  Label* copyLabel(const LoopAnalysis::Loop* loop, Block* block);
+
+  // Records a native call for table unwinding. Offsets are those of the
+  // current pc; |landing| must be bound by the end of compilation.
+  void addUnwindEntry(uint32_t site, uint32_t ret, uint32_t slot, Label* landing) {
+    UnwindEntry entry;
+    entry.site = site;
+    entry.ret = ret;
+    entry.slot = slot;
+    entry.landing = 0;
+    unwind_entries_.push_back(entry);
+    landing_pads_.push_back(landing);
+  }
+
  protected:
   void emitErrorPath(ErrorPath* path);
+
+  // Returns the thunk for |err| at the current instruction. A thunk only
+  // records the error and the cip, so all of an instruction's checks for the
+  // same error share one.
+  ErrorPath* errorPathFor(int err);
+  void emitInterruptCheckPath(InterruptCheckPath* path);
+
+  // A BREAK's patchable jump, and the debugger call it can be pointed at;
+  // see BreakSite.
+  void emitDebugBreakSite();
+  void emitDebugBreakPath(DebugBreakPath* path);
   void emitThrowPathIfNeeded(int err);
 
   void reportError(int err);
 
+  // Returns true if the BOUNDS at the current instruction can never fail.
+  bool isRedundantBoundsCheck() const {
+    return bounds_ && bounds_->isRedundant(op_cip_);
+  }
+
+  // Returns true if the LOAD.I, STOR.I, or FILL at the current instruction
+  // accesses a local array element at a known frame offset.
+  bool elementSlot(cell_t* offset) const {
+    return !inlining_ && elements_ && elements_->slotFor(op_cip_, offset);
+  }
+
  protected:
   Environment* env_;
   PluginRuntime* rt_;
@@ -121,10 +242,33 @@ class CompilerBase : public PcodeVisitor
   uint32_t pcode_start_;
   const cell_t* code_start_;
   const cell_t* op_cip_;
+  // The instruction before op_cip_ in the same block, or null.
+  const cell_t* prev_cip_;
+  std::unique_ptr<FrameElementAccesses> elements_;
+  std::unique_ptr<LoopAnalysis> loops_;
+  std::unique_ptr<BoundsAnalysis> bounds_;
+  std::unique_ptr<HeapCheckAnalysis> heap_checks_;
+  CodeAllocator* code_alloc_;
+
+  // Whether the method calls other scripted code.
+  bool makes_calls_;
+
+  // True while an inlined body is emitted. Frame accesses are then relative
+  // to the stack pointer, by kInlineFrameBias.
+  bool inlining_;
+
+  // The loop whose copy is being emitted, if any, and the block after the
+  // current one in the copy.
+  const LoopAnalysis::Loop* unrolling_;
+  Block* copy_next_;
+  // The labels of each unrolled loop's copy, indexed like its body.
+  std::vector<std::unique_ptr<Label[]>> copy_labels_;
 
   MacroAssembler masm;
 
   std::vector<OutOfLinePath*> ool_paths_;
+  // The error thunks made for the instruction at op_cip_.
+  std::vector<ErrorPath*> op_error_paths_;
 
   Label throw_timeout_;
   Label throw_error_code_[SP_MAX_ERROR_CODES];
@@ -134,9 +278,13 @@ class CompilerBase : public PcodeVisitor
 
   // Debugging.
   Label debug_break_;
+  std::vector<DebugBreakPath*> break_paths_;
 
   std::vector<BackwardJump> backward_jumps_;
   std::vector<CipMapEntry> cip_map_;
+  std::vector<OsrEntry> osr_entries_;
+  std::vector<UnwindEntry> unwind_entries_;
+  std::vector<Label*> landing_pads_;
 };
 
 } // namespace sp
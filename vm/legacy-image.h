@@ -43,6 +43,11 @@ class LegacyImage
   virtual size_t NumNatives() const = 0;
   virtual const char* GetNative(size_t index) const = 0;
   virtual bool FindNative(const char* name, size_t* indexp) const = 0;
+  // Each native's place in the manifest |*manifest|, or null.
+  virtual const uint32_t* NativeOrdinals(uint32_t* manifest) const = 0;
+  // The signature the plugin declared for a native, encoded as in
+  // smx_rtti_method::signature. Returns false if the image has none.
+  virtual bool GetNativeSignature(size_t index, const uint8_t** bytes, size_t* length) = 0;
   virtual size_t NumPublics() const = 0;
   virtual void GetPublic(size_t index, uint32_t* offsetp, const char** namep) const = 0;
   virtual bool FindPublic(const char* name, size_t* indexp) const = 0;
@@ -53,11 +58,16 @@ class LegacyImage
   virtual size_t ImageSize() const = 0;
   virtual const char* LookupFile(uint32_t code_offset) = 0;
   virtual const char* LookupFunction(uint32_t code_offset) = 0;
+  // Finds the code range [start, end) of the function containing the offset.
+  virtual bool LookupFunctionRange(uint32_t code_offset, uint32_t* start, uint32_t* end) = 0;
   virtual bool LookupLine(uint32_t code_offset, uint32_t* line) = 0;
   virtual bool LookupFunctionAddress(const char* function, const char* file, ucell_t *addr) = 0;
   virtual bool LookupLineAddress(const uint32_t line, const char* file, ucell_t* addr) = 0;
   virtual size_t NumFiles() const = 0;
   virtual const char* GetFileName(size_t index) const = 0;
+  // Global variables named in the debug info, and their addresses in .data.
+  virtual size_t NumDebugGlobals() = 0;
+  virtual void GetDebugGlobal(size_t index, uint32_t* addressp, const char** namep) = 0;
 };
 
 class EmptyImage : public LegacyImage
@@ -95,6 +105,12 @@ class EmptyImage : public LegacyImage
   bool FindNative(const char* name, size_t* indexp) const override {
     return false;
   }
+  const uint32_t* NativeOrdinals(uint32_t* manifest) const override {
+    return nullptr;
+  }
+  bool GetNativeSignature(size_t index, const uint8_t** bytes, size_t* length) override {
+    return false;
+  }
   size_t NumPublics() const override {
     return 0;
   }
@@ -123,6 +139,9 @@ class EmptyImage : public LegacyImage
   const char* LookupFunction(uint32_t code_offset) override {
     return nullptr;
   }
+  bool LookupFunctionRange(uint32_t code_offset, uint32_t* start, uint32_t* end) override {
+    return false;
+  }
   bool LookupLine(uint32_t code_offset, uint32_t* line) override {
     return false;
   }
@@ -138,6 +157,11 @@ class EmptyImage : public LegacyImage
   const char* GetFileName(size_t index) const override {
     return nullptr;
   }
+  size_t NumDebugGlobals() override {
+    return 0;
+  }
+  void GetDebugGlobal(size_t index, uint32_t* addressp, const char** namep) override {
+  }
 
  private:
   size_t heap_size_;
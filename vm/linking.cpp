@@ -16,15 +16,29 @@
 using namespace sp;
 
 CodeChunk
-sp::LinkCode(Environment* env, Assembler& masm)
+sp::LinkCode(Environment* env, Assembler& masm, bool hot)
 {
   if (masm.outOfMemory())
     return CodeChunk();
 
-  CodeChunk code = env->AllocateCode(masm.length());
+  CodeChunk code = env->AllocateCode(masm.length(), hot);
   if (!code.address())
     return code;
 
-  masm.emitToExecutableMemory(code.address());
+  masm.emitToExecutableMemory(code.address(), code.writable());
+  return code;
+}
+
+CodeChunk
+sp::LinkCode(CodeAllocator* alloc, Assembler& masm, bool hot)
+{
+  if (masm.outOfMemory())
+    return CodeChunk();
+
+  CodeChunk code = alloc->Allocate(masm.length(), hot);
+  if (!code.address())
+    return code;
+
+  masm.emitToExecutableMemory(code.address(), code.writable());
   return code;
 }
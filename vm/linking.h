@@ -18,9 +18,12 @@
 
 namespace sp {
 
+class CodeAllocator;
 class Environment;
 
-CodeChunk LinkCode(Environment* env, Assembler& masm);
+// |hot| places the code with other hot code; see CodePool.
+CodeChunk LinkCode(Environment* env, Assembler& masm, bool hot = false);
+CodeChunk LinkCode(CodeAllocator* alloc, Assembler& masm, bool hot = false);
 
 }
 
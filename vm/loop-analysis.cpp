@@ -0,0 +1,204 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "loop-analysis.h"
+#include <smx/smx-v1-opcodes.h>
+
+#include <algorithm>
+
+namespace sp {
+
+LoopAnalysis::LoopAnalysis(ControlFlowGraph* graph, const FrameElementAccesses* elements)
+ : graph_(graph),
+   elements_(elements)
+{
+}
+
+void
+LoopAnalysis::analyze()
+{
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    ForEachInstruction(*iter, [this](const cell_t* cip, const cell_t* prev) -> void {
+      FrameEffects fx;
+      DecodeFrameEffects(cip, prev, false, &fx, elements_);
+      aliasing_.scan(fx);
+    });
+  }
+
+  for (auto iter = graph_->rpoBegin(); iter != graph_->rpoEnd(); iter++) {
+    Block* header = *iter;
+    if (!header->isLoopHeader())
+      continue;
+
+    Loop loop;
+    if (!findBody(header, &loop) || !findInductionVariable(&loop))
+      continue;
+    loops_.push_back(std::move(loop));
+  }
+}
+
+bool
+LoopAnalysis::findBody(Block* header, Loop* loop)
+{
+  std::vector<Block*>* body = &loop->body;
+  loop->header = header;
+  loop->latch = nullptr;
+  for (const auto& pred : header->predecessors()) {
+    if (!header->dominates(pred))
+      continue;
+    if (loop->latch)
+      return false;
+    loop->latch = pred;
+  }
+  if (!loop->latch)
+    return false;
+
+  graph_->newEpoch();
+  header->setVisited();
+  body->push_back(header);
+
+  std::vector<Block*> worklist;
+  if (!loop->latch->visited()) {
+    loop->latch->setVisited();
+    worklist.push_back(loop->latch);
+  }
+  while (!worklist.empty()) {
+    Block* block = worklist.back();
+    worklist.pop_back();
+    body->push_back(block);
+
+    for (const auto& pred : block->predecessors()) {
+      if (!pred->visited()) {
+        pred->setVisited();
+        worklist.push_back(pred);
+      }
+    }
+  }
+
+  uint32_t bytes = 0;
+  for (Block* block : *body) {
+    if (block != header && block->isLoopHeader())
+      return false;
+
+    const uint8_t* end = block->end();
+    if (block->endType() == BlockEnd::Insn) {
+      // Jump targets would have to be copied too.
+      if (*reinterpret_cast<const cell_t*>(end) == OP_SWITCH)
+        return false;
+      end = NextInstruction(end);
+    }
+    bytes += uint32_t(end - block->start());
+  }
+  if (bytes > kMaxUnrolledLoopBytes)
+    return false;
+
+  // The header comes first, since it dominates the rest.
+  std::sort(body->begin(), body->end(), [](Block* a, Block* b) -> bool {
+    return a->id() < b->id();
+  });
+  return true;
+}
+
+bool
+LoopAnalysis::findInductionVariable(Loop* loop)
+{
+  struct Write {
+    cell_t offset;
+    Block* block;
+    cell_t step;
+  };
+  std::vector<Write> writes;
+  std::vector<cell_t> exit_reads;
+
+  for (Block* block : loop->body) {
+    bool exits = false;
+    for (const auto& succ : block->successors()) {
+      if (!loop->contains(succ))
+        exits = true;
+    }
+
+    const cell_t* prev2 = nullptr;
+    ForEachInstruction(block, [&](const cell_t* cip, const cell_t* prev) -> void {
+      FrameEffects fx;
+      DecodeFrameEffects(cip, prev, false, &fx, elements_);
+
+      bool steps = (*cip == OP_INC_S || *cip == OP_DEC_S);
+      for (size_t i = 0; i < fx.naccesses; i++) {
+        const SlotAccess& access = fx.accesses[i];
+        if (access.reads && !steps) {
+          if (exits)
+            exit_reads.push_back(access.offset);
+          continue;
+        }
+
+        // A step of zero means the slot is written some other way.
+        Write write = { access.offset, block, 0 };
+        if (*cip == OP_INC_S) {
+          write.step = 1;
+        } else if (*cip == OP_DEC_S) {
+          write.step = -1;
+        } else if (*cip == OP_STOR_S_PRI && prev && prev2 && *prev == OP_ADD_C &&
+                   *prev2 == OP_LOAD_S_PRI && prev2[1] == cip[1])
+        {
+          write.step = prev[1];
+        }
+        writes.push_back(write);
+      }
+      prev2 = prev;
+    });
+  }
+
+  std::sort(writes.begin(), writes.end(), [](const Write& a, const Write& b) -> bool {
+    return a.offset < b.offset;
+  });
+
+  for (size_t i = 0; i < writes.size(); i++) {
+    const Write& write = writes[i];
+    bool only = (i == 0 || writes[i - 1].offset != write.offset) &&
+                (i + 1 == writes.size() || writes[i + 1].offset != write.offset);
+    if (!only || !write.step || !aliasing_.isTrackable(write.offset))
+      continue;
+
+    // Stepped on every iteration, and tested on the way out.
+    if (!write.block->dominates(loop->latch))
+      continue;
+    if (std::find(exit_reads.begin(), exit_reads.end(), write.offset) == exit_reads.end())
+      continue;
+
+    loop->iv = write.offset;
+    loop->step = write.step;
+    return true;
+  }
+  return false;
+}
+
+bool
+LoopAnalysis::Loop::contains(Block* block) const
+{
+  return std::binary_search(body.begin(), body.end(), block, [](Block* a, Block* b) -> bool {
+    return a->id() < b->id();
+  });
+}
+
+const LoopAnalysis::Loop*
+LoopAnalysis::unrollableAt(Block* block) const
+{
+  auto iter = std::lower_bound(loops_.begin(), loops_.end(), block->id(),
+                               [](const Loop& loop, uint32_t id) -> bool {
+                                 return loop.header->id() < id;
+                               });
+  if (iter == loops_.end() || iter->header != block)
+    return nullptr;
+  return &*iter;
+}
+
+} // namespace sp
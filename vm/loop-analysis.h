@@ -0,0 +1,83 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+
+#ifndef _include_sourcepawn_vm_loop_analysis_h_
+#define _include_sourcepawn_vm_loop_analysis_h_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <sp_vm_types.h>
+#include "control-flow.h"
+#include "frame-effects.h"
+
+namespace sp {
+
+// Loops whose blocks together are at most this many bytes of p-code may be
+// unrolled.
+static const uint32_t kMaxUnrolledLoopBytes = 256;
+
+// Finds small counted loops, which the JIT unrolls once: the original's
+// back-edge goes on to a copy of the loop, and only the copy's goes back, so
+// every other iteration pays for it.
+//
+// A counted loop is an innermost natural loop with a single back-edge, and an
+// induction variable: a frame slot whose address is never taken, stepped by a
+// constant exactly once per iteration, and read by a block that can leave the
+// loop.
+class LoopAnalysis
+{
+ public:
+  struct Loop {
+    Block* header;
+    Block* latch;
+    // Every block in the loop, in reverse postorder. The header is first.
+    std::vector<Block*> body;
+    // The induction variable, and what it is stepped by.
+    cell_t iv;
+    cell_t step;
+
+    bool contains(Block* block) const;
+  };
+
+  LoopAnalysis(ControlFlowGraph* graph, const FrameElementAccesses* elements);
+
+  void analyze();
+
+  // Returns the loop headed by |block| if it can be unrolled, or null.
+  const Loop* unrollableAt(Block* block) const;
+
+  size_t numLoops() const {
+    return loops_.size();
+  }
+  const Loop& loop(size_t index) const {
+    return loops_[index];
+  }
+
+ private:
+  bool findBody(Block* header, Loop* loop);
+  bool findInductionVariable(Loop* loop);
+
+ private:
+  ControlFlowGraph* graph_;
+  const FrameElementAccesses* elements_;
+  FrameAliasing aliasing_;
+
+  // Sorted by header id.
+  std::vector<Loop> loops_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_loop_analysis_h_
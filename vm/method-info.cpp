@@ -15,15 +15,22 @@
 #include "method-info.h"
 #include "method-verifier.h"
 #include "graph-builder.h"
+#include "opcode-histogram.h"
+#include "threaded-code.h"
+#include "image-cache.h"
 
 namespace sp {
 
 MethodInfo::MethodInfo(PluginRuntime* rt, uint32_t codeOffset)
  : rt_(rt),
    pcode_offset_(codeOffset),
+   threaded_checked_(false),
    checked_(false),
    validation_error_(SP_ERROR_NONE),
-   max_stack_(0)
+   max_stack_(0),
+   callees_known_(false),
+   invocation_count_(0),
+   backedge_count_(0)
 {
 }
 
@@ -38,22 +45,81 @@ MethodInfo::setCompiledFunction(CompiledFunction* fun)
 
   // Grab the lock before linking code in, since the watchdog timer will look
   // at this on another thread.
-  std::lock_guard<ke::Mutex> lock(Environment::get()->lock());
+  std::lock_guard<ke::Mutex> lock(rt_->env()->lock());
   jit_.reset(fun);
+  rt_->ArmBreakSites(fun);
+}
+
+ThreadedCode*
+MethodInfo::threadedCode()
+{
+  assert(checked_ && validation_error_ == SP_ERROR_NONE);
+  if (!threaded_checked_) {
+    threaded_ = ThreadedCode::Build(rt_, pcode_offset_);
+    threaded_checked_ = true;
+  }
+  return threaded_.get();
+}
+
+void
+MethodInfo::dropCodeReferences()
+{
+  graph_ = nullptr;
+  threaded_ = nullptr;
+  threaded_checked_ = false;
+}
+
+OpcodeHistogram*
+MethodInfo::countExecutedOps()
+{
+  if (!executed_ops_)
+    executed_ops_.reset(new OpcodeHistogram());
+  return executed_ops_.get();
 }
 
 void
 MethodInfo::InternalValidate()
 {
+  callees_.clear();
+
   MethodVerifier verifier(rt_, pcode_offset_);
+  verifier.collectExternalFuncRefs([this](cell_t offset) -> void {
+    callees_.push_back(offset);
+  });
   graph_ = verifier.verify();
   if (graph_) {
     max_stack_ = verifier.max_stack();
+    validation_error_ = SP_ERROR_NONE;
   } else {
     validation_error_ = verifier.error();
   }
 
   checked_ = true;
+  callees_known_ = true;
+
+  if (SharedImage* shared = rt_->shared_image())
+    shared->AddVerified(pcode_offset_, validation_error_, max_stack_);
+}
+
+void
+MethodInfo::BuildGraph()
+{
+  assert(checked_ && validation_error_ == SP_ERROR_NONE);
+
+  GraphBuilder builder(rt_, pcode_offset_);
+  graph_ = builder.build();
+  if (!graph_)
+    validation_error_ = builder.error_code();
+}
+
+bool
+MethodInfo::LoadSharedValidation()
+{
+  SharedImage* shared = rt_->shared_image();
+  if (!shared || !shared->LookupVerified(pcode_offset_, &validation_error_, &max_stack_))
+    return false;
+  checked_ = true;
+  return true;
 }
 
 } // namespace sp
@@ -13,6 +13,9 @@
 #ifndef _INCLUDE_SOURCEPAWN_VM_METHOD_INFO_H_
 #define _INCLUDE_SOURCEPAWN_VM_METHOD_INFO_H_
 
+#include <stdint.h>
+#include <functional>
+#include <vector>
 #include <sp_vm_types.h>
 #include <amtl/am-refcounting.h>
 #include "control-flow.h"
@@ -21,29 +24,56 @@ namespace sp {
 
 class PluginRuntime;
 class CompiledFunction;
+class OpcodeHistogram;
+class ThreadedCode;
 
-class MethodInfo final : public ke::Refcounted<MethodInfo>
+// Threadsafe, since the background precompiler holds references.
+class MethodInfo final : public ke::RefcountedThreadsafe<MethodInfo>
 {
  public:
   MethodInfo(PluginRuntime* rt, uint32_t codeOffset);
   ~MethodInfo();
 
   int Validate() {
-    if (!checked_) {
+    if (!checked_ && !LoadSharedValidation()) {
       InternalValidate();
       graph_ = nullptr;
     }
     return validation_error_;
   }
+  // A method that was already verified only has its graph rebuilt, rather
+  // than being verified again.
   ke::RefPtr<ControlFlowGraph> ValidateWithGraph() {
-    if (!checked_ || !graph_)
+    if (!checked_ && !LoadSharedValidation())
       InternalValidate();
+    else if (!graph_ && validation_error_ == SP_ERROR_NONE)
+      BuildGraph();
+    return graph_.take();
+  }
+
+  // Like ValidateWithGraph(), but also calls |on_call| with the target of
+  // every CALL in the method. The targets are remembered from verifying, so
+  // this only re-verifies if the method was verified by another runtime.
+  typedef std::function<void(cell_t)> CallCallback;
+  ke::RefPtr<ControlFlowGraph> ValidateWithCallees(const CallCallback& on_call) {
+    if (!checked_ || !callees_known_)
+      InternalValidate();
+    else if (!graph_ && validation_error_ == SP_ERROR_NONE)
+      BuildGraph();
+    if (validation_error_ != SP_ERROR_NONE)
+      return nullptr;
+    for (cell_t callee : callees_)
+      on_call(callee);
     return graph_.take();
   }
 
   int validationError() const {
     return validation_error_;
   }
+  // Targets of the method's CALLs, or null if it wasn't verified here.
+  const std::vector<cell_t>* knownCallees() const {
+    return checked_ && callees_known_ ? &callees_ : nullptr;
+  }
   uint32_t pcode_offset() const {
     return pcode_offset_;
   }
@@ -56,18 +86,69 @@ class MethodInfo final : public ke::Refcounted<MethodInfo>
     return jit_.get();
   }
 
+  // The method translated for the interpreter, built on first use. Returns
+  // null if it can't be translated. The method must have been validated.
+  ThreadedCode* threadedCode();
+
+  // What the interpreter ran of this method while opcode counting was on,
+  // created on first use. executedOps() is null if nothing was counted.
+  OpcodeHistogram* countExecutedOps();
+  const OpcodeHistogram* executedOps() const {
+    return executed_ops_.get();
+  }
+
+  // Called when the runtime's code is replaced by code in which this method
+  // is unchanged. What was compiled is kept, but nothing that points into
+  // the old code.
+  void dropCodeReferences();
+
+  // Counters used to decide when an interpreted method should be compiled.
+  void addInvocation() {
+    if (invocation_count_ < UINT32_MAX)
+      invocation_count_++;
+  }
+  void addBackEdge() {
+    if (backedge_count_ < UINT32_MAX)
+      backedge_count_++;
+  }
+  uint64_t hotness() const {
+    return uint64_t(invocation_count_) + backedge_count_;
+  }
+
+  // Credits the method with hotness recorded by an earlier run.
+  void seedHotness(uint64_t hotness) {
+    uint32_t count = hotness > UINT32_MAX ? UINT32_MAX : uint32_t(hotness);
+    if (count > invocation_count_)
+      invocation_count_ = count;
+  }
+
  private:
   void InternalValidate();
+  void BuildGraph();
+
+  // Takes the result of verifying this method in another runtime sharing
+  // the same image, if there is one.
+  bool LoadSharedValidation();
 
  private:
   PluginRuntime* rt_;
   uint32_t pcode_offset_;
   std::unique_ptr<CompiledFunction> jit_;
+  std::unique_ptr<ThreadedCode> threaded_;
+  bool threaded_checked_;
+  std::unique_ptr<OpcodeHistogram> executed_ops_;
   ke::RefPtr<ControlFlowGraph> graph_;
 
   bool checked_;
   int validation_error_;
   int32_t max_stack_;
+
+  // Targets of the method's CALLs, if it was verified here.
+  std::vector<cell_t> callees_;
+  bool callees_known_;
+
+  uint32_t invocation_count_;
+  uint32_t backedge_count_;
 };
 
 } // namespace sp
@@ -349,9 +349,17 @@ MethodVerifier::verifyOp(OPCODE op)
   }
 
   case OP_TRACKER_PUSH_C:
+  {
+    // Trackers are pushed inline by the JIT, which relies on the amount
+    // being a valid size.
+    cell_t amount = readCell();
+    if (amount < 0) {
+      reportError(SP_ERROR_INSTRUCTION_PARAM);
+      return false;
+    }
     block_->data<VerifyData>()->heap_balance.push_back(-1);
-    cip_++;
     return true;
+  }
 
   case OP_HALT:
   {
@@ -495,6 +503,25 @@ MethodVerifier::verifyOp(OPCODE op)
     return true;
   }
 
+  case OP_LIDX_S_BOUNDS:
+  case OP_IDXADDR_S_BOUNDS:
+  {
+    if (!(code_features_ & SmxConsts::kCodeFeatureFusedIndex)) {
+      reportError(SP_ERROR_INVALID_INSTRUCTION);
+      return false;
+    }
+
+    cell_t array = readCell();
+    cell_t index = readCell();
+    cip_++;
+    if (!verifyStackOffset(array) ||
+        !verifyStackOffset(index))
+    {
+      return false;
+    }
+    return true;
+  }
+
   case OP_CASETBL:
     cip_ = insn_ + GetCaseTableSize(reinterpret_cast<const uint8_t*>(insn_));
     return true;
@@ -0,0 +1,201 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+// 
+// Copyright (C) 2006-2018 AlliedModders LLC
+// 
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <utility>
+
+#include "native-registry.h"
+#include "plugin-runtime.h"
+#include "typed-natives.h"
+
+using namespace sp;
+
+NativeRegistry::NativeRegistry(StringPool* atoms)
+ : atoms_(atoms),
+   generation_(0),
+   has_manifest_(false),
+   manifest_id_(0)
+{
+  manifest_.generation = 0;
+  scratch_.generation = 0;
+}
+
+bool
+NativeRegistry::Initialize()
+{
+  return natives_.init(256) && lists_.init(32);
+}
+
+bool
+NativeRegistry::add(const char* name, const Binding& binding)
+{
+  Atom* atom = atoms_->add(name);
+  if (!atom)
+    return false;
+
+  NativeMap::Insert p = natives_.findForAdd(atom);
+  if (p.found()) {
+    p->value = binding;
+    return true;
+  }
+  return natives_.add(p, atom, binding);
+}
+
+bool
+NativeRegistry::Register(const sp_nativeinfo_t* natives)
+{
+  bool ok = true;
+  for (size_t i = 0; ok && natives[i].name; i++) {
+    Binding binding;
+    binding.func = natives[i].func;
+    ok = add(natives[i].name, binding);
+  }
+  generation_++;
+  return ok;
+}
+
+bool
+NativeRegistry::RegisterTyped(const sp_typed_nativeinfo_t* natives)
+{
+  bool ok = true;
+  for (size_t i = 0; ok && natives[i].name; i++) {
+    if (!IsValidTypedNative(&natives[i])) {
+      ok = false;
+      break;
+    }
+    Binding binding;
+    binding.typed = natives[i];
+    binding.typed.name = nullptr;
+    ok = add(natives[i].name, binding);
+  }
+  generation_++;
+  return ok;
+}
+
+bool
+NativeRegistry::SetManifest(uint32_t id, const char* const* names, size_t count)
+{
+  has_manifest_ = false;
+  manifest_.names.clear();
+  manifest_.funcs.clear();
+  for (size_t i = 0; i < count; i++) {
+    Atom* atom = atoms_->add(names[i]);
+    if (!atom)
+      return false;
+    manifest_.names.push_back(atom);
+  }
+  manifest_.generation = generation_ - 1;
+  manifest_id_ = id;
+  has_manifest_ = true;
+  return true;
+}
+
+NativeRegistry::Binding
+NativeRegistry::lookup(Atom* name)
+{
+  NativeMap::Result r = natives_.find(name);
+  return r.found() ? r->value : Binding();
+}
+
+// Resolves the whole manifest once per Register(), then a plugin's natives
+// are copied out by ordinal.
+const NativeRegistry::Resolved*
+NativeRegistry::resolveManifest(PluginRuntime* rt, const uint32_t* ordinals)
+{
+  if (manifest_.generation != generation_) {
+    manifest_.funcs.resize(manifest_.names.size());
+    for (size_t i = 0; i < manifest_.names.size(); i++)
+      manifest_.funcs[i] = lookup(manifest_.names[i]);
+    manifest_.generation = generation_;
+  }
+
+  size_t count = rt->image()->NumNatives();
+  scratch_.funcs.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    Atom* name = rt->NativeName(i);
+    uint32_t ordinal = ordinals[i];
+    if (ordinal < manifest_.names.size() && manifest_.names[ordinal] == name)
+      scratch_.funcs[i] = manifest_.funcs[ordinal];
+    else
+      scratch_.funcs[i] = lookup(name);
+  }
+  return &scratch_;
+}
+
+const NativeRegistry::Resolved*
+NativeRegistry::resolve(std::vector<Atom*>&& names)
+{
+  uint32_t hash = 0;
+  for (Atom* name : names)
+    hash = hash * 31 + ke::HashPointer(name);
+
+  ListCache::Insert p = lists_.findForAdd(hash);
+  if (!p.found()) {
+    if (!lists_.add(p, hash, std::vector<std::unique_ptr<Resolved>>()))
+      return nullptr;
+  }
+
+  Resolved* entry = nullptr;
+  for (const auto& candidate : p->value) {
+    if (candidate->names == names) {
+      entry = candidate.get();
+      break;
+    }
+  }
+  if (entry && entry->generation == generation_)
+    return entry;
+
+  if (!entry) {
+    p->value.emplace_back(std::make_unique<Resolved>());
+    entry = p->value.back().get();
+    entry->names = std::move(names);
+  }
+
+  entry->funcs.resize(entry->names.size());
+  for (size_t i = 0; i < entry->names.size(); i++)
+    entry->funcs[i] = lookup(entry->names[i]);
+  entry->generation = generation_;
+  return entry;
+}
+
+size_t
+NativeRegistry::BindAll(PluginRuntime* rt)
+{
+  const Resolved* list;
+  uint32_t manifest;
+  const uint32_t* ordinals = rt->image()->NativeOrdinals(&manifest);
+  if (ordinals && has_manifest_ && manifest == manifest_id_) {
+    list = resolveManifest(rt, ordinals);
+  } else {
+    std::vector<Atom*> names(rt->image()->NumNatives());
+    for (size_t i = 0; i < names.size(); i++)
+      names[i] = rt->NativeName(i);
+    list = resolve(std::move(names));
+  }
+  if (!list)
+    return 0;
+
+  size_t bound = 0;
+  for (size_t i = 0; i < list->funcs.size(); i++) {
+    const Binding& binding = list->funcs[i];
+    if (!binding.bound() || rt->NativeAt(i)->status == SP_NATIVE_BOUND)
+      continue;
+
+    int err;
+    if (binding.typed.func)
+      err = rt->UpdateTypedNativeBinding(uint32_t(i), &binding.typed, 0, nullptr);
+    else
+      err = rt->UpdateNativeBinding(uint32_t(i), binding.func, 0, nullptr);
+    if (err == SP_ERROR_NONE)
+      bound++;
+  }
+  return bound;
+}
@@ -0,0 +1,123 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+// 
+// Copyright (C) 2006-2018 AlliedModders LLC
+// 
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_native_registry_h_
+#define _include_sourcepawn_vm_native_registry_h_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <sp_vm_types.h>
+#include <amtl/am-hashmap.h>
+#include "shared/string-pool.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// Natives the host registers once for every plugin. Names are interned in
+// the environment's atoms, where plugins' native names already are, so
+// binding a plugin is pointer comparison. Plugins importing the same list of
+// natives share one resolved table.
+//
+// A plugin compiled against the host's native manifest instead carries each
+// native's index in that list, and binds by indexing it. A native whose name
+// doesn't match the manifest at its index is looked up by name.
+class NativeRegistry
+{
+ public:
+  explicit NativeRegistry(StringPool* atoms);
+
+  bool Initialize();
+
+  // Adds a table terminated by a null name. A name registered again replaces
+  // the earlier function.
+  bool Register(const sp_nativeinfo_t* natives);
+
+  // Same as Register, for typed natives. Fails if a signature is invalid.
+  bool RegisterTyped(const sp_typed_nativeinfo_t* natives);
+
+  // Replaces the manifest that plugins' ordinals refer to.
+  bool SetManifest(uint32_t id, const char* const* names, size_t count);
+
+  // Binds every native of |rt| that is registered and not already bound, and
+  // returns how many were bound.
+  size_t BindAll(PluginRuntime* rt);
+
+ private:
+  // A registered native; |typed.func| is set for typed natives.
+  struct Binding {
+    Binding()
+     : func(nullptr),
+       typed()
+    {}
+    SPVM_NATIVE_FUNC func;
+    sp_typed_nativeinfo_t typed;
+
+    bool bound() const {
+      return func || typed.func;
+    }
+  };
+
+  struct Resolved {
+    std::vector<Atom*> names;
+    std::vector<Binding> funcs;
+    uint32_t generation;
+  };
+
+  bool add(const char* name, const Binding& binding);
+  const Resolved* resolve(std::vector<Atom*>&& names);
+  const Resolved* resolveManifest(PluginRuntime* rt, const uint32_t* ordinals);
+  Binding lookup(Atom* name);
+
+  struct AtomPolicy {
+    static inline bool matches(Atom* a, Atom* b) {
+      return a == b;
+    }
+    static inline uint32_t hash(Atom* key) {
+      return ke::HashPointer(key);
+    }
+  };
+  typedef ke::HashMap<Atom*, Binding, AtomPolicy> NativeMap;
+
+  struct ListPolicy {
+    static inline bool matches(uint32_t a, uint32_t b) {
+      return a == b;
+    }
+    static inline uint32_t hash(uint32_t key) {
+      return key;
+    }
+  };
+  // Keyed by a hash of the interned name list; each bucket holds every list
+  // with that hash.
+  typedef ke::HashMap<uint32_t, std::vector<std::unique_ptr<Resolved>>, ListPolicy> ListCache;
+
+  StringPool* atoms_;
+  NativeMap natives_;
+  ListCache lists_;
+
+  // Bumped by every Register(), so cached lists resolved before it are redone.
+  uint32_t generation_;
+
+  bool has_manifest_;
+  uint32_t manifest_id_;
+  Resolved manifest_;
+
+  // The plugin's natives, in the order of its table, for the manifest path.
+  Resolved scratch_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_native_registry_h_
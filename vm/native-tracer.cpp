@@ -0,0 +1,118 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <algorithm>
+
+#include "environment.h"
+#include "native-tracer.h"
+#include "plugin-runtime.h"
+
+using namespace sp;
+
+void
+NativeCallStats::add(uint64_t ns)
+{
+  size_t bucket = 0;
+  for (uint64_t v = ns >> 1; v && bucket < kBuckets - 1; v >>= 1)
+    bucket++;
+
+  calls++;
+  total_ns += ns;
+  max_ns = std::max(max_ns, ns);
+  buckets[bucket]++;
+}
+
+uint64_t
+NativeCallStats::percentile(double percent) const
+{
+  uint64_t wanted = uint64_t(double(calls) * percent / 100.0);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+    if (seen > wanted)
+      return std::min(uint64_t(1) << (i + 1), max_ns);
+  }
+  return max_ns;
+}
+
+AutoTraceNative::AutoTraceNative(Environment* env, PluginRuntime* rt, uint32_t native_index)
+ : rt_(env->IsNativeTracingEnabled() ? rt : nullptr),
+   native_index_(native_index),
+   event_(env->timeline(), Timeline::Kind::Native, rt, native_index)
+{
+  if (rt_)
+    start_ = std::chrono::steady_clock::now();
+}
+
+AutoTraceNative::~AutoTraceNative()
+{
+  if (!rt_)
+    return;
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+  rt_->nativeStats(native_index_)->add(ns);
+}
+
+void
+sp::WriteNativeTrace(const std::vector<PluginRuntime*>& runtimes, FILE* fp)
+{
+  struct Row {
+    PluginRuntime* rt;
+    uint32_t index;
+    const NativeCallStats* stats;
+  };
+  std::vector<Row> rows;
+  for (PluginRuntime* rt : runtimes) {
+    if (!rt->native_stats())
+      continue;
+    for (uint32_t i = 0; i < rt->image()->NumNatives(); i++) {
+      const NativeCallStats& stats = rt->native_stats()[i];
+      if (stats.calls)
+        rows.push_back(Row{rt, i, &stats});
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) -> bool {
+    return a.stats->total_ns > b.stats->total_ns;
+  });
+
+  fprintf(fp, "%-24s %-32s %10s %12s %10s %10s %10s %10s\n", "plugin", "native", "calls",
+          "total (ms)", "mean (us)", "p50 (us)", "p99 (us)", "max (us)");
+  for (const Row& row : rows) {
+    const NativeCallStats& stats = *row.stats;
+    fprintf(fp, "%-24s %-32s %10llu %12.3f %10.3f %10.3f %10.3f %10.3f\n",
+            row.rt->Name(), row.rt->NativeAt(row.index)->name,
+            (unsigned long long)stats.calls,
+            double(stats.total_ns) / 1e6,
+            double(stats.total_ns) / double(stats.calls) / 1e3,
+            double(stats.percentile(50)) / 1e3,
+            double(stats.percentile(99)) / 1e3,
+            double(stats.max_ns) / 1e3);
+
+    // The histogram, as "<upper bound>:<calls>" for each non-empty bucket.
+    fprintf(fp, "  ");
+    for (size_t i = 0; i < NativeCallStats::kBuckets; i++) {
+      if (!stats.buckets[i])
+        continue;
+      uint64_t bound = uint64_t(1) << (i + 1);
+      if (bound < 1000)
+        fprintf(fp, " <%lluns:%llu", (unsigned long long)bound,
+                (unsigned long long)stats.buckets[i]);
+      else if (bound < 1000000)
+        fprintf(fp, " <%lluus:%llu", (unsigned long long)(bound / 1000),
+                (unsigned long long)stats.buckets[i]);
+      else
+        fprintf(fp, " <%llums:%llu", (unsigned long long)(bound / 1000000),
+                (unsigned long long)stats.buckets[i]);
+    }
+    fprintf(fp, "\n");
+  }
+}
@@ -0,0 +1,70 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_native_tracer_h_
+#define _include_sourcepawn_vm_native_tracer_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <vector>
+
+#include "timeline.h"
+
+namespace sp {
+
+class Environment;
+class PluginRuntime;
+
+// How long a plugin's calls to one native took, while native tracing was on.
+// Latencies are kept in a log2 histogram: bucket i counts calls that took
+// [2^i, 2^(i+1)) nanoseconds, with bucket 0 also counting calls under 1ns.
+struct NativeCallStats
+{
+  static const size_t kBuckets = 40;
+
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[kBuckets];
+
+  void add(uint64_t ns);
+
+  // Returns the upper bound of the bucket holding the |percent|th
+  // percentile, in nanoseconds.
+  uint64_t percentile(double percent) const;
+};
+
+// Times one native call, if native tracing is on, and records it in the
+// timeline, if there is one.
+class AutoTraceNative
+{
+ public:
+  AutoTraceNative(Environment* env, PluginRuntime* rt, uint32_t native_index);
+  ~AutoTraceNative();
+
+ private:
+  PluginRuntime* rt_;
+  uint32_t native_index_;
+  std::chrono::steady_clock::time_point start_;
+  AutoTimelineEvent event_;
+};
+
+// Writes the statistics of |runtimes|, one line per native a plugin called,
+// most total time first.
+void WriteNativeTrace(const std::vector<PluginRuntime*>& runtimes, FILE* fp);
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_native_tracer_h_
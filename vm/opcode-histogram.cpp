@@ -0,0 +1,203 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "method-info.h"
+#include "opcode-histogram.h"
+#include "opcodes.h"
+#include "plugin-runtime.h"
+
+using namespace sp;
+
+static bool
+HasValueOperands(OPCODE op)
+{
+  switch (op) {
+    case OP_CALL:
+    case OP_JUMP:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+    case OP_SWITCH:
+    case OP_CASETBL:
+      return false;
+    default:
+      return true;
+  }
+}
+
+OpcodeHistogram::OpcodeHistogram()
+ : total_(0)
+{
+  memset(ops_, 0, sizeof(ops_));
+}
+
+void
+OpcodeHistogram::add(const cell_t* cip)
+{
+  ucell_t op = ucell_t(*cip);
+  if (op >= OPCODES_TOTAL)
+    return;
+
+  total_++;
+  ops_[op]++;
+
+  if (!HasValueOperands(OPCODE(op)) || kOpcodeSizes[op] <= 1)
+    return;
+  if (operands_.empty())
+    operands_.resize(OPCODES_TOTAL * kBuckets);
+  for (int i = 1; i < kOpcodeSizes[op]; i++)
+    operands_[op * kBuckets + BucketOf(cip[i])]++;
+}
+
+void
+OpcodeHistogram::merge(const OpcodeHistogram& other)
+{
+  total_ += other.total_;
+  for (size_t i = 0; i < OPCODES_TOTAL; i++)
+    ops_[i] += other.ops_[i];
+
+  if (other.operands_.empty())
+    return;
+  if (operands_.empty())
+    operands_.resize(OPCODES_TOTAL * kBuckets);
+  for (size_t i = 0; i < operands_.size(); i++)
+    operands_[i] += other.operands_[i];
+}
+
+size_t
+OpcodeHistogram::BucketOf(cell_t value)
+{
+  const size_t exact = size_t(kMaxExact - kMinExact + 1);
+  if (value >= kMinExact && value <= kMaxExact)
+    return size_t(value - kMinExact);
+  if (value >= INT8_MIN && value <= INT8_MAX)
+    return exact;
+  if (value >= INT16_MIN && value <= INT16_MAX)
+    return exact + 1;
+  return exact + 2;
+}
+
+void
+OpcodeHistogram::FormatBucket(size_t bucket, char* buffer, size_t maxlength)
+{
+  static const char* const kWidths[] = {"int8", "int16", "int32"};
+
+  const size_t exact = size_t(kMaxExact - kMinExact + 1);
+  if (bucket < exact)
+    snprintf(buffer, maxlength, "%d", int(bucket) + kMinExact);
+  else
+    snprintf(buffer, maxlength, "%s", kWidths[bucket - exact]);
+}
+
+void
+OpcodeHistogram::report(FILE* fp, size_t max_ops, bool operands) const
+{
+  std::vector<size_t> ops;
+  for (size_t i = 0; i < OPCODES_TOTAL; i++) {
+    if (ops_[i])
+      ops.push_back(i);
+  }
+  std::stable_sort(ops.begin(), ops.end(), [this](size_t a, size_t b) -> bool {
+    return ops_[a] > ops_[b];
+  });
+
+  for (size_t i = 0; i < ops.size() && i < max_ops; i++) {
+    size_t op = ops[i];
+    fprintf(fp, "  %-20s %12llu %6.2f%%\n", OpcodeNames[op], (unsigned long long)ops_[op],
+            100.0 * double(ops_[op]) / double(total_));
+  }
+
+  if (!operands || operands_.empty())
+    return;
+
+  for (size_t op : ops) {
+    const uint64_t* buckets = &operands_[op * kBuckets];
+    uint64_t count = 0;
+    std::vector<size_t> order;
+    for (size_t i = 0; i < kBuckets; i++) {
+      if (!buckets[i])
+        continue;
+      count += buckets[i];
+      order.push_back(i);
+    }
+    if (!count)
+      continue;
+    std::stable_sort(order.begin(), order.end(), [buckets](size_t a, size_t b) -> bool {
+      return buckets[a] > buckets[b];
+    });
+
+    fprintf(fp, "  %s operands:\n", OpcodeNames[op]);
+    for (size_t bucket : order) {
+      char name[16];
+      FormatBucket(bucket, name, sizeof(name));
+      fprintf(fp, "    %-8s %12llu %6.2f%%\n", name, (unsigned long long)buckets[bucket],
+              100.0 * double(buckets[bucket]) / double(count));
+    }
+  }
+}
+
+namespace sp {
+
+void
+CountStaticOpcodes(PluginRuntime* rt, OpcodeHistogram* plugin,
+                   const MethodHistogramCallback& on_method)
+{
+  const auto& code = rt->code();
+  const uint8_t* cip = code.bytes;
+  const uint8_t* stop = code.bytes + code.length;
+
+  // Counts for the method being walked, or null if it failed verification.
+  std::unique_ptr<OpcodeHistogram> method;
+  cell_t method_offset = 0;
+  auto finish = [&]() -> void {
+    if (!method)
+      return;
+    plugin->merge(*method);
+    if (on_method)
+      on_method(method_offset, *method);
+    method = nullptr;
+  };
+
+  while (cip + sizeof(cell_t) <= stop) {
+    ucell_t op = *reinterpret_cast<const cell_t*>(cip);
+    if (op >= OPCODES_TOTAL || (op != OP_CASETBL && !kOpcodeSizes[op]))
+      break;
+
+    if (op == OP_PROC) {
+      finish();
+      method_offset = cell_t(cip - code.bytes);
+      RefPtr<MethodInfo> info = rt->AcquireMethod(method_offset);
+      if (info && info->Validate() == SP_ERROR_NONE)
+        method.reset(new OpcodeHistogram());
+    }
+
+    const uint8_t* next = NextInstruction(cip);
+    if (next > stop)
+      break;
+    if (method)
+      method->add(reinterpret_cast<const cell_t*>(cip));
+    cip = next;
+  }
+  finish();
+}
+
+} // namespace sp
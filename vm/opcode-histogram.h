@@ -0,0 +1,79 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_opcode_histogram_h_
+#define _include_sourcepawn_vm_opcode_histogram_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <vector>
+
+#include <smx/smx-v1-opcodes.h>
+#include <sp_vm_types.h>
+
+namespace sp {
+
+class PluginRuntime;
+
+// Counts how often each p-code op appears in, or is run by, some code, and
+// which values its operands take. Operands that are code addresses (jump
+// and call targets, case tables) aren't counted.
+class OpcodeHistogram
+{
+ public:
+  // Operand values from kMinExact to kMaxExact are counted one by one. The
+  // rest are counted by the smallest signed width that holds them.
+  static const cell_t kMinExact = -8;
+  static const cell_t kMaxExact = 16;
+  static const size_t kBuckets = size_t(kMaxExact - kMinExact + 1) + 3;
+
+  OpcodeHistogram();
+
+  // Counts the instruction at |cip|.
+  void add(const cell_t* cip);
+  void merge(const OpcodeHistogram& other);
+
+  uint64_t total() const {
+    return total_;
+  }
+  uint64_t count(OPCODE op) const {
+    return ops_[op];
+  }
+
+  // Prints the |max_ops| most common ops, then, if |operands| is set, how
+  // the operands of each op were distributed.
+  void report(FILE* fp, size_t max_ops, bool operands) const;
+
+ private:
+  static size_t BucketOf(cell_t value);
+  static void FormatBucket(size_t bucket, char* buffer, size_t maxlength);
+
+ private:
+  uint64_t total_;
+  uint64_t ops_[OPCODES_TOTAL];
+  // Indexed by [op * kBuckets + bucket]. Empty until an operand is counted.
+  std::vector<uint64_t> operands_;
+};
+
+// Counts the instructions of every method in |rt| that passes verification
+// into |plugin|, calling |on_method| (if set) with each method's own counts.
+typedef std::function<void(cell_t pcode_offset, const OpcodeHistogram& counts)>
+  MethodHistogramCallback;
+void CountStaticOpcodes(PluginRuntime* rt, OpcodeHistogram* plugin,
+                        const MethodHistogramCallback& on_method = nullptr);
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_opcode_histogram_h_
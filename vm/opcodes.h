@@ -36,6 +36,9 @@
 #include <sp_vm_types.h>
 #include "plugin-runtime.h"
 
+// Indexed by OPCODE.
+extern const char* OpcodeNames[];
+
 namespace sp {
 
 void SpewOpcode(FILE* fp, sp::PluginRuntime* runtime, const cell_t* start, const cell_t* cip);
@@ -70,6 +70,43 @@ class OutOfBoundsErrorPath : public OutOfLinePath
   cell_t bounds;
 };
 
+// Taken from a loop back-edge when the interrupt flag is set.
+class InterruptCheckPath : public OutOfLinePath
+{
+ public:
+  explicit InterruptCheckPath(const cell_t* cip)
+   : cip(cip)
+  {}
+
+  bool emit(Compiler* cc) override;
+
+  const cell_t* cip;
+};
+
+// Taken from an armed BREAK, to call the debugger.
+class DebugBreakPath : public OutOfLinePath
+{
+ public:
+  explicit DebugBreakPath(const cell_t* cip)
+   : cip(cip),
+     site(0)
+  {}
+
+  bool emit(Compiler* cc) override;
+
+  // Bound just past the BREAK's jump, where the path returns to.
+  Label* done() {
+    return &done_;
+  }
+
+  const cell_t* cip;
+  // Offset just past the BREAK's jump.
+  uint32_t site;
+
+ private:
+  Label done_;
+};
+
 } // namespace sp
 
 #endif // _include_sourcepawn_outofline_asm_h__
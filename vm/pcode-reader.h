@@ -35,7 +35,8 @@ class PcodeReader
      visitor_(visitor),
      code_(nullptr),
      cip_(nullptr),
-     stop_at_(nullptr)
+     stop_at_(nullptr),
+     native_replacement_(true)
   {
     assert(ke::IsAligned(startOffset, sizeof(cell_t)));
   
@@ -49,7 +50,8 @@ class PcodeReader
      visitor_(visitor),
      code_(nullptr),
      cip_(nullptr),
-     stop_at_(nullptr)
+     stop_at_(nullptr),
+     native_replacement_(true)
   {
     auto& code = rt->code();
     code_ = reinterpret_cast<const cell_t*>(code.bytes);
@@ -100,7 +102,44 @@ class PcodeReader
     assert(cip_ >= code_ && cip_ < stop_at_);
   }
 
+  // Always visit SYSREQ.C as a native call, without looking at how the
+  // native is bound.
+  void disableNativeReplacement() {
+    native_replacement_ = false;
+  }
+
  private:
+  // Natives that can never be rebound may be replaced with the pseudo-opcode
+  // implementing them, so the float natives run inline.
+  uint32_t getNativeReplacement(cell_t index) {
+    if (!native_replacement_)
+      return OP_NOP;
+
+    NativeEntry* native = rt_->NativeAt(index);
+    if (native->status != SP_NATIVE_BOUND ||
+        (native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL)))
+    {
+      return OP_NOP;
+    }
+    return rt_->GetNativeReplacement(index);
+  }
+
+  // Number of cells a replacement pseudo-opcode pops off the stack.
+  static cell_t ReplacementArity(OPCODE op) {
+    switch (op) {
+      case OP_FABS:
+      case OP_FLOAT:
+      case OP_RND_TO_NEAREST:
+      case OP_RND_TO_FLOOR:
+      case OP_RND_TO_CEIL:
+      case OP_RND_TO_ZERO:
+      case OP_FLOAT_NOT:
+        return 1;
+      default:
+        return 2;
+    }
+  }
+
   bool visitOp(OPCODE op) {
     switch (op) {
     case OP_NOP:
@@ -460,6 +499,20 @@ class PcodeReader
     case OP_SYSREQ_C:
     {
       cell_t index = readCell();
+
+      // Old compilers push the argument count and leave cleaning up the
+      // stack to the caller. Skip the count, run the replacement (which pops
+      // its arguments), then restore the stack for the caller's STACK.
+      uint32_t replacement = getNativeReplacement(index);
+      if (replacement != OP_NOP) {
+        cell_t nargs = ReplacementArity((OPCODE)replacement);
+        if (!visitor_->visitSTACK(sizeof(cell_t)))
+          return false;
+        if (!visitOp((OPCODE)replacement))
+          return false;
+        return visitor_->visitSTACK(-cell_t(sizeof(cell_t)) * (nargs + 1));
+      }
+
       return visitor_->visitSYSREQ_C(index);
     }
 
@@ -489,14 +542,9 @@ class PcodeReader
       cell_t index = readCell();
       cell_t nparams = readCell();
 
-      NativeEntry* native = rt_->NativeAt(index);
-      if (native->status == SP_NATIVE_BOUND &&
-          !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL)))
-      {
-        uint32_t replacement = rt_->GetNativeReplacement(index);
-        if (replacement != OP_NOP)
-          return visitOp((OPCODE)replacement);
-      }
+      uint32_t replacement = getNativeReplacement(index);
+      if (replacement != OP_NOP)
+        return visitOp((OPCODE)replacement);
 
       return visitor_->visitSYSREQ_N(index, nparams);
     }
@@ -645,6 +693,22 @@ class PcodeReader
       return visitor_->visitREBASE(addr, iv_size, data_size);
     }
 
+    case OP_LIDX_S_BOUNDS:
+    {
+      cell_t array = readCell();
+      cell_t index = readCell();
+      uint32_t limit = readCell();
+      return visitor_->visitLIDX_S_BOUNDS(array, index, limit);
+    }
+
+    case OP_IDXADDR_S_BOUNDS:
+    {
+      cell_t array = readCell();
+      cell_t index = readCell();
+      uint32_t limit = readCell();
+      return visitor_->visitIDXADDR_S_BOUNDS(array, index, limit);
+    }
+
     default:
       assert(false);
       return false;
@@ -668,6 +732,7 @@ class PcodeReader
   const cell_t* code_;
   const cell_t* cip_;
   const cell_t* stop_at_;
+  bool native_replacement_;
 };
 
 } // namespace sp
@@ -135,6 +135,8 @@ class PcodeVisitor
   virtual bool visitHALT(cell_t value) = 0;
   virtual bool visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases) = 0;
   virtual bool visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size) = 0;
+  virtual bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) = 0;
+  virtual bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) = 0;
 };
 
 class IncompletePcodeVisitor : public PcodeVisitor
@@ -496,6 +498,14 @@ class IncompletePcodeVisitor : public PcodeVisitor
     assert(false);
     return false;
   }
+  virtual bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    assert(false);
+    return false;
+  }
+  virtual bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    assert(false);
+    return false;
+  }
 };
 
 } // namespace sp
@@ -0,0 +1,142 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include "perf-counters.h"
+
+#if defined(__linux__)
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+using namespace sp;
+
+PerfCounters::PerfCounters()
+ : leader_(-1),
+   nslots_(0)
+{
+  for (int i = 0; i < kNumCounters; i++) {
+    fds_[i] = -1;
+    slots_[i] = -1;
+  }
+}
+
+PerfCounters::~PerfCounters()
+{
+#if defined(__linux__)
+  for (int i = 0; i < kNumCounters; i++) {
+    if (fds_[i] >= 0)
+      close(fds_[i]);
+  }
+#endif
+}
+
+const char*
+PerfCounters::Name(Counter counter)
+{
+  switch (counter) {
+    case kCycles:
+      return "cycles";
+    case kInstructions:
+      return "instructions";
+    case kBranchMisses:
+      return "branch-misses";
+    case kL1iMisses:
+      return "L1i-misses";
+    case kItlbMisses:
+      return "iTLB-misses";
+    default:
+      return "unknown";
+  }
+}
+
+#if defined(__linux__)
+static uint64_t
+CacheMissConfig(uint64_t cache)
+{
+  return cache |
+         (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8) |
+         (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+}
+#endif
+
+bool
+PerfCounters::init()
+{
+#if defined(__linux__)
+  struct {
+    uint32_t type;
+    uint64_t config;
+  } events[kNumCounters] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_L1I) },
+    { PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_ITLB) },
+  };
+
+  // The counters form one group, so they are scheduled onto the PMU
+  // together and can be read with a single syscall.
+  for (int i = 0; i < kNumCounters; i++) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = (leader_ < 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+    if (fd < 0) {
+      if (i == kCycles)
+        return false;
+      continue;
+    }
+    if (leader_ < 0)
+      leader_ = fd;
+    fds_[i] = fd;
+    slots_[i] = nslots_++;
+  }
+
+  ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  return ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == 0;
+#else
+  return false;
+#endif
+}
+
+void
+PerfCounters::read(uint64_t values[kNumCounters])
+{
+  memset(values, 0, sizeof(uint64_t) * kNumCounters);
+
+#if defined(__linux__)
+  if (leader_ < 0)
+    return;
+
+  // With PERF_FORMAT_GROUP, the leader reads as a count followed by one
+  // value per counter, in the order they were opened.
+  uint64_t buffer[1 + kNumCounters];
+  ssize_t n = ::read(leader_, buffer, sizeof(buffer));
+  if (n < ssize_t(sizeof(uint64_t)) || buffer[0] != uint64_t(nslots_))
+    return;
+  for (int i = 0; i < kNumCounters; i++) {
+    if (slots_[i] >= 0)
+      values[i] = buffer[1 + slots_[i]];
+  }
+#endif
+}
@@ -0,0 +1,60 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_perf_counters_h_
+#define _include_sourcepawn_vm_perf_counters_h_
+
+#include <stdint.h>
+
+namespace sp {
+
+// Hardware performance counters for the calling thread, counting user-mode
+// events only. They are read through perf_event_open, so this only works on
+// Linux, and only if the kernel allows it (see perf_event_paranoid).
+class PerfCounters
+{
+ public:
+  enum Counter {
+    kCycles,
+    kInstructions,
+    kBranchMisses,
+    kL1iMisses,
+    kItlbMisses,
+    kNumCounters
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+
+  // Opens and starts the counters. Fails if cycles can't be counted; any
+  // other counter the CPU lacks is left out, and always reads as 0.
+  bool init();
+
+  bool has(Counter counter) const {
+    return slots_[counter] >= 0;
+  }
+
+  // Reads every counter at once.
+  void read(uint64_t values[kNumCounters]);
+
+  static const char* Name(Counter counter);
+
+ private:
+  int leader_;
+  int fds_[kNumCounters];
+  int slots_[kNumCounters];
+  int nslots_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_perf_counters_h_
@@ -19,6 +19,9 @@
 #include "watchdog_timer.h"
 #include "environment.h"
 #include "method-info.h"
+#include "plugin-snapshot.h"
+#include "string-utils.h"
+#include "suspension.h"
 
 using namespace sp;
 using namespace SourcePawn;
@@ -28,6 +31,9 @@ using namespace SourcePawn;
 
 static const size_t kMinHeapSize = 16384;
 
+// Below this, copying .data is cheaper than setting up a mapping.
+static const size_t kMinSharedDataSize = 64 * 1024;
+
 PluginContext::PluginContext(PluginRuntime* pRuntime)
  : m_pRuntime(pRuntime),
    memory_(nullptr),
@@ -50,21 +56,46 @@ PluginContext::PluginContext(PluginRuntime* pRuntime)
   sp_ = mem_size_ - sizeof(cell_t);
   stp_ = sp_;
   frm_ = sp_;
+  hp_high_water_ = hp_;
+  hp_peak_ = hp_;
+  sp_low_water_ = sp_;
+  tracker_depth_ = 0;
+  tracker_high_water_ = 0;
+  heap_allocs_ = 0;
+  array_allocs_ = 0;
 }
 
 PluginContext::~PluginContext()
 {
-  delete[] memory_;
 }
 
 bool
-PluginContext::Initialize()
+PluginContext::Initialize(const PluginSnapshot* snapshot)
 {
-  memory_ = new uint8_t[mem_size_];
-  if (!memory_)
+  const uint8_t* data = m_pRuntime->data().bytes;
+
+  if (snapshot) {
+    if (!snapshot->MapInto(&backing_, mem_size_))
+      return false;
+    hp_ = snapshot->hp();
+    hp_high_water_ = hp_;
+    hp_peak_ = hp_;
+  }
+
+  // Large .data sections are mapped copy-on-write from an image shared by
+  // every context with the same data, so untouched tables aren't duplicated.
+  if (!backing_.base() && data_size_ >= kMinSharedDataSize) {
+    Environment* env = m_pRuntime->env();
+    const unsigned char* hash = m_pRuntime->GetDataHash();
+    RefPtr<DataImage> image = env->FindDataImage(data_size_, hash);
+    if (!image)
+      image = DataImage::Create(env, data, data_size_, hash);
+    if (image)
+      backing_.MapShared(mem_size_, image);
+  }
+  if (!backing_.base() && !backing_.Copy(mem_size_, data, data_size_))
     return false;
-  memset(memory_ + data_size_, 0, mem_size_ - data_size_);
-  memcpy(memory_, m_pRuntime->data().bytes, data_size_);
+  memory_ = backing_.base();
 
   /* Initialize the null references */
   uint32_t index;
@@ -102,6 +133,7 @@ PluginContext::HeapAlloc(unsigned int cells, cell_t* local_addr, cell_t** phys_a
   assert(cells < CELLBOUNDMAX);
 #endif
 
+  heap_allocs_++;
   realmem = cells * sizeof(cell_t);
 
   /**
@@ -122,6 +154,7 @@ PluginContext::HeapAlloc(unsigned int cells, cell_t* local_addr, cell_t** phys_a
     *phys_addr = addr;
 
   hp_ += realmem;
+  noteHeapUse();
 
   return SP_ERROR_NONE;
 }
@@ -263,7 +296,7 @@ PluginContext::StringToLocal(cell_t local_addr, size_t bytes, const char* source
   if (bytes == 0)
     return SP_ERROR_NONE;
 
-  len = strlen(source);
+  len = BoundedStrLen(source, bytes);
   dest = (char*)(memory_ + local_addr);
 
   if (len >= bytes)
@@ -275,77 +308,237 @@ PluginContext::StringToLocal(cell_t local_addr, size_t bytes, const char* source
   return SP_ERROR_NONE;
 }
 
-static inline int
-__CheckValidChar(char* c)
+int
+PluginContext::StringToLocalUTF8(cell_t local_addr, size_t maxbytes, const char* source, size_t* wrtnbytes)
 {
-  int count;
-  int bytecount = 0;
+  // Only scan as far as could be copied.
+  return StringToLocalN(local_addr, maxbytes, source, BoundedStrLen(source, maxbytes),
+                        wrtnbytes);
+}
 
-  for (count=1; (*c & 0xC0) == 0x80; count++)
-    c--;
+int
+PluginContext::StringToLocalN(cell_t local_addr, size_t maxbytes, const char* source,
+                              size_t length, size_t* wrtnbytes)
+{
+  if (((local_addr >= hp_) && (local_addr < sp_)) ||
+      (local_addr < 0) ||
+      ((ucell_t)local_addr >= mem_size_))
+  {
+    return SP_ERROR_INVALID_ADDRESS;
+  }
+
+  if (wrtnbytes)
+    *wrtnbytes = 0;
 
-  switch (*c & 0xF0)
+  size_t available = BytesAvailableAt(local_addr);
+  if (maxbytes > available)
+    maxbytes = available;
+  if (maxbytes == 0)
+    return SP_ERROR_NONE;
+
+  char* dest = (char*)(memory_ + local_addr);
+  if (length >= maxbytes)
+    length = Utf8SafeLength(source, maxbytes - 1);
+
+  memmove(dest, source, length);
+  dest[length] = '\0';
+
+  if (wrtnbytes)
+    *wrtnbytes = length;
+  return SP_ERROR_NONE;
+}
+
+int
+PluginContext::LocalToStringView(cell_t local_addr, const char** addr, size_t* length)
+{
+  if (((local_addr >= hp_) && (local_addr < sp_)) ||
+      (local_addr < 0) ||
+      ((ucell_t)local_addr >= mem_size_))
   {
-  case 0xC0:
-  case 0xD0:
-    {
-      bytecount = 2;
-      break;
-    }
-  case 0xE0:
-    {
-      bytecount = 3;
-      break;
-    }
-  case 0xF0:
-    {
-      bytecount = 4;
-      break;
-    }
+    return SP_ERROR_INVALID_ADDRESS;
   }
 
-  if (bytecount != count)
-    return count;
+  const char* str = (const char*)(memory_ + local_addr);
+  size_t available = BytesAvailableAt(local_addr);
+  size_t len = BoundedStrLen(str, available);
+  if (len == available)
+    return SP_ERROR_INVALID_ADDRESS;
 
-  return 0;
+  *addr = str;
+  *length = len;
+  return SP_ERROR_NONE;
 }
 
 int
-PluginContext::StringToLocalUTF8(cell_t local_addr, size_t maxbytes, const char* source, size_t* wrtnbytes)
+PluginContext::LocalToPhysRange(cell_t local_addr, size_t count, cell_t** phys_addr)
 {
-  char* dest;
-  size_t len;
-  bool needtocheck = false;
+  if (((local_addr >= hp_) && (local_addr < sp_)) ||
+      (local_addr < 0) ||
+      ((ucell_t)local_addr >= mem_size_))
+  {
+    return SP_ERROR_INVALID_ADDRESS;
+  }
+  if (count > BytesAvailableAt(local_addr) / sizeof(cell_t))
+    return SP_ERROR_INVALID_ADDRESS;
+
+  *phys_addr = reinterpret_cast<cell_t*>(memory_ + local_addr);
+  return SP_ERROR_NONE;
+}
+
+bool
+PluginContext::SuspendInvocation(SPVM_SUSPEND_FUNC callback, void* data, cell_t* value)
+{
+  return Suspension::Suspend(this, callback, data, value);
+}
+
+int
+PluginContext::FormatToBuffer(char* buffer, size_t maxbytes, cell_t fmt_addr,
+                              const cell_t* params, unsigned int arg, size_t* wrtnbytes)
+{
+  return m_pRuntime->format_cache().format(this, fmt_addr, params, arg, buffer, maxbytes,
+                                           wrtnbytes);
+}
 
+int
+PluginContext::FormatToLocal(cell_t local_addr, size_t maxbytes, cell_t fmt_addr,
+                             const cell_t* params, unsigned int arg, size_t* wrtnbytes)
+{
   if (((local_addr >= hp_) && (local_addr < sp_)) ||
       (local_addr < 0) ||
       ((ucell_t)local_addr >= mem_size_))
   {
     return SP_ERROR_INVALID_ADDRESS;
   }
-  
+
+  if (wrtnbytes)
+    *wrtnbytes = 0;
+
+  size_t available = BytesAvailableAt(local_addr);
+  if (maxbytes > available)
+    maxbytes = available;
   if (maxbytes == 0)
     return SP_ERROR_NONE;
 
-  len = strlen(source);
-  dest = (char*)(memory_ + local_addr);
+  // Format aside first, in case the destination is also an argument.
+  FormatCache& cache = m_pRuntime->format_cache();
+  char* buffer = cache.scratch(maxbytes);
+  size_t length;
+  if (int err = cache.format(this, fmt_addr, params, arg, buffer, maxbytes, &length))
+    return err;
+  return StringToLocalN(local_addr, maxbytes, buffer, length, wrtnbytes);
+}
 
-  if ((size_t)len >= maxbytes) {
-    len = maxbytes - 1;
-    needtocheck = true;
+int
+PluginContext::MarshalArgs(ParamInfo* info, unsigned int count, cell_t* params)
+{
+  size_t cells = 0;
+  bool any = false;
+  for (unsigned int i = 0; i < count; i++) {
+    if (info[i].marked) {
+      cells += CellsForArg(info[i]);
+      any = true;
+    }
   }
+  if (!any)
+    return SP_ERROR_NONE;
 
-  memmove(dest, source, len);
-  if ((dest[len-1] & 1<<7) && needtocheck)
-    len -= __CheckValidChar(dest+len-1);
-  dest[len] = '\0';
+  cell_t block;
+  cell_t* phys;
+  if (int err = HeapAlloc(unsigned(cells), &block, &phys))
+    return err;
 
-  if (wrtnbytes)
-    *wrtnbytes = len;
+  for (unsigned int i = 0; i < count; i++) {
+    ParamInfo& arg = info[i];
+    if (!arg.marked)
+      continue;
+    arg.local_addr = block;
+    arg.phys_addr = phys;
+    MarshalArg(arg, block, phys);
+    params[i] = block;
+
+    size_t arg_cells = CellsForArg(arg);
+    block += cell_t(arg_cells * sizeof(cell_t));
+    phys += arg_cells;
+  }
+  return SP_ERROR_NONE;
+}
+
+int
+PluginContext::UnmarshalArgs(const ParamInfo* info, unsigned int count, bool copyback)
+{
+  const ParamInfo* first = nullptr;
+  for (unsigned int i = 0; i < count; i++) {
+    if (!info[i].marked)
+      continue;
+    if (!first)
+      first = &info[i];
+    if (copyback)
+      CopyBackArg(info[i], info[i].phys_addr);
+  }
+  if (!first)
+    return SP_ERROR_NONE;
+  return HeapPop(first->local_addr);
+}
+
+void
+PluginContext::MarshalArg(const ParamInfo& info, cell_t local_addr, cell_t* phys_addr)
+{
+  if (!info.orig_addr)
+    return;
+
+  if (!info.str.is_sz) {
+    memcpy(phys_addr, info.orig_addr, sizeof(cell_t) * info.size);
+    return;
+  }
+  if (!(info.str.sz_flags & SM_PARAM_STRING_COPY))
+    return;
+  if (info.str.sz_flags & SM_PARAM_STRING_UTF8)
+    StringToLocalUTF8(local_addr, info.size, (const char*)info.orig_addr, nullptr);
+  else if (info.str.sz_flags & SM_PARAM_STRING_BINARY)
+    memmove(phys_addr, info.orig_addr, info.size);
+  else
+    StringToLocal(local_addr, info.size, (const char*)info.orig_addr);
+}
 
+void
+PluginContext::CopyBackArg(const ParamInfo& info, const cell_t* phys_addr)
+{
+  if (!(info.flags & SM_PARAM_COPYBACK) || !info.orig_addr)
+    return;
+  if (info.str.is_sz)
+    memcpy(info.orig_addr, phys_addr, info.size);
+  else
+    memcpy(info.orig_addr, phys_addr, info.size * sizeof(cell_t));
+}
+
+int
+PluginContext::LocalToStringBuffer(cell_t local_addr, size_t maxbytes, char** addr,
+                                   size_t* bytes)
+{
+  if (((local_addr >= hp_) && (local_addr < sp_)) ||
+      (local_addr < 0) ||
+      ((ucell_t)local_addr >= mem_size_))
+  {
+    return SP_ERROR_INVALID_ADDRESS;
+  }
+
+  *addr = (char*)(memory_ + local_addr);
+  *bytes = std::min(maxbytes, BytesAvailableAt(local_addr));
   return SP_ERROR_NONE;
 }
 
+cell_t*
+PluginContext::ScratchAlloc(size_t cells, size_t* mark)
+{
+  return scratch_.alloc(cells, mark);
+}
+
+void
+PluginContext::ScratchRelease(size_t mark)
+{
+  scratch_.release(mark);
+}
+
 IPluginFunction*
 PluginContext::GetFunctionById(funcid_t func_id)
 {
@@ -393,19 +586,24 @@ PluginContext::IsInExec()
 bool
 PluginContext::Invoke(funcid_t fnid, const cell_t* params, unsigned int num_params, cell_t* result)
 {
-  EnterProfileScope profileScope("SourcePawn", "EnterJIT");
-
-  if (!env_->watchdog()->HandleInterrupt()) {
-    ReportErrorNumber(SP_ERROR_TIMEOUT);
+  ScriptedInvoker* cfun = static_cast<ScriptedInvoker*>(m_pRuntime->GetFunctionById(fnid));
+  if (!cfun) {
+    ReportErrorNumber(SP_ERROR_NOT_FOUND);
     return false;
   }
+  return Invoke(cfun, params, num_params, result);
+}
 
-  assert((fnid & 1) != 0);
+bool
+PluginContext::Invoke(ScriptedInvoker* cfun, const cell_t* params, unsigned int num_params,
+                      cell_t* result)
+{
+  assert(cfun->context() == this);
 
-  unsigned public_id = fnid >> 1;
-  ScriptedInvoker* cfun = m_pRuntime->GetPublicFunction(public_id);
-  if (!cfun) {
-    ReportErrorNumber(SP_ERROR_NOT_FOUND);
+  EnterProfileScope profileScope("SourcePawn", "EnterJIT");
+
+  if (!env_->watchdog()->HandleInterrupt()) {
+    ReportErrorNumber(SP_ERROR_TIMEOUT);
     return false;
   }
 
@@ -430,6 +628,7 @@ PluginContext::Invoke(funcid_t fnid, const cell_t* params, unsigned int num_para
 
   /* We got this far.  It's time to start profiling. */
   EnterProfileScope scriptScope("SourcePawn", cfun->DebugName());
+  EnterStatsScope statsScope(this, &cfun->stats());
 
   /* See if we have to compile the callee. */
   RefPtr<MethodInfo> method = cfun->AcquireMethod();
@@ -441,6 +640,8 @@ PluginContext::Invoke(funcid_t fnid, const cell_t* params, unsigned int num_para
   /* Save our previous state. */
   cell_t save_sp = sp_;
   cell_t save_hp = hp_;
+  uint32_t save_tracker_depth = tracker_depth_;
+  size_t save_scratch = scratch_.mark();
 
   /* Push parameters */
   sp_ -= sizeof(cell_t) * (num_params + 1);
@@ -450,9 +651,25 @@ PluginContext::Invoke(funcid_t fnid, const cell_t* params, unsigned int num_para
   for (unsigned int i = 0; i < num_params; i++)
     sp[i + 1] = params[i];
 
+  if (InvocationRecorder* recorder = m_pRuntime->recorder())
+    recorder->enter(cfun->GetFunctionID(), params, num_params, memory_ + data_size_, hp_ - data_size_);
+
+  // Only the host's own invocations get a fresh budget; calls back into a
+  // plugin from its natives spend from the one they're part of.
+  bool outermost = env_->has_budgets() && !env_->top();
+  if (outermost)
+    env_->refillBudget();
+
   // Enter the execution engine.
   bool ok = env_->Invoke(this, method, result);
 
+  if (outermost)
+    env_->noteBudgetSpent();
+
+  // Natives can stop or restart the recording, so look it up again.
+  if (InvocationRecorder* recorder = m_pRuntime->recorder())
+    recorder->leave(ok, *result);
+
   if (ok) {
     // Verify that our state is still sane.
     if (sp_ != save_sp) {
@@ -475,9 +692,40 @@ PluginContext::Invoke(funcid_t fnid, const cell_t* params, unsigned int num_para
 
   sp_ = save_sp;
   hp_ = save_hp;
+  tracker_depth_ = save_tracker_depth;
+  scratch_.release(save_scratch);
+
+  // Globals can't change again until the plugin is entered again, so this
+  // is when watches are checked.
+  if (!m_pRuntime->data_watcher().empty() && !IsInExec())
+    m_pRuntime->data_watcher().check(m_pRuntime, memory_);
   return ok;
 }
 
+void
+PluginContext::GetMemoryStats(MemoryStats* stats) const
+{
+  cell_t hp_peak = std::max(hp_peak_, hp_high_water_);
+
+  stats->memory_size = mem_size_ - data_size_;
+  stats->heap_high_water = uint32_t(hp_peak - cell_t(data_size_));
+  stats->stack_high_water = uint32_t(stp_ - std::min(sp_low_water_, sp_));
+  stats->tracker_high_water = tracker_high_water_;
+  stats->heap_allocs = heap_allocs_;
+  stats->array_allocs = array_allocs_;
+}
+
+void
+PluginContext::ResetMemoryStats()
+{
+  hp_peak_ = hp_;
+  hp_high_water_ = std::min(hp_high_water_, hp_);
+  sp_low_water_ = sp_;
+  tracker_high_water_ = tracker_depth_;
+  heap_allocs_ = 0;
+  array_allocs_ = 0;
+}
+
 IPluginRuntime*
 PluginContext::GetRuntime()
 {
@@ -506,6 +754,7 @@ PluginContext::popTrackerAndSetHeap()
     return SP_ERROR_TRACKER_BOUNDS;
 
   hp_ -= amt;
+  tracker_depth_--;
   return SP_ERROR_NONE;
 }
 
@@ -519,6 +768,8 @@ PluginContext::pushTracker(uint32_t amount)
 
   *reinterpret_cast<cell_t*>(memory_ + hp_) = amount;
   hp_ += sizeof(cell_t);
+  noteHeapUse();
+  tracker_high_water_ = std::max(tracker_high_water_, ++tracker_depth_);
   return SP_ERROR_NONE;
 }
 
@@ -648,9 +899,36 @@ GenerateAbsoluteIndirectionVectors(abs_iv_data_t& info, cell_t dim)
   return iv_base_offset;
 }
 
+// Two-dimensional arrays, [rows][cols], are by far the most common kind of
+// multi-dimensional array (string lists, mostly), and their indirection
+// vector is a single level. Fill it directly instead of going through the
+// recursive builders above; the results are identical.
+template <bool DirectArrays>
+static void
+Generate2DIndirectionVector(cell_t* base, cell_t addr, cell_t rows, cell_t cols)
+{
+  if (DirectArrays) {
+    // Absolute addresses of each row in the data region.
+    cell_t row_addr = addr + rows * sizeof(cell_t);
+    for (cell_t i = 0; i < rows; i++) {
+      base[i] = row_addr;
+      row_addr += cols * sizeof(cell_t);
+    }
+  } else {
+    // Offsets of each row relative to its own indirection cell.
+    cell_t offset = rows * sizeof(cell_t);
+    for (cell_t i = 0; i < rows; i++) {
+      base[i] = offset;
+      offset += (cols - 1) * sizeof(cell_t);
+    }
+  }
+}
+
 int
 PluginContext::generateFullArray(uint32_t argc, cell_t* argv, int autozero)
 {
+  array_allocs_++;
+
   // Calculate how many cells are needed.
   if (argv[0] <= 0)
     return SP_ERROR_ARRAY_TOO_BIG;
@@ -685,8 +963,9 @@ PluginContext::generateFullArray(uint32_t argc, cell_t* argv, int autozero)
   uint32_t new_hp = hp_ + bytes;
   cell_t* dat_hp = reinterpret_cast<cell_t*>(memory_ + new_hp);
 
-  // argv, coincidentally, is STK.
-  if (dat_hp >= argv - STACK_MARGIN)
+  // argv, coincidentally, is STK. Compiled callers also keep the guard for
+  // leaf methods free.
+  if (dat_hp >= argv - (STACK_MARGIN + kLeafStackGuard))
     return SP_ERROR_HEAPLOW;
 
   cell_t* base = reinterpret_cast<cell_t*>(memory_ + hp_);
@@ -696,7 +975,13 @@ PluginContext::generateFullArray(uint32_t argc, cell_t* argv, int autozero)
     memset(reinterpret_cast<uint8_t*>(base) + iv_size, 0, bytes - iv_size);
   }
 
-  if (image->DescribeCode().features & SmxConsts::kCodeFeatureDirectArrays) {
+  bool direct_arrays = !!(image->DescribeCode().features & SmxConsts::kCodeFeatureDirectArrays);
+  if (argc == 2) {
+    if (direct_arrays)
+      Generate2DIndirectionVector<true>(base, hp_, argv[1], argv[0]);
+    else
+      Generate2DIndirectionVector<false>(base, hp_, argv[1], argv[0]);
+  } else if (direct_arrays) {
     abs_iv_data_t info;
     info.addr = hp_;
     info.ptr = reinterpret_cast<uint8_t*>(base);
@@ -726,6 +1011,7 @@ int
 PluginContext::generateArray(cell_t dims, cell_t* stk, bool autozero)
 {
   if (dims == 1) {
+    array_allocs_++;
     uint32_t size = *stk;
     if (size == 0 || !ke::IsUint32MultiplySafe(size, 4))
       return SP_ERROR_ARRAY_TOO_BIG;
@@ -886,6 +1172,7 @@ PluginContext::heapAlloc(cell_t amount, cell_t* out)
 
   *out = hp_;
   hp_ = new_hp;
+  noteHeapUse();
   return true;
 }
 
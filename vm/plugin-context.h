@@ -13,17 +13,27 @@
 #ifndef _INCLUDE_SOURCEPAWN_V1CONTEXT_H_
 #define _INCLUDE_SOURCEPAWN_V1CONTEXT_H_
 
+#include <algorithm>
+
 #include "base-context.h"
 #include "scripted-invoker.h"
 #include "plugin-runtime.h"
+#include "plugin-memory.h"
+#include "scratch-arena.h"
 
 namespace sp {
 
 static const size_t SP_MAX_RETURN_STACK = 1024;
 static const cell_t STACK_MARGIN = 64; // 16 parameters of safety, I guess
 
+// Compiled code keeps this much room between the heap margin and the stack
+// wherever it calls other scripted code, so a callee that makes no calls and
+// whose frame fits in it doesn't check the stack itself.
+static const cell_t kLeafStackGuard = 256;
+
 class Environment;
 class PluginContext;
+class PluginSnapshot;
 
 class PluginContext : public BasePluginContext
 {
@@ -31,7 +41,8 @@ class PluginContext : public BasePluginContext
   PluginContext(PluginRuntime* pRuntime);
   ~PluginContext() override;
 
-  bool Initialize();
+  // With a |snapshot|, memory starts out as the snapshot instead of .data.
+  bool Initialize(const PluginSnapshot* snapshot = nullptr);
 
  public: //IPluginContext
   int HeapAlloc(unsigned int cells, cell_t* local_addr, cell_t** phys_addr) override;
@@ -51,6 +62,40 @@ class PluginContext : public BasePluginContext
   int LocalToString(cell_t local_addr, char** addr) override;
   int StringToLocal(cell_t local_addr, size_t chars, const char* source) override;
   int StringToLocalUTF8(cell_t local_addr, size_t maxbytes, const char* source, size_t* wrtnbytes) override;
+  int StringToLocalN(cell_t local_addr, size_t maxbytes, const char* source, size_t length,
+                     size_t* wrtnbytes) override;
+  int LocalToStringView(cell_t local_addr, const char** addr, size_t* length) override;
+
+  // Like LocalToPhysAddr, but checks that all |count| cells from
+  // |local_addr| are addressable, so callers can work on them directly.
+  int LocalToPhysRange(cell_t local_addr, size_t count, cell_t** phys_addr);
+
+  // Marshals the by-reference arguments of a call. Every marked entry of
+  // |info| is copied into one heap block, in argument order, and gets its
+  // address there in |local_addr|, |phys_addr|, and |params|. Unmarked
+  // arguments are left alone. UnmarshalArgs copies back the arguments that
+  // asked for it, if |copyback| is set, and frees the block.
+  int MarshalArgs(ParamInfo* info, unsigned int count, cell_t* params);
+  int UnmarshalArgs(const ParamInfo* info, unsigned int count, bool copyback);
+
+  // The pieces of the above, for callers that lay out the block
+  // themselves.
+  static size_t CellsForArg(const ParamInfo& info) {
+    if (info.str.is_sz)
+      return (info.size + sizeof(cell_t) - 1) / sizeof(cell_t);
+    return info.size;
+  }
+  void MarshalArg(const ParamInfo& info, cell_t local_addr, cell_t* phys_addr);
+  static void CopyBackArg(const ParamInfo& info, const cell_t* phys_addr);
+  bool SuspendInvocation(SPVM_SUSPEND_FUNC callback, void* data, cell_t* value) override;
+  int FormatToBuffer(char* buffer, size_t maxbytes, cell_t fmt_addr, const cell_t* params,
+                     unsigned int arg, size_t* wrtnbytes) override;
+  int FormatToLocal(cell_t local_addr, size_t maxbytes, cell_t fmt_addr, const cell_t* params,
+                    unsigned int arg, size_t* wrtnbytes) override;
+  int LocalToStringBuffer(cell_t local_addr, size_t maxbytes, char** addr,
+                          size_t* bytes) override;
+  cell_t* ScratchAlloc(size_t cells, size_t* mark) override;
+  void ScratchRelease(size_t mark) override;
   IPluginFunction* GetFunctionByName(const char* public_name) override;
   IPluginFunction* GetFunctionById(funcid_t func_id) override;
   cell_t* GetNullRef(SP_NULL_TYPE type) override;
@@ -59,6 +104,10 @@ class PluginContext : public BasePluginContext
   cell_t* GetLocalParams() override;
 
   bool Invoke(funcid_t fnid, const cell_t* params, unsigned int num_params, cell_t* result);
+  // Same, for a function that has already been looked up. Invokers and
+  // prepared calls come through here, since they already know their target.
+  bool Invoke(ScriptedInvoker* fn, const cell_t* params, unsigned int num_params,
+              cell_t* result);
 
   size_t HeapSize() const {
     return mem_size_;
@@ -76,15 +125,54 @@ class PluginContext : public BasePluginContext
  public:
   bool IsInExec() override;
 
+ private:
+  // Returns the number of bytes addressable from |local_addr|, which must be
+  // valid, before running into the gap between the heap and the stack, or
+  // the end of memory.
+  size_t BytesAvailableAt(cell_t local_addr) const {
+    if (local_addr < hp_)
+      return hp_ - local_addr;
+    return mem_size_ - local_addr;
+  }
+
+ public:
+
   static inline size_t offsetOfSp() {
     return offsetof(PluginContext, sp_);
   }
+  static inline size_t offsetOfHp() {
+    return offsetof(PluginContext, hp_);
+  }
   static inline size_t offsetOfRuntime() {
     return offsetof(PluginContext, m_pRuntime);
   }
   static inline size_t offsetOfMemory() {
     return offsetof(PluginContext, memory_);
   }
+  static inline size_t offsetOfFrm() {
+    return offsetof(PluginContext, frm_);
+  }
+  static inline size_t offsetOfDataSize() {
+    return offsetof(PluginContext, data_size_);
+  }
+  static inline size_t offsetOfMemSize() {
+    return offsetof(PluginContext, mem_size_);
+  }
+  static inline size_t offsetOfHpHighWater() {
+    return offsetof(PluginContext, hp_high_water_);
+  }
+  static inline size_t offsetOfSpLowWater() {
+    return offsetof(PluginContext, sp_low_water_);
+  }
+  static inline size_t offsetOfTrackerDepth() {
+    return offsetof(PluginContext, tracker_depth_);
+  }
+  static inline size_t offsetOfTrackerHighWater() {
+    return offsetof(PluginContext, tracker_high_water_);
+  }
+  static inline size_t offsetOfArrayAllocs() {
+    return offsetof(PluginContext, array_allocs_);
+  }
 
   int32_t* addressOfSp() {
     return &sp_;
@@ -95,6 +183,21 @@ class PluginContext : public BasePluginContext
   cell_t* addressOfHp() {
     return &hp_;
   }
+  cell_t* addressOfHpHighWater() {
+    return &hp_high_water_;
+  }
+  cell_t* addressOfSpLowWater() {
+    return &sp_low_water_;
+  }
+  uint32_t* addressOfTrackerDepth() {
+    return &tracker_depth_;
+  }
+  uint32_t* addressOfTrackerHighWater() {
+    return &tracker_high_water_;
+  }
+  uint64_t* addressOfArrayAllocs() {
+    return &array_allocs_;
+  }
 
   cell_t frm() const {
     return frm_;
@@ -106,6 +209,33 @@ class PluginContext : public BasePluginContext
     return hp_;
   }
 
+  // The highest the heap pointer has been since it was last set, for
+  // PublicStats. Compiled code updates it inline on HEAP.
+  cell_t hp_high_water() const {
+    return hp_high_water_;
+  }
+  void set_hp_high_water(cell_t value) {
+    // Keep the lifetime peak before the per-invocation mark is lowered.
+    hp_peak_ = std::max(hp_peak_, hp_high_water_);
+    hp_high_water_ = value;
+  }
+  void noteHeapUse() {
+    if (hp_ > hp_high_water_)
+      hp_high_water_ = hp_;
+  }
+
+  // The lowest the stack may have reached: each method entry notes its frame
+  // minus the most stack the verifier says it can use. Compiled code updates
+  // this inline.
+  void noteStackUse(cell_t sp) {
+    if (sp < sp_low_water_)
+      sp_low_water_ = sp;
+  }
+
+  // Lifetime memory usage, for MemoryStats.
+  void GetMemoryStats(MemoryStats* stats) const;
+  void ResetMemoryStats();
+
   int popTrackerAndSetHeap();
   int pushTracker(uint32_t amount);
 
@@ -135,6 +265,7 @@ class PluginContext : public BasePluginContext
 
  private:
   PluginRuntime* m_pRuntime;
+  PluginMemory backing_;
   uint8_t* memory_;
   uint32_t data_size_;
   uint32_t mem_size_;
@@ -149,6 +280,17 @@ class PluginContext : public BasePluginContext
   cell_t sp_;
   cell_t hp_;
   cell_t frm_;
+  cell_t hp_high_water_;
+
+  // Lifetime counters for MemoryStats.
+  cell_t hp_peak_;
+  cell_t sp_low_water_;
+  uint32_t tracker_depth_;
+  uint32_t tracker_high_water_;
+  uint64_t heap_allocs_;
+  uint64_t array_allocs_;
+
+  ScratchArena scratch_;
 };
 
 } // namespace sp
@@ -0,0 +1,267 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32)
+# include <Windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# if defined(__linux__)
+#  include <sys/syscall.h>
+# endif
+#endif
+#include <amtl/am-bits.h>
+#include "plugin-memory.h"
+#include "environment.h"
+
+using namespace sp;
+
+size_t
+PluginMemory::PageSize()
+{
+  static size_t sPageSize = 0;
+  if (!sPageSize) {
+    // Views on Windows must start on the allocation granularity, not just a
+    // page boundary.
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    sPageSize = info.dwAllocationGranularity;
+#else
+    sPageSize = sysconf(_SC_PAGESIZE);
+#endif
+  }
+  return sPageSize;
+}
+
+#if !defined(_WIN32)
+// Anonymous memory is zero-filled by the OS on first touch. The heap and stack
+// are reserved without swap backing, so a large #pragma dynamic only costs
+// the pages the plugin actually reaches.
+static void*
+ReserveZeroed(size_t bytes)
+{
+  int flags = MAP_PRIVATE | MAP_ANON;
+#if defined(MAP_NORESERVE)
+  flags |= MAP_NORESERVE;
+#endif
+  void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED)
+    return nullptr;
+  return base;
+}
+
+static int
+CreateSharedMemory()
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+  int memfd = (int)syscall(SYS_memfd_create, "sourcepawn-data", 1 /* MFD_CLOEXEC */);
+  if (memfd >= 0)
+    return memfd;
+#endif
+
+  // Otherwise, make a POSIX shared memory object and unlink it right away, so
+  // it goes away with the last mapping.
+  static unsigned sCounter = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/sourcepawn-%d-%u", (int)getpid(), sCounter++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return -1;
+  shm_unlink(name);
+  return fd;
+}
+#endif
+
+ke::RefPtr<DataImage>
+DataImage::Create(Environment* env, const uint8_t* bytes, size_t length,
+                  const unsigned char hash[16])
+{
+  size_t mapped_length = ke::Align(length, PluginMemory::PageSize());
+
+#if defined(_WIN32)
+  uint64_t size = mapped_length;
+  HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                      DWORD(size >> 32), DWORD(size), nullptr);
+  if (!section)
+    return nullptr;
+
+  void* view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, mapped_length);
+  if (!view) {
+    CloseHandle(section);
+    return nullptr;
+  }
+  memcpy(view, bytes, length);
+  UnmapViewOfFile(view);
+
+  intptr_t handle = reinterpret_cast<intptr_t>(section);
+#else
+  int fd = CreateSharedMemory();
+  if (fd < 0)
+    return nullptr;
+  if (ftruncate(fd, mapped_length) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  void* view = mmap(nullptr, mapped_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (view == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  memcpy(view, bytes, length);
+  munmap(view, mapped_length);
+
+  intptr_t handle = fd;
+#endif
+
+  return new DataImage(env, length, mapped_length, handle, hash);
+}
+
+DataImage::DataImage(Environment* env, size_t length, size_t mapped_length, intptr_t handle,
+                     const unsigned char hash[16])
+ : env_(env),
+   length_(length),
+   mapped_length_(mapped_length),
+   handle_(handle),
+   registered_(!!hash)
+{
+  if (hash)
+    memcpy(hash_, hash, sizeof(hash_));
+  else
+    memset(hash_, 0, sizeof(hash_));
+  if (registered_)
+    env_->RegisterDataImage(this);
+}
+
+DataImage::~DataImage()
+{
+  if (registered_)
+    env_->UnregisterDataImage(this);
+#if defined(_WIN32)
+  CloseHandle(reinterpret_cast<HANDLE>(handle_));
+#else
+  close(int(handle_));
+#endif
+}
+
+bool
+DataImage::matches(size_t length, const unsigned char hash[16]) const
+{
+  return length_ == length && memcmp(hash_, hash, sizeof(hash_)) == 0;
+}
+
+PluginMemory::PluginMemory()
+ : base_(nullptr),
+   reserved_(0)
+{
+}
+
+PluginMemory::~PluginMemory()
+{
+  if (!base_)
+    return;
+
+#if defined(_WIN32)
+  if (!image_) {
+    VirtualFree(base_, 0, MEM_RELEASE);
+    return;
+  }
+  UnmapViewOfFile(base_);
+  if (reserved_ > image_->mapped_length())
+    VirtualFree(base_ + image_->mapped_length(), 0, MEM_RELEASE);
+#else
+  munmap(base_, reserved_);
+#endif
+}
+
+bool
+PluginMemory::MapShared(size_t size, DataImage* image)
+{
+  assert(!base_);
+
+  size_t total = ke::Align(size, PageSize());
+  size_t mapped = image->mapped_length();
+  if (mapped > total)
+    return false;
+
+#if defined(_WIN32)
+  HANDLE section = reinterpret_cast<HANDLE>(image->handle());
+
+  // Windows can't map a view over part of an existing reservation, so find a
+  // hole big enough for everything, release it, and place the view and the
+  // rest of the memory there. Someone else may take the hole in between, so
+  // try a few times.
+  for (int attempt = 0; attempt < 4; attempt++) {
+    void* hole = VirtualAlloc(nullptr, total, MEM_RESERVE, PAGE_NOACCESS);
+    if (!hole)
+      return false;
+    VirtualFree(hole, 0, MEM_RELEASE);
+
+    void* view = MapViewOfFileEx(section, FILE_MAP_COPY, 0, 0, mapped, hole);
+    if (!view)
+      continue;
+    if (total > mapped) {
+      uint8_t* rest = reinterpret_cast<uint8_t*>(view) + mapped;
+      if (!VirtualAlloc(rest, total - mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) {
+        UnmapViewOfFile(view);
+        continue;
+      }
+    }
+
+    base_ = reinterpret_cast<uint8_t*>(view);
+    break;
+  }
+  if (!base_)
+    return false;
+#else
+  void* base = ReserveZeroed(total);
+  if (!base)
+    return false;
+
+  void* view = mmap(base, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                    int(image->handle()), 0);
+  if (view == MAP_FAILED) {
+    munmap(base, total);
+    return false;
+  }
+  base_ = reinterpret_cast<uint8_t*>(base);
+#endif
+
+  reserved_ = total;
+  image_ = image;
+  return true;
+}
+
+bool
+PluginMemory::Copy(size_t size, const uint8_t* data, size_t data_length)
+{
+  assert(!base_);
+
+  size_t total = ke::Align(size, PageSize());
+#if defined(_WIN32)
+  void* base = VirtualAlloc(nullptr, total, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  void* base = ReserveZeroed(total);
+#endif
+  if (!base)
+    return false;
+
+  base_ = reinterpret_cast<uint8_t*>(base);
+  reserved_ = total;
+  memcpy(base_, data, data_length);
+  return true;
+}
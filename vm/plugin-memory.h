@@ -0,0 +1,98 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_plugin_memory_h_
+#define _include_sourcepawn_vm_plugin_memory_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <amtl/am-refcounting.h>
+
+namespace sp {
+
+class Environment;
+
+// A copy of a plugin's initial .data in a shared memory object, so contexts
+// can map it copy-on-write instead of copying it. Pages a context never
+// writes stay shared with every other context (and reload) of the same data.
+class DataImage : public ke::Refcounted<DataImage>
+{
+ public:
+  // Returns null if the platform cannot create the mapping. Images without a
+  // |hash| are private to whoever made them, and never shared by
+  // FindDataImage.
+  static ke::RefPtr<DataImage> Create(Environment* env, const uint8_t* bytes, size_t length,
+                                  const unsigned char hash[16]);
+  ~DataImage();
+
+  bool matches(size_t length, const unsigned char hash[16]) const;
+
+  size_t length() const {
+    return length_;
+  }
+  // |length| rounded up to a whole number of pages.
+  size_t mapped_length() const {
+    return mapped_length_;
+  }
+  intptr_t handle() const {
+    return handle_;
+  }
+
+ private:
+  DataImage(Environment* env, size_t length, size_t mapped_length, intptr_t handle,
+            const unsigned char hash[16]);
+
+ private:
+  Environment* env_;
+  size_t length_;
+  size_t mapped_length_;
+  intptr_t handle_;
+  unsigned char hash_[16];
+  bool registered_;
+};
+
+// The memory backing one context: .data, followed by the heap and stack. The
+// whole range is reserved up front, so address checks against the heap size
+// and stack top stay exactly as they were, but pages are only committed when
+// first touched and come zero-filled from the OS.
+class PluginMemory
+{
+ public:
+  PluginMemory();
+  ~PluginMemory();
+
+  // Maps |image| copy-on-write at the start of |size| bytes of memory. Fails
+  // if the mapping cannot be made, in which case nothing is allocated.
+  bool MapShared(size_t size, DataImage* image);
+
+  // Reserves |size| bytes of zeroed memory and copies |data| to the start.
+  bool Copy(size_t size, const uint8_t* data, size_t data_length);
+
+  uint8_t* base() const {
+    return base_;
+  }
+  bool shared() const {
+    return !!image_;
+  }
+
+  static size_t PageSize();
+
+ private:
+  uint8_t* base_;
+  size_t reserved_;
+  ke::RefPtr<DataImage> image_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_plugin_memory_h_
@@ -11,53 +11,118 @@
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 //
 #include "plugin-runtime.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <smx/smx-v1-opcodes.h>
+#include "api.h"
 #include "compiled-function.h"
 #include "environment.h"
 #include "method-info.h"
+#include "opcode-histogram.h"
 #include "plugin-context.h"
+#include "plugin-snapshot.h"
 #include "builtins.h"
-
+#if defined(SP_HAS_JIT)
+# include "compile-queue.h"
+# include "jit.h"
+# include "precompiler.h"
+#endif
+
+#include "fast-hash.h"
+#include "image-cache.h"
+#include "smx-v1-image.h"
 #include "md5/md5.h"
+#include "code-cache.h"
+#include "typed-natives.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace sp;
 using namespace SourcePawn;
 
-PluginRuntime::PluginRuntime(LegacyImage* image)
- : image_(image),
+PluginRuntime::PluginRuntime(LegacyImage* image, bool md5_hashes)
+ : env_(Environment::get()),
+   owned_image_(image),
+   image_(image),
+   paused_(false),
+   single_step_(true),
+   native_epoch_(0),
+   md5_hashes_(md5_hashes),
+   computed_code_hash_(false),
+   computed_data_hash_(false)
+{
+  Setup();
+}
+
+PluginRuntime::PluginRuntime(const RefPtr<SharedImage>& image, bool md5_hashes)
+ : env_(Environment::get()),
+   shared_image_(image),
+   image_(image->image()),
    paused_(false),
+   single_step_(true),
+   native_epoch_(0),
+   md5_hashes_(md5_hashes),
    computed_code_hash_(false),
    computed_data_hash_(false)
+{
+  env_->image_cache()->Acquire(shared_image_.get());
+  Setup();
+}
+
+void
+PluginRuntime::Setup()
 {
   code_ = image_->DescribeCode();
   data_ = image_->DescribeData();
   memset(code_hash_, 0, sizeof(code_hash_));
   memset(data_hash_, 0, sizeof(data_hash_));
+  methods_ = std::make_unique<MethodList>();
 
-  std::lock_guard<ke::Mutex> lock(Environment::get()->lock());
-  Environment::get()->RegisterRuntime(this);
+  std::lock_guard<ke::Mutex> lock(env_->lock());
+  env_->RegisterRuntime(this);
 }
 
 PluginRuntime::~PluginRuntime()
 {
+  StopRecording();
+
+#if defined(SP_HAS_JIT)
+  // The compile thread reads the runtime, so it must be gone first. Wait
+  // for it outside the lock below, so the watchdog isn't held up.
+  precompiler_ = nullptr;
+  compile_queue_ = nullptr;
+#endif
+
+  // Invokers live in |invoker_pool_|, which frees them all at once; they
+  // only have to let go of their methods.
+  for (uint32_t i = 0; i < image_->NumPublics(); i++) {
+    if (entrypoints_[i])
+      entrypoints_[i]->~ScriptedInvoker();
+  }
+  for (InvokerMap::iterator iter = method_invokers_.iter(); !iter.empty(); iter.next())
+    iter->value->~ScriptedInvoker();
+
   // The watchdog thread takes the global JIT lock while it patches all
-  // runtimes. It is not enough to ensure that the unlinking of the runtime is
-  // protected; we cannot delete functions or code while the watchdog might be
-  // executing. Therefore, the entire destructor is guarded.
-  std::lock_guard<ke::Mutex> lock(Environment::get()->lock());
+  // runtimes, so once the runtime is unlinked under it, the watchdog can't
+  // see its code. The methods, and the code compiled for them, are handed
+  // to the environment to free later instead of one by one here.
+  std::lock_guard<ke::Mutex> lock(env_->lock());
 
-  Environment::get()->DeregisterRuntime(this);
+  env_->DeregisterRuntime(this);
+  env_->RetireMethods(std::move(methods_));
 
-  for (uint32_t i = 0; i < image_->NumPublics(); i++)
-    delete entrypoints_[i];
+  if (shared_image_)
+    env_->image_cache()->Release(shared_image_.get());
 }
 
 bool
-PluginRuntime::Initialize()
+PluginRuntime::Initialize(const PluginSnapshot* snapshot)
 {
   if (!ke::IsAligned(code_.bytes, sizeof(cell_t))) {
     // Align the code section.
@@ -69,14 +134,40 @@ PluginRuntime::Initialize()
     code_.bytes = aligned_code_.get();
   }
 
+  // Hosts poll the hashes to detect reloads, and the context keys shared
+  // .data on the data hash, so compute the cheap digests once up front.
+  if (!md5_hashes_) {
+    FastHash::Compute(code_.bytes, code_.length, code_hash_);
+    FastHash::Compute(data_.bytes, data_.length, data_hash_);
+    computed_code_hash_ = true;
+    computed_data_hash_ = true;
+  }
+
   natives_ = std::make_unique<NativeEntry[]>(image_->NumNatives());
-  if (!natives_)
+  native_names_ = std::make_unique<Atom*[]>(image_->NumNatives());
+  if (!natives_ || !native_names_)
     return false;
 
+  // Names handed out through the API point into the interned copy, so a
+  // name every plugin uses is only stored once.
+  StringPool* atoms = env_->atoms();
+  for (size_t i = 0; i < image_->NumNatives(); i++) {
+    if (!(native_names_[i] = atoms->add(image_->GetNative(i))))
+      return false;
+    natives_[i].name = native_names_[i]->chars();
+  }
+
   publics_ = std::make_unique<sp_public_t[]>(image_->NumPublics());
-  if (!publics_)
+  public_names_ = std::make_unique<Atom*[]>(image_->NumPublics());
+  if (!publics_ || !public_names_)
     return false;
   memset(publics_.get(), 0, sizeof(sp_public_t) * image_->NumPublics());
+  for (size_t i = 0; i < image_->NumPublics(); i++) {
+    const char* name;
+    image_->GetPublic(i, nullptr, &name);
+    if (!(public_names_[i] = atoms->add(name)))
+      return false;
+  }
 
   pubvars_ = std::make_unique<sp_pubvar_t[]>(image_->NumPubvars());
   if (!pubvars_)
@@ -89,12 +180,15 @@ PluginRuntime::Initialize()
   memset(entrypoints_.get(), 0, sizeof(ScriptedInvoker*) * image_->NumPublics());
 
   context_ = std::make_unique<PluginContext>(this);
-  if (!context_->Initialize())
+  if (!context_->Initialize(snapshot))
     return false;
 
   SetupFloatNativeRemapping();
 
-  if (!function_map_.init(32))
+  method_index_ = std::make_unique<uint32_t[]>(code_.length / sizeof(cell_t));
+  if (!method_invokers_.init(16))
+    return false;
+  if (!format_cache_.init())
     return false;
 
   return true;
@@ -170,13 +264,18 @@ NativeMustBeReplaced(IPluginContext* cx, const cell_t* params)
 void
 PluginRuntime::InstallBuiltinNatives()
 {
-  Environment* env = Environment::get();
+  Environment* env = env_;
   for (size_t i = 0; i < image_->NumNatives(); i++) {
-    if (!float_table_[i].found)
-      continue;
-
     const char* name = image_->GetNative(i);
     SPVM_NATIVE_FUNC func = env->builtins()->Lookup(name);
+    if (!float_table_[i].found) {
+      // The array, string and vector builtins are only a fallback; a host
+      // that binds its own keeps it.
+      if (func && natives_[i].status != SP_NATIVE_BOUND)
+        UpdateNativeBinding(i, func, 0, nullptr);
+      continue;
+    }
+
     if (!func)
       func = NativeMustBeReplaced;
     UpdateNativeBinding(i, func, 0, nullptr);
@@ -201,22 +300,23 @@ PluginRuntime::SetNames(const char* fullname, const char* name)
 RefPtr<MethodInfo>
 PluginRuntime::GetMethod(cell_t pcode_offset) const
 {
-  FunctionMap::Result r = function_map_.find(pcode_offset);
-  if (!r.found())
+  if (pcode_offset < 0 ||
+      size_t(pcode_offset) >= code_.length ||
+      !IsAligned(pcode_offset, sizeof(cell_t)))
+  {
     return nullptr;
-  return r->value;
+  }
+
+  uint32_t index = method_index_[pcode_offset / sizeof(cell_t)];
+  if (!index)
+    return nullptr;
+  return methods_->at(index - 1);
 }
 
 RefPtr<MethodInfo>
 PluginRuntime::AcquireMethod(cell_t pcode_offset)
 {
-  FunctionMap::Insert p = function_map_.findForAdd(pcode_offset);
-  if (p.found())
-    return p->value;
-
-  // Do some quick validation to make sure this is a valid offset. The only
-  // real reason to do this is so we don't fill the hash set with bogus
-  // methods.
+  // Do some quick validation to make sure this is a valid offset.
   if (pcode_offset < 0 ||
       size_t(pcode_offset) >= code_.length ||
       !IsAligned(pcode_offset, sizeof(cell_t)))
@@ -224,28 +324,357 @@ PluginRuntime::AcquireMethod(cell_t pcode_offset)
     return nullptr;
   }
 
+  uint32_t* index = &method_index_[pcode_offset / sizeof(cell_t)];
+  if (*index)
+    return methods_->at(*index - 1);
+
   const cell_t* address = reinterpret_cast<const cell_t*>(code_.bytes + pcode_offset);
   if (*address != OP_PROC)
     return nullptr;
 
   RefPtr<MethodInfo> method = new MethodInfo(this, pcode_offset);
-  if (!function_map_.add(p, pcode_offset, method))
-    return nullptr;
 
-  // Grab the lock before linking code in, since the watchdog timer will look
-  // at this list on another thread.
+  // The watchdog may be reading the list on another thread, but only sees
+  // the method once it has been fully added.
+  methods_->append(method);
+  *index = uint32_t(methods_->length());
+  return method;
+}
+
+void
+PluginRuntime::VerifyAllMethods()
+{
+  SharedImage* shared = shared_image();
+  if (shared && shared->fully_verified())
+    return;
+
+#if defined(SP_HAS_CODE_CACHE)
+  CodeCache* cache = env_->code_cache();
+  if (shared && cache && cache->LoadVerified(this, shared)) {
+    shared->setFullyVerified();
+    return;
+  }
+#endif
+
+  std::unordered_set<cell_t> seen;
+  std::vector<RefPtr<MethodInfo>> worklist;
+
+  auto enqueue = [&](cell_t offset) -> void {
+    if (!seen.insert(offset).second)
+      return;
+    if (RefPtr<MethodInfo> method = AcquireMethod(offset))
+      worklist.push_back(method);
+  };
+
+  for (size_t i = 0; i < image_->NumPublics(); i++) {
+    uint32_t offset;
+    const char* name;
+    image_->GetPublic(i, &offset, &name);
+    enqueue(offset);
+  }
+
+  // Graphs are only needed to find callees, so each is dropped as soon as
+  // its method is done.
+  while (!worklist.empty()) {
+    RefPtr<MethodInfo> method = worklist.back();
+    worklist.pop_back();
+    method->ValidateWithCallees(enqueue);
+  }
+
+  if (!shared)
+    return;
+  shared->setFullyVerified();
+#if defined(SP_HAS_CODE_CACHE)
+  if (cache)
+    cache->StoreVerified(this, shared);
+#endif
+}
+
+// Whether |to| can take over a context set up for |from|.
+static bool
+IsReplacementCompatible(LegacyImage* from, LegacyImage* to, char* error, size_t maxlength)
+{
+  // Compiled code calls natives through their entries, and hosts hold
+  // publics by index, so both lists must stay the same.
+  if (to->NumNatives() != from->NumNatives()) {
+    UTIL_Format(error, maxlength, "natives changed");
+    return false;
+  }
+  for (size_t i = 0; i < from->NumNatives(); i++) {
+    if (strcmp(to->GetNative(i), from->GetNative(i)) != 0) {
+      UTIL_Format(error, maxlength, "native \"%s\" changed", from->GetNative(i));
+      return false;
+    }
+  }
+  if (to->NumPublics() != from->NumPublics()) {
+    UTIL_Format(error, maxlength, "publics changed");
+    return false;
+  }
+  for (size_t i = 0; i < from->NumPublics(); i++) {
+    const char* from_name;
+    const char* to_name;
+    from->GetPublic(i, nullptr, &from_name);
+    to->GetPublic(i, nullptr, &to_name);
+    if (strcmp(to_name, from_name) != 0) {
+      UTIL_Format(error, maxlength, "public \"%s\" changed", from_name);
+      return false;
+    }
+  }
+  if (to->NumPubvars() != from->NumPubvars()) {
+    UTIL_Format(error, maxlength, "pubvars changed");
+    return false;
+  }
+  for (size_t i = 0; i < from->NumPubvars(); i++) {
+    uint32_t from_offset, to_offset;
+    const char* from_name;
+    const char* to_name;
+    from->GetPubvar(i, &from_offset, &from_name);
+    to->GetPubvar(i, &to_offset, &to_name);
+    if (to_offset != from_offset || strcmp(to_name, from_name) != 0) {
+      UTIL_Format(error, maxlength, "pubvar \"%s\" changed", from_name);
+      return false;
+    }
+  }
+
+  if (to->DescribeData().length != from->DescribeData().length ||
+      to->HeapSize() != from->HeapSize())
   {
-    std::lock_guard<ke::Mutex> lock(Environment::get()->lock());
-    methods_.push_back(method);
+    UTIL_Format(error, maxlength, "memory layout changed");
+    return false;
   }
-  return method;
+
+  // Every global that is still there must be where it was.
+  if (!from->NumDebugGlobals())
+    return true;
+  if (!to->NumDebugGlobals()) {
+    UTIL_Format(error, maxlength, "no debug info to check globals against");
+    return false;
+  }
+  std::unordered_map<std::string, uint32_t> globals;
+  for (size_t i = 0; i < to->NumDebugGlobals(); i++) {
+    uint32_t address;
+    const char* name;
+    to->GetDebugGlobal(i, &address, &name);
+    globals.emplace(name, address);
+  }
+  for (size_t i = 0; i < from->NumDebugGlobals(); i++) {
+    uint32_t address;
+    const char* name;
+    from->GetDebugGlobal(i, &address, &name);
+    auto iter = globals.find(name);
+    if (iter != globals.end() && iter->second != address) {
+      UTIL_Format(error, maxlength, "global \"%s\" moved", name);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether |method| is at the same place, with the same bytes, in |to|.
+static bool
+IsMethodUnchanged(MethodInfo* method, LegacyImage* from, const LegacyImage::Code& from_code,
+                  LegacyImage* to, const LegacyImage::Code& to_code)
+{
+  if (method->validationError() != SP_ERROR_NONE || !method->knownCallees())
+    return false;
+
+  uint32_t offset = method->pcode_offset();
+  uint32_t start, end, to_start, to_end;
+  if (!from->LookupFunctionRange(offset, &start, &end) || start != offset)
+    return false;
+  if (!to->LookupFunctionRange(offset, &to_start, &to_end) || to_start != start || to_end != end)
+    return false;
+  if (end > from_code.length || end > to_code.length)
+    return false;
+  return memcmp(from_code.bytes + start, to_code.bytes + start, end - start) == 0;
 }
 
-const std::vector<RefPtr<MethodInfo>>&
+bool
+PluginRuntime::ReplaceCode(const RefPtr<SharedImage>& image, char* error, size_t maxlength)
+{
+  if (!shared_image_) {
+    UTIL_Format(error, maxlength, "plugin was not loaded from a file");
+    return false;
+  }
+  if (image == shared_image_)
+    return true;
+  if (context_->IsInExec()) {
+    UTIL_Format(error, maxlength, "plugin is running");
+    return false;
+  }
+  if (recorder_) {
+    UTIL_Format(error, maxlength, "plugin is being recorded");
+    return false;
+  }
+
+  LegacyImage* next = image->image();
+  if (!IsReplacementCompatible(image_, next, error, maxlength))
+    return false;
+
+  Code next_code = next->DescribeCode();
+  std::unique_ptr<uint8_t[]> next_aligned_code;
+  if (!ke::IsAligned(next_code.bytes, sizeof(cell_t))) {
+    next_aligned_code = std::make_unique<uint8_t[]>(next_code.length);
+    memcpy(next_aligned_code.get(), next_code.bytes, next_code.length);
+    next_code.bytes = next_aligned_code.get();
+  }
+
+#if defined(SP_HAS_JIT)
+  // Both hold methods of the old code, and wait for their threads as they
+  // go away.
+  precompiler_ = nullptr;
+  compile_queue_ = nullptr;
+#endif
+
+  // Compiled calls are linked straight to their callee's code, so unchanged
+  // methods are only kept if everything they call is kept too.
+  std::unordered_map<cell_t, MethodInfo*> kept;
+  for (size_t i = 0; i < methods_->length(); i++) {
+    MethodInfo* method = methods_->at(i).get();
+    if (IsMethodUnchanged(method, image_, code_, next, next_code))
+      kept.emplace(method->pcode_offset(), method);
+  }
+  for (bool removed = true; removed;) {
+    removed = false;
+    for (auto iter = kept.begin(); iter != kept.end();) {
+      const std::vector<cell_t>& callees = *iter->second->knownCallees();
+      bool keep = std::all_of(callees.begin(), callees.end(), [&](cell_t callee) -> bool {
+        return kept.count(callee) != 0;
+      });
+      if (keep) {
+        iter++;
+      } else {
+        iter = kept.erase(iter);
+        removed = true;
+      }
+    }
+  }
+
+  std::unique_ptr<MethodList> next_methods = std::make_unique<MethodList>();
+  std::unique_ptr<uint32_t[]> next_method_index =
+    std::make_unique<uint32_t[]>(next_code.length / sizeof(cell_t));
+  for (size_t i = 0; i < methods_->length(); i++) {
+    const RefPtr<MethodInfo>& method = methods_->at(i);
+    if (!kept.count(method->pcode_offset()))
+      continue;
+    method->dropCodeReferences();
+    next_methods->append(method);
+    next_method_index[method->pcode_offset() / sizeof(cell_t)] = uint32_t(next_methods->length());
+  }
+
+  // Globals whose initial value changed take the new one; everything else
+  // keeps the value the plugin left it with.
+  Data next_data = next->DescribeData();
+  uint8_t* memory = context_->memory();
+  for (size_t i = 0; i < next_data.length; i++) {
+    if (next_data.bytes[i] != data_.bytes[i])
+      memory[i] = next_data.bytes[i];
+  }
+
+  {
+    // The watchdog walks the methods, and the old ones are freed with the
+    // rest of the retired methods.
+    std::lock_guard<ke::Mutex> lock(env_->lock());
+
+    env_->RetireMethods(std::move(methods_));
+    methods_ = std::move(next_methods);
+    method_index_ = std::move(next_method_index);
+
+    env_->image_cache()->Acquire(image.get());
+    env_->image_cache()->Release(shared_image_.get());
+    shared_image_ = image;
+    image_ = next;
+    code_ = next_code;
+    data_ = next_data;
+    aligned_code_ = std::move(next_aligned_code);
+
+    if (!breakpoints_.empty()) {
+      breakpoints_.assign(code_.length / sizeof(cell_t), false);
+      for (const auto& pair : kept) {
+        if (CompiledFunction* fun = pair.second->jit())
+          ArmBreakSites(fun);
+      }
+    }
+  }
+
+  // Public entries that were looked up point at the old code.
+  for (size_t i = 0; i < image_->NumPublics(); i++) {
+    if (!publics_[i].name)
+      continue;
+    uint32_t offset;
+    image_->GetPublic(i, &offset, nullptr);
+    publics_[i].code_offs = offset;
+  }
+  for (size_t i = 0; i < image_->NumPublics(); i++) {
+    if (entrypoints_[i])
+      entrypoints_[i]->ForgetMethod();
+  }
+  for (InvokerMap::iterator iter = method_invokers_.iter(); !iter.empty(); iter.next())
+    iter->value->ForgetMethod();
+
+  // Parsed formats are keyed by address, and string literals may have moved.
+  format_cache_.clear();
+
+  computed_code_hash_ = false;
+  computed_data_hash_ = false;
+  if (!md5_hashes_) {
+    FastHash::Compute(code_.bytes, code_.length, code_hash_);
+    FastHash::Compute(data_.bytes, data_.length, data_hash_);
+    computed_code_hash_ = true;
+    computed_data_hash_ = true;
+  }
+  return true;
+}
+
+#if defined(SP_HAS_JIT)
+void
+PluginRuntime::StartPrecompile()
+{
+  assert(!precompiler_);
+  precompiler_ = std::make_unique<Precompiler>(this);
+  if (!precompiler_->Start())
+    precompiler_ = nullptr;
+}
+
+void
+PluginRuntime::PublishPrecompiledCode(bool wait)
+{
+  if (!precompiler_)
+    return;
+  if (!wait && !precompiler_->finished())
+    return;
+
+  // Install() waits for the thread, so the precompiler can go right away.
+  std::unique_ptr<Precompiler> precompiler = std::move(precompiler_);
+  precompiler->Install();
+}
+
+bool
+PluginRuntime::QueueCompile(MethodInfo* method)
+{
+  if (!compile_queue_)
+    compile_queue_ = std::make_unique<CompileQueue>(this);
+  return compile_queue_->Enqueue(method);
+}
+
+void
+PluginRuntime::InstallQueuedCode()
+{
+  if (compile_queue_)
+    compile_queue_->Install();
+}
+
+bool
+PluginRuntime::HasQueuedCode() const
+{
+  return compile_queue_ && compile_queue_->hasFinished();
+}
+#endif
+
+const PluginRuntime::MethodList&
 PluginRuntime::AllMethods() const
 {
-  Environment::get()->lock().AssertCurrentThreadOwns();
-  return methods_;
+  return *methods_;
 }
 
 int
@@ -283,9 +712,12 @@ PluginRuntime::UpdateNativeBinding(uint32_t index, SPVM_NATIVE_FUNC pfn, uint32_
   {
     return SP_ERROR_PARAM;
   }
+  if (native->status == SP_NATIVE_BOUND)
+    native_epoch_++;
 
   native->legacy_fn = pfn;
   native->callback = nullptr;
+  native->typed = sp_typed_nativeinfo_t();
   native->status = pfn ? SP_NATIVE_BOUND : SP_NATIVE_UNBOUND;
   native->flags = flags;
   native->user = data;
@@ -310,27 +742,148 @@ PluginRuntime::UpdateNativeBindingObject(uint32_t index, INativeCallback* callba
   {
     return SP_ERROR_PARAM;
   }
+  if (native->status == SP_NATIVE_BOUND)
+    native_epoch_++;
 
   native->legacy_fn = nullptr;
   native->callback = callback;
+  native->typed = sp_typed_nativeinfo_t();
   native->status = callback ? SP_NATIVE_BOUND : SP_NATIVE_UNBOUND;
   native->flags = flags;
   native->user = data;
   return SP_ERROR_NONE;
 }
 
+int
+PluginRuntime::UpdateTypedNativeBinding(uint32_t index, const sp_typed_nativeinfo_t* info,
+                                        uint32_t flags, void* data)
+{
+  if (index >= image_->NumNatives())
+    return SP_ERROR_INDEX;
+  if (info && !IsValidTypedNative(info))
+    return SP_ERROR_PARAM;
+
+  // A native the plugin declared differently would fail or misread its
+  // arguments on every call, so it isn't bound at all.
+  const uint8_t* signature;
+  size_t length;
+  if (info && image_->GetNativeSignature(index, &signature, &length) &&
+      MatchRttiSignature(info, signature, length) == SignatureMatch::Mismatch)
+  {
+    return SP_ERROR_PARAM;
+  }
+
+  NativeEntry* native = &natives_[index];
+
+  // The native must either be unbound, or it must be ephemeral or optional.
+  // Otherwise, we've already baked its address in at callsites and it's too
+  // late to fix them.
+  if (native->status == SP_NATIVE_BOUND &&
+      !(native->flags & (SP_NTVFLAG_OPTIONAL|SP_NTVFLAG_EPHEMERAL)))
+  {
+    return SP_ERROR_PARAM;
+  }
+  if (native->status == SP_NATIVE_BOUND)
+    native_epoch_++;
+
+  native->legacy_fn = nullptr;
+  native->callback = nullptr;
+  native->typed = info ? *info : sp_typed_nativeinfo_t();
+  native->typed.name = nullptr;
+  native->status = info ? SP_NATIVE_BOUND : SP_NATIVE_UNBOUND;
+  native->flags = flags;
+  native->user = data;
+  return SP_ERROR_NONE;
+}
+
 const sp_native_t*
 PluginRuntime::GetNative(uint32_t index)
 {
   if (index >= image_->NumNatives())
     return nullptr;
 
-  if (!natives_[index].name)
-    natives_[index].name = image_->GetNative(index);
-
   return &natives_[index];
 }
 
+int
+PluginRuntime::SetBreakpoint(ucell_t addr, bool enabled)
+{
+  if (!env_->IsDebugBreakEnabled())
+    return SP_ERROR_NOTDEBUGGING;
+  if (addr >= code_.length || !IsAligned(addr, sizeof(cell_t)) ||
+      *reinterpret_cast<const cell_t*>(code_.bytes + addr) != OP_BREAK)
+  {
+    return SP_ERROR_INVALID_ADDRESS;
+  }
+
+  if (breakpoints_.empty())
+    breakpoints_.resize(code_.length / sizeof(cell_t));
+  breakpoints_[addr / sizeof(cell_t)] = enabled;
+
+  // The watchdog patches code too, so it can't be running.
+  std::lock_guard<ke::Mutex> lock(env_->lock());
+  for (const auto& method : *methods_) {
+    if (CompiledFunction* fun = method->jit())
+      ArmBreakSites(fun);
+  }
+  return SP_ERROR_NONE;
+}
+
+void
+PluginRuntime::SetSingleStep(bool enabled)
+{
+  single_step_ = enabled;
+
+  std::lock_guard<ke::Mutex> lock(env_->lock());
+  for (const auto& method : *methods_) {
+    if (CompiledFunction* fun = method->jit())
+      ArmBreakSites(fun);
+  }
+}
+
+void
+PluginRuntime::SetDataWatchCallback(SPVM_DATAWATCH_FUNC callback, void* data)
+{
+  data_watcher_.setCallback(callback, data);
+}
+
+int
+PluginRuntime::WatchData(cell_t local_addr, uint32_t bytes, uint32_t* id)
+{
+  // Only global data lives across invocations.
+  if (local_addr < 0 || !bytes || size_t(local_addr) >= context_->DataSize() ||
+      bytes > context_->DataSize() - size_t(local_addr))
+  {
+    return SP_ERROR_INVALID_ADDRESS;
+  }
+
+  *id = data_watcher_.add(context_->memory(), local_addr, bytes);
+  return SP_ERROR_NONE;
+}
+
+int
+PluginRuntime::UnwatchData(uint32_t id)
+{
+  if (!data_watcher_.remove(id))
+    return SP_ERROR_NOT_FOUND;
+  return SP_ERROR_NONE;
+}
+
+IPluginSnapshot*
+PluginRuntime::CreateSnapshot()
+{
+  return PluginSnapshot::Create(this);
+}
+
+void
+PluginRuntime::ArmBreakSites(CompiledFunction* fun)
+{
+  env_->lock().AssertCurrentThreadOwns();
+  const FixedArray<BreakSite>& sites = fun->break_sites();
+  for (size_t i = 0; i < sites.length(); i++)
+    fun->ArmBreakSite(i, ShouldBreakAt(fun->GetCodeOffset() + sites.at(i).cipoffs));
+}
+
 uint32_t
 PluginRuntime::GetNativesNum()
 {
@@ -358,7 +911,8 @@ PluginRuntime::GetPublicByIndex(uint32_t index, sp_public_t** out)
   sp_public_t& entry = publics_[index];
   if (!entry.name) {
     uint32_t offset;
-    image_->GetPublic(index, &offset, &entry.name);
+    image_->GetPublic(index, &offset, nullptr);
+    entry.name = public_names_[index]->chars();
     entry.code_offs = offset;
     entry.funcid = (index << 1) | 1;
   }
@@ -449,14 +1003,37 @@ PluginRuntime::GetFunctionById(funcid_t func_id)
       return NULL;
     pFunc = entrypoints_[func_id];
     if (!pFunc) {
-      entrypoints_[func_id] = new ScriptedInvoker(this, (func_id << 1) | 1, func_id);
+      entrypoints_[func_id] =
+        new (invoker_pool_) ScriptedInvoker(this, (func_id << 1) | 1, func_id);
       pFunc = entrypoints_[func_id];
     }
+  } else {
+    // Even IDs are code offsets, which any function can be called by.
+    pFunc = GetMethodFunction(func_id);
   }
 
   return pFunc;
 }
 
+ScriptedInvoker*
+PluginRuntime::GetMethodFunction(cell_t pcode_offset)
+{
+  InvokerMap::Insert p = method_invokers_.findForAdd(pcode_offset);
+  if (p.found())
+    return p->value;
+
+  RefPtr<MethodInfo> method = AcquireMethod(pcode_offset);
+  if (!method)
+    return nullptr;
+
+  ScriptedInvoker* pFunc = new (invoker_pool_) ScriptedInvoker(this, method);
+  if (!method_invokers_.add(p, pcode_offset, pFunc)) {
+    pFunc->~ScriptedInvoker();
+    return nullptr;
+  }
+  return pFunc;
+}
+
 ScriptedInvoker*
 PluginRuntime::GetPublicFunction(size_t index)
 {
@@ -466,7 +1043,7 @@ PluginRuntime::GetPublicFunction(size_t index)
     sp_public_t* pub = NULL;
     GetPublicByIndex(index, &pub);
     if (pub)
-      entrypoints_[index] = new ScriptedInvoker(this, (index << 1) | 1, index);
+      entrypoints_[index] = new (invoker_pool_) ScriptedInvoker(this, (index << 1) | 1, index);
     pFunc = entrypoints_[index];
   }
 
@@ -505,11 +1082,219 @@ PluginRuntime::IsPaused()
 size_t
 PluginRuntime::GetMemUsage()
 {
+  // Compiled code is given back to the code allocator when the runtime is
+  // destroyed, so it counts towards the plugin.
+  size_t jit_bytes = 0;
+  for (const auto& method : *methods_) {
+    if (CompiledFunction* fun = method->jit())
+      jit_bytes += fun->GetCodeLength();
+  }
+
   return sizeof(*this) +
          sizeof(PluginContext) +
          image_->ImageSize() +
          (aligned_code_ ? code_.length : 0) +
-         context_->HeapSize();
+         context_->HeapSize() +
+         jit_bytes;
+}
+
+static const char kMethodProfileHeader[] = "sourcepawn-method-profile 1";
+
+static void
+FormatCodeHash(const unsigned char* hash, char* buffer)
+{
+  for (size_t i = 0; i < 16; i++)
+    snprintf(buffer + i * 2, 3, "%02x", hash[i]);
+}
+
+bool
+PluginRuntime::WriteMethodProfile(FILE* fp)
+{
+  std::vector<RefPtr<MethodInfo>> hot;
+  for (const auto& method : *methods_) {
+    if (method->hotness() || method->jit())
+      hot.push_back(method);
+  }
+  std::stable_sort(hot.begin(), hot.end(),
+    [](const RefPtr<MethodInfo>& a, const RefPtr<MethodInfo>& b) -> bool {
+      return a->hotness() > b->hotness();
+  });
+
+  char hash[33];
+  FormatCodeHash(GetCodeHash(), hash);
+  fprintf(fp, "%s\n", kMethodProfileHeader);
+  fprintf(fp, "code-hash %s\n", hash);
+
+  for (const auto& method : hot) {
+    const char* name = nullptr;
+    if (LookupFunction(method->pcode_offset(), &name) != SP_ERROR_NONE)
+      name = "-";
+    fprintf(fp, "method %u %llu %s\n",
+            method->pcode_offset(),
+            (unsigned long long)method->hotness(),
+            name);
+  }
+  return !ferror(fp);
+}
+
+bool
+PluginRuntime::StartRecording(const char* path)
+{
+  StopRecording();
+  recorder_ = InvocationRecorder::Open(this, path);
+  if (!recorder_)
+    return false;
+  env_->AddNativeHook();
+  return true;
+}
+
+bool
+PluginRuntime::StopRecording()
+{
+  if (!recorder_)
+    return true;
+  bool ok = recorder_->close();
+  recorder_ = nullptr;
+  env_->RemoveNativeHook();
+  return ok;
+}
+
+void
+PluginRuntime::GetJitStats(JitStats* stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (const auto& method : *methods_) {
+    CompiledFunction* fun = method->jit();
+    if (!fun)
+      continue;
+    const CompileStats& cs = fun->stats();
+    stats->methods++;
+    if (cs.cached)
+      stats->cached_methods++;
+    stats->pcode_bytes += cs.pcode_bytes;
+    stats->code_bytes += fun->GetCodeLength();
+    stats->compile_ns += cs.compile_ns;
+    stats->ool_paths += cs.ool_paths;
+    stats->thunks += cs.thunks;
+  }
+}
+
+bool
+PluginRuntime::WriteJitReport(FILE* fp)
+{
+  std::vector<CompiledFunction*> funs;
+  for (const auto& method : *methods_) {
+    if (CompiledFunction* fun = method->jit())
+      funs.push_back(fun);
+  }
+  std::stable_sort(funs.begin(), funs.end(),
+    [](CompiledFunction* a, CompiledFunction* b) -> bool {
+      return a->stats().compile_ns > b->stats().compile_ns;
+  });
+
+  fprintf(fp, "%-40s %10s %10s %10s %6s %6s\n", "method", "pcode", "code", "time (us)",
+          "ool", "thunks");
+  for (CompiledFunction* fun : funs) {
+    const CompileStats& cs = fun->stats();
+    const char* name = nullptr;
+    if (LookupFunction(fun->GetCodeOffset(), &name) != SP_ERROR_NONE)
+      name = "-";
+    if (cs.cached) {
+      fprintf(fp, "%-40s %10s %10zu %10s %6s %6s\n", name, "-", fun->GetCodeLength(),
+              "cached", "-", "-");
+      continue;
+    }
+    fprintf(fp, "%-40s %10u %10zu %10.1f %6u %6u\n", name, cs.pcode_bytes,
+            fun->GetCodeLength(), double(cs.compile_ns) / 1e3, cs.ool_paths, cs.thunks);
+  }
+
+  JitStats stats;
+  GetJitStats(&stats);
+  fprintf(fp, "%u methods (%u cached): %llu bytes of p-code to %llu bytes of code in %.3fms\n",
+          stats.methods, stats.cached_methods, (unsigned long long)stats.pcode_bytes,
+          (unsigned long long)stats.code_bytes, double(stats.compile_ns) / 1e6);
+  return !ferror(fp);
+}
+
+bool
+PluginRuntime::WriteOpcodeHistogram(FILE* fp, bool per_method)
+{
+  OpcodeHistogram plugin;
+  std::vector<MethodInfo*> methods;
+  for (const auto& method : *methods_) {
+    if (const OpcodeHistogram* counts = method->executedOps()) {
+      plugin.merge(*counts);
+      methods.push_back(method.get());
+    }
+  }
+
+  fprintf(fp, "%s: %llu ops run\n", Name(), (unsigned long long)plugin.total());
+  plugin.report(fp, OPCODES_TOTAL, true);
+  if (!per_method)
+    return !ferror(fp);
+
+  std::stable_sort(methods.begin(), methods.end(), [](MethodInfo* a, MethodInfo* b) -> bool {
+    return a->executedOps()->total() > b->executedOps()->total();
+  });
+  for (MethodInfo* method : methods) {
+    const char* name = nullptr;
+    if (LookupFunction(method->pcode_offset(), &name) != SP_ERROR_NONE)
+      name = "-";
+    fprintf(fp, "%s: %llu ops run\n", name,
+            (unsigned long long)method->executedOps()->total());
+    method->executedOps()->report(fp, 10, false);
+  }
+  return !ferror(fp);
+}
+
+bool
+PluginRuntime::ApplyMethodProfile(FILE* fp)
+{
+  char line[512];
+  if (!fgets(line, sizeof(line), fp) ||
+      strncmp(line, kMethodProfileHeader, sizeof(kMethodProfileHeader) - 1) != 0)
+  {
+    return false;
+  }
+
+  char expected[33], hash[33];
+  FormatCodeHash(GetCodeHash(), expected);
+  if (!fgets(line, sizeof(line), fp) ||
+      sscanf(line, "code-hash %32s", hash) != 1 ||
+      strcmp(hash, expected) != 0)
+  {
+    return false;
+  }
+
+  // Entries are written hottest first.
+  std::vector<RefPtr<MethodInfo>> profiled;
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned offset;
+    unsigned long long hotness;
+    if (sscanf(line, "method %u %llu", &offset, &hotness) != 2)
+      return false;
+    if (offset > INT_MAX)
+      return false;
+
+    RefPtr<MethodInfo> method = AcquireMethod(cell_t(offset));
+    if (!method)
+      return false;
+    method->seedHotness(hotness);
+    profiled.push_back(method);
+  }
+
+#if defined(SP_HAS_JIT)
+  // Methods that fail to compile are left alone; the error is reported
+  // when they're first called, as usual.
+  if (env_->IsJitEnabled()) {
+    for (const auto& method : profiled) {
+      int err;
+      if (!method->jit())
+        CompilerBase::Compile(context(), method, &err);
+    }
+  }
+#endif
+  return true;
 }
 
 unsigned char*
@@ -538,6 +1323,28 @@ PluginRuntime::GetDataHash()
   return data_hash_;
 }
 
+NativeCallStats*
+PluginRuntime::nativeStats(size_t index)
+{
+  if (!native_stats_) {
+    size_t count = image_->NumNatives();
+    native_stats_.reset(new NativeCallStats[count]);
+    memset(native_stats_.get(), 0, sizeof(NativeCallStats) * count);
+  }
+  return &native_stats_[index];
+}
+
+NativeMemo*
+PluginRuntime::NewNativeMemo(uint32_t epoch)
+{
+  std::unique_ptr<NativeMemo> memo = std::make_unique<NativeMemo>();
+
+  // Nothing is remembered yet.
+  memo->epoch = epoch - 1;
+  native_memos_.push_back(std::move(memo));
+  return native_memos_.back().get();
+}
+
 PluginContext*
 PluginRuntime::GetBaseContext()
 {
@@ -13,14 +13,22 @@
 #ifndef _INCLUDE_SOURCEPAWN_JIT_RUNTIME_H_
 #define _INCLUDE_SOURCEPAWN_JIT_RUNTIME_H_
 
+#include <stdio.h>
 #include <sp_vm_api.h>
 #include <am-vector.h>
 #include <am-string.h>
 #include <am-inlinelist.h>
 #include <am-hashmap.h>
 #include <amtl/am-refcounting.h>
+#include "append-only-list.h"
 #include "scripted-invoker.h"
 #include "legacy-image.h"
+#include "invocation-recorder.h"
+#include "native-tracer.h"
+#include "pool-allocator.h"
+#include "data-watch.h"
+#include "string-format.h"
+#include "shared/string-atom.h"
 
 namespace sp {
 
@@ -28,6 +36,11 @@ using namespace ke;
 
 class PluginContext;
 class MethodInfo;
+class Precompiler;
+class CompileQueue;
+class SharedImage;
+class CompiledFunction;
+class PluginSnapshot;
 
 struct floattbl_t
 {
@@ -42,10 +55,42 @@ struct floattbl_t
 struct NativeEntry : public sp_native_t
 {
   NativeEntry()
-   : legacy_fn(nullptr)
+   : legacy_fn(nullptr),
+     typed()
   {}
+
+  // The function a JIT'd call site may call directly, if any.
+  void* direct_fn() const {
+    if (legacy_fn)
+      return reinterpret_cast<void*>(legacy_fn);
+    return reinterpret_cast<void*>(typed.func);
+  }
+
   SPVM_NATIVE_FUNC legacy_fn;
   RefPtr<SourcePawn::INativeCallback> callback;
+
+  // Set if bound with UpdateTypedNativeBinding; |typed.name| is not used.
+  sp_typed_nativeinfo_t typed;
+};
+
+// Pure natives with at most this many arguments may have their results
+// remembered at a call site.
+static const uint32_t kMaxMemoArgs = 4;
+
+// The last call made through one call site of an SP_NTVFLAG_PURE native,
+// which compiled code checks and fills in place of calling it again.
+struct NativeMemo
+{
+  NativeMemo()
+   : epoch(0),
+     args(),
+     result(0)
+  {}
+
+  // The environment's memo epoch when the result was stored.
+  uint32_t epoch;
+  cell_t args[kMaxMemoArgs];
+  cell_t result;
 };
 
 /* Jit wants fast access to this so we expose things as public */
@@ -55,10 +100,12 @@ class PluginRuntime
     public ke::InlineListNode<PluginRuntime>
 {
  public:
-  PluginRuntime(LegacyImage* image);
+  explicit PluginRuntime(LegacyImage* image, bool md5_hashes = false);
+  explicit PluginRuntime(const RefPtr<SharedImage>& image, bool md5_hashes = false);
   ~PluginRuntime();
 
-  bool Initialize();
+  // With a |snapshot|, the context's memory starts out as the snapshot.
+  bool Initialize(const PluginSnapshot* snapshot = nullptr);
 
  public:
   virtual bool IsDebugging() override;
@@ -85,10 +132,22 @@ class PluginRuntime
   void SetNames(const char* fullname, const char* name);
   unsigned GetNativeReplacement(size_t index);
   ScriptedInvoker* GetPublicFunction(size_t index);
+
+  // Returns the function that starts at |pcode_offset|, which need not be
+  // public, or null if no function starts there. Its ID is the offset.
+  ScriptedInvoker* GetMethodFunction(cell_t pcode_offset);
   int UpdateNativeBinding(uint32_t index, SPVM_NATIVE_FUNC pfn, uint32_t flags, void* data) override;
+  int UpdateTypedNativeBinding(uint32_t index, const sp_typed_nativeinfo_t* info, uint32_t flags,
+                               void* data) override;
   int UpdateNativeBindingObject(uint32_t index, INativeCallback* callback, uint32_t flags,
                                 void* data) override;
   const sp_native_t* GetNative(uint32_t index) override;
+  int SetBreakpoint(ucell_t addr, bool enabled) override;
+  void SetSingleStep(bool enabled) override;
+  void SetDataWatchCallback(SPVM_DATAWATCH_FUNC callback, void* data) override;
+  int WatchData(cell_t local_addr, uint32_t bytes, uint32_t* id) override;
+  int UnwatchData(uint32_t id) override;
+  IPluginSnapshot* CreateSnapshot() override;
   int LookupLine(ucell_t addr, uint32_t* line) override;
   int LookupFunction(ucell_t addr, const char** name) override;
   int LookupFile(ucell_t addr, const char** filename) override;
@@ -110,15 +169,131 @@ class PluginRuntime
   // method, return it.
   RefPtr<MethodInfo> AcquireMethod(cell_t pcode_offset);
 
-  // Return a list of all methods. The caller must own the environment lock.
-  const std::vector<RefPtr<MethodInfo>>& AllMethods() const;
+  // Whether the BREAK at |addr| should call the debugger.
+  bool ShouldBreakAt(ucell_t addr) const {
+    return single_step_ || (addr / sizeof(cell_t) < breakpoints_.size() &&
+                            breakpoints_[addr / sizeof(cell_t)]);
+  }
+
+  // Arms the break sites in |fun| that should call the debugger, and
+  // disarms the rest. The caller must own the environment lock.
+  void ArmBreakSites(CompiledFunction* fun);
+
+  typedef AppendOnlyList<RefPtr<MethodInfo>> MethodList;
+
+  // Return a list of all methods. Only the runtime's thread adds to it, but
+  // any thread may read it.
+  const MethodList& AllMethods() const;
 
   NativeEntry* NativeAt(size_t index) {
     return &natives_[index];
   }
+  // Names interned in the environment's atoms.
+  Atom* NativeName(size_t index) const {
+    return native_names_[index];
+  }
+  Atom* PublicName(size_t index) const {
+    return public_names_[index];
+  }
+
+  // Bumped whenever a bound native is rebound or unbound. JIT'd code that
+  // calls a mutable native directly compares against the epoch it was
+  // compiled under, and takes the generic path if it has changed.
+  uint32_t native_epoch() const {
+    return native_epoch_;
+  }
+  uint32_t* addressOfNativeEpoch() {
+    return &native_epoch_;
+  }
+
+  // Returns a new call site memo, which lives as long as the runtime. Only
+  // the VM thread may call this.
+  NativeMemo* NewNativeMemo(uint32_t epoch);
+
+  // Statistics for calls to the native at |index|, allocated for every
+  // native the first time one is traced.
+  NativeCallStats* nativeStats(size_t index);
+  const NativeCallStats* native_stats() const {
+    return native_stats_.get();
+  }
 
   PluginContext* GetBaseContext();
 
+  PoolAllocator& invoker_pool() {
+    return invoker_pool_;
+  }
+
+  // Verifies every method reachable from a public up front, rather than each
+  // one the first time it is called. Results are shared with other runtimes
+  // loaded from the same image, and saved in the code cache if there is one.
+  void VerifyAllMethods();
+
+  // Swaps in a newer build of the plugin's code, keeping its context: the
+  // values of globals (except those whose initial values changed), the heap,
+  // and native bindings. The new image must import the same natives and
+  // export the same publics and pubvars, and lay out .data the same way.
+  // Compiled code is kept for methods that didn't change. Must not be called
+  // while the plugin is running.
+  bool ReplaceCode(const RefPtr<SharedImage>& image, char* error, size_t maxlength);
+
+  // Writes how hot each method that has run is, keyed by its code offset and
+  // the code hash, in a form that ApplyMethodProfile can read back.
+  bool WriteMethodProfile(FILE* fp);
+
+  // Records the invocations the host makes into this plugin to |path|; see
+  // InvocationRecorder. Stopping returns false if the recording couldn't be
+  // written.
+  bool StartRecording(const char* path);
+  bool StopRecording();
+  InvocationRecorder* recorder() const {
+    return recorder_.get();
+  }
+
+  // Watched ranges of global data; see DataWatcher.
+  DataWatcher& data_watcher() {
+    return data_watcher_;
+  }
+  FormatCache& format_cache() {
+    return format_cache_;
+  }
+
+  // Sums up, or lists per method, what compiling this plugin has cost.
+  void GetJitStats(JitStats* stats);
+  bool WriteJitReport(FILE* fp);
+
+  // Writes the ops the interpreter ran while opcode counting was on, for
+  // the whole plugin and then (if |per_method|) for each method, hottest
+  // first. The plugin's operand values are included.
+  bool WriteOpcodeHistogram(FILE* fp, bool per_method);
+
+  // Seeds method counters from a profile of the same code, then compiles the
+  // profiled methods hottest first, so they start out compiled and packed
+  // together. Returns false if the profile is malformed or is for different
+  // code.
+  bool ApplyMethodProfile(FILE* fp);
+
+#if defined(SP_HAS_JIT)
+  // Compiles every method reachable from a public on a background thread.
+  void StartPrecompile();
+
+  // Installs whatever the background compile produced. Unless |wait| is
+  // true, this does nothing while the compile thread is still running. Must
+  // be called on the VM thread.
+  void PublishPrecompiledCode(bool wait);
+  bool HasPendingPrecompile() const {
+    return !!precompiler_;
+  }
+
+  // Queues |method| to be compiled in the background; see CompileQueue.
+  // Returns false if the caller should compile it now instead.
+  bool QueueCompile(MethodInfo* method);
+
+  // Installs whatever the compile queue has finished. Must be called on the
+  // VM thread.
+  void InstallQueuedCode();
+  bool HasQueuedCode() const;
+#endif
+
   const char* Name() const {
     return name_.c_str();
   }
@@ -138,17 +313,31 @@ class PluginRuntime
     return data_;
   }
   LegacyImage* image() const {
-    return image_.get();
+    return image_;
+  }
+  // Non-null if the image may be shared with other runtimes.
+  SharedImage* shared_image() const {
+    return shared_image_.get();
   }
   PluginContext* context() const {
     return context_.get();
   }
+  Environment* env() const {
+    return env_;
+  }
+  bool md5_hashes() const {
+    return md5_hashes_;
+  }
 
  private:
+  void Setup();
   void SetupFloatNativeRemapping();
 
  private:
-  std::unique_ptr<sp::LegacyImage> image_;
+  Environment* env_;
+  std::unique_ptr<sp::LegacyImage> owned_image_;
+  RefPtr<SharedImage> shared_image_;
+  sp::LegacyImage* image_;
   std::unique_ptr<uint8_t[]> aligned_code_;
   std::unique_ptr<floattbl_t[]> float_table_;
   std::string name_;
@@ -156,7 +345,9 @@ class PluginRuntime
   Code code_;
   Data data_;
   std::unique_ptr<NativeEntry[]> natives_;
+  std::unique_ptr<Atom*[]> native_names_;
   std::unique_ptr<sp_public_t[]> publics_;
+  std::unique_ptr<Atom*[]> public_names_;
   std::unique_ptr<sp_pubvar_t[]> pubvars_;
   std::unique_ptr<ScriptedInvoker*[]> entrypoints_;
   std::unique_ptr<PluginContext> context_;
@@ -169,15 +360,44 @@ class PluginRuntime
       return a == b;
     }
   };
-  typedef ke::HashMap<ucell_t, RefPtr<MethodInfo>, FunctionMapPolicy> FunctionMap;
 
-  FunctionMap function_map_;
-  std::vector<RefPtr<MethodInfo>> methods_;;
+  // Handed to the environment when the runtime is destroyed; see
+  // Environment::RetireMethods.
+  std::unique_ptr<MethodList> methods_;
+  // For each cell of code, one more than the index in |methods_| of the
+  // method starting there, or 0 if none has been acquired. Resolving a call
+  // is then a single load.
+  std::unique_ptr<uint32_t[]> method_index_;
+
+  // Invokers for functions looked up by code offset, rather than public ID.
+  typedef ke::HashMap<ucell_t, ScriptedInvoker*, FunctionMapPolicy> InvokerMap;
+  InvokerMap method_invokers_;
+
+  // Every invoker, and its name, is allocated here.
+  PoolAllocator invoker_pool_;
 
   // Pause state.
   bool paused_;
 
-  // Checksumming.
+  // Debugger breakpoints, one per cell of code.
+  std::vector<bool> breakpoints_;
+  bool single_step_;
+
+  uint32_t native_epoch_;
+  std::vector<std::unique_ptr<NativeMemo>> native_memos_;
+  std::unique_ptr<NativeCallStats[]> native_stats_;
+  std::unique_ptr<InvocationRecorder> recorder_;
+  DataWatcher data_watcher_;
+  FormatCache format_cache_;
+
+#if defined(SP_HAS_JIT)
+  std::unique_ptr<Precompiler> precompiler_;
+  std::unique_ptr<CompileQueue> compile_queue_;
+#endif
+
+  // Checksumming. Unless MD5 was requested, both digests are FastHash
+  // digests computed once in Initialize().
+  bool md5_hashes_;
   bool computed_code_hash_;
   bool computed_data_hash_;
   unsigned char code_hash_[16];
@@ -0,0 +1,91 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+
+#include <memory>
+
+#include "api.h"
+#include "environment.h"
+#include "plugin-context.h"
+#include "plugin-snapshot.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+PluginSnapshot::PluginSnapshot()
+ : md5_hashes_(false),
+   hp_(0)
+{
+}
+
+PluginSnapshot::~PluginSnapshot()
+{
+}
+
+PluginSnapshot*
+PluginSnapshot::Create(PluginRuntime* rt)
+{
+  PluginContext* cx = rt->GetBaseContext();
+  if (!rt->shared_image() || cx->IsInExec())
+    return nullptr;
+
+  std::unique_ptr<PluginSnapshot> snapshot(new PluginSnapshot());
+  snapshot->image_ = rt->shared_image();
+  snapshot->md5_hashes_ = rt->md5_hashes();
+  snapshot->full_name_ = rt->GetFilename();
+  snapshot->name_ = rt->Name();
+  snapshot->hp_ = cx->hp();
+
+  snapshot->memory_ = DataImage::Create(rt->env(), cx->memory(), size_t(cx->hp()), nullptr);
+  if (!snapshot->memory_)
+    snapshot->bytes_.assign(cx->memory(), cx->memory() + cx->hp());
+
+  size_t num_natives = rt->image()->NumNatives();
+  snapshot->natives_.resize(num_natives);
+  for (size_t i = 0; i < num_natives; i++)
+    snapshot->natives_[i] = *rt->NativeAt(i);
+  return snapshot.release();
+}
+
+bool
+PluginSnapshot::MapInto(PluginMemory* backing, size_t mem_size) const
+{
+  if (memory_)
+    return backing->MapShared(mem_size, memory_.get());
+  return backing->Copy(mem_size, bytes_.data(), bytes_.size());
+}
+
+IPluginRuntime*
+PluginSnapshot::Instantiate(char* error, size_t maxlength)
+{
+  std::unique_ptr<PluginRuntime> rt(new PluginRuntime(image_, md5_hashes_));
+  if (!rt->Initialize(this)) {
+    UTIL_Format(error, maxlength, "out of memory");
+    return nullptr;
+  }
+  rt->SetNames(full_name_.c_str(), name_.c_str());
+
+  // The names point at the same interned strings, so only the binding is
+  // copied.
+  for (size_t i = 0; i < natives_.size(); i++) {
+    const NativeEntry& from = natives_[i];
+    NativeEntry* native = rt->NativeAt(i);
+    native->legacy_fn = from.legacy_fn;
+    native->callback = from.callback;
+    native->typed = from.typed;
+    native->status = from.status;
+    native->flags = from.flags;
+    native->user = from.user;
+  }
+  return rt.release();
+}
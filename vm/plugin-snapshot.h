@@ -0,0 +1,68 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_plugin_snapshot_h_
+#define _include_sourcepawn_vm_plugin_snapshot_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <sp_vm_api.h>
+#include <amtl/am-refcounting.h>
+#include "image-cache.h"
+#include "plugin-memory.h"
+#include "plugin-runtime.h"
+
+namespace sp {
+
+// Everything below the heap pointer of a context between invocations, which
+// new contexts map copy-on-write, so a plugin's start-up work is paid for
+// once no matter how many instances of it are made. The stack is empty
+// between invocations, so it isn't part of the snapshot.
+class PluginSnapshot final : public SourcePawn::IPluginSnapshot
+{
+ public:
+  // Returns null if |rt| is running, or has no shared image to start from.
+  static PluginSnapshot* Create(PluginRuntime* rt);
+  ~PluginSnapshot() override;
+
+  SourcePawn::IPluginRuntime* Instantiate(char* error, size_t maxlength) override;
+
+  // Sets up |backing| as |mem_size| bytes starting with the snapshot.
+  bool MapInto(PluginMemory* backing, size_t mem_size) const;
+
+  cell_t hp() const {
+    return hp_;
+  }
+
+ private:
+  PluginSnapshot();
+
+ private:
+  ke::RefPtr<SharedImage> image_;
+  bool md5_hashes_;
+  std::string full_name_;
+  std::string name_;
+  cell_t hp_;
+  // The memory, in a mapping if the platform can make one, otherwise
+  // copied.
+  ke::RefPtr<DataImage> memory_;
+  std::vector<uint8_t> bytes_;
+  std::vector<NativeEntry> natives_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_plugin_snapshot_h_
@@ -0,0 +1,138 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "precompiler.h"
+
+#include <unordered_set>
+
+#include <amtl/am-thread.h>
+#include "environment.h"
+#include "jit.h"
+#include "plugin-runtime.h"
+#include "pool-allocator.h"
+
+namespace sp {
+
+Precompiler::Precompiler(PluginRuntime* rt)
+ : rt_(rt),
+   cancel_(false),
+   finished_(false)
+{
+}
+
+Precompiler::~Precompiler()
+{
+  if (thread_) {
+    cancel_.store(true, std::memory_order_relaxed);
+    thread_->join();
+  }
+}
+
+bool
+Precompiler::Start()
+{
+  Discover();
+  if (jobs_.empty())
+    return false;
+
+  // Describing code looks up names and lines, and the image's debug info is
+  // validated on first use; make sure that happens on this thread.
+  if (rt_->env()->code_map())
+    rt_->image()->LookupFunction(0);
+
+  thread_ = ke::NewThread("SourcePawn Precompiler", [this]() -> void {
+    Run();
+  });
+  return !!thread_;
+}
+
+void
+Precompiler::Discover()
+{
+  // Acquiring and verifying methods touches state that is only safe on the
+  // VM thread, so the call graph is walked here. Each method is verified
+  // once, and its graph is handed to the compile thread.
+  std::unordered_set<cell_t> seen;
+  std::vector<RefPtr<MethodInfo>> worklist;
+
+  auto enqueue = [&](cell_t offset) -> void {
+    if (!seen.insert(offset).second)
+      return;
+    if (RefPtr<MethodInfo> method = rt_->AcquireMethod(offset))
+      worklist.push_back(method);
+  };
+
+  for (size_t i = 0; i < rt_->image()->NumPublics(); i++) {
+    uint32_t offset;
+    const char* name;
+    rt_->image()->GetPublic(i, &offset, &name);
+    enqueue(offset);
+  }
+
+  while (!worklist.empty()) {
+    RefPtr<MethodInfo> method = worklist.back();
+    worklist.pop_back();
+
+    if (method->jit())
+      continue;
+
+    RefPtr<ControlFlowGraph> graph = method->ValidateWithCallees(enqueue);
+    if (!graph)
+      continue;
+
+    Job job;
+    job.method = method;
+    job.graph = graph;
+    jobs_.push_back(std::move(job));
+  }
+}
+
+void
+Precompiler::Run()
+{
+  // The compiler reads environment settings and the addresses it embeds in
+  // code through Environment::get().
+  Environment::AttachToThread(rt_->env());
+  PoolAllocator::InitDefault();
+
+  for (Job& job : jobs_) {
+    if (cancel_.load(std::memory_order_relaxed))
+      break;
+
+    // Methods that fail to compile are left alone; compiling them lazily
+    // will report the error.
+    job.fun.reset(CompilerBase::CompileOffThread(rt_, job.method.get(), job.graph,
+                                                 &code_alloc_));
+    job.graph = nullptr;
+  }
+
+  PoolAllocator::FreeDefault();
+  Environment::AttachToThread(nullptr);
+  finished_.store(true, std::memory_order_release);
+}
+
+void
+Precompiler::Install()
+{
+  if (thread_) {
+    thread_->join();
+    thread_ = nullptr;
+  }
+
+  for (Job& job : jobs_) {
+    if (job.fun && !job.method->jit())
+      job.method->setCompiledFunction(job.fun.release());
+  }
+  jobs_.clear();
+}
+
+} // namespace sp
@@ -0,0 +1,73 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_precompiler_h_
+#define _include_sourcepawn_vm_precompiler_h_
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <amtl/am-refcounting.h>
+#include "code-allocator.h"
+#include "compiled-function.h"
+#include "control-flow.h"
+#include "method-info.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// Compiles a whole plugin ahead of time. Every method reachable from a public
+// is found and verified on the calling thread, then compiled on a background
+// thread into code memory of its own. Nothing is visible to the runtime until
+// Install(), which puts all of it in place at once.
+class Precompiler
+{
+ public:
+  explicit Precompiler(PluginRuntime* rt);
+  ~Precompiler();
+
+  // Returns false if there is nothing to compile.
+  bool Start();
+
+  bool finished() const {
+    return finished_.load(std::memory_order_acquire);
+  }
+
+  // Waits for the compile thread, then installs every method that was not
+  // compiled on the VM thread in the meantime.
+  void Install();
+
+ private:
+  void Discover();
+  void Run();
+
+ private:
+  struct Job {
+    ke::RefPtr<MethodInfo> method;
+    ke::RefPtr<ControlFlowGraph> graph;
+    std::unique_ptr<CompiledFunction> fun;
+  };
+
+  PluginRuntime* rt_;
+  std::vector<Job> jobs_;
+  CodeAllocator code_alloc_;
+  std::unique_ptr<std::thread> thread_;
+  std::atomic<bool> cancel_;
+  std::atomic<bool> finished_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_precompiler_h_
@@ -16,6 +16,11 @@
 // along with SourcePawn.  If not, see <http://www.gnu.org/licenses/>.
 #include "runtime-helpers.h"
 #include "environment.h"
+#include "native-tracer.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+#include "typed-natives.h"
+#include "watchdog_timer.h"
 
 namespace sp {
 
@@ -46,4 +51,36 @@ ReportUnboundNative()
   Environment::get()->ReportError(SP_ERROR_INVALID_NATIVE);
 }
 
+cell_t
+NativeInvokeThunk(NativeEntry* native, IPluginContext* ctx, const cell_t* params)
+{
+  // The exit frame is complete here, so this is a safe place to sample.
+  Environment* env = Environment::get();
+  env->watchdog()->HandleSampleRequest();
+
+  if (env->HasNativeHooks()) {
+    PluginRuntime* rt = static_cast<PluginContext*>(ctx)->runtime();
+    uint32_t index = uint32_t(native - rt->NativeAt(0));
+    cell_t result;
+    {
+      AutoTraceNative trace(env, rt, index);
+      result = InvokeNative(native, ctx, params);
+    }
+    if (InvocationRecorder* recorder = rt->recorder())
+      recorder->native(index, result);
+    return result;
+  }
+  return InvokeNative(native, ctx, params);
+}
+
+cell_t
+SharedNativeInvokeThunk(NativeEntry* native, IPluginContext* ctx, const cell_t* params)
+{
+  if (native->status != SP_NATIVE_BOUND) {
+    ReportUnboundNative();
+    return 0;
+  }
+  return NativeInvokeThunk(native, ctx, params);
+}
+
 } // namespace sp
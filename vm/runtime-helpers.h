@@ -19,11 +19,27 @@
 
 #include <sp_vm_types.h>
 
+namespace SourcePawn {
+class IPluginContext;
+} // namespace SourcePawn
+
 namespace sp {
 
+struct NativeEntry;
+
 void ReportOutOfBoundsError(cell_t index, cell_t bounds);
 void ReportUnboundNative();
 
+// Calls a native for compiled code, once its exit frame is complete, tracing
+// or recording the call while native hooks are on.
+cell_t NativeInvokeThunk(NativeEntry* native, SourcePawn::IPluginContext* ctx,
+                         const cell_t* params);
+
+// The same, for call sites that go through the shared native stub, which
+// also leaves checking the binding to this.
+cell_t SharedNativeInvokeThunk(NativeEntry* native, SourcePawn::IPluginContext* ctx,
+                               const cell_t* params);
+
 } // namespace sp
 
 #endif // _include_sourcepawn_runtime_helpers_h_
@@ -0,0 +1,106 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "sampling-profiler.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "environment.h"
+#include "plugin-runtime.h"
+#include "stack-frames.h"
+
+namespace sp {
+
+SamplingProfiler::SamplingProfiler()
+ : num_samples_(0)
+{
+}
+
+static void
+AppendFrame(std::string* out, const FrameIterator& iter)
+{
+  char buffer[64];
+
+  if (iter.IsNativeFrame()) {
+    const char* name = iter.FunctionName();
+    *out += name ? name : "<unknown native>";
+    *out += " [native]";
+    return;
+  }
+
+  PluginRuntime* rt = PluginRuntime::FromAPI(iter.Context()->GetRuntime());
+  const char* name = iter.FunctionName();
+  *out += rt->Name();
+  *out += "!";
+  *out += name ? name : "<unknown>";
+
+  // Without debug info, the offset into the method is the best we can do.
+  // Plugins without line info usually still have rtti.methods to find it.
+  uint32_t start, end;
+  if (unsigned line = iter.LineNumber())
+    snprintf(buffer, sizeof(buffer), ":%u", line);
+  else if (rt->image()->LookupFunctionRange(iter.cip(), &start, &end))
+    snprintf(buffer, sizeof(buffer), "+0x%x", unsigned(iter.cip() - start));
+  else
+    snprintf(buffer, sizeof(buffer), "+0x%x", unsigned(iter.cip()));
+  *out += buffer;
+}
+
+void
+SamplingProfiler::TakeSample()
+{
+  std::vector<std::string> frames;
+  for (FrameIterator iter; !iter.Done(); iter.Next()) {
+    if (iter.IsInternalFrame())
+      continue;
+
+    std::string frame;
+    AppendFrame(&frame, iter);
+
+    // Semicolons separate frames, and the count follows the last space, so
+    // neither may appear in a name. Spaces are fine elsewhere.
+    std::replace(frame.begin(), frame.end(), ';', ':');
+    frames.push_back(std::move(frame));
+  }
+  if (frames.empty())
+    return;
+
+  std::string stack;
+  for (size_t i = frames.size(); i > 0; i--) {
+    if (!stack.empty())
+      stack += ";";
+    stack += frames[i - 1];
+  }
+
+  stacks_[stack]++;
+  num_samples_++;
+}
+
+bool
+SamplingProfiler::Write(FILE* fp) const
+{
+  for (const auto& entry : stacks_) {
+    if (fprintf(fp, "%s %llu\n", entry.first.c_str(), (unsigned long long)entry.second) < 0)
+      return false;
+  }
+  return true;
+}
+
+void
+SamplingProfiler::Clear()
+{
+  stacks_.clear();
+  num_samples_ = 0;
+}
+
+} // namespace sp
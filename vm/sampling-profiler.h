@@ -0,0 +1,57 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_sampling_profiler_h_
+#define _include_sourcepawn_vm_sampling_profiler_h_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace sp {
+
+// Counts how often each call stack is seen. The watchdog thread decides when
+// a sample is due, but the stack is only walked on the VM thread, at a point
+// where every frame is known to be complete: an interpreter back edge or
+// native call, a call into the VM, a lazy JIT compile, or a native call from
+// code compiled while sampling was on.
+//
+// Each stack is recorded outermost frame first, as a list of
+// "plugin!function:line" entries separated by semicolons, which is the
+// "folded" format flamegraph.pl and similar tools read.
+class SamplingProfiler
+{
+ public:
+  SamplingProfiler();
+
+  // Must be called on the VM thread.
+  void TakeSample();
+
+  // Writes one "stack count" line per distinct stack. Returns false if the
+  // file couldn't be written.
+  bool Write(FILE* fp) const;
+  void Clear();
+
+  uint64_t numSamples() const {
+    return num_samples_;
+  }
+
+ private:
+  std::unordered_map<std::string, uint64_t> stacks_;
+  uint64_t num_samples_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_sampling_profiler_h_
@@ -0,0 +1,76 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <new>
+
+#include <algorithm>
+
+#include "scratch-arena.h"
+
+using namespace sp;
+
+static const size_t kMinChunkCells = 1024;
+
+ScratchArena::ScratchArena()
+ : current_(0),
+   used_(0)
+{
+}
+
+cell_t*
+ScratchArena::alloc(size_t cells, size_t* mark)
+{
+  *mark = used_;
+
+  if (!chunks_.empty()) {
+    Chunk& chunk = chunks_[current_];
+    if (cells <= chunk.start + chunk.size - used_) {
+      cell_t* ptr = chunk.cells.get() + (used_ - chunk.start);
+      used_ += cells;
+      return ptr;
+    }
+  }
+
+  // Move on to the next chunk, leaving the rest of this one unused. Chunks
+  // past the current one are free, so one that is too small is replaced.
+  size_t next = chunks_.empty() ? 0 : current_ + 1;
+  size_t start = chunks_.empty() ? 0 : chunks_[current_].start + chunks_[current_].size;
+  if (next < chunks_.size() && chunks_[next].size < cells)
+    chunks_.resize(next);
+  if (next == chunks_.size()) {
+    size_t size = std::max(cells, kMinChunkCells);
+    if (!chunks_.empty())
+      size = std::max(size, chunks_.back().size * 2);
+
+    Chunk chunk;
+    chunk.cells.reset(new (std::nothrow) cell_t[size]);
+    if (!chunk.cells)
+      return nullptr;
+    chunk.start = start;
+    chunk.size = size;
+    chunks_.push_back(std::move(chunk));
+  }
+
+  current_ = next;
+  used_ = start + cells;
+  return chunks_[next].cells.get();
+}
+
+void
+ScratchArena::release(size_t mark)
+{
+  if (mark >= used_)
+    return;
+  used_ = mark;
+  while (current_ > 0 && chunks_[current_].start > mark)
+    current_--;
+}
@@ -0,0 +1,59 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_scratch_arena_h_
+#define _include_sourcepawn_vm_scratch_arena_h_
+
+#include <stddef.h>
+
+#include <memory>
+#include <vector>
+
+#include <sp_vm_types.h>
+
+namespace sp {
+
+// Temporary host memory for natives, handed out in stack order. A mark is
+// how much was in use before an allocation; releasing to it frees that
+// allocation and everything after. Memory is kept in chunks that are never
+// moved, so growing doesn't invalidate anything still in use, and chunks
+// are kept once made, so a native called in a loop doesn't go to malloc.
+class ScratchArena
+{
+ public:
+  ScratchArena();
+
+  // Returns null if out of memory.
+  cell_t* alloc(size_t cells, size_t* mark);
+  void release(size_t mark);
+
+  size_t mark() const {
+    return used_;
+  }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<cell_t[]> cells;
+    // Where the chunk starts in the arena, and its size, in cells.
+    size_t start;
+    size_t size;
+  };
+
+  std::vector<Chunk> chunks_;
+  // The chunk |used_| falls in, if there are any.
+  size_t current_;
+  size_t used_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_scratch_arena_h_
@@ -18,6 +18,7 @@
 #include "environment.h"
 #include "plugin-context.h"
 #include "method-info.h"
+#include "suspension.h"
 
 /********************
 * FUNCTION CALLING*
@@ -34,20 +35,55 @@ ScriptedInvoker::ScriptedInvoker(PluginRuntime* runtime, funcid_t id, uint32_t p
    m_FnId(id)
 {
   runtime->GetPublicByIndex(pub_id, &public_);
+  SetName(runtime, public_->name);
+  ResetStats();
+}
+
+ScriptedInvoker::ScriptedInvoker(PluginRuntime* runtime, const RefPtr<MethodInfo>& method)
+ : env_(Environment::get()),
+   context_(runtime->GetBaseContext()),
+   m_curparam(0),
+   m_errorstate(SP_ERROR_NONE),
+   m_FnId(method->pcode_offset()),
+   public_(nullptr),
+   method_(method)
+{
+  const char* name;
+  if (runtime->LookupFunction(method->pcode_offset(), &name) != SP_ERROR_NONE)
+    name = "<unknown>";
+  SetName(runtime, name);
+  ResetStats();
+}
 
+void
+ScriptedInvoker::SetName(PluginRuntime* runtime, const char* name)
+{
   size_t rt_len = strlen(runtime->Name());
-  size_t len = rt_len + strlen("::") + strlen(public_->name);
+  size_t len = rt_len + strlen("::") + strlen(name);
 
-  full_name_ = std::make_unique<char[]>(len + 1);
-  strcpy(full_name_.get(), runtime->Name());
-  strcpy(full_name_.get() + rt_len, "::");
-  strcpy(full_name_.get() + rt_len + 2, public_->name);
+  full_name_ = runtime->invoker_pool().alloc<char>(len + 1);
+  full_name_length_ = len;
+  strcpy(full_name_, runtime->Name());
+  strcpy(full_name_ + rt_len, "::");
+  strcpy(full_name_ + rt_len + 2, name);
 }
 
 ScriptedInvoker::~ScriptedInvoker()
 {
 }
 
+void
+ScriptedInvoker::ResetStats()
+{
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+bool
+ScriptedInvoker::InvokeSuspendable(cell_t* result, ISuspendedInvocation** suspended)
+{
+  return Suspension::Invoke(this, result, suspended);
+}
+
 bool
 ScriptedInvoker::IsRunnable()
 {
@@ -213,7 +249,6 @@ ScriptedInvoker::Invoke(cell_t* result)
   cell_t temp_params[SP_MAX_EXEC_PARAMS];
   ParamInfo temp_info[SP_MAX_EXEC_PARAMS];
   unsigned int numparams = m_curparam;
-  unsigned int i;
 
   if (numparams)
   {
@@ -222,111 +257,23 @@ ScriptedInvoker::Invoke(cell_t* result)
   }
   m_curparam = 0;
 
-  /* Browse the parameters and build arrays */
-  bool ok = true;
-  for (i=0; i<numparams; i++) {
-    /* Is this marked as an array? */
-    if (temp_info[i].marked) {
-      if (!temp_info[i].str.is_sz) {
-        /* Allocate a normal/generic array */
-        int err = context_->HeapAlloc(
-          temp_info[i].size, 
-          &(temp_info[i].local_addr),
-          &(temp_info[i].phys_addr));
-        if (err != SP_ERROR_NONE) {
-          env_->ReportError(err);
-          ok = false;
-          break;
-        }
-        if (temp_info[i].orig_addr)
-        {
-          memcpy(temp_info[i].phys_addr, temp_info[i].orig_addr, sizeof(cell_t) * temp_info[i].size);
-        }
-      } else {
-        /* Calculate cells required for the string */
-        size_t cells = (temp_info[i].size + sizeof(cell_t) - 1) / sizeof(cell_t);
-
-        /* Allocate the buffer */
-        int err = context_->HeapAlloc(
-          cells,
-          &(temp_info[i].local_addr),
-          &(temp_info[i].phys_addr));
-        if (err != SP_ERROR_NONE) {
-          env_->ReportError(err);
-          ok = false;
-          break;
-        }
-
-        /* Copy original string if necessary */
-        if ((temp_info[i].str.sz_flags & SM_PARAM_STRING_COPY) && (temp_info[i].orig_addr != NULL))
-        {
-          /* Cut off UTF-8 properly */
-          if (temp_info[i].str.sz_flags & SM_PARAM_STRING_UTF8) {
-            context_->StringToLocalUTF8(
-              temp_info[i].local_addr, 
-              temp_info[i].size, 
-              (const char*)temp_info[i].orig_addr,
-              NULL);
-          }
-          /* Copy a binary blob */
-          else if (temp_info[i].str.sz_flags & SM_PARAM_STRING_BINARY)
-          {
-            memmove(temp_info[i].phys_addr, temp_info[i].orig_addr, temp_info[i].size);
-          }
-          /* Copy ASCII characters */
-          else
-          {
-            context_->StringToLocal(
-              temp_info[i].local_addr,
-              temp_info[i].size,
-              (const char*)temp_info[i].orig_addr);
-          }
-        }
-      } /* End array/string calculation */
-      /* Update the pushed parameter with the byref local address */
-      temp_params[i] = temp_info[i].local_addr;
-    } else {
-      /* Just copy the value normally */
-      temp_params[i] = m_params[i];
-    }
+  // Plain cells are passed as they are; arrays and strings all go into one
+  // heap block.
+  memcpy(temp_params, m_params, numparams * sizeof(cell_t));
+  if (int err = context_->MarshalArgs(temp_info, numparams, temp_params)) {
+    env_->ReportError(err);
+    return false;
   }
 
-  /* Make the call if we can */
-  if (ok) {
-    const char *debugName = this->DebugName();
-    size_t debugNameLength = strlen(debugName) + 2;
-    volatile char * volatile debugNameForCrashDumps = (char *)alloca(debugNameLength);
-    SafeStrcpy((char *)debugNameForCrashDumps + 1, debugNameLength - 1, debugName);
+  // The name's length is known, so this is one copy per call.
+  size_t debugNameLength = full_name_length_ + 2;
+  volatile char * volatile debugNameForCrashDumps = (char *)alloca(debugNameLength);
+  memcpy((char *)debugNameForCrashDumps + 1, full_name_, full_name_length_ + 1);
 
-    ok = context_->Invoke(m_FnId, temp_params, numparams, result);
-  }
-
-  /* i should be equal to the last valid parameter + 1 */
-  bool docopies = ok;
-  while (i--) {
-    if (!temp_info[i].marked)
-      continue;
+  bool ok = context_->Invoke(this, temp_params, numparams, result);
 
-    if (docopies && (temp_info[i].flags & SM_PARAM_COPYBACK)) {
-      if (temp_info[i].orig_addr) {
-        if (temp_info[i].str.is_sz) {
-          memcpy(temp_info[i].orig_addr, temp_info[i].phys_addr, temp_info[i].size);
-        
-        } else {
-          if (temp_info[i].size == 1) {
-            *temp_info[i].orig_addr = *(temp_info[i].phys_addr);
-          } else {
-            memcpy(temp_info[i].orig_addr, 
-                temp_info[i].phys_addr, 
-                temp_info[i].size * sizeof(cell_t));
-          }
-        }
-      }
-    }
-
-    if (int err = context_->HeapPop(temp_info[i].local_addr))
-      env_->ReportError(err);
-  }
+  if (int err = context_->UnmarshalArgs(temp_info, numparams, ok))
+    env_->ReportError(err);
 
   return !env_->hasPendingException();
 }
@@ -362,6 +309,236 @@ RefPtr<MethodInfo>
 ScriptedInvoker::AcquireMethod()
 {
   if (!method_)
-    method_ = context_->runtime()->AcquireMethod(public_->code_offs);
+    method_ = context_->runtime()->AcquireMethod(public_ ? public_->code_offs : m_FnId);
   return method_;
 }
+
+void
+ScriptedInvoker::ForgetMethod()
+{
+  method_ = nullptr;
+}
+
+PreparedCall::PreparedCall()
+ : num_params_(0),
+   error_(SP_ERROR_NONE),
+   laid_out_(false),
+   image_valid_(false)
+{
+}
+
+int
+PreparedCall::PushCell(cell_t cell)
+{
+  if (num_params_ >= SP_MAX_EXEC_PARAMS)
+    return error_ = SP_ERROR_PARAMS_MAX;
+
+  info_[num_params_].marked = false;
+  params_[num_params_] = cell;
+  num_params_++;
+  return SP_ERROR_NONE;
+}
+
+int
+PreparedCall::PushCellByRef(cell_t* cell, int flags)
+{
+  return PushArray(cell, 1, flags);
+}
+
+int
+PreparedCall::PushFloat(float number)
+{
+  return PushCell(sp::FloatCellUnion(number).cell);
+}
+
+int
+PreparedCall::PushFloatByRef(float* number, int flags)
+{
+  return PushCellByRef((cell_t*)number, flags);
+}
+
+int
+PreparedCall::PushArray(cell_t* inarray, unsigned int cells, int copyback)
+{
+  if (num_params_ >= SP_MAX_EXEC_PARAMS)
+    return error_ = SP_ERROR_PARAMS_MAX;
+
+  ParamInfo* info = &info_[num_params_];
+  info->flags = copyback;
+  info->marked = true;
+  info->size = cells;
+  info->str.is_sz = false;
+  info->str.sz_flags = 0;
+  info->orig_addr = inarray;
+
+  num_params_++;
+  laid_out_ = false;
+  return SP_ERROR_NONE;
+}
+
+int
+PreparedCall::PushString(const char* string)
+{
+  return pushString(string, SM_PARAM_STRING_COPY, 0, strlen(string) + 1);
+}
+
+int
+PreparedCall::PushStringEx(char* buffer, size_t length, int sz_flags, int cp_flags)
+{
+  return pushString(buffer, sz_flags, cp_flags, length);
+}
+
+int
+PreparedCall::pushString(const char* string, int sz_flags, int cp_flags, size_t len)
+{
+  if (num_params_ >= SP_MAX_EXEC_PARAMS)
+    return error_ = SP_ERROR_PARAMS_MAX;
+
+  ParamInfo* info = &info_[num_params_];
+  info->marked = true;
+  info->orig_addr = (cell_t*)string;
+  info->flags = cp_flags;
+  info->size = len;
+  info->str.sz_flags = sz_flags;
+  info->str.is_sz = true;
+
+  num_params_++;
+  laid_out_ = false;
+  return SP_ERROR_NONE;
+}
+
+void
+PreparedCall::Cancel()
+{
+  num_params_ = 0;
+  error_ = SP_ERROR_NONE;
+  laid_out_ = false;
+}
+
+int
+PreparedCall::SetCell(unsigned int index, cell_t cell)
+{
+  if (index >= num_params_ || info_[index].marked)
+    return SP_ERROR_PARAM;
+  params_[index] = cell;
+  return SP_ERROR_NONE;
+}
+
+int
+PreparedCall::SetFloat(unsigned int index, float number)
+{
+  return SetCell(index, sp::FloatCellUnion(number).cell);
+}
+
+int
+PreparedCall::SetArray(unsigned int index, cell_t* inarray)
+{
+  if (index >= num_params_ || !info_[index].marked || info_[index].str.is_sz)
+    return SP_ERROR_PARAM;
+  info_[index].orig_addr = inarray;
+  image_valid_ = false;
+  return SP_ERROR_NONE;
+}
+
+int
+PreparedCall::SetString(unsigned int index, const char* string)
+{
+  if (index >= num_params_ || !info_[index].marked || !info_[index].str.is_sz)
+    return SP_ERROR_PARAM;
+  info_[index].orig_addr = (cell_t*)string;
+  image_valid_ = false;
+  return SP_ERROR_NONE;
+}
+
+void
+PreparedCall::Refresh()
+{
+  image_valid_ = false;
+}
+
+void
+PreparedCall::layout()
+{
+  size_t cells = 0;
+  for (unsigned int i = 0; i < num_params_; i++) {
+    ParamInfo& info = info_[i];
+    if (!info.marked)
+      continue;
+    info.local_addr = cell_t(cells);
+    cells += PluginContext::CellsForArg(info);
+  }
+  image_.resize(cells);
+  laid_out_ = true;
+  image_valid_ = false;
+}
+
+bool
+PreparedCall::Invoke(IPluginFunction* function, cell_t* result)
+{
+  Environment* env = Environment::get();
+  ScriptedInvoker* fn = static_cast<ScriptedInvoker*>(function);
+  if (!fn->IsRunnable()) {
+    env->ReportError(SP_ERROR_NOT_RUNNABLE);
+    return false;
+  }
+  if (error_) {
+    env->ReportError(error_);
+    return false;
+  }
+
+  if (!laid_out_)
+    layout();
+
+  PluginContext* cx = fn->context();
+
+  cell_t block = 0;
+  cell_t* phys = nullptr;
+  if (!image_.empty()) {
+    if (int err = cx->HeapAlloc(image_.size(), &block, &phys)) {
+      env->ReportError(err);
+      return false;
+    }
+
+    // Input-only arguments come from the cached image. Anything with
+    // copy-back is read again, since the last callee may have changed it.
+    bool rebuild = !image_valid_;
+    if (!rebuild)
+      memcpy(phys, image_.data(), image_.size() * sizeof(cell_t));
+    for (unsigned int i = 0; i < num_params_; i++) {
+      const ParamInfo& info = info_[i];
+      if (!info.marked)
+        continue;
+      if (rebuild || (info.flags & SM_PARAM_COPYBACK)) {
+        cell_t offset = info.local_addr;
+        cx->MarshalArg(info, block + offset * sizeof(cell_t), phys + offset);
+      }
+    }
+    if (rebuild) {
+      memcpy(image_.data(), phys, image_.size() * sizeof(cell_t));
+      image_valid_ = true;
+    }
+  }
+
+  cell_t params[SP_MAX_EXEC_PARAMS];
+  for (unsigned int i = 0; i < num_params_; i++) {
+    if (info_[i].marked)
+      params[i] = block + info_[i].local_addr * sizeof(cell_t);
+    else
+      params[i] = params_[i];
+  }
+
+  bool ok = cx->Invoke(fn, params, num_params_, result);
+
+  if (phys) {
+    if (ok) {
+      for (unsigned int i = 0; i < num_params_; i++) {
+        if (info_[i].marked)
+          PluginContext::CopyBackArg(info_[i], phys + info_[i].local_addr);
+      }
+    }
+    if (int err = cx->HeapPop(block))
+      env->ReportError(err);
+  }
+
+  return !env->hasPendingException();
+}
@@ -14,9 +14,11 @@
 #define _INCLUDE_SOURCEMOD_BASEFUNCTION_H_
 
 #include <memory>
+#include <vector>
 
 #include <sp_vm_api.h>
 #include <amtl/am-refcounting.h>
+#include "pool-allocator.h"
 
 namespace sp {
 
@@ -42,10 +44,14 @@ struct ParamInfo
   } str;
 };
 
-class ScriptedInvoker : public IPluginFunction
+// Invokers are allocated in their runtime's invoker pool, and are destroyed,
+// but not deleted, with it.
+class ScriptedInvoker : public IPluginFunction, public PoolObject
 {
  public:
   ScriptedInvoker(PluginRuntime* pRuntime, funcid_t fnid, uint32_t pub_id);
+  // For a function called by code offset; its ID is the offset.
+  ScriptedInvoker(PluginRuntime* pRuntime, const RefPtr<MethodInfo>& method);
   virtual ~ScriptedInvoker();
 
  public:
@@ -61,6 +67,7 @@ class ScriptedInvoker : public IPluginFunction
   int CallFunction(const cell_t* params, unsigned int num_params, cell_t* result);
   IPluginContext* GetParentContext();
   bool Invoke(cell_t* result);
+  bool InvokeSuspendable(cell_t* result, ISuspendedInvocation** suspended) override;
   bool IsRunnable();
   funcid_t GetFunctionID();
   int Execute2(IPluginContext* ctx, cell_t* result);
@@ -70,20 +77,33 @@ class ScriptedInvoker : public IPluginFunction
     cell_t* result);
   IPluginRuntime* GetParentRuntime();
   const char* DebugName() {
-    return full_name_.get();
+    return full_name_;
   }
 
  public:
+  // Null if the function wasn't looked up as a public.
   sp_public_t* Public() const {
     return public_;
   }
 
   // Helper for pRuntime->AcquireMethod that caches the result.
   RefPtr<MethodInfo> AcquireMethod();
+  // Called when the runtime's code is replaced.
+  void ForgetMethod();
+
+  PluginContext* context() const {
+    return context_;
+  }
+
+  PublicStats& stats() {
+    return stats_;
+  }
+  void ResetStats();
 
  private:
   int _PushString(const char* string, int sz_flags, int cp_flags, size_t len);
   int SetError(int err);
+  void SetName(PluginRuntime* runtime, const char* name);
 
  private:
   Environment* env_;
@@ -93,9 +113,55 @@ class ScriptedInvoker : public IPluginFunction
   unsigned int m_curparam;
   int m_errorstate;
   funcid_t m_FnId;
-  std::unique_ptr<char[]> full_name_;
+  char* full_name_;
+  size_t full_name_length_;
   sp_public_t* public_;
   RefPtr<MethodInfo> method_;
+  PublicStats stats_;
+};
+
+// An argument list that is validated and laid out once, then copied into the
+// callee's heap as one block per call. Arrays and strings share a single heap
+// allocation instead of one tracker entry each.
+class PreparedCall final : public IPreparedCall
+{
+ public:
+  PreparedCall();
+
+  int PushCell(cell_t cell) override;
+  int PushCellByRef(cell_t* cell, int flags) override;
+  int PushFloat(float number) override;
+  int PushFloatByRef(float* number, int flags) override;
+  int PushArray(cell_t* inarray, unsigned int cells, int copyback) override;
+  int PushString(const char* string) override;
+  int PushStringEx(char* buffer, size_t length, int sz_flags, int cp_flags) override;
+  void Cancel() override;
+
+  unsigned int GetArgCount() override {
+    return num_params_;
+  }
+  int SetCell(unsigned int index, cell_t cell) override;
+  int SetFloat(unsigned int index, float number) override;
+  int SetArray(unsigned int index, cell_t* inarray) override;
+  int SetString(unsigned int index, const char* string) override;
+  void Refresh() override;
+  bool Invoke(IPluginFunction* function, cell_t* result) override;
+
+ private:
+  int pushString(const char* string, int sz_flags, int cp_flags, size_t len);
+  void layout();
+
+ private:
+  cell_t params_[SP_MAX_EXEC_PARAMS];
+  ParamInfo info_[SP_MAX_EXEC_PARAMS];
+  unsigned int num_params_;
+  int error_;
+
+  // Marshaled contents of every array and string, in argument order. Each
+  // marked argument's |local_addr| is its cell offset into this block.
+  std::vector<cell_t> image_;
+  bool laid_out_;
+  bool image_valid_;
 };
 
 } // namespace sp
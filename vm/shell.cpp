@@ -13,15 +13,34 @@
 #include <sp_vm_api.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 #include <amtl/am-cxx.h>
 #include <amtl/experimental/am-argparser.h>
 #include "dll_exports.h"
 #include "environment.h"
+#include "perf-counters.h"
+#include "method-info.h"
+#include "native-registry.h"
+#include "plugin-context.h"
+#include "smx-v1-image.h"
 #include "stack-frames.h"
+#include "threaded-code.h"
+#if defined(SP_HAS_JIT)
+# include "jit.h"
+#endif
 
 #ifdef __EMSCRIPTEN__
 # include <emscripten.h>
 #endif
+#if defined(_WIN32)
+# include <Windows.h>
+#else
+# include <dirent.h>
+#endif
 
 #if defined(SOURCEMOD_BUILD)
 # include <sourcemod_version.h>
@@ -35,6 +54,104 @@ using namespace SourcePawn;
 
 Environment* sEnv;
 
+// Hardware event counts for each public the shell runs (--perf-counters).
+// A public that calls another through execute() or invoke() is not charged
+// for the events of the callee.
+class PublicCounters
+{
+ public:
+  bool init() {
+    if (!counters_.init())
+      return false;
+    counters_.read(last_);
+    return true;
+  }
+
+  void enter(const char* name) {
+    switchTo(&totals_[name]);
+    stack_.back()->calls++;
+  }
+  void leave() {
+    switchTo(nullptr);
+  }
+
+  void report(FILE* fp) {
+    std::vector<std::pair<std::string, Totals*>> order;
+    for (auto& entry : totals_)
+      order.emplace_back(entry.first, &entry.second);
+    std::sort(order.begin(), order.end(),
+              [](const std::pair<std::string, Totals*>& a,
+                 const std::pair<std::string, Totals*>& b) {
+      return a.second->counts[PerfCounters::kCycles] > b.second->counts[PerfCounters::kCycles];
+    });
+
+    fprintf(fp, "%-32s %10s", "public", "calls");
+    for (int i = 0; i < PerfCounters::kNumCounters; i++)
+      fprintf(fp, " %14s", PerfCounters::Name(PerfCounters::Counter(i)));
+    fprintf(fp, " %6s\n", "IPC");
+    for (const auto& entry : order) {
+      const Totals* totals = entry.second;
+      fprintf(fp, "%-32s %10llu", entry.first.c_str(), (unsigned long long)totals->calls);
+      for (int i = 0; i < PerfCounters::kNumCounters; i++) {
+        if (counters_.has(PerfCounters::Counter(i)))
+          fprintf(fp, " %14llu", (unsigned long long)totals->counts[i]);
+        else
+          fprintf(fp, " %14s", "-");
+      }
+      uint64_t cycles = totals->counts[PerfCounters::kCycles];
+      uint64_t insns = totals->counts[PerfCounters::kInstructions];
+      if (cycles && counters_.has(PerfCounters::kInstructions))
+        fprintf(fp, " %6.2f\n", double(insns) / double(cycles));
+      else
+        fprintf(fp, " %6s\n", "-");
+    }
+  }
+
+ private:
+  struct Totals {
+    uint64_t calls;
+    uint64_t counts[PerfCounters::kNumCounters];
+  };
+
+  // Charges the events since the last switch to the running public, then
+  // enters |next|, or returns to the caller if |next| is null.
+  void switchTo(Totals* next) {
+    uint64_t now[PerfCounters::kNumCounters];
+    counters_.read(now);
+    if (!stack_.empty()) {
+      for (int i = 0; i < PerfCounters::kNumCounters; i++)
+        stack_.back()->counts[i] += now[i] - last_[i];
+    }
+    if (next)
+      stack_.push_back(next);
+    else if (!stack_.empty())
+      stack_.pop_back();
+    memcpy(last_, now, sizeof(last_));
+  }
+
+ private:
+  PerfCounters counters_;
+  // Map nodes never move, so the stack can point into it.
+  std::map<std::string, Totals> totals_;
+  std::vector<Totals*> stack_;
+  uint64_t last_[PerfCounters::kNumCounters];
+};
+
+static PublicCounters* sCounters;
+
+class AutoCountPublic
+{
+ public:
+  explicit AutoCountPublic(IPluginFunction* fn) {
+    if (sCounters)
+      sCounters->enter(fn->DebugName());
+  }
+  ~AutoCountPublic() {
+    if (sCounters)
+      sCounters->leave();
+  }
+};
+
 static const char*
 BaseFilename(const char* path)
 {
@@ -132,14 +249,28 @@ static cell_t DoNothing(IPluginContext* cx, const cell_t* params)
   return 1;
 }
 
-static void BindNative(IPluginRuntime* rt, const char* name, SPVM_NATIVE_FUNC fn)
+static cell_t sShellValue = 0;
+
+static cell_t GetShellValue(IPluginContext* cx, const cell_t* params)
+{
+  return sShellValue + params[1];
+}
+
+static cell_t SetShellValue(IPluginContext* cx, const cell_t* params)
+{
+  sShellValue = params[1];
+  return 0;
+}
+
+static void BindNative(IPluginRuntime* rt, const char* name, SPVM_NATIVE_FUNC fn,
+                       uint32_t flags = 0)
 {
   int err;
   uint32_t index;
   if ((err = rt->FindNativeByName(name, &index)) != SP_ERROR_NONE)
     return;
 
-  rt->UpdateNativeBinding(index, fn, 0, nullptr);
+  rt->UpdateNativeBinding(index, fn, flags, nullptr);
 }
 
 static void BindNative(IPluginRuntime* rt, const char* name, INativeCallback* callback)
@@ -167,6 +298,7 @@ static cell_t DoExecute(IPluginContext* cx, const cell_t* params)
   int32_t ok = 0;
   for (size_t i = 0; i < size_t(params[2]); i++) {
     if (IPluginFunction* fn = cx->GetFunctionById(params[1])) {
+      AutoCountPublic count(fn);
       if (fn->Execute(nullptr) != SP_ERROR_NONE)
         continue;
       ok++;
@@ -179,6 +311,7 @@ static cell_t DoInvoke(IPluginContext* cx, const cell_t* params)
 {
   for (size_t i = 0; i < size_t(params[2]); i++) {
     if (IPluginFunction* fn = cx->GetFunctionById(params[1])) {
+      AutoCountPublic count(fn);
       if (!fn->Invoke())
         return 0;
     }
@@ -186,6 +319,71 @@ static cell_t DoInvoke(IPluginContext* cx, const cell_t* params)
   return 1;
 }
 
+// Like invoke(), but calls |fn| by its code offset instead of its public ID.
+static cell_t DoInvokeByOffset(IPluginContext* cx, const cell_t* params)
+{
+  sp_public_t* pub;
+  if (cx->GetRuntime()->GetPublicByIndex(params[2] >> 1, &pub) != SP_ERROR_NONE)
+    return 0;
+
+  for (size_t i = 0; i < size_t(params[1]); i++) {
+    IPluginFunction* fn = cx->GetFunctionById(pub->code_offs);
+    if (!fn || fn != cx->GetFunctionById(pub->code_offs))
+      return 0;
+    AutoCountPublic count(fn);
+    if (!fn->Invoke())
+      return 0;
+  }
+  return 1;
+}
+
+// Calls the public named |name| with |value| through a by-name lookup,
+// returning its result, or -1 if there is no such public.
+static cell_t CallPublic(IPluginContext* cx, const cell_t* params)
+{
+  char* name;
+  cx->LocalToString(params[1], &name);
+
+  IPluginFunction* fn = cx->GetRuntime()->GetFunctionByName(name);
+  if (!fn)
+    return -1;
+
+  AutoCountPublic count(fn);
+  cell_t result = 0;
+  fn->PushCell(params[2]);
+  if (!fn->Invoke(&result))
+    return 0;
+  return result;
+}
+
+// Returns the public variable named |name|, or -1 if there is none.
+static cell_t GetPubvar(IPluginContext* cx, const cell_t* params)
+{
+  char* name;
+  cx->LocalToString(params[1], &name);
+
+  uint32_t index;
+  cell_t local_addr;
+  cell_t* phys_addr;
+  IPluginRuntime* rt = cx->GetRuntime();
+  if (rt->FindPubvarByName(name, &index) != SP_ERROR_NONE ||
+      rt->GetPubvarAddrs(index, &local_addr, &phys_addr) != SP_ERROR_NONE)
+  {
+    return -1;
+  }
+  return *phys_addr;
+}
+
+// Returns whether the plugin imports a native named |name|.
+static cell_t HasNative(IPluginContext* cx, const cell_t* params)
+{
+  char* name;
+  cx->LocalToString(params[1], &name);
+
+  uint32_t index;
+  return cx->GetRuntime()->FindNativeByName(name, &index) == SP_ERROR_NONE;
+}
+
 static cell_t DumpStackTrace(IPluginContext* cx, const cell_t* params)
 {
   FrameIterator iter;
@@ -199,6 +397,69 @@ static cell_t ReportError(IPluginContext* cx, const cell_t* params)
   return 0;
 }
 
+static cell_t Format(IPluginContext* cx, const cell_t* params)
+{
+  size_t written;
+  if (int err = cx->FormatToLocal(params[1], params[2], params[3], params, 4, &written))
+    return cx->ThrowNativeErrorEx(err, "Could not format string");
+  return cell_t(written);
+}
+
+static cell_t Reverse(IPluginContext* cx, const cell_t* params)
+{
+  const char* src;
+  size_t length;
+  if (int err = cx->LocalToStringView(params[3], &src, &length))
+    return cx->ThrowNativeErrorEx(err, "Invalid source string");
+
+  char* dest;
+  size_t bytes;
+  if (int err = cx->LocalToStringBuffer(params[1], size_t(params[2]), &dest, &bytes))
+    return cx->ThrowNativeErrorEx(err, "Invalid buffer");
+  if (!bytes)
+    return 0;
+
+  // The buffer may be the source, so it's copied aside first.
+  size_t mark;
+  char* copy = reinterpret_cast<char*>(cx->ScratchAlloc(length / sizeof(cell_t) + 1, &mark));
+  if (!copy)
+    return cx->ThrowNativeError("Out of memory");
+  memcpy(copy, src, length);
+
+  size_t written = std::min(length, bytes - 1);
+  for (size_t i = 0; i < written; i++)
+    dest[i] = copy[length - i - 1];
+  dest[written] = '\0';
+  cx->ScratchRelease(mark);
+  return cell_t(written);
+}
+
+static cell_t QueueCallback(IPluginContext* cx, const cell_t* params)
+{
+  IPluginFunction* fn = cx->GetFunctionById(params[1]);
+  if (!fn)
+    return cx->ThrowNativeError("Invalid function");
+  return sEnv->QueueCallback(fn, &params[2], 1, params[3], 0, nullptr, nullptr) ? 1 : 0;
+}
+
+static cell_t RunQueuedCallbacks(IPluginContext* cx, const cell_t* params)
+{
+  return cell_t(sEnv->RunQueuedCallbacks(0));
+}
+
+// The value passed to suspend(), which main() is resumed with, plus one.
+static cell_t sSuspendValue;
+
+static cell_t Suspend(IPluginContext* cx, const cell_t* params)
+{
+  sSuspendValue = params[1];
+
+  cell_t value;
+  if (!cx->SuspendInvocation(nullptr, nullptr, &value))
+    return 0;
+  return value;
+}
+
 class DynamicNative : public INativeCallback
 {
   public:
@@ -225,17 +486,33 @@ class DynamicNative : public INativeCallback
     uintptr_t refcount_ = 0;
 };
 
-static int Execute(const char* file)
+static cell_t TypedSum(IPluginContext* cx, cell_t a, cell_t b, cell_t c)
 {
-  char error[255];
-  std::unique_ptr<IPluginRuntime> rtb(sEnv->APIv2()->LoadBinaryFromFile(file, error, sizeof(error)));
-  if (!rtb) {
-    fprintf(stderr, "Could not load plugin %s: %s\n", file, error);
-    return 1;
-  }
+  return a + b + c;
+}
 
-  PluginRuntime* rt = PluginRuntime::FromAPI(rtb.get());
+static cell_t TypedSetRef(IPluginContext* cx, cell_t* ref, cell_t value)
+{
+  *ref = value;
+  return 0;
+}
+
+static cell_t TypedStrlen(IPluginContext* cx, char* str)
+{
+  return cell_t(strlen(str));
+}
 
+static const sp_typed_nativeinfo_t sTypedNatives[] = {
+  { "typed_sum", (SPVM_TYPED_NATIVE_FUNC)TypedSum, 3,
+    { SP_NATIVEARG_CELL, SP_NATIVEARG_CELL, SP_NATIVEARG_CELL } },
+  { "typed_setfloat", (SPVM_TYPED_NATIVE_FUNC)TypedSetRef, 2,
+    { SP_NATIVEARG_REF, SP_NATIVEARG_FLOAT } },
+  { "typed_strlen", (SPVM_TYPED_NATIVE_FUNC)TypedStrlen, 1, { SP_NATIVEARG_STRING } },
+  { nullptr, nullptr, 0, {} },
+};
+
+static void BindShellNatives(PluginRuntime* rt)
+{
   rt->InstallBuiltinNatives();
   BindNative(rt, "print", Print);
   BindNative(rt, "printnum", PrintNum);
@@ -246,11 +523,147 @@ static int Execute(const char* file)
   BindNative(rt, "donothing", DoNothing);
   BindNative(rt, "execute", DoExecute);
   BindNative(rt, "invoke", DoInvoke);
+  BindNative(rt, "invoke_by_offset", DoInvokeByOffset);
+  BindNative(rt, "call_public", CallPublic);
+  BindNative(rt, "get_pubvar", GetPubvar);
+  BindNative(rt, "has_native", HasNative);
   BindNative(rt, "dump_stack_trace", DumpStackTrace);
   BindNative(rt, "report_error", ReportError);
+  BindNative(rt, "suspend", Suspend);
+  BindNative(rt, "format", Format);
+  BindNative(rt, "reverse", Reverse);
+  BindNative(rt, "queue_callback", QueueCallback);
+  BindNative(rt, "run_queued_callbacks", RunQueuedCallbacks);
+  BindNative(rt, "get_shell_value", GetShellValue, SP_NTVFLAG_PURE);
+  BindNative(rt, "set_shell_value", SetShellValue);
   BindNative(rt, "CloseHandle", DoNothing);
   BindNative(rt, "dynamic_native", new DynamicNative());
 
+  for (const sp_typed_nativeinfo_t* info = sTypedNatives; info->name; info++) {
+    uint32_t index;
+    if (rt->FindNativeByName(info->name, &index) == SP_ERROR_NONE)
+      rt->UpdateTypedNativeBinding(index, info, 0, nullptr);
+  }
+}
+
+static bool sShowStats;
+static bool sShowJitStats;
+
+static void
+OnWatchedDataChanged(IPluginRuntime* rt, const uint32_t* ids, size_t count, void* data)
+{
+  for (size_t i = 0; i < count; i++)
+    printf("watched global changed (watch %u)\n", ids[i]);
+}
+
+// Tests can declare a "public int g_Watched", which is reported whenever
+// main() changes it.
+static void
+WatchTestGlobals(IPluginRuntime* rt)
+{
+  uint32_t index;
+  cell_t local_addr;
+  cell_t* phys_addr;
+  if (rt->FindPubvarByName("g_Watched", &index) != SP_ERROR_NONE ||
+      rt->GetPubvarAddrs(index, &local_addr, &phys_addr) != SP_ERROR_NONE)
+  {
+    return;
+  }
+
+  uint32_t id;
+  if (rt->WatchData(local_addr, sizeof(cell_t), &id) == SP_ERROR_NONE)
+    rt->SetDataWatchCallback(OnWatchedDataChanged, nullptr);
+}
+
+// Tests can declare a "public snapshot_main()", which the shell runs after
+// main() in two new instances of the plugin, both started from a snapshot of
+// how main() left it.
+static bool
+RunFromSnapshot(IPluginRuntime* rt)
+{
+  if (!rt->GetFunctionByName("snapshot_main"))
+    return true;
+
+  std::unique_ptr<IPluginSnapshot> snapshot(rt->CreateSnapshot());
+  if (!snapshot) {
+    fprintf(stderr, "Could not snapshot the plugin\n");
+    return false;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    char error[255];
+    std::unique_ptr<IPluginRuntime> instance(snapshot->Instantiate(error, sizeof(error)));
+    if (!instance) {
+      fprintf(stderr, "Could not start from the snapshot: %s\n", error);
+      return false;
+    }
+
+    ExceptionHandler eh(instance->GetDefaultContext());
+    if (!instance->GetFunctionByName("snapshot_main")->Invoke()) {
+      fprintf(stderr, "Error executing snapshot_main: %s\n", eh.Message());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the reports asked for with --stats, --jit-stats, --trace-natives,
+// --opcode-histogram and --budget to stderr, while the plugin they describe
+// is still loaded.
+class AutoWriteReports
+{
+ public:
+  explicit AutoWriteReports(IPluginRuntime* rt)
+   : rt_(rt)
+  {}
+  ~AutoWriteReports() {
+    if (sShowStats) {
+      MemoryStats stats;
+      sEnv->APIv2()->GetMemoryStats(rt_, &stats);
+      fprintf(stderr, "heap + stack size:  %u bytes\n", stats.memory_size);
+      fprintf(stderr, "heap high water:    %u bytes\n", stats.heap_high_water);
+      fprintf(stderr, "stack high water:   %u bytes\n", stats.stack_high_water);
+      fprintf(stderr, "tracker high water: %u\n", stats.tracker_high_water);
+      fprintf(stderr, "HeapAlloc calls:    %llu\n", (unsigned long long)stats.heap_allocs);
+      fprintf(stderr, "arrays generated:   %llu\n", (unsigned long long)stats.array_allocs);
+    }
+    if (sShowJitStats)
+      PluginRuntime::FromAPI(rt_)->WriteJitReport(stderr);
+    if (sEnv->IsNativeTracingEnabled())
+      sEnv->WriteNativeTrace(stderr);
+    if (sEnv->IsOpcodeCountingEnabled())
+      PluginRuntime::FromAPI(rt_)->WriteOpcodeHistogram(stderr, true);
+    if (sEnv->has_budgets())
+      fprintf(stderr, "budget spent: %u units\n", sEnv->GetInvocationBudgetSpent());
+  }
+
+ private:
+  IPluginRuntime* rt_;
+};
+
+static int Execute(const char* file, uint32_t load_flags, const std::string& profile_in,
+                   const std::string& profile_out, const std::string& record)
+{
+  char error[255];
+  std::unique_ptr<IPluginRuntime> rtb(
+    sEnv->APIv2()->LoadBinaryFromFileEx(file, load_flags, error, sizeof(error)));
+  if (!rtb) {
+    fprintf(stderr, "Could not load plugin %s: %s\n", file, error);
+    return 1;
+  }
+
+  PluginRuntime* rt = PluginRuntime::FromAPI(rtb.get());
+  BindShellNatives(rt);
+  WatchTestGlobals(rt);
+
+  AutoWriteReports reports(rt);
+
+  if (!record.empty() && !sEnv->APIv2()->StartRecording(rt, record.c_str()))
+    fprintf(stderr, "Could not record to %s\n", record.c_str());
+
+  if (!profile_in.empty() && !sEnv->APIv2()->ApplyMethodProfile(rt, profile_in.c_str()))
+    fprintf(stderr, "Could not apply method profile %s\n", profile_in.c_str());
+
   IPluginFunction* fun = rt->GetFunctionByName("main");
   if (!fun)
     return 0;
@@ -260,15 +673,474 @@ static int Execute(const char* file)
   int result;
   {
     ExceptionHandler eh(cx);
-    if (!fun->Invoke(&result)) {
+    AutoCountPublic count(fun);
+
+    // Whenever main() is suspended, the shell resumes it straight away.
+    ISuspendedInvocation* suspended;
+    bool ok = fun->InvokeSuspendable(&result, &suspended);
+    while (ok && suspended)
+      ok = suspended->Resume(sSuspendValue + 1, &result, &suspended);
+    if (!ok) {
       fprintf(stderr, "Error executing main: %s\n", eh.Message());
       return 1;
     }
   }
 
+  if (!RunFromSnapshot(rt))
+    return 1;
+
+  if (!profile_out.empty() && !sEnv->APIv2()->WriteMethodProfile(rt, profile_out.c_str()))
+    fprintf(stderr, "Could not write %s\n", profile_out.c_str());
+  if (!record.empty() && !sEnv->APIv2()->StopRecording(rt))
+    fprintf(stderr, "Could not write %s\n", record.c_str());
+
   return result;
 }
 
+static uint64_t ElapsedNs(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Calls main() over and over for at least |millis| milliseconds, and prints
+// one JSON object describing the run. The first call is timed separately,
+// since it includes verifying (and usually compiling) everything it reaches.
+static int Bench(const char* file, uint32_t load_flags, int millis)
+{
+  auto load_start = std::chrono::steady_clock::now();
+
+  char error[255];
+  std::unique_ptr<IPluginRuntime> rtb(
+    sEnv->APIv2()->LoadBinaryFromFileEx(file, load_flags, error, sizeof(error)));
+  if (!rtb) {
+    fprintf(stderr, "Could not load plugin %s: %s\n", file, error);
+    return 1;
+  }
+  uint64_t load_ns = ElapsedNs(load_start);
+
+  PluginRuntime* rt = PluginRuntime::FromAPI(rtb.get());
+  BindShellNatives(rt);
+
+  uint32_t index;
+  IPluginFunction* fun = rt->GetFunctionByName("main");
+  if (!fun || rt->FindPublicByName("main", &index) != SP_ERROR_NONE) {
+    fprintf(stderr, "%s has no main()\n", file);
+    return 1;
+  }
+
+  IPluginContext* cx = rt->GetDefaultContext();
+  ExceptionHandler eh(cx);
+
+  auto first_start = std::chrono::steady_clock::now();
+  if (!fun->Invoke()) {
+    fprintf(stderr, "Error executing main: %s\n", eh.Message());
+    return 1;
+  }
+  uint64_t first_ns = ElapsedNs(first_start);
+
+  sEnv->APIv2()->ResetPublicStats(rt);
+
+  uint64_t budget_ns = uint64_t(std::max(millis, 1)) * 1000000;
+  uint64_t iterations = 0;
+  uint64_t run_ns = 0;
+  auto run_start = std::chrono::steady_clock::now();
+  do {
+    if (!fun->Invoke()) {
+      fprintf(stderr, "Error executing main: %s\n", eh.Message());
+      return 1;
+    }
+    iterations++;
+    run_ns = ElapsedNs(run_start);
+  } while (run_ns < budget_ns);
+
+  PublicStats stats;
+  sEnv->APIv2()->GetPublicStats(rt, index, &stats);
+
+  CodeMemoryStats code;
+  sEnv->GetCodeMemoryStats(&code);
+
+  const char* engine;
+  if (sEnv->IsJitEnabled())
+    engine = sEnv->jit_threshold() ? "tiered" : "jit";
+  else
+    engine = sEnv->IsPredecodeEnabled() ? "interpreter" : "decoding-interpreter";
+
+  fprintf(stdout,
+          "{\"file\": \"%s\", \"engine\": \"%s\", \"iterations\": %llu, "
+          "\"iterations_per_sec\": %.2f, \"load_ms\": %.3f, \"first_call_ms\": %.3f, "
+          "\"jit_compiles\": %u, \"jit_compile_ms\": %.3f, \"native_calls\": %llu, "
+          "\"heap_high_water\": %u, \"code_bytes\": %zu}\n",
+          BaseFilename(file), engine, (unsigned long long)iterations,
+          double(iterations) * 1e9 / double(run_ns), double(load_ns) / 1e6,
+          double(first_ns) / 1e6, sEnv->jit_compiles(), double(sEnv->jit_compile_ns()) / 1e6,
+          (unsigned long long)stats.native_calls, stats.heap_high_water, code.in_use);
+  return 0;
+}
+
+// Stands in for every native during --replay, returning what the native
+// returned when the invocation was recorded.
+class ReplayNative : public INativeCallback
+{
+ public:
+  ReplayNative(ReplayReader* reader, uint32_t index)
+   : reader_(reader),
+     index_(index)
+  {}
+
+  void AddRef() override {
+    refcount_++;
+  }
+  void Release() override {
+    assert(refcount_ > 0);
+    if (--refcount_ == 0)
+      delete this;
+  }
+  int Invoke(IPluginContext* cx, const cell_t* params) override {
+    cell_t result;
+    if (!reader_->NextNative(index_, &result)) {
+      cx->ReportError("replay diverged from the recording at native %u", index_);
+      return 0;
+    }
+    return result;
+  }
+
+ private:
+  ReplayReader* reader_;
+  uint32_t index_;
+  uintptr_t refcount_ = 0;
+};
+
+// Runs every invocation in a file written by --record against |file|, with
+// natives replaced by their recorded results, and compares the results and
+// times against the recording.
+static int Replay(const char* file, uint32_t load_flags, const char* recording)
+{
+  char error[255];
+  std::unique_ptr<IPluginRuntime> rtb(
+    sEnv->APIv2()->LoadBinaryFromFileEx(file, load_flags, error, sizeof(error)));
+  if (!rtb) {
+    fprintf(stderr, "Could not load plugin %s: %s\n", file, error);
+    return 1;
+  }
+
+  PluginRuntime* rt = PluginRuntime::FromAPI(rtb.get());
+
+  std::string message;
+  ReplayReader reader;
+  if (!reader.Open(rt, recording, &message)) {
+    fprintf(stderr, "Could not replay %s: %s\n", recording, message.c_str());
+    return 1;
+  }
+  for (uint32_t i = 0; i < rt->GetNativesNum(); i++)
+    rt->UpdateNativeBindingObject(i, new ReplayNative(&reader, i), 0, nullptr);
+
+  AutoWriteReports reports(rt);
+
+  PluginContext* cx = rt->GetBaseContext();
+
+  uint64_t invocations = 0, failures = 0, mismatches = 0;
+  uint64_t recorded_ns = 0, replayed_ns = 0;
+  ReplayReader::Invocation invocation;
+  while (reader.NextInvocation(&invocation)) {
+    invocations++;
+
+    size_t heap_end = cx->DataSize() + invocation.heap.size();
+    if (heap_end > cx->HeapSize()) {
+      fprintf(stderr, "Invocation %llu: recorded heap does not fit\n",
+              (unsigned long long)invocations);
+      return 1;
+    }
+    if (!invocation.heap.empty())
+      memcpy(cx->memory() + cx->DataSize(), invocation.heap.data(), invocation.heap.size());
+    *cx->addressOfHp() = cell_t(heap_end);
+
+    ExceptionHandler eh(cx);
+    cell_t result = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = cx->Invoke(invocation.func_id, invocation.params.data(),
+                         (unsigned int)invocation.params.size(), &result);
+    replayed_ns += ElapsedNs(start);
+    *cx->addressOfHp() = cell_t(cx->DataSize());
+
+    ReplayReader::Return recorded;
+    if (!reader.ReadReturn(&recorded)) {
+      fprintf(stderr, "%s ends in the middle of an invocation\n", recording);
+      return 1;
+    }
+    recorded_ns += recorded.ns;
+
+    if (!ok) {
+      failures++;
+      if (recorded.ok)
+        fprintf(stderr, "Invocation %llu failed: %s\n", (unsigned long long)invocations,
+                eh.HasException() ? eh.Message() : "unknown error");
+    }
+    if (ok != recorded.ok || (ok && result != recorded.result)) {
+      mismatches++;
+      fprintf(stderr, "Invocation %llu returned %d, recorded %d\n",
+              (unsigned long long)invocations, result, recorded.result);
+    }
+  }
+
+  fprintf(stdout, "%llu invocations, %llu failed, %llu mismatched\n",
+          (unsigned long long)invocations, (unsigned long long)failures,
+          (unsigned long long)mismatches);
+  fprintf(stdout, "recorded %.3fms, replayed %.3fms\n", double(recorded_ns) / 1e6,
+          double(replayed_ns) / 1e6);
+  return mismatches ? 1 : 0;
+}
+
+// Loads every plugin named in |list|, one path per line, and prints the most
+// common pairs of interpreter ops across all of them.
+static int CountPairs(const char* list)
+{
+  FILE* fp = fopen(list, "rt");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s\n", list);
+    return 1;
+  }
+
+  std::vector<uint64_t> counts;
+  char path[1024];
+  size_t nplugins = 0;
+  while (fgets(path, sizeof(path), fp)) {
+    size_t len = strlen(path);
+    while (len && (path[len - 1] == '\n' || path[len - 1] == '\r'))
+      path[--len] = '\0';
+    if (!len)
+      continue;
+
+    char error[255];
+    std::unique_ptr<IPluginRuntime> rtb(
+      sEnv->APIv2()->LoadBinaryFromFile(path, error, sizeof(error)));
+    if (!rtb) {
+      fprintf(stderr, "Could not load plugin %s: %s\n", path, error);
+      continue;
+    }
+    CountOpcodePairs(PluginRuntime::FromAPI(rtb.get()), &counts);
+    nplugins++;
+  }
+  fclose(fp);
+
+  const size_t total = size_t(ThreadedOp::Total);
+  std::vector<size_t> order;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    sum += counts[i];
+    if (counts[i])
+      order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&counts](size_t a, size_t b) -> bool {
+    return counts[a] > counts[b];
+  });
+
+  fprintf(stdout, "%zu plugins, %llu pairs\n", nplugins, (unsigned long long)sum);
+  for (size_t i = 0; i < order.size() && i < 50; i++) {
+    size_t index = order[i];
+    fprintf(stdout, "%12llu %6.2f%%  %s %s\n",
+            (unsigned long long)counts[index], 100.0 * double(counts[index]) / double(sum),
+            ThreadedOpName(ThreadedOp(index / total)),
+            ThreadedOpName(ThreadedOp(index % total)));
+  }
+  return 0;
+}
+
+static cell_t StubNative(IPluginContext* cx, const cell_t* params)
+{
+  return 0;
+}
+
+static bool EndsWith(const std::string& str, const char* suffix)
+{
+  size_t len = strlen(suffix);
+  return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+// Lists the .smx files in the directory |path|, or if it is not a directory,
+// the files it names one per line, as --opcode-pairs reads.
+static bool ListPlugins(const char* path, std::vector<std::string>* files)
+{
+  std::string dir = path;
+  if (!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+    dir += "/";
+
+#if defined(_WIN32)
+  WIN32_FIND_DATAA data;
+  HANDLE handle = FindFirstFileA((dir + "*.smx").c_str(), &data);
+  if (handle != INVALID_HANDLE_VALUE) {
+    do {
+      files->push_back(dir + data.cFileName);
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+    std::sort(files->begin(), files->end());
+    return true;
+  }
+#else
+  if (DIR* dp = opendir(path)) {
+    while (struct dirent* entry = readdir(dp)) {
+      std::string name = entry->d_name;
+      if (EndsWith(name, ".smx"))
+        files->push_back(dir + name);
+    }
+    closedir(dp);
+    std::sort(files->begin(), files->end());
+    return true;
+  }
+#endif
+
+  FILE* fp = fopen(path, "rt");
+  if (!fp)
+    return false;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    size_t len = strlen(line);
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len)
+      files->push_back(line);
+  }
+  fclose(fp);
+  return true;
+}
+
+// Loads every plugin in |path| and unloads them again, |cycles| times, the
+// way a server does on map change, and prints one JSON object per cycle with
+// the time each stage took across all plugins:
+//
+//   read, validate: reading and decompressing each file, then validating
+//     it, done on an image of its own so cycles after the first aren't
+//     served by the image cache.
+//   load: LoadBinaryFromFileEx, which after the first cycle reuses cached
+//     images, as a server reloading unchanged plugins would.
+//   bind: binding every native against a registry of stubs.
+//   verify, jit: verifying every method reachable from a public, then
+//     compiling each public, as their first calls would.
+//   unload: destroying the runtimes.
+//   reclaim: freeing their methods and code, which the environment
+//     otherwise does later, as invocations return.
+static int LoadBench(const char* path, uint32_t load_flags, int cycles)
+{
+  std::vector<std::string> files;
+  if (!ListPlugins(path, &files) || files.empty()) {
+    fprintf(stderr, "No plugins found in %s\n", path);
+    return 1;
+  }
+
+  // Every native any plugin imports goes in the stub registry up front, so
+  // binding costs what it would with the host's natives registered.
+  std::vector<std::string> native_names;
+  for (const auto& file : files) {
+    char error[255];
+    std::unique_ptr<IPluginRuntime> rt(
+      sEnv->APIv2()->LoadBinaryFromFileEx(file.c_str(), load_flags, error, sizeof(error)));
+    if (!rt) {
+      fprintf(stderr, "Could not load plugin %s: %s\n", file.c_str(), error);
+      return 1;
+    }
+    for (uint32_t i = 0; i < rt->GetNativesNum(); i++)
+      native_names.push_back(rt->GetNative(i)->name);
+  }
+  std::sort(native_names.begin(), native_names.end());
+  native_names.erase(std::unique(native_names.begin(), native_names.end()), native_names.end());
+
+  std::vector<sp_nativeinfo_t> stubs;
+  for (const auto& name : native_names)
+    stubs.push_back(sp_nativeinfo_t{name.c_str(), StubNative});
+  stubs.push_back(sp_nativeinfo_t{nullptr, nullptr});
+  sEnv->natives()->Register(stubs.data());
+
+  for (int cycle = 1; cycle <= cycles; cycle++) {
+    uint64_t read_ns = 0, validate_ns = 0, load_ns = 0, bind_ns = 0;
+    uint64_t verify_ns = 0, jit_ns = 0;
+    size_t image_bytes = 0, memory_bytes = 0;
+
+    std::vector<std::unique_ptr<IPluginRuntime>> runtimes;
+    for (const auto& file : files) {
+      auto start = std::chrono::steady_clock::now();
+      FILE* fp = fopen(file.c_str(), "rb");
+      if (!fp) {
+        fprintf(stderr, "Could not open %s\n", file.c_str());
+        return 1;
+      }
+      SmxV1Image image(fp, !!(load_flags & SP_LOADFLAG_MAP_FILE));
+      fclose(fp);
+      read_ns += ElapsedNs(start);
+
+      start = std::chrono::steady_clock::now();
+      image.validate(!!(load_flags & SP_LOADFLAG_LAZY_DEBUG_INFO));
+      validate_ns += ElapsedNs(start);
+      image_bytes += image.length();
+
+      char error[255];
+      start = std::chrono::steady_clock::now();
+      runtimes.emplace_back(
+        sEnv->APIv2()->LoadBinaryFromFileEx(file.c_str(), load_flags, error, sizeof(error)));
+      load_ns += ElapsedNs(start);
+      if (!runtimes.back()) {
+        fprintf(stderr, "Could not load plugin %s: %s\n", file.c_str(), error);
+        return 1;
+      }
+      PluginRuntime* rt = PluginRuntime::FromAPI(runtimes.back().get());
+
+      start = std::chrono::steady_clock::now();
+      sEnv->natives()->BindAll(rt);
+      bind_ns += ElapsedNs(start);
+
+      start = std::chrono::steady_clock::now();
+      rt->VerifyAllMethods();
+      verify_ns += ElapsedNs(start);
+
+#if defined(SP_HAS_JIT)
+      start = std::chrono::steady_clock::now();
+      if (sEnv->IsJitEnabled()) {
+        for (size_t i = 0; i < rt->image()->NumPublics(); i++) {
+          uint32_t offset;
+          const char* name;
+          rt->image()->GetPublic(i, &offset, &name);
+
+          int err;
+          RefPtr<MethodInfo> method = rt->AcquireMethod(offset);
+          if (method && !method->jit())
+            CompilerBase::Compile(rt->GetBaseContext(), method, &err);
+        }
+      }
+      jit_ns += ElapsedNs(start);
+#endif
+
+      MemoryStats stats;
+      sEnv->APIv2()->GetMemoryStats(rt, &stats);
+      memory_bytes += stats.memory_size;
+    }
+
+    CodeMemoryStats code;
+    sEnv->GetCodeMemoryStats(&code);
+    size_t code_bytes = code.in_use;
+
+    auto unload_start = std::chrono::steady_clock::now();
+    runtimes.clear();
+    uint64_t unload_ns = ElapsedNs(unload_start);
+
+    auto reclaim_start = std::chrono::steady_clock::now();
+    while (sEnv->ReclaimRetiredMethods())
+      ;
+    uint64_t reclaim_ns = ElapsedNs(reclaim_start);
+
+    sEnv->GetCodeMemoryStats(&code);
+
+    fprintf(stdout,
+            "{\"cycle\": %d, \"plugins\": %zu, \"read_ms\": %.3f, \"validate_ms\": %.3f, "
+            "\"load_ms\": %.3f, \"bind_ms\": %.3f, \"verify_ms\": %.3f, \"jit_ms\": %.3f, "
+            "\"unload_ms\": %.3f, \"reclaim_ms\": %.3f, \"image_bytes\": %zu, "
+            "\"memory_bytes\": %zu, \"code_bytes\": %zu, \"code_bytes_after_unload\": %zu}\n",
+            cycle, files.size(), double(read_ns) / 1e6, double(validate_ns) / 1e6,
+            double(load_ns) / 1e6, double(bind_ns) / 1e6, double(verify_ns) / 1e6,
+            double(jit_ns) / 1e6, double(unload_ns) / 1e6, double(reclaim_ns) / 1e6,
+            image_bytes, memory_bytes, code_bytes, code.in_use);
+  }
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
 #ifdef __EMSCRIPTEN__
@@ -287,6 +1159,118 @@ int main(int argc, char** argv)
     "i", "disable-jit",
     Some(false),
     "Disable the just-in-time compiler.");
+  ToggleOption disable_predecode(parser,
+    "d", "disable-predecode",
+    Some(false),
+    "Interpret pcode directly instead of pre-decoding each method.");
+  ToggleOption tiered_jit(parser,
+    "t", "tiered-jit",
+    Some(false),
+    "Interpret methods until they are hot, then compile them.");
+  ToggleOption background_jit(parser,
+    "B", "background-jit",
+    Some(false),
+    "Interpret methods while they are compiled on a background thread.");
+  StringOption code_cache(parser,
+    "c", "code-cache",
+    Some(std::string()),
+    "Directory in which to cache compiled code.");
+  ToggleOption precompile(parser,
+    "p", "precompile",
+    Some(false),
+    "Compile the whole plugin on a background thread as it loads.");
+  ToggleOption map_file(parser,
+    "m", "map-file",
+    Some(false),
+    "Map the plugin file instead of reading it into memory.");
+  ToggleOption wx_code(parser,
+    "W", "wx-code",
+    Some(false),
+    "Never map JIT code writable and executable at once.");
+  ToggleOption poll_interrupts(parser,
+    "P", "poll-interrupts",
+    Some(false),
+    "Check for timeouts at loop back-edges instead of patching them on a timeout.");
+  ToggleOption table_unwind(parser,
+    "U", "table-unwind",
+    Some(false),
+    "Propagate exceptions from natives through landing pads instead of checking after each call.");
+  ToggleOption verify_all(parser,
+    "V", "verify-all",
+    Some(false),
+    "Verify every reachable method while loading, instead of on first call.");
+  ToggleOption opcode_pairs(parser,
+    "o", "opcode-pairs",
+    Some(false),
+    "Read a list of .smx files, one per line, and print the most common pairs of "
+    "interpreter ops instead of running anything.");
+  StringOption sample_profile(parser,
+    "s", "sample-profile",
+    Some(std::string()),
+    "Sample the call stack every millisecond, and write folded stacks to this file.");
+  StringOption timeline(parser,
+    "T", "timeline",
+    Some(std::string()),
+    "Record invokes, native calls, JIT compiles and watchdog timeouts, and write them "
+    "to this file as a Chrome trace.");
+  StringOption method_profile(parser,
+    "M", "method-profile",
+    Some(std::string()),
+    "After running, write how hot each method was to this file.");
+  StringOption use_method_profile(parser,
+    "R", "use-method-profile",
+    Some(std::string()),
+    "Before running, compile the methods in this method profile, hottest first.");
+  IntOption budget(parser,
+    "u", "budget",
+    Some(-1),
+    "Give each invocation this many units of budget, one per call and loop iteration "
+    "(0 for as many as possible), and print what main() spent to stderr.");
+  IntOption bench(parser,
+    "b", "bench",
+    Some(0),
+    "Run main() repeatedly for this many milliseconds, and print timings as JSON.");
+  IntOption load_bench(parser,
+    "L", "load-bench",
+    Some(0),
+    "Treat the file as a directory of plugins (or a list of them), load, bind, verify, "
+    "compile and unload them all this many times, and print timings as JSON.");
+  ToggleOption perf_counters(parser,
+    "C", "perf-counters",
+    Some(false),
+    "Print hardware performance counters for each public to stderr (Linux only).");
+  ToggleOption show_stats(parser,
+    "S", "stats",
+    Some(false),
+    "Print how much heap and stack the plugin used to stderr, for sizing #pragma dynamic.");
+  ToggleOption jit_stats(parser,
+    "J", "jit-stats",
+    Some(false),
+    "Print what compiling each method cost to stderr.");
+  ToggleOption trace_natives(parser,
+    "N", "trace-natives",
+    Some(false),
+    "Print call counts and latencies for each native main() calls to stderr.");
+  ToggleOption opcode_histogram(parser,
+    "H", "opcode-histogram",
+    Some(false),
+    "Interpret everything, and print how often each op and operand value ran, per "
+    "method and for the plugin, to stderr.");
+  StringOption record(parser,
+    "r", "record",
+    Some(std::string()),
+    "Record each invocation of the plugin, and the results of the natives it calls, "
+    "to this file.");
+  StringOption replay(parser,
+    "y", "replay",
+    Some(std::string()),
+    "Run the invocations recorded in this file by --record, with natives returning "
+    "what they returned then, and compare their results and times.");
+  StringOption perf_map(parser,
+    "X", "perf-map",
+    Some(std::string()),
+    "Describe JIT code to profilers like perf: \"map\" writes /tmp/perf-<pid>.map, "
+    "\"jitdump\" writes /tmp/jit-<pid>.dump.");
   ToggleOption disable_watchdog(parser,
     "w", "disable-watchdog",
     Some(false),
@@ -313,6 +1297,9 @@ int main(int argc, char** argv)
     return 0;
   }
 
+  if (getenv("WX_CODE") || wx_code.value())
+    Environment::SetDualMappedCode(true);
+
   if ((sEnv = Environment::New()) == nullptr) {
     fprintf(stderr, "Could not initialize ISourcePawnEngine2\n");
     return 1;
@@ -320,14 +1307,100 @@ int main(int argc, char** argv)
 
   if (getenv("DISABLE_JIT") || disable_jit.value())
     sEnv->SetJitEnabled(false);
+  if (getenv("DISABLE_PREDECODE") || disable_predecode.value())
+    sEnv->SetPredecodeEnabled(false);
+  if (getenv("POLL_INTERRUPTS") || poll_interrupts.value())
+    sEnv->SetInterruptPolling(true);
+  if (getenv("TABLE_UNWIND") || table_unwind.value())
+    sEnv->SetTableUnwinding(true);
+  if (budget.value() >= 0) {
+    sEnv->SetInvocationBudgets(true);
+    sEnv->SetInvocationBudget(uint32_t(budget.value()));
+  }
+  if (getenv("TIERED_JIT") || tiered_jit.value())
+    sEnv->SetJitThreshold(Environment::kDefaultJitThreshold);
+  if (getenv("BACKGROUND_JIT") || background_jit.value())
+    sEnv->SetBackgroundCompilation(true);
+  if (!code_cache.value().empty())
+    sEnv->SetCodeCacheDirectory(code_cache.value().c_str());
+  if (perf_map.value() == "map" || perf_map.value() == "jitdump") {
+    CodeMap::Format format =
+      perf_map.value() == "map" ? CodeMap::Format::PerfMap : CodeMap::Format::JitDump;
+    if (!sEnv->EnableCodeMap(format))
+      fprintf(stderr, "Could not open the %s file\n", perf_map.value().c_str());
+  } else if (!perf_map.value().empty()) {
+    fprintf(stderr, "Unknown --perf-map format: %s\n", perf_map.value().c_str());
+  }
+
+  if (opcode_pairs.value()) {
+    int errcode = CountPairs(filename.value().c_str());
+    sEnv->Shutdown();
+    delete sEnv;
+    return errcode;
+  }
 
   ShellDebugListener debug;
   sEnv->SetDebugger(&debug);
 
   if (!getenv("DISABLE_WATCHDOG") && !disable_watchdog.value())
     sEnv->InstallWatchdogTimer(5000);
+  if (!sample_profile.value().empty() && !sEnv->StartSampling(1))
+    fprintf(stderr, "Could not start the sampling profiler; is the watchdog disabled?\n");
+
+  uint32_t load_flags = 0;
+  if (getenv("PRECOMPILE") || precompile.value())
+    load_flags |= SP_LOADFLAG_PRECOMPILE;
+  if (map_file.value())
+    load_flags |= SP_LOADFLAG_MAP_FILE;
+  if (verify_all.value())
+    load_flags |= SP_LOADFLAG_VERIFY_ALL;
 
-  int errcode = Execute(filename.value().c_str());
+  if (trace_natives.value())
+    sEnv->SetNativeTracing(true);
+  if (!timeline.value().empty())
+    sEnv->StartTimeline(1 << 20);
+  if (opcode_histogram.value()) {
+    sEnv->SetJitEnabled(false);
+    sEnv->SetOpcodeCounting(true);
+  }
+  sShowStats = show_stats.value();
+  sShowJitStats = jit_stats.value();
+
+  PublicCounters counters;
+  if (perf_counters.value()) {
+    if (counters.init())
+      sCounters = &counters;
+    else
+      fprintf(stderr, "Could not open performance counters; check perf_event_paranoid.\n");
+  }
+
+  int errcode;
+  if (load_bench.value() > 0) {
+    errcode = LoadBench(filename.value().c_str(), load_flags, load_bench.value());
+  } else if (bench.value() > 0) {
+    errcode = Bench(filename.value().c_str(), load_flags, bench.value());
+  } else if (!replay.value().empty()) {
+    errcode = Replay(filename.value().c_str(), load_flags, replay.value().c_str());
+  } else {
+    errcode = Execute(filename.value().c_str(), load_flags, use_method_profile.value(),
+                      method_profile.value(), record.value());
+  }
+
+  if (sCounters) {
+    sCounters->report(stderr);
+    sCounters = nullptr;
+  }
+
+  if (sEnv->IsSamplingEnabled()) {
+    sEnv->StopSampling();
+    if (!sEnv->WriteSampleProfile(sample_profile.value().c_str()))
+      fprintf(stderr, "Could not write %s\n", sample_profile.value().c_str());
+  }
+  if (sEnv->timeline()) {
+    sEnv->StopTimeline();
+    if (!sEnv->WriteTimeline(timeline.value().c_str()))
+      fprintf(stderr, "Could not write %s\n", timeline.value().c_str());
+  }
 
   sEnv->SetDebugger(NULL);
   sEnv->Shutdown();
@@ -7,34 +7,179 @@
 // provided with this file, you can obtain it here:
 //   http://www.gnu.org/licenses/gpl.html
 //
+#include <algorithm>
 #include <utility>
 
 #include <amtl/am-string.h>
 #include "smx-v1-image.h"
 #include "zlib/zlib.h"
+#include "shared/lz4-block.h"
+#include "shared/zlib-chunks.h"
 
 using namespace ke;
 using namespace sp;
 
-SmxV1Image::SmxV1Image(FILE* fp)
- : FileReader(fp),
+// Checks whether |fp| is uncompressed with its code on a page boundary, as
+// spcomp --page-aligned writes it. Mapping such a file shares its pages with
+// every other process that maps it, and the code is used where it lies. Only
+// enough is read to find the code; validate() checks everything properly.
+static bool
+HasPageAlignedCode(FILE* fp)
+{
+  sp_file_hdr_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+    return false;
+  if (hdr.magic != SmxConsts::FILE_MAGIC || hdr.compression != SmxConsts::FILE_COMPRESSION_NONE)
+    return false;
+
+  // The section table and names come before |dataoffs|, and are small.
+  if (hdr.stringtab < sizeof(hdr) || hdr.dataoffs <= hdr.stringtab ||
+      hdr.dataoffs > SmxConsts::FILE_PAGE_ALIGNMENT * 16 ||
+      sizeof(hdr) + hdr.sections * sizeof(sp_file_section_t) > hdr.stringtab)
+  {
+    return false;
+  }
+
+  std::unique_ptr<uint8_t[]> prefix = std::make_unique<uint8_t[]>(hdr.dataoffs);
+  size_t rest = hdr.dataoffs - sizeof(hdr);
+  if (fread(prefix.get() + sizeof(hdr), 1, rest, fp) != rest)
+    return false;
+
+  const sp_file_section_t* sections =
+    reinterpret_cast<const sp_file_section_t*>(prefix.get() + sizeof(hdr));
+  const char* names = reinterpret_cast<const char*>(prefix.get() + hdr.stringtab);
+  size_t names_length = hdr.dataoffs - hdr.stringtab;
+  for (size_t i = 0; i < hdr.sections; i++) {
+    const sp_file_section_t& section = sections[i];
+    if (section.nameoffs >= names_length ||
+        strncmp(names + section.nameoffs, ".code", names_length - section.nameoffs) != 0)
+    {
+      continue;
+    }
+
+    sp_file_code_t code;
+    if (section.size < sizeof(code) || fseek(fp, section.dataoffs, SEEK_SET) != 0 ||
+        fread(&code, sizeof(code), 1, fp) != 1)
+    {
+      return false;
+    }
+    return IsAligned(size_t(section.dataoffs) + code.code, SmxConsts::FILE_PAGE_ALIGNMENT);
+  }
+  return false;
+}
+
+SmxV1Image::SmxV1Image(FILE* fp, bool map_file)
+ : inflated_(false),
    hdr_(nullptr),
    header_strings_(nullptr),
    names_section_(nullptr),
    names_(nullptr),
+   native_ordinals_(nullptr),
+   native_manifest_(0),
    debug_names_section_(nullptr),
    debug_names_(nullptr),
+   debug_info_(nullptr),
+   line_table_(nullptr),
+   line_blocks_(nullptr),
+   line_stream_(nullptr),
+   line_stream_length_(0),
+   debug_symbols_section_(nullptr),
    debug_syms_(nullptr),
    debug_syms_unpacked_(nullptr),
+   debug_globals_(nullptr),
    rtti_data_(nullptr),
-   rtti_methods_(nullptr)
+   rtti_methods_(nullptr),
+   rtti_natives_(nullptr),
+   has_name_hash_(false),
+   debug_state_(DebugState::Unchecked)
 {
+  memset(name_hash_, 0, sizeof(name_hash_));
+  // A mapped file costs no heap, so it is simplest to inflate it in place.
+  if (!map_file && inflateFromFile(fp))
+    return;
+  if (fseek(fp, 0, SEEK_SET) != 0)
+    return;
+  if (!map_file) {
+    map_file = HasPageAlignedCode(fp);
+    if (fseek(fp, 0, SEEK_SET) != 0)
+      return;
+  }
+  readFile(fp, map_file);
 }
 
-// Validating SMX v1 scripts is fairly expensive. We reserve real validation
-// for v2.
+// Inflates a compressed plugin as it is read, so the compressed copy never has
+// to be held in memory alongside the image. Only the checks needed to size
+// the image are made here; if anything is off, the whole file is read instead
+// and validate() reports the problem as usual.
+bool
+SmxV1Image::inflateFromFile(FILE* fp)
+{
+  if (fseek(fp, 0, SEEK_END) != 0)
+    return false;
+  long file_size = ftell(fp);
+  if (file_size < 0 || fseek(fp, 0, SEEK_SET) != 0)
+    return false;
+
+  sp_file_hdr_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+    return false;
+  if (hdr.magic != SmxConsts::FILE_MAGIC || hdr.compression != SmxConsts::FILE_COMPRESSION_GZ)
+    return false;
+  if (hdr.disksize > (size_t)file_size ||
+      hdr.dataoffs < sizeof(sp_file_hdr_t) ||
+      hdr.dataoffs > hdr.disksize ||
+      hdr.imagesize < hdr.dataoffs)
+  {
+    return false;
+  }
+
+  std::unique_ptr<uint8_t[]> image = std::make_unique<uint8_t[]>(hdr.imagesize);
+  if (!image)
+    return false;
+
+  // The header, section table and string table precede the compressed region.
+  memcpy(image.get(), &hdr, sizeof(hdr));
+  size_t prefix = hdr.dataoffs - sizeof(hdr);
+  if (prefix && fread(image.get() + sizeof(hdr), 1, prefix, fp) != prefix)
+    return false;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK)
+    return false;
+  strm.next_out = image.get() + hdr.dataoffs;
+  strm.avail_out = hdr.imagesize - hdr.dataoffs;
+
+  static const size_t kChunkSize = 64 * 1024;
+  std::unique_ptr<uint8_t[]> chunk = std::make_unique<uint8_t[]>(kChunkSize);
+
+  int rv = Z_OK;
+  size_t remaining = hdr.disksize - hdr.dataoffs;
+  while (remaining && rv == Z_OK) {
+    size_t bytes = fread(chunk.get(), 1, std::min(remaining, kChunkSize), fp);
+    if (!bytes)
+      break;
+    remaining -= bytes;
+
+    strm.next_in = chunk.get();
+    strm.avail_in = uInt(bytes);
+    rv = inflate(&strm, Z_NO_FLUSH);
+  }
+  inflateEnd(&strm);
+
+  if (rv != Z_STREAM_END)
+    return false;
+
+  setBuffer(std::move(image), hdr.imagesize);
+  inflated_ = true;
+  return true;
+}
+
+// Checks the file header, decodes the image if it is compressed, and reads
+// the section table. This is all a split-out debug file needs before its
+// sections can be looked up.
 bool
-SmxV1Image::validate()
+SmxV1Image::validateHeader()
 {
   if (length_ < sizeof(sp_file_hdr_t))
     return error("bad header");
@@ -55,6 +200,10 @@ SmxV1Image::validate()
   switch (hdr_->compression) {
     case SmxConsts::FILE_COMPRESSION_GZ:
     {
+      // Already inflated while reading the file.
+      if (inflated_)
+        break;
+
       // We don't support junk in binaries, check that disksize matches the actual file size.
       // (this is to avoid a known crash in inflate() if told that data is bigger than it is)
       if (hdr_->disksize > length_)
@@ -94,9 +243,42 @@ SmxV1Image::validate()
       // Copy the initial uncompressed region back in.
       memcpy(uncompressed.get(), buffer(), hdr_->dataoffs);
 
-      // Replace the original buffer.
-      length_ = hdr_->imagesize;
-      buffer_ = std::move(uncompressed);
+      // Replace the original buffer. A mapped file is no longer needed.
+      setBuffer(std::move(uncompressed), hdr_->imagesize);
+      hdr_ = (sp_file_hdr_t*)buffer();
+      break;
+    }
+
+    case SmxConsts::FILE_COMPRESSION_LZ4:
+    case SmxConsts::FILE_COMPRESSION_GZ_CHUNKS:
+    {
+      // Same region rules as the GZ codec.
+      if (hdr_->disksize > length_)
+        return error("illegal disk size");
+      if (hdr_->dataoffs > length_ || hdr_->dataoffs < sizeof(sp_file_hdr_t) ||
+          hdr_->disksize < hdr_->dataoffs)
+      {
+        return error("illegal compressed region");
+      }
+      if (hdr_->imagesize < hdr_->dataoffs)
+        return error("illegal image size");
+
+      std::unique_ptr<uint8_t[]> uncompressed = std::make_unique<uint8_t[]>(hdr_->imagesize);
+      if (!uncompressed)
+        return error("out of memory");
+
+      const uint8_t* src = buffer() + hdr_->dataoffs;
+      size_t srclen = hdr_->disksize - hdr_->dataoffs;
+      uint8_t* dest = uncompressed.get() + hdr_->dataoffs;
+      size_t destlen = hdr_->imagesize - hdr_->dataoffs;
+      bool ok = (hdr_->compression == SmxConsts::FILE_COMPRESSION_LZ4)
+                ? Lz4Decompress(src, srclen, dest, destlen)
+                : ZlibChunksDecompress(src, srclen, dest, destlen, 0);
+      if (!ok)
+        return error("could not decode compressed region");
+
+      memcpy(uncompressed.get(), buffer(), hdr_->dataoffs);
+      setBuffer(std::move(uncompressed), hdr_->imagesize);
       hdr_ = (sp_file_hdr_t*)buffer();
       break;
     }
@@ -146,6 +328,16 @@ SmxV1Image::validate()
   }
   if (!found_terminator)
     return error("malformed section names header");
+  return true;
+}
+
+// Validating SMX v1 scripts is fairly expensive. We reserve real validation
+// for v2.
+bool
+SmxV1Image::validate(bool lazy_debug_info)
+{
+  if (!validateHeader())
+    return false;
 
   names_section_ = findSection(".names");
   if (!names_section_)
@@ -171,16 +363,180 @@ SmxV1Image::validate()
     return false;
   if (!validateNatives())
     return false;
+  if (!validateNativeOrdinals())
+    return false;
+  if (!validateNameHash())
+    return false;
+  if (!has_name_hash_ && !buildNameIndex())
+    return error("out of memory");
+
+  // A split-out debug file is only read once something needs it.
+  if (lazy_debug_info || findSection(".dbg.link"))
+    return true;
+  if (!validateDebugSections())
+    return false;
+  debug_state_ = DebugState::Valid;
+  return true;
+}
+
+// The compiler's .names.hash section saves hashing every name at load. Only
+// its shape is checked: a table that doesn't match the names it indexes can
+// make lookups fail, but never read out of bounds or fail to stop.
+bool
+SmxV1Image::validateNameHash()
+{
+  const Section* section = findSection(".names.hash");
+  if (!section)
+    return true;
+  if (!validateSection(section) || section->size < sizeof(sp_file_name_hash_t))
+    return error("invalid .names.hash section");
+
+  const sp_file_name_hash_t* header =
+    reinterpret_cast<const sp_file_name_hash_t*>(buffer() + section->dataoffs);
+  const uint32_t slots[] = {
+    header->natives_slots,
+    header->publics_slots,
+    header->pubvars_slots,
+  };
+  const size_t rows[] = {
+    natives_.length(),
+    publics_.length(),
+    pubvars_.length(),
+  };
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < 3; i++) {
+    if ((slots[i] & (slots[i] - 1)) != 0 || (rows[i] && !slots[i]))
+      return error("invalid .names.hash section");
+    total += slots[i];
+  }
+  if (sizeof(sp_file_name_hash_t) + total * sizeof(sp_file_name_hash_entry_t) != section->size)
+    return error("invalid .names.hash section");
+
+  const sp_file_name_hash_entry_t* entries =
+    reinterpret_cast<const sp_file_name_hash_entry_t*>(header + 1);
+  for (size_t i = 0; i < 3; i++) {
+    // Every probe must reach an empty slot.
+    bool found_empty = !slots[i];
+    for (size_t slot = 0; slot < slots[i]; slot++) {
+      uint32_t row = entries[slot].row;
+      if (row == NAME_HASH_EMPTY)
+        found_empty = true;
+      else if (row >= rows[i])
+        return error("invalid .names.hash section");
+    }
+    if (!found_empty)
+      return error("invalid .names.hash section");
+
+    name_hash_[i].entries = entries;
+    name_hash_[i].slots = slots[i];
+    entries += slots[i];
+  }
+  has_name_hash_ = true;
+  return true;
+}
+
+template <typename T>
+bool
+SmxV1Image::findHashedName(const HashedNames& table, const List<T>& rows, const char* name,
+                           size_t* indexp) const
+{
+  if (!table.slots)
+    return false;
+
+  uint32_t hash = SmxNameHash(name);
+  uint32_t mask = table.slots - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    const sp_file_name_hash_entry_t& entry = table.entries[slot];
+    if (entry.row == NAME_HASH_EMPTY)
+      return false;
+    if (entry.hash == hash && strcmp(names_ + rows[entry.row].name, name) == 0) {
+      if (indexp)
+        *indexp = entry.row;
+      return true;
+    }
+  }
+}
+
+// Binding hundreds of natives by name would otherwise be quadratic.
+bool
+SmxV1Image::buildNameIndex()
+{
+  if (!native_index_.init() || !public_index_.init() || !pubvar_index_.init())
+    return false;
+
+  for (size_t i = 0; i < natives_.length(); i++) {
+    const char* name = names_ + natives_[i].name;
+    NameMap::Insert p = native_index_.findForAdd(name);
+    if (!p.found() && !native_index_.add(p, name, i))
+      return false;
+  }
+  for (size_t i = 0; i < publics_.length(); i++) {
+    const char* name = names_ + publics_[i].name;
+    NameMap::Insert p = public_index_.findForAdd(name);
+    if (!p.found() && !public_index_.add(p, name, i))
+      return false;
+  }
+  for (size_t i = 0; i < pubvars_.length(); i++) {
+    const char* name = names_ + pubvars_[i].name;
+    NameMap::Insert p = pubvar_index_.findForAdd(name);
+    if (!p.found() && !pubvar_index_.add(p, name, i))
+      return false;
+  }
+  return true;
+}
+
+bool
+SmxV1Image::validateDebugSections()
+{
   if (!validateRtti())
     return false;
   if (!validateDebugInfo())
     return false;
   if (!validateTags())
     return false;
-
+  buildFunctionIndex();
+  buildGlobalIndex();
   return true;
 }
 
+// Nothing reads the debug, RTTI or tag sections without going through here,
+// so deferring their validation is as safe as doing it at load.
+bool
+SmxV1Image::ensureDebugInfo() const
+{
+  if (debug_state_ != DebugState::Unchecked)
+    return debug_state_ == DebugState::Valid;
+
+  // Validation only fills in what was left unset at load, so it is safe to
+  // finish from const lookups.
+  SmxV1Image* self = const_cast<SmxV1Image*>(this);
+  if (self->validateDebugSections()) {
+    self->debug_state_ = DebugState::Valid;
+    return true;
+  }
+
+  // Drop anything a partial validation may have set.
+  self->debug_state_ = DebugState::Invalid;
+  self->tags_ = List<sp_file_tag_t>();
+  self->debug_names_section_ = names_section_;
+  self->debug_names_ = names_;
+  self->debug_info_ = nullptr;
+  self->debug_files_ = List<sp_fdbg_file_t>();
+  self->debug_lines_ = List<sp_fdbg_line_t>();
+  self->line_table_ = nullptr;
+  self->debug_symbols_section_ = nullptr;
+  self->debug_syms_ = nullptr;
+  self->debug_syms_unpacked_ = nullptr;
+  self->debug_globals_ = nullptr;
+  self->rtti_data_ = nullptr;
+  self->rtti_methods_ = nullptr;
+  self->function_index_.clear();
+  self->global_index_.clear();
+  self->debug_file_ = nullptr;
+  return false;
+}
+
 const SmxV1Image::Section*
 SmxV1Image::findSection(const char* name)
 {
@@ -276,7 +632,8 @@ SmxV1Image::validateCode()
   if (code->codeversion >= SmxConsts::CODE_VERSION_FEATURE_MASK)
     features = code->features;
 
-  uint32_t supported_features = SmxConsts::kCodeFeatureDirectArrays;
+  uint32_t supported_features = SmxConsts::kCodeFeatureDirectArrays |
+                                SmxConsts::kCodeFeatureFusedIndex;
   if (features & ~supported_features)
     return error("unsupported feature set; code is too new");
 
@@ -358,6 +715,24 @@ SmxV1Image::validateNatives()
   return true;
 }
 
+bool
+SmxV1Image::validateNativeOrdinals()
+{
+  const Section* section = findSection(".natives.ordinals");
+  if (!section)
+    return true;
+  if (!validateSection(section) ||
+      section->size != sizeof(sp_file_native_ordinals_t) + natives_.length() * sizeof(uint32_t))
+  {
+    return error("invalid .natives.ordinals section");
+  }
+
+  const uint8_t* bytes = buffer() + section->dataoffs;
+  native_manifest_ = reinterpret_cast<const sp_file_native_ordinals_t*>(bytes)->manifest;
+  native_ordinals_ = reinterpret_cast<const uint32_t*>(bytes + sizeof(sp_file_native_ordinals_t));
+  return true;
+}
+
 bool
 SmxV1Image::validateName(size_t offset)
 {
@@ -394,6 +769,15 @@ SmxV1Image::validateRtti()
   if (rtti_methods_ && !validateRttiMethods())
     return false;
 
+  // Signatures are only looked up when natives are bound, and a table that
+  // doesn't line up with the natives is ignored rather than rejected.
+  rtti_natives_ = findRttiSection("rtti.natives");
+  if (rtti_natives_ && (rtti_natives_->row_count != natives_.length() ||
+                        rtti_natives_->row_size < sizeof(smx_rtti_native)))
+  {
+    rtti_natives_ = nullptr;
+  }
+
   return true;
 }
 
@@ -416,25 +800,71 @@ SmxV1Image::validateRttiMethods()
   return true;
 }
 
+// Opens the file a --split-debug build wrote this image's debug sections to,
+// if it is next to the image and was written along with it.
+SmxV1Image*
+SmxV1Image::loadDebugFile()
+{
+  const Section* link = findSection(".dbg.link");
+  if (!link || !validateSection(link) || link->size <= sizeof(sp_fdbg_link_t))
+    return nullptr;
+
+  const char* bytes = reinterpret_cast<const char*>(buffer() + link->dataoffs);
+  const sp_fdbg_link_t* info = reinterpret_cast<const sp_fdbg_link_t*>(bytes);
+  const char* name = bytes + sizeof(sp_fdbg_link_t);
+  if (!*name || bytes[link->size - 1] != '\0')
+    return nullptr;
+
+  std::string path;
+  size_t sep = path_.find_last_of("/\\");
+  if (sep != std::string::npos)
+    path = path_.substr(0, sep + 1);
+  path += name;
+
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return nullptr;
+  std::unique_ptr<SmxV1Image> file = std::make_unique<SmxV1Image>(fp);
+  fclose(fp);
+  if (!file->buffer() || !file->validateHeader())
+    return nullptr;
+
+  const Section* other = file->findSection(".dbg.link");
+  if (!other || !file->validateSection(other) || other->size < sizeof(sp_fdbg_link_t))
+    return nullptr;
+  if (memcmp(file->buffer() + other->dataoffs, info->build_id, sizeof(info->build_id)) != 0)
+    return nullptr;
+
+  debug_file_ = std::move(file);
+  return debug_file_.get();
+}
+
 bool
 SmxV1Image::validateDebugInfo()
 {
+  // A --split-debug build keeps these sections in another file.
+  SmxV1Image* source = this;
   const Section* dbginfo = findSection(".dbg.info");
-  if (!dbginfo)
-    return true;
-  if (!validateSection(dbginfo))
+  if (!dbginfo) {
+    if (!(source = loadDebugFile()))
+      return true;
+    if (!(dbginfo = source->findSection(".dbg.info")))
+      return error("no debug info in debug file");
+  }
+  if (!source->validateSection(dbginfo))
     return error("invalid .dbg.info section");
 
   debug_info_ =
-    reinterpret_cast<const sp_fdbg_info_t*>(buffer() + dbginfo->dataoffs);
+    reinterpret_cast<const sp_fdbg_info_t*>(source->buffer() + dbginfo->dataoffs);
 
   // Pre-RTTI, the debug tables used a separate string table. That is no longer
   // the case, but we support both scenarios.
-  debug_names_section_ = findSection(".dbg.strings");
+  debug_names_section_ = source->findSection(".dbg.strings");
   if (debug_names_section_) {
-    if (!validateSection(debug_names_section_))
+    if (!source->validateSection(debug_names_section_))
       return error("invalid .dbg.strings section");
-    debug_names_ = reinterpret_cast<const char*>(buffer() + debug_names_section_->dataoffs);
+    debug_names_ =
+      reinterpret_cast<const char*>(source->buffer() + debug_names_section_->dataoffs);
 
     // Name tables must be null-terminated.
     if (debug_names_section_->size != 0 &&
@@ -447,59 +877,68 @@ SmxV1Image::validateDebugInfo()
     debug_names_ = names_;
   }
 
-  const Section* files = findSection(".dbg.files");
+  const Section* files = source->findSection(".dbg.files");
   if (!files)
     return error("no debug file table");
-  if (!validateSection(files))
+  if (!source->validateSection(files))
     return error("invalid debug file table");
   if (files->size < sizeof(sp_fdbg_file_t) * debug_info_->num_files)
     return error("invalid debug file table");
   debug_files_ = List<sp_fdbg_file_t>(
-    reinterpret_cast<const sp_fdbg_file_t*>(buffer() + files->dataoffs),
+    reinterpret_cast<const sp_fdbg_file_t*>(source->buffer() + files->dataoffs),
     debug_info_->num_files);
 
-  const Section* lines = findSection(".dbg.lines");
+  const Section* lines = source->findSection(".dbg.lines");
   if (!lines)
     return error("no debug lines table");
-  if (!validateSection(lines))
+  if (!source->validateSection(lines))
     return error("invalid debug lines table");
   if (lines->size < sizeof(sp_fdbg_line_t) * debug_info_->num_lines)
     return error("invalid debug lines table");
   debug_lines_ = List<sp_fdbg_line_t>(
-    reinterpret_cast<const sp_fdbg_line_t*>(buffer() + lines->dataoffs),
+    reinterpret_cast<const sp_fdbg_line_t*>(source->buffer() + lines->dataoffs),
     debug_info_->num_lines);
 
-  debug_symbols_section_ = findSection(".dbg.symbols");
+  if (const Section* table = source->findSection(".dbg.linetable")) {
+    if (!validateLineTable(source, table))
+      return error("invalid debug line table");
+  }
+
+  debug_symbols_section_ = source->findSection(".dbg.symbols");
   if (debug_symbols_section_) {
-    if (!validateSection(debug_symbols_section_))
+    if (!source->validateSection(debug_symbols_section_))
       return error("invalid debug symbol table");
   } else {
     // New debug symbol tables are optional, but if present, they need to be
     // coherent.
-    if (const Section* globals = findSection(".dbg.globals")) {
-      if (!validateRttiHeader(globals))
+    if (const Section* globals = source->findSection(".dbg.globals")) {
+      if (!source->validateRttiHeader(globals))
+        return error("invalid debug globals table");
+      debug_globals_ =
+        reinterpret_cast<const smx_rtti_table_header*>(source->buffer() + globals->dataoffs);
+      if (debug_globals_->row_size < sizeof(smx_rtti_debug_var))
         return error("invalid debug globals table");
     }
-    if (const Section* locals = findSection(".dbg.locals")) {
-      if (!validateRttiHeader(locals))
+    if (const Section* locals = source->findSection(".dbg.locals")) {
+      if (!source->validateRttiHeader(locals))
         return error("invalid debug locals table");
     }
-    if (const Section* methods = findSection(".dbg.methods")) {
-      if (!validateRttiHeader(methods))
+    if (const Section* methods = source->findSection(".dbg.methods")) {
+      if (!source->validateRttiHeader(methods))
         return error("invalid debug methods table");
     }
   }
 
   if (debug_symbols_section_) {
+    const uint8_t* syms = source->buffer() + debug_symbols_section_->dataoffs;
+
     // See the note about unpacked debug sections in smx-headers.h.
-    if (hdr_->version == SmxConsts::SP1_VERSION_1_0 &&
-        !findSection(".dbg.natives"))
+    if (source->hdr_->version == SmxConsts::SP1_VERSION_1_0 &&
+        !source->findSection(".dbg.natives"))
     {
-      debug_syms_unpacked_ =
-        reinterpret_cast<const sp_u_fdbg_symbol_t*>(buffer() + debug_symbols_section_->dataoffs);
+      debug_syms_unpacked_ = reinterpret_cast<const sp_u_fdbg_symbol_t*>(syms);
     } else {
-      debug_syms_ =
-        reinterpret_cast<const sp_fdbg_symbol_t*>(buffer() + debug_symbols_section_->dataoffs);
+      debug_syms_ = reinterpret_cast<const sp_fdbg_symbol_t*>(syms);
     }
   }
 
@@ -563,18 +1002,39 @@ SmxV1Image::GetNative(size_t index) const
   return names_ + natives_[index].name;
 }
 
+const uint32_t*
+SmxV1Image::NativeOrdinals(uint32_t* manifest) const
+{
+  *manifest = native_manifest_;
+  return native_ordinals_;
+}
+
+bool
+SmxV1Image::GetNativeSignature(size_t index, const uint8_t** bytes, size_t* length)
+{
+  if (!rtti_natives_ || index >= rtti_natives_->row_count)
+    return false;
+
+  const smx_rtti_native* row = getRttiRow<smx_rtti_native>(rtti_natives_, index);
+  if (row->signature >= rtti_data_->size)
+    return false;
+  *bytes = buffer() + rtti_data_->dataoffs + row->signature;
+  *length = rtti_data_->size - row->signature;
+  return true;
+}
+
 bool
 SmxV1Image::FindNative(const char* name, size_t* indexp) const
 {
-  for (size_t i = 0; i < natives_.length(); i++) {
-    const char* candidate = names_ + natives_[i].name;
-    if (strcmp(candidate, name) == 0) {
-      if (indexp)
-        *indexp = i;
-      return true;
-    }
-  }
-  return false;
+  if (has_name_hash_)
+    return findHashedName(name_hash_[0], natives_, name, indexp);
+
+  NameMap::Result r = native_index_.find(name);
+  if (!r.found())
+    return false;
+  if (indexp)
+    *indexp = r->value;
+  return true;
 }
 
 size_t
@@ -596,24 +1056,15 @@ SmxV1Image::GetPublic(size_t index, uint32_t* offsetp, const char** namep) const
 bool
 SmxV1Image::FindPublic(const char* name, size_t* indexp) const
 {
-  int high = publics_.length() - 1;
-  int low = 0;
-  while (low <= high) {
-    int mid = (low + high) / 2;
-    const char* candidate = names_ + publics_[mid].name;
-    int diff = strcmp(candidate, name);
-    if (diff == 0) {
-      if (indexp) {
-        *indexp = mid;
-        return true;
-      }
-    }
-    if (diff < 0)
-      low = mid + 1;
-    else
-      high = mid - 1;
-  }
-  return false;
+  if (has_name_hash_)
+    return findHashedName(name_hash_[1], publics_, name, indexp);
+
+  NameMap::Result r = public_index_.find(name);
+  if (!r.found())
+    return false;
+  if (indexp)
+    *indexp = r->value;
+  return true;
 }
 
 size_t
@@ -635,24 +1086,15 @@ SmxV1Image::GetPubvar(size_t index, uint32_t* offsetp, const char** namep) const
 bool
 SmxV1Image::FindPubvar(const char* name, size_t* indexp) const
 {
-  int high = pubvars_.length() - 1;
-  int low = 0;
-  while (low <= high) {
-    int mid = (low + high) / 2;
-    const char* candidate = names_ + pubvars_[mid].name;
-    int diff = strcmp(candidate, name);
-    if (diff == 0) {
-      if (indexp) {
-        *indexp = mid;
-        return true;
-      }
-    }
-    if (diff < 0)
-      low = mid + 1;
-    else
-      high = mid - 1;
-  }
-  return false;
+  if (has_name_hash_)
+    return findHashedName(name_hash_[2], pubvars_, name, indexp);
+
+  NameMap::Result r = pubvar_index_.find(name);
+  if (!r.found())
+    return false;
+  if (indexp)
+    *indexp = r->value;
+  return true;
 }
 
 size_t
@@ -670,6 +1112,9 @@ SmxV1Image::ImageSize() const
 const char*
 SmxV1Image::LookupFile(uint32_t addr)
 {
+  if (!ensureDebugInfo())
+    return nullptr;
+
   int high = debug_files_.length();
   int low = -1;
 
@@ -690,8 +1135,8 @@ SmxV1Image::LookupFile(uint32_t addr)
 }
 
 template <typename SymbolType, typename DimType>
-const char*
-SmxV1Image::lookupFunction(const SymbolType* syms, uint32_t addr)
+void
+SmxV1Image::addDebugFunctions(const SymbolType* syms)
 {
   const uint8_t* cursor = reinterpret_cast<const uint8_t*>(syms);
   const uint8_t* cursor_end = cursor + debug_symbols_section_->size;
@@ -701,46 +1146,281 @@ SmxV1Image::lookupFunction(const SymbolType* syms, uint32_t addr)
 
     const SymbolType* sym = reinterpret_cast<const SymbolType*>(cursor);
     if (sym->ident == sp::IDENT_FUNCTION &&
-        sym->codestart <= addr &&
-        sym->codeend > addr)
+        sym->codestart < sym->codeend &&
+        sym->name < debug_names_section_->size)
     {
-      if (sym->name >= debug_names_section_->size)
-        return nullptr;
-      return debug_names_ + sym->name;
+      function_index_.push_back(
+        FunctionRange{uint32_t(sym->codestart), uint32_t(sym->codeend), debug_names_ + sym->name});
     }
 
     if (sym->dimcount > 0)
       cursor += sizeof(DimType) * sym->dimcount;
     cursor += sizeof(SymbolType);
   }
-  return nullptr;
 }
 
-const char*
-SmxV1Image::LookupFunction(uint32_t code_offset)
+void
+SmxV1Image::buildFunctionIndex()
 {
+  function_index_.clear();
+
   if (rtti_methods_) {
+    function_index_.reserve(rtti_methods_->row_count);
     for (uint32_t i = 0; i < rtti_methods_->row_count; i++) {
       const smx_rtti_method* method = getRttiRow<smx_rtti_method>(rtti_methods_, i);
-      if (method->pcode_start <= code_offset && method->pcode_end > code_offset)
-        return names_ + method->name;
+      if (method->pcode_start < method->pcode_end) {
+        function_index_.push_back(
+          FunctionRange{method->pcode_start, method->pcode_end, names_ + method->name});
+      }
     }
-    return nullptr;
+  } else if (debug_syms_) {
+    addDebugFunctions<sp_fdbg_symbol_t, sp_fdbg_arraydim_t>(debug_syms_);
+  } else if (debug_syms_unpacked_) {
+    addDebugFunctions<sp_u_fdbg_symbol_t, sp_u_fdbg_arraydim_t>(debug_syms_unpacked_);
   }
 
-  if (debug_syms_) {
-    return lookupFunction<sp_fdbg_symbol_t, sp_fdbg_arraydim_t>(
-      debug_syms_, code_offset);
+  // Keep the table's order among equal starts, so the first entry still wins
+  // just as it did for a linear scan.
+  std::stable_sort(function_index_.begin(), function_index_.end());
+}
+
+template <typename SymbolType, typename DimType>
+void
+SmxV1Image::addDebugGlobals(const SymbolType* syms)
+{
+  const uint8_t* cursor = reinterpret_cast<const uint8_t*>(syms);
+  const uint8_t* cursor_end = cursor + debug_symbols_section_->size;
+  for (uint32_t i = 0; i < debug_info_->num_syms; i++) {
+    if (cursor + sizeof(SymbolType) > cursor_end)
+      break;
+
+    const SymbolType* sym = reinterpret_cast<const SymbolType*>(cursor);
+    if (sym->ident != sp::IDENT_FUNCTION &&
+        sym->vclass == kVarClass_Global &&
+        sym->name < debug_names_section_->size)
+    {
+      global_index_.push_back(GlobalVar{debug_names_ + sym->name, uint32_t(sym->addr)});
+    }
+
+    if (sym->dimcount > 0)
+      cursor += sizeof(DimType) * sym->dimcount;
+    cursor += sizeof(SymbolType);
+  }
+}
+
+void
+SmxV1Image::buildGlobalIndex()
+{
+  global_index_.clear();
+
+  if (debug_globals_) {
+    global_index_.reserve(debug_globals_->row_count);
+    for (uint32_t i = 0; i < debug_globals_->row_count; i++) {
+      const smx_rtti_debug_var* var = getRttiRow<smx_rtti_debug_var>(debug_globals_, i);
+      if ((var->vclass & 3) == kVarClass_Global && var->name < debug_names_section_->size)
+        global_index_.push_back(GlobalVar{debug_names_ + var->name, uint32_t(var->address)});
+    }
+  } else if (debug_syms_) {
+    addDebugGlobals<sp_fdbg_symbol_t, sp_fdbg_arraydim_t>(debug_syms_);
+  } else if (debug_syms_unpacked_) {
+    addDebugGlobals<sp_u_fdbg_symbol_t, sp_u_fdbg_arraydim_t>(debug_syms_unpacked_);
   }
-  if (!debug_syms_unpacked_)
+}
+
+size_t
+SmxV1Image::NumDebugGlobals()
+{
+  if (!ensureDebugInfo())
+    return 0;
+  return global_index_.size();
+}
+
+void
+SmxV1Image::GetDebugGlobal(size_t index, uint32_t* addressp, const char** namep)
+{
+  assert(index < global_index_.size());
+  if (addressp)
+    *addressp = global_index_[index].address;
+  if (namep)
+    *namep = global_index_[index].name;
+}
+
+const SmxV1Image::FunctionRange*
+SmxV1Image::findFunction(uint32_t code_offset)
+{
+  if (!ensureDebugInfo())
     return nullptr;
-  return lookupFunction<sp_u_fdbg_symbol_t, sp_u_fdbg_arraydim_t>(
-      debug_syms_unpacked_, code_offset);
+
+  // Find the last function starting at or before the offset.
+  FunctionRange key{code_offset, 0, nullptr};
+  auto iter = std::upper_bound(function_index_.begin(), function_index_.end(), key);
+  if (iter == function_index_.begin())
+    return nullptr;
+  --iter;
+  if (code_offset >= iter->end)
+    return nullptr;
+  return &*iter;
+}
+
+const char*
+SmxV1Image::LookupFunction(uint32_t code_offset)
+{
+  const FunctionRange* range = findFunction(code_offset);
+  return range ? range->name : nullptr;
+}
+
+bool
+SmxV1Image::LookupFunctionRange(uint32_t code_offset, uint32_t* start, uint32_t* end)
+{
+  const FunctionRange* range = findFunction(code_offset);
+  if (!range)
+    return false;
+  *start = range->start;
+  *end = range->end;
+  return true;
+}
+
+// Only the block index is checked here. The stream is checked as it is
+// decoded, and a block that runs past its end is treated as the end of the
+// table.
+bool
+SmxV1Image::validateLineTable(SmxV1Image* source, const Section* section)
+{
+  if (!source->validateSection(section) || section->size < sizeof(sp_fdbg_linetable_t))
+    return false;
+
+  const sp_fdbg_linetable_t* table =
+    reinterpret_cast<const sp_fdbg_linetable_t*>(source->buffer() + section->dataoffs);
+  if (!table->block_size)
+    return false;
+  if ((uint64_t(table->num_lines) + table->block_size - 1) / table->block_size != table->num_blocks)
+    return false;
+
+  uint64_t index_size = uint64_t(table->num_blocks) * sizeof(sp_fdbg_lineblock_t);
+  if (sizeof(sp_fdbg_linetable_t) + index_size > section->size)
+    return false;
+
+  const sp_fdbg_lineblock_t* blocks = reinterpret_cast<const sp_fdbg_lineblock_t*>(table + 1);
+  const uint8_t* stream = reinterpret_cast<const uint8_t*>(blocks + table->num_blocks);
+  size_t stream_length = section->size - sizeof(sp_fdbg_linetable_t) - size_t(index_size);
+  for (size_t i = 0; i < table->num_blocks; i++) {
+    if (blocks[i].offset > stream_length)
+      return false;
+    if (i && (blocks[i].offset < blocks[i - 1].offset || blocks[i].addr < blocks[i - 1].addr))
+      return false;
+  }
+
+  line_table_ = table;
+  line_blocks_ = blocks;
+  line_stream_ = stream;
+  line_stream_length_ = stream_length;
+  return true;
+}
+
+SmxV1Image::LineCursor::LineCursor(const SmxV1Image* image, size_t start)
+ : image_(image),
+   index_(start),
+   pos_(nullptr),
+   end_(nullptr)
+{
+  if (image->line_table_) {
+    count_ = image->line_table_->num_lines;
+    assert(start % image->line_table_->block_size == 0);
+    if (!done())
+      enterBlock(start / image->line_table_->block_size);
+  } else {
+    count_ = image->debug_lines_.length();
+    if (!done())
+      entry_ = image->debug_lines_[index_];
+  }
+}
+
+void
+SmxV1Image::LineCursor::enterBlock(size_t block)
+{
+  const sp_fdbg_lineblock_t& info = image_->line_blocks_[block];
+  entry_.addr = info.addr;
+  entry_.line = info.line;
+  pos_ = image_->line_stream_ + info.offset;
+  if (block + 1 < image_->line_table_->num_blocks)
+    end_ = image_->line_stream_ + image_->line_blocks_[block + 1].offset;
+  else
+    end_ = image_->line_stream_ + image_->line_stream_length_;
+}
+
+bool
+SmxV1Image::LineCursor::readVarint(uint32_t* value)
+{
+  *value = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (pos_ >= end_)
+      return false;
+    uint8_t byte = *pos_++;
+    *value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+void
+SmxV1Image::LineCursor::next()
+{
+  assert(!done());
+  if (++index_ >= count_)
+    return;
+
+  if (!image_->line_table_) {
+    entry_ = image_->debug_lines_[index_];
+    return;
+  }
+
+  uint32_t block_size = image_->line_table_->block_size;
+  if (index_ % block_size == 0) {
+    enterBlock(index_ / block_size);
+    return;
+  }
+
+  uint32_t addr_delta, line_delta;
+  if (!readVarint(&addr_delta) || !readVarint(&line_delta)) {
+    index_ = count_;
+    return;
+  }
+  entry_.addr += addr_delta;
+  entry_.line += (line_delta >> 1) ^ (0 - (line_delta & 1));
 }
 
 bool
 SmxV1Image::LookupLine(uint32_t addr, uint32_t* line)
 {
+  if (!ensureDebugInfo())
+    return false;
+
+  if (line_table_) {
+    // Find the last block that starts at or before |addr|; the entry is in
+    // that block, since every later block starts after |addr|.
+    size_t low = 0;
+    size_t high = line_table_->num_blocks;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (line_blocks_[mid].addr <= addr)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if (!low)
+      return false;
+
+    LineCursor cursor(this, (low - 1) * line_table_->block_size);
+    uint32_t found = cursor.get().line;
+    for (cursor.next(); !cursor.done() && cursor.get().addr <= addr; cursor.next())
+      found = cursor.get().line;
+
+    // Since the CIP occurs BEFORE the line, we have to add one.
+    *line = found + 1;
+    return true;
+  }
+
   int high = debug_lines_.length();
   int low = -1;
 
@@ -763,12 +1443,16 @@ SmxV1Image::LookupLine(uint32_t addr, uint32_t* line)
 size_t
 SmxV1Image::NumFiles() const
 {
+  if (!ensureDebugInfo())
+    return 0;
   return debug_files_.length();
 }
 
 const char*
 SmxV1Image::GetFileName(size_t index) const
 {
+  if (!ensureDebugInfo())
+    return nullptr;
   if (index >= debug_files_.length())
     return nullptr;
 
@@ -808,6 +1492,8 @@ bool
 SmxV1Image::LookupFunctionAddress(const char* function, const char* file, ucell_t* funcaddr)
 {
   *funcaddr = 0;
+  if (!ensureDebugInfo())
+    return false;
   if (rtti_methods_) {
     for (uint32_t i = 0; i < rtti_methods_->row_count; i++) {
       const smx_rtti_method* method = getRttiRow<smx_rtti_method>(rtti_methods_, i);
@@ -844,14 +1530,14 @@ SmxV1Image::LookupFunctionAddress(const char* function, const char* file, ucell_
   }
 
   // now find the first line in the function where we can "break" on
-  uint32_t index = 0;
-  for (; index < debug_info_->num_lines && debug_lines_[index].addr < *funcaddr; index++)
-    continue;
+  LineCursor cursor(this);
+  while (!cursor.done() && cursor.get().addr < *funcaddr)
+    cursor.next();
 
-  if (index >= debug_info_->num_lines)
+  if (cursor.done())
     return false;
 
-  *funcaddr = debug_lines_[index].addr;
+  *funcaddr = cursor.get().addr;
   return true;
 }
 
@@ -865,10 +1551,12 @@ SmxV1Image::LookupLineAddress(const uint32_t line, const char* filename, uint32_
 
   // The filename comparison is strict (case sensitive and path sensitive).
   *addr = 0;
+  if (!ensureDebugInfo())
+    return false;
 
   uint32_t bottomaddr, topaddr;
   uint32_t file;
-  uint32_t index = 0;
+  LineCursor cursor(this);
   for (file = 0; file < debug_info_->num_files; file++) {
     // find the (next) matching instance of the file
     if (debug_files_[file].name >= debug_names_section_->size ||
@@ -882,20 +1570,16 @@ SmxV1Image::LookupLineAddress(const uint32_t line, const char* filename, uint32_
     topaddr = (file + 1 < debug_info_->num_files) ? debug_files_[file + 1].addr : (uint32_t)-1;
 
     // go to the starting address in the line table
-    while (index < debug_info_->num_lines && debug_lines_[index].addr < bottomaddr)
-      index++;
+    while (!cursor.done() && cursor.get().addr < bottomaddr)
+      cursor.next();
 
     // browse until the line is found or until the top address is exceeded
-    while (index < debug_info_->num_lines &&
-           debug_lines_[index].line < line &&
-           debug_lines_[index].addr < topaddr)
-    {
-      index++;
-    }
+    while (!cursor.done() && cursor.get().line < line && cursor.get().addr < topaddr)
+      cursor.next();
 
-    if (index >= debug_info_->num_lines)
+    if (cursor.done())
       return false;
-    if (debug_lines_[index].line >= line)
+    if (cursor.get().line >= line)
       break;
 
     // if not found (and the line table is not yet exceeded) try the next
@@ -904,7 +1588,7 @@ SmxV1Image::LookupLineAddress(const uint32_t line, const char* filename, uint32_
   if (file >= debug_info_->num_files)
     return false;
 
-  assert(index < debug_info_->num_lines);
-  *addr = debug_lines_[index].addr;
+  assert(!cursor.done());
+  *addr = cursor.get().addr;
   return true;
 }
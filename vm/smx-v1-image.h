@@ -11,10 +11,14 @@
 #define _include_sourcepawn_smx_parser_h_
 
 #include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
 #include <smx/smx-headers.h>
 #include <smx/smx-legacy-debuginfo.h>
 #include <smx/smx-typeinfo.h>
 #include <smx/smx-v1.h>
+#include <am-hashmap.h>
 #include <am-string.h>
 #include <am-vector.h>
 #include <sp_vm_types.h>
@@ -28,10 +32,19 @@ class SmxV1Image
     public LegacyImage
 {
  public:
-  SmxV1Image(FILE* fp);
+  explicit SmxV1Image(FILE* fp, bool map_file = false);
 
-  // This must be called to initialize the reader.
-  bool validate();
+  // This must be called to initialize the reader. If |lazy_debug_info| is
+  // true, the debug, RTTI and tag sections are validated the first time
+  // something looks at them instead; if they turn out to be malformed, the
+  // image behaves as if it had no debug information.
+  bool validate(bool lazy_debug_info = false);
+
+  // Where the image was read from. A --split-debug build's debug file is
+  // looked for in the same directory.
+  void setFilePath(const char* path) {
+    path_ = path;
+  }
 
   const sp_file_hdr_t* hdr() const {
     return hdr_;
@@ -47,6 +60,8 @@ class SmxV1Image
   size_t NumNatives() const override;
   const char* GetNative(size_t index) const override;
   bool FindNative(const char* name, size_t* indexp) const override;
+  const uint32_t* NativeOrdinals(uint32_t* manifest) const override;
+  bool GetNativeSignature(size_t index, const uint8_t** bytes, size_t* length) override;
   size_t NumPublics() const override;
   void GetPublic(size_t index, uint32_t* offsetp, const char** namep) const override;
   bool FindPublic(const char* name, size_t* indexp) const override;
@@ -57,11 +72,14 @@ class SmxV1Image
   size_t ImageSize() const override;
   const char* LookupFile(uint32_t code_offset) override;
   const char* LookupFunction(uint32_t code_offset) override;
+  bool LookupFunctionRange(uint32_t code_offset, uint32_t* start, uint32_t* end) override;
   bool LookupLine(uint32_t code_offset, uint32_t* line) override;
   bool LookupFunctionAddress(const char* function, const char* file, ucell_t* addr) override;
   bool LookupLineAddress(const uint32_t line, const char* file, ucell_t* addr) override;
   size_t NumFiles() const override;
   const char* GetFileName(size_t index) const override;
+  size_t NumDebugGlobals() override;
+  void GetDebugGlobal(size_t index, uint32_t* addressp, const char** namep) override;
 
  private:
    struct Section
@@ -155,6 +173,37 @@ class SmxV1Image
     size_t length_;
   };
 
+  // Visits the address-to-line entries in order, from .dbg.linetable if the
+  // file has one, or .dbg.lines. With .dbg.linetable, |start| must be the
+  // first entry of a block.
+  class LineCursor
+  {
+   public:
+    explicit LineCursor(const SmxV1Image* image, size_t start = 0);
+
+    bool done() const {
+      return index_ >= count_;
+    }
+    const sp_fdbg_line_t& get() const {
+      assert(!done());
+      return entry_;
+    }
+    void next();
+
+   private:
+    void enterBlock(size_t block);
+    bool readVarint(uint32_t* value);
+
+   private:
+    const SmxV1Image* image_;
+    size_t index_;
+    size_t count_;
+    sp_fdbg_line_t entry_;
+    // The stream position and end of the current block.
+    const uint8_t* pos_;
+    const uint8_t* end_;
+  };
+
  public:
   const Blob<sp_file_code_t>& code() const {
     return code_;
@@ -185,14 +234,27 @@ class SmxV1Image
   bool validatePublics();
   bool validatePubvars();
   bool validateNatives();
+  bool validateNativeOrdinals();
   bool validateRtti();
   bool validateRttiMethods();
+  bool validateHeader();
   bool validateDebugInfo();
+  bool validateLineTable(SmxV1Image* source, const Section* section);
   bool validateTags();
+  bool validateDebugSections();
+  bool validateNameHash();
+  bool buildNameIndex();
+  bool inflateFromFile(FILE* fp);
+  bool ensureDebugInfo() const;
+  SmxV1Image* loadDebugFile();
+  void buildFunctionIndex();
+  void buildGlobalIndex();
 
  private:
   template <typename SymbolType, typename DimType>
-  const char* lookupFunction(const SymbolType* syms, uint32_t addr);
+  void addDebugFunctions(const SymbolType* syms);
+  template <typename SymbolType, typename DimType>
+  void addDebugGlobals(const SymbolType* syms);
   template <typename SymbolType, typename DimType>
   bool getFunctionAddress(const SymbolType* syms, const char* function, ucell_t* funcaddr, uint32_t& index);
 
@@ -211,6 +273,7 @@ class SmxV1Image
   }
 
  private:
+  bool inflated_;
   sp_file_hdr_t* hdr_;
   std::string error_;
   const char* header_strings_;
@@ -226,17 +289,91 @@ class SmxV1Image
   List<sp_file_pubvars_t> pubvars_;
   List<sp_file_tag_t> tags_;
 
+  // From .natives.ordinals, one per native.
+  const uint32_t* native_ordinals_;
+  uint32_t native_manifest_;
+
   const Section* debug_names_section_;
   const char* debug_names_;
   const sp_fdbg_info_t* debug_info_;
   List<sp_fdbg_file_t> debug_files_;
   List<sp_fdbg_line_t> debug_lines_;
+  const sp_fdbg_linetable_t* line_table_;
+  const sp_fdbg_lineblock_t* line_blocks_;
+  const uint8_t* line_stream_;
+  size_t line_stream_length_;
   const Section* debug_symbols_section_;
   const sp_fdbg_symbol_t* debug_syms_;
   const sp_u_fdbg_symbol_t* debug_syms_unpacked_;
+  // The RTTI globals table, used when there is no .dbg.symbols.
+  const smx_rtti_table_header* debug_globals_;
+
+  // Where the image was read from, and for a --split-debug build, the file
+  // the debug sections above point into once it is loaded.
+  std::string path_;
+  std::unique_ptr<SmxV1Image> debug_file_;
 
   const Section* rtti_data_;
   const smx_rtti_table_header* rtti_methods_;
+  const smx_rtti_table_header* rtti_natives_;
+
+  // Name to index, for natives, publics and pubvars. Keys point into the
+  // .names section. When names repeat, the lowest index wins.
+  struct NameMapPolicy {
+    static inline bool matches(const char* lookup, const char* key) {
+      return strcmp(lookup, key) == 0;
+    }
+    static inline uint32_t hash(const char* key) {
+      return ke::FastHashCharSequence(key, strlen(key));
+    }
+  };
+  typedef ke::HashMap<const char*, size_t, NameMapPolicy> NameMap;
+
+  NameMap native_index_;
+  NameMap public_index_;
+  NameMap pubvar_index_;
+
+  // The native, public and pubvar tables in .names.hash. When the file has
+  // that section, names are looked up there and the maps above stay empty.
+  struct HashedNames {
+    const sp_file_name_hash_entry_t* entries;
+    uint32_t slots;
+  };
+  template <typename T>
+  bool findHashedName(const HashedNames& table, const List<T>& rows, const char* name,
+                      size_t* indexp) const;
+
+  bool has_name_hash_;
+  HashedNames name_hash_[3];
+
+  enum class DebugState {
+    Unchecked,
+    Valid,
+    Invalid
+  };
+  DebugState debug_state_;
+
+  // Code ranges of every function with a name, sorted by start, so
+  // symbolizing a frame is a binary search. Built along with the debug info.
+  struct FunctionRange {
+    uint32_t start;
+    uint32_t end;
+    const char* name;
+
+    bool operator <(const FunctionRange& other) const {
+      return start < other.start;
+    }
+  };
+  std::vector<FunctionRange> function_index_;
+
+  const FunctionRange* findFunction(uint32_t code_offset);
+
+  // Every global in the debug info, in table order.
+  struct GlobalVar {
+    const char* name;
+    uint32_t address;
+  };
+  std::vector<GlobalVar> global_index_;
 };
 
 } // namespace sp
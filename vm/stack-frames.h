@@ -132,6 +132,11 @@ class InterpInvokeFrame final : public InvokeFrame
     return this;
   }
 
+  // The current position in the method's code.
+  const cell_t* cip() const {
+    return cip_;
+  }
+
  private:
   ke::RefPtr<MethodInfo> method_;
   const cell_t* const& cip_;
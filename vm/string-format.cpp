@@ -0,0 +1,377 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <sp_typeutil.h>
+#include "plugin-context.h"
+#include "string-format.h"
+#include "string-utils.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+namespace {
+
+// Copies into a buffer of fixed size, remembering whether anything had to
+// be dropped.
+class FormatWriter
+{
+ public:
+  FormatWriter(char* buffer, size_t maxbytes)
+   : buffer_(buffer),
+     room_(maxbytes ? maxbytes - 1 : 0),
+     pos_(0),
+     terminate_(maxbytes != 0),
+     full_(false)
+  {}
+
+  void append(const char* str, size_t length) {
+    if (length > room_ - pos_) {
+      length = room_ - pos_;
+      full_ = true;
+    }
+    memcpy(buffer_ + pos_, str, length);
+    pos_ += length;
+  }
+  void fill(char c, size_t count) {
+    if (count > room_ - pos_) {
+      count = room_ - pos_;
+      full_ = true;
+    }
+    memset(buffer_ + pos_, c, count);
+    pos_ += count;
+  }
+
+  // Appends |str| padded out to the op's width.
+  void pad(const FormatProgram::Op& op, const char* str, size_t length, bool numeric) {
+    size_t width = op.width > 0 ? size_t(op.width) : 0;
+    size_t padding = width > length ? width - length : 0;
+    if (op.flags & FormatProgram::kLeftJustify) {
+      append(str, length);
+      fill(' ', padding);
+    } else if (numeric && (op.flags & FormatProgram::kZeroPad)) {
+      // Zeroes go after the sign.
+      if (length && *str == '-') {
+        append(str, 1);
+        str++;
+        length--;
+      }
+      fill('0', padding);
+      append(str, length);
+    } else {
+      fill(' ', padding);
+      append(str, length);
+    }
+  }
+
+  // Terminates the output, first cutting off any character that was split.
+  size_t finish() {
+    if (!terminate_)
+      return 0;
+    if (full_)
+      pos_ = Utf8SafeLength(buffer_, pos_);
+    buffer_[pos_] = '\0';
+    return pos_;
+  }
+
+  bool full() const {
+    return full_;
+  }
+
+ private:
+  char* buffer_;
+  size_t room_;
+  size_t pos_;
+  bool terminate_;
+  bool full_;
+};
+
+// Writes |value| backwards from |end|, returning where it starts.
+static char*
+FormatDigits(char* end, uint32_t value, uint32_t base, const char* digits)
+{
+  do {
+    *--end = digits[value % base];
+    value /= base;
+  } while (value);
+  return end;
+}
+
+static size_t
+Utf8SequenceLength(uint8_t lead)
+{
+  if ((lead & 0xE0) == 0xC0)
+    return 2;
+  if ((lead & 0xF0) == 0xE0)
+    return 3;
+  if ((lead & 0xF8) == 0xF0)
+    return 4;
+  return 1;
+}
+
+} // anonymous namespace
+
+FormatCache::FormatCache()
+{
+}
+
+FormatCache::~FormatCache()
+{
+  for (ProgramMap::iterator iter = programs_.iter(); !iter.empty(); iter.next())
+    delete iter->value;
+}
+
+bool
+FormatCache::init()
+{
+  return programs_.init(16);
+}
+
+void
+FormatCache::clear()
+{
+  for (ProgramMap::iterator iter = programs_.iter(); !iter.empty(); iter.next())
+    delete iter->value;
+  programs_.clear();
+}
+
+char*
+FormatCache::scratch(size_t bytes)
+{
+  if (scratch_.size() < bytes)
+    scratch_.resize(bytes);
+  return scratch_.data();
+}
+
+bool
+FormatCache::Parse(const char* fmt, size_t length, FormatProgram* program)
+{
+  program->text.assign(fmt, length);
+  program->ops.clear();
+
+  FormatProgram::Op literal = {};
+  literal.kind = FormatProgram::Literal;
+
+  size_t i = 0;
+  size_t run = 0;
+  auto flush = [&](size_t end) -> void {
+    if (end > run) {
+      literal.offset = uint32_t(run);
+      literal.length = uint32_t(end - run);
+      program->ops.push_back(literal);
+    }
+  };
+
+  while (i < length) {
+    const char* pct = reinterpret_cast<const char*>(memchr(fmt + i, '%', length - i));
+    if (!pct)
+      break;
+    i = pct - fmt;
+    flush(i);
+
+    if (++i >= length)
+      return false;
+    if (fmt[i] == '%') {
+      // The second '%' starts the next literal run.
+      run = i++;
+      continue;
+    }
+
+    FormatProgram::Op op = {};
+    op.precision = -1;
+    for (; i < length; i++) {
+      if (fmt[i] == '-')
+        op.flags |= FormatProgram::kLeftJustify;
+      else if (fmt[i] == '0')
+        op.flags |= FormatProgram::kZeroPad;
+      else
+        break;
+    }
+    for (; i < length && fmt[i] >= '0' && fmt[i] <= '9'; i++)
+      op.width = std::min(op.width * 10 + (fmt[i] - '0'), 0xffff);
+    if (i < length && fmt[i] == '.') {
+      op.precision = 0;
+      for (i++; i < length && fmt[i] >= '0' && fmt[i] <= '9'; i++)
+        op.precision = std::min(op.precision * 10 + (fmt[i] - '0'), 0xffff);
+    }
+    if (i >= length)
+      return false;
+
+    switch (fmt[i]) {
+      case 'd':
+      case 'i':
+        op.kind = FormatProgram::Int;
+        break;
+      case 'u':
+        op.kind = FormatProgram::Unsigned;
+        break;
+      case 'x':
+        op.kind = FormatProgram::Hex;
+        break;
+      case 'X':
+        op.kind = FormatProgram::HexUpper;
+        break;
+      case 'b':
+        op.kind = FormatProgram::Binary;
+        break;
+      case 'f':
+        op.kind = FormatProgram::Float;
+        break;
+      case 's':
+        op.kind = FormatProgram::String;
+        break;
+      case 'c':
+        op.kind = FormatProgram::Char;
+        break;
+      default:
+        return false;
+    }
+    program->ops.push_back(op);
+    run = ++i;
+  }
+  flush(length);
+  return true;
+}
+
+int
+FormatCache::format(PluginContext* cx, cell_t fmt_addr, const cell_t* params, unsigned int arg,
+                    char* buffer, size_t maxbytes, size_t* written)
+{
+  if (written)
+    *written = 0;
+
+  const char* fmt;
+  size_t length;
+  if (int err = cx->LocalToStringView(fmt_addr, &fmt, &length))
+    return err;
+
+  // Only formats in global data stay put long enough to be worth keeping.
+  if (fmt_addr < 0 || size_t(fmt_addr) >= cx->DataSize()) {
+    if (!Parse(fmt, length, &temp_))
+      return SP_ERROR_PARAM;
+    return run(cx, temp_, params, arg, buffer, maxbytes, written);
+  }
+
+  ProgramMap::Insert p = programs_.findForAdd(fmt_addr);
+  if (p.found()) {
+    FormatProgram* program = p->value;
+    if (program->text.size() == length && memcmp(program->text.data(), fmt, length) == 0)
+      return run(cx, *program, params, arg, buffer, maxbytes, written);
+
+    // The plugin rewrote it.
+    if (!Parse(fmt, length, program)) {
+      program->text.clear();
+      program->ops.clear();
+      return SP_ERROR_PARAM;
+    }
+    return run(cx, *program, params, arg, buffer, maxbytes, written);
+  }
+
+  std::unique_ptr<FormatProgram> program = std::make_unique<FormatProgram>();
+  if (!Parse(fmt, length, program.get()))
+    return SP_ERROR_PARAM;
+  if (!programs_.add(p, fmt_addr, program.get()))
+    return run(cx, *program, params, arg, buffer, maxbytes, written);
+  return run(cx, *program.release(), params, arg, buffer, maxbytes, written);
+}
+
+int
+FormatCache::run(PluginContext* cx, const FormatProgram& program, const cell_t* params,
+                 unsigned int arg, char* buffer, size_t maxbytes, size_t* written)
+{
+  static const char kLower[] = "0123456789abcdef";
+  static const char kUpper[] = "0123456789ABCDEF";
+
+  FormatWriter out(buffer, maxbytes);
+  unsigned int num_params = unsigned(params[0]);
+
+  for (const FormatProgram::Op& op : program.ops) {
+    if (out.full())
+      break;
+
+    if (op.kind == FormatProgram::Literal) {
+      out.append(program.text.data() + op.offset, op.length);
+      continue;
+    }
+
+    if (arg > num_params)
+      return SP_ERROR_PARAM;
+    cell_t local_addr = params[arg++];
+
+    if (op.kind == FormatProgram::String || op.kind == FormatProgram::Char) {
+      const char* str;
+      size_t length;
+      if (int err = cx->LocalToStringView(local_addr, &str, &length))
+        return err;
+      if (op.kind == FormatProgram::Char) {
+        if (length)
+          length = std::min(length, Utf8SequenceLength(uint8_t(*str)));
+      } else if (op.precision >= 0 && size_t(op.precision) < length) {
+        length = Utf8SafeLength(str, size_t(op.precision));
+      }
+      out.pad(op, str, length, false);
+      continue;
+    }
+
+    cell_t* addr;
+    if (int err = cx->LocalToPhysAddr(local_addr, &addr))
+      return err;
+    cell_t value = *addr;
+
+    // Large enough for 32 binary digits and a sign, or any float printed
+    // with the largest precision we allow.
+    char digits[128];
+    char* end = digits + sizeof(digits);
+    char* start;
+    switch (op.kind) {
+      case FormatProgram::Int:
+        start = FormatDigits(end, value < 0 ? 0u - uint32_t(value) : uint32_t(value), 10,
+                             kLower);
+        if (value < 0)
+          *--start = '-';
+        break;
+      case FormatProgram::Unsigned:
+        start = FormatDigits(end, uint32_t(value), 10, kLower);
+        break;
+      case FormatProgram::Hex:
+        start = FormatDigits(end, uint32_t(value), 16, kLower);
+        break;
+      case FormatProgram::HexUpper:
+        start = FormatDigits(end, uint32_t(value), 16, kUpper);
+        break;
+      case FormatProgram::Binary:
+        start = FormatDigits(end, uint32_t(value), 2, kLower);
+        break;
+      default:
+      {
+        int precision = op.precision >= 0 ? std::min(op.precision, 64) : 6;
+        int n = snprintf(digits, sizeof(digits), "%.*f", precision, double(sp_ctof(value)));
+        if (n < 0)
+          n = 0;
+        start = digits;
+        end = digits + std::min(size_t(n), sizeof(digits) - 1);
+        break;
+      }
+    }
+    out.pad(op, start, end - start, true);
+  }
+
+  size_t length = out.finish();
+  if (written)
+    *written = length;
+  return SP_ERROR_NONE;
+}
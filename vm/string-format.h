@@ -0,0 +1,111 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_string_format_h_
+#define _include_sourcepawn_vm_string_format_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <sp_vm_types.h>
+#include <am-hashmap.h>
+
+namespace sp {
+
+class PluginContext;
+
+// A format string, parsed into the literal runs and specifiers it contains.
+struct FormatProgram
+{
+  enum Kind : uint8_t {
+    Literal,
+    Int,
+    Unsigned,
+    Hex,
+    HexUpper,
+    Binary,
+    Float,
+    String,
+    Char
+  };
+
+  static const uint8_t kLeftJustify = 0x1;
+  static const uint8_t kZeroPad = 0x2;
+
+  struct Op {
+    Kind kind;
+    uint8_t flags;
+    // Minimum width, and for strings and floats, the precision, or -1.
+    int32_t width;
+    int32_t precision;
+    // For literals, where the run is in |text|.
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  std::string text;
+  std::vector<Op> ops;
+};
+
+// Formats strings the way hosts' Format natives do, with arguments passed
+// by reference from plugin memory. Formats that live in a plugin's global
+// data are parsed once and cached by address. Global data can be written,
+// so a cached format is only used while it still matches the plugin's
+// copy; comparing the bytes is still much cheaper than parsing them again.
+class FormatCache
+{
+ public:
+  FormatCache();
+  ~FormatCache();
+
+  bool init();
+  // Forgets every parsed format, for when the data they came from changes.
+  void clear();
+
+  // Formats |fmt_addr| with the arguments in |params| from |arg| onward,
+  // into |buffer|. The output is cut at a character boundary if it does
+  // not fit, and always terminated if |maxbytes| is non-zero.
+  int format(PluginContext* cx, cell_t fmt_addr, const cell_t* params, unsigned int arg,
+             char* buffer, size_t maxbytes, size_t* written);
+
+  // Space for formatting output that is copied into plugin memory after,
+  // since the destination may also be an argument.
+  char* scratch(size_t bytes);
+
+ private:
+  static bool Parse(const char* fmt, size_t length, FormatProgram* program);
+  int run(PluginContext* cx, const FormatProgram& program, const cell_t* params,
+          unsigned int arg, char* buffer, size_t maxbytes, size_t* written);
+
+ private:
+  struct Policy {
+    static inline uint32_t hash(cell_t value) {
+      return ke::HashInteger<4>(value);
+    }
+    static inline bool matches(cell_t a, cell_t b) {
+      return a == b;
+    }
+  };
+  typedef ke::HashMap<cell_t, FormatProgram*, Policy> ProgramMap;
+
+  ProgramMap programs_;
+  // Formats from the stack or heap are parsed into this each time.
+  FormatProgram temp_;
+  std::vector<char> scratch_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_string_format_h_
@@ -0,0 +1,114 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_string_utils_h_
+#define _include_sourcepawn_vm_string_utils_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define SP_HAS_SSE2_STRINGS
+# include <emmintrin.h>
+#endif
+
+// Reading a whole aligned block past the end of a string never faults, but
+// the address sanitizer can't know that.
+#if defined(__SANITIZE_ADDRESS__)
+# undef SP_HAS_SSE2_STRINGS
+#elif defined(__has_feature)
+# if __has_feature(address_sanitizer)
+#  undef SP_HAS_SSE2_STRINGS
+# endif
+#endif
+
+namespace sp {
+
+// Returns the length of |str|, scanning at most |max| bytes. Returns |max|
+// if there is no terminator within them.
+static inline size_t
+BoundedStrLen(const char* str, size_t max)
+{
+  if (!max)
+    return 0;
+
+#if defined(SP_HAS_SSE2_STRINGS)
+  // Compare aligned 16-byte blocks, so no load crosses into a page that the
+  // string doesn't touch. Bytes before |str| in the first block are masked.
+  const __m128i zero = _mm_setzero_si128();
+  uintptr_t misalign = uintptr_t(str) & 15;
+  const char* block = str - misalign;
+  uint32_t mask = uint32_t(_mm_movemask_epi8(
+    _mm_cmpeq_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(block)), zero)));
+  mask >>= misalign;
+
+  size_t offset = 0;
+  size_t chunk = 16 - misalign;
+  for (;;) {
+    if (mask) {
+      size_t length = offset;
+      while (!(mask & 1)) {
+        mask >>= 1;
+        length++;
+      }
+      return length < max ? length : max;
+    }
+    offset += chunk;
+    if (offset >= max)
+      return max;
+    block += 16;
+    chunk = 16;
+    mask = uint32_t(_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(block)), zero)));
+  }
+#else
+  // memchr is vectorized by every libc worth using.
+  const void* end = memchr(str, '\0', max);
+  return end ? size_t(reinterpret_cast<const char*>(end) - str) : max;
+#endif
+}
+
+// Returns the largest length <= |length| at which |str| can be cut without
+// splitting a UTF-8 sequence. Only the last sequence can be cut short, so at
+// most three bytes are examined.
+static inline size_t
+Utf8SafeLength(const char* str, size_t length)
+{
+  if (!length || !(str[length - 1] & 0x80))
+    return length;
+
+  // Walk back over continuation bytes to the lead byte.
+  size_t count = 1;
+  size_t lead = length - 1;
+  while (lead > 0 && count < 4 && (uint8_t(str[lead]) & 0xC0) == 0x80) {
+    lead--;
+    count++;
+  }
+
+  size_t expected;
+  uint8_t c = uint8_t(str[lead]);
+  if ((c & 0xE0) == 0xC0)
+    expected = 2;
+  else if ((c & 0xF0) == 0xE0)
+    expected = 3;
+  else if ((c & 0xF8) == 0xF0)
+    expected = 4;
+  else
+    return length;  // Not valid UTF-8; leave it as it is.
+
+  return expected == count ? length : lead;
+}
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_string_utils_h_
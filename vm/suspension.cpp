@@ -0,0 +1,337 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+// ucontext is only declared for XSI programs on macOS.
+# define _XOPEN_SOURCE 600
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include <amtl/am-platform.h>
+#if defined(KE_WINDOWS)
+# include <windows.h>
+# define SP_HAS_NATIVE_STACKS
+#elif !defined(__EMSCRIPTEN__)
+# include <ucontext.h>
+# define SP_HAS_NATIVE_STACKS
+#endif
+
+#include "plugin-context.h"
+#include "scripted-invoker.h"
+#include "stack-frames.h"
+#include "suspension.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+// Room for the interpreter's recursion and the natives it calls. Pages are
+// only committed as they are touched.
+static const size_t kStackSize = 1024 * 1024;
+
+// The invocation whose stack is current, if any.
+static Suspension* sRunning = nullptr;
+
+#if defined(KE_WINDOWS)
+struct sp::NativeStack
+{
+  NativeStack()
+   : fiber(nullptr),
+     host(nullptr)
+  {}
+  ~NativeStack() {
+    if (fiber)
+      DeleteFiber(fiber);
+  }
+
+  bool init() {
+    fiber = CreateFiber(kStackSize, Main, nullptr);
+    return !!fiber;
+  }
+  // The host's thread has to be a fiber to switch away from it. It stays
+  // one afterward, which is harmless.
+  void enter() {
+    host = IsThreadAFiber() ? GetCurrentFiber() : ConvertThreadToFiber(nullptr);
+    SwitchToFiber(fiber);
+  }
+  void leave() {
+    SwitchToFiber(host);
+  }
+
+  static void WINAPI Main(void*) {
+    Suspension::Start();
+  }
+
+  void* fiber;
+  void* host;
+};
+#elif defined(SP_HAS_NATIVE_STACKS)
+struct sp::NativeStack
+{
+  bool init() {
+    // Not value-initialized, so the pages aren't touched yet.
+    memory.reset(new uint8_t[kStackSize]);
+    if (getcontext(&context) != 0)
+      return false;
+    context.uc_stack.ss_sp = memory.get();
+    context.uc_stack.ss_size = kStackSize;
+    context.uc_link = nullptr;
+    makecontext(&context, Main, 0);
+    return true;
+  }
+  void enter() {
+    swapcontext(&host, &context);
+  }
+  void leave() {
+    swapcontext(&context, &host);
+  }
+
+  static void Main() {
+    Suspension::Start();
+  }
+
+  std::unique_ptr<uint8_t[]> memory;
+  ucontext_t context;
+  ucontext_t host;
+};
+#else
+struct sp::NativeStack
+{
+};
+#endif
+
+Suspension::Suspension(ScriptedInvoker* fn)
+ : fn_(fn),
+   cx_(fn->context()),
+   stack_(new NativeStack()),
+   entry_sp_(cx_->sp()),
+   entry_hp_(cx_->hp()),
+   entry_frm_(cx_->frm()),
+   entry_tracker_depth_(*cx_->addressOfTrackerDepth()),
+   sp_(0),
+   hp_(0),
+   frm_(0),
+   tracker_depth_(0),
+   callback_(nullptr),
+   callback_data_(nullptr),
+   resume_value_(0),
+   resume_error_(SP_ERROR_NONE),
+   finished_(false),
+   ok_(false),
+   result_(0),
+   error_code_(SP_ERROR_NONE)
+{
+}
+
+Suspension::~Suspension()
+{
+  // Throwing away a stack that is still in use would skip the destructors
+  // of everything on it.
+  assert(finished_);
+}
+
+bool
+Suspension::Invoke(ScriptedInvoker* fn, cell_t* result, ISuspendedInvocation** suspended)
+{
+  *suspended = nullptr;
+
+#if defined(SP_HAS_NATIVE_STACKS)
+  if (!Environment::get()->top()) {
+    std::unique_ptr<Suspension> self(new Suspension(fn));
+    if (self->stack_->init()) {
+      self->enter();
+      if (self->finished_)
+        return self->finish(result);
+      *suspended = self.release();
+      return true;
+    }
+  }
+#endif
+
+  return fn->Invoke(result);
+}
+
+void
+Suspension::Start()
+{
+  sRunning->run();
+}
+
+void
+Suspension::run()
+{
+  {
+    ExceptionHandler eh(cx_);
+    ok_ = fn_->Invoke(&result_);
+    if (!ok_ && eh.HasException()) {
+      error_code_ = Environment::get()->getPendingExceptionCode();
+      error_message_ = eh.Message();
+    }
+  }
+  finished_ = true;
+
+  // Nothing switches back to a finished invocation.
+  leave();
+}
+
+bool
+Suspension::enter()
+{
+  Environment* env = Environment::get();
+  assert(!sRunning && !env->top());
+
+  sRunning = this;
+  env->swapStackState(&state_);
+  stack_->enter();
+  env->swapStackState(&state_);
+  sRunning = nullptr;
+
+  if (!finished_ && callback_) {
+    SPVM_SUSPEND_FUNC callback = callback_;
+    callback_ = nullptr;
+    callback(this, callback_data_);
+  }
+  return finished_;
+}
+
+void
+Suspension::leave()
+{
+#if defined(SP_HAS_NATIVE_STACKS)
+  stack_->leave();
+#endif
+}
+
+bool
+Suspension::finish(cell_t* result)
+{
+  assert(finished_);
+  if (!ok_) {
+    Environment::get()->setPendingException(error_code_ ? error_code_ : SP_ERROR_ABORTED,
+                                            error_message_.c_str());
+    return false;
+  }
+  if (result)
+    *result = result_;
+  return true;
+}
+
+bool
+Suspension::Suspend(PluginContext* cx, SPVM_SUSPEND_FUNC callback, void* data, cell_t* value)
+{
+  Suspension* self = sRunning;
+  if (!self || self->cx_ != cx) {
+    cx->ReportError("This invocation can't be suspended");
+    return false;
+  }
+
+  // Only this plugin's memory is set aside, so that is all that can be in use.
+  for (InvokeFrame* frame = Environment::get()->top(); frame; frame = frame->prev()) {
+    if (frame->cx() != cx) {
+      cx->ReportError("An invocation can't be suspended while it calls into another plugin");
+      return false;
+    }
+  }
+
+  self->callback_ = callback;
+  self->callback_data_ = data;
+  self->saveMemory();
+  self->leave();
+
+  // Resumed. The host has already put this invocation's memory back.
+  if (self->resume_error_ != SP_ERROR_NONE) {
+    cx->ReportErrorNumber(self->resume_error_);
+    return false;
+  }
+  *value = self->resume_value_;
+  return true;
+}
+
+bool
+Suspension::canResume() const
+{
+  return !Environment::get()->top() && cx_->sp() == entry_sp_ && cx_->hp() == entry_hp_;
+}
+
+bool
+Suspension::Resume(cell_t value, cell_t* result, ISuspendedInvocation** suspended)
+{
+  *suspended = this;
+  if (!canResume()) {
+    Environment::get()->ReportErrorFmt(SP_ERROR_NOT_RUNNABLE,
+                                       "Can't resume an invocation while the VM is running");
+    return false;
+  }
+
+  resume_value_ = value;
+  resume_error_ = SP_ERROR_NONE;
+  restoreMemory();
+  if (!enter())
+    return true;
+
+  *suspended = nullptr;
+  bool ok = finish(result);
+  delete this;
+  return ok;
+}
+
+bool
+Suspension::Abort()
+{
+  if (!canResume())
+    return false;
+
+  resume_value_ = 0;
+  resume_error_ = SP_ERROR_ABORTED;
+  restoreMemory();
+  enter();
+
+  // Nothing runs with an error pending, so it can't be suspended again.
+  assert(finished_);
+  delete this;
+  return true;
+}
+
+void
+Suspension::saveMemory()
+{
+  const uint8_t* memory = cx_->memory();
+  sp_ = cx_->sp();
+  hp_ = cx_->hp();
+  frm_ = cx_->frm();
+  tracker_depth_ = *cx_->addressOfTrackerDepth();
+  saved_stack_.assign(memory + sp_, memory + entry_sp_);
+  saved_heap_.assign(memory + entry_hp_, memory + hp_);
+
+  *cx_->addressOfSp() = entry_sp_;
+  *cx_->addressOfHp() = entry_hp_;
+  *cx_->addressOfFrm() = entry_frm_;
+  *cx_->addressOfTrackerDepth() = entry_tracker_depth_;
+}
+
+void
+Suspension::restoreMemory()
+{
+  uint8_t* memory = cx_->memory();
+  std::copy(saved_stack_.begin(), saved_stack_.end(), memory + sp_);
+  std::copy(saved_heap_.begin(), saved_heap_.end(), memory + entry_hp_);
+  saved_stack_.clear();
+  saved_heap_.clear();
+
+  *cx_->addressOfSp() = sp_;
+  *cx_->addressOfHp() = hp_;
+  *cx_->addressOfFrm() = frm_;
+  *cx_->addressOfTrackerDepth() = tracker_depth_;
+}
@@ -0,0 +1,118 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_suspension_h_
+#define _include_sourcepawn_vm_suspension_h_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sp_vm_api.h>
+#include "environment.h"
+
+namespace sp {
+
+class PluginContext;
+class ScriptedInvoker;
+struct NativeStack;
+
+// An invocation started with IPluginFunction::InvokeSuspendable. It runs on
+// a native stack of its own, so suspending it is a switch back to the host's
+// stack: the interpreter, compiled code and natives in between stay where
+// they are, and carry on when the stack is switched back to.
+//
+// The plugin's memory can't stay that way, since other invocations of the
+// same plugin should be able to run while this one is suspended. Instead,
+// the stack and heap it has used since it started are copied out, and the
+// context is put back the way it was at entry. That only works because the
+// invocation starts, and resumes, with nothing else running: both times, the
+// context is in the same, idle, state, so its memory goes back to the same
+// addresses.
+class Suspension final : public SourcePawn::ISuspendedInvocation
+{
+ public:
+  ~Suspension();
+
+  static bool Invoke(ScriptedInvoker* fn, cell_t* result,
+                     SourcePawn::ISuspendedInvocation** suspended);
+
+  // Called by a native, through IPluginContext::SuspendInvocation.
+  static bool Suspend(PluginContext* cx, SPVM_SUSPEND_FUNC callback, void* data,
+                      cell_t* value);
+
+  bool Resume(cell_t value, cell_t* result, SourcePawn::ISuspendedInvocation** suspended) override;
+  bool Abort() override;
+
+ private:
+  explicit Suspension(ScriptedInvoker* fn);
+
+  // Runs on the invocation's stack.
+  void run();
+
+  // Switch to the invocation's stack, and back. enter() returns whether the
+  // invocation finished.
+  bool enter();
+  void leave();
+
+  bool canResume() const;
+  void saveMemory();
+  void restoreMemory();
+
+  // Hands the results of a finished invocation to the host.
+  bool finish(cell_t* result);
+
+  static void Start();
+  friend struct NativeStack;
+
+ private:
+  ScriptedInvoker* fn_;
+  PluginContext* cx_;
+  std::unique_ptr<NativeStack> stack_;
+
+  // The host's state while the invocation runs, and vice versa.
+  Environment::StackState state_;
+
+  // The context's registers at entry, which are restored while suspended.
+  cell_t entry_sp_;
+  cell_t entry_hp_;
+  cell_t entry_frm_;
+  uint32_t entry_tracker_depth_;
+
+  // The context's registers and memory while suspended.
+  cell_t sp_;
+  cell_t hp_;
+  cell_t frm_;
+  uint32_t tracker_depth_;
+  std::vector<uint8_t> saved_stack_;
+  std::vector<uint8_t> saved_heap_;
+
+  SPVM_SUSPEND_FUNC callback_;
+  void* callback_data_;
+
+  // What the invocation is resumed with.
+  cell_t resume_value_;
+  int resume_error_;
+
+  // Set once the invocation has returned.
+  bool finished_;
+  bool ok_;
+  cell_t result_;
+  int error_code_;
+  std::string error_message_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_suspension_h_
@@ -0,0 +1,640 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "threaded-code.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <amtl/am-bits.h>
+#include "opcodes.h"
+#include "pcode-visitor.h"
+#include "pcode-reader.h"
+#include "method-info.h"
+#include "plugin-runtime.h"
+
+namespace sp {
+
+ThreadedCode::ThreadedCode(uint32_t start, uint32_t end)
+ : start_(start),
+   end_(end),
+   index_((end - start) / sizeof(cell_t), UINT32_MAX),
+   linked_(false)
+{
+}
+
+const ThreadedInsn*
+ThreadedCode::at(cell_t offset) const
+{
+  if (offset < cell_t(start_) || offset >= cell_t(end_))
+    return nullptr;
+  uint32_t index = index_[(offset - start_) / sizeof(cell_t)];
+  if (index == UINT32_MAX)
+    return nullptr;
+  return &insns_[index];
+}
+
+void
+ThreadedCode::link(const void* const* handlers)
+{
+  for (ThreadedInsn& insn : insns_)
+    insn.handler = handlers[size_t(insn.op)];
+  linked_ = true;
+}
+
+// Records each visitor callback as one ThreadedInsn. PcodeReader already
+// expands fused and replaced opcodes into visitor calls, so nothing here
+// depends on the encoding.
+class ThreadedCodeBuilder final : public PcodeVisitor
+{
+ public:
+  explicit ThreadedCodeBuilder(ThreadedCode* code)
+   : code_(code)
+  {}
+
+  bool build(PluginRuntime* rt);
+  void fuse();
+
+  bool visitBREAK() override {
+    return emit(ThreadedOp::BREAK);
+  }
+  bool visitLOAD(PawnReg dest, cell_t srcaddr) override {
+    return emit(ThreadedOp::LOAD, srcaddr, reg(dest));
+  }
+  bool visitLOAD_S(PawnReg dest, cell_t srcoffs) override {
+    return emit(ThreadedOp::LOAD_S, srcoffs, reg(dest));
+  }
+  bool visitLREF_S(PawnReg dest, cell_t srcoffs) override {
+    return emit(ThreadedOp::LREF_S, srcoffs, reg(dest));
+  }
+  bool visitLOAD_I() override {
+    return emit(ThreadedOp::LOAD_I);
+  }
+  bool visitLODB_I(cell_t width) override {
+    return emit(ThreadedOp::LODB_I, width);
+  }
+  bool visitCONST(PawnReg dest, cell_t imm) override {
+    return emit(ThreadedOp::CONST, imm, reg(dest));
+  }
+  bool visitADDR(PawnReg dest, cell_t offset) override {
+    return emit(ThreadedOp::ADDR, offset, reg(dest));
+  }
+  bool visitSTOR(cell_t address, PawnReg src) override {
+    return emit(ThreadedOp::STOR, address, reg(src));
+  }
+  bool visitSTOR_S(cell_t offset, PawnReg src) override {
+    return emit(ThreadedOp::STOR_S, offset, reg(src));
+  }
+  bool visitSREF_S(cell_t offset, PawnReg src) override {
+    return emit(ThreadedOp::SREF_S, offset, reg(src));
+  }
+  bool visitSTOR_I() override {
+    return emit(ThreadedOp::STOR_I);
+  }
+  bool visitSTRB_I(cell_t width) override {
+    return emit(ThreadedOp::STRB_I, width);
+  }
+  bool visitLIDX() override {
+    return emit(ThreadedOp::LIDX);
+  }
+  bool visitIDXADDR() override {
+    return emit(ThreadedOp::IDXADDR);
+  }
+  bool visitMOVE(PawnReg reg) override {
+    return emit(ThreadedOp::MOVE, 0, this->reg(reg));
+  }
+  bool visitXCHG() override {
+    return emit(ThreadedOp::XCHG);
+  }
+  bool visitPUSH(PawnReg src) override {
+    return emit(ThreadedOp::PUSH_REG, 0, reg(src));
+  }
+  bool visitPUSH_C(const cell_t* vals, size_t nvals) override {
+    return emitCells(ThreadedOp::PUSH_C, vals, nvals);
+  }
+  bool visitPUSH(const cell_t* addresses, size_t nvals) override {
+    return emitCells(ThreadedOp::PUSH, addresses, nvals);
+  }
+  bool visitPUSH_S(const cell_t* offsets, size_t nvals) override {
+    return emitCells(ThreadedOp::PUSH_S, offsets, nvals);
+  }
+  bool visitPOP(PawnReg dest) override {
+    return emit(ThreadedOp::POP, 0, reg(dest));
+  }
+  bool visitSTACK(cell_t amount) override {
+    return emit(ThreadedOp::STACK, amount);
+  }
+  bool visitHEAP(cell_t amount) override {
+    return emit(ThreadedOp::HEAP, amount);
+  }
+  bool visitRETN() override {
+    return emit(ThreadedOp::RETN);
+  }
+  bool visitCALL(cell_t offset) override {
+    return emit(ThreadedOp::CALL, offset);
+  }
+  bool visitJUMP(cell_t offset) override {
+    return emitJump(ThreadedOp::JUMP, offset);
+  }
+  bool visitJcmp(CompareOp op, cell_t offset) override {
+    switch (op) {
+      case CompareOp::Zero:
+        return emitJump(ThreadedOp::JZER, offset);
+      case CompareOp::NotZero:
+        return emitJump(ThreadedOp::JNZ, offset);
+      case CompareOp::Eq:
+        return emitJump(ThreadedOp::JEQ, offset);
+      case CompareOp::Neq:
+        return emitJump(ThreadedOp::JNEQ, offset);
+      case CompareOp::Sless:
+        return emitJump(ThreadedOp::JSLESS, offset);
+      case CompareOp::Sleq:
+        return emitJump(ThreadedOp::JSLEQ, offset);
+      case CompareOp::Sgrtr:
+        return emitJump(ThreadedOp::JSGRTR, offset);
+      case CompareOp::Sgeq:
+        return emitJump(ThreadedOp::JSGEQ, offset);
+      default:
+        return false;
+    }
+  }
+  bool visitSHL() override {
+    return emit(ThreadedOp::SHL);
+  }
+  bool visitSHR() override {
+    return emit(ThreadedOp::SHR);
+  }
+  bool visitSSHR() override {
+    return emit(ThreadedOp::SSHR);
+  }
+  bool visitSHL_C(PawnReg dest, cell_t amount) override {
+    return emit(ThreadedOp::SHL_C, amount, reg(dest));
+  }
+  bool visitSMUL() override {
+    return emit(ThreadedOp::SMUL);
+  }
+  bool visitSDIV(PawnReg dest) override {
+    return emit(ThreadedOp::SDIV, 0, reg(dest));
+  }
+  bool visitADD() override {
+    return emit(ThreadedOp::ADD);
+  }
+  bool visitSUB() override {
+    return emit(ThreadedOp::SUB);
+  }
+  bool visitSUB_ALT() override {
+    return emit(ThreadedOp::SUB_ALT);
+  }
+  bool visitAND() override {
+    return emit(ThreadedOp::AND);
+  }
+  bool visitOR() override {
+    return emit(ThreadedOp::OR);
+  }
+  bool visitXOR() override {
+    return emit(ThreadedOp::XOR);
+  }
+  bool visitNOT() override {
+    return emit(ThreadedOp::NOT);
+  }
+  bool visitNEG() override {
+    return emit(ThreadedOp::NEG);
+  }
+  bool visitINVERT() override {
+    return emit(ThreadedOp::INVERT);
+  }
+  bool visitADD_C(cell_t value) override {
+    return emit(ThreadedOp::ADD_C, value);
+  }
+  bool visitSMUL_C(cell_t value) override {
+    return emit(ThreadedOp::SMUL_C, value);
+  }
+  bool visitZERO(PawnReg dest) override {
+    return emit(ThreadedOp::ZERO_REG, 0, reg(dest));
+  }
+  bool visitZERO(cell_t address) override {
+    return emit(ThreadedOp::ZERO, address);
+  }
+  bool visitZERO_S(cell_t offset) override {
+    return emit(ThreadedOp::ZERO_S, offset);
+  }
+  bool visitCompareOp(CompareOp op) override {
+    return emit(ThreadedOp::COMPARE, cell_t(op));
+  }
+  bool visitEQ_C(PawnReg src, cell_t value) override {
+    return emit(ThreadedOp::EQ_C, value, reg(src));
+  }
+  bool visitINC(PawnReg dest) override {
+    return emit(ThreadedOp::INC_REG, 0, reg(dest));
+  }
+  bool visitINC(cell_t address) override {
+    return emit(ThreadedOp::INC, address);
+  }
+  bool visitINC_S(cell_t offset) override {
+    return emit(ThreadedOp::INC_S, offset);
+  }
+  bool visitINC_I() override {
+    return emit(ThreadedOp::INC_I);
+  }
+  bool visitDEC(PawnReg dest) override {
+    return emit(ThreadedOp::DEC_REG, 0, reg(dest));
+  }
+  bool visitDEC(cell_t address) override {
+    return emit(ThreadedOp::DEC, address);
+  }
+  bool visitDEC_S(cell_t offset) override {
+    return emit(ThreadedOp::DEC_S, offset);
+  }
+  bool visitDEC_I() override {
+    return emit(ThreadedOp::DEC_I);
+  }
+  bool visitMOVS(uint32_t amount) override {
+    return emit(ThreadedOp::MOVS, cell_t(amount));
+  }
+  bool visitFILL(uint32_t amount) override {
+    return emit(ThreadedOp::FILL, cell_t(amount));
+  }
+  bool visitBOUNDS(uint32_t limit) override {
+    return emit(ThreadedOp::BOUNDS, cell_t(limit));
+  }
+  bool visitSYSREQ_C(uint32_t native_index) override {
+    return emit(ThreadedOp::SYSREQ_C, cell_t(native_index));
+  }
+  bool visitSWAP(PawnReg dest) override {
+    return emit(ThreadedOp::SWAP, 0, reg(dest));
+  }
+  bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override {
+    return emitCells(ThreadedOp::PUSH_ADR, offsets, nvals);
+  }
+  bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override {
+    return emit(ThreadedOp::SYSREQ_N, cell_t(native_index), cell_t(nparams));
+  }
+  bool visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt) override {
+    return emit(ThreadedOp::LOAD_BOTH, addressForPri, addressForAlt);
+  }
+  bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override {
+    return emit(ThreadedOp::LOAD_S_BOTH, offsetForPri, offsetForAlt);
+  }
+  bool visitCONST(cell_t address, cell_t value) override {
+    return emit(ThreadedOp::CONST_ADDR, address, value);
+  }
+  bool visitCONST_S(cell_t offset, cell_t value) override {
+    return emit(ThreadedOp::CONST_S, offset, value);
+  }
+  bool visitTRACKER_PUSH_C(cell_t amount) override {
+    return emit(ThreadedOp::TRACKER_PUSH_C, amount);
+  }
+  bool visitTRACKER_POP_SETHEAP() override {
+    return emit(ThreadedOp::TRACKER_POP_SETHEAP);
+  }
+  bool visitGENARRAY(uint32_t dims, bool autozero) override {
+    return emit(ThreadedOp::GENARRAY, cell_t(dims), autozero ? 1 : 0);
+  }
+  bool visitSTRADJUST_PRI() override {
+    return emit(ThreadedOp::STRADJUST_PRI);
+  }
+  bool visitFABS() override {
+    return emit(ThreadedOp::FABS);
+  }
+  bool visitFLOAT() override {
+    return emit(ThreadedOp::FLOAT);
+  }
+  bool visitFLOATADD() override {
+    return emit(ThreadedOp::FLOATADD);
+  }
+  bool visitFLOATSUB() override {
+    return emit(ThreadedOp::FLOATSUB);
+  }
+  bool visitFLOATMUL() override {
+    return emit(ThreadedOp::FLOATMUL);
+  }
+  bool visitFLOATDIV() override {
+    return emit(ThreadedOp::FLOATDIV);
+  }
+  bool visitRND_TO_NEAREST() override {
+    return emit(ThreadedOp::RND_TO_NEAREST);
+  }
+  bool visitRND_TO_FLOOR() override {
+    return emit(ThreadedOp::RND_TO_FLOOR);
+  }
+  bool visitRND_TO_CEIL() override {
+    return emit(ThreadedOp::RND_TO_CEIL);
+  }
+  bool visitRND_TO_ZERO() override {
+    return emit(ThreadedOp::RND_TO_ZERO);
+  }
+  bool visitFLOATCMP() override {
+    return emit(ThreadedOp::FLOATCMP);
+  }
+  bool visitFLOAT_CMP_OP(CompareOp op) override {
+    return emit(ThreadedOp::FLOAT_CMP_OP, cell_t(op));
+  }
+  bool visitFLOAT_NOT() override {
+    return emit(ThreadedOp::FLOAT_NOT);
+  }
+  bool visitHALT(cell_t value) override {
+    return emit(ThreadedOp::HALT, value);
+  }
+  bool visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases) override {
+    switches_.push_back(code_->insns_.size());
+    ThreadedInsn& insn = append(ThreadedOp::SWITCH, cell_t(ncases), defaultOffset);
+    insn.ptr = reinterpret_cast<const cell_t*>(cases);
+    return true;
+  }
+  bool visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size) override {
+    ThreadedInsn& insn = append(ThreadedOp::REBASE, addr, iv_size);
+    insn.c = data_size;
+    return true;
+  }
+  bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    ThreadedInsn& insn = append(ThreadedOp::LIDX_S_BOUNDS, array, index);
+    insn.c = cell_t(limit);
+    return true;
+  }
+  bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override {
+    ThreadedInsn& insn = append(ThreadedOp::IDXADDR_S_BOUNDS, array, index);
+    insn.c = cell_t(limit);
+    return true;
+  }
+
+ private:
+  static cell_t reg(PawnReg reg) {
+    return cell_t(reg);
+  }
+
+  ThreadedInsn& append(ThreadedOp op, cell_t a = 0, cell_t b = 0) {
+    ThreadedInsn insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.op = op;
+    insn.a = a;
+    insn.b = b;
+    code_->insns_.push_back(insn);
+    return code_->insns_.back();
+  }
+  bool emit(ThreadedOp op, cell_t a = 0, cell_t b = 0) {
+    append(op, a, b);
+    return true;
+  }
+  bool emitCells(ThreadedOp op, const cell_t* cells, size_t ncells) {
+    ThreadedInsn& insn = append(op, cell_t(ncells));
+    insn.ptr = cells;
+    return true;
+  }
+  bool emitJump(ThreadedOp op, cell_t offset) {
+    // The target is resolved once every instruction has been decoded.
+    jumps_.push_back(code_->insns_.size());
+    return emit(op, offset);
+  }
+
+ private:
+  bool buildSwitch(ThreadedInsn* insn, ThreadedSwitch* table);
+
+ private:
+  ThreadedCode* code_;
+  std::vector<size_t> jumps_;
+  std::vector<size_t> switches_;
+};
+
+bool
+ThreadedCodeBuilder::build(PluginRuntime* rt)
+{
+  PcodeReader<ThreadedCodeBuilder> reader(rt, code_->start_, this);
+  reader.begin();
+
+  // Decode up to the next method, as the interpreter would run.
+  while (reader.more()) {
+    OPCODE op = reader.peekOpcode();
+    if (op == OP_PROC || op == OP_ENDPROC)
+      break;
+
+    cell_t offset = reader.cip_offset();
+    if (offset >= cell_t(code_->end_))
+      return false;
+    code_->index_[(offset - code_->start_) / sizeof(cell_t)] = uint32_t(code_->insns_.size());
+
+    size_t first = code_->insns_.size();
+    if (!reader.visitNext())
+      return false;
+    for (size_t i = first; i < code_->insns_.size(); i++)
+      code_->insns_[i].cip = reader.cip();
+  }
+
+  // Falling off the end just stops the interpreter.
+  ThreadedInsn& end = append(ThreadedOp::END);
+  end.cip = reader.cip();
+
+  // The vector is final, so targets can point into it now.
+  for (size_t index : jumps_) {
+    ThreadedInsn& insn = code_->insns_[index];
+    const ThreadedInsn* target = code_->at(insn.a);
+    if (!target)
+      return false;
+    insn.target = target;
+  }
+
+  // Tables are referenced by pointer, so size the vector up front.
+  code_->switches_.resize(switches_.size());
+  for (size_t i = 0; i < switches_.size(); i++) {
+    ThreadedInsn* insn = &code_->insns_[switches_[i]];
+    if (!buildSwitch(insn, &code_->switches_[i]))
+      return false;
+    insn->table = &code_->switches_[i];
+  }
+  return true;
+}
+
+bool
+ThreadedCodeBuilder::buildSwitch(ThreadedInsn* insn, ThreadedSwitch* table)
+{
+  const CaseTableEntry* cases = reinterpret_cast<const CaseTableEntry*>(insn->ptr);
+  size_t ncases = size_t(insn->a);
+
+  table->low = 0;
+  table->default_target = code_->at(insn->b);
+  if (!table->default_target)
+    return false;
+
+  // Keep the first entry for any duplicated value, as a scan would.
+  std::vector<size_t> order(ncases);
+  for (size_t i = 0; i < ncases; i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [cases](size_t a, size_t b) -> bool {
+    return cases[a].value < cases[b].value;
+  });
+  order.erase(std::unique(order.begin(), order.end(), [cases](size_t a, size_t b) -> bool {
+    return cases[a].value == cases[b].value;
+  }), order.end());
+
+  if (order.size() <= ThreadedSwitch::kMaxLinearCases) {
+    table->kind = ThreadedSwitch::Kind::Linear;
+    for (size_t i = 0; i < ncases; i++) {
+      const ThreadedInsn* target = code_->at(cases[i].address);
+      if (!target)
+        return false;
+      table->values.push_back(cases[i].value);
+      table->targets.push_back(target);
+    }
+    return true;
+  }
+
+  // Use a jump table if at least half of it would be real cases.
+  int64_t low = cases[order.front()].value;
+  int64_t high = cases[order.back()].value;
+  if (high - low + 1 <= int64_t(order.size()) * 2) {
+    table->kind = ThreadedSwitch::Kind::Dense;
+    table->low = cell_t(low);
+    table->targets.resize(size_t(high - low + 1), table->default_target);
+    for (size_t index : order) {
+      const ThreadedInsn* target = code_->at(cases[index].address);
+      if (!target)
+        return false;
+      table->targets[size_t(cases[index].value - low)] = target;
+    }
+    return true;
+  }
+
+  table->kind = ThreadedSwitch::Kind::Sorted;
+  for (size_t index : order) {
+    const ThreadedInsn* target = code_->at(cases[index].address);
+    if (!target)
+      return false;
+    table->values.push_back(cases[index].value);
+    table->targets.push_back(target);
+  }
+  return true;
+}
+
+static ThreadedOp
+FuseConstJump(ThreadedOp jump)
+{
+  switch (jump) {
+    case ThreadedOp::JEQ:
+      return ThreadedOp::CONST_JEQ;
+    case ThreadedOp::JNEQ:
+      return ThreadedOp::CONST_JNEQ;
+    case ThreadedOp::JSLESS:
+      return ThreadedOp::CONST_JSLESS;
+    case ThreadedOp::JSLEQ:
+      return ThreadedOp::CONST_JSLEQ;
+    case ThreadedOp::JSGRTR:
+      return ThreadedOp::CONST_JSGRTR;
+    case ThreadedOp::JSGEQ:
+      return ThreadedOp::CONST_JSGEQ;
+    default:
+      return ThreadedOp::Total;
+  }
+}
+
+void
+ThreadedCodeBuilder::fuse()
+{
+  std::vector<ThreadedInsn>& insns = code_->insns_;
+  for (size_t i = 0; i + 1 < insns.size(); i++) {
+    ThreadedInsn& first = insns[i];
+    const ThreadedInsn& second = insns[i + 1];
+
+    ThreadedOp fused = ThreadedOp::Total;
+    switch (first.op) {
+      case ThreadedOp::LOAD_S:
+        if (second.op == ThreadedOp::PUSH_REG && second.b == first.b)
+          fused = ThreadedOp::LOAD_S_PUSH;
+        else if (second.op == ThreadedOp::LIDX && first.b == reg(PawnReg::Pri))
+          fused = ThreadedOp::LOAD_S_LIDX;
+        break;
+      case ThreadedOp::CONST:
+        fused = FuseConstJump(second.op);
+        break;
+      default:
+        break;
+    }
+    if (fused == ThreadedOp::Total)
+      continue;
+
+    // The pair's handler runs the second instruction from its own record,
+    // so skip it rather than fusing it again.
+    first.op = fused;
+    i++;
+  }
+}
+
+const char*
+ThreadedOpName(ThreadedOp op)
+{
+  static const char* const names[] = {
+#define _O(name) #name,
+    THREADED_OPS(_O)
+#undef _O
+  };
+  if (size_t(op) >= size_t(ThreadedOp::Total))
+    return "unknown";
+  return names[size_t(op)];
+}
+
+std::unique_ptr<ThreadedCode>
+ThreadedCode::Build(PluginRuntime* rt, uint32_t pcode_offset, bool fuse)
+{
+  const auto& code = rt->code();
+  if (pcode_offset >= code.length || !ke::IsAligned(pcode_offset, sizeof(cell_t)))
+    return nullptr;
+
+  // Find where the method ends, so each pcode cell can be mapped.
+  const uint8_t* cip = NextInstruction(code.bytes + pcode_offset);
+  const uint8_t* stop = code.bytes + code.length;
+  while (cip < stop) {
+    OPCODE op = (OPCODE)*reinterpret_cast<const cell_t*>(cip);
+    if (op == OP_PROC || op == OP_ENDPROC)
+      break;
+    cip = NextInstruction(cip);
+  }
+  uint32_t end = uint32_t((cip < stop ? cip : stop) - code.bytes);
+
+  std::unique_ptr<ThreadedCode> threaded(new ThreadedCode(pcode_offset, end));
+  ThreadedCodeBuilder builder(threaded.get());
+  if (!builder.build(rt))
+    return nullptr;
+  if (fuse)
+    builder.fuse();
+  return threaded;
+}
+
+void
+CountOpcodePairs(PluginRuntime* rt, std::vector<uint64_t>* counts)
+{
+  const size_t total = size_t(ThreadedOp::Total);
+  counts->resize(total * total);
+
+  const auto& code = rt->code();
+  const uint8_t* cip = code.bytes;
+  const uint8_t* stop = code.bytes + code.length;
+  while (cip + sizeof(cell_t) <= stop) {
+    ucell_t op = *reinterpret_cast<const cell_t*>(cip);
+    if (op >= OPCODES_TOTAL || (op != OP_CASETBL && !kOpcodeSizes[op]))
+      return;
+
+    if (op == OP_PROC) {
+      cell_t offset = cell_t(cip - code.bytes);
+      RefPtr<MethodInfo> method = rt->AcquireMethod(offset);
+      if (method && method->Validate() == SP_ERROR_NONE) {
+        if (std::unique_ptr<ThreadedCode> threaded = ThreadedCode::Build(rt, offset, false)) {
+          const ThreadedInsn* insns = threaded->start();
+          // The last instruction is always END.
+          for (size_t i = 0; i + 2 < threaded->length(); i++)
+            (*counts)[size_t(insns[i].op) * total + size_t(insns[i + 1].op)]++;
+        }
+      }
+    }
+    cip = NextInstruction(cip);
+  }
+}
+
+} // namespace sp
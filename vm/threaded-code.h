@@ -0,0 +1,302 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_threaded_code_h_
+#define _include_sourcepawn_vm_threaded_code_h_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <sp_vm_types.h>
+
+// GCC and Clang can jump straight to each handler. Elsewhere, the interpreter
+// falls back to a switch over the pre-decoded stream.
+#if defined(__GNUC__)
+# define SP_THREADED_DISPATCH
+#endif
+
+namespace sp {
+
+class MethodInfo;
+class PluginRuntime;
+
+// One entry for each PcodeVisitor callback, in the order the interpreter's
+// handler table is built.
+#define THREADED_OPS(_O)   \
+  _O(BREAK)                \
+  _O(LOAD)                 \
+  _O(LOAD_S)               \
+  _O(LREF_S)               \
+  _O(LOAD_I)               \
+  _O(LODB_I)               \
+  _O(CONST)                \
+  _O(ADDR)                 \
+  _O(STOR)                 \
+  _O(STOR_S)               \
+  _O(SREF_S)               \
+  _O(STOR_I)               \
+  _O(STRB_I)               \
+  _O(LIDX)                 \
+  _O(IDXADDR)              \
+  _O(MOVE)                 \
+  _O(XCHG)                 \
+  _O(PUSH_REG)             \
+  _O(PUSH_C)               \
+  _O(PUSH)                 \
+  _O(PUSH_S)               \
+  _O(POP)                  \
+  _O(STACK)                \
+  _O(HEAP)                 \
+  _O(RETN)                 \
+  _O(CALL)                 \
+  _O(JUMP)                 \
+  _O(JZER)                 \
+  _O(JNZ)                  \
+  _O(JEQ)                  \
+  _O(JNEQ)                 \
+  _O(JSLESS)               \
+  _O(JSLEQ)                \
+  _O(JSGRTR)               \
+  _O(JSGEQ)                \
+  _O(SHL)                  \
+  _O(SHR)                  \
+  _O(SSHR)                 \
+  _O(SHL_C)                \
+  _O(SMUL)                 \
+  _O(SDIV)                 \
+  _O(ADD)                  \
+  _O(SUB)                  \
+  _O(SUB_ALT)              \
+  _O(AND)                  \
+  _O(OR)                   \
+  _O(XOR)                  \
+  _O(NOT)                  \
+  _O(NEG)                  \
+  _O(INVERT)               \
+  _O(ADD_C)                \
+  _O(SMUL_C)               \
+  _O(ZERO_REG)             \
+  _O(ZERO)                 \
+  _O(ZERO_S)               \
+  _O(COMPARE)              \
+  _O(EQ_C)                 \
+  _O(INC_REG)              \
+  _O(INC)                  \
+  _O(INC_S)                \
+  _O(INC_I)                \
+  _O(DEC_REG)              \
+  _O(DEC)                  \
+  _O(DEC_S)                \
+  _O(DEC_I)                \
+  _O(MOVS)                 \
+  _O(FILL)                 \
+  _O(BOUNDS)               \
+  _O(SYSREQ_C)             \
+  _O(SWAP)                 \
+  _O(PUSH_ADR)             \
+  _O(SYSREQ_N)             \
+  _O(LOAD_BOTH)            \
+  _O(LOAD_S_BOTH)          \
+  _O(CONST_ADDR)           \
+  _O(CONST_S)              \
+  _O(TRACKER_PUSH_C)       \
+  _O(TRACKER_POP_SETHEAP)  \
+  _O(GENARRAY)             \
+  _O(STRADJUST_PRI)        \
+  _O(FABS)                 \
+  _O(FLOAT)                \
+  _O(FLOATADD)             \
+  _O(FLOATSUB)             \
+  _O(FLOATMUL)             \
+  _O(FLOATDIV)             \
+  _O(RND_TO_NEAREST)       \
+  _O(RND_TO_FLOOR)         \
+  _O(RND_TO_CEIL)          \
+  _O(RND_TO_ZERO)          \
+  _O(FLOATCMP)             \
+  _O(FLOAT_CMP_OP)         \
+  _O(FLOAT_NOT)            \
+  _O(HALT)                 \
+  _O(SWITCH)               \
+  _O(REBASE)               \
+  _O(LIDX_S_BOUNDS)        \
+  _O(IDXADDR_S_BOUNDS)     \
+  _O(END)                  \
+  FUSED_OPS(_O)
+
+// Superinstructions. Each replaces the first instruction of a common pair;
+// the second is left in place, so jumps into it still work. The set was
+// chosen from --opcode-pairs counts over a corpus of SourceMod plugins.
+#define FUSED_OPS(_O)      \
+  _O(LOAD_S_PUSH)          \
+  _O(LOAD_S_LIDX)          \
+  _O(CONST_JEQ)            \
+  _O(CONST_JNEQ)           \
+  _O(CONST_JSLESS)         \
+  _O(CONST_JSLEQ)          \
+  _O(CONST_JSGRTR)         \
+  _O(CONST_JSGEQ)
+
+enum class ThreadedOp : uint32_t {
+#define _O(name) name,
+  THREADED_OPS(_O)
+#undef _O
+  Total
+};
+
+const char* ThreadedOpName(ThreadedOp op);
+
+struct ThreadedInsn;
+
+// A SWITCH with its case table resolved. How it is searched is picked once,
+// when the method is translated: a jump table if the case values are dense,
+// a binary search if there are many sparse cases, and a linear scan
+// otherwise.
+struct ThreadedSwitch
+{
+  enum class Kind {
+    Linear,
+    Dense,
+    Sorted
+  };
+
+  // Switches with at most this many cases are scanned.
+  static const size_t kMaxLinearCases = 4;
+
+  const ThreadedInsn* lookup(cell_t value) const {
+    switch (kind) {
+      case Kind::Dense:
+      {
+        // Unsigned, so values below |low| are out of range too.
+        ucell_t index = ucell_t(value) - ucell_t(low);
+        if (index < targets.size())
+          return targets[index];
+        return default_target;
+      }
+      case Kind::Sorted:
+      {
+        size_t lo = 0, hi = values.size();
+        while (lo < hi) {
+          size_t mid = lo + (hi - lo) / 2;
+          if (values[mid] < value)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        if (lo < values.size() && values[lo] == value)
+          return targets[lo];
+        return default_target;
+      }
+      default:
+        for (size_t i = 0; i < values.size(); i++) {
+          if (values[i] == value)
+            return targets[i];
+        }
+        return default_target;
+    }
+  }
+
+  Kind kind;
+  // The case value of targets[0], for Dense.
+  cell_t low;
+  const ThreadedInsn* default_target;
+  // Case values in table order, for Linear, or sorted, for Sorted. Empty for
+  // Dense, where every value in range has a target.
+  std::vector<cell_t> values;
+  std::vector<const ThreadedInsn*> targets;
+};
+
+// A pcode instruction with its operands decoded. Registers and compare
+// operators are stored as small integers in |a| or |b|, and jumps point
+// directly at their target.
+struct ThreadedInsn
+{
+  // With SP_THREADED_DISPATCH, the address of the handler for |op|.
+  const void* handler;
+  // Just past the pcode instruction, which is what frame iteration reports.
+  const cell_t* cip;
+  ThreadedOp op;
+  cell_t a;
+  cell_t b;
+  union {
+    // Operand cells, for PUSH variants, and SWITCH cases while building.
+    const cell_t* ptr;
+    // Jump target.
+    const ThreadedInsn* target;
+    // Case table, for SWITCH.
+    const ThreadedSwitch* table;
+    // Third operand, for REBASE and the fused indexing ops.
+    cell_t c;
+    // Target, for CALL, once it has been looked up.
+    MethodInfo* callee;
+  };
+};
+
+// A method's pcode translated once into ThreadedInsns, so the interpreter
+// doesn't have to decode each instruction every time it runs.
+class ThreadedCode
+{
+ public:
+  // Returns null if the method can't be translated, in which case it should
+  // be interpreted directly. The method must have been verified.
+  static std::unique_ptr<ThreadedCode> Build(PluginRuntime* rt, uint32_t pcode_offset,
+                                             bool fuse = true);
+
+  const ThreadedInsn* start() const {
+    return insns_.data();
+  }
+
+  // Returns the instruction for the pcode at |offset|, or null.
+  const ThreadedInsn* at(cell_t offset) const;
+
+  size_t length() const {
+    return insns_.size();
+  }
+
+  // Fill in every handler from a table indexed by ThreadedOp. This is done
+  // on first use, since only the interpreter knows its handler addresses.
+  bool linked() const {
+    return linked_;
+  }
+  void link(const void* const* handlers);
+
+  // Remembers where a CALL goes, so later calls from it skip the lookup.
+  void setCallee(const ThreadedInsn* insn, MethodInfo* callee) {
+    insns_[insn - start()].callee = callee;
+  }
+
+ private:
+  friend class ThreadedCodeBuilder;
+
+  ThreadedCode(uint32_t start, uint32_t end);
+
+ private:
+  uint32_t start_;
+  uint32_t end_;
+  std::vector<ThreadedInsn> insns_;
+  std::vector<ThreadedSwitch> switches_;
+  // Index of the first ThreadedInsn for each pcode cell, or UINT32_MAX.
+  std::vector<uint32_t> index_;
+  bool linked_;
+};
+
+// Adds how often each pair of unfused ops appears back to back in |rt|'s
+// methods to |counts|, a ThreadedOp::Total by ThreadedOp::Total matrix
+// indexed by [first * Total + second]. Methods that fail verification are
+// skipped.
+void CountOpcodePairs(PluginRuntime* rt, std::vector<uint64_t>* counts);
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_threaded_code_h_
@@ -0,0 +1,183 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "timeline.h"
+
+#include <map>
+#include <utility>
+
+#include "plugin-runtime.h"
+
+namespace sp {
+
+static std::atomic<uint32_t> sNextThreadId(1);
+static thread_local uint32_t sThreadId;
+
+static const char*
+KindName(Timeline::Kind kind)
+{
+  switch (kind) {
+    case Timeline::Kind::Invoke:
+      return "invoke";
+    case Timeline::Kind::Native:
+      return "native";
+    case Timeline::Kind::Compile:
+      return "compile";
+    case Timeline::Kind::Timeout:
+      return "watchdog";
+  }
+  return "unknown";
+}
+
+Timeline::Timeline(size_t capacity)
+ : next_(0),
+   start_(std::chrono::steady_clock::now())
+{
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  events_ = std::make_unique<Event[]>(size);
+  mask_ = size - 1;
+}
+
+void
+Timeline::record(Kind kind, char phase, PluginRuntime* rt, uint32_t id)
+{
+  if (!sThreadId)
+    sThreadId = sNextThreadId.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  Event& event = events_[index & mask_];
+  event.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+  event.rt = rt;
+  event.plugin = nullptr;
+  event.name = nullptr;
+  event.id = id;
+  event.thread = sThreadId;
+  event.kind = kind;
+  event.phase = phase;
+}
+
+void
+Timeline::resolve(const Event& event, const char** plugin, const char** name) const
+{
+  if (!event.rt) {
+    *plugin = event.plugin;
+    *name = event.name;
+    if (!*name)
+      *name = event.kind == Kind::Timeout ? "timeout" : "<unloaded>";
+    return;
+  }
+
+  *plugin = event.rt->Name();
+  if (event.kind == Kind::Native)
+    *name = event.rt->image()->GetNative(event.id);
+  else
+    *name = event.rt->image()->LookupFunction(event.id);
+  if (!*name)
+    *name = "<unknown>";
+}
+
+void
+Timeline::forgetRuntime(PluginRuntime* rt)
+{
+  // Most events of a plugin share a handful of names.
+  std::map<std::pair<Kind, uint32_t>, const char*> names;
+  const char* plugin = nullptr;
+
+  uint64_t total = next_.load(std::memory_order_relaxed);
+  uint64_t first = total > mask_ ? total - mask_ - 1 : 0;
+  for (uint64_t i = first; i < total; i++) {
+    Event& event = events_[i & mask_];
+    if (event.rt != rt)
+      continue;
+
+    const char* name;
+    auto key = std::make_pair(event.kind, event.id);
+    auto iter = names.find(key);
+    if (iter == names.end()) {
+      const char* rt_plugin;
+      resolve(event, &rt_plugin, &name);
+      if (!plugin) {
+        names_.emplace_back(rt_plugin);
+        plugin = names_.back().c_str();
+      }
+      names_.emplace_back(name);
+      name = names_.back().c_str();
+      names.emplace(key, name);
+    } else {
+      name = iter->second;
+    }
+
+    event.rt = nullptr;
+    event.plugin = plugin;
+    event.name = name;
+  }
+}
+
+static void
+WriteString(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+bool
+Timeline::Write(FILE* fp)
+{
+  uint64_t total = next_.load(std::memory_order_acquire);
+  uint64_t first = total > mask_ ? total - mask_ - 1 : 0;
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (uint64_t i = first; i < total; i++) {
+    const Event& event = events_[i & mask_];
+
+    const char* plugin;
+    const char* name;
+    resolve(event, &plugin, &name);
+
+    fprintf(fp, "%s{\"name\":", i == first ? "" : ",\n");
+    WriteString(fp, name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u",
+            KindName(event.kind), event.phase, (unsigned long long)(event.ns / 1000),
+            unsigned(event.ns % 1000), event.thread);
+    if (event.phase == 'i')
+      fprintf(fp, ",\"s\":\"g\"");
+    if (plugin) {
+      fprintf(fp, ",\"args\":{\"plugin\":");
+      WriteString(fp, plugin);
+      fputc('}', fp);
+    }
+    fputc('}', fp);
+  }
+  fprintf(fp, "\n]}\n");
+  return !ferror(fp);
+}
+
+void
+Timeline::Clear()
+{
+  next_.store(0, std::memory_order_relaxed);
+  names_.clear();
+}
+
+} // namespace sp
@@ -0,0 +1,123 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_timeline_h_
+#define _include_sourcepawn_vm_timeline_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+
+namespace sp {
+
+class PluginRuntime;
+
+// Records when invokes, native calls and JIT compiles begin and end, and when
+// the watchdog times out, into a ring of the most recent events. Any thread
+// may record; writers only race on an atomic index, so recording never takes
+// a lock. Names are looked up when the timeline is written, not when events
+// are recorded.
+//
+// The timeline is written in the Chrome trace event format, which both
+// chrome://tracing and the Perfetto UI can open.
+class Timeline
+{
+ public:
+  enum class Kind : uint8_t {
+    Invoke,
+    Native,
+    Compile,
+    Timeout
+  };
+
+  // |capacity| is rounded up to a power of two.
+  explicit Timeline(size_t capacity);
+
+  // |id| is a code offset, or for natives, the index of the native.
+  void begin(Kind kind, PluginRuntime* rt, uint32_t id) {
+    record(kind, 'B', rt, id);
+  }
+  void end(Kind kind, PluginRuntime* rt, uint32_t id) {
+    record(kind, 'E', rt, id);
+  }
+  void instant(Kind kind) {
+    record(kind, 'i', nullptr, 0);
+  }
+
+  // Called before |rt| is destroyed, so its events keep their names.
+  void forgetRuntime(PluginRuntime* rt);
+
+  // Nothing may be recorded while the timeline is written. Returns false if
+  // the file couldn't be written.
+  bool Write(FILE* fp);
+  void Clear();
+
+ private:
+  struct Event {
+    uint64_t ns;
+    PluginRuntime* rt;
+    // Set once |rt| is gone.
+    const char* plugin;
+    const char* name;
+    uint32_t id;
+    uint32_t thread;
+    Kind kind;
+    char phase;
+  };
+
+  void record(Kind kind, char phase, PluginRuntime* rt, uint32_t id);
+  void resolve(const Event& event, const char** plugin, const char** name) const;
+
+ private:
+  std::unique_ptr<Event[]> events_;
+  size_t mask_;
+  std::atomic<uint64_t> next_;
+  std::chrono::steady_clock::time_point start_;
+  // Names of events whose plugins were unloaded.
+  std::deque<std::string> names_;
+};
+
+// Records a begin event now, and its end when this goes away, if |timeline|
+// is not null.
+class AutoTimelineEvent
+{
+ public:
+  AutoTimelineEvent(Timeline* timeline, Timeline::Kind kind, PluginRuntime* rt, uint32_t id)
+   : timeline_(timeline),
+     kind_(kind),
+     rt_(rt),
+     id_(id)
+  {
+    if (timeline_)
+      timeline_->begin(kind_, rt_, id_);
+  }
+  ~AutoTimelineEvent() {
+    if (timeline_)
+      timeline_->end(kind_, rt_, id_);
+  }
+
+ private:
+  Timeline* timeline_;
+  Timeline::Kind kind_;
+  PluginRuntime* rt_;
+  uint32_t id_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_timeline_h_
@@ -0,0 +1,189 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <stdint.h>
+
+#include <smx/smx-typeinfo.h>
+#include "typed-natives.h"
+
+using namespace sp;
+using namespace SourcePawn;
+
+// Every argument is passed in a pointer-sized slot: registers on x64, and
+// four-byte stack slots on x86. A native declaring cell_t reads the low half,
+// so one prototype per arity covers every signature.
+typedef cell_t (*TypedNative0)(IPluginContext*);
+typedef cell_t (*TypedNative1)(IPluginContext*, intptr_t);
+typedef cell_t (*TypedNative2)(IPluginContext*, intptr_t, intptr_t);
+typedef cell_t (*TypedNative3)(IPluginContext*, intptr_t, intptr_t, intptr_t);
+
+bool
+sp::IsValidTypedNative(const sp_typed_nativeinfo_t* info)
+{
+  if (!info->func || info->nargs > SP_TYPED_NATIVE_MAX_ARGS)
+    return false;
+  for (uint32_t i = 0; i < info->nargs; i++) {
+    if (info->args[i] > SP_NATIVEARG_STRING)
+      return false;
+  }
+  return true;
+}
+
+static bool
+DecodeUint32(const uint8_t** p, const uint8_t* end, uint32_t* out)
+{
+  uint32_t value = 0;
+  for (uint32_t shift = 0; shift < 35; shift += 7) {
+    if (*p == end)
+      return false;
+    uint8_t byte = *(*p)++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *out = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns how a parameter of this type would reach a typed native, as an
+// SP_NATIVEARG_* value, or -1 for nested arrays, structs, function
+// signatures, and anything else a typed native can't take.
+static int
+DecodeRttiParam(const uint8_t** p, const uint8_t* end)
+{
+  bool by_ref = false;
+  if (*p != end && **p == cb::kByRef) {
+    by_ref = true;
+    (*p)++;
+  }
+
+  bool array = false;
+  uint32_t size;
+  if (*p != end && (**p == cb::kFixedArray || **p == cb::kArray)) {
+    array = true;
+    if (*(*p)++ == cb::kFixedArray && !DecodeUint32(p, end, &size))
+      return -1;
+  }
+  if (*p != end && **p == cb::kConst)
+    (*p)++;
+  if (*p == end)
+    return -1;
+
+  uint8_t type = *(*p)++;
+  switch (type) {
+    case cb::kBool:
+    case cb::kInt32:
+    case cb::kFloat32:
+    case cb::kChar8:
+    case cb::kAny:
+    case cb::kTopFunction:
+      break;
+    case cb::kEnum:
+    case cb::kTypedef:
+    case cb::kTypeset:
+    {
+      uint32_t index;
+      if (!DecodeUint32(p, end, &index))
+        return -1;
+      break;
+    }
+    default:
+      return -1;
+  }
+
+  if (array)
+    return type == cb::kChar8 ? SP_NATIVEARG_STRING : SP_NATIVEARG_REF;
+  if (by_ref)
+    return SP_NATIVEARG_REF;
+  return type == cb::kFloat32 ? SP_NATIVEARG_FLOAT : SP_NATIVEARG_CELL;
+}
+
+SignatureMatch
+sp::MatchRttiSignature(const sp_typed_nativeinfo_t* info, const uint8_t* bytes, size_t length)
+{
+  const uint8_t* p = bytes;
+  const uint8_t* end = bytes + length;
+  if (p == end)
+    return SignatureMatch::Unknown;
+
+  // Typed natives can't take variadic arguments.
+  uint32_t argc = *p++;
+  if (argc != info->nargs || (p != end && *p == cb::kVariadic))
+    return SignatureMatch::Mismatch;
+
+  // Only the parameters are compared; the return value is always a cell.
+  if (p != end && *p == cb::kVoid)
+    p++;
+  else if (DecodeRttiParam(&p, end) < 0)
+    return SignatureMatch::Unknown;
+
+  for (uint32_t i = 0; i < argc; i++) {
+    int kind = DecodeRttiParam(&p, end);
+    if (kind < 0)
+      return SignatureMatch::Unknown;
+    if (kind != info->args[i])
+      return SignatureMatch::Mismatch;
+  }
+  return SignatureMatch::Match;
+}
+
+cell_t
+sp::InvokeTypedNative(const sp_typed_nativeinfo_t* info, IPluginContext* cx,
+                      const cell_t* params)
+{
+  if (params[0] != cell_t(info->nargs * sizeof(cell_t))) {
+    cx->ReportError("Native takes %u arguments, but %d were passed", info->nargs,
+                    params[0] / int(sizeof(cell_t)));
+    return 0;
+  }
+
+  intptr_t args[SP_TYPED_NATIVE_MAX_ARGS] = {};
+  for (uint32_t i = 0; i < info->nargs; i++) {
+    cell_t value = params[i + 1];
+    int err = SP_ERROR_NONE;
+    switch (info->args[i]) {
+      case SP_NATIVEARG_REF:
+      {
+        cell_t* addr;
+        if ((err = cx->LocalToPhysAddr(value, &addr)) == SP_ERROR_NONE)
+          args[i] = reinterpret_cast<intptr_t>(addr);
+        break;
+      }
+      case SP_NATIVEARG_STRING:
+      {
+        char* addr;
+        if ((err = cx->LocalToString(value, &addr)) == SP_ERROR_NONE)
+          args[i] = reinterpret_cast<intptr_t>(addr);
+        break;
+      }
+      default:
+        args[i] = value;
+        break;
+    }
+    if (err != SP_ERROR_NONE) {
+      cx->ReportErrorNumber(err);
+      return 0;
+    }
+  }
+
+  switch (info->nargs) {
+    case 0:
+      return reinterpret_cast<TypedNative0>(info->func)(cx);
+    case 1:
+      return reinterpret_cast<TypedNative1>(info->func)(cx, args[0]);
+    case 2:
+      return reinterpret_cast<TypedNative2>(info->func)(cx, args[0], args[1]);
+    default:
+      return reinterpret_cast<TypedNative3>(info->func)(cx, args[0], args[1], args[2]);
+  }
+}
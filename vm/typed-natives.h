@@ -0,0 +1,54 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2018 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_typed_natives_h_
+#define _include_sourcepawn_vm_typed_natives_h_
+
+#include <sp_vm_api.h>
+#include "plugin-runtime.h"
+
+namespace sp {
+
+// Returns whether |info| has a function and a signature the VM can call.
+bool IsValidTypedNative(const sp_typed_nativeinfo_t* info);
+
+enum class SignatureMatch {
+  // The plugin's signature uses types a typed native can't describe.
+  Unknown,
+  Match,
+  Mismatch
+};
+
+// Compares a typed native's signature with the one a plugin declared for it,
+// encoded as in smx_rtti_method::signature.
+SignatureMatch MatchRttiSignature(const sp_typed_nativeinfo_t* info, const uint8_t* bytes,
+                                  size_t length);
+
+// Calls a typed native with the arguments in |params|, checking the count
+// and every reference and string the way a JIT'd call site does first.
+cell_t InvokeTypedNative(const sp_typed_nativeinfo_t* info, SourcePawn::IPluginContext* cx,
+                         const cell_t* params);
+
+// Calls a bound native however it was bound.
+static inline cell_t
+InvokeNative(NativeEntry* native, SourcePawn::IPluginContext* cx, const cell_t* params)
+{
+  if (native->legacy_fn)
+    return native->legacy_fn(cx, params);
+  if (native->typed.func)
+    return InvokeTypedNative(&native->typed, cx, params);
+  return native->callback->Invoke(cx, params);
+}
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_typed_natives_h_
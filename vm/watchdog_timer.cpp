@@ -18,8 +18,12 @@
 
 #include <string.h>
 
+#include <algorithm>
+
 #include <amtl/am-thread.h>
 #include "environment.h"
+#include "sampling-profiler.h"
+#include "timeline.h"
 
 using namespace sp;
 
@@ -37,6 +41,8 @@ WatchdogTimer::WatchdogTimer(Environment* env)
    terminate_(false),
    mainthread_(std::this_thread::get_id()),
    ignore_timeout_(false),
+   sample_interval_ms_(0),
+   sample_pending_(false),
    last_frame_id_(0),
    second_timeout_(false),
    timedout_(false)
@@ -78,21 +84,52 @@ WatchdogTimer::Shutdown()
   thread_ = nullptr;
 }
 
+bool
+WatchdogTimer::SetSampleInterval(size_t interval_ms)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!thread_ || terminate_)
+    return false;
+
+  sample_interval_ms_ = interval_ms;
+  if (!interval_ms)
+    sample_pending_ = false;
+
+  // Wake up so the new interval takes effect now.
+  cv_.notify_all();
+  return true;
+}
+
 void
 WatchdogTimer::Run()
 {
+  typedef std::chrono::steady_clock Clock;
+
   std::unique_lock<std::mutex> lock(mutex_);
 
   // Initialize the frame id, so we don't have to wait longer on startup.
   last_frame_id_ = env_->FrameId();
 
+  const auto check_interval = std::chrono::milliseconds(timeout_ms_ / 2);
+  auto next_check = Clock::now() + check_interval;
+
   while (!terminate_) {
-    auto rv = cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms_ / 2));
+    // Sampling may wake us more often than timeouts need to be checked.
+    auto wake_at = next_check;
+    if (sample_interval_ms_)
+      wake_at = std::min(wake_at, Clock::now() + std::chrono::milliseconds(sample_interval_ms_));
+
+    cv_.wait_until(lock, wake_at);
     if (terminate_)
       return;
 
-    if (rv != std::cv_status::timeout)
+    auto now = Clock::now();
+    if (sample_interval_ms_ && env_->RunningCode())
+      sample_pending_ = true;
+
+    if (now < next_check)
       continue;
+    next_check = now + check_interval;
 
     // We reached a timeout. If the current frame is not equal to the last
     // frame, then we assume the server is still moving enough to process
@@ -117,7 +154,16 @@ WatchdogTimer::Run()
       continue;
     }
 
-    {
+    if (Timeline* timeline = env_->timeline())
+      timeline->instant(Timeline::Kind::Timeout);
+
+    if (env_->polls_interrupts()) {
+      // Compiled code checks the flag at every back-edge, so there is nothing
+      // to patch and no need for the environment lock. The flag is set after
+      // the notification bit, so the main thread sees both.
+      timedout_ = true;
+      env_->RequestInterrupt();
+    } else {
       // Prevent the JIT from linking or destroying runtimes and functions.
       std::lock_guard<ke::Mutex> lock(env_->lock());
 
@@ -137,6 +183,7 @@ WatchdogTimer::Run()
     cv_.wait(lock);
 
     second_timeout_ = false;
+    next_check = Clock::now() + check_interval;
 
     // Reset the last frame ID to something unlikely to be chosen again soon.
     last_frame_id_--;
@@ -154,7 +201,9 @@ WatchdogTimer::NotifyTimeoutReceived()
   // We are guaranteed that the watchdog thread is waiting for our
   // notification, and is therefore blocked. We take the JIT lock
   // anyway for sanity.
-  {
+  if (env_->polls_interrupts()) {
+    env_->ClearInterrupt();
+  } else {
     std::lock_guard<ke::Mutex> lock(env_->lock());
     env_->UnpatchAllJumpsFromTimeout();
   }
@@ -167,9 +216,18 @@ WatchdogTimer::NotifyTimeoutReceived()
   return false;
 }
 
+void
+WatchdogTimer::TakeSample()
+{
+  sample_pending_ = false;
+  if (SamplingProfiler* sampler = env_->sampler())
+    sampler->TakeSample();
+}
+
 bool
 WatchdogTimer::HandleInterrupt()
 {
+  HandleSampleRequest();
   if (timedout_)
     return NotifyTimeoutReceived();
   return true;
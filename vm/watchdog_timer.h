@@ -20,6 +20,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <thread>
 
@@ -46,10 +47,23 @@ class WatchdogTimer
   bool Initialize(size_t timeout_ms);
   void Shutdown();
 
+  // Ask for a stack sample every |interval_ms|, or stop if 0. Returns false
+  // if the timer isn't running.
+  bool SetSampleInterval(size_t interval_ms);
+
   // Called from main thread.
   bool NotifyTimeoutReceived();
   bool HandleInterrupt();
 
+  // Called from main thread, at points where the stack can be walked.
+  void HandleSampleRequest() {
+    if (sample_pending_.load(std::memory_order_relaxed))
+      TakeSample();
+  }
+
+ private:
+  void TakeSample();
+
  private:
   // Watchdog thread.
   void Run();
@@ -65,6 +79,10 @@ class WatchdogTimer
   std::unique_ptr<std::thread> thread_;
   std::mutex mutex_;
   std::condition_variable cv_;
+  size_t sample_interval_ms_;
+
+  // Set by the watchdog thread, cleared by the main thread.
+  std::atomic<bool> sample_pending_;
 
   // Accessed only on the watchdog thread.
   uintptr_t last_frame_id_;
@@ -15,20 +15,29 @@
 
 namespace sp {
 
+CPUFeatures Assembler::X64Features;
+
 void
-Assembler::emitToExecutableMemory(void* code)
+Assembler::emitToExecutableMemory(void* code, void* writable)
 {
   assert(!outOfMemory());
 
   uint8_t* base = reinterpret_cast<uint8_t*>(code);
-  memcpy(base, buffer(), length());
+  uint8_t* out = writable ? reinterpret_cast<uint8_t*>(writable) : base;
+  memcpy(out, buffer(), length());
 
   for (size_t i = 0; i < absolute_code_refs_.size(); i++) {
     size_t offset = absolute_code_refs_[i];
-    size_t target = *reinterpret_cast<uint64_t*>(base + offset - 8);
+    size_t target = *reinterpret_cast<uint64_t*>(out + offset - 8);
     assert(target <= length());
 
-    *reinterpret_cast<void**>(base + offset - 8) = base + target;
+    *reinterpret_cast<void**>(out + offset - 8) = base + target;
+  }
+
+  for (const NearCall& ref : near_calls_) {
+    intptr_t delta = intptr_t(ref.target) - intptr_t(base + ref.offset);
+    if (delta >= INT_MIN && delta <= INT_MAX)
+      *reinterpret_cast<int32_t*>(out + ref.offset - 4) = int32_t(delta);
   }
 }
 
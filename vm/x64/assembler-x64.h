@@ -13,6 +13,8 @@
 #ifndef _include_sourcepawn_vm_assembler_x64_h__
 #define _include_sourcepawn_vm_assembler_x64_h__
 
+#include <string.h>
+
 #include <assembler.h>
 #include <amtl/am-platform.h>
 #include <amtl/am-assert.h>
@@ -153,6 +155,30 @@ enum ConditionCode {
   not_parity = odd_parity
 };
 
+struct CPUFeatures
+{
+  CPUFeatures()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  bool sse3;
+  bool ssse3;
+  bool sse4_1;
+  bool sse4_2;
+  bool popcnt;
+  bool avx;
+  bool avx2;
+};
+
+// Rounding modes for ROUNDSS. The precision exception is always suppressed.
+enum RoundMode {
+  kRoundNearest = 0x8,
+  kRoundDown = 0x9,
+  kRoundUp = 0xa,
+  kRoundTowardZero = 0xb
+};
+
 enum Scale {
   NoScale,
   ScaleTwo,
@@ -330,8 +356,85 @@ struct Operand
 
 class Assembler : public AssemblerBase
 {
+ private:
+  // Filled in by RunFeatureDetection at startup. SSE2 is always there.
+  static CPUFeatures X64Features;
+
  public:
-  void emitToExecutableMemory(void* code);
+  Assembler()
+   : relocatable_(false)
+  {}
+
+  static void SetFeatures(const CPUFeatures& features) {
+    X64Features = features;
+  }
+  static const CPUFeatures& Features() {
+    return X64Features;
+  }
+
+  // The generated function takes an int[3], and fills it with ECX and EDX
+  // from the first CPUID level and EBX from the seventh.
+  static void GenerateFeatureDetection(Assembler& masm) {
+    masm.push(rbx);
+    masm.movq(r8, ArgReg0);
+    masm.movl(rax, 1);
+    masm.movl(rcx, 0);
+    masm.cpuid();
+    masm.movl(Operand(r8, 0), rcx);
+    masm.movl(Operand(r8, 4), rdx);
+    masm.movl(Operand(r8, 8), 0);
+
+    Label skip_level_7;
+    masm.movl(rax, 0);
+    masm.cpuid();
+    masm.cmpl(rax, 7);
+    masm.j(below, &skip_level_7);
+    masm.movl(rax, 7);
+    masm.movl(rcx, 0);
+    masm.cpuid();
+    masm.movl(Operand(r8, 8), rbx);
+    masm.bind(&skip_level_7);
+
+    masm.pop(rbx);
+    masm.ret();
+  }
+
+  static void RunFeatureDetection(void* code) {
+    typedef void (*fn_t)(int* regs);
+
+    int regs[3];
+    ((fn_t)code)(regs);
+
+    CPUFeatures features;
+    features.sse3 = !!(regs[0] & (1 << 0));
+    features.ssse3 = !!(regs[0] & (1 << 9));
+    features.sse4_1 = !!(regs[0] & (1 << 19));
+    features.sse4_2 = !!(regs[0] & (1 << 20));
+    features.popcnt = !!(regs[0] & (1 << 23));
+    features.avx = !!(regs[0] & (1 << 28));
+    features.avx2 = !!(regs[2] & (1 << 5));
+    SetFeatures(features);
+  }
+
+  // Code is written to |writable| (by default, |code| itself) but fixed up
+  // for running at |code|.
+  void emitToExecutableMemory(void* code, void* writable = nullptr);
+
+  // In relocatable mode, every absolute address is emitted as a full 64-bit
+  // immediate and its position is recorded, so the code can be saved and
+  // rebased later.
+  void setRelocatable() {
+    relocatable_ = true;
+  }
+  bool relocatable() const {
+    return relocatable_;
+  }
+
+  // Offsets just past each 64-bit absolute address in the code stream, in
+  // emission order. Only complete in relocatable mode.
+  const std::vector<uint32_t>& absolute_refs() const {
+    return absolute_refs_;
+  }
 
   void bind(Label* target) {
     if (outOfMemory()) {
@@ -375,6 +478,15 @@ class Assembler : public AssemblerBase
   void call(Register reg) {
     emit1(0xff, 2, reg);
   }
+
+  // Calls |target| directly if it is within rel32 range once the code is
+  // placed. Otherwise the call goes to |fallback|, which must reach |target|
+  // some other way.
+  void callNear(void* target, Label* fallback) {
+    call(fallback);
+    NearCall ref = { pc(), target };
+    near_calls_.push_back(ref);
+  }
   void leave() {
     emit1(0xc9);
   }
@@ -395,8 +507,10 @@ class Assembler : public AssemblerBase
       emitJumpTarget(dest);
     }
   }
-  template <typename T>
-  void jmp(const T& target) {
+  void jmp(Register target) {
+    emit1(0xff, 4, target);
+  }
+  void jmp(const Operand& target) {
     emit1(0xff, 4, target);
   }
 
@@ -445,7 +559,8 @@ class Assembler : public AssemblerBase
       movl(dest, int32_t(value));
     } else if (value >= INT_MIN && value <= INT_MAX) {
       // Perform a sign-extended move.
-      emit1_64(0xc7, 1, dest);
+      emit1_64(0xc7, 0, dest);
+      writeInt32(int32_t(value));
     } else {
       // Do a full 64-bit move.
       emit1_64_rex(0xb8 + dest.low_bits(), dest);
@@ -463,6 +578,7 @@ class Assembler : public AssemblerBase
     if (patch)
       bind(patch);
     absolute_code_refs_.push_back(pc());
+    absolute_refs_.push_back(pc());
   }
   void movl(Register dest, int32_t value) {
     emit1_maybe_rex(0xb8 + dest.low_bits(), dest);
@@ -473,7 +589,13 @@ class Assembler : public AssemblerBase
     writeInt32(value);
   }
   void movq(Register dest, const AddressValue& address) {
-    movq(dest, address.value());
+    if (!relocatable_) {
+      movq(dest, address.value());
+      return;
+    }
+    emit1_64_rex(0xb8 + dest.low_bits(), dest);
+    writeInt64(address.value());
+    absolute_refs_.push_back(pc());
   }
   void movl(Register dest, const Operand& src) {
     emit1(0x8b, dest, src);
@@ -532,7 +654,6 @@ class Assembler : public AssemblerBase
   void cmpq(const T& left, Register right) {
     emit1_64(0x39, right, left);
   }
-  template <typename T>
   void cmpq(Register left, const Operand& right) {
     emit1_64(0x3b, left, right);
   }
@@ -540,7 +661,6 @@ class Assembler : public AssemblerBase
   void cmpl(const T& left, Register right) {
     emit1(0x39, right, left);
   }
-  template <typename T>
   void cmpl(Register left, const Operand& right) {
     emit1(0x3b, left, right);
   }
@@ -554,12 +674,225 @@ class Assembler : public AssemblerBase
     emit1_64(0x31, right, left);
   }
 
+  // 32-bit operations. Cells are 32 bits wide, so the JIT performs most of
+  // its arithmetic with these; writing a 32-bit register zero-extends it to
+  // 64 bits, which keeps cell offsets usable as address indices.
+  void movw(const Operand& dest, Register src) {
+    emit1(0x66);
+    emit1(0x89, src, dest);
+  }
+  void movb(const Operand& dest, Register src) {
+    ensureSpace();
+    // spl/bpl/sil/dil need a REX prefix to avoid encoding ah/ch/dh/bh.
+    uint8_t bits = static_cast<uint8_t>((src.rex_bit() << 2) | dest.rex_bits());
+    if (bits || src.code >= 4)
+      *pos_++ = 0x40 | bits;
+    emit1_tail(0x88, src, dest);
+  }
+  void movzxb(Register dest, const Operand& src) {
+    emit2(0x0f, 0xb6, dest, src);
+  }
+  void movsxd(Register dest, const Operand& src) {
+    emit1_64(0x63, dest, src);
+  }
+  void leal(Register dest, const Operand& src) {
+    emit1(0x8d, dest, src);
+  }
+  void xchgl(Register left, Register right) {
+    emit1(0x87, left, right);
+  }
+
+  void addl(Register dest, Register src) {
+    emit1(0x01, src, dest);
+  }
+  void subl(Register dest, Register src) {
+    emit1(0x29, src, dest);
+  }
+  template <typename T>
+  void subl(const T& rm, int32_t imm) {
+    alu_imm_32(5, imm, rm);
+  }
+  void andl(Register dest, Register src) {
+    emit1(0x21, src, dest);
+  }
+  template <typename T>
+  void andl(const T& rm, int32_t imm) {
+    alu_imm_32(4, imm, rm);
+  }
+  void orl(Register dest, Register src) {
+    emit1(0x09, src, dest);
+  }
+  void xorl(Register dest, Register src) {
+    emit1(0x31, src, dest);
+  }
+  template <typename T>
+  void xorl(const T& rm, int32_t imm) {
+    alu_imm_32(6, imm, rm);
+  }
+  void testl(Register left, int32_t imm) {
+    if (left == rax)
+      emit1(0xa9);
+    else
+      emit1(0xf7, 0, left);
+    writeInt32(imm);
+  }
+
+  void shll_cl(Register dest) {
+    emit1(0xd3, 4, dest);
+  }
+  void shll(Register dest, uint8_t imm) {
+    shift_imm(4, dest, imm);
+  }
+  void shrl_cl(Register dest) {
+    emit1(0xd3, 5, dest);
+  }
+  void shrl(Register dest, uint8_t imm) {
+    shift_imm(5, dest, imm);
+  }
+  void sarl_cl(Register dest) {
+    emit1(0xd3, 7, dest);
+  }
+  void sarl(Register dest, uint8_t imm) {
+    shift_imm(7, dest, imm);
+  }
+
+  void imull(Register dest, Register src) {
+    emit2(0x0f, 0xaf, dest, src);
+  }
+  template <typename T>
+  void imull(Register dest, const T& src, int32_t imm) {
+    if (imm >= SCHAR_MIN && imm <= SCHAR_MAX) {
+      emit1(0x6b, dest, src);
+      *pos_++ = uint8_t(imm & 0xff);
+    } else {
+      emit1(0x69, dest, src);
+      writeInt32(imm);
+    }
+  }
+  // edx:eax = eax * src.
+  void imull(Register src) {
+    emit1(0xf7, 5, src);
+  }
+  void idivl(Register divisor) {
+    emit1(0xf7, 7, divisor);
+  }
+  void notl(Register dest) {
+    emit1(0xf7, 2, dest);
+  }
+  void negl(Register srcdest) {
+    emit1(0xf7, 3, srcdest);
+  }
+
+  void set(ConditionCode cc, Register dest) {
+    ensureSpace();
+    // As with movb, byte registers above bl need a REX prefix.
+    if (dest.code >= 4)
+      *pos_++ = 0x40 | dest.rex_bit();
+    *pos_++ = 0x0f;
+    *pos_++ = 0x90 + uint8_t(cc);
+    emit_modrm(0, dest);
+  }
+
+  void cld() {
+    emit1(0xfc);
+  }
+  void rep_movsb() {
+    emit2(0xf3, 0xa4);
+  }
+  void rep_movsd() {
+    emit2(0xf3, 0xa5);
+  }
+  void rep_stosd() {
+    emit2(0xf3, 0xab);
+  }
+
+  // Force a 32-bit jump, for jumps that may be patched later.
+  void jmp32(Label* dest) {
+    emit1(0xe9);
+    emitJumpTarget(dest);
+  }
+  void j32(ConditionCode cc, Label* dest) {
+    emit2(0x0f, 0x80 + uint8_t(cc));
+    emitJumpTarget(dest);
+  }
+
+  // Emit a 32-bit displacement to |dest|, relative to the end of the entry.
+  // This is used for jump tables, since absolute addresses would need 64-bit
+  // entries.
+  void emit_jump_table_entry(Label* dest) {
+    ensureSpace();
+    emitJumpTarget(dest);
+  }
+
+  // SSE instructions. These are always available on x86-64.
+  void movss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x10, dest, src);
+  }
+  void movss(const Operand& dest, FloatRegister src) {
+    emit_sse(0xf3, 0x11, src, dest);
+  }
+  void movd(Register dest, FloatRegister src) {
+    emit_sse(0x66, 0x7e, src, dest);
+  }
+  void cvtsi2ss(FloatRegister dest, Register src) {
+    emit_sse(0xf3, 0x2a, dest, src);
+  }
+  void cvtsi2ss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x2a, dest, src);
+  }
+  void cvttss2si(Register dest, FloatRegister src) {
+    emit_sse(0xf3, 0x2c, dest, ToRegister(src));
+  }
+  void cvttss2si(Register dest, const Operand& src) {
+    emit_sse(0xf3, 0x2c, dest, src);
+  }
+  void cvtss2si(Register dest, const Operand& src) {
+    emit_sse(0xf3, 0x2d, dest, src);
+  }
+  void addss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x58, dest, src);
+  }
+  void subss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x5c, dest, src);
+  }
+  void mulss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x59, dest, src);
+  }
+  void divss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x5e, dest, src);
+  }
+  void xorps(FloatRegister dest, FloatRegister src) {
+    emit2(0x0f, 0x57, ToRegister(dest), ToRegister(src));
+  }
+  // Note: as on x86, these compare |right| against |left|.
+  void roundss(FloatRegister dest, const Operand& src, RoundMode mode) {
+    assert(Features().sse4_1);
+    ensureSpace();
+    Register reg = ToRegister(dest);
+    *pos_++ = 0x66;
+    maybe_emit_rex(reg, src);
+    *pos_++ = 0x0f;
+    *pos_++ = 0x3a;
+    emit1_tail(0x0a, reg, src);
+    *pos_++ = uint8_t(mode);
+  }
+  void cpuid() {
+    emit2(0x0f, 0xa2);
+  }
+  void ucomiss(FloatRegister left, FloatRegister right) {
+    emit2(0x0f, 0x2e, ToRegister(right), ToRegister(left));
+  }
+  void ucomiss(const Operand& left, FloatRegister right) {
+    emit2(0x0f, 0x2e, ToRegister(right), left);
+  }
+
  protected:
   // If address does not fit in a 32-bit value, src must be rax.
   void movq(const AddressOperand& address, Register src) {
     if (src == rax) {
       emit1_64(0xa3);
       writeInt64(address.asIntPtr());
+      absolute_refs_.push_back(pc());
     } else {
       movq(Operand(address.asValue()), src);
     }
@@ -568,6 +901,7 @@ class Assembler : public AssemblerBase
     if (dest == rax) {
       emit1_64(0xa1);
       writeInt64(src.asIntPtr());
+      absolute_refs_.push_back(pc());
     } else {
       movq(dest, Operand(src.asValue()));
     }
@@ -600,7 +934,7 @@ class Assembler : public AssemblerBase
       emit1_64(0x83, r, rm);
       *pos_++ = uint8_t(imm & 0xff);
     } else if (rm == rax) {
-      emit1(0x05 | (r << 3));
+      emit1_64(0x05 | (r << 3));
       writeInt32(imm);
     } else {
       emit1_64(0x81, r, rm);
@@ -701,6 +1035,40 @@ class Assembler : public AssemblerBase
     *pos_++ = prefix;
     *pos_++ = opcode;
   }
+  // Emit a two-byte opcode that might need a REX prefix.
+  template <typename RMType>
+  void emit2(uint8_t prefix, uint8_t opcode, Register opreg, const RMType& rm) {
+    ensureSpace();
+    maybe_emit_rex(opreg, rm);
+    *pos_++ = prefix;
+    emit1_tail(opcode, opreg, rm);
+  }
+  // Emit an SSE instruction: mandatory prefix, optional REX, 0F escape.
+  template <typename RegType, typename RMType>
+  void emit_sse(uint8_t prefix, uint8_t opcode, const RegType& opreg, const RMType& rm) {
+    ensureSpace();
+    Register reg = ToRegister(opreg);
+    *pos_++ = prefix;
+    maybe_emit_rex(reg, rm);
+    *pos_++ = 0x0f;
+    emit1_tail(opcode, reg, rm);
+  }
+  void shift_imm(uint8_t r, Register dest, uint8_t imm) {
+    if (imm == 1) {
+      emit1(0xd1, r, dest);
+    } else {
+      emit1(0xc1, r, dest);
+      *pos_++ = imm;
+    }
+  }
+
+  static Register ToRegister(Register reg) {
+    return reg;
+  }
+  static Register ToRegister(FloatRegister reg) {
+    Register r = { reg.code };
+    return r;
+  }
 
   // Helpers.
   template <typename RegType, typename RMType>
@@ -769,9 +1137,43 @@ class Assembler : public AssemblerBase
   }
 
  private:
+  struct NearCall {
+    uint32_t offset;
+    void* target;
+  };
+
   std::vector<uint32_t> absolute_code_refs_;
+  std::vector<uint32_t> absolute_refs_;
+  std::vector<NearCall> near_calls_;
+  bool relocatable_;
 };
 
+static inline ConditionCode
+InvertConditionCode(ConditionCode cc)
+{
+  switch (cc) {
+    case overflow: return no_overflow;
+    case no_overflow: return overflow;
+    case below: return not_below;
+    case not_below: return below;
+    case equal: return not_equal;
+    case not_equal: return equal;
+    case not_above: return above;
+    case above: return not_above;
+    case negative: return not_negative;
+    case not_negative: return negative;
+    case even_parity: return odd_parity;
+    case odd_parity: return even_parity;
+    case less: return not_less;
+    case not_less: return less;
+    case not_greater: return greater;
+    case greater: return not_greater;
+    default:
+      assert(false);
+      return zero;
+  }
+}
+
 } // namespace sp
 
 #endif // _include_sourcepawn_vm_assembler_x64_h__
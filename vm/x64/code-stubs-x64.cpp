@@ -15,7 +15,10 @@
 #include "linking.h"
 #include "macro-assembler-x64.h"
 #include "constants-x64.h"
+#include "environment.h"
 #include "plugin-context.h"
+#include "runtime-helpers.h"
+#include "stack-frames.h"
 
 #define __ masm.
 
@@ -24,39 +27,54 @@ namespace sp {
 bool
 CodeStubs::InitializeFeatureDetection()
 {
+  MacroAssembler masm;
+  MacroAssembler::GenerateFeatureDetection(masm);
+  CodeChunk code = LinkCode(env_, masm);
+  if (!code.address())
+    return false;
+  MacroAssembler::RunFeatureDetection(code.address());
   return true;
 }
 
-#if 0
 bool
 CodeStubs::CompileInvokeStub()
 {
   MacroAssembler masm;
   __ enterFrame(JitFrameType::Entry, 0);
 
+  // rsi and rdi are only callee-saved on Windows, but MOVS and FILL clobber
+  // them, so save them everywhere.
   __ push(rbx);
   __ push(r12);
   __ push(r13);
   __ push(r14);
   __ push(r15);
+  __ push(rsi);
+  __ push(rdi);
 
-  // We push 5 values, plus 2 for the frame size.
-  static const intptr_t kFpOffsetToPreAlignedSp = -(5 + kExtraWordsInSpFrame) * 8;
+  // We push 7 values, plus 2 for the frame size.
+  static const intptr_t kFpOffsetToPreAlignedSp = -(7 + kExtraWordsInSpFrame) * 8;
 
   // arg0 = cx
   // arg1 = code
   // arg2 = rval
-  
-  // Save the context and rval pointers.
-  const Register context = saved1;
-  const Register rvalptr = saved0;
-  __ movq(context, ArgReg0);
-  __ movq(rvalptr, ArgReg2);
-  
-  // Set up runtime registers.
-  __ movq(dat, Operand(context, static_cast<int32_t>(PluginContext::offsetOfMemory())));
-  __ movq(stk, Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())));
+
+  // Save the context and rval pointers in the frame. JIT code caches frame
+  // slots in the callee-saved registers, so they don't survive the call.
+  static const int32_t kContextOffset = kFpOffsetToPreAlignedSp - 8;
+  static const int32_t kRvalOffset = kFpOffsetToPreAlignedSp - 16;
+  __ push(ArgReg0);
+  __ push(ArgReg2);
+
+  // JIT code reaches the context through ctx, which it never changes.
+  __ movq(ctx, ArgReg0);
+
+  // Set up runtime registers. The stack pointer is a 32-bit offset, which
+  // movl will zero-extend.
+  __ movq(dat, Operand(ctx, static_cast<int32_t>(PluginContext::offsetOfMemory())));
+  __ movl(stk, Operand(ctx, static_cast<int32_t>(PluginContext::offsetOfSp())));
   __ addq(stk, dat);
+  __ movq(frm, stk);
 
   // Align the stack.
   __ andq(rsp, 0xfffffff0);
@@ -65,17 +83,21 @@ CodeStubs::CompileInvokeStub()
   __ call(ArgReg1);
 
   // Store the rval.
-  __ movq(Operand(rvalptr, 0), pri);
+  __ movq(scratch0, Operand(rbp, kRvalOffset));
+  __ movl(Operand(scratch0, 0), pri);
 
   // Store latest stk. If we have an error code, we'll jump directly to here,
   // so rax will already be set.
   Label ret;
   __ bind(&ret);
+  __ movq(scratch0, Operand(rbp, kContextOffset));
   __ subq(stk, dat);
-  __ movq(Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())), stk);
+  __ movl(Operand(scratch0, static_cast<int32_t>(PluginContext::offsetOfSp())), stk);
 
   // Restore registers and leave.
   __ leaq(rsp, Operand(rbp, kFpOffsetToPreAlignedSp));
+  __ pop(rdi);
+  __ pop(rsi);
   __ pop(r15);
   __ pop(r14);
   __ pop(r13);
@@ -96,6 +118,68 @@ CodeStubs::CompileInvokeStub()
   return_stub_ = reinterpret_cast<uint8_t*>(invoke_stub_.address()) + error.offset();
   return true;
 }
-#endif
+
+bool
+CodeStubs::CompileNativeStub()
+{
+  MacroAssembler masm;
+
+  // scratch0 = exit frame id
+  // scratch1 = native
+  //
+  // The call site's return address is already on the stack, so this is the
+  // same exit frame a call site makes inline, and the stack stays aligned:
+  //   56: Return address
+  //   48: Saved RBP
+  //   40: Frame type
+  //   32: Exit frame id
+  //   24: Saved RDX
+  //   16: Context
+  //    8: Saved HP
+  //    0: Native
+  __ push(rbp);
+  __ movq(AddressOperand(env_->addressOfExit()), rsp);
+  __ push(uint32_t(JitFrameType::Exit));
+  __ push(scratch0);
+  __ push(alt);
+  __ push(ctx);
+  __ movl(scratch0, Operand(ctx, int32_t(PluginContext::offsetOfHp())));
+  __ push(scratch0);
+  __ push(scratch1);
+
+  // Calls made here aren't inlined at the site, so they are counted here.
+  __ addl(AddressOperand(env_->addressOfNativeCalls()), 1);
+  __ addl(AddressOperand(env_->addressOfMemoEpoch()), 1);
+
+  // Relocate our absolute stk to be dat-relative, and update the context's
+  // view.
+  __ subq(stk, dat);
+  __ movl(Operand(ctx, int32_t(PluginContext::offsetOfSp())), stk);
+
+  // Argument registers overlap the ones we were given on some ABIs, so the
+  // arguments come from the stack.
+  __ movq(ArgReg1, Operand(rsp, 16));
+  __ leaq(ArgReg2, Operand(dat, stk, NoScale));
+  __ movq(ArgReg0, Operand(rsp, 0));
+  __ reserveShadowSpace();
+  __ callWithABI(ExternalAddress((void*)SharedNativeInvokeThunk));
+  __ releaseShadowSpace();
+
+  // Restore the heap pointer, ALT, and SP. ctx is callee-saved, so its
+  // saved copy is only there for the native's arguments.
+  __ addq(rsp, 8);
+  __ pop(scratch0);
+  __ addq(rsp, 8);
+  __ movl(Operand(ctx, int32_t(PluginContext::offsetOfHp())), scratch0);
+  __ pop(alt);
+  __ addq(stk, dat);
+
+  __ addq(rsp, 16);
+  __ pop(rbp);
+  __ ret();
+
+  native_stub_ = LinkCode(env_, masm);
+  return !!native_stub_.address();
+}
 
 } // namespace sp
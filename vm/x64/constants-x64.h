@@ -30,14 +30,34 @@ static const Register stk = r14;
 static const Register dat = r15;
 static const Register frm = rbx;
 
+// The running PluginContext. Compiled code reaches the context's fields
+// through it rather than through embedded addresses, so the same code can
+// run against any context of its plugin. It is callee-saved, so it survives
+// native calls, and every scripted call is made with the same context.
+static const Register ctx = r13;
+
 static const Register saved0 = r12;
-static const Register saved1 = r13;
 
+// Hot frame slots are cached in callee-saved registers, so they survive
+// native calls. Scripted calls clobber them.
+static const Register kSlotRegisters[] = { saved0 };
+static const size_t kNumSlotRegisters = sizeof(kSlotRegisters) / sizeof(kSlotRegisters[0]);
+
+// The reserved scratch register is used by the macro assembler to form
+// 64-bit addresses, often right before a call, so it must not be an argument
+// register on any ABI.
 static const Register scratch0 = rcx;
-static const Register scratch1 = r11;
+static const Register scratch1 = r8;
 static const Register scratch2 = r10;
 static const Register scratch3 = r9;
-static const Register reserved_scratch = r8;
+static const Register reserved_scratch = r11;
+
+// Space the caller must reserve above the return address for the callee.
+#if defined(KE_WINDOWS)
+static const int32_t kShadowSpace = 32;
+#else
+static const int32_t kShadowSpace = 0;
+#endif
 
 } // namespace sp
 
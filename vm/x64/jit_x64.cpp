@@ -0,0 +1,2245 @@
+/**
+ * vim: set ts=2 sw=2 tw=99 et:
+ * =============================================================================
+ * SourceMod
+ * Copyright (C) 2004-2008 AlliedModders LLC.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, AlliedModders LLC gives you permission to link the
+ * code of this program (as well as its derivative works) to "Half-Life 2," the
+ * "Source Engine," the "SourcePawn JIT," and any Game MODs that run on software
+ * by the Valve Corporation.  You must obey the GNU General Public License in
+ * all respects for all other code used.  Additionally, AlliedModders LLC grants
+ * this exception to all derivative works.  AlliedModders LLC defines further
+ * exceptions, found in LICENSE.txt (as of this writing, version JULY-31-2007),
+ * or <http://www.sourcemod.net/license.php>.
+ *
+ * Version: $Id$
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "jit_x64.h"
+#include "plugin-runtime.h"
+#include "plugin-context.h"
+#include "watchdog_timer.h"
+#include "environment.h"
+#include "code-stubs.h"
+#include "linking.h"
+#include "frames-x64.h"
+#include "outofline-asm.h"
+#include "method-info.h"
+#include "runtime-helpers.h"
+#include "debugging.h"
+#include "typed-natives.h"
+
+#define __ masm.
+
+namespace sp {
+
+static inline ConditionCode
+OpToCondition(CompareOp op)
+{
+  switch (op) {
+  case CompareOp::Eq:
+    return equal;
+  case CompareOp::Neq:
+    return not_equal;
+  case CompareOp::Sless:
+    return less;
+  case CompareOp::Sleq:
+    return less_equal;
+  case CompareOp::Sgrtr:
+    return greater;
+  case CompareOp::Sgeq:
+    return greater_equal;
+  default:
+    assert(false);
+    return negative;
+  }
+}
+
+Compiler::Compiler(PluginRuntime* rt, MethodInfo* method)
+ : CompilerBase(rt, method)
+{
+  // Code that will be saved to the code cache must not embed addresses that
+  // can't be rebased.
+  if (env_->code_cache())
+    masm.setRelocatable();
+}
+
+Compiler::~Compiler()
+{
+}
+
+
+// No exit frame - error code is returned directly.
+static int
+InvokeGenerateFullArray(PluginContext* cx, uint32_t argc, cell_t* argv, int autozero)
+{
+  return cx->generateFullArray(argc, argv, autozero);
+}
+
+// No exit frame - error code is returned directly.
+static int
+InvokeRebaseArray(PluginContext* cx,
+                  cell_t base_addr,
+                  cell_t dat_addr,
+                  cell_t iv_size,
+                  cell_t data_size)
+{
+  return cx->rebaseArray(base_addr, dat_addr, iv_size, data_size);
+}
+
+bool
+Compiler::visitMOVE(PawnReg reg)
+{
+  if (reg == PawnReg::Pri)
+    __ movl(pri, alt);
+  else
+    __ movl(alt, pri);
+  return true;
+}
+
+bool
+Compiler::visitXCHG()
+{
+  __ xchgl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitZERO(cell_t offset)
+{
+  __ movl(Operand(dat, offset), 0);
+  return true;
+}
+
+bool
+Compiler::visitZERO_S(cell_t offset)
+{
+  Register slot;
+  if (cachedSlot(offset, false, &slot)) {
+    __ movl(slot, 0);
+    __ movl(Operand(frm, offset), slot);
+    return true;
+  }
+  __ movl(Operand(frm, offset), 0);
+  return true;
+}
+
+bool
+Compiler::visitPUSH(PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ movl(Operand(stk, -4), reg);
+  __ subq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_C(const cell_t* vals, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++)
+    __ movl(Operand(stk, -(4 * int(i))), vals[i - 1]);
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_ADR(const cell_t* offsets, size_t nvals)
+{
+  // Compute the dat-relative frame address once, rather than relocating FRM.
+  __ movq(scratch2, frm);
+  __ subq(scratch2, dat);
+  for (size_t i = 1; i <= nvals; i++) {
+    __ leal(tmp, Operand(scratch2, offsets[i - 1]));
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_S(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++) {
+    Register slot;
+    if (cachedSlot(offsets[i - 1], true, &slot)) {
+      __ movl(Operand(stk, -(4 * int(i))), slot);
+      continue;
+    }
+    __ movl(tmp, Operand(frm, offsets[i - 1]));
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++) {
+    __ movl(tmp, Operand(dat, offsets[i - 1]));
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitZERO(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ xorl(reg, reg);
+  return true;
+}
+
+bool
+Compiler::visitADD()
+{
+  __ addl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitSUB()
+{
+  __ subl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitSUB_ALT()
+{
+  __ movl(tmp, alt);
+  __ subl(tmp, pri);
+  __ movl(pri, tmp);
+  return true;
+}
+
+void
+Compiler::emitPrologue()
+{
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+
+  // Push the old frame onto the stack.
+  __ subq(stk, 8);
+  __ movl(tmp, frmAddr());
+  __ movl(Operand(stk, 4), tmp);
+  __ movl(tmp, hpAddr());
+  __ movl(Operand(stk, 0), tmp);
+
+  // Get and store the new frame.
+  __ movq(tmp, stk);
+  __ movq(frm, stk);
+  __ subq(tmp, dat);
+  __ movl(frmAddr(), tmp);
+
+  if (needsStackCheck())
+    emitCheckStack();
+  if (env_->has_budgets())
+    emitBudgetCheck();
+
+  // Loops keep their hottest frame slots in registers.
+  FrameSlotAllocator allocator(rt_, graph_.get(), kNumSlotRegisters,
+                               env_->IsDebugBreakEnabled(), elements_.get());
+  slots_ = allocator.allocate();
+}
+
+void
+Compiler::emitCheckStack()
+{
+  int32_t max_stack = method_info_->max_stack();
+  assert(max_stack >= 0);
+
+  // Leave the guard for leaf callees, which don't check for themselves.
+  if (makes_calls_)
+    max_stack += kLeafStackGuard;
+
+  if (max_stack) {
+    __ movl(rax, hpAddr());
+    __ leaq(rax, Operand(dat, rax, NoScale, STACK_MARGIN));
+    __ leaq(rcx, Operand(stk, -max_stack));
+    __ cmpq(rcx, rax);
+    jumpOnError(below, SP_ERROR_STACKLOW);
+
+    // This is PluginContext::noteStackUse.
+    Label above_low_water;
+    __ subq(rcx, dat);
+    __ cmpl(contextField(PluginContext::offsetOfSpLowWater()), rcx);
+    __ j(below_equal, &above_low_water);
+    __ movl(contextField(PluginContext::offsetOfSpLowWater()), rcx);
+    __ bind(&above_low_water);
+  }
+}
+
+void
+Compiler::emitOsrEntry(Block* header)
+{
+  // The invoke stub has set up dat and stk. The interpreter has already
+  // pushed this function's frame, and then pri and alt.
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+  __ movl(frm, frmAddr());
+  __ addq(frm, dat);
+  emitCheckStack();
+  __ movl(alt, Operand(stk, 0));
+  __ movl(pri, Operand(stk, 4));
+  __ addq(stk, 8);
+
+  if (slots_) {
+    for (size_t i = 0; i < kNumSlotRegisters; i++) {
+      if (cell_t offset = slots_->slotAtLoopHeader(header->start(), i))
+        __ movl(kSlotRegisters[i], Operand(frm, offset));
+    }
+  }
+
+  __ jmp(header->label());
+}
+
+bool
+Compiler::visitSHL()
+{
+  __ movl(rcx, alt);
+  __ shll_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSHR()
+{
+  __ movl(rcx, alt);
+  __ shrl_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSSHR()
+{
+  __ movl(rcx, alt);
+  __ sarl_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSHL_C(PawnReg dest, cell_t amount)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ shll(reg, amount);
+  return true;
+}
+
+bool
+Compiler::visitSMUL()
+{
+  __ imull(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitNOT()
+{
+  __ testl(pri, pri);
+  __ movl(pri, 0);
+  __ set(zero, pri);
+  return true;
+}
+
+bool
+Compiler::visitNEG()
+{
+  __ negl(pri);
+  return true;
+}
+
+bool
+Compiler::visitXOR()
+{
+  __ xorl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitOR()
+{
+  __ orl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitAND()
+{
+  __ andl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitINVERT()
+{
+  __ notl(pri);
+  return true;
+}
+
+bool
+Compiler::visitADD_C(cell_t value)
+{
+  __ addl(pri, value);
+  return true;
+}
+
+bool
+Compiler::visitSMUL_C(cell_t value)
+{
+  __ imull(pri, pri, value);
+  return true;
+}
+
+bool
+Compiler::visitCompareOp(CompareOp op)
+{
+  ConditionCode cc = OpToCondition(op);
+  __ cmpl(pri, alt);
+  __ movl(pri, 0);
+  __ set(cc, pri);
+  return true;
+}
+
+bool
+Compiler::visitEQ_C(PawnReg src, cell_t value)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ cmpl(reg, value);
+  __ movl(pri, 0);
+  __ set(equal, pri);
+  return true;
+}
+
+bool
+Compiler::visitINC(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ addl(reg, 1);
+  return true;
+}
+
+bool
+Compiler::visitINC(cell_t offset)
+{
+  __ addl(Operand(dat, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitINC_S(cell_t offset)
+{
+  Register slot;
+  if (cachedSlot(offset, true, &slot)) {
+    __ addl(slot, 1);
+    __ movl(Operand(frm, offset), slot);
+    return true;
+  }
+  __ addl(Operand(frm, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitINC_I()
+{
+  __ addl(Operand(dat, pri, NoScale), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ subl(reg, 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC(cell_t offset)
+{
+  __ subl(Operand(dat, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC_S(cell_t offset)
+{
+  Register slot;
+  if (cachedSlot(offset, true, &slot)) {
+    __ subl(slot, 1);
+    __ movl(Operand(frm, offset), slot);
+    return true;
+  }
+  __ subl(Operand(frm, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC_I()
+{
+  __ subl(Operand(dat, pri, NoScale), 1);
+  return true;
+}
+
+bool
+Compiler::visitLOAD(PawnReg dest, cell_t srcaddr)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, Operand(dat, srcaddr));
+  return true;
+}
+
+bool
+Compiler::visitLOAD_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
+{
+  visitLOAD(PawnReg::Pri, offsetForPri);
+  visitLOAD(PawnReg::Alt, offsetForAlt);
+  return true;
+}
+
+bool
+Compiler::visitLOAD_S(PawnReg dest, cell_t srcoffs)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  Register slot;
+  if (inlining_) {
+    __ movl(reg, Operand(stk, srcoffs - kInlineFrameBias));
+    return true;
+  }
+  if (cachedSlot(srcoffs, true, &slot)) {
+    __ movl(reg, slot);
+    return true;
+  }
+  __ movl(reg, Operand(frm, srcoffs));
+  return true;
+}
+
+bool
+Compiler::visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
+{
+  visitLOAD_S(PawnReg::Pri, offsetForPri);
+  visitLOAD_S(PawnReg::Alt, offsetForAlt);
+  return true;
+}
+
+bool
+Compiler::visitLREF_S(PawnReg dest, cell_t srcoffs)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  Register slot;
+  if (inlining_) {
+    __ movl(reg, Operand(stk, srcoffs - kInlineFrameBias));
+    __ movl(reg, Operand(dat, reg, NoScale));
+    return true;
+  }
+  if (cachedSlot(srcoffs, true, &slot)) {
+    __ movl(reg, Operand(dat, slot, NoScale));
+    return true;
+  }
+  __ movl(reg, Operand(frm, srcoffs));
+  __ movl(reg, Operand(dat, reg, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitCONST(PawnReg dest, cell_t val)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, val);
+  return true;
+}
+
+bool
+Compiler::visitADDR(PawnReg dest, cell_t offset)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, frmAddr());
+  __ addl(reg, offset);
+  return true;
+}
+
+bool
+Compiler::visitSTOR(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ movl(Operand(dat, offset), reg);
+  return true;
+}
+
+bool
+Compiler::visitSTOR_S(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  Register slot;
+  if (cachedSlot(offset, false, &slot))
+    __ movl(slot, reg);
+  __ movl(Operand(frm, offset), reg);
+  return true;
+}
+
+bool
+Compiler::visitIDXADDR()
+{
+  __ leal(pri, Operand(alt, pri, ScaleFour));
+  return true;
+}
+
+bool
+Compiler::visitSREF_S(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  Register slot;
+  if (cachedSlot(offset, true, &slot)) {
+    __ movl(Operand(dat, slot, NoScale), reg);
+    return true;
+  }
+  __ movl(tmp, Operand(frm, offset));
+  __ movl(Operand(dat, tmp, NoScale), reg);
+  return true;
+}
+
+bool
+Compiler::visitPOP(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitSWAP(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(tmp, Operand(stk, 0));
+  __ movl(Operand(stk, 0), reg);
+  __ movl(reg, tmp);
+  return true;
+}
+
+bool
+Compiler::visitLIDX()
+{
+  __ leal(pri, Operand(alt, pri, ScaleFour));
+  __ movl(pri, Operand(dat, pri, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  // The index must still be in pri if the bounds check fails.
+  visitLOAD_S(PawnReg::Pri, index);
+  visitBOUNDS(limit);
+  visitADDR(PawnReg::Alt, array);
+  return visitLIDX();
+}
+
+bool
+Compiler::visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  visitLOAD_S(PawnReg::Pri, index);
+  visitBOUNDS(limit);
+  visitADDR(PawnReg::Alt, array);
+  return visitIDXADDR();
+}
+
+bool
+Compiler::visitCONST(cell_t offset, cell_t value)
+{
+  __ movl(Operand(dat, offset), value);
+  return true;
+}
+
+bool
+Compiler::visitCONST_S(cell_t offset, cell_t value)
+{
+  Register slot;
+  if (cachedSlot(offset, false, &slot)) {
+    __ movl(slot, value);
+    __ movl(Operand(frm, offset), slot);
+    return true;
+  }
+  __ movl(Operand(frm, offset), value);
+  return true;
+}
+
+bool
+Compiler::visitLOAD_I()
+{
+  // A constant-index element of a local array is a frame slot, and may be
+  // cached in a register like one.
+  cell_t offset;
+  if (elementSlot(&offset))
+    return visitLOAD_S(PawnReg::Pri, offset);
+
+  emitCheckAddress(pri);
+  __ movl(pri, Operand(dat, pri, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitSTOR_I()
+{
+  cell_t offset;
+  if (elementSlot(&offset))
+    return visitSTOR_S(offset, PawnReg::Pri);
+
+  emitCheckAddress(alt);
+  __ movl(Operand(dat, alt, NoScale), pri);
+  return true;
+}
+
+bool
+Compiler::visitSDIV(PawnReg dest)
+{
+  Register dividend = (dest == PawnReg::Pri) ? pri : alt;
+  Register divisor = (dest == PawnReg::Pri) ? alt : pri;
+
+  cell_t value;
+  if (knownConstant(dest == PawnReg::Pri ? PawnReg::Alt : PawnReg::Pri, &value) &&
+      emitConstantDivide(dividend, value))
+  {
+    return true;
+  }
+
+  // Guard against divide-by-zero.
+  __ testl(divisor, divisor);
+  jumpOnError(zero, SP_ERROR_DIVIDE_BY_ZERO);
+
+  // A more subtle case; -INT_MIN / -1 yields an overflow exception.
+  Label ok;
+  __ cmpl(divisor, -1);
+  __ j(not_equal, &ok);
+  __ cmpl(dividend, INT_MIN);
+  jumpOnError(equal, SP_ERROR_INTEGER_OVERFLOW);
+  __ bind(&ok);
+
+  // Now we can actually perform the divide.
+  __ movl(tmp, divisor);
+  if (dest == PawnReg::Pri)
+    __ movl(rdx, dividend);
+  else
+    __ movl(rax, dividend);
+  __ sarl(rdx, 31);
+  __ idivl(tmp);
+  return true;
+}
+
+// Divides |dividend| by a constant the way visitSDIV does, leaving the
+// quotient in PRI and the remainder in ALT. Returns false if |divisor| needs
+// the general path.
+bool
+Compiler::emitConstantDivide(Register dividend, int32_t divisor)
+{
+  if (divisor == 0 || divisor == INT_MIN)
+    return false;
+
+  if (divisor == 1 || divisor == -1) {
+    if (divisor == -1) {
+      __ cmpl(dividend, INT_MIN);
+      jumpOnError(equal, SP_ERROR_INTEGER_OVERFLOW);
+    }
+    if (dividend != pri)
+      __ movl(pri, dividend);
+    if (divisor == -1)
+      __ negl(pri);
+    __ xorl(alt, alt);
+    return true;
+  }
+
+  __ movl(tmp, dividend);
+
+  uint32_t magnitude = divisor < 0 ? 0u - uint32_t(divisor) : uint32_t(divisor);
+  if ((magnitude & (magnitude - 1)) == 0) {
+    uint8_t bits = 0;
+    while ((uint32_t(1) << bits) != magnitude)
+      bits++;
+
+    // Negative dividends are biased by |magnitude| - 1, so the shift rounds
+    // toward zero.
+    __ movl(pri, tmp);
+    if (bits > 1)
+      __ sarl(pri, 31);
+    __ shrl(pri, 32 - bits);
+    __ addl(pri, tmp);
+    __ movl(alt, pri);
+    __ andl(alt, -int32_t(magnitude));
+    __ sarl(pri, bits);
+    __ subl(tmp, alt);
+    __ movl(alt, tmp);
+    if (divisor < 0)
+      __ negl(pri);
+    return true;
+  }
+
+  int32_t multiplier, shift;
+  ComputeDivisionMagic(divisor, &multiplier, &shift);
+
+  // The high half of the product, corrected and shifted, rounds toward
+  // negative infinity; adding its sign bit rounds toward zero.
+  __ movl(pri, multiplier);
+  __ imull(tmp);
+  if (divisor > 0 && multiplier < 0)
+    __ addl(alt, tmp);
+  else if (divisor < 0 && multiplier > 0)
+    __ subl(alt, tmp);
+  if (shift)
+    __ sarl(alt, uint8_t(shift));
+  __ movl(pri, alt);
+  __ shrl(pri, 31);
+  __ addl(pri, alt);
+
+  __ imull(alt, pri, divisor);
+  __ subl(tmp, alt);
+  __ movl(alt, tmp);
+  return true;
+}
+
+bool
+Compiler::visitLODB_I(cell_t width)
+{
+  emitCheckAddress(pri);
+  __ movl(pri, Operand(dat, pri, NoScale));
+  if (width == 1)
+    __ andl(pri, 0xff);
+  else if (width == 2)
+    __ andl(pri, 0xffff);
+  return true;
+}
+
+bool
+Compiler::visitSTRB_I(cell_t width)
+{
+  emitCheckAddress(alt);
+  if (width == 1)
+    __ movb(Operand(dat, alt, NoScale), pri);
+  else if (width == 2)
+    __ movw(Operand(dat, alt, NoScale), pri);
+  else if (width == 4)
+    __ movl(Operand(dat, alt, NoScale), pri);
+  return true;
+}
+
+bool
+Compiler::visitRETN()
+{
+  // Restore the old stack and frame pointer.
+  __ movq(stk, frm);
+  __ movl(frm, Operand(stk, 4));              // get the old frm
+  __ movl(tmp, Operand(stk, 0));              // get the old hp
+  __ movl(hpAddr(), tmp);
+  __ addq(stk, 8);                            // pop stack
+  __ movl(frmAddr(), frm);                    // store back old frm
+  __ addq(frm, dat);                          // relocate
+
+  // Remove parameters.
+  __ movl(tmp, Operand(stk, 0));
+  __ leaq(stk, Operand(stk, tmp, ScaleFour, 4));
+
+  __ leaveFrame();
+  __ ret();
+  return true;
+}
+
+bool
+Compiler::visitMOVS(uint32_t amount)
+{
+  unsigned dwords = amount / 4;
+  unsigned bytes = amount % 4;
+
+  // Copying forward a cell at a time matches rep movsd, even if the ranges
+  // overlap.
+  if (amount <= kMaxUnrolledMoveBytes) {
+    int32_t offset = 0;
+    for (unsigned i = 0; i < dwords; i++, offset += 4) {
+      __ movl(tmp, Operand(dat, pri, NoScale, offset));
+      __ movl(Operand(dat, alt, NoScale, offset), tmp);
+    }
+    for (unsigned i = 0; i < bytes; i++, offset++) {
+      __ movzxb(tmp, Operand(dat, pri, NoScale, offset));
+      __ movb(Operand(dat, alt, NoScale, offset), tmp);
+    }
+    return true;
+  }
+
+  // rsi and rdi are not pinned, and the invoke stub preserves them for us.
+  __ cld();
+  __ leaq(rdi, Operand(dat, alt, NoScale));
+  __ leaq(rsi, Operand(dat, pri, NoScale));
+  if (dwords) {
+    __ movl(rcx, dwords);
+    __ rep_movsd();
+  }
+  if (bytes) {
+    __ movl(rcx, bytes);
+    __ rep_movsb();
+  }
+  return true;
+}
+
+bool
+Compiler::visitFILL(uint32_t amount)
+{
+  unsigned dwords = amount / 4;
+
+  cell_t offset;
+  if (elementSlot(&offset)) {
+    for (unsigned i = 0; i < dwords; i++)
+      visitSTOR_S(offset + i * 4, PawnReg::Pri);
+    return true;
+  }
+
+  if (amount <= kMaxUnrolledFillBytes) {
+    for (unsigned i = 0; i < dwords; i++)
+      __ movl(Operand(dat, alt, NoScale, i * 4), pri);
+    return true;
+  }
+
+  // eax/pri is used implicitly.
+  __ leaq(rdi, Operand(dat, alt, NoScale));
+  __ movl(rcx, dwords);
+  __ cld();
+  __ rep_stosd();
+  return true;
+}
+
+bool
+Compiler::visitSTRADJUST_PRI()
+{
+  __ addl(pri, 4);
+  __ sarl(pri, 2);
+  return true;
+}
+
+bool
+Compiler::visitFABS()
+{
+  __ movl(pri, Operand(stk, 0));
+  __ andl(pri, 0x7fffffff);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT()
+{
+  __ cvtsi2ss(xmm0, Operand(stk, 0));
+  __ movd(pri, xmm0);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitFLOATADD()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ addss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATSUB()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ subss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATMUL()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ mulss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATDIV()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ divss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_NEAREST()
+{
+  // Docs say that MXCSR must be preserved across function calls, so we
+  // assume that we'll always get the defualt round-to-nearest.
+  __ cvtss2si(pri, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_CEIL()
+{
+  if (MacroAssembler::Features().sse4_1) {
+    __ roundss(xmm0, Operand(stk, 0), kRoundUp);
+    __ cvttss2si(pri, xmm0);
+    __ addq(stk, 4);
+    return true;
+  }
+
+  // Truncate, then round up if truncation went the wrong way. Values that
+  // can't be represented come back as 0x80000000, matching x86.
+  Label done;
+  __ movss(xmm0, Operand(stk, 0));
+  __ cvttss2si(pri, xmm0);
+  __ cmpl(pri, INT_MIN);
+  __ j(equal, &done);
+  __ cvtsi2ss(xmm1, pri);
+  __ ucomiss(xmm1, xmm0);
+  __ j(not_above, &done);
+  __ addl(pri, 1);
+  __ bind(&done);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_ZERO() 
+{
+  __ cvttss2si(pri, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_FLOOR()
+{
+  if (MacroAssembler::Features().sse4_1) {
+    __ roundss(xmm0, Operand(stk, 0), kRoundDown);
+    __ cvttss2si(pri, xmm0);
+    __ addq(stk, 4);
+    return true;
+  }
+
+  // As above, but round down.
+  Label done;
+  __ movss(xmm0, Operand(stk, 0));
+  __ cvttss2si(pri, xmm0);
+  __ cmpl(pri, INT_MIN);
+  __ j(equal, &done);
+  __ cvtsi2ss(xmm1, pri);
+  __ ucomiss(xmm0, xmm1);
+  __ j(not_above, &done);
+  __ subl(pri, 1);
+  __ bind(&done);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitFLOATCMP()
+{
+  // This is the old float cmp, which returns ordered results. In newly
+  // compiled code it should not be used or generated.
+  //
+  // Note that the checks here are inverted: the test is |rhs OP lhs|.
+  Label bl, ab, done;
+  __ movss(xmm0, Operand(stk, 4));
+  __ ucomiss(Operand(stk, 0), xmm0);
+  __ j(above, &ab);
+  __ j(below, &bl);
+  __ xorl(pri, pri);
+  __ jmp(&done);
+  __ bind(&ab);
+  __ movl(pri, -1);
+  __ jmp(&done);
+  __ bind(&bl);
+  __ movl(pri, 1);
+  __ bind(&done);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT_CMP_OP(CompareOp op)
+{
+  ConditionCode code;
+  switch (op) {
+  case CompareOp::Sgrtr:
+    code = above;
+    break;
+  case CompareOp::Sgeq:
+    code = above_equal;
+    break;
+  case CompareOp::Sleq:
+    code = below_equal;
+    break;
+  case CompareOp::Sless:
+    code = below;
+    break;
+  case CompareOp::Eq:
+    code = equal;
+    break;
+  case CompareOp::Neq:
+    code = not_equal;
+    break;
+  default:
+    assert(false);
+    reportError(SP_ERROR_INVALID_INSTRUCTION);
+    return false;
+  }
+  emitFloatCmp(code);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT_NOT()
+{
+  __ xorps(xmm0, xmm0);
+  __ ucomiss(Operand(stk, 0), xmm0);
+
+  // See emitFloatCmp() - this is a shorter version.
+  Label done;
+  __ movl(pri, 1);
+  __ j(parity, &done);
+  __ set(zero, pri);
+  __ bind(&done);
+
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitSTACK(cell_t amount)
+{
+  __ addq(stk, amount);
+  return true;
+}
+
+bool
+Compiler::visitHEAP(cell_t amount)
+{
+  // Note: this must not clobber PRI.
+  __ movl(alt, hpAddr());
+  __ leal(tmp, Operand(alt, amount));
+  __ movl(hpAddr(), tmp);
+
+  // The first allocation of a run checks for the whole run.
+  cell_t reserve, peak;
+  if (amount > 0 && heap_checks_->isCovered(op_cip_))
+    return true;
+  if (amount > 0 && heap_checks_->leadsRun(op_cip_, &reserve, &peak)) {
+    __ leal(tmp, Operand(alt, peak));
+    emitNoteHeapUse(tmp);
+
+    __ leal(tmp, Operand(alt, reserve));
+    __ leaq(tmp, Operand(dat, tmp, NoScale, HeapMargin()));
+    __ cmpq(tmp, stk);
+    jumpOnError(above, SP_ERROR_HEAPLOW);
+    return true;
+  }
+
+  if (amount < 0) {
+    __ cmpl(tmp, contextField(PluginContext::offsetOfDataSize()));
+    jumpOnError(below, SP_ERROR_HEAPMIN);
+  } else {
+    emitNoteHeapUse(tmp);
+
+    __ leaq(tmp, Operand(dat, tmp, NoScale, HeapMargin()));
+    __ cmpq(tmp, stk);
+    jumpOnError(above, SP_ERROR_HEAPLOW);
+  }
+  return true;
+}
+
+bool
+Compiler::visitJUMP(cell_t offset)
+{
+  assert(block_->successors().size() == 1);
+
+  Block* successor = block_->successors()[0];
+  if (isNextBlock(successor)) {
+    // We'll visit this block next, and this terminates the block, so there's
+    // no need to emit a jump instruction.
+    assert(!isBackedge(successor));
+    return true;
+  }
+
+  Label* target = labelFor(successor);
+  if (isBackedge(successor)) {
+    if (env_->has_budgets())
+      emitBudgetCheck();
+    if (env_->polls_interrupts()) {
+      emitInterruptCheck();
+      __ jmp(target);
+      return true;
+    }
+    __ jmp32(target);
+    backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
+  } else {
+    __ jmp(target);
+  }
+  return true;
+}
+
+// Polls the interrupt flag at a loop back-edge. Must come before anything
+// that sets the flags for the back-edge itself.
+void
+Compiler::emitInterruptCheck()
+{
+  InterruptCheckPath* path = new InterruptCheckPath(op_cip_);
+  ool_paths_.push_back(path);
+
+  __ cmpl(AddressOperand(env_->addressOfInterrupt()), 0);
+  __ j(not_equal, path->label());
+}
+
+// Spends one unit of the invocation's budget. This clobbers the flags.
+void
+Compiler::emitBudgetCheck()
+{
+  __ subl(AddressOperand(env_->addressOfBudget()), 1);
+  jumpOnError(negative, SP_ERROR_BUDGET);
+}
+
+bool
+Compiler::visitJcmp(CompareOp op, cell_t offset)
+{
+  assert(block_->successors().size() == 2);
+  Block* fallthrough = block_->successors()[0];
+  Block* target = block_->successors()[1];
+
+  assert(!isBackedge(fallthrough));
+
+  bool poll = isBackedge(target) && env_->polls_interrupts();
+  if (poll)
+    emitInterruptCheck();
+
+  ConditionCode cc;
+  switch (op) {
+    case CompareOp::Zero:
+    case CompareOp::NotZero:
+      cc = (op == CompareOp::Zero) ? zero : not_zero;
+      __ testl(pri, pri);
+      break;
+    case CompareOp::Eq:
+    case CompareOp::Neq:
+    case CompareOp::Sless:
+    case CompareOp::Sleq:
+    case CompareOp::Sgrtr:
+    case CompareOp::Sgeq:
+      cc = OpToCondition(op);
+      __ cmpl(pri, alt);
+      break;
+    default:
+      assert(false);
+      return false;
+  }
+
+  if (isBackedge(target) && env_->has_budgets()) {
+    // Only a taken back-edge spends budget, as in the interpreter.
+    Label not_taken;
+    __ j(InvertConditionCode(cc), &not_taken);
+    emitBudgetCheck();
+    if (poll) {
+      __ jmp(labelFor(target));
+    } else {
+      __ jmp32(labelFor(target));
+      backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
+    }
+    __ bind(&not_taken);
+
+    if (!isNextBlock(fallthrough))
+      __ jmp(labelFor(fallthrough));
+    return true;
+  }
+
+  if (isBackedge(target) && !poll) {
+    __ j32(cc, labelFor(target));
+    backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
+
+    if (!isNextBlock(fallthrough))
+      __ jmp(labelFor(fallthrough));
+    return true;
+  }
+
+  if (isNextBlock(target)) {
+    // Invert the condition so we can fallthrough to the target instead.
+    __ j(InvertConditionCode(cc), labelFor(fallthrough));
+  } else {
+    __ j(cc, labelFor(target));
+    if (!isNextBlock(fallthrough))
+      __ jmp(labelFor(fallthrough));
+  }
+  return true;
+}
+
+
+bool
+Compiler::visitTRACKER_PUSH_C(cell_t amount)
+{
+  // The verifier rejects negative amounts.
+  assert(amount >= 0);
+  __ movl(scratch1, amount);
+  emitPushTracker(scratch1);
+  return true;
+}
+
+// This is PluginContext::pushTracker, without the call. Only scratch2 is
+// clobbered.
+void
+Compiler::emitPushTracker(Register amount)
+{
+  __ movl(scratch2, hpAddr());
+  __ leaq(scratch2, Operand(dat, scratch2, NoScale, HeapMargin()));
+  __ cmpq(scratch2, stk);
+  jumpOnError(above, SP_ERROR_TRACKER_BOUNDS);
+
+  __ movl(scratch2, hpAddr());
+  __ movl(Operand(dat, scratch2, NoScale, 0), amount);
+  __ addl(scratch2, sizeof(cell_t));
+  __ movl(hpAddr(), scratch2);
+  emitNoteHeapUse(scratch2);
+
+  Label below_high_water;
+  __ movl(scratch2, contextField(PluginContext::offsetOfTrackerDepth()));
+  __ addl(scratch2, 1);
+  __ movl(contextField(PluginContext::offsetOfTrackerDepth()), scratch2);
+  __ cmpl(contextField(PluginContext::offsetOfTrackerHighWater()), scratch2);
+  __ j(above_equal, &below_high_water);
+  __ movl(contextField(PluginContext::offsetOfTrackerHighWater()), scratch2);
+  __ bind(&below_high_water);
+}
+
+void
+Compiler::emitNoteHeapUse(Register hp)
+{
+  Label below_high_water;
+  __ cmpl(contextField(PluginContext::offsetOfHpHighWater()), hp);
+  __ j(above_equal, &below_high_water);
+  __ movl(contextField(PluginContext::offsetOfHpHighWater()), hp);
+  __ bind(&below_high_water);
+}
+
+bool
+Compiler::visitTRACKER_POP_SETHEAP()
+{
+  // This is PluginContext::popTrackerAndSetHeap, without the call. PRI and
+  // ALT must be preserved.
+  __ movl(tmp, hpAddr());
+  __ subl(tmp, sizeof(cell_t));
+  __ cmpl(tmp, contextField(PluginContext::offsetOfDataSize()));
+  jumpOnError(less, SP_ERROR_TRACKER_BOUNDS);
+
+  __ movl(scratch1, Operand(dat, tmp, NoScale, 0));
+  __ testl(scratch1, scratch1);
+  jumpOnError(negative, SP_ERROR_TRACKER_BOUNDS);
+  __ subl(tmp, scratch1);
+  __ cmpl(tmp, contextField(PluginContext::offsetOfDataSize()));
+  jumpOnError(less, SP_ERROR_TRACKER_BOUNDS);
+  __ movl(hpAddr(), tmp);
+  __ subl(contextField(PluginContext::offsetOfTrackerDepth()), 1);
+  return true;
+}
+
+bool
+Compiler::visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size)
+{
+  // We need to sync |sp| first.
+  syncSp();
+
+  __ push(pri);
+  __ push(alt);
+
+  // alt aliases an argument register on both ABIs, but it's saved above.
+  __ movl(ArgReg1, pri);
+  __ movl(ArgReg2, addr);
+  __ movl(ArgReg3, iv_size);
+#if defined(KE_WINDOWS)
+  // The fifth argument goes on the stack, above the shadow space.
+  __ subq(rsp, kShadowSpace + 16);
+  __ movl(Operand(rsp, kShadowSpace), data_size);
+#else
+  __ movl(ArgReg4, data_size);
+#endif
+  __ movq(ArgReg0, ctx);
+  __ callWithABI(ExternalAddress((void*)InvokeRebaseArray));
+#if defined(KE_WINDOWS)
+  __ addq(rsp, kShadowSpace + 16);
+#endif
+  __ testl(rax, rax);
+  jumpOnError(not_zero);
+
+  __ pop(alt);
+  __ pop(pri);
+  return true;
+}
+
+bool
+Compiler::visitBREAK()
+{
+  if (!Environment::get()->IsDebugBreakEnabled())
+    return true;
+
+  emitDebugBreakSite();
+  return true;
+}
+
+bool
+Compiler::visitHALT(cell_t value)
+{
+  // We don't support this. It's included in the bytestream by default, but it
+  // must be unreachable.
+  reportError(SP_ERROR_INVALID_INSTRUCTION);
+  return false;
+}
+
+bool
+Compiler::visitBOUNDS(uint32_t limit)
+{
+  if (isRedundantBoundsCheck())
+    return true;
+
+  OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, limit);
+  ool_paths_.push_back(bounds);
+
+  __ cmpl(pri, limit);
+  __ j(above, bounds->label());
+  return true;
+}
+
+void
+Compiler::emitCheckAddress(Register reg, int err)
+{
+  // Check if we're in memory bounds.
+  __ cmpl(reg, contextField(PluginContext::offsetOfMemSize()));
+  jumpOnError(not_below, err);
+
+  // Check if we're in the invalid region between hp and sp.
+  Label done;
+  __ movl(tmp, hpAddr());
+  __ cmpl(reg, tmp);
+  __ j(below, &done);
+  __ leaq(tmp, Operand(dat, reg, NoScale));
+  __ cmpq(tmp, stk);
+  jumpOnError(below, err);
+  __ bind(&done);
+}
+
+bool
+Compiler::visitGENARRAY(uint32_t dims, bool autozero)
+{
+  if (dims == 1)
+  {
+    // flat array; we can generate this without indirection tables.
+    // Note that we can overwrite ALT because technically STACK should be destroying ALT
+    __ addq(contextField(PluginContext::offsetOfArrayAllocs()), 1);
+    __ movl(alt, hpAddr());
+    __ movl(tmp, Operand(stk, 0));
+    __ movl(Operand(stk, 0), alt);    // store base of the array into the stack.
+    __ leal(alt, Operand(alt, tmp, ScaleFour));
+    __ movl(hpAddr(), alt);
+    __ addq(alt, dat);
+    __ cmpq(alt, stk);
+    jumpOnError(not_below, SP_ERROR_HEAPLOW);
+
+    // Track the size in bytes. pushTracker rejects sizes above INT_MAX.
+    __ shll(tmp, 2);
+    jumpOnError(negative, SP_ERROR_TRACKER_BOUNDS);
+    emitPushTracker(tmp);
+    __ shrl(tmp, 2);
+
+    if (autozero) {
+      // Note - tmp is rcx and still intact.
+      __ xorl(rax, rax);
+      __ movl(rdi, Operand(stk, 0));
+      __ addq(rdi, dat);
+      __ cld();
+      __ rep_stosd();
+    }
+  } else {
+    __ push(pri);
+    __ subq(rsp, 8);
+
+    // int GenerateArray(cx, vars[], uint32_t, cell_t*, int, unsigned*);
+    __ movq(ArgReg2, stk);
+    __ movl(ArgReg1, dims);
+    __ movl(ArgReg3, autozero ? 1 : 0);
+    __ movq(ArgReg0, ctx);
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress((void*)InvokeGenerateFullArray));
+    __ releaseShadowSpace();
+    __ addq(rsp, 8);
+
+    // restore pri to tmp
+    __ pop(tmp);
+
+    __ testl(rax, rax);
+    jumpOnError(not_zero);
+
+    // Move tmp back to pri, remove pushed args.
+    __ movl(pri, tmp);
+    __ addq(stk, (dims - 1) * 4);
+  }
+  return true;
+}
+
+class CallThunk : public OutOfLinePath
+{
+ public:
+  CallThunk(cell_t pcode_offset)
+   : pcode_offset(pcode_offset)
+  {
+  }
+
+  bool emit(Compiler* cc) override {
+    cc->emitCallThunk(this);
+    return true;
+  }
+
+  cell_t pcode_offset;
+};
+
+// Reaches a compiled method that turned out to be too far away for a rel32
+// call.
+class FarCall : public OutOfLinePath
+{
+ public:
+  FarCall(void* target)
+   : target(target)
+  {
+  }
+
+  bool emit(Compiler* cc) override {
+    cc->emitFarCall(this);
+    return true;
+  }
+
+  void* target;
+};
+
+bool
+Compiler::visitCALL(cell_t offset)
+{
+  if (tryInlineCall(offset))
+    return true;
+
+  // Relocatable code can't call other compiled methods directly, since they
+  // won't be at the same address next time. Off the VM thread, the method
+  // table can't be looked at. The thunk is patched into a direct call on
+  // first use anyway.
+  RefPtr<MethodInfo> method = offThread() ? nullptr : rt_->GetMethod(offset);
+  if (!method || !method->jit() || masm.relocatable()) {
+    // Need to emit a delayed thunk.
+    CallThunk* thunk = new CallThunk(offset);
+    __ callWithABI(thunk->label());
+    ool_paths_.push_back(thunk);
+  } else {
+    // Function is already emitted, so call it directly. This is a rel32 call
+    // unless the code lands too far away.
+    FarCall* far = new FarCall(method->jit()->GetEntryAddress());
+    __ assertStackAligned();
+    __ callNear(far->target, far->label());
+    ool_paths_.push_back(far);
+  }
+
+  // Map the return address to the cip that started this call.
+  emitCipMapping(op_cip_);
+  return true;
+}
+
+void
+Compiler::emitFarCall(FarCall* far)
+{
+  // The return address is already on the stack.
+  __ jmp(ExternalAddress(far->target));
+}
+
+void
+Compiler::emitInlineReturn()
+{
+  // Remove parameters.
+  __ movl(tmp, Operand(stk, 0));
+  __ leaq(stk, Operand(stk, tmp, ScaleFour, 4));
+}
+
+void
+Compiler::emitCallThunk(CallThunk* thunk)
+{
+  // Get the return address, since that is the call that we need to patch.
+  __ movq(rax, Operand(rsp, 0));
+
+  // A cold callee runs in the interpreter, which needs the context's view
+  // of the stack.
+  syncSp();
+
+  // Enter the exit frame. This aligns the stack.
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+
+  // Reserve room for the out-param, keeping the stack aligned.
+  static const int32_t kStackReserve = kShadowSpace + 16;
+  static_assert(sizeof(CallThunkResult) <= 16, "out-param must fit");
+  __ subq(rsp, kStackReserve);
+
+  // Set arguments. rax is not an argument register on either ABI.
+  __ movq(ArgReg3, rax);
+  __ leaq(ArgReg2, Operand(rsp, kShadowSpace));
+  __ movl(ArgReg1, thunk->pcode_offset);
+  __ movq(ArgReg0, ctx);
+
+  __ callWithABI(ExternalAddress((void*)CompileFromThunk));
+  __ movq(rdx, Operand(rsp, kShadowSpace + offsetof(CallThunkResult, target)));
+  __ movl(rcx, Operand(rsp, kShadowSpace + offsetof(CallThunkResult, result)));
+  __ leaveExitFrame();
+
+  __ testl(rax, rax);
+  jumpOnError(not_zero);
+
+  Label interpreted;
+  __ testq(rdx, rdx);
+  __ j(zero, &interpreted);
+  __ jmp(rdx);
+
+  // The interpreter has popped the callee's frame and arguments, so this
+  // returns straight to the call site.
+  __ bind(&interpreted);
+  AddressOperand exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(exn_code, 0);
+  __ j(not_zero, &return_reported_error_);
+  __ movl(stk, spAddr());
+  __ addq(stk, dat);
+  __ movl(pri, rcx);
+  __ ret();
+}
+
+bool
+Compiler::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
+{
+  NativeEntry* native = rt_->NativeAt(native_index);
+
+  // Store the number of parameters on the stack.
+  __ movl(Operand(stk, -4), nparams);
+  __ subq(stk, 4);
+  emitLegacyNativeCall(native_index, native, int32_t(nparams));
+  __ addq(stk, (nparams + 1) * sizeof(cell_t));
+  return true;
+}
+
+bool
+Compiler::visitSYSREQ_C(uint32_t native_index)
+{
+  emitLegacyNativeCall(native_index, rt_->NativeAt(native_index));
+  return true;
+}
+
+// Where a native call made by emitLegacyNativeCall resumes if the native left
+// an exception pending; see UnwindEntry.
+class NativeLandingPad : public OutOfLinePath
+{
+ public:
+  explicit NativeLandingPad(bool save_hp)
+   : save_hp(save_hp)
+  {}
+
+  bool emit(Compiler* cc) override {
+    cc->emitNativeLandingPad(this);
+    return true;
+  }
+
+  Label* resume() {
+    return &resume_;
+  }
+
+  bool save_hp;
+
+ private:
+  Label resume_;
+};
+
+// The native's return address, in words below the inline exit frame: the
+// frame's two words, saved ALT and HP, and the shadow space.
+static const uint32_t kNativeReturnSlot = 2 + 2 + kShadowSpace / sizeof(intptr_t) + 1;
+
+void
+Compiler::emitLegacyNativeCall(uint32_t native_index, NativeEntry* native, int32_t nparams)
+{
+  // A native bound with a plain function pointer can be called directly. If
+  // the host is allowed to rebind it, the direct call is guarded by the
+  // runtime's bind epoch and we keep the generic path as a fallback. Off
+  // the VM thread, the binding may be changing under us, so it is ignored.
+  // While the sampling profiler is on, every call goes through the thunk so
+  // it can take samples, and while native hooks are on, direct sites jump to
+  // the thunk so it can trace or record them.
+  bool bound = !offThread() && native->status == SP_NATIVE_BOUND;
+  bool immutable = bound && !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL));
+  bool direct = bound && native->legacy_fn && !Environment::get()->IsSamplingEnabled();
+  bool guarded = direct && !immutable;
+
+  // A typed native is called with its arguments in registers, which are
+  // checked before the call. That needs a binding that can't change and an
+  // argument count known here; anything else takes the thunk, which unpacks
+  // and checks them the same way.
+  const sp_typed_nativeinfo_t& sig = native->typed;
+  bool typed = immutable && sig.func && nparams == int32_t(sig.nargs) &&
+               !Environment::get()->IsSamplingEnabled();
+  if (typed) {
+    for (uint32_t i = 0; i < sig.nargs; i++) {
+      if (sig.args[i] != SP_NATIVEARG_REF && sig.args[i] != SP_NATIVEARG_STRING)
+        continue;
+      __ movl(scratch2, Operand(stk, (i + 1) * sizeof(cell_t)));
+      emitCheckAddress(scratch2, SP_ERROR_INVALID_ADDRESS);
+    }
+  }
+
+  // Natives that never re-enter the VM can't leave the heap pointer changed,
+  // so there is no need to save and restore it.
+  bool save_hp = !(immutable && (native->flags & SP_NTVFLAG_NOREENTRY));
+
+  // Sites that would only ever take the generic path share the environment's
+  // native stub, unless they need a landing pad of their own.
+  void* stub = env_->stubs()->NativeStub();
+  if (!direct && !typed && !env_->table_unwinding() && stub) {
+    __ movq(tmp, intptr_t(EncodeExitFrameId(ExitFrameType::Native, native_index)));
+    __ movq(scratch1, ExternalAddress(native));
+    __ call(ExternalAddress(stub));
+    emitCipMapping(op_cip_);
+
+    AddressOperand exn_code(Environment::get()->addressOfExceptionCode());
+    __ cmpl(exn_code, 0);
+    __ j(not_zero, &return_reported_error_);
+    return;
+  }
+
+  // A pure native's last result is remembered at the call site, and reused
+  // while the arguments and the memo epoch are the same. Calls to any other
+  // native move the epoch on.
+  bool pure = immutable && (native->flags & SP_NTVFLAG_PURE);
+  NativeMemo* memo = nullptr;
+  if (pure && (direct || typed) && nparams >= 0 && uint32_t(nparams) <= kMaxMemoArgs)
+    memo = rt_->NewNativeMemo(env_->memo_epoch());
+
+  Label memo_done;
+  if (memo) {
+    Label miss;
+    __ cmpl(AddressOperand(env_->addressOfNativeHooks()), 0);
+    __ j(not_equal, &miss);
+    __ movq(tmp, ExternalAddress(memo));
+    __ movl(scratch2, AddressOperand(env_->addressOfMemoEpoch()));
+    __ cmpl(scratch2, Operand(tmp, offsetof(NativeMemo, epoch)));
+    __ j(not_equal, &miss);
+    for (int32_t i = 0; i < nparams; i++) {
+      __ movl(scratch2, Operand(stk, (i + 1) * sizeof(cell_t)));
+      __ cmpl(scratch2, Operand(tmp, offsetof(NativeMemo, args) + i * sizeof(cell_t)));
+      __ j(not_equal, &miss);
+    }
+    __ movl(pri, Operand(tmp, offsetof(NativeMemo, result)));
+    __ jmp(&memo_done);
+    __ bind(&miss);
+  } else if (!pure) {
+    __ addl(AddressOperand(env_->addressOfMemoEpoch()), 1);
+  }
+
+  __ addl(AddressOperand(Environment::get()->addressOfNativeCalls()), 1);
+
+  CodeLabel return_address;
+  __ pushInlineExitFrame(ExitFrameType::Native, native_index, &return_address);
+
+  // Save ALT and the old heap pointer. Stack (16 bytes, aligned):
+  //   8: Saved RDX
+  //   0: Saved HP, or padding
+  __ push(alt);
+  if (save_hp) {
+    __ movl(tmp, hpAddr());
+    __ push(tmp);
+  } else {
+    __ subq(rsp, 8);
+  }
+
+  // Check whether the native is bound.
+  if (!immutable && !guarded) {
+    __ movl(tmp, AddressOperand(&native->status));
+    __ cmpl(tmp, SP_NATIVE_BOUND);
+    __ j(not_equal, &unbound_native_error_);
+  }
+
+  // Relocate our absolute stk to be dat-relative, and update the context's
+  // view.
+  __ subq(stk, dat);
+  __ movl(spAddr(), stk);
+
+  Label generic, done;
+  if (guarded) {
+    __ cmpl(AddressOperand(rt_->addressOfNativeEpoch()), int32_t(rt_->native_epoch()));
+    __ j(not_equal, &generic);
+  }
+
+  uint32_t direct_return = 0;
+  if (direct || typed) {
+    __ cmpl(AddressOperand(env_->addressOfNativeHooks()), 0);
+    __ j(not_equal, &generic);
+
+    if (typed) {
+      // Unpack the arguments; the checks above already passed.
+      static const Register kArgRegs[SP_TYPED_NATIVE_MAX_ARGS] = { ArgReg1, ArgReg2, ArgReg3 };
+      for (uint32_t i = 0; i < sig.nargs; i++) {
+        Register reg = kArgRegs[i];
+        __ movl(reg, Operand(dat, stk, NoScale, (i + 1) * sizeof(cell_t)));
+        if (sig.args[i] == SP_NATIVEARG_REF || sig.args[i] == SP_NATIVEARG_STRING)
+          __ leaq(reg, Operand(dat, reg, NoScale));
+      }
+    } else {
+      // Fast invoke, skip right to the function call.
+      __ leaq(ArgReg1, Operand(dat, stk, NoScale));
+    }
+    __ movq(ArgReg0, ctx);
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress(native->direct_fn()));
+    direct_return = masm.pc();
+    __ jmp(&done);
+    __ bind(&generic);
+  }
+  if (guarded) {
+    // The binding may have changed since we compiled, so re-check it.
+    __ movl(tmp, AddressOperand(&native->status));
+    __ cmpl(tmp, SP_NATIVE_BOUND);
+    __ j(not_equal, &unbound_native_error_);
+  }
+
+  // Slower invoke, go through a wrapper so we don't have to make this super
+  // complicated handling all the different calling conventions.
+  __ leaq(ArgReg2, Operand(dat, stk, NoScale));
+  __ movq(ArgReg1, ctx);
+  __ movq(ArgReg0, ExternalAddress(native));
+  __ reserveShadowSpace();
+  __ callWithABI(ExternalAddress((void*)NativeInvokeThunk));
+  __ bind(&done);
+  __ bind(&return_address);
+  // Map the return address to the cip that initiated this call.
+  emitCipMapping(op_cip_);
+
+  emitNativeCallReturn(save_hp);
+
+  if (env_->table_unwinding()) {
+    NativeLandingPad* pad = new NativeLandingPad(save_hp);
+    ool_paths_.push_back(pad);
+
+    // Natives called directly return to the site's jump to the common path,
+    // rather than to its return address.
+    uint32_t site = return_address.offset();
+    if (direct || typed)
+      addUnwindEntry(site, direct_return, kNativeReturnSlot, pad->label());
+    addUnwindEntry(site, site, kNativeReturnSlot, pad->label());
+
+    // A native that threw, even if it was caught, has no result to keep.
+    if (memo) {
+      emitStoreNativeMemo(memo, nparams);
+      __ bind(&memo_done);
+    }
+    __ bind(pad->resume());
+    return;
+  }
+
+  // Check for errors. Note we jump directly to the return stub since the
+  // error has already been reported.
+  AddressOperand exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(exn_code, 0);
+  __ j(not_zero, &return_reported_error_);
+
+  if (memo) {
+    emitStoreNativeMemo(memo, nparams);
+    __ bind(&memo_done);
+  }
+}
+
+// Remembers the result in PRI of a call to a pure native; see
+// emitLegacyNativeCall.
+void
+Compiler::emitStoreNativeMemo(NativeMemo* memo, int32_t nparams)
+{
+  __ movq(tmp, ExternalAddress(memo));
+  __ movl(scratch2, AddressOperand(env_->addressOfMemoEpoch()));
+  __ movl(Operand(tmp, offsetof(NativeMemo, epoch)), scratch2);
+  for (int32_t i = 0; i < nparams; i++) {
+    __ movl(scratch2, Operand(stk, (i + 1) * sizeof(cell_t)));
+    __ movl(Operand(tmp, offsetof(NativeMemo, args) + i * sizeof(cell_t)), scratch2);
+  }
+  __ movl(Operand(tmp, offsetof(NativeMemo, result)), pri);
+}
+
+void
+Compiler::emitNativeCallReturn(bool save_hp)
+{
+  __ releaseShadowSpace();
+
+  // Restore the heap pointer.
+  if (save_hp) {
+    __ movl(tmp, Operand(rsp, 0));
+    __ movl(hpAddr(), tmp);
+  }
+
+  // Restore ALT.
+  __ movq(alt, Operand(rsp, 8));
+
+  // Restore SP.
+  __ addq(stk, dat);
+
+  // Remove the inline frame, + our two saved words.
+  __ popInlineExitFrame(2);
+}
+
+void
+Compiler::emitNativeLandingPad(NativeLandingPad* pad)
+{
+  emitNativeCallReturn(pad->save_hp);
+
+  // The exception may have been caught before the native returned.
+  AddressOperand exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(exn_code, 0);
+  __ j(not_zero, &return_reported_error_);
+  __ jmp(pad->resume());
+}
+
+bool
+Compiler::visitSWITCH(cell_t defaultOffset,
+                      const CaseTableEntry* cases,
+                      size_t ncases)
+{
+  assert(block_->successors().size() == ncases + 1);
+  Block* defaultCase = block_->successors()[0];
+
+  // Degenerate - 0 cases.
+  if (!ncases) {
+    if (!isNextBlock(defaultCase))
+      __ jmp(defaultCase->label());
+    return true;
+  }
+
+  // Degenerate - 1 case.
+  if (ncases == 1) {
+    Block* maybe = block_->successors()[1];
+    __ cmpl(pri, cases[0].value);
+    __ j(equal, maybe->label());
+    if (!isNextBlock(defaultCase))
+      __ jmp(defaultCase->label());
+    return true;
+  }
+
+  // We have two or more cases, so let's generate a full switch. The compiler
+  // emits sorted tables; those get a jump table when the cases fill at least
+  // half of their range (gaps go to the default case), and a binary search
+  // otherwise. Anything else falls back to an if chain.
+  bool sorted = true;
+  for (size_t i = 1; i < ncases; i++) {
+    if (cases[i].value <= cases[i - 1].value) {
+      sorted = false;
+      break;
+    }
+  }
+  if (!sorted) {
+    emitCaseChain(cases, 0, ncases, defaultCase);
+    return true;
+  }
+
+  int64_t range = int64_t(cases[ncases - 1].value) - int64_t(cases[0].value) + 1;
+  bool dense = range <= int64_t(ncases) * 2;
+
+  // First check whether the bounds are correct: if (a < LOW || a > HIGH);
+  // this check is valid whether or not we emit a jump table.
+  cell_t low = cases[0].value;
+  if (low != 0) {
+    // negate it so we'll get a lower bound of 0.
+    low = -low;
+    __ leal(tmp, Operand(pri, low));
+  } else {
+    __ movl(tmp, pri);
+  }
+
+  __ cmpl(tmp, int32_t(range - 1));
+  __ j(above, defaultCase->label());
+
+  if (dense) {
+    // Optimized table version. Entries are 32-bit displacements relative to
+    // the end of each entry, so the table doesn't need 64-bit relocations.
+    CodeLabel table;
+    __ movq(scratch2, &table);
+    __ leaq(scratch2, Operand(scratch2, tmp, ScaleFour, 4));
+    __ movsxd(tmp, Operand(scratch2, -4));
+    __ addq(scratch2, tmp);
+    __ jmp(scratch2);
+
+    __ bind(&table);
+    size_t next = 0;
+    for (int64_t value = cases[0].value; value <= cases[ncases - 1].value; value++) {
+      Block* target = defaultCase;
+      if (cases[next].value == value)
+        target = block_->successors()[++next];
+      __ emit_jump_table_entry(target->label());
+    }
+  } else {
+    emitCaseTree(cases, 0, ncases, defaultCase);
+  }
+  return true;
+}
+
+// Compares against cases [begin, end) in order.
+void
+Compiler::emitCaseChain(const CaseTableEntry* cases, size_t begin, size_t end,
+                        Block* defaultCase)
+{
+  for (size_t i = begin; i < end; i++) {
+    Block* target = block_->successors()[i + 1];
+    __ cmpl(pri, cases[i].value);
+    __ j(equal, target->label());
+  }
+  __ jmp(defaultCase->label());
+}
+
+// Binary search over the sorted cases [begin, end), ending in short chains.
+void
+Compiler::emitCaseTree(const CaseTableEntry* cases, size_t begin, size_t end,
+                       Block* defaultCase)
+{
+  if (end - begin <= 4) {
+    emitCaseChain(cases, begin, end, defaultCase);
+    return;
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  Label upper;
+  __ cmpl(pri, cases[mid].value);
+  __ j(equal, block_->successors()[mid + 1]->label());
+  __ j(greater, &upper);
+  emitCaseTree(cases, begin, mid, defaultCase);
+  __ bind(&upper);
+  emitCaseTree(cases, mid + 1, end, defaultCase);
+}
+
+void
+Compiler::emitFloatCmp(ConditionCode cc)
+{
+  unsigned lhs = 4;
+  unsigned rhs = 0;
+  if (cc == below || cc == below_equal) {
+    // NaN results in ZF=1 PF=1 CF=1
+    //
+    // ja/jae check for ZF,CF=0 and CF=0. If we make all relational compares
+    // look like ja/jae, we'll guarantee all NaN comparisons will fail (which
+    // would not be true for jb/jbe, unless we checked with jp).
+    if (cc == below)
+      cc = above;
+    else
+      cc = above_equal;
+    rhs = 4;
+    lhs = 0;
+  }
+
+  __ movss(xmm0, Operand(stk, rhs));
+  __ ucomiss(Operand(stk, lhs), xmm0);
+
+  // An equal or not-equal needs special handling for the parity bit.
+  if (cc == equal || cc == not_equal) {
+    // If NaN, PF=1, ZF=1, and E/Z tests ZF=1.
+    //
+    // If NaN, PF=1, ZF=1 and NE/NZ tests Z=0. But, we want any != with NaNs
+    // to return true, including NaN != NaN.
+    //
+    // To make checks simpler, we set |eax| to the expected value of a NaN
+    // beforehand. This also clears the top bits of |eax| for setcc.
+    Label done;
+    __ movl(pri, (cc == equal) ? 0 : 1);
+    __ j(parity, &done);
+    __ set(cc, pri);
+    __ bind(&done);
+  } else {
+    __ movl(pri, 0);
+    __ set(cc, pri);
+  }
+  __ addq(stk, 8);
+}
+
+void
+Compiler::jumpOnError(ConditionCode cc, int err)
+{
+  // Note: we accept 0 for err. In this case we expect the error to be in eax.
+  __ j(cc, errorPathFor(err)->label());
+}
+
+bool
+Compiler::cachedSlot(cell_t offset, bool load, Register* reg)
+{
+  if (!slots_)
+    return false;
+
+  int index = slots_->registerFor(offset);
+  if (index < 0)
+    return false;
+
+  *reg = kSlotRegisters[index];
+  if (load && slots_->needsReload(op_cip_, offset))
+    __ movl(*reg, Operand(frm, offset));
+  return true;
+}
+
+void
+Compiler::syncSp()
+{
+  __ movq(tmp, stk);
+  __ subq(tmp, dat);
+  __ movl(spAddr(), tmp);
+}
+
+void
+Compiler::emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path)
+{
+  CodeLabel return_address;
+  __ alignStack();
+  __ pushInlineExitFrame(ExitFrameType::Helper, 0, &return_address);
+  __ movl(ArgReg0, pri);
+  __ movl(ArgReg1, path->bounds);
+  __ reserveShadowSpace();
+  __ callWithABI(ExternalAddress((void*)ReportOutOfBoundsError));
+  __ bind(&return_address);
+  emitCipMapping(path->cip);
+  __ releaseShadowSpace();
+  __ popInlineExitFrame(0);
+  __ jmp(&return_reported_error_);
+}
+
+void
+Compiler::emitErrorHandlers()
+{
+  Label return_to_invoke;
+
+  if (report_error_.used()) {
+    __ bind(&report_error_);
+
+    // Create the exit frame. We always get here through a call from the opcode
+    // (and always via an out-of-line thunk).
+    __ enterExitFrame(ExitFrameType::Helper, 0);
+
+    __ movl(ArgReg0, rax);
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress((void*)InvokeReportError));
+    __ leaveExitFrame();
+    __ jmp(&return_to_invoke);
+  }
+
+  // The unbound native path re-uses the native exit frame so the stack trace
+  // looks as if the native was bound.
+  if (unbound_native_error_.used()) {
+    __ bind(&unbound_native_error_);
+    __ alignStack();
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress((void*)ReportUnboundNative));
+    __ jmp(&return_reported_error_);
+  }
+
+  // The timeout uses a special stub.
+  if (throw_timeout_.used()) {
+    __ bind(&throw_timeout_);
+
+    // Create the exit frame.
+    __ enterExitFrame(ExitFrameType::Helper, 0);
+
+    // Since the return stub wipes out the stack, we don't need to addq after
+    // the call.
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress((void*)InvokeReportTimeout));
+    __ leaveExitFrame();
+    __ jmp(&return_reported_error_);
+  }
+
+  // We get here if we know an exception is already pending.
+  if (return_reported_error_.used()) {
+    __ bind(&return_reported_error_);
+    __ call(&return_to_invoke);
+  }
+
+  if (return_to_invoke.used()) {
+    __ bind(&return_to_invoke);
+
+    // We get here either through an explicit call, or a call that terminated
+    // in a tail-jmp here. The former is not guaranteed to be aligned.
+    __ enterExitFrame(ExitFrameType::Helper, 0);
+    __ alignStack();
+
+    // We cannot jump to the return stub just yet. We could be multiple frames
+    // deep, and our |rbp| does not match the initial frame. Find and restore
+    // it now.
+    __ reserveShadowSpace();
+    __ callWithABI(ExternalAddress((void*)find_entry_fp));
+    __ leaveExitFrame();
+
+    __ movq(rbp, rax);
+    __ jmp(ExternalAddress(env_->stubs()->ReturnStub()));
+  }
+}
+
+void
+Compiler::emitThrowPath(int err)
+{
+  __ movl(rax, err);
+  __ jmp(&report_error_);
+}
+
+void
+Compiler::emitDebugBreakHandler()
+{
+  if (!debug_break_.used())
+    return;
+
+  // Common path for invoking debugger.
+  __ bind(&debug_break_);
+
+  // Get and store the current stack pointer.
+  syncSp();
+
+  // Enter the exit frame. This aligns the stack.
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+
+  // Get the context pointer and call the debugging break handler.
+  __ xorl(ArgReg1, ArgReg1); // IErrorReport*
+  __ movq(ArgReg0, ctx);
+  __ reserveShadowSpace();
+  __ callWithABI(ExternalAddress((void *)InvokeDebugger));
+  __ leaveExitFrame();
+
+  // The debugger does not return an error code, so check whether it left an
+  // exception pending instead.
+  AddressOperand exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(exn_code, 0);
+  __ j(not_zero, &return_reported_error_);
+  __ ret();
+}
+
+void
+CompilerBase::PatchCallThunk(uint8_t* pc, void* target)
+{
+  // Calls are rel32. If the target is out of range, leave the thunk in
+  // place; it will keep resolving to the compiled function.
+  intptr_t delta = intptr_t(target) - intptr_t(pc);
+  if (delta < INT_MIN || delta > INT_MAX)
+    return;
+  *(int32_t*)WritableCodeAddress(pc - 4) = int32_t(delta);
+}
+
+} // namespace sp
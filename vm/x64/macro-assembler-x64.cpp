@@ -48,6 +48,27 @@ MacroAssembler::leaveExitFrame()
   leaveFrame();
 }
 
+void
+MacroAssembler::pushInlineExitFrame(ExitFrameType type, uintptr_t payload,
+                                    CodeLabel* return_address)
+{
+  {
+    ReserveScratch scratch(this);
+    movq(scratch.reg(), return_address);
+    push(scratch.reg());
+  }
+  push(rbp);
+  movq(AddressOperand(Environment::get()->addressOfExit()), rsp);
+  push(uint32_t(JitFrameType::Exit));
+  push(EncodeExitFrameId(type, payload));
+}
+
+void
+MacroAssembler::popInlineExitFrame(uint32_t extra_argc)
+{
+  addq(rsp, (4 + extra_argc) * sizeof(uintptr_t));
+}
+
 void
 MacroAssembler::alignStack()
 {
@@ -69,7 +90,7 @@ MacroAssembler::assertStackAligned()
 void
 MacroAssembler::movq(const AddressOperand& dest, Register src)
 {
-  if (dest.has32BitEncoding() || src == rax) {
+  if (useAbsolute32(dest) || src == rax) {
     Assembler::movq(dest, src);
   } else {
     ReserveScratch scratch(this);
@@ -81,7 +102,7 @@ MacroAssembler::movq(const AddressOperand& dest, Register src)
 void
 MacroAssembler::movq(Register dest, const AddressOperand& src)
 {
-  if (src.has32BitEncoding() || dest == rax) {
+  if (useAbsolute32(src) || dest == rax) {
     Assembler::movq(dest, src);
   } else {
     ReserveScratch scratch(this);
@@ -93,7 +114,7 @@ MacroAssembler::movq(Register dest, const AddressOperand& src)
 void
 MacroAssembler::movl(const AddressOperand& dest, Register src)
 {
-  if (dest.has32BitEncoding()) {
+  if (useAbsolute32(dest)) {
     Assembler::movl(Operand(dest.asValue()), src);
   } else {
     ReserveScratch scratch(this);
@@ -105,7 +126,7 @@ MacroAssembler::movl(const AddressOperand& dest, Register src)
 void
 MacroAssembler::movl(Register dest, const AddressOperand& src)
 {
-  if (src.has32BitEncoding()) {
+  if (useAbsolute32(src)) {
     Assembler::movl(dest, Operand(src.asValue()));
   } else {
     ReserveScratch scratch(this);
@@ -117,12 +138,60 @@ MacroAssembler::movl(Register dest, const AddressOperand& src)
 void
 MacroAssembler::cmpl(const AddressOperand& dest, int32_t imm)
 {
-  if (dest.has32BitEncoding()) {
+  if (useAbsolute32(dest)) {
     cmpl(Operand(dest.asValue()), imm);
   } else {
     ReserveScratch scratch(this);
     movq(scratch.reg(), dest.asValue());
-    cmpl(Operand(scratch.reg(), 0), 0);
+    cmpl(Operand(scratch.reg(), 0), imm);
+  }
+}
+
+void
+MacroAssembler::cmpl(const AddressOperand& dest, Register src)
+{
+  if (useAbsolute32(dest)) {
+    cmpl(Operand(dest.asValue()), src);
+  } else {
+    ReserveScratch scratch(this);
+    movq(scratch.reg(), dest.asValue());
+    cmpl(Operand(scratch.reg(), 0), src);
+  }
+}
+
+void
+MacroAssembler::addl(const AddressOperand& dest, int32_t imm)
+{
+  if (useAbsolute32(dest)) {
+    addl(Operand(dest.asValue()), imm);
+  } else {
+    ReserveScratch scratch(this);
+    movq(scratch.reg(), dest.asValue());
+    addl(Operand(scratch.reg(), 0), imm);
+  }
+}
+
+void
+MacroAssembler::addq(const AddressOperand& dest, int32_t imm)
+{
+  if (useAbsolute32(dest)) {
+    addq(Operand(dest.asValue()), imm);
+  } else {
+    ReserveScratch scratch(this);
+    movq(scratch.reg(), dest.asValue());
+    addq(Operand(scratch.reg(), 0), imm);
+  }
+}
+
+void
+MacroAssembler::subl(const AddressOperand& dest, int32_t imm)
+{
+  if (useAbsolute32(dest)) {
+    subl(Operand(dest.asValue()), imm);
+  } else {
+    ReserveScratch scratch(this);
+    movq(scratch.reg(), dest.asValue());
+    subl(Operand(scratch.reg(), 0), imm);
   }
 }
 
@@ -38,6 +38,10 @@ class MacroAssembler : public Assembler
   void enterExitFrame(ExitFrameType type, uintptr_t payload);
   void leaveExitFrame();
 
+  // Inline exit frames are four words, so an aligned stack stays aligned.
+  void pushInlineExitFrame(ExitFrameType type, uintptr_t payload, CodeLabel* return_address);
+  void popInlineExitFrame(uint32_t extra_argc);
+
   void assertStackAligned();
 
   void alignStack();
@@ -51,10 +55,29 @@ class MacroAssembler : public Assembler
 
   using Assembler::cmpl;
   void cmpl(const AddressOperand& dest, int32_t imm);
+  void cmpl(const AddressOperand& dest, Register src);
+
+  using Assembler::addl;
+  void addl(const AddressOperand& dest, int32_t imm);
+  using Assembler::addq;
+  void addq(const AddressOperand& dest, int32_t imm);
+  using Assembler::subl;
+  void subl(const AddressOperand& dest, int32_t imm);
 
   using Assembler::call;
   void call(const AddressValue& address);
 
+  // Windows callees may spill their register arguments into space reserved
+  // by the caller. These are no-ops elsewhere.
+  void reserveShadowSpace() {
+    if (kShadowSpace)
+      subq(rsp, kShadowSpace);
+  }
+  void releaseShadowSpace() {
+    if (kShadowSpace)
+      addq(rsp, kShadowSpace);
+  }
+
   template <typename T>
   void callWithABI(const T& address) {
     assertStackAligned();
@@ -64,6 +87,13 @@ class MacroAssembler : public Assembler
   using Assembler::jmp;
   void jmp(const AddressValue& address);
 
+ private:
+  // Absolute addresses can't be encoded as 32-bit displacements if the code
+  // has to be relocatable.
+  bool useAbsolute32(const AddressOperand& address) const {
+    return !relocatable() && address.has32BitEncoding();
+  }
+
  private:
   ReserveScratch* scratch_reserved_;
 };
@@ -115,6 +115,14 @@ struct CPUFeatures
   bool avx2;
 };
 
+// Rounding modes for ROUNDSS. The precision exception is always suppressed.
+enum RoundMode {
+  kRoundNearest = 0x8,
+  kRoundDown = 0x9,
+  kRoundUp = 0xa,
+  kRoundTowardZero = 0xb
+};
+
 const Register eax = { 0 };
 const Register ecx = { 1 };
 const Register edx = { 2 };
@@ -582,6 +590,10 @@ class Assembler : public AssemblerBase
   void notl(const Operand& srcdest) {
     emit1(0xf7, 2, srcdest);
   }
+  // edx:eax = eax * src.
+  void imull(Register src) {
+    emit1(0xf7, 5, src.code);
+  }
   void idivl(Register dividend) {
     emit1(0xf7, 7, dividend.code);
   }
@@ -838,6 +850,17 @@ class Assembler : public AssemblerBase
     assert(Features().sse);
     emit3(0xf3, 0x0f, 0x2c, dest.code, src);
   }
+  void cvttss2si(Register dest, FloatRegister src) {
+    assert(Features().sse);
+    emit3(0xf3, 0x0f, 0x2c, dest.code, src.code);
+  }
+  void roundss(FloatRegister dest, const Operand& src, RoundMode mode) {
+    assert(Features().sse4_1);
+    ensureSpace();
+    *pos_++ = 0x66;
+    emit3(0x0f, 0x3a, 0x0a, dest.code, src);
+    *pos_++ = uint8_t(mode);
+  }
   void cvtss2si(Register dest, Register src) {
     assert(Features().sse);
     emit3(0xf3, 0x0f, 0x2d, dest.code, src.code);
@@ -897,15 +920,20 @@ class Assembler : public AssemblerBase
     *reinterpret_cast<int32_t*>(ip - 4) = delta;
   }
 
-  void emitToExecutableMemory(void* code) {
+  // Code is written to |writable| (by default, |code| itself) but fixed up
+  // for running at |code|.
+  void emitToExecutableMemory(void* code, void* writable = nullptr) {
     assert(!outOfMemory());
 
     // Relocate anything we emitted as rel32 with an external pointer.
     uint8_t* base = reinterpret_cast<uint8_t*>(code);
-    memcpy(base, buffer(), length());
+    uint8_t* out = writable ? reinterpret_cast<uint8_t*>(writable) : base;
+    memcpy(out, buffer(), length());
     for (size_t i = 0; i < external_refs_.size(); i++) {
       size_t offset = external_refs_[i];
-      PatchRel32Absolute(base + offset, *reinterpret_cast<void**>(base + offset - 4));
+      void* target = *reinterpret_cast<void**>(out + offset - 4);
+      *reinterpret_cast<int32_t*>(out + offset - 4) =
+        int32_t(reinterpret_cast<intptr_t>(target) - reinterpret_cast<intptr_t>(base + offset));
     }
 
     // Relocate everything we emitted as an abs32 with an internal offset. Note
@@ -913,8 +941,8 @@ class Assembler : public AssemblerBase
     // and CodeLabel.
     for (size_t i = 0; i < local_refs_.size(); i++) {
       size_t offset = local_refs_[i];
-      int32_t delta = *reinterpret_cast<int32_t*>(base + offset - 4);
-      *reinterpret_cast<void**>(base + offset - 4) = base + offset + delta;
+      int32_t delta = *reinterpret_cast<int32_t*>(out + offset - 4);
+      *reinterpret_cast<void**>(out + offset - 4) = base + offset + delta;
     }
   }
 
@@ -44,6 +44,7 @@
 #include "method-info.h"
 #include "runtime-helpers.h"
 #include "debugging.h"
+#include "typed-natives.h"
 
 #define __ masm.
 
@@ -80,20 +81,6 @@ Compiler::~Compiler()
 {
 }
 
-// No exit frame - error code is returned directly.
-static int
-InvokePushTracker(PluginContext* cx, uint32_t amount)
-{
-  return cx->pushTracker(amount);
-}
-
-// No exit frame - error code is returned directly.
-static int
-InvokePopTrackerAndSetHeap(PluginContext* cx)
-{
-  return cx->popTrackerAndSetHeap();
-}
-
 // No exit frame - error code is returned directly.
 static int
 InvokeGenerateFullArray(PluginContext* cx, uint32_t argc, cell_t* argv, int autozero)
@@ -247,18 +234,54 @@ Compiler::emitPrologue()
   __ subl(tmp, dat);
   __ movl(Operand(frmAddr()), tmp);
 
+  if (needsStackCheck())
+    emitCheckStack();
+  if (env_->has_budgets())
+    emitBudgetCheck();
+}
+
+void
+Compiler::emitCheckStack()
+{
   int32_t max_stack = method_info_->max_stack();
   assert(max_stack >= 0);
 
+  // Leave the guard for leaf callees, which don't check for themselves.
+  if (makes_calls_)
+    max_stack += kLeafStackGuard;
+
   if (max_stack) {
     __ movl(eax, Operand(hpAddr()));
     __ lea(eax, Operand(dat, eax, NoScale, STACK_MARGIN));
     __ lea(ecx, Operand(stk, -max_stack));
     __ cmpl(ecx, eax);
     jumpOnError(below, SP_ERROR_STACKLOW);
+
+    // This is PluginContext::noteStackUse.
+    Label above_low_water;
+    __ subl(ecx, dat);
+    __ cmpl(Operand(ExternalAddress(context_->addressOfSpLowWater())), ecx);
+    __ j(below_equal, &above_low_water);
+    __ movl(Operand(ExternalAddress(context_->addressOfSpLowWater())), ecx);
+    __ bind(&above_low_water);
   }
 }
 
+void
+Compiler::emitOsrEntry(Block* header)
+{
+  // The invoke stub has set up dat and stk. The interpreter has already
+  // pushed this function's frame, and then pri and alt.
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+  __ movl(frm, Operand(frmAddr()));
+  __ addl(frm, dat);
+  emitCheckStack();
+  __ movl(alt, Operand(stk, 0));
+  __ movl(pri, Operand(stk, 4));
+  __ addl(stk, 8);
+  __ jmp(header->label());
+}
+
 bool
 Compiler::visitSHL()
 {
@@ -454,7 +477,10 @@ bool
 Compiler::visitLOAD_S(PawnReg dest, cell_t srcoffs)
 {
   Register reg = (dest == PawnReg::Pri) ? pri : alt;
-  __ movl(reg, Operand(frm, srcoffs));
+  if (inlining_)
+    __ movl(reg, Operand(stk, srcoffs - kInlineFrameBias));
+  else
+    __ movl(reg, Operand(frm, srcoffs));
   return true;
 }
 
@@ -470,7 +496,10 @@ bool
 Compiler::visitLREF_S(PawnReg dest, cell_t srcoffs)
 {
   Register reg = (dest == PawnReg::Pri) ? pri : alt;
-  __ movl(reg, Operand(frm, srcoffs));
+  if (inlining_)
+    __ movl(reg, Operand(stk, srcoffs - kInlineFrameBias));
+  else
+    __ movl(reg, Operand(frm, srcoffs));
   __ movl(reg, Operand(dat, reg, NoScale));
   return true;
 }
@@ -551,6 +580,25 @@ Compiler::visitLIDX()
   return true;
 }
 
+bool
+Compiler::visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  // The index must still be in pri if the bounds check fails.
+  visitLOAD_S(PawnReg::Pri, index);
+  visitBOUNDS(limit);
+  visitADDR(PawnReg::Alt, array);
+  return visitLIDX();
+}
+
+bool
+Compiler::visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit)
+{
+  visitLOAD_S(PawnReg::Pri, index);
+  visitBOUNDS(limit);
+  visitADDR(PawnReg::Alt, array);
+  return visitIDXADDR();
+}
+
 bool
 Compiler::visitCONST(cell_t offset, cell_t value)
 {
@@ -587,6 +635,13 @@ Compiler::visitSDIV(PawnReg dest)
   Register dividend = (dest == PawnReg::Pri) ? pri : alt;
   Register divisor = (dest == PawnReg::Pri) ? alt : pri;
 
+  cell_t value;
+  if (knownConstant(dest == PawnReg::Pri ? PawnReg::Alt : PawnReg::Pri, &value) &&
+      emitConstantDivide(dividend, value))
+  {
+    return true;
+  }
+
   // Guard against divide-by-zero.
   __ testl(divisor, divisor);
   jumpOnError(zero, SP_ERROR_DIVIDE_BY_ZERO);
@@ -610,6 +665,76 @@ Compiler::visitSDIV(PawnReg dest)
   return true;
 }
 
+// Divides |dividend| by a constant the way visitSDIV does, leaving the
+// quotient in PRI and the remainder in ALT. Returns false if |divisor| needs
+// the general path.
+bool
+Compiler::emitConstantDivide(Register dividend, int32_t divisor)
+{
+  if (divisor == 0 || divisor == int32_t(0x80000000))
+    return false;
+
+  if (divisor == 1 || divisor == -1) {
+    if (divisor == -1) {
+      __ cmpl(dividend, 0x80000000);
+      jumpOnError(equal, SP_ERROR_INTEGER_OVERFLOW);
+    }
+    if (dividend != pri)
+      __ movl(pri, dividend);
+    if (divisor == -1)
+      __ negl(pri);
+    __ xorl(alt, alt);
+    return true;
+  }
+
+  __ movl(tmp, dividend);
+
+  uint32_t magnitude = divisor < 0 ? 0u - uint32_t(divisor) : uint32_t(divisor);
+  if ((magnitude & (magnitude - 1)) == 0) {
+    uint8_t bits = 0;
+    while ((uint32_t(1) << bits) != magnitude)
+      bits++;
+
+    // Negative dividends are biased by |magnitude| - 1, so the shift rounds
+    // toward zero.
+    __ movl(pri, tmp);
+    if (bits > 1)
+      __ sarl(pri, 31);
+    __ shrl(pri, 32 - bits);
+    __ addl(pri, tmp);
+    __ movl(alt, pri);
+    __ andl(alt, -int32_t(magnitude));
+    __ sarl(pri, bits);
+    __ subl(tmp, alt);
+    __ movl(alt, tmp);
+    if (divisor < 0)
+      __ negl(pri);
+    return true;
+  }
+
+  int32_t multiplier, shift;
+  ComputeDivisionMagic(divisor, &multiplier, &shift);
+
+  // The high half of the product, corrected and shifted, rounds toward
+  // negative infinity; adding its sign bit rounds toward zero.
+  __ movl(pri, multiplier);
+  __ imull(tmp);
+  if (divisor > 0 && multiplier < 0)
+    __ addl(alt, tmp);
+  else if (divisor < 0 && multiplier > 0)
+    __ subl(alt, tmp);
+  if (shift)
+    __ sarl(alt, uint8_t(shift));
+  __ movl(pri, alt);
+  __ shrl(pri, 31);
+  __ addl(pri, alt);
+
+  __ imull(alt, pri, divisor);
+  __ subl(tmp, alt);
+  __ movl(alt, tmp);
+  return true;
+}
+
 bool
 Compiler::visitLODB_I(cell_t width)
 {
@@ -662,6 +787,21 @@ Compiler::visitMOVS(uint32_t amount)
   unsigned dwords = amount / 4;
   unsigned bytes = amount % 4;
 
+  // Copying forward a cell at a time matches rep movsd, even if the ranges
+  // overlap.
+  if (amount <= kMaxUnrolledMoveBytes) {
+    int32_t offset = 0;
+    for (unsigned i = 0; i < dwords; i++, offset += 4) {
+      __ movl(tmp, Operand(dat, pri, NoScale, offset));
+      __ movl(Operand(dat, alt, NoScale, offset), tmp);
+    }
+    for (unsigned i = 0; i < bytes; i++, offset++) {
+      __ movzxb(tmp, Operand(dat, pri, NoScale, offset));
+      __ movb(Operand(dat, alt, NoScale, offset), tmp);
+    }
+    return true;
+  }
+
   __ cld();
   __ push(esi);
   __ push(edi);
@@ -685,8 +825,14 @@ Compiler::visitMOVS(uint32_t amount)
 bool
 Compiler::visitFILL(uint32_t amount)
 {
-  // eax/pri is used implicitly.
   unsigned dwords = amount / 4;
+  if (amount <= kMaxUnrolledFillBytes) {
+    for (unsigned i = 0; i < dwords; i++)
+      __ movl(Operand(dat, alt, NoScale, i * 4), pri);
+    return true;
+  }
+
+  // eax/pri is used implicitly.
   __ push(edi);
   __ lea(edi, Operand(dat, alt, NoScale));
   __ movl(ecx, dwords);
@@ -821,6 +967,13 @@ Compiler::visitRND_TO_NEAREST()
 bool
 Compiler::visitRND_TO_CEIL()
 {
+  if (MacroAssembler::Features().sse4_1) {
+    __ roundss(xmm0, Operand(stk, 0), kRoundUp);
+    __ cvttss2si(pri, xmm0);
+    __ addl(stk, 4);
+    return true;
+  }
+
   // Adapted from http://wurstcaptures.untergrund.net/assembler_tricks.html#fastfloorf
   // (the above does not support the full integer range)
   static float kRoundToCeil = -0.5f;
@@ -873,6 +1026,13 @@ Compiler::visitRND_TO_ZERO()
 bool
 Compiler::visitRND_TO_FLOOR()
 {
+  if (MacroAssembler::Features().sse4_1) {
+    __ roundss(xmm0, Operand(stk, 0), kRoundDown);
+    __ cvttss2si(pri, xmm0);
+    __ addl(stk, 4);
+    return true;
+  }
+
   __ fld32(Operand(stk, 0));
   __ subl(esp, 8);
   __ fstcw(Operand(esp, 4));
@@ -987,12 +1147,29 @@ Compiler::visitHEAP(cell_t amount)
   __ movl(alt, Operand(hpAddr()));
   __ addl(Operand(hpAddr()), amount);
 
+  // The first allocation of a run checks for the whole run.
+  cell_t reserve, peak;
+  if (amount > 0 && heap_checks_->isCovered(op_cip_))
+    return true;
+  if (amount > 0 && heap_checks_->leadsRun(op_cip_, &reserve, &peak)) {
+    __ lea(tmp, Operand(alt, peak));
+    emitNoteHeapUse(tmp);
+
+    __ lea(tmp, Operand(alt, reserve));
+    __ lea(tmp, Operand(dat, tmp, NoScale, HeapMargin()));
+    __ cmpl(tmp, stk);
+    jumpOnError(above, SP_ERROR_HEAPLOW);
+    return true;
+  }
+
   if (amount < 0) {
     __ cmpl(Operand(hpAddr()), context_->DataSize());
     jumpOnError(below, SP_ERROR_HEAPMIN);
   } else {
     __ movl(tmp, Operand(hpAddr()));
-    __ lea(tmp, Operand(dat, ecx, NoScale, STACK_MARGIN));
+    emitNoteHeapUse(tmp);
+
+    __ lea(tmp, Operand(dat, ecx, NoScale, HeapMargin()));
     __ cmpl(tmp, stk);
     jumpOnError(above, SP_ERROR_HEAPLOW);
   }
@@ -1012,8 +1189,15 @@ Compiler::visitJUMP(cell_t offset)
     return true;
   }
 
-  Label* target = successor->label();
+  Label* target = labelFor(successor);
   if (isBackedge(successor)) {
+    if (env_->has_budgets())
+      emitBudgetCheck();
+    if (env_->polls_interrupts()) {
+      emitInterruptCheck();
+      __ jmp(target);
+      return true;
+    }
     __ jmp32(target);
     backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
   } else {
@@ -1022,9 +1206,39 @@ Compiler::visitJUMP(cell_t offset)
   return true;
 }
 
+// Polls the interrupt flag at a loop back-edge. Must come before anything
+// that sets the flags for the back-edge itself.
+void
+Compiler::emitInterruptCheck()
+{
+  InterruptCheckPath* path = new InterruptCheckPath(op_cip_);
+  ool_paths_.push_back(path);
+
+  __ cmpl(Operand(ExternalAddress(env_->addressOfInterrupt())), 0);
+  __ j(not_equal, path->label());
+}
+
+// Spends one unit of the invocation's budget. This clobbers the flags.
+void
+Compiler::emitBudgetCheck()
+{
+  __ subl(Operand(ExternalAddress(env_->addressOfBudget())), 1);
+  jumpOnError(negative, SP_ERROR_BUDGET);
+}
+
 bool
 Compiler::visitJcmp(CompareOp op, cell_t offset)
 {
+  assert(block_->successors().size() == 2);
+  Block* fallthrough = block_->successors()[0];
+  Block* target = block_->successors()[1];
+
+  assert(!isBackedge(fallthrough));
+
+  bool poll = isBackedge(target) && env_->polls_interrupts();
+  if (poll)
+    emitInterruptCheck();
+
   ConditionCode cc;
   switch (op) {
     case CompareOp::Zero:
@@ -1046,28 +1260,40 @@ Compiler::visitJcmp(CompareOp op, cell_t offset)
       return false;
   }
 
-  assert(block_->successors().size() == 2);
-  Block* fallthrough = block_->successors()[0];
-  Block* target = block_->successors()[1];
+  if (isBackedge(target) && env_->has_budgets()) {
+    // Only a taken back-edge spends budget, as in the interpreter.
+    Label not_taken;
+    __ j(InvertConditionCode(cc), &not_taken);
+    emitBudgetCheck();
+    if (poll) {
+      __ jmp(labelFor(target));
+    } else {
+      __ jmp32(labelFor(target));
+      backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
+    }
+    __ bind(&not_taken);
 
-  assert(!isBackedge(fallthrough));
+    if (!isNextBlock(fallthrough))
+      __ jmp(labelFor(fallthrough));
+    return true;
+  }
 
-  if (isBackedge(target)) {
-    __ j32(cc, target->label());
+  if (isBackedge(target) && !poll) {
+    __ j32(cc, labelFor(target));
     backward_jumps_.push_back(BackwardJump(masm.pc(), op_cip_));
 
     if (!isNextBlock(fallthrough))
-      __ jmp(fallthrough->label());
+      __ jmp(labelFor(fallthrough));
     return true;
   }
 
   if (isNextBlock(target)) {
     // Invert the condition so we can fallthrough to the target instead.
-    __ j(InvertConditionCode(cc), fallthrough->label());
+    __ j(InvertConditionCode(cc), labelFor(fallthrough));
   } else {
-    __ j(cc, target->label());
+    __ j(cc, labelFor(target));
     if (!isNextBlock(fallthrough))
-      __ jmp(fallthrough->label());
+      __ jmp(labelFor(fallthrough));
   }
   return true;
 }
@@ -1076,42 +1302,70 @@ Compiler::visitJcmp(CompareOp op, cell_t offset)
 bool
 Compiler::visitTRACKER_PUSH_C(cell_t amount)
 {
-  __ push(pri);
-  __ push(alt);
-
-  __ push(amount);
-  __ push(intptr_t(rt_->GetBaseContext()));
-  __ callWithABI(ExternalAddress((void*)InvokePushTracker));
-  __ addl(esp, 8);
-  __ testl(eax, eax);
-  jumpOnError(not_zero);
+  // The verifier rejects negative amounts. PRI and ALT must be preserved.
+  assert(amount >= 0);
+  __ movl(tmp, Operand(hpAddr()));
+  __ lea(tmp, Operand(dat, tmp, NoScale, HeapMargin()));
+  __ cmpl(tmp, stk);
+  jumpOnError(above, SP_ERROR_TRACKER_BOUNDS);
 
-  __ pop(alt);
-  __ pop(pri);
+  __ movl(tmp, Operand(hpAddr()));
+  __ movl(Operand(dat, tmp, NoScale, 0), amount);
+  __ addl(tmp, sizeof(cell_t));
+  __ movl(Operand(hpAddr()), tmp);
+  emitNoteHeapUse(tmp);
+  emitNoteTrackerPush(tmp);
   return true;
 }
 
+// This is PluginContext::popTrackerAndSetHeap, without the call. PRI and ALT
+// must be preserved, so only tmp is available.
 bool
 Compiler::visitTRACKER_POP_SETHEAP()
 {
-  // Save registers.
-  __ subl(esp, 4);
-  __ push(pri);
-  __ push(alt);
-
-  // Get the context pointer and call the sanity checker.
-  __ push(intptr_t(rt_->GetBaseContext()));
-  __ callWithABI(ExternalAddress((void*)InvokePopTrackerAndSetHeap));
-  __ addl(esp, 4);
-  __ testl(eax, eax);
-  jumpOnError(not_zero);
+  __ movl(tmp, Operand(hpAddr()));
+  __ subl(tmp, sizeof(cell_t));
+  __ cmpl(tmp, context_->DataSize());
+  jumpOnError(less, SP_ERROR_TRACKER_BOUNDS);
+  __ movl(Operand(hpAddr()), tmp);
 
-  __ pop(alt);
-  __ pop(pri);
-  __ addl(esp, 4);
+  // hp -= amount, where amount is the tracker just popped.
+  __ movl(tmp, Operand(dat, tmp, NoScale, 0));
+  __ testl(tmp, tmp);
+  jumpOnError(negative, SP_ERROR_TRACKER_BOUNDS);
+  __ negl(tmp);
+  __ addl(tmp, Operand(hpAddr()));
+  __ cmpl(tmp, context_->DataSize());
+  jumpOnError(less, SP_ERROR_TRACKER_BOUNDS);
+  __ movl(Operand(hpAddr()), tmp);
+  __ subl(Operand(ExternalAddress(context_->addressOfTrackerDepth())), 1);
   return true;
 }
 
+void
+Compiler::emitNoteHeapUse(Register hp)
+{
+  Label below_high_water;
+  __ cmpl(Operand(ExternalAddress(context_->addressOfHpHighWater())), hp);
+  __ j(above_equal, &below_high_water);
+  __ movl(Operand(ExternalAddress(context_->addressOfHpHighWater())), hp);
+  __ bind(&below_high_water);
+}
+
+// Counts a pushed tracker. Clobbers |scratch|.
+void
+Compiler::emitNoteTrackerPush(Register scratch)
+{
+  Label below_high_water;
+  __ movl(scratch, Operand(ExternalAddress(context_->addressOfTrackerDepth())));
+  __ addl(scratch, 1);
+  __ movl(Operand(ExternalAddress(context_->addressOfTrackerDepth())), scratch);
+  __ cmpl(Operand(ExternalAddress(context_->addressOfTrackerHighWater())), scratch);
+  __ j(above_equal, &below_high_water);
+  __ movl(Operand(ExternalAddress(context_->addressOfTrackerHighWater())), scratch);
+  __ bind(&below_high_water);
+}
+
 bool
 Compiler::visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size)
 {
@@ -1139,8 +1393,7 @@ Compiler::visitBREAK()
   if (!Environment::get()->IsDebugBreakEnabled())
     return true;
 
-  __ call(&debug_break_);
-  emitCipMapping(op_cip_);
+  emitDebugBreakSite();
   return true;
 }
 
@@ -1156,6 +1409,9 @@ Compiler::visitHALT(cell_t value)
 bool
 Compiler::visitBOUNDS(uint32_t limit)
 {
+  if (isRedundantBoundsCheck())
+    return true;
+
   OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, limit);
   ool_paths_.push_back(bounds);
 
@@ -1188,6 +1444,9 @@ Compiler::visitGENARRAY(uint32_t dims, bool autozero)
   {
     // flat array; we can generate this without indirection tables.
     // Note that we can overwrite ALT because technically STACK should be destroying ALT
+    uint32_t* array_allocs = reinterpret_cast<uint32_t*>(context_->addressOfArrayAllocs());
+    __ addl(Operand(ExternalAddress(&array_allocs[0])), 1);
+    __ adcl(Operand(ExternalAddress(&array_allocs[1])), 0);
     __ movl(alt, Operand(hpAddr()));
     __ movl(tmp, Operand(stk, 0));
     __ movl(Operand(stk, 0), alt);    // store base of the array into the stack.
@@ -1197,16 +1456,21 @@ Compiler::visitGENARRAY(uint32_t dims, bool autozero)
     __ cmpl(alt, stk);
     jumpOnError(not_below, SP_ERROR_HEAPLOW);
 
+    // Push a tracker for the size in bytes, as pushTracker would; ALT is
+    // free here. pushTracker rejects sizes above INT_MAX.
     __ shll(tmp, 2);
-    __ subl(esp, 8);
-    __ push(tmp);
-    __ push(intptr_t(rt_->GetBaseContext()));
-    __ callWithABI(ExternalAddress((void*)InvokePushTracker));
-    __ movl(tmp, Operand(esp, 4));
-    __ addl(esp, 16);
+    jumpOnError(negative, SP_ERROR_TRACKER_BOUNDS);
+    __ movl(alt, Operand(hpAddr()));
+    __ lea(alt, Operand(dat, alt, NoScale, HeapMargin()));
+    __ cmpl(alt, stk);
+    jumpOnError(above, SP_ERROR_TRACKER_BOUNDS);
+    __ movl(alt, Operand(hpAddr()));
+    __ movl(Operand(dat, alt, NoScale, 0), tmp);
+    __ addl(alt, sizeof(cell_t));
+    __ movl(Operand(hpAddr()), alt);
+    emitNoteHeapUse(alt);
+    emitNoteTrackerPush(alt);
     __ shrl(tmp, 2);
-    __ testl(eax, eax);
-    jumpOnError(not_zero);
 
     if (autozero) {
       // Note - tmp is ecx and still intact.
@@ -1264,7 +1528,12 @@ class CallThunk : public OutOfLinePath
 bool
 Compiler::visitCALL(cell_t offset)
 {
-  RefPtr<MethodInfo> method = rt_->GetMethod(offset);
+  if (tryInlineCall(offset))
+    return true;
+
+  // Off the VM thread, the method table can't be looked at, so every call
+  // goes through a thunk.
+  RefPtr<MethodInfo> method = offThread() ? nullptr : rt_->GetMethod(offset);
   if (!method || !method->jit()) {
     // Need to emit a delayed thunk.
     CallThunk* thunk = new CallThunk(offset);
@@ -1280,20 +1549,34 @@ Compiler::visitCALL(cell_t offset)
   return true;
 }
 
+void
+Compiler::emitInlineReturn()
+{
+  // Remove parameters.
+  __ movl(tmp, Operand(stk, 0));
+  __ lea(stk, Operand(stk, tmp, ScaleFour, 4));
+}
+
 void
 Compiler::emitCallThunk(CallThunk* thunk)
 {
   // Get the return address, since that is the call that we need to patch.
   __ movl(eax, Operand(esp, 0));
 
+  // A cold callee runs in the interpreter, which needs the context's view
+  // of the stack.
+  __ movl(tmp, stk);
+  __ subl(tmp, dat);
+  __ movl(Operand(spAddr()), tmp);
+
   // Enter the exit frame. This aligns the stack.
   __ enterExitFrame(ExitFrameType::Helper, 0);
 
-  // We need to push 4 arguments, and one of them will need an extra word
-  // on the stack. Allocate a big block so we're aligned.
+  // We need to push 4 arguments, and one of them needs room for a
+  // CallThunkResult on the stack. Allocate a big block so we're aligned.
   //
   // Note: we add 12 since the push above misaligned the stack.
-  static const size_t kStackNeeded = 5 * sizeof(void*);
+  static const size_t kStackNeeded = 4 * sizeof(void*) + sizeof(CallThunkResult);
   static const size_t kStackReserve = ke::Align(kStackNeeded, 16);
   __ subl(esp, kStackReserve);
 
@@ -1305,13 +1588,28 @@ Compiler::emitCallThunk(CallThunk* thunk)
   __ movl(Operand(esp, 0 * sizeof(void*)), intptr_t(context_));
 
   __ callWithABI(ExternalAddress((void*)CompileFromThunk));
-  __ movl(edx, Operand(esp, 4 * sizeof(void*)));
+  __ movl(edx, Operand(esp, 4 * sizeof(void*) + offsetof(CallThunkResult, target)));
+  __ movl(ecx, Operand(esp, 4 * sizeof(void*) + offsetof(CallThunkResult, result)));
   __ leaveExitFrame();
 
   __ testl(eax, eax);
   jumpOnError(not_zero);
 
+  Label interpreted;
+  __ testl(edx, edx);
+  __ j(zero, &interpreted);
   __ jmp(edx);
+
+  // The interpreter has popped the callee's frame and arguments, so this
+  // returns straight to the call site.
+  __ bind(&interpreted);
+  ExternalAddress exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(Operand(exn_code), 0);
+  __ j(not_zero, &return_reported_error_);
+  __ movl(stk, Operand(spAddr()));
+  __ addl(stk, dat);
+  __ movl(pri, ecx);
+  __ ret();
 }
 
 bool
@@ -1334,37 +1632,135 @@ Compiler::visitSYSREQ_C(uint32_t native_index)
   return true;
 }
 
-static cell_t NativeInvokeThunk(NativeEntry* native, IPluginContext* ctx, const cell_t* params)
+// Where a native call made by emitLegacyNativeCall resumes if the native left
+// an exception pending; see UnwindEntry. The direct and generic paths keep
+// different stacks, so each has its own.
+class NativeLandingPad : public OutOfLinePath
 {
-  if (native->legacy_fn)
-    return native->legacy_fn(ctx, params);
-  return native->callback->Invoke(ctx, params);
-} 
+ public:
+  NativeLandingPad(bool generic, bool save_hp)
+   : generic(generic),
+     save_hp(save_hp)
+  {}
+
+  bool emit(Compiler* cc) override {
+    cc->emitNativeLandingPad(this);
+    return true;
+  }
+
+  Label* resume() {
+    return &resume_;
+  }
+
+  bool generic;
+  bool save_hp;
+
+ private:
+  Label resume_;
+};
+
+// The native's return address, in words below the inline exit frame: the
+// frame's two words, then the words each path pushes.
+static const uint32_t kDirectNativeReturnSlot = 2 + 4 + 1;
+static const uint32_t kGenericNativeReturnSlot = 2 + 8 + 1;
 
 void
 Compiler::emitLegacyNativeCall(uint32_t native_index, NativeEntry* native)
 {
+  // A native bound with a plain function pointer can be called directly. If
+  // the host is allowed to rebind it, the direct call is guarded by the
+  // runtime's bind epoch and we keep the generic path as a fallback. Off
+  // the VM thread, the binding may be changing under us, so it is ignored.
+  // While the sampling profiler is on, every call goes through the thunk so
+  // it can take samples, and while native hooks are on, direct sites jump to
+  // the thunk so it can trace or record them.
+  bool bound = !offThread() && native->status == SP_NATIVE_BOUND;
+  bool immutable = bound && !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL));
+  bool direct = bound && native->legacy_fn && !Environment::get()->IsSamplingEnabled();
+  bool guarded = direct && !immutable;
+
+  // Natives that never re-enter the VM can't leave the heap pointer changed,
+  // so there is no need to save and restore it.
+  bool save_hp = !(immutable && (native->flags & SP_NTVFLAG_NOREENTRY));
+
+  __ addl(Operand(ExternalAddress(Environment::get()->addressOfNativeCalls())), 1);
+
   CodeLabel return_address;
   __ pushInlineExitFrame(ExitFrameType::Native, native_index, &return_address);
 
+  bool unwind = env_->table_unwinding();
+  NativeLandingPad* direct_pad = nullptr;
+  NativeLandingPad* generic_pad = nullptr;
+
+  Label generic, done;
+  if (guarded) {
+    __ cmpl(Operand(ExternalAddress(rt_->addressOfNativeEpoch())), int32_t(rt_->native_epoch()));
+    __ j(not_equal, &generic);
+  }
+
+  if (direct) {
+    __ cmpl(Operand(ExternalAddress(env_->addressOfNativeHooks())), 0);
+    __ j(not_equal, &generic);
+
+    // Save registers.
+    __ push(edx);
+
+    // Save the old heap pointer.
+    if (save_hp)
+      __ push(Operand(hpAddr()));
+    else
+      __ subl(esp, 4);
+
+    // Push the last parameter for the C++ function.
+    __ push(stk);
+
+    // Relocate our absolute stk to be dat-relative, and update the context's
+    // view.
+    __ subl(stk, dat);
+    __ movl(Operand(spAddr()), stk);
+
+    // Push the first parameter, the context.
+    __ push(intptr_t(rt_->GetBaseContext()));
+
+    // Fast invoke, skip right to the function call.
+    //
+    // Stack (16 bytes):
+    //   12: Saved EDX
+    //    8: Saved HP, or padding
+    //    4: Cells
+    //    0: Context
+    __ callWithABI(ExternalAddress((void*)native->legacy_fn));
+    __ bind(&return_address);
+    // Map the return address to the cip that initiated this call.
+    emitCipMapping(op_cip_);
+
+    if (unwind) {
+      direct_pad = new NativeLandingPad(false, save_hp);
+      ool_paths_.push_back(direct_pad);
+      addUnwindEntry(return_address.offset(), return_address.offset(), kDirectNativeReturnSlot,
+                     direct_pad->label());
+    }
+
+    emitNativeCallReturn(false, save_hp);
+
+    __ jmp(&done);
+  }
+
+  __ bind(&generic);
+
   // Save registers.
   __ push(edx);
 
   // Check whether the native is bound.
-  bool immutable = native->status == SP_NATIVE_BOUND &&
-                   !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL));
   if (!immutable) {
     __ movl(edx, Operand(ExternalAddress(&native->status)));
     __ cmpl(edx, SP_NATIVE_BOUND);
     __ j(not_equal, &unbound_native_error_);
   }
 
-  bool fast_path = immutable && native->legacy_fn;
-
-  // If we're going to take the slow path, the stack has an extra word, so we
-  // need to align it here.
-  if (!fast_path)
-    __ subl(esp, 12);
+  // The stack has an extra word for the wrapper's argument, so we need to
+  // align it here.
+  __ subl(esp, 12);
 
   // Save the old heap pointer.
   __ push(Operand(hpAddr()));
@@ -1380,51 +1776,82 @@ Compiler::emitLegacyNativeCall(uint32_t native_index, NativeEntry* native)
   // Push the first parameter, the context.
   __ push(intptr_t(rt_->GetBaseContext()));
 
-  if (fast_path) {
-    // Fast invoke, skip right to the function call.
-    //
-    // Stack (16 bytes):
-    //   12: Saved EDX
-    //    8: Saved HP
-    //    4: Cells
-    //    0: Context
-    __ callWithABI(ExternalAddress((void*)native->legacy_fn));
-  } else {
-    // Slower invoke, go through a wrapper so we don't have to make this super
-    // complicated handling all the different calling conventions.
-    //
-    // Stack (32 bytes):
-    //   28: Saved EDX
-    //   24: Alignment (3 words)
-    //   12: Saved HP
-    //    8: Cells
-    //    4: Context
-    //    0: Native
-    __ push(reinterpret_cast<intptr_t>(native));
-    __ callWithABI(ExternalAddress((void*)NativeInvokeThunk));
-  }
-  __ bind(&return_address);
+  // Slower invoke, go through a wrapper so we don't have to make this super
+  // complicated handling all the different calling conventions.
+  //
+  // Stack (32 bytes):
+  //   28: Saved EDX
+  //   16: Alignment (3 words)
+  //   12: Saved HP
+  //    8: Cells
+  //    4: Context
+  //    0: Native
+  __ push(reinterpret_cast<intptr_t>(native));
+  __ callWithABI(ExternalAddress((void*)NativeInvokeThunk));
+  uint32_t generic_return = masm.pc();
+  if (!direct)
+    __ bind(&return_address);
   // Map the return address to the cip that initiated this call.
   emitCipMapping(op_cip_);
 
+  if (unwind) {
+    generic_pad = new NativeLandingPad(true, true);
+    ool_paths_.push_back(generic_pad);
+    addUnwindEntry(return_address.offset(), generic_return, kGenericNativeReturnSlot,
+                   generic_pad->label());
+  }
+
+  emitNativeCallReturn(true, true);
+  __ bind(&done);
+
+  if (unwind) {
+    if (direct_pad)
+      __ bind(direct_pad->resume());
+    if (generic_pad)
+      __ bind(generic_pad->resume());
+    return;
+  }
+
+  // Check for errors. Note we jump directly to the return stub since the
+  // error has already been reported.
+  ExternalAddress exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(Operand(exn_code), 0);
+  __ j(not_zero, &return_reported_error_);
+}
+
+void
+Compiler::emitNativeCallReturn(bool generic, bool save_hp)
+{
+  // Offsets of the saved HP and EDX.
+  int32_t hp_slot = generic ? 3 : 2;
+  int32_t edx_slot = generic ? 7 : 3;
+
   // Restore the heap pointer.
-  __ movl(edx, Operand(esp, 2 * sizeof(intptr_t)));
-  __ movl(Operand(hpAddr()), edx);
+  if (save_hp) {
+    __ movl(edx, Operand(esp, hp_slot * sizeof(intptr_t)));
+    __ movl(Operand(hpAddr()), edx);
+  }
 
   // Restore ALT.
-  __ movl(edx, Operand(esp, 3 * sizeof(intptr_t)));
+  __ movl(edx, Operand(esp, edx_slot * sizeof(intptr_t)));
 
   // Restore SP.
   __ addl(stk, dat);
 
-  // Remove the inline frame, + our four arguments.
-  __ popInlineExitFrame(4);
+  // Remove the inline frame, + our four or eight words.
+  __ popInlineExitFrame(generic ? 8 : 4);
+}
 
-  // Check for errors. Note we jump directly to the return stub since the
-  // error has already been reported.
+void
+Compiler::emitNativeLandingPad(NativeLandingPad* pad)
+{
+  emitNativeCallReturn(pad->generic, pad->save_hp);
+
+  // The exception may have been caught before the native returned.
   ExternalAddress exn_code(Environment::get()->addressOfExceptionCode());
   __ cmpl(Operand(exn_code), 0);
   __ j(not_zero, &return_reported_error_);
+  __ jmp(pad->resume());
 }
 
 bool
@@ -1452,23 +1879,27 @@ Compiler::visitSWITCH(cell_t defaultOffset,
     return true;
   }
 
-  // We have two or more cases, so let's generate a full switch. Decide
-  // whether we'll make an if chain, or a jump table, based on whether
-  // the numbers are strictly sequential.
-  bool sequential = true;
-  {
-    cell_t first = cases[0].value;
-    cell_t last = first;
-    for (size_t i = 1; i < ncases; i++) {
-      if (cases[i].value != ++last) {
-        sequential = false;
-        break;
-      }
+  // We have two or more cases, so let's generate a full switch. The compiler
+  // emits sorted tables; those get a jump table when the cases fill at least
+  // half of their range (gaps go to the default case), and a binary search
+  // otherwise. Anything else falls back to an if chain.
+  bool sorted = true;
+  for (size_t i = 1; i < ncases; i++) {
+    if (cases[i].value <= cases[i - 1].value) {
+      sorted = false;
+      break;
     }
   }
+  if (!sorted) {
+    emitCaseChain(cases, 0, ncases, defaultCase);
+    return true;
+  }
+
+  int64_t range = int64_t(cases[ncases - 1].value) - int64_t(cases[0].value) + 1;
+  bool dense = range <= int64_t(ncases) * 2;
 
   // First check whether the bounds are correct: if (a < LOW || a > HIGH);
-  // this check is valid whether or not we emit a sequential-optimized switch.
+  // this check is valid whether or not we emit a jump table.
   cell_t low = cases[0].value;
   if (low != 0) {
     // negate it so we'll get a lower bound of 0.
@@ -1478,11 +1909,10 @@ Compiler::visitSWITCH(cell_t defaultOffset,
     __ movl(tmp, pri);
   }
 
-  cell_t high = abs(cases[0].value - cases[ncases - 1].value);
-  __ cmpl(tmp, high);
+  __ cmpl(tmp, int32_t(range - 1));
   __ j(above, defaultCase->label());
 
-  if (sequential) {
+  if (dense) {
     // Optimized table version. The tomfoolery below is because we only have
     // one free register... it seems unlikely pri or alt will be used given
     // that we're at the end of a control-flow point, but we'll play it safe.
@@ -1494,22 +1924,52 @@ Compiler::visitSWITCH(cell_t defaultOffset,
     __ jmp(ecx);
 
     __ bind(&table);
-    for (size_t i = 0; i < ncases; i++) {
-      Block* target = block_->successors()[i + 1];
+    size_t next = 0;
+    for (int64_t value = cases[0].value; value <= cases[ncases - 1].value; value++) {
+      Block* target = defaultCase;
+      if (cases[next].value == value)
+        target = block_->successors()[++next];
       __ emit_absolute_address(target->label());
     }
   } else {
-    // Slower version. Go through each case and generate a check.
-    for (size_t i = 0; i < ncases; i++) {
-      Block* target = block_->successors()[i + 1];
-      __ cmpl(pri, cases[i].value);
-      __ j(equal, target->label());
-    }
-    __ jmp(defaultCase->label());
+    emitCaseTree(cases, 0, ncases, defaultCase);
   }
   return true;
 }
 
+// Compares against cases [begin, end) in order.
+void
+Compiler::emitCaseChain(const CaseTableEntry* cases, size_t begin, size_t end,
+                        Block* defaultCase)
+{
+  for (size_t i = begin; i < end; i++) {
+    Block* target = block_->successors()[i + 1];
+    __ cmpl(pri, cases[i].value);
+    __ j(equal, target->label());
+  }
+  __ jmp(defaultCase->label());
+}
+
+// Binary search over the sorted cases [begin, end), ending in short chains.
+void
+Compiler::emitCaseTree(const CaseTableEntry* cases, size_t begin, size_t end,
+                       Block* defaultCase)
+{
+  if (end - begin <= 4) {
+    emitCaseChain(cases, begin, end, defaultCase);
+    return;
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  Label upper;
+  __ cmpl(pri, cases[mid].value);
+  __ j(equal, block_->successors()[mid + 1]->label());
+  __ j(greater, &upper);
+  emitCaseTree(cases, begin, mid, defaultCase);
+  __ bind(&upper);
+  emitCaseTree(cases, mid + 1, end, defaultCase);
+}
+
 void
 Compiler::emitFloatCmp(ConditionCode cc)
 {
@@ -1564,10 +2024,7 @@ void
 Compiler::jumpOnError(ConditionCode cc, int err)
 {
   // Note: we accept 0 for err. In this case we expect the error to be in eax.
-  ErrorPath* path = new ErrorPath(op_cip_, err);
-  ool_paths_.push_back(path);
-
-  __ j(cc, path->label());
+  __ j(cc, errorPathFor(err)->label());
 }
 
 void
@@ -1692,7 +2149,7 @@ Compiler::emitDebugBreakHandler()
 void
 CompilerBase::PatchCallThunk(uint8_t* pc, void* target)
 {
-  *(intptr_t*)(pc - 4) = intptr_t(target) - intptr_t(pc);
+  *(intptr_t*)WritableCodeAddress(pc - 4) = intptr_t(target) - intptr_t(pc);
 }
 
 } // namespace sp
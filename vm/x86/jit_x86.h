@@ -34,11 +34,13 @@ class LegacyImage;
 class Environment;
 class CompiledFunction;
 class CallThunk;
+class NativeLandingPad;
 
 class Compiler : public CompilerBase
 {
   friend class CallThunk;
   friend class OutOfBoundsErrorPath;
+  friend class NativeLandingPad;
 
  public:
   Compiler(PluginRuntime* rt, MethodInfo* method);
@@ -136,6 +138,8 @@ class Compiler : public CompilerBase
     const CaseTableEntry* cases,
     size_t ncases) override;
   bool visitREBASE(cell_t addr, cell_t iv_size, cell_t data_size) override;
+  bool visitLIDX_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override;
+  bool visitIDXADDR_S_BOUNDS(cell_t array, cell_t index, uint32_t limit) override;
 
  private:
   bool setup(cell_t pcode_offs);
@@ -146,12 +150,26 @@ class Compiler : public CompilerBase
   void emitErrorHandlers() override;
   void emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path) override;
   void emitDebugBreakHandler() override;
+  void emitOsrEntry(Block* header) override;
+  void emitInlineReturn() override;
 
   void emitLegacyNativeCall(uint32_t native_index, NativeEntry* native);
   void emitGenArray(bool autozero);
   void emitCheckAddress(Register reg);
+  void emitCheckStack();
   void emitFloatCmp(ConditionCode cc);
   void emitCallThunk(CallThunk* thunk);
+  void emitInterruptCheck();
+  void emitBudgetCheck();
+  void emitNativeCallReturn(bool generic, bool save_hp);
+  void emitNativeLandingPad(NativeLandingPad* pad);
+  void emitNoteHeapUse(Register hp);
+  bool emitConstantDivide(Register dividend, int32_t divisor);
+  void emitNoteTrackerPush(Register scratch);
+  void emitCaseChain(const CaseTableEntry* cases, size_t begin, size_t end,
+                     Block* defaultCase);
+  void emitCaseTree(const CaseTableEntry* cases, size_t begin, size_t end,
+                    Block* defaultCase);
   void jumpOnError(ConditionCode cc, int err = 0);
 
   ExternalAddress hpAddr() {